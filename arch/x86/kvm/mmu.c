@@ -830,6 +830,12 @@ static int kvm_unmap_rmapp(struct kvm *kvm, unsigned long *rmapp,
 	return need_tlb_flush;
 }
 
+/*
+ * The host pte of a gfn changed under us, as when KSM write protects or
+ * merges a page: fix up the sptes in place rather than zap them, so that
+ * the guest neither refaults nor rebuilds its shadow pages on next access.
+ * Returns whether the remote TLBs need a flush, left to the caller.
+ */
 static int kvm_set_pte_rmapp(struct kvm *kvm, unsigned long *rmapp,
 			     unsigned long data)
 {
@@ -844,11 +850,26 @@ static int kvm_set_pte_rmapp(struct kvm *kvm, unsigned long *rmapp,
 	while (spte) {
 		BUG_ON(!is_shadow_present_pte(*spte));
 		rmap_printk("kvm_set_pte_rmapp: spte %p %llx\n", spte, *spte);
-		need_flush = 1;
-		if (pte_write(*ptep)) {
+		if (pte_write(*ptep) && spte_to_pfn(*spte) == new_pfn) {
+			/*
+			 * Same page, only cleaned: write protect the spte so
+			 * that a guest write refaults and dirties the pte.
+			 */
+			if (is_writable_pte(*spte)) {
+				update_spte(spte, *spte & ~PT_WRITABLE_MASK);
+				need_flush = 1;
+			}
+			spte = rmap_next(kvm, rmapp, spte);
+		} else if (pte_write(*ptep)) {
 			drop_spte(kvm, spte, shadow_trap_nonpresent_pte);
+			need_flush = 1;
 			spte = rmap_next(kvm, rmapp, NULL);
+		} else if (spte_to_pfn(*spte) == new_pfn &&
+			   !(*spte & (PT_WRITABLE_MASK | SPTE_HOST_WRITEABLE))) {
+			/* nothing to change, nor to flush */
+			spte = rmap_next(kvm, rmapp, spte);
 		} else {
+			need_flush = 1;
 			new_spte = *spte &~ (PT64_BASE_ADDR_MASK);
 			new_spte |= (u64)new_pfn << PAGE_SHIFT;
 
@@ -859,19 +880,39 @@ static int kvm_set_pte_rmapp(struct kvm *kvm, unsigned long *rmapp,
 			spte = rmap_next(kvm, rmapp, spte);
 		}
 	}
-	if (need_flush)
-		kvm_flush_remote_tlbs(kvm);
 
-	return 0;
+	return need_flush;
+}
+
+typedef int (*rmap_handler_t)(struct kvm *kvm, unsigned long *rmapp,
+			      unsigned long data);
+
+/* run @handler on the rmaps of @hva, which @memslot maps */
+static int kvm_handle_hva_slot(struct kvm *kvm,
+			       struct kvm_memory_slot *memslot,
+			       unsigned long hva, unsigned long data,
+			       rmap_handler_t handler)
+{
+	gfn_t gfn_offset = (hva - memslot->userspace_addr) >> PAGE_SHIFT;
+	gfn_t gfn = memslot->base_gfn + gfn_offset;
+	int j, ret;
+
+	ret = handler(kvm, &memslot->rmap[gfn_offset], data);
+
+	for (j = 0; j < KVM_NR_PAGE_SIZES - 1; ++j) {
+		struct kvm_lpage_info *linfo;
+
+		linfo = lpage_info_slot(gfn, memslot, PT_DIRECTORY_LEVEL + j);
+		ret |= handler(kvm, &linfo->rmap_pde, data);
+	}
+	trace_kvm_age_page(hva, memslot, ret);
+	return ret;
 }
 
 static int kvm_handle_hva(struct kvm *kvm, unsigned long hva,
-			  unsigned long data,
-			  int (*handler)(struct kvm *kvm, unsigned long *rmapp,
-					 unsigned long data))
+			  unsigned long data, rmap_handler_t handler)
 {
-	int i, j;
-	int ret;
+	int i;
 	int retval = 0;
 	struct kvm_memslots *slots;
 
@@ -883,21 +924,42 @@ static int kvm_handle_hva(struct kvm *kvm, unsigned long hva,
 		unsigned long end;
 
 		end = start + (memslot->npages << PAGE_SHIFT);
-		if (hva >= start && hva < end) {
-			gfn_t gfn_offset = (hva - start) >> PAGE_SHIFT;
-			gfn_t gfn = memslot->base_gfn + gfn_offset;
+		if (hva >= start && hva < end)
+			retval |= kvm_handle_hva_slot(kvm, memslot, hva, data,
+						      handler);
+	}
 
-			ret = handler(kvm, &memslot->rmap[gfn_offset], data);
+	return retval;
+}
+
+/*
+ * kvm_handle_hva() for all the pages of [start, end), setting the bit of
+ * each page the handler returned non zero for in @bitmap.
+ */
+static int kvm_handle_hva_range(struct kvm *kvm, unsigned long start,
+				unsigned long end, unsigned long data,
+				unsigned long *bitmap, rmap_handler_t handler)
+{
+	int i;
+	int retval = 0;
+	struct kvm_memslots *slots;
+	unsigned long hva;
 
-			for (j = 0; j < KVM_NR_PAGE_SIZES - 1; ++j) {
-				struct kvm_lpage_info *linfo;
+	slots = kvm_memslots(kvm);
 
-				linfo = lpage_info_slot(gfn, memslot,
-							PT_DIRECTORY_LEVEL + j);
-				ret |= handler(kvm, &linfo->rmap_pde, data);
-			}
-			trace_kvm_age_page(hva, memslot, ret);
-			retval |= ret;
+	for (i = 0; i < slots->nmemslots; i++) {
+		struct kvm_memory_slot *memslot = &slots->memslots[i];
+		unsigned long slot_start = memslot->userspace_addr;
+		unsigned long slot_end;
+
+		slot_end = slot_start + (memslot->npages << PAGE_SHIFT);
+		for (hva = max(start, slot_start); hva < min(end, slot_end);
+		     hva += PAGE_SIZE) {
+			if (!kvm_handle_hva_slot(kvm, memslot, hva, data,
+						 handler))
+				continue;
+			__set_bit((hva - start) >> PAGE_SHIFT, bitmap);
+			retval = 1;
 		}
 	}
 
@@ -909,9 +971,9 @@ int kvm_unmap_hva(struct kvm *kvm, unsigned long hva)
 	return kvm_handle_hva(kvm, hva, 0, kvm_unmap_rmapp);
 }
 
-void kvm_set_spte_hva(struct kvm *kvm, unsigned long hva, pte_t pte)
+int kvm_set_spte_hva(struct kvm *kvm, unsigned long hva, pte_t pte)
 {
-	kvm_handle_hva(kvm, hva, (unsigned long)&pte, kvm_set_pte_rmapp);
+	return kvm_handle_hva(kvm, hva, (unsigned long)&pte, kvm_set_pte_rmapp);
 }
 
 static int kvm_age_rmapp(struct kvm *kvm, unsigned long *rmapp,
@@ -994,6 +1056,12 @@ int kvm_age_hva(struct kvm *kvm, unsigned long hva)
 	return kvm_handle_hva(kvm, hva, 0, kvm_age_rmapp);
 }
 
+int kvm_age_hva_range(struct kvm *kvm, unsigned long start,
+		      unsigned long end, unsigned long *young)
+{
+	return kvm_handle_hva_range(kvm, start, end, 0, young, kvm_age_rmapp);
+}
+
 int kvm_test_age_hva(struct kvm *kvm, unsigned long hva)
 {
 	return kvm_handle_hva(kvm, hva, 0, kvm_test_age_rmapp);
@@ -1044,6 +1112,18 @@ static unsigned kvm_page_table_hashfn(gfn_t gfn)
 	return gfn & ((1 << KVM_MMU_HASH_SHIFT) - 1);
 }
 
+/*
+ * active_mmu_pages is kept in LRU order, the shadow pages of recent faults
+ * and lookups at its head, so that both kvm_mmu_change_mmu_pages() and the
+ * shrinker evict the least recently used ones.
+ */
+static void kvm_mmu_page_used(struct kvm *kvm, struct kvm_mmu_page *sp)
+{
+	sp->last_used = jiffies;
+	if (!sp->role.invalid)
+		list_move(&sp->link, &kvm->arch.active_mmu_pages);
+}
+
 static struct kvm_mmu_page *kvm_mmu_alloc_page(struct kvm_vcpu *vcpu,
 					       u64 *parent_pte, int direct)
 {
@@ -1056,6 +1136,7 @@ static struct kvm_mmu_page *kvm_mmu_alloc_page(struct kvm_vcpu *vcpu,
 						  PAGE_SIZE);
 	set_page_private(virt_to_page(sp->spt), (unsigned long)sp);
 	list_add(&sp->link, &vcpu->kvm->arch.active_mmu_pages);
+	sp->last_used = jiffies;
 	bitmap_zero(sp->slot_bitmap, KVM_MEMORY_SLOTS + KVM_PRIVATE_MEM_SLOTS);
 	sp->multimapped = 0;
 	sp->parent_pte = parent_pte;
@@ -1506,6 +1587,7 @@ static struct kvm_mmu_page *kvm_mmu_get_page(struct kvm_vcpu *vcpu,
 		} else if (sp->unsync)
 			kvm_mmu_mark_parents_unsync(sp);
 
+		kvm_mmu_page_used(vcpu->kvm, sp);
 		trace_kvm_mmu_get_page(sp, false);
 		return sp;
 	}
@@ -2094,6 +2176,9 @@ static void mmu_set_spte(struct kvm_vcpu *vcpu, u64 *sptep,
 		 __func__, *sptep, pt_access,
 		 write_fault, user_fault, gfn);
 
+	if (!speculative)
+		kvm_mmu_page_used(vcpu->kvm, page_header(__pa(sptep)));
+
 	if (is_rmap_spte(*sptep)) {
 		/*
 		 * If we overwrite a PTE page pointer with a 2MB PMD, unlink
@@ -3527,6 +3612,22 @@ int kvm_mmu_setup(struct kvm_vcpu *vcpu)
 	return init_kvm_mmu(vcpu);
 }
 
+/*
+ * Write protect the sptes of the pages whose bits are set in @mask, bit 0
+ * for @gfn, for them to be logged dirty again on their next write.
+ *
+ * @return whether any spte was write protected, whose TLBs need a flush
+ */
+int kvm_mmu_write_protect_masked(struct kvm *kvm, gfn_t gfn,
+				 unsigned long mask)
+{
+	int i, flush = 0;
+
+	for_each_set_bit(i, &mask, BITS_PER_LONG)
+		flush |= rmap_write_protect(kvm, gfn + i);
+	return flush;
+}
+
 void kvm_mmu_slot_remove_write_access(struct kvm *kvm, int slot)
 {
 	struct kvm_mmu_page *sp;
@@ -3565,46 +3666,88 @@ restart:
 	spin_unlock(&kvm->mmu_lock);
 }
 
-static int kvm_mmu_remove_some_alloc_mmu_pages(struct kvm *kvm,
-					       struct list_head *invalid_list)
+static struct kvm_mmu_page *kvm_mmu_lru_page(struct kvm *kvm)
 {
-	struct kvm_mmu_page *page;
-
-	page = container_of(kvm->arch.active_mmu_pages.prev,
+	return container_of(kvm->arch.active_mmu_pages.prev,
 			    struct kvm_mmu_page, link);
-	return kvm_mmu_prepare_zap_page(kvm, page, invalid_list);
 }
 
+/*
+ * Zap up to @nr of the least recently used shadow pages of @kvm, stopping
+ * after the first at those used after @until if @limit.
+ */
+static int kvm_mmu_shrink_vm(struct kvm *kvm, int nr, int limit,
+			     unsigned long until)
+{
+	struct kvm_mmu_page *sp;
+	LIST_HEAD(invalid_list);
+	int idx, done = 0;
+
+	idx = srcu_read_lock(&kvm->srcu);
+	spin_lock(&kvm->mmu_lock);
+	while (done < nr && !list_empty(&kvm->arch.active_mmu_pages)) {
+		sp = kvm_mmu_lru_page(kvm);
+		if (done && limit && time_after(sp->last_used, until))
+			break;
+		kvm_mmu_prepare_zap_page(kvm, sp, &invalid_list);
+		done++;
+	}
+	kvm_mmu_commit_zap_page(kvm, &invalid_list);
+	spin_unlock(&kvm->mmu_lock);
+	srcu_read_unlock(&kvm->srcu, idx);
+
+	return done;
+}
+
+/*
+ * Evict the least recently used shadow pages of all the vms in one global
+ * age order: each step zaps from the vm with the oldest page until its
+ * pages get younger than the oldest of the runner up, so that idle guests
+ * lose their shadow pages before the busy ones.
+ */
 static int mmu_shrink(struct shrinker *shrink, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct kvm *kvm;
-	struct kvm *kvm_freed = NULL;
+	struct kvm *kvm, *victim;
+	unsigned long oldest = 0, next = 0, used;
+	int has_next, done;
 
 	if (nr_to_scan == 0)
 		goto out;
 
 	spin_lock(&kvm_lock);
 
-	list_for_each_entry(kvm, &vm_list, vm_list) {
-		int idx, freed_pages;
-		LIST_HEAD(invalid_list);
-
-		idx = srcu_read_lock(&kvm->srcu);
-		spin_lock(&kvm->mmu_lock);
-		if (!kvm_freed && nr_to_scan > 0 &&
-		    kvm->arch.n_used_mmu_pages > 0) {
-			freed_pages = kvm_mmu_remove_some_alloc_mmu_pages(kvm,
-							  &invalid_list);
-			kvm_freed = kvm;
+	while (nr_to_scan > 0) {
+		victim = NULL;
+		has_next = 0;
+		list_for_each_entry(kvm, &vm_list, vm_list) {
+			spin_lock(&kvm->mmu_lock);
+			if (list_empty(&kvm->arch.active_mmu_pages)) {
+				spin_unlock(&kvm->mmu_lock);
+				continue;
+			}
+			used = kvm_mmu_lru_page(kvm)->last_used;
+			spin_unlock(&kvm->mmu_lock);
+
+			if (!victim || time_before(used, oldest)) {
+				if (victim) {
+					next = oldest;
+					has_next = 1;
+				}
+				victim = kvm;
+				oldest = used;
+			} else if (!has_next || time_before(used, next)) {
+				next = used;
+				has_next = 1;
+			}
 		}
-		nr_to_scan--;
+		if (!victim)
+			break;
 
-		kvm_mmu_commit_zap_page(kvm, &invalid_list);
-		spin_unlock(&kvm->mmu_lock);
-		srcu_read_unlock(&kvm->srcu, idx);
+		done = kvm_mmu_shrink_vm(victim, nr_to_scan, has_next, next);
+		if (!done)
+			break;
+		nr_to_scan -= done;
 	}
-	if (kvm_freed)
-		list_move_tail(&kvm_freed->vm_list, &vm_list);
 
 	spin_unlock(&kvm_lock);
 
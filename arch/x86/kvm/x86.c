@@ -44,6 +44,7 @@
 #include <linux/perf_event.h>
 #include <linux/uaccess.h>
 #include <linux/hash.h>
+#include <linux/ksm.h>
 #include <trace/events/kvm.h>
 
 #define CREATE_TRACE_POINTS
@@ -1966,6 +1967,7 @@ int kvm_dev_ioctl_check_extension(long ext)
 	case KVM_CAP_X86_ROBUST_SINGLESTEP:
 	case KVM_CAP_XSAVE:
 	case KVM_CAP_ASYNC_PF:
+	case KVM_CAP_DIRTY_LOG_RANGE:
 		r = 1;
 		break;
 	case KVM_CAP_COALESCED_MMIO:
@@ -3245,6 +3247,11 @@ int kvm_vm_ioctl_get_dirty_log(struct kvm *kvm,
 		kvm_mmu_slot_remove_write_access(kvm, log->slot);
 		spin_unlock(&kvm->mmu_lock);
 
+		/* let ksmd leave alone what the guest keeps writing */
+		memslot = &slots->memslots[log->slot];
+		ksm_dirty_log_hint(kvm->mm, memslot->userspace_addr,
+				   dirty_bitmap, memslot->npages);
+
 		r = -EFAULT;
 		if (copy_to_user(log->dirty_bitmap, dirty_bitmap, n))
 			goto out;
@@ -3260,6 +3267,82 @@ out:
 	return r;
 }
 
+/* bitmap longs harvested per hold of mmu_lock */
+#define KVM_DIRTY_LOG_CHUNK	32
+
+/*
+ * Get and clear the dirty log of a range of a memory slot. Unlike the
+ * above, which switches the whole bitmap under slots_lock, the bits are
+ * taken a word at a time with xchg and only the pages found dirty are
+ * write protected, under srcu: several threads can harvest parts of a
+ * large slot in parallel, and a vcpu faulting meanwhile waits for one
+ * chunk at most. A write between the xchg and the write protect is not
+ * lost, userspace copies the page after it got its dirty bit.
+ */
+static int kvm_vm_ioctl_get_dirty_log_range(struct kvm *kvm,
+					    struct kvm_dirty_log_range *log)
+{
+	unsigned long mask[KVM_DIRTY_LOG_CHUNK];
+	struct kvm_memory_slot *memslot;
+	unsigned long __user *dst;
+	unsigned long first, nr, i, j, n, any;
+	int r, idx, flush;
+
+	if (log->slot >= KVM_MEMORY_SLOTS || log->first_page % BITS_PER_LONG)
+		return -EINVAL;
+
+	idx = srcu_read_lock(&kvm->srcu);
+	memslot = &kvm_memslots(kvm)->memslots[log->slot];
+	r = -ENOENT;
+	if (!memslot->dirty_bitmap)
+		goto out;
+
+	/* a partial last word would take the bits of the next range */
+	r = -EINVAL;
+	if (log->first_page > memslot->npages ||
+	    log->num_pages > memslot->npages - log->first_page ||
+	    (log->num_pages % BITS_PER_LONG &&
+	     log->first_page + log->num_pages != memslot->npages))
+		goto out;
+
+	first = log->first_page / BITS_PER_LONG;
+	nr = BITS_TO_LONGS(log->num_pages);
+	dst = (unsigned long __user *)(unsigned long)log->dirty_bitmap;
+
+	for (i = 0; i < nr; i += n) {
+		n = min_t(unsigned long, nr - i, KVM_DIRTY_LOG_CHUNK);
+		any = 0;
+		flush = 0;
+
+		spin_lock(&kvm->mmu_lock);
+		for (j = 0; j < n; j++) {
+			mask[j] = xchg(&memslot->dirty_bitmap[first + i + j], 0);
+			if (!mask[j])
+				continue;
+			any = 1;
+			flush |= kvm_mmu_write_protect_masked(kvm,
+				memslot->base_gfn +
+				(first + i + j) * BITS_PER_LONG, mask[j]);
+		}
+		if (flush)
+			kvm_flush_remote_tlbs(kvm);
+		spin_unlock(&kvm->mmu_lock);
+
+		if (any)
+			ksm_dirty_log_hint(kvm->mm, memslot->userspace_addr +
+				((first + i) * BITS_PER_LONG << PAGE_SHIFT),
+				mask, n * BITS_PER_LONG);
+
+		r = -EFAULT;
+		if (copy_to_user(dst + i, mask, n * sizeof(long)))
+			goto out;
+	}
+	r = 0;
+out:
+	srcu_read_unlock(&kvm->srcu, idx);
+	return r;
+}
+
 long kvm_arch_vm_ioctl(struct file *filp,
 		       unsigned int ioctl, unsigned long arg)
 {
@@ -3299,6 +3382,15 @@ long kvm_arch_vm_ioctl(struct file *filp,
 		if (r)
 			goto out;
 		break;
+	case KVM_GET_DIRTY_LOG_RANGE: {
+		struct kvm_dirty_log_range log;
+
+		r = -EFAULT;
+		if (copy_from_user(&log, argp, sizeof log))
+			goto out;
+		r = kvm_vm_ioctl_get_dirty_log_range(kvm, &log);
+		break;
+	}
 	case KVM_GET_NR_MMU_PAGES:
 		r = kvm_vm_ioctl_get_nr_mmu_pages(kvm);
 		break;
@@ -177,7 +177,8 @@ static inline void blkio_update_group_iops(struct blkio_group *blkg,
 
 /*
  * Add to the appropriate stat variable depending on the request type.
- * This should be called with the blkg->stats_lock held.
+ * This should be called with the blkg->stats_lock held, or on per cpu
+ * stats from blkio_stats_cpu_begin().
  */
 static void blkio_add_stat(uint64_t *stat, uint64_t add, bool direction,
 				bool sync)
@@ -215,6 +216,79 @@ static void blkio_check_and_dec_stat(uint64_t *stat, bool direction, bool sync)
 	}
 }
 
+/*
+ * The per cpu stats of @blkg for the current cpu, with interrupts off so
+ * completions cannot race with dispatches on the same cpu. Returns NULL,
+ * with stats_lock held instead, when the group has no per cpu stats.
+ */
+static struct blkio_group_stats_cpu *
+blkio_stats_cpu_begin(struct blkio_group *blkg, unsigned long *flags)
+{
+	struct blkio_group_stats_cpu *stats_cpu;
+
+	if (unlikely(!blkg->stats_cpu)) {
+		spin_lock_irqsave(&blkg->stats_lock, *flags);
+		return NULL;
+	}
+
+	local_irq_save(*flags);
+	stats_cpu = &blkg->stats_cpu[smp_processor_id()];
+	u64_stats_update_begin(&stats_cpu->syncp);
+	return stats_cpu;
+}
+
+static void blkio_stats_cpu_end(struct blkio_group *blkg,
+		struct blkio_group_stats_cpu *stats_cpu, unsigned long flags)
+{
+	if (unlikely(!stats_cpu)) {
+		spin_unlock_irqrestore(&blkg->stats_lock, flags);
+		return;
+	}
+
+	u64_stats_update_end(&stats_cpu->syncp);
+	local_irq_restore(flags);
+}
+
+/* The stat_arr row for @type, per cpu if there is one */
+static uint64_t *blkio_stats_cpu_arr(struct blkio_group *blkg,
+		struct blkio_group_stats_cpu *stats_cpu, enum stat_type type)
+{
+	if (stats_cpu)
+		return stats_cpu->stat_arr_cpu[type];
+	return blkg->stats.stat_arr[type];
+}
+
+/* Sum of the locked and the per cpu parts of a per cpu stat */
+static uint64_t blkio_read_stat_cpu(struct blkio_group *blkg,
+		enum stat_type type, enum stat_sub_type sub_type)
+{
+	struct blkio_group_stats_cpu *stats_cpu;
+	uint64_t val, total;
+	unsigned int start;
+	int cpu;
+
+	if (type == BLKIO_STAT_SECTORS)
+		total = blkg->stats.sectors;
+	else
+		total = blkg->stats.stat_arr[type][sub_type];
+	if (!blkg->stats_cpu)
+		return total;
+
+	for_each_possible_cpu(cpu) {
+		stats_cpu = &blkg->stats_cpu[cpu];
+		do {
+			start = u64_stats_fetch_begin(&stats_cpu->syncp);
+			if (type == BLKIO_STAT_SECTORS)
+				val = stats_cpu->sectors;
+			else
+				val = stats_cpu->stat_arr_cpu[type][sub_type];
+		} while (u64_stats_fetch_retry(&stats_cpu->syncp, start));
+		total += val;
+	}
+
+	return total;
+}
+
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 /* This should be called with the blkg->stats_lock held. */
 static void blkio_set_start_group_wait_time(struct blkio_group *blkg,
@@ -384,48 +458,52 @@ EXPORT_SYMBOL_GPL(blkiocg_update_timeslice_used);
 void blkiocg_update_dispatch_stats(struct blkio_group *blkg,
 				uint64_t bytes, bool direction, bool sync)
 {
-	struct blkio_group_stats *stats;
+	struct blkio_group_stats_cpu *stats_cpu;
 	unsigned long flags;
 
-	spin_lock_irqsave(&blkg->stats_lock, flags);
-	stats = &blkg->stats;
-	stats->sectors += bytes >> 9;
-	blkio_add_stat(stats->stat_arr[BLKIO_STAT_SERVICED], 1, direction,
-			sync);
-	blkio_add_stat(stats->stat_arr[BLKIO_STAT_SERVICE_BYTES], bytes,
-			direction, sync);
-	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+	stats_cpu = blkio_stats_cpu_begin(blkg, &flags);
+	if (stats_cpu)
+		stats_cpu->sectors += bytes >> 9;
+	else
+		blkg->stats.sectors += bytes >> 9;
+	blkio_add_stat(blkio_stats_cpu_arr(blkg, stats_cpu, BLKIO_STAT_SERVICED),
+			1, direction, sync);
+	blkio_add_stat(blkio_stats_cpu_arr(blkg, stats_cpu,
+			BLKIO_STAT_SERVICE_BYTES), bytes, direction, sync);
+	blkio_stats_cpu_end(blkg, stats_cpu, flags);
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_dispatch_stats);
 
 void blkiocg_update_completion_stats(struct blkio_group *blkg,
 	uint64_t start_time, uint64_t io_start_time, bool direction, bool sync)
 {
-	struct blkio_group_stats *stats;
+	struct blkio_group_stats_cpu *stats_cpu;
 	unsigned long flags;
 	unsigned long long now = sched_clock();
 
-	spin_lock_irqsave(&blkg->stats_lock, flags);
-	stats = &blkg->stats;
+	stats_cpu = blkio_stats_cpu_begin(blkg, &flags);
 	if (time_after64(now, io_start_time))
-		blkio_add_stat(stats->stat_arr[BLKIO_STAT_SERVICE_TIME],
+		blkio_add_stat(blkio_stats_cpu_arr(blkg, stats_cpu,
+				BLKIO_STAT_SERVICE_TIME),
 				now - io_start_time, direction, sync);
 	if (time_after64(io_start_time, start_time))
-		blkio_add_stat(stats->stat_arr[BLKIO_STAT_WAIT_TIME],
+		blkio_add_stat(blkio_stats_cpu_arr(blkg, stats_cpu,
+				BLKIO_STAT_WAIT_TIME),
 				io_start_time - start_time, direction, sync);
-	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+	blkio_stats_cpu_end(blkg, stats_cpu, flags);
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_completion_stats);
 
 void blkiocg_update_io_merged_stats(struct blkio_group *blkg, bool direction,
 					bool sync)
 {
+	struct blkio_group_stats_cpu *stats_cpu;
 	unsigned long flags;
 
-	spin_lock_irqsave(&blkg->stats_lock, flags);
-	blkio_add_stat(blkg->stats.stat_arr[BLKIO_STAT_MERGED], 1, direction,
-			sync);
-	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+	stats_cpu = blkio_stats_cpu_begin(blkg, &flags);
+	blkio_add_stat(blkio_stats_cpu_arr(blkg, stats_cpu, BLKIO_STAT_MERGED),
+			1, direction, sync);
+	blkio_stats_cpu_end(blkg, stats_cpu, flags);
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_io_merged_stats);
 
@@ -435,6 +513,14 @@ void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 {
 	unsigned long flags;
 
+	/*
+	 * Groups are mostly created under the queue lock, so the per cpu
+	 * stats come from kmalloc rather than alloc_percpu(). Without them
+	 * the group just keeps all its stats under stats_lock.
+	 */
+	blkg->stats_cpu = kzalloc(nr_cpu_ids * sizeof(*blkg->stats_cpu),
+				  GFP_ATOMIC | __GFP_NOWARN);
+
 	spin_lock_irqsave(&blkcg->lock, flags);
 	spin_lock_init(&blkg->stats_lock);
 	rcu_assign_pointer(blkg->key, key);
@@ -448,6 +534,14 @@ void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 }
 EXPORT_SYMBOL_GPL(blkiocg_add_blkio_group);
 
+/* Free what blkiocg_add_blkio_group() allocated, before freeing @blkg */
+void blkiocg_free_blkio_group_stats(struct blkio_group *blkg)
+{
+	kfree(blkg->stats_cpu);
+	blkg->stats_cpu = NULL;
+}
+EXPORT_SYMBOL_GPL(blkiocg_free_blkio_group_stats);
+
 static void __blkiocg_del_blkio_group(struct blkio_group *blkg)
 {
 	hlist_del_init_rcu(&blkg->blkcg_node);
@@ -507,7 +601,7 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 	struct blkio_group_stats *stats;
 	struct hlist_node *n;
 	uint64_t queued[BLKIO_STAT_TOTAL];
-	int i;
+	int i, cpu;
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	bool idling, waiting, empty;
 	unsigned long long now = sched_clock();
@@ -528,6 +622,16 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 		memset(stats, 0, sizeof(struct blkio_group_stats));
 		for (i = 0; i < BLKIO_STAT_TOTAL; i++)
 			stats->stat_arr[BLKIO_STAT_QUEUED][i] = queued[i];
+		/*
+		 * Updates racing with this are lost or survive the reset,
+		 * either is fine for a reset.
+		 */
+		if (blkg->stats_cpu) {
+			for_each_possible_cpu(cpu)
+				memset(&blkg->stats_cpu[cpu], 0,
+				       offsetof(struct blkio_group_stats_cpu,
+						syncp));
+		}
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 		if (idling) {
 			blkio_mark_blkg_idling(stats);
@@ -593,7 +697,7 @@ static uint64_t blkio_fill_stat(char *str, int chars_left, uint64_t val,
 static uint64_t blkio_get_stat(struct blkio_group *blkg,
 		struct cgroup_map_cb *cb, dev_t dev, enum stat_type type)
 {
-	uint64_t disk_total;
+	uint64_t disk_total, val[BLKIO_STAT_TOTAL];
 	char key_str[MAX_KEY_LEN];
 	enum stat_sub_type sub_type;
 
@@ -602,7 +706,7 @@ static uint64_t blkio_get_stat(struct blkio_group *blkg,
 					blkg->stats.time, cb, dev);
 	if (type == BLKIO_STAT_SECTORS)
 		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
-					blkg->stats.sectors, cb, dev);
+				blkio_read_stat_cpu(blkg, type, 0), cb, dev);
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	if (type == BLKIO_STAT_AVG_QUEUE_SIZE) {
 		uint64_t sum = blkg->stats.avg_queue_size_sum;
@@ -629,11 +733,15 @@ static uint64_t blkio_get_stat(struct blkio_group *blkg,
 
 	for (sub_type = BLKIO_STAT_READ; sub_type < BLKIO_STAT_TOTAL;
 			sub_type++) {
+		if (type < BLKIO_STAT_CPU_NR)
+			val[sub_type] = blkio_read_stat_cpu(blkg, type,
+							    sub_type);
+		else
+			val[sub_type] = blkg->stats.stat_arr[type][sub_type];
 		blkio_get_key_name(sub_type, dev, key_str, MAX_KEY_LEN, false);
-		cb->fill(cb, key_str, blkg->stats.stat_arr[type][sub_type]);
+		cb->fill(cb, key_str, val[sub_type]);
 	}
-	disk_total = blkg->stats.stat_arr[type][BLKIO_STAT_READ] +
-			blkg->stats.stat_arr[type][BLKIO_STAT_WRITE];
+	disk_total = val[BLKIO_STAT_READ] + val[BLKIO_STAT_WRITE];
 	blkio_get_key_name(BLKIO_STAT_TOTAL, dev, key_str, MAX_KEY_LEN, false);
 	cb->fill(cb, key_str, disk_total);
 	return disk_total;
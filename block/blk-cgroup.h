@@ -14,6 +14,7 @@
  */
 
 #include <linux/cgroup.h>
+#include <linux/u64_stats_sync.h>
 
 enum blkio_policy_id {
 	BLKIO_POLICY_PROP = 0,		/* Proportional Bandwidth division */
@@ -110,6 +111,12 @@ struct blkio_cgroup {
 	struct list_head policy_list; /* list of blkio_policy_node */
 };
 
+/*
+ * The stat types below BLKIO_STAT_QUEUED are bumped on every dispatch,
+ * completion or merge and are kept per cpu, see blkio_group_stats_cpu.
+ */
+#define BLKIO_STAT_CPU_NR	BLKIO_STAT_QUEUED
+
 struct blkio_group_stats {
 	/* total disk time and nr sectors dispatched by this group */
 	uint64_t time;
@@ -140,6 +147,16 @@ struct blkio_group_stats {
 #endif
 };
 
+/*
+ * Per cpu part of the stats, updated without blkg->stats_lock and summed
+ * up by the readers. syncp keeps 64bit counters whole on 32bit.
+ */
+struct blkio_group_stats_cpu {
+	uint64_t sectors;
+	uint64_t stat_arr_cpu[BLKIO_STAT_CPU_NR][BLKIO_STAT_TOTAL];
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
 struct blkio_group {
 	/* An rcu protected unique identifier for the group */
 	void *key;
@@ -155,6 +172,11 @@ struct blkio_group {
 	/* Need to serialize the stats in the case of reset/update */
 	spinlock_t stats_lock;
 	struct blkio_group_stats stats;
+	/*
+	 * nr_cpu_ids entries, or NULL if they could not be allocated and the
+	 * per cpu stats fall back to stats under stats_lock.
+	 */
+	struct blkio_group_stats_cpu *stats_cpu;
 };
 
 struct blkio_policy_node {
@@ -290,6 +312,7 @@ extern void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 	struct blkio_group *blkg, void *key, dev_t dev,
 	enum blkio_policy_id plid);
 extern int blkiocg_del_blkio_group(struct blkio_group *blkg);
+extern void blkiocg_free_blkio_group_stats(struct blkio_group *blkg);
 extern struct blkio_group *blkiocg_lookup_group(struct blkio_cgroup *blkcg,
 						void *key);
 void blkiocg_update_timeslice_used(struct blkio_group *blkg,
@@ -315,6 +338,8 @@ static inline void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 
 static inline int
 blkiocg_del_blkio_group(struct blkio_group *blkg) { return 0; }
+static inline void
+blkiocg_free_blkio_group_stats(struct blkio_group *blkg) {}
 
 static inline struct blkio_group *
 blkiocg_lookup_group(struct blkio_cgroup *blkcg, void *key) { return NULL; }
@@ -156,6 +156,7 @@ static void throtl_put_tg(struct throtl_grp *tg)
 	BUG_ON(atomic_read(&tg->ref) <= 0);
 	if (!atomic_dec_and_test(&tg->ref))
 		return;
+	blkiocg_free_blkio_group_stats(&tg->blkg);
 	kfree(tg);
 }
 
@@ -871,6 +872,7 @@ static void throtl_release_tgs(struct throtl_data *td)
 
 static void throtl_td_free(struct throtl_data *td)
 {
+	blkiocg_free_blkio_group_stats(&td->root_tg.blkg);
 	kfree(td);
 }
 
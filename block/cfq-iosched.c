@@ -1093,6 +1093,7 @@ static void cfq_put_cfqg(struct cfq_group *cfqg)
 		return;
 	for_each_cfqg_st(cfqg, i, j, st)
 		BUG_ON(!RB_EMPTY_ROOT(&st->rb));
+	cfq_blkiocg_free_blkio_group_stats(&cfqg->blkg);
 	kfree(cfqg);
 }
 
@@ -3814,7 +3815,10 @@ static void cfq_put_async_queues(struct cfq_data *cfqd)
 
 static void cfq_cfqd_free(struct rcu_head *head)
 {
-	kfree(container_of(head, struct cfq_data, rcu));
+	struct cfq_data *cfqd = container_of(head, struct cfq_data, rcu);
+
+	cfq_blkiocg_free_blkio_group_stats(&cfqd->root_group.blkg);
+	kfree(cfqd);
 }
 
 static void cfq_exit_queue(struct elevator_queue *e)
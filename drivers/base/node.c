@@ -149,6 +149,13 @@ static ssize_t node_read_meminfo(struct sys_device * dev,
 			HPAGE_PMD_NR)
 #endif
 		       );
+#ifdef CONFIG_KSM
+	n += sprintf(buf + n,
+		       "Node %d KsmShared:      %8lu kB\n"
+		       "Node %d KsmSharing:     %8lu kB\n",
+		       nid, K(node_page_state(nid, NR_KSM_PAGES_SHARED)),
+		       nid, K(node_page_state(nid, NR_KSM_PAGES_SHARING)));
+#endif
 	n += hugetlb_report_node_meminfo(nid, buf + n);
 	return n;
 }
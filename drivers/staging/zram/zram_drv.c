@@ -24,9 +24,12 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/lglock.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
 #include <linux/string.h>
+#include <linux/time.h>
 #include <linux/vmalloc.h>
 
 #include "zram_drv.h"
@@ -38,33 +41,53 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
-{
-	*v = *v + 1;
-}
-
-static void zram_stat_dec(u32 *v)
-{
-	*v = *v - 1;
-}
-
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
-{
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
-}
-
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
-{
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
-}
-
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+/*
+ * The stats are per cpu, updated with preemption disabled and summed up
+ * by zram_stats_sum(). A counter may go below zero on one cpu.
+ */
+#define zram_stat_add(zram, field, val)				\
+do {								\
+	struct zram_stats *__stats = get_cpu_ptr((zram)->stats);	\
+								\
+	u64_stats_update_begin(&__stats->syncp);		\
+	__stats->field += (val);				\
+	u64_stats_update_end(&__stats->syncp);			\
+	put_cpu_ptr((zram)->stats);				\
+} while (0)
+
+#define zram_stat_sub(zram, field, val)	zram_stat_add(zram, field, -(s64)(val))
+#define zram_stat_inc(zram, field)	zram_stat_add(zram, field, 1)
+#define zram_stat_dec(zram, field)	zram_stat_add(zram, field, -1)
+
+void zram_stats_sum(struct zram *zram, struct zram_stats *sum)
 {
-	zram_stat64_add(zram, v, 1);
+	struct zram_stats *stats, snap;
+	unsigned int start;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(zram->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			snap = *stats;
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		sum->compr_size += snap.compr_size;
+		sum->num_reads += snap.num_reads;
+		sum->num_writes += snap.num_writes;
+		sum->failed_reads += snap.failed_reads;
+		sum->failed_writes += snap.failed_writes;
+		sum->invalid_io += snap.invalid_io;
+		sum->notify_free += snap.notify_free;
+		sum->pages_compacted += snap.pages_compacted;
+		sum->pages_zero += snap.pages_zero;
+		sum->pages_dedup += snap.pages_dedup;
+		sum->pages_stored += snap.pages_stored;
+		sum->good_compress += snap.good_compress;
+		sum->pages_expand += snap.pages_expand;
+		sum->pages_wb += snap.pages_wb;
+	}
 }
 
 static int zram_test_flag(struct zram *zram, u32 index,
@@ -100,6 +123,393 @@ static int page_zero_filled(void *ptr)
 	return 1;
 }
 
+/* Where the object of a disk page is stored, shared or not */
+static void zram_obj_location(struct zram *zram, u32 index,
+			struct page **page, u32 *offset)
+{
+	if (zram_test_flag(zram, index, ZRAM_SHARED)) {
+		*page = zram->table[index].obj->page;
+		*offset = zram->table[index].obj->offset;
+	} else {
+		*page = zram->table[index].page;
+		*offset = zram->table[index].offset;
+	}
+}
+
+/*
+ * zs_compact() moves the objects of zsmalloc pools with the write side
+ * of this held: the location of a compressed object is used with the
+ * read side held, from looking it up to unmapping it. The lock is
+ * global, the write side is held for one zspage at a time.
+ *
+ * zram_writeback() also copies and frees the objects of pages written
+ * back with it held, as no page is freed meanwhile.
+ */
+DEFINE_BRLOCK(zram_compact_lock);
+
+/* Object tags of zs_set_tag(): a disk page index, or its zram_obj */
+#define ZRAM_TAG_INDEX(index)	(((unsigned long)(index) << 1) | 1)
+
+static void zram_obj_migrate(void *priv, unsigned long tag,
+			struct page *page, u32 idx)
+{
+	struct zram *zram = priv;
+	struct zram_obj *obj;
+
+	if (tag & 1) {
+		zram->table[tag >> 1].page = page;
+		zram->table[tag >> 1].offset = idx;
+	} else {
+		obj = (struct zram_obj *)tag;
+		obj->page = page;
+		obj->offset = idx;
+	}
+}
+
+static int zram_obj_alloc(struct zram *zram, u32 size,
+			struct page **page, u32 *offset)
+{
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		return zs_malloc(zram->zs_pool, size, page, offset,
+				GFP_NOIO | __GFP_HIGHMEM);
+
+	return xv_malloc(zram->mem_pool, size + sizeof(struct zobj_header),
+			page, offset, GFP_NOIO | __GFP_HIGHMEM);
+}
+
+static void zram_obj_free(struct zram *zram, struct page *page, u32 offset)
+{
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		zs_free(zram->zs_pool, page, offset);
+	else
+		xv_free(zram->mem_pool, page, offset);
+}
+
+static void zram_obj_write(struct zram *zram, struct page *page,
+			u32 offset, const void *src, u32 size)
+{
+	unsigned char *cmem;
+
+	if (zram->allocator == ZRAM_ZSMALLOC) {
+		zs_write_object(zram->zs_pool, page, offset, src, size);
+		return;
+	}
+
+	cmem = kmap_atomic(page, KM_USER1) + offset;
+	memcpy(cmem + sizeof(struct zobj_header), src, size);
+	kunmap_atomic(cmem, KM_USER1);
+}
+
+static u32 zram_obj_size(struct zram *zram, struct page *page, u32 offset)
+{
+	unsigned char *cmem;
+	u32 size;
+
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		return zs_get_object_size(zram->zs_pool, page, offset);
+
+	cmem = kmap_atomic(page, KM_USER1) + offset;
+	size = xv_get_object_size(cmem) - sizeof(struct zobj_header);
+	kunmap_atomic(cmem, KM_USER1);
+
+	return size;
+}
+
+/*
+ * Map a compressed object with KM_USER1, setting @size to its size,
+ * until zram_obj_unmap().
+ */
+static unsigned char *zram_obj_map(struct zram *zram, struct page *page,
+			u32 offset, size_t *size)
+{
+	unsigned char *cmem;
+	u32 len;
+
+	if (zram->allocator == ZRAM_ZSMALLOC) {
+		cmem = zs_map_object(zram->zs_pool, page, offset, &len);
+		*size = len;
+		return cmem;
+	}
+
+	cmem = kmap_atomic(page, KM_USER1) + offset;
+	*size = xv_get_object_size(cmem) - sizeof(struct zobj_header);
+	return cmem + sizeof(struct zobj_header);
+}
+
+static void zram_obj_unmap(struct zram *zram, struct page *page,
+			u32 offset, unsigned char *cmem)
+{
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		zs_unmap_object(zram->zs_pool, page, offset, cmem);
+	else
+		kunmap_atomic(cmem - sizeof(struct zobj_header), KM_USER1);
+}
+
+/* Monotonic seconds for table ac_time, never 0 */
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec + 1;
+}
+
+/*
+ * Let zs_compact() move, and zram_writeback() write back, the object just
+ * stored for disk page @index, now that all its references are set.
+ */
+static void zram_obj_publish(struct zram *zram, u32 index)
+{
+	struct page *page;
+	u32 offset;
+	unsigned long tag;
+	int tagged = zram->allocator == ZRAM_ZSMALLOC &&
+		!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	if (!tagged && !zram->bdev)
+		return;
+
+	br_read_lock(zram_compact_lock);
+	if (tagged) {
+		zram_obj_location(zram, index, &page, &offset);
+		if (zram_test_flag(zram, index, ZRAM_SHARED))
+			tag = (unsigned long)zram->table[index].obj;
+		else
+			tag = ZRAM_TAG_INDEX(index);
+		zs_set_tag(zram->zs_pool, page, offset, tag);
+	}
+	if (zram->bdev)
+		zram->table[index].ac_time = zram_now();
+	br_read_unlock(zram_compact_lock);
+}
+
+/* Disk page @index was read, with zram_compact_lock read held */
+static void zram_touch(struct zram *zram, u32 index)
+{
+	if (zram->bdev && zram->table[index].ac_time)
+		zram->table[index].ac_time = zram_now();
+}
+
+u64 zram_pool_size_bytes(struct zram *zram)
+{
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		return zs_get_total_size_bytes(zram->zs_pool);
+
+	return xv_get_total_size_bytes(zram->mem_pool);
+}
+
+/*
+ * Empty the sparse zspages of a zsmalloc device into the others. Returns
+ * the number of pages freed.
+ */
+unsigned long zram_compact(struct zram *zram)
+{
+	unsigned long freed = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done && zram->allocator == ZRAM_ZSMALLOC) {
+		freed = zs_compact(zram->zs_pool,
+				zram_compact_lock_global_lock,
+				zram_compact_lock_global_unlock);
+		zram_stat_add(zram, pages_compacted, freed);
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return freed;
+}
+
+/*
+ * Find a stored object with the content at @user_mem, and take a reference
+ * to it. Objects are indexed by hash, and the one found is decompressed in
+ * the dedup_buffer of @zs and compared with @user_mem before being shared.
+ */
+static struct zram_obj *zram_dedup_find(struct zram *zram,
+			struct zram_stream *zs, u32 hash,
+			unsigned char *user_mem)
+{
+	struct rb_node *node;
+	struct zram_obj *obj = NULL;
+	unsigned char *cmem;
+	size_t clen, size;
+	int ret;
+
+	br_read_lock(zram_compact_lock);
+	spin_lock(&zram->dedup_lock);
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		obj = rb_entry(node, struct zram_obj, node);
+		if (hash < obj->hash)
+			node = node->rb_left;
+		else if (hash > obj->hash)
+			node = node->rb_right;
+		else
+			break;
+	}
+	if (!node) {
+		spin_unlock(&zram->dedup_lock);
+		br_read_unlock(zram_compact_lock);
+		return NULL;
+	}
+
+	if (obj->uncompressed) {
+		cmem = kmap_atomic(obj->page, KM_USER1) + obj->offset;
+		ret = memcmp(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		cmem = zram_obj_map(zram, obj->page, obj->offset, &size);
+		clen = PAGE_SIZE;
+		ret = lzo1x_decompress_safe(cmem, size, zs->dedup_buffer,
+					&clen);
+		zram_obj_unmap(zram, obj->page, obj->offset, cmem);
+		if (ret == LZO_E_OK && clen == PAGE_SIZE)
+			ret = memcmp(zs->dedup_buffer, user_mem, PAGE_SIZE);
+		else
+			ret = -1;
+	}
+
+	if (ret)
+		obj = NULL;
+	else
+		obj->count++;
+	spin_unlock(&zram->dedup_lock);
+	br_read_unlock(zram_compact_lock);
+
+	return obj;
+}
+
+/*
+ * Make the object just stored for disk page @index the zram_obj @obj,
+ * indexed by @hash unless another content of the same hash is there
+ * already. Without memory for @obj, the page is simply left unshared.
+ */
+static void zram_dedup_insert(struct zram *zram, u32 index, u32 hash,
+			struct zram_obj *obj)
+{
+	struct rb_node **link, *parent = NULL;
+	struct zram_obj *iter;
+
+	if (!obj)
+		return;
+
+	obj->page = zram->table[index].page;
+	obj->offset = zram->table[index].offset;
+	obj->uncompressed = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+	obj->hash = hash;
+	obj->count = 1;
+
+	spin_lock(&zram->dedup_lock);
+	link = &zram->dedup_root.rb_node;
+	while (*link) {
+		parent = *link;
+		iter = rb_entry(parent, struct zram_obj, node);
+		if (hash < iter->hash)
+			link = &parent->rb_left;
+		else if (hash > iter->hash)
+			link = &parent->rb_right;
+		else
+			break;
+	}
+	if (*link) {
+		RB_CLEAR_NODE(&obj->node);
+	} else {
+		rb_link_node(&obj->node, parent, link);
+		rb_insert_color(&obj->node, &zram->dedup_root);
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	zram->table[index].obj = obj;
+	zram->table[index].offset = 0;
+	zram_set_flag(zram, index, ZRAM_SHARED);
+}
+
+/*
+ * Drop the reference of disk page @index to its zram_obj. Returns 0 if
+ * other pages still refer to it, else frees it and returns 1 with the
+ * location of the object to be freed.
+ */
+static int zram_dedup_put(struct zram *zram, u32 index,
+			struct page **page, u32 *offset)
+{
+	struct zram_obj *obj = zram->table[index].obj;
+	u32 count;
+
+	spin_lock(&zram->dedup_lock);
+	count = --obj->count;
+	if (!count && !RB_EMPTY_NODE(&obj->node))
+		rb_erase(&obj->node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	zram_clear_flag(zram, index, ZRAM_SHARED);
+	zram->table[index].page = NULL;
+	if (count)
+		return 0;
+
+	*page = obj->page;
+	*offset = obj->offset;
+	kfree(obj);
+	return 1;
+}
+
+static void zram_stream_free(struct zram_stream *zs)
+{
+	kfree(zs->workmem);
+	free_pages((unsigned long)zs->buffer, 1);
+	kfree(zs->dedup_buffer);
+	kfree(zs);
+}
+
+static struct zram_stream *zram_stream_alloc(void)
+{
+	struct zram_stream *zs;
+
+	zs = kzalloc(sizeof(*zs), GFP_KERNEL);
+	if (!zs)
+		return NULL;
+
+	zs->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+	zs->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+	zs->dedup_buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!zs->workmem || !zs->buffer || !zs->dedup_buffer) {
+		zram_stream_free(zs);
+		return NULL;
+	}
+
+	return zs;
+}
+
+/*
+ * Take an idle compression stream of @zram, waiting for one if all of them
+ * are busy. There is one per online cpu, allocated with the device.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zs;
+
+	for (;;) {
+		spin_lock(&zram->stream_lock);
+		if (!list_empty(&zram->idle_streams)) {
+			zs = list_first_entry(&zram->idle_streams,
+					struct zram_stream, list);
+			list_del(&zs->list);
+			spin_unlock(&zram->stream_lock);
+			return zs;
+		}
+		spin_unlock(&zram->stream_lock);
+
+		wait_event(zram->stream_wait,
+			!list_empty(&zram->idle_streams));
+	}
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zs)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zs->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -129,14 +539,35 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+static void __zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
 
 	struct page *page = zram->table[index].page;
 	u32 offset = zram->table[index].offset;
 
+	/* this ends any writeback of it, see zram_writeback_batch() */
+	zram->table[index].ac_time = 0;
+	zram_clear_flag(zram, index, ZRAM_WB_PENDING);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		clear_bit(zram->table[index].block, zram->wb_bitmap);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram->table[index].block = 0;
+		zram_stat_dec(zram, pages_wb);
+		zram_stat_dec(zram, pages_stored);
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SHARED) &&
+	    !zram_dedup_put(zram, index, &page, &offset)) {
+		/* the object is still in use by other disk pages */
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_dec(zram, pages_dedup);
+		zram_stat_dec(zram, pages_stored);
+		return;
+	}
+
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -144,7 +575,7 @@ static void zram_free_page(struct zram *zram, size_t index)
 		 */
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+			zram_stat_dec(zram, pages_zero);
 		}
 		return;
 	}
@@ -153,26 +584,350 @@ static void zram_free_page(struct zram *zram, size_t index)
 		clen = PAGE_SIZE;
 		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat_dec(zram, pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram_obj_size(zram, page, offset);
+	zram_obj_free(zram, page, offset);
 	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+		zram_stat_dec(zram, good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+	zram_stat_sub(zram, compr_size, clen);
+	zram_stat_dec(zram, pages_stored);
 
 	zram->table[index].page = NULL;
 	zram->table[index].offset = 0;
 }
 
+/* With tb_lock held for write */
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	br_read_lock(zram_compact_lock);
+	__zram_free_page(zram, index);
+	br_read_unlock(zram_compact_lock);
+}
+
+/*
+ * System overwrites unused sectors. Free memory associated with this
+ * sector now. With tb_lock held for write.
+ */
+static void zram_free_old_page(struct zram *zram, u32 index)
+{
+	if (zram->table[index].page || zram_test_flag(zram, index, ZRAM_ZERO))
+		zram_free_page(zram, index);
+}
+
+/* A batch of pages of zram_writeback(), or a page of zram_wb_read() */
+struct zram_wb_io {
+	struct work_struct work;	/* of zram_wb_read() */
+	struct zram *zram;
+	struct page *page;
+	unsigned long block;
+	u32 index;
+	int error;
+	struct completion done;
+};
+
+#define ZRAM_WB_BATCH		16
+#define ZRAM_WB_INTERVAL	(5 * HZ)
+
+static void zram_wb_end_io(struct bio *bio, int error)
+{
+	struct zram_wb_io *io = bio->bi_private;
+
+	if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = -EIO;
+	io->error = error;
+	complete(&io->done);
+	bio_put(bio);
+}
+
+static void zram_wb_submit(struct zram_wb_io *io, int rw)
+{
+	struct bio *bio;
+
+	init_completion(&io->done);
+	io->error = 0;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_sector = io->block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = io->zram->bdev;
+	bio->bi_end_io = zram_wb_end_io;
+	bio->bi_private = io;
+	if (!bio_add_page(bio, io->page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		io->error = -EIO;
+		complete(&io->done);
+		return;
+	}
+
+	submit_bio(rw, bio);
+}
+
+static void zram_wb_read_work(struct work_struct *work)
+{
+	struct zram_wb_io *io = container_of(work, struct zram_wb_io, work);
+
+	zram_wb_submit(io, READ);
+	wait_for_completion(&io->done);
+}
+
+/*
+ * Read @block back from the backing device into @page. A bio submitted
+ * from zram_make_request() only goes once it returns, so this waits for
+ * one submitted by a work item instead.
+ */
+static int zram_wb_read(struct zram *zram, unsigned long block,
+			struct page *page)
+{
+	struct zram_wb_io io;
+
+	io.zram = zram;
+	io.page = page;
+	io.block = block;
+
+	INIT_WORK_ONSTACK(&io.work, zram_wb_read_work);
+	schedule_work(&io.work);
+	flush_work(&io.work);
+	destroy_work_on_stack(&io.work);
+
+	if (!io.error)
+		flush_dcache_page(page);
+	return io.error;
+}
+
+static int zram_wb_candidate(struct zram *zram, u32 index, u32 now)
+{
+	struct table *t = &zram->table[index];
+
+	/* ac_time is 0 until the page is stored, see zram_obj_publish() */
+	if (!t->ac_time || t->flags & (BIT(ZRAM_SHARED) | BIT(ZRAM_WB) |
+					BIT(ZRAM_WB_PENDING)))
+		return 0;
+
+	if (zram->wb_incompressible && t->flags & BIT(ZRAM_UNCOMPRESSED))
+		return 1;
+
+	return zram->wb_idle_secs && now - t->ac_time >= zram->wb_idle_secs;
+}
+
+/* A free block of the backing device, 0 if it is full */
+static unsigned long zram_wb_alloc_block(struct zram *zram)
+{
+	unsigned long block;
+
+	do {
+		block = find_next_zero_bit(zram->wb_bitmap, zram->wb_blocks, 1);
+		if (block >= zram->wb_blocks)
+			return 0;
+	} while (test_and_set_bit(block, zram->wb_bitmap));
+
+	return block;
+}
+
+/* Copy the content of disk page @index to @page */
+static int zram_wb_copy(struct zram *zram, u32 index, struct page *page)
+{
+	int ret = 0;
+	u32 offset;
+	size_t clen = PAGE_SIZE, size;
+	struct page *cpage;
+	unsigned char *dst, *cmem;
+
+	zram_obj_location(zram, index, &cpage, &offset);
+	dst = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic(cpage, KM_USER1);
+		memcpy(dst, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		cmem = zram_obj_map(zram, cpage, offset, &size);
+		if (lzo1x_decompress_safe(cmem, size, dst, &clen) != LZO_E_OK)
+			ret = -EIO;
+		zram_obj_unmap(zram, cpage, offset, cmem);
+	}
+	kunmap_atomic(dst, KM_USER0);
+
+	return ret;
+}
+
+/*
+ * Write back up to ZRAM_WB_BATCH pages from *index on. The candidates are
+ * found without the lock held and checked again with it. Their copies
+ * are written to the backing device, and they are only freed if no
+ * zram_free_page() cleared their ZRAM_WB_PENDING meanwhile.
+ */
+static void zram_writeback_batch(struct zram *zram, u32 *index, u32 end,
+			struct zram_wb_io *io)
+{
+	u32 now = zram_now();
+	int i, n = 0;
+
+	for (; *index < end && n < ZRAM_WB_BATCH; (*index)++) {
+		if (zram_wb_candidate(zram, *index, now))
+			io[n++].index = *index;
+	}
+	if (!n)
+		return;
+
+	write_lock(&zram->tb_lock);
+	lg_global_lock(zram_compact_lock);
+	for (i = 0; i < n; i++) {
+		io[i].block = 0;
+		if (!zram_wb_candidate(zram, io[i].index, now))
+			continue;
+
+		io[i].block = zram_wb_alloc_block(zram);
+		if (!io[i].block) {
+			/* the backing device is full */
+			*index = end;
+			n = i;
+			break;
+		}
+
+		if (zram_wb_copy(zram, io[i].index, io[i].page)) {
+			clear_bit(io[i].block, zram->wb_bitmap);
+			io[i].block = 0;
+			continue;
+		}
+		zram_set_flag(zram, io[i].index, ZRAM_WB_PENDING);
+	}
+	lg_global_unlock(zram_compact_lock);
+	write_unlock(&zram->tb_lock);
+
+	for (i = 0; i < n; i++) {
+		if (io[i].block)
+			zram_wb_submit(&io[i], WRITE);
+	}
+	for (i = 0; i < n; i++) {
+		if (io[i].block)
+			wait_for_completion(&io[i].done);
+	}
+
+	write_lock(&zram->tb_lock);
+	lg_global_lock(zram_compact_lock);
+	for (i = 0; i < n; i++) {
+		u32 idx = io[i].index;
+
+		if (!io[i].block)
+			continue;
+
+		if (!zram_test_flag(zram, idx, ZRAM_WB_PENDING) ||
+		    io[i].error) {
+			if (zram_test_flag(zram, idx, ZRAM_WB_PENDING))
+				zram_clear_flag(zram, idx, ZRAM_WB_PENDING);
+			clear_bit(io[i].block, zram->wb_bitmap);
+			continue;
+		}
+
+		__zram_free_page(zram, idx);
+		zram->table[idx].block = io[i].block;
+		zram_set_flag(zram, idx, ZRAM_WB);
+		zram_stat_inc(zram, pages_wb);
+		zram_stat_inc(zram, pages_stored);
+	}
+	lg_global_unlock(zram_compact_lock);
+	write_unlock(&zram->tb_lock);
+}
+
+/*
+ * Write back the incompressible pages, and those neither read nor written
+ * for wb_idle_secs, to the backing device every ZRAM_WB_INTERVAL.
+ */
+static void zram_writeback(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work),
+					struct zram, wb_work);
+	struct zram_wb_io *io;
+	u32 index = 0, end = zram->disksize >> PAGE_SHIFT;
+	int i;
+
+	if (!zram->wb_idle_secs && !zram->wb_incompressible)
+		goto out;
+
+	io = kcalloc(ZRAM_WB_BATCH, sizeof(*io), GFP_KERNEL);
+	if (!io)
+		goto out;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		io[i].zram = zram;
+		io[i].page = alloc_page(GFP_KERNEL);
+		if (!io[i].page)
+			goto free;
+	}
+
+	while (index < end) {
+		zram_writeback_batch(zram, &index, end, io);
+		cond_resched();
+	}
+
+free:
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		if (io[i].page)
+			__free_page(io[i].page);
+	}
+	kfree(io);
+out:
+	queue_delayed_work(system_long_wq, &zram->wb_work, ZRAM_WB_INTERVAL);
+}
+
+/*
+ * Use the block device at @path to write back pages to. Its first block
+ * is left unused: a table entry of block 0 would look empty.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = nr_blocks > 1 ?
+		vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long)) : NULL;
+	if (!bitmap) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		ret = nr_blocks > 1 ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+	set_bit(0, bitmap);
+
+	zram_put_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->wb_bitmap = bitmap;
+	zram->wb_blocks = nr_blocks;
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+
+/* With init_lock held or at exit, the device not initialized */
+void zram_put_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->wb_bitmap);
+	zram->bdev = NULL;
+	zram->wb_bitmap = NULL;
+	zram->wb_blocks = 0;
+}
+
 static void handle_zero_page(struct page *page)
 {
 	void *user_mem;
@@ -188,10 +943,12 @@ static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
+	struct page *cpage;
+	u32 offset;
 
+	zram_obj_location(zram, index, &cpage, &offset);
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(cpage, KM_USER1) + offset;
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -213,19 +970,22 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	zram_stat_inc(zram, num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
+		size_t clen, size;
+		u32 offset;
+		unsigned long block;
+		struct page *page, *cpage;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		read_lock(&zram->tb_lock);
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			read_unlock(&zram->tb_lock);
 			handle_zero_page(page);
 			index++;
 			continue;
@@ -233,6 +993,7 @@ static int zram_read(struct zram *zram, struct bio *bio)
 
 		/* Requested page is not present in compressed area */
 		if (unlikely(!zram->table[index].page)) {
+			read_unlock(&zram->tb_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -240,32 +1001,52 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+		/* read back with the lock dropped, the block is its own */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			block = zram->table[index].block;
+			read_unlock(&zram->tb_lock);
+			ret = zram_wb_read(zram, block, page);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat_inc(zram, failed_reads);
+				goto out;
+			}
+			index++;
+			continue;
+		}
+
+		br_read_lock(zram_compact_lock);
+
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			zram_touch(zram, index);
+			br_read_unlock(zram_compact_lock);
+			read_unlock(&zram->tb_lock);
 			index++;
 			continue;
 		}
 
+		zram_obj_location(zram, index, &cpage, &offset);
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zram_obj_map(zram, cpage, offset, &size);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		ret = lzo1x_decompress_safe(cmem, size, user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		zram_obj_unmap(zram, cpage, offset, cmem);
+		zram_touch(zram, index);
+		br_read_unlock(zram_compact_lock);
+		read_unlock(&zram->tb_lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
 		if (unlikely(ret != LZO_E_OK)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
+			zram_stat_inc(zram, failed_reads);
 			goto out;
 		}
 
@@ -287,6 +1068,7 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	int i, ret;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_stream *zs = NULL;
 
 	if (unlikely(!zram->init_done)) {
 		ret = zram_init_device(zram);
@@ -294,48 +1076,66 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			goto out;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
+	zram_stat_inc(zram, num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	/* the whole bio is compressed with one stream */
+	zs = zram_stream_get(zram);
+
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
+		u32 offset, hash = 0;
+		int dedup = ACCESS_ONCE(zram->dedup);
+		int uncompressed;
 		size_t clen;
-		struct zobj_header *zheader;
+		struct zram_obj *shared, *obj;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		src = zs->buffer;
+		uncompressed = 0;
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
+			write_lock(&zram->tb_lock);
+			zram_free_old_page(zram, index);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			write_unlock(&zram->tb_lock);
+			zram_stat_inc(zram, pages_zero);
 			index++;
 			continue;
 		}
 
+		if (dedup) {
+			hash = jhash2((u32 *)user_mem, PAGE_SIZE / sizeof(u32),
+					0);
+			shared = zram_dedup_find(zram, zs, hash, user_mem);
+			if (shared) {
+				kunmap_atomic(user_mem, KM_USER0);
+				write_lock(&zram->tb_lock);
+				zram_free_old_page(zram, index);
+				zram->table[index].obj = shared;
+				zram_set_flag(zram, index, ZRAM_SHARED);
+				if (shared->uncompressed)
+					zram_set_flag(zram, index,
+						ZRAM_UNCOMPRESSED);
+				write_unlock(&zram->tb_lock);
+				zram_stat_inc(zram, pages_dedup);
+				zram_stat_inc(zram, pages_stored);
+				index++;
+				continue;
+			}
+		}
+
 		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+					zs->workmem);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
 		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
 			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			zram_stat_inc(zram, failed_writes);
 			goto out;
 		}
 
@@ -348,68 +1148,66 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
+				zram_stat_inc(zram, failed_writes);
 				goto out;
 			}
 
+			uncompressed = 1;
 			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+			goto stored;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		if (zram_obj_alloc(zram, clen, &page_store, &offset)) {
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			zram_stat_inc(zram, failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+		/* untagged, the object stays put until zram_obj_publish() */
+		zram_obj_write(zram, page_store, offset, src, clen);
 
-		memcpy(cmem, src, clen);
+stored:
+		/* kmalloc() may sleep, so not under tb_lock */
+		obj = dedup ? kmalloc(sizeof(*obj), GFP_NOIO) : NULL;
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		write_lock(&zram->tb_lock);
+		zram_free_old_page(zram, index);
+		if (uncompressed)
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram->table[index].page = page_store;
+		zram->table[index].offset = offset;
+		if (dedup)
+			zram_dedup_insert(zram, index, hash, obj);
+		zram_obj_publish(zram, index);
+		write_unlock(&zram->tb_lock);
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_add(zram, compr_size, clen);
+		zram_stat_inc(zram, pages_stored);
+		if (uncompressed)
+			zram_stat_inc(zram, pages_expand);
 		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+			zram_stat_inc(zram, good_compress);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
+	zram_stream_put(zram, zs);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	if (zs)
+		zram_stream_put(zram, zs);
 	bio_io_error(bio);
 	return 0;
 }
@@ -440,7 +1238,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	struct zram *zram = queue->queuedata;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		zram_stat_inc(zram, invalid_io);
 		bio_io_error(bio);
 		return 0;
 	}
@@ -461,42 +1259,67 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
+	int cpu;
 
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
+	cancel_delayed_work_sync(&zram->wb_work);
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Free the compression streams, all idle now */
+	while (!list_empty(&zram->idle_streams)) {
+		struct zram_stream *zs;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+		zs = list_first_entry(&zram->idle_streams,
+				struct zram_stream, list);
+		list_del(&zs->list);
+		zram_stream_free(zs);
+	}
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		struct page *page;
-		u16 offset;
+		u32 offset;
+
+		/* its block is freed with the bitmap below */
+		if (zram_test_flag(zram, index, ZRAM_WB))
+			continue;
 
 		page = zram->table[index].page;
 		offset = zram->table[index].offset;
 
+		if (zram_test_flag(zram, index, ZRAM_SHARED) &&
+		    !zram_dedup_put(zram, index, &page, &offset))
+			continue;
+
 		if (!page)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(page);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zram_obj_free(zram, page, offset);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
+	zram->dedup_root = RB_ROOT;
 
-	xv_destroy_pool(zram->mem_pool);
+	/* The backing device stays, all its blocks free */
+	if (zram->wb_bitmap) {
+		bitmap_zero(zram->wb_bitmap, zram->wb_blocks);
+		set_bit(0, zram->wb_bitmap);
+	}
+
+	if (zram->mem_pool)
+		xv_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
+	if (zram->zs_pool)
+		zs_destroy_pool(zram->zs_pool);
+	zram->zs_pool = NULL;
 
 	/* Reset stats */
-	memset(&zram->stats, 0, sizeof(zram->stats));
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(zram->stats, cpu), 0, sizeof(*zram->stats));
 
 	zram->disksize = 0;
 	mutex_unlock(&zram->init_lock);
@@ -504,7 +1327,7 @@ void zram_reset_device(struct zram *zram)
 
 int zram_init_device(struct zram *zram)
 {
-	int ret;
+	int i, ret;
 	size_t num_pages;
 
 	mutex_lock(&zram->init_lock);
@@ -516,16 +1339,16 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
+	/* One compression stream per cpu, at least one */
+	for (i = 0; i < num_online_cpus(); i++) {
+		struct zram_stream *zs = zram_stream_alloc();
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+		if (!zs)
+			break;
+		list_add(&zs->list, &zram->idle_streams);
+	}
+	if (!i) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -545,14 +1368,20 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
-	if (!zram->mem_pool) {
+	if (zram->allocator == ZRAM_ZSMALLOC)
+		zram->zs_pool = zs_create_pool(zram_obj_migrate, zram);
+	else
+		zram->mem_pool = xv_create_pool();
+	if (!zram->mem_pool && !zram->zs_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
 	zram->init_done = 1;
+	if (zram->bdev)
+		queue_delayed_work(system_long_wq, &zram->wb_work,
+				ZRAM_WB_INTERVAL);
 	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -571,8 +1400,10 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	write_unlock(&zram->tb_lock);
+	zram_stat_inc(zram, notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -584,9 +1415,21 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->stream_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	init_waitqueue_head(&zram->stream_wait);
+	rwlock_init(&zram->tb_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_root = RB_ROOT;
+	INIT_DELAYED_WORK(&zram->wb_work, zram_writeback);
+
+	zram->stats = alloc_percpu(struct zram_stats);
+	if (!zram->stats) {
+		pr_err("Error allocating stats for device %d\n", device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -659,6 +1502,8 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	free_percpu(zram->stats);
 }
 
 static int __init zram_init(void)
@@ -672,6 +1517,8 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	br_lock_init(zram_compact_lock);
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
@@ -721,6 +1568,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_put_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
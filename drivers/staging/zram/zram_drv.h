@@ -17,8 +17,14 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 
 #include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -53,6 +59,7 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
  * otherwise, xv_malloc() would always return failure.
+ * zs_malloc() has room for PAGE_SIZE - 16 bytes.
  */
 
 /*-- End of configurable params */
@@ -70,17 +77,58 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page refers to a struct zram_obj, shared with identical pages */
+	ZRAM_SHARED,
+
+	/* Page is stored in a block of the backing device */
+	ZRAM_WB,
+
+	/* Page is being written back, until zram_free_page() */
+	ZRAM_WB_PENDING,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* Allocator of the compressed objects, selected before init */
+enum zram_allocator {
+	ZRAM_XVMALLOC,
+	ZRAM_ZSMALLOC,
+};
+
 /*-- Data structures */
 
+/*
+ * A stored object of a zram with dedup set, indexed by the hash of the
+ * page it holds. Every disk page with that content refers to it.
+ */
+struct zram_obj {
+	struct rb_node node;
+	struct page *page;
+	u16 offset;
+	u16 uncompressed;
+	u32 hash;
+	u32 count;	/* disk pages referring to it */
+};
+
+/* Compressor buffers, one writer at a time */
+struct zram_stream {
+	struct list_head list;
+	void *workmem;
+	void *buffer;		/* compressed output */
+	void *dedup_buffer;	/* decompressed object, see zram_dedup_find() */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		struct zram_obj *obj;	/* if ZRAM_SHARED */
+		unsigned long block;	/* if ZRAM_WB */
+	};
 	u16 offset;
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+	u32 ac_time;	/* last access in seconds, with a backing device */
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -91,20 +139,42 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 pages_compacted;	/* no. of pages freed by zram_compact() */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_wb;		/* no. of pages in the backing device */
+	struct u64_stats_sync syncp;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	int allocator;
+	struct xv_pool *mem_pool;	/* if ZRAM_XVMALLOC */
+	struct zs_pool *zs_pool;	/* if ZRAM_ZSMALLOC */
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/*
+	 * Protect the table entries: taken for write to free and store an
+	 * entry, for read to read one. Taken before zram_compact_lock.
+	 */
+	rwlock_t tb_lock;
+	struct zram_stats __percpu *stats;
+	/* Idle compression streams, taken by zram_write() */
+	spinlock_t stream_lock;
+	struct list_head idle_streams;
+	wait_queue_head_t stream_wait;
+	/* Identical pages share one object, see zram_dedup_find() */
+	int dedup;
+	spinlock_t dedup_lock;	/* protect dedup_root and zram_obj counts */
+	struct rb_root dedup_root;
+	/* Pages written back by zram_writeback(), set before init */
+	struct block_device *bdev;
+	unsigned long *wb_bitmap;	/* blocks of bdev in use */
+	unsigned long wb_blocks;
+	unsigned int wb_idle_secs;	/* idle pages written back, 0: none */
+	int wb_incompressible;		/* incompressible pages written back */
+	struct delayed_work wb_work;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -115,8 +185,6 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
-
-	struct zram_stats stats;
 };
 
 extern struct zram *devices;
@@ -127,5 +195,10 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_stats_sum(struct zram *zram, struct zram_stats *sum);
+extern u64 zram_pool_size_bytes(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_put_backing_dev(struct zram *zram);
+extern unsigned long zram_compact(struct zram *zram);
 
 #endif
@@ -13,23 +13,15 @@
  */
 
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
 
 #include "zram_drv.h"
 
 #ifdef CONFIG_SYSFS
 
-static u64 zram_stat64_read(struct zram *zram, u64 *v)
-{
-	u64 val;
-
-	spin_lock(&zram->stat64_lock);
-	val = *v;
-	spin_unlock(&zram->stat64_lock);
-
-	return val;
-}
-
 static struct zram *dev_to_zram(struct device *dev)
 {
 	int i;
@@ -73,6 +65,40 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 }
 
+static const char * const zram_allocator_names[] = {
+	[ZRAM_XVMALLOC] = "xvmalloc",
+	[ZRAM_ZSMALLOC] = "zsmalloc",
+};
+
+static ssize_t allocator_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%s\n", zram_allocator_names[zram->allocator]);
+}
+
+static ssize_t allocator_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int i;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		pr_info("Cannot change allocator for initialized device\n");
+		return -EBUSY;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(zram_allocator_names); i++) {
+		if (sysfs_streq(buf, zram_allocator_names[i])) {
+			zram->allocator = i;
+			return len;
+		}
+	}
+
+	return -EINVAL;
+}
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -116,81 +142,293 @@ static ssize_t reset_store(struct device *dev,
 static ssize_t num_reads_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_reads));
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.num_reads);
 }
 
 static ssize_t num_writes_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_writes));
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.num_writes);
 }
 
 static ssize_t invalid_io_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.invalid_io));
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.invalid_io);
 }
 
 static ssize_t notify_free_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.notify_free));
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.notify_free);
 }
 
 static ssize_t zero_pages_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
+{
+	struct zram_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%u\n", stats.pages_zero);
+}
+
+static ssize_t dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->dedup);
+}
+
+static ssize_t dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long dedup;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &dedup);
+	if (ret)
+		return ret;
+
+	if (dedup > 1)
+		return -EINVAL;
+
+	/* pages already shared stay so when it is turned off */
+	zram->dedup = dedup;
+
+	return len;
+}
+
+static ssize_t dedup_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%u\n", stats.pages_dedup);
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	char b[BDEVNAME_SIZE];
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!zram->bdev)
+		return sprintf(buf, "none\n");
+
+	return sprintf(buf, "%s\n", bdevname(zram->bdev, b));
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	struct zram *zram = dev_to_zram(dev);
+
+	path = kstrndup(buf, len, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	ret = zram_set_backing_dev(zram, strim(path));
+	kfree(path);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static ssize_t writeback_idle_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", zram->wb_idle_secs);
+}
+
+static ssize_t writeback_idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long secs;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &secs);
+	if (ret)
+		return ret;
+
+	if (secs > UINT_MAX)
+		return -EINVAL;
+
+	zram->wb_idle_secs = secs;
+
+	return len;
+}
+
+static ssize_t writeback_incompressible_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%d\n", zram->wb_incompressible);
+}
+
+static ssize_t writeback_incompressible_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	if (val > 1)
+		return -EINVAL;
+
+	zram->wb_incompressible = val;
+
+	return len;
+}
+
+static ssize_t writeback_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%u\n", stats.pages_wb);
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
+	zram_stats_sum(zram, &stats);
+
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)(stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.compr_size));
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.compr_size);
 }
 
 static ssize_t mem_used_total_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	u64 val = 0;
+	struct zram_stats stats;
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		zram_stats_sum(zram, &stats);
+		val = zram_pool_size_bytes(zram) +
+			((u64)(stats.pages_expand) << PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+/*
+ * Percentage of the memory of the allocator not holding compressed data,
+ * comparable between allocators.
+ */
+static ssize_t mem_fragmentation_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 total, used, val = 0;
+	struct zram_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (zram->init_done) {
+		zram_stats_sum(zram, &stats);
+		total = zram_pool_size_bytes(zram);
+		/* incompressible pages are stored out of the pool */
+		used = stats.compr_size -
+			((u64)(stats.pages_expand) << PAGE_SHIFT);
+		if (total > used)
+			val = div64_u64((total - used) * 100, total);
+	}
+
+	return sprintf(buf, "%llu\n", val);
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long do_compact;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &do_compact);
+	if (ret)
+		return ret;
+
+	if (!do_compact)
+		return -EINVAL;
+
+	if (zram->allocator != ZRAM_ZSMALLOC)
+		return -EINVAL;
+
+	zram_compact(zram);
+
+	return len;
+}
+
+static ssize_t compacted_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	zram_stats_sum(zram, &stats);
+
+	return sprintf(buf, "%llu\n", stats.pages_compacted);
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
+static DEVICE_ATTR(allocator, S_IRUGO | S_IWUSR,
+		allocator_show, allocator_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
@@ -198,12 +436,25 @@ static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(dedup, S_IRUGO | S_IWUSR, dedup_show, dedup_store);
+static DEVICE_ATTR(dedup_pages, S_IRUGO, dedup_pages_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback_idle, S_IRUGO | S_IWUSR,
+		writeback_idle_show, writeback_idle_store);
+static DEVICE_ATTR(writeback_incompressible, S_IRUGO | S_IWUSR,
+		writeback_incompressible_show, writeback_incompressible_store);
+static DEVICE_ATTR(writeback_pages, S_IRUGO, writeback_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(mem_fragmentation, S_IRUGO, mem_fragmentation_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(compacted_pages, S_IRUGO, compacted_pages_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
+	&dev_attr_allocator.attr,
 	&dev_attr_initstate.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_num_reads.attr,
@@ -211,9 +462,18 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_dedup.attr,
+	&dev_attr_dedup_pages.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback_idle.attr,
+	&dev_attr_writeback_incompressible.attr,
+	&dev_attr_writeback_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_mem_fragmentation.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_compacted_pages.attr,
 	NULL,
 };
 
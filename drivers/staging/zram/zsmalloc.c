@@ -0,0 +1,620 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are packed by size class into zspages of one to
+ * ZS_MAX_PAGES_PER_ZSPAGE pages, the count that wastes the least space
+ * for that size. The pages of a zspage need not be contiguous: an object
+ * may straddle two of them, and is then copied when it is mapped.
+ *
+ * A zspage has no metadata of its own, it is kept in the struct page of
+ * its first page:
+ *
+ *	page->objects	index of its size class
+ *	page->inuse	number of objects allocated
+ *	page->freelist	index + 1 of its first free object, 0 if none
+ *	page->lru	in the fullness list of its class
+ *
+ * and page->private of each of its pages points to the next one. An
+ * object is known by the first page of its zspage and its index there.
+ *
+ * Objects tagged by their owner can be moved by zs_compact(), which
+ * empties the sparse zspages of a class into the others.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct size_class *get_size_class(struct zs_pool *pool, u32 size)
+{
+	u32 idx = 0;
+
+	if (size > ZS_MIN_ALLOC_SIZE)
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+					ZS_SIZE_CLASS_DELTA);
+
+	return &pool->size_class[idx];
+}
+
+/* The number of pages per zspage that wastes the least for @size */
+static u16 get_pages_per_zspage(u32 size)
+{
+	u16 i, best = 1;
+	u32 usedpc, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+
+		usedpc = (zspage_size - zspage_size % size) * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static struct page *get_next_page(struct page *page)
+{
+	return (struct page *)page->private;
+}
+
+/* The page holding byte @off of the zspage at @first, and its offset there */
+static struct page *get_offset_page(struct page *first, unsigned long off,
+			unsigned long *page_off)
+{
+	struct page *page = first;
+
+	while (off >= PAGE_SIZE) {
+		page = get_next_page(page);
+		off -= PAGE_SIZE;
+	}
+	*page_off = off;
+
+	return page;
+}
+
+/* The header of object @idx, which never straddles two pages */
+static struct zs_head *get_head_atomic(struct size_class *class,
+			struct page *first, u32 idx, enum km_type km)
+{
+	unsigned long off;
+	struct page *page;
+
+	page = get_offset_page(first, (unsigned long)idx * class->size, &off);
+
+	return kmap_atomic(page, km) + off;
+}
+
+static void put_head_atomic(struct zs_head *head, enum km_type km)
+{
+	kunmap_atomic(head, km);
+}
+
+static void copy_to_zspage(struct page *first, unsigned long off,
+			const void *src, u32 len)
+{
+	unsigned long page_off;
+	struct page *page;
+	void *dst;
+	u32 n;
+
+	while (len) {
+		page = get_offset_page(first, off, &page_off);
+		n = min_t(u32, len, PAGE_SIZE - page_off);
+
+		dst = kmap_atomic(page, KM_USER1);
+		memcpy(dst + page_off, src, n);
+		kunmap_atomic(dst, KM_USER1);
+
+		off += n;
+		src += n;
+		len -= n;
+	}
+}
+
+static void copy_from_zspage(struct page *first, unsigned long off,
+			void *dst, u32 len)
+{
+	unsigned long page_off;
+	struct page *page;
+	void *src;
+	u32 n;
+
+	while (len) {
+		page = get_offset_page(first, off, &page_off);
+		n = min_t(u32, len, PAGE_SIZE - page_off);
+
+		src = kmap_atomic(page, KM_USER1);
+		memcpy(dst, src + page_off, n);
+		kunmap_atomic(src, KM_USER1);
+
+		off += n;
+		dst += n;
+		len -= n;
+	}
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+			struct page *first)
+{
+	if (first->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (first->inuse * 4 <= class->objs_per_zspage)
+		return ZS_SPARSE;
+	return ZS_PARTIAL;
+}
+
+static void fix_fullness_group(struct size_class *class, struct page *first)
+{
+	list_move(&first->lru,
+		&class->fullness_list[get_fullness_group(class, first)]);
+}
+
+/* A non-full zspage of @class to allocate from, NULL if none */
+static struct page *find_get_zspage(struct size_class *class)
+{
+	if (!list_empty(&class->fullness_list[ZS_PARTIAL]))
+		return list_first_entry(&class->fullness_list[ZS_PARTIAL],
+					struct page, lru);
+	if (!list_empty(&class->fullness_list[ZS_SPARSE]))
+		return list_first_entry(&class->fullness_list[ZS_SPARSE],
+					struct page, lru);
+	return NULL;
+}
+
+/* Take a free object of @first, which has one. With class->lock held. */
+static u32 take_free_obj(struct size_class *class, struct page *first)
+{
+	struct zs_head *head;
+	u32 idx;
+
+	idx = (unsigned long)first->freelist - 1;
+	head = get_head_atomic(class, first, idx, KM_USER0);
+	first->freelist = (void *)(unsigned long)*(u32 *)head;
+	head->tag = 0;
+	head->size = 0;
+	put_head_atomic(head, KM_USER0);
+
+	first->inuse++;
+	return idx;
+}
+
+/* Give object @idx back to @first. With class->lock held. */
+static void put_free_obj(struct size_class *class, struct page *first,
+			u32 idx)
+{
+	struct zs_head *head;
+
+	head = get_head_atomic(class, first, idx, KM_USER0);
+	*(u32 *)head = (unsigned long)first->freelist;
+	put_head_atomic(head, KM_USER0);
+
+	first->freelist = (void *)(unsigned long)(idx + 1);
+	first->inuse--;
+}
+
+static void free_zspage(struct zs_pool *pool, struct page *first)
+{
+	struct page *page, *next;
+
+	first->freelist = NULL;
+	reset_page_mapcount(first);
+
+	for (page = first; page; page = next) {
+		next = get_next_page(page);
+		set_page_private(page, 0);
+		__free_page(page);
+		atomic_long_dec(&pool->total_pages);
+	}
+}
+
+/*
+ * Allocate the pages of a zspage of @class and chain all its objects
+ * in its free list.
+ */
+static struct page *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class, gfp_t flags)
+{
+	struct page *first = NULL, *prev = NULL, *page;
+	struct zs_head *head;
+	u16 i;
+	u32 idx;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		page = alloc_page(flags);
+		if (unlikely(!page))
+			goto fail;
+
+		atomic_long_inc(&pool->total_pages);
+		set_page_private(page, 0);
+		if (prev)
+			set_page_private(prev, (unsigned long)page);
+		else
+			first = page;
+		prev = page;
+	}
+
+	for (idx = 0; idx < class->objs_per_zspage; idx++) {
+		head = get_head_atomic(class, first, idx, KM_USER0);
+		*(u32 *)head = idx + 1 < class->objs_per_zspage ? idx + 2 : 0;
+		put_head_atomic(head, KM_USER0);
+	}
+
+	first->objects = class - pool->size_class;
+	first->inuse = 0;
+	first->freelist = (void *)1UL;
+	INIT_LIST_HEAD(&first->lru);
+
+	return first;
+
+fail:
+	for (page = first; page; page = prev) {
+		prev = get_next_page(page);
+		set_page_private(page, 0);
+		__free_page(page);
+		atomic_long_dec(&pool->total_pages);
+	}
+	return NULL;
+}
+
+/**
+ * zs_malloc - Allocate an object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @page: first page of the zspage of the object
+ * @idx: index of the object in its zspage
+ * @flags: for the pages of a new zspage, if one is needed
+ *
+ * The object holds nothing until zs_write_object(), and is
+ * not moved by zs_compact() until zs_set_tag().
+ *
+ * Returns 0 on success, -ENOMEM or -EINVAL otherwise.
+ */
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *idx, gfp_t flags)
+{
+	struct size_class *class;
+	struct page *first;
+
+	size += sizeof(struct zs_head);
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return -EINVAL;
+
+	class = get_size_class(pool, size);
+
+	spin_lock(&class->lock);
+	first = find_get_zspage(class);
+	if (!first) {
+		spin_unlock(&class->lock);
+		first = alloc_zspage(pool, class, flags);
+		if (unlikely(!first))
+			return -ENOMEM;
+
+		spin_lock(&class->lock);
+		class->zspages++;
+		list_add(&first->lru, &class->fullness_list[ZS_SPARSE]);
+	}
+
+	*idx = take_free_obj(class, first);
+	fix_fullness_group(class, first);
+	spin_unlock(&class->lock);
+
+	*page = first;
+	return 0;
+}
+
+void zs_free(struct zs_pool *pool, struct page *first, u32 idx)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+
+	spin_lock(&class->lock);
+	put_free_obj(class, first, idx);
+
+	if (!first->inuse) {
+		list_del(&first->lru);
+		class->zspages--;
+		spin_unlock(&class->lock);
+		free_zspage(pool, first);
+		return;
+	}
+
+	fix_fullness_group(class, first);
+	spin_unlock(&class->lock);
+}
+
+/* Store @size bytes from @src in object @idx of @first */
+void zs_write_object(struct zs_pool *pool, struct page *first, u32 idx,
+			const void *src, u32 size)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+	unsigned long off = (unsigned long)idx * class->size;
+	struct zs_head *head;
+
+	BUG_ON(size + sizeof(*head) > class->size);
+
+	head = get_head_atomic(class, first, idx, KM_USER1);
+	head->size = size;
+	put_head_atomic(head, KM_USER1);
+
+	copy_to_zspage(first, off + sizeof(*head), src, size);
+}
+
+/* Let zs_compact() move object @idx of @first, reporting it as @tag */
+void zs_set_tag(struct zs_pool *pool, struct page *first, u32 idx,
+			unsigned long tag)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+	struct zs_head *head;
+
+	head = get_head_atomic(class, first, idx, KM_USER1);
+	head->tag = tag;
+	put_head_atomic(head, KM_USER1);
+}
+
+/* The size written by zs_write_object() in object @idx of @first */
+u32 zs_get_object_size(struct zs_pool *pool, struct page *first, u32 idx)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+	struct zs_head *head;
+	u32 size;
+
+	head = get_head_atomic(class, first, idx, KM_USER1);
+	size = head->size;
+	put_head_atomic(head, KM_USER1);
+
+	return size;
+}
+
+/**
+ * zs_map_object - Map an object for reading.
+ * @pool: pool of the object
+ * @first: first page of its zspage
+ * @idx: index of the object in its zspage
+ * @size: set to the size written by zs_write_object()
+ *
+ * Returns the address of its contents, valid until zs_unmap_object(),
+ * which must be called without sleeping and before the next mapping
+ * with KM_USER1.
+ */
+void *zs_map_object(struct zs_pool *pool, struct page *first, u32 idx,
+			u32 *size)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+	unsigned long off = (unsigned long)idx * class->size, page_off;
+	struct zs_head *head;
+	struct page *page;
+	u32 len, n;
+	void *buf;
+
+	page = get_offset_page(first, off, &page_off);
+	head = kmap_atomic(page, KM_USER1) + page_off;
+	*size = head->size;
+
+	len = sizeof(*head) + head->size;
+	if (page_off + len <= PAGE_SIZE)
+		return head + 1;
+
+	/* it straddles two pages: copy it, first part then the other */
+	buf = get_cpu_ptr(pool->map_buf);
+	n = PAGE_SIZE - page_off;
+	memcpy(buf, head, n);
+	kunmap_atomic(head, KM_USER1);
+	copy_from_zspage(first, off + n, buf + n, len - n);
+
+	return buf + sizeof(*head);
+}
+
+void zs_unmap_object(struct zs_pool *pool, struct page *first, u32 idx,
+			void *obj)
+{
+	struct size_class *class = &pool->size_class[first->objects];
+	unsigned long page_off = ((unsigned long)idx * class->size) &
+					~PAGE_MASK;
+	struct zs_head *head = obj - sizeof(*head);
+
+	if (page_off + sizeof(*head) + head->size <= PAGE_SIZE)
+		kunmap_atomic(head, KM_USER1);
+	else
+		put_cpu_ptr(pool->map_buf);
+}
+
+/*
+ * Move the tagged objects of @src, taken off its fullness list, into the
+ * other zspages of @class while they have room. With class->lock held.
+ * Returns -ENOSPC if they ran out of room.
+ */
+static int compact_zspage(struct zs_pool *pool, struct size_class *class,
+			struct page *src)
+{
+	DECLARE_BITMAP(free_map, ZS_MAX_OBJS_PER_ZSPAGE);
+	void *buf = this_cpu_ptr(pool->map_buf);
+	struct zs_head *head = buf;
+	unsigned long off;
+	struct page *dst;
+	u32 idx, next, didx, len;
+
+	bitmap_zero(free_map, ZS_MAX_OBJS_PER_ZSPAGE);
+	for (next = (unsigned long)src->freelist; next; ) {
+		struct zs_head *h;
+
+		set_bit(next - 1, free_map);
+		h = get_head_atomic(class, src, next - 1, KM_USER0);
+		next = *(u32 *)h;
+		put_head_atomic(h, KM_USER0);
+	}
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		if (test_bit(idx, free_map))
+			continue;
+
+		off = (unsigned long)idx * class->size;
+		copy_from_zspage(src, off, buf, sizeof(*head));
+		/* not published by its owner yet */
+		if (!head->tag)
+			continue;
+
+		dst = find_get_zspage(class);
+		if (!dst)
+			return -ENOSPC;
+
+		len = sizeof(*head) + head->size;
+		copy_from_zspage(src, off, buf, len);
+
+		didx = take_free_obj(class, dst);
+		fix_fullness_group(class, dst);
+		copy_to_zspage(dst, (unsigned long)didx * class->size,
+				buf, len);
+		pool->migrate(pool->priv, head->tag, dst, didx);
+
+		put_free_obj(class, src, idx);
+	}
+
+	return 0;
+}
+
+/**
+ * zs_compact - Empty sparse zspages into the other ones.
+ * @pool: pool to compact
+ * @lock: called before each zspage is emptied, to keep every user of
+ *	  the pool from mapping, writing or freeing an object meanwhile
+ * @unlock: called after it
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool, void (*lock)(void),
+			void (*unlock)(void))
+{
+	struct size_class *class;
+	struct page *src, *tmp;
+	unsigned long freed = 0;
+	int i, ret;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		LIST_HEAD(kept);
+
+		class = &pool->size_class[i];
+		if (class->objs_per_zspage < 4)
+			continue;
+
+		for (;;) {
+			lock();
+			spin_lock(&class->lock);
+			if (list_empty(&class->fullness_list[ZS_SPARSE])) {
+				spin_unlock(&class->lock);
+				unlock();
+				break;
+			}
+
+			src = list_entry(class->fullness_list[ZS_SPARSE].prev,
+					struct page, lru);
+			list_del_init(&src->lru);
+			ret = compact_zspage(pool, class, src);
+
+			if (!src->inuse) {
+				class->zspages--;
+				spin_unlock(&class->lock);
+				free_zspage(pool, src);
+				freed += class->pages_per_zspage;
+			} else {
+				/* out of the way until this class is done */
+				list_add(&src->lru, &kept);
+				spin_unlock(&class->lock);
+			}
+			unlock();
+
+			if (ret)
+				break;
+			cond_resched();
+		}
+
+		spin_lock(&class->lock);
+		list_for_each_entry_safe(src, tmp, &kept, lru)
+			fix_fullness_group(class, src);
+		spin_unlock(&class->lock);
+	}
+
+	return freed;
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->total_pages) << PAGE_SHIFT;
+}
+
+/*
+ * Create a memory pool. @migrate is called by zs_compact() for each
+ * object it moves, with @priv.
+ */
+struct zs_pool *zs_create_pool(zs_migrate_fn migrate, void *priv)
+{
+	struct zs_pool *pool;
+	struct size_class *class;
+	int i, fg;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->map_buf = __alloc_percpu(ZS_MAX_ALLOC_SIZE, ZS_ALIGN);
+	if (!pool->map_buf) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < __NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	pool->migrate = migrate;
+	pool->priv = priv;
+	atomic_long_set(&pool->total_pages, 0);
+
+	return pool;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct size_class *class;
+	struct page *first, *tmp;
+	int i, fg;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		for (fg = 0; fg < __NR_ZS_FULLNESS; fg++) {
+			list_for_each_entry_safe(first, tmp,
+					&class->fullness_list[fg], lru) {
+				list_del(&first->lru);
+				free_zspage(pool, first);
+			}
+		}
+	}
+
+	free_percpu(pool->map_buf);
+	kfree(pool);
+}
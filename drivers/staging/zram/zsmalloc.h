@@ -0,0 +1,46 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+struct zs_pool;
+
+/*
+ * Called by zs_compact() when the object tagged @tag has been moved to
+ * (@page, @idx), for its owner to update its reference to it.
+ */
+typedef void (*zs_migrate_fn)(void *priv, unsigned long tag,
+			struct page *page, u32 idx);
+
+struct zs_pool *zs_create_pool(zs_migrate_fn migrate, void *priv);
+void zs_destroy_pool(struct zs_pool *pool);
+
+int zs_malloc(struct zs_pool *pool, u32 size, struct page **page,
+			u32 *idx, gfp_t flags);
+void zs_free(struct zs_pool *pool, struct page *page, u32 idx);
+
+void zs_write_object(struct zs_pool *pool, struct page *page, u32 idx,
+			const void *src, u32 size);
+void zs_set_tag(struct zs_pool *pool, struct page *page, u32 idx,
+			unsigned long tag);
+u32 zs_get_object_size(struct zs_pool *pool, struct page *page, u32 idx);
+void *zs_map_object(struct zs_pool *pool, struct page *page, u32 idx,
+			u32 *size);
+void zs_unmap_object(struct zs_pool *pool, struct page *page, u32 idx,
+			void *obj);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool, void (*lock)(void),
+			void (*unlock)(void));
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * Objects start on ZS_ALIGN boundaries, so that their header never
+ * straddles two pages. Must be a power of two.
+ */
+#define ZS_ALIGN		16
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_SIZE_CLASS_DELTA	ZS_ALIGN
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/* A zspage is one to this many pages, not necessarily contiguous */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_MAX_OBJS_PER_ZSPAGE	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE \
+					/ ZS_MIN_ALLOC_SIZE)
+
+/* End of user params */
+
+enum fullness_group {
+	ZS_FULL,
+	ZS_PARTIAL,
+	ZS_SPARSE,		/* a quarter in use or less */
+	__NR_ZS_FULLNESS,
+};
+
+/*
+ * At the start of every allocated object. A free object holds the index
+ * + 1 of the next free one of its zspage in its first u32 instead.
+ */
+struct zs_head {
+	unsigned long tag;	/* of its owner, 0 until zs_set_tag() */
+	u32 size;		/* as written by zs_write_object() */
+};
+
+struct size_class {
+	spinlock_t lock;
+	u32 size;
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+	struct list_head fullness_list[__NR_ZS_FULLNESS];
+	u64 zspages;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	zs_migrate_fn migrate;
+	void *priv;
+
+	/* a straddling object is copied here when mapped */
+	void __percpu *map_buf;
+
+	/* stats */
+	atomic_long_t total_pages;
+};
+
+#endif
@@ -41,6 +41,8 @@ struct wb_writeback_work {
 	unsigned int for_background:1;
 
 	struct list_head list;		/* pending work list */
+	unsigned long todo;		/* flushers yet to take it */
+	unsigned int pending;		/* flushers yet to finish it */
 	struct completion *done;	/* set if the caller waits */
 };
 
@@ -66,7 +68,7 @@ int nr_pdflush_threads;
  */
 int writeback_in_progress(struct backing_dev_info *bdi)
 {
-	return test_bit(BDI_writeback_running, &bdi->state);
+	return atomic_read(&bdi->wb_running);
 }
 
 static inline struct backing_dev_info *inode_to_bdi(struct inode *inode)
@@ -79,33 +81,58 @@ static inline struct backing_dev_info *inode_to_bdi(struct inode *inode)
 	return sb->s_bdi;
 }
 
+static inline struct bdi_writeback *inode_to_wb(struct inode *inode)
+{
+	return bdi_inode_wb(inode_to_bdi(inode), inode);
+}
+
 static inline struct inode *wb_inode(struct list_head *head)
 {
 	return list_entry(head, struct inode, i_wb_list);
 }
 
-/* Wakeup flusher thread or forker thread to fork it. Requires bdi->wb_lock. */
+/* Wakeup flusher threads or forker thread to fork them. Needs bdi->wb_lock. */
 static void bdi_wakeup_flusher(struct backing_dev_info *bdi)
 {
-	if (bdi->wb.task) {
-		wake_up_process(bdi->wb.task);
-	} else {
-		/*
-		 * The bdi thread isn't there, wake up the forker thread which
-		 * will create and run it.
-		 */
-		wake_up_process(default_backing_dev_info.wb.task);
+	bool fork = false;
+	unsigned int i;
+
+	for (i = 0; i < bdi->nr_flushers; i++) {
+		if (bdi->wb[i].task)
+			wake_up_process(bdi->wb[i].task);
+		else
+			fork = true;
 	}
+
+	/*
+	 * A bdi thread isn't there, wake up the forker thread which
+	 * will create and run it.
+	 */
+	if (fork)
+		wake_up_process(default_backing_dev_info.wb[0].task);
 }
 
+/*
+ * Every flusher of the bdi runs each work over its own inodes, writing its
+ * share of the pages asked for.
+ */
 static void bdi_queue_work(struct backing_dev_info *bdi,
 			   struct wb_writeback_work *work)
 {
+	unsigned int i, nr;
+
 	trace_writeback_queue(bdi, work);
 
 	spin_lock_bh(&bdi->wb_lock);
+	nr = bdi->nr_flushers;
+	if (nr > 1)
+		work->nr_pages = max(work->nr_pages / nr, 1L);
+	work->todo = (1UL << nr) - 1;
+	work->pending = nr;
+	for (i = 0; i < nr; i++)
+		bdi->wb[i].nr_works++;
 	list_add_tail(&work->list, &bdi->work_list);
-	if (!bdi->wb.task)
+	if (!bdi->wb[0].task)
 		trace_writeback_nothread(bdi, work);
 	bdi_wakeup_flusher(bdi);
 	spin_unlock_bh(&bdi->wb_lock);
@@ -123,10 +150,14 @@ __bdi_start_writeback(struct backing_dev_info *bdi, long nr_pages,
 	 */
 	work = kzalloc(sizeof(*work), GFP_ATOMIC);
 	if (!work) {
-		if (bdi->wb.task) {
-			trace_writeback_nowork(bdi);
-			wake_up_process(bdi->wb.task);
-		}
+		unsigned int i;
+
+		trace_writeback_nowork(bdi);
+		spin_lock_bh(&bdi->wb_lock);
+		for (i = 0; i < bdi->nr_flushers; i++)
+			if (bdi->wb[i].task)
+				wake_up_process(bdi->wb[i].task);
+		spin_unlock_bh(&bdi->wb_lock);
 		return;
 	}
 
@@ -186,7 +217,7 @@ void bdi_start_background_writeback(struct backing_dev_info *bdi)
  */
 static void redirty_tail(struct inode *inode)
 {
-	struct bdi_writeback *wb = &inode_to_bdi(inode)->wb;
+	struct bdi_writeback *wb = inode_to_wb(inode);
 
 	if (!list_empty(&wb->b_dirty)) {
 		struct inode *tail;
@@ -203,7 +234,7 @@ static void redirty_tail(struct inode *inode)
  */
 static void requeue_io(struct inode *inode)
 {
-	struct bdi_writeback *wb = &inode_to_bdi(inode)->wb;
+	struct bdi_writeback *wb = inode_to_wb(inode);
 
 	list_move(&inode->i_wb_list, &wb->b_more_io);
 }
@@ -676,7 +707,7 @@ static long wb_writeback(struct bdi_writeback *wb,
 		 * after the other works are all done.
 		 */
 		if ((work->for_background || work->for_kupdate) &&
-		    !list_empty(&wb->bdi->work_list))
+		    wb->nr_works)
 			break;
 
 		/*
@@ -733,21 +764,52 @@ static long wb_writeback(struct bdi_writeback *wb,
 }
 
 /*
- * Return the next wb_writeback_work struct that hasn't been processed yet.
+ * Return the next wb_writeback_work struct that hasn't been processed yet
+ * by @wb.
  */
 static struct wb_writeback_work *
-get_next_work_item(struct backing_dev_info *bdi)
+get_next_work_item(struct backing_dev_info *bdi, struct bdi_writeback *wb)
 {
-	struct wb_writeback_work *work = NULL;
+	struct wb_writeback_work *work;
+
+	if (!wb->nr_works)
+		return NULL;
 
 	spin_lock_bh(&bdi->wb_lock);
-	if (!list_empty(&bdi->work_list)) {
-		work = list_entry(bdi->work_list.next,
-				  struct wb_writeback_work, list);
-		list_del_init(&work->list);
+	list_for_each_entry(work, &bdi->work_list, list) {
+		if (work->todo & (1UL << wb->nr)) {
+			work->todo &= ~(1UL << wb->nr);
+			wb->nr_works--;
+			spin_unlock_bh(&bdi->wb_lock);
+			return work;
+		}
 	}
 	spin_unlock_bh(&bdi->wb_lock);
-	return work;
+	return NULL;
+}
+
+/*
+ * The last flusher done with a work takes it off the list and notifies the
+ * caller of completion if this is a synchronous work item, otherwise just
+ * frees it.
+ */
+static void finish_work_item(struct backing_dev_info *bdi,
+			     struct wb_writeback_work *work)
+{
+	bool last;
+
+	spin_lock_bh(&bdi->wb_lock);
+	last = !--work->pending;
+	if (last)
+		list_del(&work->list);
+	spin_unlock_bh(&bdi->wb_lock);
+
+	if (!last)
+		return;
+	if (work->done)
+		complete(work->done);
+	else
+		kfree(work);
 }
 
 /*
@@ -820,27 +882,23 @@ long wb_do_writeback(struct bdi_writeback *wb, int force_wait)
 	struct wb_writeback_work *work;
 	long wrote = 0;
 
-	set_bit(BDI_writeback_running, &wb->bdi->state);
-	while ((work = get_next_work_item(bdi)) != NULL) {
+	atomic_inc(&bdi->wb_running);
+	while ((work = get_next_work_item(bdi, wb)) != NULL) {
+		/* the other flushers of the bdi run the same work */
+		struct wb_writeback_work share = *work;
+
 		/*
 		 * Override sync mode, in case we must wait for completion
 		 * because this thread is exiting now.
 		 */
 		if (force_wait)
-			work->sync_mode = WB_SYNC_ALL;
+			share.sync_mode = WB_SYNC_ALL;
 
-		trace_writeback_exec(bdi, work);
+		trace_writeback_exec(bdi, &share);
 
-		wrote += wb_writeback(wb, work);
+		wrote += wb_writeback(wb, &share);
 
-		/*
-		 * Notify the caller of completion if this is a synchronous
-		 * work item, otherwise just free it.
-		 */
-		if (work->done)
-			complete(work->done);
-		else
-			kfree(work);
+		finish_work_item(bdi, work);
 	}
 
 	/*
@@ -848,7 +906,7 @@ long wb_do_writeback(struct bdi_writeback *wb, int force_wait)
 	 */
 	wrote += wb_check_old_data_flush(wb);
 	wrote += wb_check_background_flush(wb);
-	clear_bit(BDI_writeback_running, &wb->bdi->state);
+	atomic_dec(&bdi->wb_running);
 
 	return wrote;
 }
@@ -889,7 +947,7 @@ int bdi_writeback_thread(void *data)
 			wb->last_active = jiffies;
 
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (!list_empty(&bdi->work_list) || kthread_should_stop()) {
+		if (wb->nr_works || kthread_should_stop()) {
 			__set_current_state(TASK_RUNNING);
 			continue;
 		}
@@ -909,7 +967,7 @@ int bdi_writeback_thread(void *data)
 	}
 
 	/* Flush any work that raced with us exiting */
-	if (!list_empty(&bdi->work_list))
+	if (wb->nr_works)
 		wb_do_writeback(wb, 1);
 
 	trace_writeback_thread_stop(bdi);
@@ -939,6 +997,70 @@ void wakeup_flusher_threads(long nr_pages)
 	rcu_read_unlock();
 }
 
+/**
+ * bdi_set_flushers - set how many flusher threads write back a bdi
+ * @bdi: the backing device
+ * @nr: number of flushers to spread its dirty inodes over
+ *
+ * The inodes of flushers that go away are moved onto the lists of the first
+ * one, which also takes over their part of the works still queued. Inodes
+ * only move onto the lists of new flushers once they are redirtied or
+ * requeued. The forker thread starts and stops the threads themselves.
+ */
+int bdi_set_flushers(struct backing_dev_info *bdi, unsigned int nr)
+{
+	struct bdi_writeback *dst = &bdi->wb[0];
+	struct wb_writeback_work *work;
+	unsigned int i, old;
+
+	if (nr < 1 || nr > BDI_MAX_FLUSHERS || bdi_cap_flush_forker(bdi))
+		return -EINVAL;
+
+	spin_lock(&inode_lock);
+	spin_lock_bh(&bdi->wb_lock);
+	old = bdi->nr_flushers;
+	bdi->nr_flushers = nr;
+
+	for (i = nr; i < old; i++) {
+		struct bdi_writeback *wb = &bdi->wb[i];
+
+		/* at the old end, so that they are written back first */
+		list_splice_tail_init(&wb->b_dirty, &dst->b_dirty);
+		list_splice_init(&wb->b_io, &dst->b_more_io);
+		list_splice_init(&wb->b_more_io, &dst->b_more_io);
+	}
+
+	/*
+	 * Flushers that go away may have taken a work already and lost the
+	 * inodes under it: have the first flusher run every pending work over
+	 * the inodes it now has, even if it was already done with it.
+	 */
+	if (nr < old) {
+		list_for_each_entry(work, &bdi->work_list, list) {
+			for (i = nr; i < old; i++) {
+				if (work->todo & (1UL << i)) {
+					work->todo &= ~(1UL << i);
+					bdi->wb[i].nr_works--;
+					work->pending--;
+				}
+			}
+			if (!(work->todo & 1)) {
+				work->todo |= 1;
+				dst->nr_works++;
+				work->pending++;
+			}
+		}
+	}
+
+	bdi_wakeup_flusher(bdi);
+	spin_unlock_bh(&bdi->wb_lock);
+	spin_unlock(&inode_lock);
+
+	/* let the forker stop the threads no longer needed */
+	wake_up_process(default_backing_dev_info.wb[0].task);
+	return 0;
+}
+
 static noinline void block_dump___mark_inode_dirty(struct inode *inode)
 {
 	if (inode->i_ino || strcmp(inode->i_sb->s_id, "bdev")) {
@@ -992,6 +1114,7 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 {
 	struct super_block *sb = inode->i_sb;
 	struct backing_dev_info *bdi = NULL;
+	struct bdi_writeback *wb = NULL;
 	bool wakeup_bdi = false;
 
 	/*
@@ -1047,6 +1170,7 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 		 */
 		if (!was_dirty) {
 			bdi = inode_to_bdi(inode);
+			wb = bdi_inode_wb(bdi, inode);
 
 			if (bdi_cap_writeback_dirty(bdi)) {
 				WARN(!test_bit(BDI_registered, &bdi->state),
@@ -1054,23 +1178,23 @@ void __mark_inode_dirty(struct inode *inode, int flags)
 
 				/*
 				 * If this is the first dirty inode for this
-				 * bdi, we have to wake-up the corresponding
+				 * flusher, we have to wake-up the corresponding
 				 * bdi thread to make sure background
 				 * write-back happens later.
 				 */
-				if (!wb_has_dirty_io(&bdi->wb))
+				if (!wb_has_dirty_io(wb))
 					wakeup_bdi = true;
 			}
 
 			inode->dirtied_when = jiffies;
-			list_move(&inode->i_wb_list, &bdi->wb.b_dirty);
+			list_move(&inode->i_wb_list, &wb->b_dirty);
 		}
 	}
 out:
 	spin_unlock(&inode_lock);
 
 	if (wakeup_bdi)
-		bdi_wakeup_thread_delayed(bdi);
+		wb_wakeup_thread_delayed(wb);
 }
 EXPORT_SYMBOL(__mark_inode_dirty);
 
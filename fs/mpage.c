@@ -364,23 +364,33 @@ mpage_readpages(struct address_space *mapping, struct list_head *pages,
 	sector_t last_block_in_bio = 0;
 	struct buffer_head map_bh;
 	unsigned long first_logical_block = 0;
+	struct pagevec pvec;
+	int i, added;
 
 	map_bh.b_state = 0;
 	map_bh.b_size = 0;
+	pagevec_init(&pvec, 0);
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
 		struct page *page = list_entry(pages->prev, struct page, lru);
 
 		prefetchw(&page->flags);
 		list_del(&page->lru);
-		if (!add_to_page_cache_lru(page, mapping,
-					page->index, GFP_KERNEL)) {
-			bio = do_mpage_readpage(bio, page,
-					nr_pages - page_idx,
+		if (pagevec_add(&pvec, page) && page_idx + 1 < nr_pages)
+			continue;
+
+		/* into the page cache a pagevec at a time */
+		added = add_to_page_cache_lru_vec(&pvec, mapping, GFP_KERNEL);
+		for (i = 0; i < added; i++) {
+			bio = do_mpage_readpage(bio, pvec.pages[i],
+					nr_pages - page_idx +
+					pagevec_count(&pvec) - 1 - i,
 					&last_block_in_bio, &map_bh,
 					&first_logical_block,
 					get_block);
 		}
-		page_cache_release(page);
+		for (i = 0; i < pagevec_count(&pvec); i++)
+			page_cache_release(pvec.pages[i]);
+		pagevec_reinit(&pvec);
 	}
 	BUG_ON(!list_empty(pages));
 	if (bio)
@@ -83,6 +83,7 @@
 #include <linux/pid_namespace.h>
 #include <linux/fs_struct.h>
 #include <linux/slab.h>
+#include <linux/ksm.h>
 #include "internal.h"
 
 /* NOTE:
@@ -2752,6 +2753,94 @@ static int proc_pid_personality(struct seq_file *m, struct pid_namespace *ns,
 	return 0;
 }
 
+#ifdef CONFIG_KSM
+/*
+ * The slots of all the vmas of the process summed up, see ksm_vma_stat().
+ * Scan coverage is the share of its pages scanned in this round.
+ */
+static int proc_pid_ksm_stat(struct seq_file *m, struct pid_namespace *ns,
+				struct pid *pid, struct task_struct *task)
+{
+	struct ksm_vma_stat sum, stat;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+	unsigned long dedup = 0, vmas = 0;
+
+	mm = mm_for_maps(task);
+	if (!mm)
+		return -EACCES;
+
+	memset(&sum, 0, sizeof(sum));
+	sum.rung = -1;
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		ksm_vma_stat(vma, &stat);
+		if (!stat.pages)
+			continue;
+		vmas++;
+		sum.pages += stat.pages;
+		sum.pages_merged += stat.pages_merged;
+		sum.pages_cowed += stat.pages_cowed;
+		sum.pages_scanned += stat.pages_scanned;
+		dedup += stat.dedup_ratio * stat.pages;
+		if (stat.rung > sum.rung)
+			sum.rung = stat.rung;
+	}
+	up_read(&mm->mmap_sem);
+
+	seq_printf(m, "merge_enabled %d\n",
+		   !test_bit(MMF_VM_NOKSM, &mm->flags));
+	mmput(mm);
+
+	seq_printf(m, "vmas %lu\n", vmas);
+	seq_printf(m, "pages %lu\n", sum.pages);
+	seq_printf(m, "pages_merged %lu\n", sum.pages_merged);
+	seq_printf(m, "pages_cowed %lu\n", sum.pages_cowed);
+	seq_printf(m, "pages_scanned %lu\n", sum.pages_scanned);
+	seq_printf(m, "scan_coverage %lu%%\n",
+		   sum.pages ? sum.pages_scanned * 100 / sum.pages : 0);
+	seq_printf(m, "dedup_ratio %lu%%\n",
+		   sum.pages ? dedup / sum.pages : 0);
+	seq_printf(m, "rung_max %d\n", sum.rung);
+
+	return 0;
+}
+
+/*
+ * The bottom-k MinHash sketch of the pages of the process, one hash per
+ * line in ascending order, see ksm_mm_sketch(). Empty unless sketch_size
+ * is set in /sys/kernel/mm/ksm.
+ */
+static int proc_pid_ksm_sketch(struct seq_file *m, struct pid_namespace *ns,
+			       struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm;
+	unsigned int i, nr;
+	u32 *sketch;
+
+	mm = mm_for_maps(task);
+	if (!mm)
+		return -EACCES;
+
+	sketch = kmalloc(KSM_SKETCH_MAX * sizeof(u32), GFP_KERNEL);
+	if (!sketch) {
+		mmput(mm);
+		return -ENOMEM;
+	}
+
+	down_read(&mm->mmap_sem);
+	nr = ksm_mm_sketch(mm, sketch);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	for (i = 0; i < nr; i++)
+		seq_printf(m, "%08x\n", sketch[i]);
+	kfree(sketch);
+
+	return 0;
+}
+#endif /* CONFIG_KSM */
+
 /*
  * Thread groups
  */
@@ -2797,6 +2886,7 @@ static const struct pid_entry tgid_base_stuff[] = {
 #ifdef CONFIG_PROC_PAGE_MONITOR
 	REG("clear_refs", S_IWUSR, proc_clear_refs_operations),
 	REG("smaps",      S_IRUGO, proc_smaps_operations),
+	ONE("smaps_summary", S_IRUGO, proc_pid_smaps_summary),
 	REG("pagemap",    S_IRUSR, proc_pagemap_operations),
 #endif
 #ifdef CONFIG_SECURITY
@@ -2819,6 +2909,10 @@ static const struct pid_entry tgid_base_stuff[] = {
 #endif
 #ifdef CONFIG_CGROUPS
 	REG("cgroup",  S_IRUGO, proc_cgroup_operations),
+#endif
+#ifdef CONFIG_KSM
+	ONE("ksm_stat",   S_IRUGO, proc_pid_ksm_stat),
+	ONE("ksm_sketch", S_IRUGO, proc_pid_ksm_sketch),
 #endif
 	INF("oom_score",  S_IRUGO, proc_oom_score),
 	REG("oom_adj",    S_IRUGO|S_IWUSR, proc_oom_adjust_operations),
@@ -3133,6 +3227,7 @@ static const struct pid_entry tid_base_stuff[] = {
 #ifdef CONFIG_PROC_PAGE_MONITOR
 	REG("clear_refs", S_IWUSR, proc_clear_refs_operations),
 	REG("smaps",     S_IRUGO, proc_smaps_operations),
+	ONE("smaps_summary", S_IRUGO, proc_pid_smaps_summary),
 	REG("pagemap",    S_IRUSR, proc_pagemap_operations),
 #endif
 #ifdef CONFIG_SECURITY
@@ -88,6 +88,7 @@ static int meminfo_proc_show(struct seq_file *m, void *v)
 		"KernelStack:    %8lu kB\n"
 		"PageTables:     %8lu kB\n"
 #ifdef CONFIG_KSM
+		"KsmShared:      %8lu kB\n"
 		"KsmSharing:     %8lu kB\n"
 #endif
 #ifdef CONFIG_QUICKLIST
@@ -149,6 +150,7 @@ static int meminfo_proc_show(struct seq_file *m, void *v)
 		global_page_state(NR_KERNEL_STACK) * THREAD_SIZE / 1024,
 		K(global_page_state(NR_PAGETABLE)),
 #ifdef CONFIG_KSM
+		K(global_page_state(NR_KSM_PAGES_SHARED)),
 		K(global_page_state(NR_KSM_PAGES_SHARING)),
 #endif
 #ifdef CONFIG_QUICKLIST
@@ -9,11 +9,14 @@
 #include <linux/seq_file.h>
 #include <linux/hugetlb.h>
 #include <linux/kernel-page-flags.h>
+#include <linux/slab.h>
 #include <asm/uaccess.h>
 #include "internal.h"
 
 #define KPMSIZE sizeof(u64)
 #define KPMMASK (KPMSIZE - 1)
+/* entries gathered on the stack and copied out at once */
+#define KPMBATCH 64
 
 /* /proc/kpagecount - an array exposing page counts
  *
@@ -28,7 +31,8 @@ static ssize_t kpagecount_read(struct file *file, char __user *buf,
 	unsigned long src = *ppos;
 	unsigned long pfn;
 	ssize_t ret = 0;
-	u64 pcount;
+	u64 pcount[KPMBATCH];
+	int i, nr;
 
 	pfn = src / KPMSIZE;
 	count = min_t(size_t, count, (max_pfn * KPMSIZE) - src);
@@ -36,23 +40,26 @@ static ssize_t kpagecount_read(struct file *file, char __user *buf,
 		return -EINVAL;
 
 	while (count > 0) {
-		if (pfn_valid(pfn))
-			ppage = pfn_to_page(pfn);
-		else
-			ppage = NULL;
-		if (!ppage || PageSlab(ppage))
-			pcount = 0;
-		else
-			pcount = page_mapcount(ppage);
-
-		if (put_user(pcount, out)) {
+		nr = min_t(size_t, count / KPMSIZE, KPMBATCH);
+		for (i = 0; i < nr; i++, pfn++) {
+			if (pfn_valid(pfn))
+				ppage = pfn_to_page(pfn);
+			else
+				ppage = NULL;
+			if (!ppage || PageSlab(ppage))
+				pcount[i] = 0;
+			else
+				pcount[i] = page_mapcount(ppage);
+		}
+
+		if (copy_to_user(out, pcount, nr * KPMSIZE)) {
 			ret = -EFAULT;
 			break;
 		}
 
-		pfn++;
-		out++;
-		count -= KPMSIZE;
+		out += nr;
+		count -= nr * KPMSIZE;
+		cond_resched();
 	}
 
 	*ppos += (char __user *)out - buf;
@@ -162,14 +169,20 @@ u64 stable_page_flags(struct page *page)
 	return u;
 };
 
+static inline struct page *kpage_of(unsigned long pfn)
+{
+	return pfn_valid(pfn) ? pfn_to_page(pfn) : NULL;
+}
+
 static ssize_t kpageflags_read(struct file *file, char __user *buf,
 			     size_t count, loff_t *ppos)
 {
 	u64 __user *out = (u64 __user *)buf;
-	struct page *ppage;
 	unsigned long src = *ppos;
 	unsigned long pfn;
 	ssize_t ret = 0;
+	u64 flags[KPMBATCH];
+	int i, nr;
 
 	pfn = src / KPMSIZE;
 	count = min_t(unsigned long, count, (max_pfn * KPMSIZE) - src);
@@ -177,19 +190,18 @@ static ssize_t kpageflags_read(struct file *file, char __user *buf,
 		return -EINVAL;
 
 	while (count > 0) {
-		if (pfn_valid(pfn))
-			ppage = pfn_to_page(pfn);
-		else
-			ppage = NULL;
+		nr = min_t(unsigned long, count / KPMSIZE, KPMBATCH);
+		for (i = 0; i < nr; i++, pfn++)
+			flags[i] = stable_page_flags(kpage_of(pfn));
 
-		if (put_user(stable_page_flags(ppage), out)) {
+		if (copy_to_user(out, flags, nr * KPMSIZE)) {
 			ret = -EFAULT;
 			break;
 		}
 
-		pfn++;
-		out++;
-		count -= KPMSIZE;
+		out += nr;
+		count -= nr * KPMSIZE;
+		cond_resched();
 	}
 
 	*ppos += (char __user *)out - buf;
@@ -203,10 +215,159 @@ static const struct file_operations proc_kpageflags_operations = {
 	.read = kpageflags_read,
 };
 
+/* /proc/kpagerange - the runs of pfns whose kpageflags match a filter
+ *
+ * Writing "mask value" sets the filter of the open file, both taking the
+ * KPF_* bits: a pfn matches if its flags & mask == value, so "0x200000
+ * 0x200000" selects the KSM pages. Each read then returns pairs of u64, the
+ * first pfn of a run of matching ones and its length, from the pfn the file
+ * position is at onwards. The position is a pfn, not a byte offset: it is
+ * left after the last run returned, or at max_pfn once all are.
+ */
+struct kpagerange {
+	u64 mask;
+	u64 value;
+};
+
+/* runs gathered before being copied out, in u64 pairs */
+#define KPRBATCH (PAGE_SIZE / (2 * KPMSIZE))
+
+static int kpagerange_open(struct inode *inode, struct file *file)
+{
+	struct kpagerange *filter;
+
+	filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+	if (!filter)
+		return -ENOMEM;
+
+	file->private_data = filter;
+	return 0;
+}
+
+static int kpagerange_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t kpagerange_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct kpagerange *filter = file->private_data;
+	char kbuf[64];
+	unsigned long long mask, value;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+
+	if (sscanf(kbuf, "%llx %llx", &mask, &value) != 2 || (value & ~mask))
+		return -EINVAL;
+
+	filter->mask = mask;
+	filter->value = value;
+	return count;
+}
+
+static ssize_t kpagerange_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct kpagerange *filter = file->private_data;
+	u64 __user *out = (u64 __user *)buf;
+	unsigned long pfn = *ppos, start = 0;
+	unsigned long max = count / (2 * KPMSIZE);
+	unsigned long nr = 0, done = 0;
+	bool in_run = false, match;
+	ssize_t ret = 0;
+	u64 *runs;
+
+	if (count & (2 * KPMSIZE - 1))
+		return -EINVAL;
+	if (pfn >= max_pfn || !max)
+		return 0;
+
+	runs = (u64 *)__get_free_page(GFP_KERNEL);
+	if (!runs)
+		return -ENOMEM;
+
+	for (; pfn <= max_pfn; pfn++) {
+		match = pfn < max_pfn && (stable_page_flags(kpage_of(pfn)) &
+					  filter->mask) == filter->value;
+		if (match && !in_run) {
+			start = pfn;
+			in_run = true;
+		} else if (!match && in_run) {
+			runs[2 * nr] = start;
+			runs[2 * nr + 1] = pfn - start;
+			in_run = false;
+			if (++nr == KPRBATCH || done + nr == max) {
+				if (copy_to_user(out, runs, nr * 2 * KPMSIZE)) {
+					ret = -EFAULT;
+					break;
+				}
+				out += 2 * nr;
+				done += nr;
+				nr = 0;
+				if (done == max)
+					break;
+			}
+		}
+
+		if (!(pfn & (KPMBATCH * KPMBATCH - 1))) {
+			if (fatal_signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+			cond_resched();
+		}
+	}
+
+	if (!ret && nr && copy_to_user(out, runs, nr * 2 * KPMSIZE))
+		ret = -EFAULT;
+	free_page((unsigned long)runs);
+	if (ret)
+		return ret;
+
+	done += nr;
+	/* the pfn ending the last run returned, to go on from */
+	*ppos = min(pfn, max_pfn);
+	return done * 2 * KPMSIZE;
+}
+
+static loff_t kpagerange_lseek(struct file *file, loff_t offset, int orig)
+{
+	switch (orig) {
+	case 0:
+		break;
+	case 1:
+		offset += file->f_pos;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (offset < 0)
+		return -EINVAL;
+
+	file->f_pos = offset;
+	return offset;
+}
+
+static const struct file_operations proc_kpagerange_operations = {
+	.open = kpagerange_open,
+	.release = kpagerange_release,
+	.llseek = kpagerange_lseek,
+	.read = kpagerange_read,
+	.write = kpagerange_write,
+};
+
 static int __init proc_page_init(void)
 {
 	proc_create("kpagecount", S_IRUSR, NULL, &proc_kpagecount_operations);
 	proc_create("kpageflags", S_IRUSR, NULL, &proc_kpageflags_operations);
+	proc_create("kpagerange", S_IRUSR | S_IWUSR, NULL,
+		    &proc_kpagerange_operations);
 	return 0;
 }
 module_init(proc_page_init);
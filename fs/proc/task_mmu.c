@@ -9,6 +9,7 @@
 #include <linux/mempolicy.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
+#include <linux/ksm.h>
 
 #include <asm/elf.h>
 #include <asm/uaccess.h>
@@ -109,7 +110,7 @@ static void *m_start(struct seq_file *m, loff_t *pos)
 
 	/*
 	 * We remember last_addr rather than next_addr to hit with
-	 * mmap_cache most of the time. We have zero last_addr at
+	 * vmacache most of the time. We have zero last_addr at
 	 * the beginning and also after lseek. We will have -1 last_addr
 	 * after the end of the vmas.
 	 */
@@ -392,6 +393,7 @@ static int show_smap(struct seq_file *m, void *v)
 	struct task_struct *task = priv->task;
 	struct vm_area_struct *vma = v;
 	struct mem_size_stats mss;
+	struct ksm_vma_stat ksm;
 	struct mm_walk smaps_walk = {
 		.pmd_entry = smaps_pte_range,
 		.mm = vma->vm_mm,
@@ -435,6 +437,19 @@ static int show_smap(struct seq_file *m, void *v)
 		   (vma->vm_flags & VM_LOCKED) ?
 			(unsigned long)(mss.pss >> (10 + PSS_SHIFT)) : 0);
 
+	ksm_vma_stat(vma, &ksm);
+	if (ksm.pages)
+		seq_printf(m,
+			   "KsmMerged:      %8lu kB\n"
+			   "KsmCowed:       %8lu kB\n"
+			   "KsmScanned:     %8lu kB\n"
+			   "KsmRung:        %8d\n"
+			   "KsmDedupRatio:  %8lu %%\n",
+			   ksm.pages_merged << (PAGE_SHIFT - 10),
+			   ksm.pages_cowed << (PAGE_SHIFT - 10),
+			   ksm.pages_scanned << (PAGE_SHIFT - 10),
+			   ksm.rung, ksm.dedup_ratio);
+
 	if (m->count < m->size)  /* vma is copied successfully */
 		m->version = (vma != get_gate_vma(task)) ? vma->vm_start : 0;
 	return 0;
@@ -452,6 +467,54 @@ static int smaps_open(struct inode *inode, struct file *file)
 	return do_maps_open(inode, file, &proc_pid_smaps_op);
 }
 
+/*
+ * /proc/pid/smaps_summary - the totals of smaps a poller usually wants, from
+ * the rss counters of the mm and the KSM slots of its vmas, without walking
+ * a page table. Pss is left out: it depends on the mapcount of every page,
+ * which only a walk can see. The counters may lag the page tables a little,
+ * as those of /proc/pid/status do, and KsmShared is as of the last scan.
+ */
+int proc_pid_smaps_summary(struct seq_file *m, struct pid_namespace *ns,
+			   struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	struct ksm_vma_stat ksm;
+	unsigned long anon, file, swap, ksm_pages = 0;
+
+	mm = mm_for_maps(task);
+	if (!mm)
+		return -EACCES;
+
+	anon = get_mm_counter(mm, MM_ANONPAGES);
+	file = get_mm_counter(mm, MM_FILEPAGES);
+	swap = get_mm_counter(mm, MM_SWAPENTS);
+
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		ksm_vma_stat(vma, &ksm);
+		ksm_pages += ksm.pages_ksm;
+	}
+	up_read(&mm->mmap_sem);
+
+	seq_printf(m,
+		   "Size:           %8lu kB\n"
+		   "Rss:            %8lu kB\n"
+		   "Anonymous:      %8lu kB\n"
+		   "File:           %8lu kB\n"
+		   "Swap:           %8lu kB\n"
+		   "KsmShared:      %8lu kB\n",
+		   mm->total_vm << (PAGE_SHIFT - 10),
+		   (anon + file) << (PAGE_SHIFT - 10),
+		   anon << (PAGE_SHIFT - 10),
+		   file << (PAGE_SHIFT - 10),
+		   swap << (PAGE_SHIFT - 10),
+		   ksm_pages << (PAGE_SHIFT - 10));
+	mmput(mm);
+
+	return 0;
+}
+
 const struct file_operations proc_smaps_operations = {
 	.open		= smaps_open,
 	.read		= seq_read,
@@ -571,6 +634,7 @@ struct pagemapread {
 
 #define PM_PRESENT          PM_STATUS(4LL)
 #define PM_SWAP             PM_STATUS(2LL)
+#define PM_KSM              PM_STATUS(1LL)
 #define PM_NOT_PRESENT      PM_PSHIFT(PAGE_SHIFT)
 #define PM_END_OF_BUFFER    1
 
@@ -603,15 +667,23 @@ static u64 swap_pte_to_pagemap_entry(pte_t pte)
 	return swp_type(e) | (swp_offset(e) << MAX_SWAPFILES_SHIFT);
 }
 
-static u64 pte_to_pagemap_entry(pte_t pte)
+static u64 pte_to_pagemap_entry(struct vm_area_struct *vma, unsigned long addr,
+				pte_t pte)
 {
 	u64 pme = 0;
+	struct page *page;
+
 	if (is_swap_pte(pte))
 		pme = PM_PFRAME(swap_pte_to_pagemap_entry(pte))
 			| PM_PSHIFT(PAGE_SHIFT) | PM_SWAP;
-	else if (pte_present(pte))
+	else if (pte_present(pte)) {
 		pme = PM_PFRAME(pte_pfn(pte))
 			| PM_PSHIFT(PAGE_SHIFT) | PM_PRESENT;
+		/* the ptes of a merged page all report the pfn of its kpage */
+		page = vm_normal_page(vma, addr, pte);
+		if (page && PageKsm(page))
+			pme |= PM_KSM;
+	}
 	return pme;
 }
 
@@ -638,7 +710,7 @@ static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 		if (vma && (vma->vm_start <= addr) &&
 		    !is_vm_hugetlb_page(vma)) {
 			pte = pte_offset_map(pmd, addr);
-			pfn = pte_to_pagemap_entry(*pte);
+			pfn = pte_to_pagemap_entry(vma, addr, *pte);
 			/* unmap before userspace copy */
 			pte_unmap(pte);
 		}
@@ -695,7 +767,7 @@ static int pagemap_hugetlb_range(pte_t *pte, unsigned long hmask,
  * Bits 0-4   swap type if swapped
  * Bits 5-55  swap offset if swapped
  * Bits 55-60 page shift (page size = 1<<page shift)
- * Bit  61    reserved for future use
+ * Bit  61    page is a KSM page, shared with the others of the same PFN
  * Bit  62    page swapped
  * Bit  63    page present
  *
@@ -703,7 +775,8 @@ static int pagemap_hugetlb_range(pte_t *pte, unsigned long hmask,
  * encoding of the swap file number and the page's offset into the
  * swap. Unmapped pages return a null PFN. This allows determining
  * precisely which pages are mapped (or in swap) and comparing mapped
- * pages between processes.
+ * pages between processes. The KSM bit lets a user like live migration
+ * send a merged page once and refer to it by its PFN for the others.
  *
  * Efficient users of this interface will use /proc/pid/maps to
  * determine which areas of memory are actually mapped and llseek to
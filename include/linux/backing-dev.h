@@ -10,6 +10,7 @@
 
 #include <linux/percpu_counter.h>
 #include <linux/log2.h>
+#include <linux/hash.h>
 #include <linux/proportions.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
@@ -31,7 +32,6 @@ enum bdi_state {
 	BDI_async_congested,	/* The async (write) queue is getting full */
 	BDI_sync_congested,	/* The sync queue is getting full */
 	BDI_registered,		/* bdi_register() was done */
-	BDI_writeback_running,	/* Writeback is in progress */
 	BDI_unused,		/* Available bits start here */
 };
 
@@ -40,14 +40,23 @@ typedef int (congested_fn)(void *, int);
 enum bdi_stat_item {
 	BDI_RECLAIMABLE,
 	BDI_WRITEBACK,
+	BDI_DIRTIED,
+	BDI_WRITTEN,
 	NR_BDI_STAT_ITEMS
 };
 
 #define BDI_STAT_BATCH (8*(1+ilog2(nr_cpu_ids)))
 
+/* Write bandwidth a new bdi is assumed to have, 100MB/s in pages */
+#define INIT_BW		(100 << (20 - PAGE_SHIFT))
+
+/* Flusher threads a bdi may spread its dirty inodes over */
+#define BDI_MAX_FLUSHERS	8
+
 struct bdi_writeback {
 	struct backing_dev_info *bdi;	/* our parent bdi */
-	unsigned int nr;
+	unsigned int nr;		/* index in bdi->wb[] */
+	unsigned int nr_works;		/* queued works not yet taken */
 
 	unsigned long last_old_flush;	/* last old data flush */
 	unsigned long last_active;	/* last time bdi thread was active */
@@ -76,10 +85,19 @@ struct backing_dev_info {
 	struct prop_local_percpu completions;
 	int dirty_exceeded;
 
+	spinlock_t bw_lock;		/* serializes the estimates below */
+	unsigned long bw_time_stamp;	/* when they were last updated */
+	unsigned long dirtied_stamp;	/* BDI_DIRTIED at bw_time_stamp */
+	unsigned long written_stamp;	/* BDI_WRITTEN at bw_time_stamp */
+	unsigned long write_bandwidth;	/* pages written back per second */
+	unsigned long dirty_ratelimit;	/* pages per second a dirtier gets */
+
 	unsigned int min_ratio;
 	unsigned int max_ratio, max_prop_frac;
 
-	struct bdi_writeback wb;  /* default writeback info for this bdi */
+	struct bdi_writeback wb[BDI_MAX_FLUSHERS]; /* one per flusher thread */
+	unsigned int nr_flushers; /* of wb[] in use, changed under both locks */
+	atomic_t wb_running;	  /* flushers doing writeback right now */
 	spinlock_t wb_lock;	  /* protects work_list */
 
 	struct list_head work_list;
@@ -106,8 +124,9 @@ void bdi_start_writeback(struct backing_dev_info *bdi, long nr_pages);
 void bdi_start_background_writeback(struct backing_dev_info *bdi);
 int bdi_writeback_thread(void *data);
 int bdi_has_dirty_io(struct backing_dev_info *bdi);
+int bdi_set_flushers(struct backing_dev_info *bdi, unsigned int nr);
 void bdi_arm_supers_timer(void);
-void bdi_wakeup_thread_delayed(struct backing_dev_info *bdi);
+void wb_wakeup_thread_delayed(struct bdi_writeback *wb);
 
 extern spinlock_t bdi_lock;
 extern struct list_head bdi_list;
@@ -120,6 +139,18 @@ static inline int wb_has_dirty_io(struct bdi_writeback *wb)
 	       !list_empty(&wb->b_more_io);
 }
 
+/*
+ * The flusher of @bdi whose lists @inode goes on: inodes are spread over
+ * the flushers by a hash of their number.  Called under inode_lock.
+ */
+static inline struct bdi_writeback *bdi_inode_wb(struct backing_dev_info *bdi,
+						 struct inode *inode)
+{
+	if (bdi->nr_flushers == 1)
+		return &bdi->wb[0];
+	return &bdi->wb[hash_long(inode->i_ino, 8) % bdi->nr_flushers];
+}
+
 static inline void __add_bdi_stat(struct backing_dev_info *bdi,
 		enum bdi_stat_item item, s64 amount)
 {
@@ -922,6 +922,8 @@ struct file_ra_state {
 	unsigned int ra_pages;		/* Maximum readahead window */
 	unsigned int mmap_miss;		/* Cache miss stat for mmap accesses */
 	loff_t prev_pos;		/* Cache last read() position */
+	unsigned short waste;		/* decayed % of readahead left unused */
+	unsigned short accounted;	/* window already counted in waste */
 };
 
 /*
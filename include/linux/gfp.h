@@ -315,6 +315,26 @@ static inline struct page *alloc_pages_node(int nid, gfp_t gfp_mask,
 	return __alloc_pages(gfp_mask, order, node_zonelist(nid, gfp_mask));
 }
 
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, struct zonelist *zonelist,
+				 nodemask_t *nodemask, unsigned long nr_pages,
+				 struct page **pages);
+
+/* Fill @pages with up to @nr_pages order-0 pages, preferably from @nid */
+static inline unsigned long alloc_pages_bulk_node(int nid, gfp_t gfp_mask,
+						  unsigned long nr_pages,
+						  struct page **pages)
+{
+	/* Unknown node is current node */
+	if (nid < 0)
+		nid = numa_node_id();
+
+	return __alloc_pages_bulk(gfp_mask, node_zonelist(nid, gfp_mask), NULL,
+				  nr_pages, pages);
+}
+
+#define alloc_pages_bulk(gfp_mask, nr_pages, pages)			\
+	alloc_pages_bulk_node(numa_node_id(), gfp_mask, nr_pages, pages)
+
 static inline struct page *alloc_pages_exact_node(int nid, gfp_t gfp_mask,
 						unsigned int order)
 {
@@ -366,6 +386,13 @@ extern void free_hot_cold_page(struct page *page, int cold);
 #define free_page(addr) free_pages((addr), 0)
 
 void page_alloc_init(void);
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+void page_alloc_init_late(void);
+#else
+static inline void page_alloc_init_late(void)
+{
+}
+#endif
 void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp);
 void drain_all_pages(void);
 void drain_local_pages(void *dummy);
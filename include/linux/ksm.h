@@ -16,6 +16,17 @@
 struct stable_node;
 struct mem_cgroup;
 
+/* The slots of a vma, as /proc/<pid>/smaps and ksm_stat show them */
+struct ksm_vma_stat {
+	unsigned long pages;		/* in its slots, 0 if none */
+	unsigned long pages_merged;	/* since the slots entered */
+	unsigned long pages_cowed;	/* merged ones written since then */
+	unsigned long pages_ksm;	/* mapping KSM pages, as last scanned */
+	unsigned long pages_scanned;	/* in this round */
+	unsigned long dedup_ratio;	/* of the last round, in percent */
+	int rung;			/* the highest, -1 if none entered */
+};
+
 struct page *ksm_does_need_to_copy(struct page *page,
 			struct vm_area_struct *vma, unsigned long address);
 
@@ -44,10 +55,44 @@ static inline void set_page_stable_node(struct page *page,
 				(PAGE_MAPPING_ANON | PAGE_MAPPING_KSM);
 }
 
+/*
+ * vma->ksm_advice. A vma merged into a neighbour takes the advice of the
+ * neighbour. One split keeps it on both sides.
+ */
+#define KSM_ADVICE_NONE		0	/* scanned as any other */
+#define KSM_ADVICE_MERGEABLE	1	/* its slots enter the top rung */
+#define KSM_ADVICE_UNMERGEABLE	2	/* no slots, never merged */
+#define KSM_ADVICE_ONCE		3	/* top rung, for one full scan only */
+
+/* The most hashes a page-content sketch of ksm_mm_sketch() holds */
+#define KSM_SKETCH_MAX		256
+
 /* must be done before linked to mm */
 extern inline void ksm_vma_add_new(struct vm_area_struct *vma);
+extern void ksm_vma_add_forked(struct vm_area_struct *vma,
+			       struct vm_area_struct *parent);
 
+extern void ksm_vma_moved(struct vm_area_struct *vma, unsigned long old_addr,
+			  struct vm_area_struct *new_vma,
+			  unsigned long new_addr, unsigned long len);
 extern void ksm_remove_vma(struct vm_area_struct *vma);
+extern int ksm_madvise(struct vm_area_struct *vma, int advice);
+extern int ksm_set_memory_merge(struct mm_struct *mm, int merge);
+extern void ksm_vma_cowed(struct vm_area_struct *vma, unsigned long address);
+extern void ksm_vma_stat(struct vm_area_struct *vma,
+			 struct ksm_vma_stat *stat);
+extern unsigned int ksm_mm_sketch(struct mm_struct *mm, u32 *sketch);
+extern void ksm_dirty_log_hint(struct mm_struct *mm, unsigned long start,
+			       unsigned long *bitmap, unsigned long npages);
+extern long ksm_merge_zero_range(struct mm_struct *mm, unsigned long start,
+				 unsigned long end);
+extern void ksm_swap_park(struct page *page, unsigned long swap);
+extern void ksm_swap_reshare_page(struct page *page, unsigned long swap);
+extern void ksm_swap_freed(unsigned long swap);
+extern int ksm_swap_parked(unsigned long swap);
+extern int ksm_swap_dedup_page(struct page *page);
+extern void ksm_swap_dedup_note(struct page *page);
+extern void ksm_memory_pressure(void);
 extern inline int unmerge_ksm_pages(struct vm_area_struct *vma,
 				    unsigned long start, unsigned long end);
 
@@ -57,7 +102,9 @@ extern inline int unmerge_ksm_pages(struct vm_area_struct *vma,
  * it might be faulted into a different anon_vma (or perhaps to a different
  * offset in the same anon_vma).  do_swap_page() cannot do all the locking
  * needed to reconstitute a cross-anon_vma KSM page: for now it has to make
- * a copy, and leave remerging the pages to a later pass of ksmd.
+ * a copy, and leave remerging the pages to a later pass of ksmd. Unless
+ * ksm_swap_reshare_page() found the stable node the page had parked, then
+ * it's a KSM page again and none of this applies.
  *
  * We'd like to make this conditional on vma->vm_flags & VM_MERGEABLE,
  * but what if the vma was unmerged while the page was swapped out?
@@ -78,6 +125,8 @@ int try_to_unmap_ksm(struct page *page, enum ttu_flags flags);
 int rmap_walk_ksm(struct page *page, int (*rmap_one)(struct page *,
 		  struct vm_area_struct *, unsigned long, void *), void *arg);
 void ksm_migrate_page(struct page *newpage, struct page *oldpage);
+int ksm_page_mm_only(struct page *page, struct mm_struct *mm);
+int ksm_memory_failure(struct page *page);
 
 /* Each rung of this ladder is a list of VMAs having a same scan ratio */
 struct scan_rung {
@@ -92,31 +141,85 @@ struct scan_rung {
 	unsigned long vma_num;
 	//unsigned long vma_finished;
 	unsigned long scan_turn;
+	unsigned long round_start_j; /* when its slots started their round */
+	unsigned long revisit_last_ms; /* how long its last round took */
+	unsigned long revisit_misses; /* rounds over its revisit target */
 };
 
 struct vma_slot {
 	struct list_head ksm_list;
 	struct list_head slot_list;
 	unsigned long dedup_ratio;
-	int ksm_index; /* -1 if vma is not in inter-table,
-				positive otherwise */
+	unsigned long last_dedup_ratio; /* of the last round it was scanned */
+	unsigned long dedup_avg; /* dedup_ratio decayed over its rounds */
+	unsigned long dedup_num; /* estimated duplicated pages this round */
+	unsigned long dup_wide; /* found on widely shared pages, not paired */
+	struct list_head intertab_list; /* empty if not in inter-table */
+	struct list_head pairs_lo; /* vma_pairs with this as slot[0] */
+	struct list_head pairs_hi; /* vma_pairs with this as slot[1] only */
 	unsigned long pages_scanned;
 	unsigned long last_scanned;
 	unsigned long pages_to_scan;
 	struct scan_rung *rung;
-	struct page **rmap_list_pool;
+	void **rmap_list_pool; /* the addresses of its pool pages, or NULLs */
 	unsigned long *pool_counts;
 	unsigned long pool_size;
+	/* of the one pool a slot of up to a pool page of entries needs */
+	void *pool_one;
+	unsigned long pool_count_one;
 	struct vm_area_struct *vma;
 	struct mm_struct *mm;
 	unsigned long ctime_j;
-	unsigned long pages;
-	unsigned char need_sort;
-	unsigned char need_rerand;
+	unsigned long vstart; /* start of the region of the vma it scans */
+	unsigned long pages; /* in its region */
+	struct vma_slot *next_region; /* of the same vma, NULL if last */
+	struct vma_slot_queue *queue; /* the per-cpu lists it is queued on */
+	/* no page table there, as last seen under the mmap_sem, or empty */
+	unsigned long hole_start;
+	unsigned long hole_end;
+	/* the permutation of this pass, see slot_perm_pick() */
+	unsigned char perm_window;
+	unsigned long perm_stride;
+	unsigned long perm_offset;
+	/* copied by fork, it skips the pages still shared with the parent */
+	unsigned char forked;
+	/* 1 + the rung to enter at: the parent's, the top if advised, or 0 */
+	unsigned char enter_rung;
+	/* MADV_MERGE_ONCE: 1 until fully scanned, then 2 and left alone */
+	unsigned char once;
+	/* collides too often at hash_strength, checked at full strength */
+	unsigned char strong_hash;
+	unsigned long hash_hits; /* tree lookups finding a candidate, round */
+	unsigned long hash_colli; /* those of them that were collisions */
 	unsigned long slot_scanned; /* It's scanned in this round */
 	unsigned long fully_scanned; /* the above four to be merged to status bits */
-	unsigned long pages_cowed; /* pages cowed this round */
+	struct list_head round_list; /* on ksm_round_slots once scanned */
+	unsigned long pages_cowed; /* pages cowed this round, in cold ranges */
+	/* the round pages_cowed and pages_collapsed count, stale ones are 0 */
+	unsigned long pages_round;
+	/* decaying COW count of each 1 << KSM_COW_HEAT_SHIFT pages, or NULL */
+	unsigned char *cow_heat;
+	unsigned char cow_heat_one; /* cow_heat of a slot of one range */
+	unsigned long heat_round; /* the round cow_heat was decayed to */
 	unsigned long pages_merged; /* pages merged this round */
+	unsigned long pages_merged_total; /* since it entered */
+	unsigned long pages_ksm; /* its rmap_items in the stable tree */
+	unsigned long pages_cowed_total; /* since it entered */
+	unsigned long pages_present; /* scanned this round and mapped */
+	unsigned long pages_holes; /* skipped this round as page table holes */
+	unsigned long pages_collapsed; /* collapsed by khugepaged this round */
+	unsigned char huge_hold; /* dedup-rich, khugepaged leaves it alone */
+	/* a big new one, on the top rung until its dedup ratio is measured */
+	unsigned char burst;
+	/* its tasks all frozen or stopped: 1 on the top rung, 2 once passed */
+	unsigned char quiesced;
+	/* off the ladder for its memcg: 1 on noadd, 2 once its vma is gone */
+	unsigned char excluded;
+	/* the scanner thread hashing this slot with ksm_thread_mutex dropped */
+	struct task_struct *scan_owner;
+	struct mem_cgroup *memcg; /* referenced when entering the scanner */
+	u32 *sketch; /* KSM_SKETCH_MAX room, the smallest sketch hashes first */
+	unsigned int sketch_nr;
 };
 
 
@@ -169,6 +272,7 @@ struct tree_node {
 	struct rb_node node; /* link in the main (un)stable rbtree */
 	struct rb_root sub_root; /* rb_root for sublevel collision rbtree */
 	u32 hash;
+	struct rb_root *root; /* the (un)stable tree it is linked in */
 	unsigned long count; /* how many sublevel tree nodes */
 	struct list_head all_list; /* all tree nodes in stable/unstable tree */
 };
@@ -183,11 +287,21 @@ struct tree_node {
 struct stable_node {
 	struct rb_node node; /* link in sub-rbtree */
 	struct tree_node *tree_node; /* it's tree node root in stable tree, NULL if it's in hell list */
-	struct hlist_head hlist;
+	struct hlist_head hlist; /* node_vmas, the ones updated this round first */
+	struct rb_root node_vmas; /* the same, by slot */
 	unsigned long kpfn;
 	u32 hash_max; /* if ==0 then it's not been calculated yet */
 	//struct vm_area_struct *old_vma;
 	struct list_head all_list; /* in a list for all stable nodes */
+	unsigned long swap; /* swap entry of its page while parked, or 0 */
+	unsigned int walk_start; /* rmap_item page_referenced_ksm() resumes */
+	unsigned int rmap_nr; /* rmap_items sharing its page */
+	struct hlist_node swap_hlist; /* parked, or reshared for ksmd */
+	u64 digest[2]; /* of its page for strong_digest, 0 until computed */
+	struct mem_cgroup *memcg; /* its page was charged to when merged */
+#ifdef CONFIG_MEMORY_HOTREMOVE
+	struct hlist_node kpfn_hlist; /* in the bucket of its kpfn's section */
+#endif
 };
 
 
@@ -203,36 +317,59 @@ struct node_vma {
 		unsigned long key;  /* slot is used as key sorted on hlist */
 	};
 	struct hlist_node hlist;
+	struct rb_node node; /* in head->node_vmas */
 	struct hlist_head rmap_hlist;
 	struct stable_node *head;
 	unsigned long last_update;
 };
 
+/**
+ * struct vma_pair - number of duplicated pages found between two vma_slots
+ * in this round, hashed by the two slots. slot[0] <= slot[1].
+ */
+struct vma_pair {
+	struct hlist_node hlist;
+	struct vma_slot *slot[2];
+	struct list_head lo_list; /* linked in slot[0]->pairs_lo */
+	struct list_head hi_list; /* linked in slot[1]->pairs_hi */
+	unsigned long dup_num;
+};
+
 /**
  * struct rmap_item - reverse mapping item for virtual addresses
- * @rmap_list: next rmap_item in mm_slot's singly-linked rmap_list
- * @anon_vma: pointer to anon_vma for this mm,address, when in stable tree
- * @mm: the memory structure this rmap_item is pointing into
+ * @slot: the vma_slot this rmap_item belongs to
+ * @page: the page last seen at this address
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
+ * @append_round: low 32 bits of the round it was added to the unstable tree
+ * @hash_max: hash at HASH_STRENGTH_MAX, 0 if not calculated yet
  * @node: rb node of this rmap_item in the unstable tree
- * @head: pointer to stable_node heading this list in the stable tree
- * @hlist: link into hlist of rmap_items hanging off that stable_node
+ * @tree_node: the tree_node of its hash in the unstable tree
+ * @cached_hash: its hash when its unstable tree was emptied, if HASHED_FLAG
+ * @cached_strength: the hash_strength of @cached_hash
+ * @head: pointer to the node_vma heading this list in the stable tree
+ * @hlist: link into hlist of rmap_items hanging off that node_vma
+ * @anon_vma: pointer to anon_vma for this mm,address, when in stable tree
+ *
+ * It takes 64 bytes, one cache line, on 64-bit. Its position in the
+ * rmap_list_pool of the slot is kept in the pool page, not here, or is 0
+ * for a slot of one pool.
  */
 struct rmap_item {
 	struct vma_slot *slot;
 	struct page *page;
 	unsigned long address;	/* + low bits used for flags below */
-	/* Appendded to (un)stable tree on which scan round */
-	unsigned long append_round;
-
-	/* Which rung scan turn it was last scanned */
-	//unsigned long last_scan;
-	unsigned long entry_index;
+	u32 append_round;
+	u32 hash_max;
 	union {
 		struct {/* when in unstable tree */
 			struct rb_node node;
-			struct tree_node *tree_node;
-			u32 hash_max;
+			union {
+				struct tree_node *tree_node;
+				struct { /* once its unstable tree is gone */
+					u32 cached_hash;
+					u32 cached_strength;
+				};
+			};
 		};
 		struct { /* when in stable tree */
 			struct node_vma *head;
@@ -251,14 +388,116 @@ struct rmap_list_entry {
 	//unsigned char is_addr;
 } __attribute__((aligned(4))); // 4 aligned to fit in to pages
 
+/*
+ * A big vma is scanned by several slots, one per region, chained from
+ * vma->ksm_vma_slot in address order. ksm_vma_region() finds the one of
+ * @address, NULL if the vma has none.
+ */
+static inline struct vma_slot *ksm_vma_region(struct vm_area_struct *vma,
+					      unsigned long address)
+{
+	struct vma_slot *slot = vma->ksm_vma_slot;
+
+	while (slot && slot->next_region &&
+	       address >= slot->next_region->vstart)
+		slot = slot->next_region;
+
+	return slot;
+}
+
+/*
+ * khugepaged does not collapse the huge pages of a region ksmd finds
+ * dedup-rich, and reports the collapses it does so that the region is
+ * scanned less.
+ */
+static inline int ksm_vma_huge_hold(struct vm_area_struct *vma,
+				    unsigned long address)
+{
+	struct vma_slot *slot = ksm_vma_region(vma, address);
+
+	return slot && slot->huge_hold;
+}
+
+extern void ksm_vma_huge_collapsed(struct vm_area_struct *vma,
+				   unsigned long address,
+				   unsigned long nr_pages);
+
 //extern struct semaphore ksm_scan_sem;
 #else  /* !CONFIG_KSM */
 
+static inline int ksm_madvise(struct vm_area_struct *vma, int advice)
+{
+	return -EINVAL;
+}
+
+static inline int ksm_set_memory_merge(struct mm_struct *mm, int merge)
+{
+	return -EINVAL;
+}
+
+static inline void ksm_vma_stat(struct vm_area_struct *vma,
+				struct ksm_vma_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	stat->rung = -1;
+}
+
 static inline int ksm_fork(struct mm_struct *mm, struct mm_struct *oldmm)
 {
 	return 0;
 }
 
+static inline void ksm_vma_moved(struct vm_area_struct *vma,
+				 unsigned long old_addr,
+				 struct vm_area_struct *new_vma,
+				 unsigned long new_addr, unsigned long len)
+{
+}
+
+static inline void ksm_swap_park(struct page *page, unsigned long swap)
+{
+}
+
+static inline void ksm_swap_reshare_page(struct page *page,
+					 unsigned long swap)
+{
+}
+
+static inline void ksm_swap_freed(unsigned long swap)
+{
+}
+
+static inline int ksm_swap_parked(unsigned long swap)
+{
+	return 0;
+}
+
+static inline int ksm_swap_dedup_page(struct page *page)
+{
+	return 0;
+}
+
+static inline void ksm_swap_dedup_note(struct page *page)
+{
+}
+
+static inline void ksm_memory_pressure(void)
+{
+}
+
+static inline void ksm_dirty_log_hint(struct mm_struct *mm,
+				      unsigned long start,
+				      unsigned long *bitmap,
+				      unsigned long npages)
+{
+}
+
+static inline long ksm_merge_zero_range(struct mm_struct *mm,
+					unsigned long start, unsigned long end)
+{
+	return -EINVAL;
+}
+
 static inline void ksm_exit(struct mm_struct *mm)
 {
 }
@@ -268,6 +507,18 @@ static inline int PageKsm(struct page *page)
 	return 0;
 }
 
+static inline int ksm_vma_huge_hold(struct vm_area_struct *vma,
+				    unsigned long address)
+{
+	return 0;
+}
+
+static inline void ksm_vma_huge_collapsed(struct vm_area_struct *vma,
+					  unsigned long address,
+					  unsigned long nr_pages)
+{
+}
+
 #ifdef CONFIG_MMU
 
 static inline int ksm_might_need_to_copy(struct page *page,
@@ -296,6 +547,16 @@ static inline int rmap_walk_ksm(struct page *page, int (*rmap_one)(struct page*,
 static inline void ksm_migrate_page(struct page *newpage, struct page *oldpage)
 {
 }
+
+static inline int ksm_page_mm_only(struct page *page, struct mm_struct *mm)
+{
+	return 0;
+}
+
+static inline int ksm_memory_failure(struct page *page)
+{
+	return -EBUSY;
+}
 #endif /* CONFIG_MMU */
 #endif /* !CONFIG_KSM */
 
@@ -322,6 +322,15 @@ struct kvm_dirty_log {
 	};
 };
 
+/* for KVM_GET_DIRTY_LOG_RANGE */
+struct kvm_dirty_log_range {
+	__u32 slot;
+	__u32 padding1;
+	__u64 first_page;	/* a multiple of 64 */
+	__u64 num_pages;
+	__u64 dirty_bitmap;	/* user address, one bit per page */
+};
+
 /* for KVM_SET_SIGNAL_MASK */
 struct kvm_signal_mask {
 	__u32 len;
@@ -541,6 +550,7 @@ struct kvm_ppc_pvinfo {
 #define KVM_CAP_PPC_GET_PVINFO 57
 #define KVM_CAP_PPC_IRQ_LEVEL 58
 #define KVM_CAP_ASYNC_PF 59
+#define KVM_CAP_DIRTY_LOG_RANGE 60
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -638,6 +648,7 @@ struct kvm_clock_data {
 					struct kvm_userspace_memory_region)
 #define KVM_SET_TSS_ADDR          _IO(KVMIO,   0x47)
 #define KVM_SET_IDENTITY_MAP_ADDR _IOW(KVMIO,  0x48, __u64)
+#define KVM_GET_DIRTY_LOG_RANGE   _IOW(KVMIO,  0x49, struct kvm_dirty_log_range)
 /* Device model IOC */
 #define KVM_CREATE_IRQCHIP        _IO(KVMIO,   0x60)
 #define KVM_IRQ_LINE              _IOW(KVMIO,  0x61, struct kvm_irq_level)
@@ -37,6 +37,16 @@ extern unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 					struct mem_cgroup *mem_cont,
 					int active, int file);
 
+/* Per memcg counters of the KSM scanner, charged back to the tenant */
+enum mem_cgroup_ksm_stat_item {
+	MEM_CGROUP_KSM_PAGES_SCANNED,	/* pages hashed by ksmd */
+	MEM_CGROUP_KSM_PAGES_MERGED,	/* mappings of KSM pages right now */
+	MEM_CGROUP_KSM_PAGES_COWED,	/* KSM pages broken by COW */
+	MEM_CGROUP_KSM_PAGES_CHARGED,	/* KSM pages charged here right now */
+	MEM_CGROUP_KSM_PAGES_OVER_BUDGET, /* pages left unhashed for it */
+	MEM_CGROUP_KSM_NSTATS,
+};
+
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
 /*
  * All "charge" functions with gfp_mask should use GFP_KERNEL or
@@ -78,6 +88,8 @@ extern int mem_cgroup_shmem_charge_fallback(struct page *page,
 
 extern void mem_cgroup_out_of_memory(struct mem_cgroup *mem, gfp_t gfp_mask);
 int task_in_mem_cgroup(struct task_struct *task, const struct mem_cgroup *mem);
+int mem_cgroup_scan_tasks(struct mem_cgroup *mem,
+			  int (*fn)(struct task_struct *, void *), void *arg);
 
 extern struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page);
 extern struct mem_cgroup *mem_cgroup_from_task(struct task_struct *p);
@@ -150,6 +162,15 @@ u64 mem_cgroup_get_limit(struct mem_cgroup *mem);
 void mem_cgroup_split_huge_fixup(struct page *head, struct page *tail);
 #endif
 
+#ifdef CONFIG_KSM
+extern struct mem_cgroup *mem_cgroup_ksm_get(struct mm_struct *mm);
+extern void mem_cgroup_ksm_put(struct mem_cgroup *mem);
+extern int mem_cgroup_ksm_priority(struct mem_cgroup *mem);
+extern void mem_cgroup_ksm_stat(struct mem_cgroup *mem,
+				enum mem_cgroup_ksm_stat_item idx, long val);
+extern int mem_cgroup_ksm_over_budget(struct mem_cgroup *mem);
+#endif
+
 #else /* CONFIG_CGROUP_MEM_RES_CTLR */
 struct mem_cgroup;
 
@@ -344,6 +365,31 @@ static inline void mem_cgroup_split_huge_fixup(struct page *head,
 {
 }
 
+static inline struct mem_cgroup *mem_cgroup_ksm_get(struct mm_struct *mm)
+{
+	return NULL;
+}
+
+static inline void mem_cgroup_ksm_put(struct mem_cgroup *mem)
+{
+}
+
+static inline int mem_cgroup_ksm_priority(struct mem_cgroup *mem)
+{
+	return 0;
+}
+
+static inline void mem_cgroup_ksm_stat(struct mem_cgroup *mem,
+				       enum mem_cgroup_ksm_stat_item idx,
+				       long val)
+{
+}
+
+static inline int mem_cgroup_ksm_over_budget(struct mem_cgroup *mem)
+{
+	return 0;
+}
+
 #endif /* CONFIG_CGROUP_MEM_CONT */
 
 #endif /* _LINUX_MEMCONTROL_H */
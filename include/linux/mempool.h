@@ -8,6 +8,14 @@
 
 struct kmem_cache;
 
+/* Most elements a pool may keep in each per-cpu cache */
+#define MEMPOOL_PCPU_MAX	8
+
+struct mempool_pcpu {
+	int nr;
+	void *elements[MEMPOOL_PCPU_MAX];
+};
+
 typedef void * (mempool_alloc_t)(gfp_t gfp_mask, void *pool_data);
 typedef void (mempool_free_t)(void *element, void *pool_data);
 
@@ -21,6 +29,10 @@ typedef struct mempool_s {
 	mempool_alloc_t *alloc;
 	mempool_free_t *free;
 	wait_queue_head_t wait;
+
+	int pcpu_nr;		/* elements each cpu may cache, 0 for none */
+	struct mempool_pcpu __percpu *pcpu;
+	struct list_head pcpu_list;
 } mempool_t;
 
 extern mempool_t *mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
@@ -28,6 +40,7 @@ extern mempool_t *mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
 extern mempool_t *mempool_create_node(int min_nr, mempool_alloc_t *alloc_fn,
 			mempool_free_t *free_fn, void *pool_data, int nid);
 
+extern int mempool_enable_percpu(mempool_t *pool, int nr);
 extern int mempool_resize(mempool_t *pool, int new_min_nr, gfp_t gfp_mask);
 extern void mempool_destroy(mempool_t *pool);
 extern void * mempool_alloc(mempool_t *pool, gfp_t gfp_mask);
@@ -18,6 +18,9 @@ extern int migrate_pages(struct list_head *l, new_page_t x,
 extern int migrate_huge_pages(struct list_head *l, new_page_t x,
 			unsigned long private, bool offlining,
 			bool sync);
+extern int migrate_pages_batched(struct list_head *l, new_page_t x,
+			unsigned long private);
+extern int sysctl_migrate_copy_threads;
 
 extern int fail_migrate_page(struct address_space *,
 			struct page *, struct page *);
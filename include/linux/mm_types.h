@@ -24,6 +24,11 @@ struct address_space;
 
 #define USE_SPLIT_PTLOCKS	(NR_CPUS >= CONFIG_SPLIT_PTLOCK_CPUS)
 
+/* the vmas each thread caches, see vmacache.h */
+#define VMACACHE_BITS		2
+#define VMACACHE_SIZE		(1U << VMACACHE_BITS)
+#define VMACACHE_MASK		(VMACACHE_SIZE - 1)
+
 /*
  * Each physical page in the system has a struct page associated with
  * it to keep track of whatever it is we are using the page for at the
@@ -185,6 +190,8 @@ struct vm_area_struct {
 #endif
 #ifdef CONFIG_KSM
 	struct vma_slot *ksm_vma_slot;
+	unsigned long ksm_ctime_j;	/* jiffies when first mapped */
+	unsigned char ksm_advice;	/* KSM_ADVICE_*, set by madvise() */
 #endif
 };
 
@@ -225,7 +232,7 @@ struct mm_rss_stat {
 struct mm_struct {
 	struct vm_area_struct * mmap;		/* list of VMAs */
 	struct rb_root mm_rb;
-	struct vm_area_struct * mmap_cache;	/* last find_vma result */
+	u64 vmacache_seqnum;			/* per-thread vmacache */
 #ifdef CONFIG_MMU
 	unsigned long (*get_unmapped_area) (struct file *filp,
 				unsigned long addr, unsigned long len,
@@ -247,6 +254,9 @@ struct mm_struct {
 						 * together off init_mm.mmlist, and are protected
 						 * by mmlist_lock
 						 */
+	int tlb_flush_batched;		/* reclaim cleared ptes without flushing,
+						 * see flush_tlb_batched_pending()
+						 */
 
 
 	unsigned long hiwater_rss;	/* High-watermark of RSS usage */
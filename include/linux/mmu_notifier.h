@@ -61,6 +61,18 @@ struct mmu_notifier_ops {
 				 struct mm_struct *mm,
 				 unsigned long address);
 
+	/*
+	 * clear_flush_young_range does clear_flush_young for all the pages
+	 * of [start, end) at once, setting the bit of each page found young
+	 * in the @young bitmap, bit 0 for start. Returns whether any was.
+	 * Without it clear_flush_young is called for each page.
+	 */
+	int (*clear_flush_young_range)(struct mmu_notifier *mn,
+				       struct mm_struct *mm,
+				       unsigned long start,
+				       unsigned long end,
+				       unsigned long *young);
+
 	/*
 	 * test_young is called to check the young/accessed bitflag in
 	 * the secondary pte. This is used to know if the page is
@@ -80,6 +92,21 @@ struct mmu_notifier_ops {
 			   unsigned long address,
 			   pte_t pte);
 
+	/*
+	 * change_pte_batch is change_pte for a batch of ptes of the same
+	 * mm, leaving the TLB flush of the secondary MMU to a call of
+	 * change_pte_flush at the end of the batch, which must come before
+	 * the caller relies on the new ptes: as when they are write
+	 * protected for a compare, just after the primary TLB flush.
+	 * Without them change_pte is called for each pte.
+	 */
+	void (*change_pte_batch)(struct mmu_notifier *mn,
+				 struct mm_struct *mm,
+				 unsigned long address,
+				 pte_t pte);
+	void (*change_pte_flush)(struct mmu_notifier *mn,
+				 struct mm_struct *mm);
+
 	/*
 	 * Before this is invoked any secondary MMU is still ok to
 	 * read/write to the page previously pointed to by the Linux
@@ -173,10 +200,16 @@ extern void __mmu_notifier_mm_destroy(struct mm_struct *mm);
 extern void __mmu_notifier_release(struct mm_struct *mm);
 extern int __mmu_notifier_clear_flush_young(struct mm_struct *mm,
 					  unsigned long address);
+extern int __mmu_notifier_clear_flush_young_range(struct mm_struct *mm,
+				unsigned long start, unsigned long end,
+				unsigned long *young);
 extern int __mmu_notifier_test_young(struct mm_struct *mm,
 				     unsigned long address);
 extern void __mmu_notifier_change_pte(struct mm_struct *mm,
 				      unsigned long address, pte_t pte);
+extern void __mmu_notifier_change_pte_batch(struct mm_struct *mm,
+				      unsigned long address, pte_t pte);
+extern void __mmu_notifier_change_pte_flush(struct mm_struct *mm);
 extern void __mmu_notifier_invalidate_page(struct mm_struct *mm,
 					  unsigned long address);
 extern void __mmu_notifier_invalidate_range_start(struct mm_struct *mm,
@@ -198,6 +231,16 @@ static inline int mmu_notifier_clear_flush_young(struct mm_struct *mm,
 	return 0;
 }
 
+static inline int mmu_notifier_clear_flush_young_range(struct mm_struct *mm,
+				unsigned long start, unsigned long end,
+				unsigned long *young)
+{
+	if (mm_has_notifiers(mm))
+		return __mmu_notifier_clear_flush_young_range(mm, start, end,
+							      young);
+	return 0;
+}
+
 static inline int mmu_notifier_test_young(struct mm_struct *mm,
 					  unsigned long address)
 {
@@ -213,6 +256,19 @@ static inline void mmu_notifier_change_pte(struct mm_struct *mm,
 		__mmu_notifier_change_pte(mm, address, pte);
 }
 
+static inline void mmu_notifier_change_pte_batch(struct mm_struct *mm,
+					   unsigned long address, pte_t pte)
+{
+	if (mm_has_notifiers(mm))
+		__mmu_notifier_change_pte_batch(mm, address, pte);
+}
+
+static inline void mmu_notifier_change_pte_flush(struct mm_struct *mm)
+{
+	if (mm_has_notifiers(mm))
+		__mmu_notifier_change_pte_flush(mm);
+}
+
 static inline void mmu_notifier_invalidate_page(struct mm_struct *mm,
 					  unsigned long address)
 {
@@ -321,6 +377,17 @@ static inline void mmu_notifier_mm_destroy(struct mm_struct *mm)
 	mmu_notifier_change_pte(___mm, ___address, ___pte);		\
 })
 
+/* as set_pte_at_notify(), to be followed by mmu_notifier_change_pte_flush() */
+#define set_pte_at_notify_batch(__mm, __address, __ptep, __pte)		\
+({									\
+	struct mm_struct *___mm = __mm;					\
+	unsigned long ___address = __address;				\
+	pte_t ___pte = __pte;						\
+									\
+	set_pte_at(___mm, ___address, __ptep, ___pte);			\
+	mmu_notifier_change_pte_batch(___mm, ___address, ___pte);	\
+})
+
 #else /* CONFIG_MMU_NOTIFIER */
 
 static inline void mmu_notifier_release(struct mm_struct *mm)
@@ -333,6 +400,13 @@ static inline int mmu_notifier_clear_flush_young(struct mm_struct *mm,
 	return 0;
 }
 
+static inline int mmu_notifier_clear_flush_young_range(struct mm_struct *mm,
+				unsigned long start, unsigned long end,
+				unsigned long *young)
+{
+	return 0;
+}
+
 static inline int mmu_notifier_test_young(struct mm_struct *mm,
 					  unsigned long address)
 {
@@ -344,6 +418,10 @@ static inline void mmu_notifier_change_pte(struct mm_struct *mm,
 {
 }
 
+static inline void mmu_notifier_change_pte_flush(struct mm_struct *mm)
+{
+}
+
 static inline void mmu_notifier_invalidate_page(struct mm_struct *mm,
 					  unsigned long address)
 {
@@ -373,6 +451,7 @@ static inline void mmu_notifier_mm_destroy(struct mm_struct *mm)
 #define pmdp_clear_flush_notify pmdp_clear_flush
 #define pmdp_splitting_flush_notify pmdp_splitting_flush
 #define set_pte_at_notify set_pte_at
+#define set_pte_at_notify_batch set_pte_at
 
 #endif /* CONFIG_MMU_NOTIFIER */
 
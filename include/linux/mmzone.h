@@ -116,7 +116,8 @@ enum zone_stat_item {
 #endif
 	NR_ANON_TRANSPARENT_HUGEPAGES,
 #ifdef CONFIG_KSM
-	NR_KSM_PAGES_SHARING,
+	NR_KSM_PAGES_SHARING,	/* mappings of KSM pages but the first */
+	NR_KSM_PAGES_SHARED,	/* mapped KSM pages */
 #endif
 	NR_VM_ZONE_STAT_ITEMS };
 
@@ -176,6 +177,8 @@ struct per_cpu_pages {
 	int count;		/* number of pages in the list */
 	int high;		/* high watermark, emptying needed */
 	int batch;		/* chunk size for buddy add/remove */
+	short free_factor;	/* frees go back by batch << free_factor */
+	short alloc_factor;	/* refills come by batch << alloc_factor */
 
 	/* Lists of pages, one per migrate type stored on the pcp-lists */
 	struct list_head lists[MIGRATE_PCPTYPES];
@@ -612,6 +615,9 @@ extern struct page *mem_map;
  * per-zone basis.
  */
 struct bootmem_data;
+/* Most reclaim threads, kswapd and its workers, a node can have */
+#define MAX_KSWAPD_THREADS	16
+
 typedef struct pglist_data {
 	struct zone node_zones[MAX_NR_ZONES];
 	struct zonelist node_zonelists[MAX_ZONELISTS];
@@ -644,6 +650,22 @@ typedef struct pglist_data {
 	struct task_struct *kswapd;
 	int kswapd_max_order;
 	enum zone_type classzone_idx;
+	/* extra reclaim threads helping kswapd, see kswapd_threads */
+	struct task_struct *kswapd_workers[MAX_KSWAPD_THREADS - 1];
+	wait_queue_head_t kswapd_worker_wait;
+	int kswapd_priority;	/* of balance_pgdat(), -1 while not running */
+	int kswapd_order;
+	int kswapd_end_zone;
+#ifdef CONFIG_COMPACTION
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;
+	int kcompactd_wake;
+#endif
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	/* struct pages in [first_deferred_pfn, deferred_end_pfn) are set up late */
+	unsigned long first_deferred_pfn;
+	unsigned long deferred_end_pfn;
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
@@ -102,4 +102,11 @@
 
 #define PR_MCE_KILL_GET 34
 
+/*
+ * Get/set whether KSM may merge the pages of the process: 0 keeps all its
+ * areas out of the scan and unmerges them. Inherited on fork and exec.
+ */
+#define PR_SET_MEMORY_MERGE 35
+#define PR_GET_MEMORY_MERGE 36
+
 #endif /* _LINUX_PRCTL_H */
@@ -48,6 +48,17 @@ struct anon_vma {
 	 * mm_take_all_locks() (mm_all_locks_mutex).
 	 */
 	struct list_head head;	/* Chain of private "related" vmas */
+
+	/*
+	 * Count of child anon_vmas, under the root's lock. One with fewer
+	 * than two children and no active VMA can be taken over by a forked
+	 * VMA instead of adding another level to the anon_vma tree.
+	 */
+	unsigned long num_children;
+	/* Count of VMAs whose ->anon_vma points to this, under the same */
+	unsigned long num_active_vmas;
+
+	struct anon_vma *parent;	/* Parent of this anon_vma */
 };
 
 /*
@@ -167,6 +178,7 @@ void do_page_add_anon_rmap(struct page *, struct vm_area_struct *,
 void page_add_new_anon_rmap(struct page *, struct vm_area_struct *, unsigned long);
 void page_add_file_rmap(struct page *);
 void page_remove_rmap(struct page *);
+void page_remove_rmap_nr(struct page *, int);
 
 void hugepage_add_anon_rmap(struct page *, struct vm_area_struct *,
 			    unsigned long);
@@ -186,6 +198,13 @@ int page_referenced(struct page *, int is_locked,
 int page_referenced_one(struct page *, struct vm_area_struct *,
 	unsigned long address, unsigned int *mapcount, unsigned long *vm_flags);
 
+/* Most pages page_referenced_batch() takes at once */
+#define PAGE_REFERENCED_BATCH	16
+
+void page_referenced_batch(struct page **pages, int nr,
+			   struct mem_cgroup *cnt, int *referenced,
+			   unsigned long *vm_flags);
+
 enum ttu_flags {
 	TTU_UNMAP = 0,			/* unmap mode */
 	TTU_MIGRATION = 1,		/* migration mode */
@@ -195,9 +214,28 @@ enum ttu_flags {
 	TTU_IGNORE_MLOCK = (1 << 8),	/* ignore mlock */
 	TTU_IGNORE_ACCESS = (1 << 9),	/* don't age */
 	TTU_IGNORE_HWPOISON = (1 << 10),/* corrupted page is recoverable */
+	TTU_BATCH_FLUSH = (1 << 11),	/* defer the TLB flush to current->tlb_ubc */
+	TTU_FREE = (1 << 12),		/* discard clean pages of MADV_FREE */
 };
 #define TTU_ACTION(x) ((x) & TTU_ACTION_MASK)
 
+/*
+ * The mms reclaim unmapped pages of without flushing their TLBs, to flush
+ * once each with try_to_unmap_flush() before those pages are freed, or
+ * with try_to_unmap_flush_dirty() before they are written if a pte was
+ * dirty: a cpu could still write through its TLB meanwhile.
+ */
+#define TLB_UBC_MMS	16
+struct tlbflush_unmap_batch {
+	struct mm_struct *mms[TLB_UBC_MMS];	/* each with a mm_count ref */
+	int nr;
+	int writable;
+};
+
+void try_to_unmap_flush(void);
+void try_to_unmap_flush_dirty(void);
+void flush_tlb_batched_pending(struct mm_struct *mm);
+
 bool is_vma_temporary_stack(struct vm_area_struct *vma);
 
 int try_to_unmap(struct page *, enum ttu_flags flags);
@@ -280,6 +318,19 @@ static inline int page_referenced(struct page *page, int is_locked,
 	return 0;
 }
 
+#define PAGE_REFERENCED_BATCH	16
+
+static inline void page_referenced_batch(struct page **pages, int nr,
+					 struct mem_cgroup *cnt,
+					 int *referenced,
+					 unsigned long *vm_flags)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		referenced[i] = page_referenced(pages[i], 0, cnt, &vm_flags[i]);
+}
+
 #define try_to_unmap(page, refs) SWAP_FAIL
 
 static inline int page_mkclean(struct page *page)
@@ -97,6 +97,7 @@ struct exec_domain;
 struct futex_pi_state;
 struct robust_list_head;
 struct bio_list;
+struct blk_plug;
 struct fs_struct;
 struct perf_event_context;
 
@@ -433,8 +434,10 @@ extern int get_dumpable(struct mm_struct *mm);
 # define MMF_DUMP_MASK_DEFAULT_ELF	0
 #endif
 					/* leave room for more dump flags */
+#define MMF_VM_NOKSM		16	/* PR_SET_MEMORY_MERGE 0: KSM left out */
 
-#define MMF_INIT_MASK		(MMF_DUMPABLE_MASK | MMF_DUMP_FILTER_MASK)
+#define MMF_INIT_MASK		(MMF_DUMPABLE_MASK | MMF_DUMP_FILTER_MASK |\
+				 (1 << MMF_VM_NOKSM))
 
 struct sighand_struct {
 	atomic_t		count;
@@ -718,6 +721,7 @@ extern struct user_struct root_user;
 
 struct backing_dev_info;
 struct reclaim_state;
+struct tlbflush_unmap_batch;
 
 #if defined(CONFIG_SCHEDSTATS) || defined(CONFIG_TASK_DELAY_ACCT)
 struct sched_info {
@@ -1252,6 +1256,9 @@ struct task_struct {
 #endif
 
 	struct mm_struct *mm, *active_mm;
+	/* per-thread vma caching, see vmacache.h */
+	u64 vmacache_seqnum;
+	struct vm_area_struct *vmacache[VMACACHE_SIZE];
 #if defined(SPLIT_RSS_COUNTING)
 	struct task_rss_stat	rss_stat;
 #endif
@@ -1427,8 +1434,14 @@ struct task_struct {
 /* stacked block device info */
 	struct bio_list *bio_list;
 
+#ifdef CONFIG_BLOCK
+/* stack plugging */
+	struct blk_plug *plug;
+#endif
+
 /* VM state */
 	struct reclaim_state *reclaim_state;
+	struct tlbflush_unmap_batch *tlb_ubc;
 
 	struct backing_dev_info *backing_dev_info;
 
@@ -1485,6 +1498,9 @@ struct task_struct {
 	int make_it_fail;
 #endif
 	struct prop_local_single dirties;
+	/* pages dirtied since the last balance_dirty_pages(), and its limit */
+	int nr_dirtied;
+	int nr_dirtied_pause;
 #ifdef CONFIG_LATENCYTOP
 	int latency_record_count;
 	struct latency_record latency_record[LT_SAVECOUNT];
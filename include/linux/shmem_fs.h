@@ -32,6 +32,7 @@ struct shmem_sb_info {
 	gid_t gid;		    /* Mount gid for root directory */
 	mode_t mode;		    /* Mount mode for root directory */
 	struct mempolicy *mpol;     /* default memory policy for mappings */
+	unsigned char huge;	    /* Whether to map teams with huge pmds */
 };
 
 static inline struct shmem_inode_info *SHMEM_I(struct inode *inode)
@@ -41,5 +42,18 @@ static inline struct shmem_inode_info *SHMEM_I(struct inode *inode)
 
 extern int init_tmpfs(void);
 extern int shmem_fill_super(struct super_block *sb, void *data, int silent);
+extern int shmem_mapping(struct address_space *mapping);
+
+#if defined(CONFIG_SHMEM) && defined(CONFIG_TRANSPARENT_HUGEPAGE)
+extern int shmem_collapse_team(struct vm_area_struct *vma, unsigned long haddr,
+			       unsigned int max_holes);
+#else
+static inline int shmem_collapse_team(struct vm_area_struct *vma,
+				      unsigned long haddr,
+				      unsigned int max_holes)
+{
+	return -EINVAL;
+}
+#endif
 
 #endif
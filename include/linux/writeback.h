@@ -8,6 +8,7 @@
 #include <linux/fs.h>
 
 struct backing_dev_info;
+struct swap_plug;
 
 extern spinlock_t inode_lock;
 
@@ -50,6 +51,8 @@ struct writeback_control {
 	unsigned for_reclaim:1;		/* Invoked from the page allocator */
 	unsigned range_cyclic:1;	/* range_start is cyclic */
 	unsigned more_io:1;		/* more io to be dispatched */
+
+	struct swap_plug *swap_plug;	/* swap_writepage() may queue here */
 };
 
 /*
@@ -0,0 +1,238 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ksm
+
+#if !defined(_TRACE_KSM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_KSM_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * stable and unstable are the results of the stable tree and unstable tree
+ * stages: -1 if nothing was found in that tree, 0 if merged, a MERGE_ERR_*
+ * code otherwise. tree_latency is the part of latency spent searching the
+ * trees, the rest went into merging.
+ */
+TRACE_EVENT(ksm_cmp_and_merge_page,
+
+	TP_PROTO(void *slot, void *mm, unsigned long address, u32 hash,
+		int stable, int unstable, u64 latency, u64 tree_latency),
+
+	TP_ARGS(slot, mm, address, hash, stable, unstable, latency,
+		tree_latency),
+
+	TP_STRUCT__entry(
+		__field(void *, slot)
+		__field(void *, mm)
+		__field(unsigned long, address)
+		__field(u32, hash)
+		__field(int, stable)
+		__field(int, unstable)
+		__field(u64, latency)
+		__field(u64, tree_latency)
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->mm = mm;
+		__entry->address = address;
+		__entry->hash = hash;
+		__entry->stable = stable;
+		__entry->unstable = unstable;
+		__entry->latency = latency;
+		__entry->tree_latency = tree_latency;
+	),
+
+	TP_printk("slot=%p mm=%p address=0x%lx hash=0x%08x stable=%d "
+		"unstable=%d latency_ns=%llu tree_latency_ns=%llu",
+		__entry->slot,
+		__entry->mm,
+		__entry->address,
+		__entry->hash,
+		__entry->stable,
+		__entry->unstable,
+		(unsigned long long)__entry->latency,
+		(unsigned long long)__entry->tree_latency)
+);
+
+TRACE_EVENT(ksm_merge_two_pages,
+
+	TP_PROTO(void *slot1, unsigned long address1,
+		void *slot2, unsigned long address2,
+		int err, u64 latency),
+
+	TP_ARGS(slot1, address1, slot2, address2, err, latency),
+
+	TP_STRUCT__entry(
+		__field(void *, slot1)
+		__field(unsigned long, address1)
+		__field(void *, slot2)
+		__field(unsigned long, address2)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->slot1 = slot1;
+		__entry->address1 = address1;
+		__entry->slot2 = slot2;
+		__entry->address2 = address2;
+		__entry->err = err;
+		__entry->latency = latency;
+	),
+
+	TP_printk("slot1=%p address1=0x%lx slot2=%p address2=0x%lx err=%d "
+		"latency_ns=%llu",
+		__entry->slot1,
+		__entry->address1,
+		__entry->slot2,
+		__entry->address2,
+		__entry->err,
+		(unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(ksm_break_cow,
+
+	TP_PROTO(void *slot, unsigned long address),
+
+	TP_ARGS(slot, address),
+
+	TP_STRUCT__entry(
+		__field(void *, slot)
+		__field(unsigned long, address)
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->address = address;
+	),
+
+	TP_printk("slot=%p address=0x%lx",
+		__entry->slot,
+		__entry->address)
+);
+
+/* a merged page broken by a write fault, in the context of the faulting task */
+TRACE_EVENT(ksm_page_cowed,
+
+	TP_PROTO(void *slot, void *mm, unsigned long address),
+
+	TP_ARGS(slot, mm, address),
+
+	TP_STRUCT__entry(
+		__field(void *, slot)
+		__field(void *, mm)
+		__field(unsigned long, address)
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->mm = mm;
+		__entry->address = address;
+	),
+
+	TP_printk("slot=%p mm=%p address=0x%lx",
+		__entry->slot,
+		__entry->mm,
+		__entry->address)
+);
+
+TRACE_EVENT(ksm_stable_tree_delta_hash,
+
+	TP_PROTO(u32 from, u32 to, unsigned long nodes, u64 latency),
+
+	TP_ARGS(from, to, nodes, latency),
+
+	TP_STRUCT__entry(
+		__field(u32, from)
+		__field(u32, to)
+		__field(unsigned long, nodes)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->from = from;
+		__entry->to = to;
+		__entry->nodes = nodes;
+		__entry->latency = latency;
+	),
+
+	TP_printk("from=%u to=%u nodes=%lu latency_ns=%llu",
+		__entry->from,
+		__entry->to,
+		__entry->nodes,
+		(unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(ksm_round_update_ladder,
+
+	TP_PROTO(unsigned long long round, unsigned long slots,
+		unsigned long pairs, unsigned long dedup_ratio_max,
+		unsigned long dedup_ratio_mean, u64 latency),
+
+	TP_ARGS(round, slots, pairs, dedup_ratio_max, dedup_ratio_mean,
+		latency),
+
+	TP_STRUCT__entry(
+		__field(unsigned long long, round)
+		__field(unsigned long, slots)
+		__field(unsigned long, pairs)
+		__field(unsigned long, dedup_ratio_max)
+		__field(unsigned long, dedup_ratio_mean)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->round = round;
+		__entry->slots = slots;
+		__entry->pairs = pairs;
+		__entry->dedup_ratio_max = dedup_ratio_max;
+		__entry->dedup_ratio_mean = dedup_ratio_mean;
+		__entry->latency = latency;
+	),
+
+	TP_printk("round=%llu slots=%lu pairs=%lu dedup_ratio_max=%lu "
+		"dedup_ratio_mean=%lu latency_ns=%llu",
+		__entry->round,
+		__entry->slots,
+		__entry->pairs,
+		__entry->dedup_ratio_max,
+		__entry->dedup_ratio_mean,
+		(unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(ksm_vma_rung_enter,
+
+	TP_PROTO(void *slot, int from, int to, unsigned long pages_to_scan,
+		unsigned long dedup_ratio),
+
+	TP_ARGS(slot, from, to, pages_to_scan, dedup_ratio),
+
+	TP_STRUCT__entry(
+		__field(void *, slot)
+		__field(int, from)
+		__field(int, to)
+		__field(unsigned long, pages_to_scan)
+		__field(unsigned long, dedup_ratio)
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->pages_to_scan = pages_to_scan;
+		__entry->dedup_ratio = dedup_ratio;
+	),
+
+	TP_printk("slot=%p rung=%d->%d pages_to_scan=%lu dedup_ratio=%lu",
+		__entry->slot,
+		__entry->from,
+		__entry->to,
+		__entry->pages_to_scan,
+		__entry->dedup_ratio)
+);
+
+#endif /* _TRACE_KSM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -3938,6 +3938,15 @@ asmlinkage void __sched schedule(void)
 	struct rq *rq;
 	int cpu;
 
+	/*
+	 * A task about to block first hands the requests held on its plug
+	 * to their queues, it may well be going to wait for them.
+	 */
+	prev = current;
+	if (prev->state && !(preempt_count() & PREEMPT_ACTIVE) &&
+	    blk_needs_flush_plug(prev))
+		blk_flush_plug(prev);
+
 need_resched:
 	preempt_disable();
 	cpu = smp_processor_id();
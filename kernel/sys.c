@@ -44,6 +44,7 @@
 #include <linux/user_namespace.h>
 
 #include <linux/kmsg_dump.h>
+#include <linux/ksm.h>
 
 #include <asm/uaccess.h>
 #include <asm/io.h>
@@ -1736,6 +1737,16 @@ SYSCALL_DEFINE5(prctl, int, option, unsigned long, arg2, unsigned long, arg3,
 			else
 				error = PR_MCE_KILL_DEFAULT;
 			break;
+		case PR_SET_MEMORY_MERGE:
+			if (arg3 | arg4 | arg5 || arg2 > 1)
+				return -EINVAL;
+			error = ksm_set_memory_merge(me->mm, arg2);
+			break;
+		case PR_GET_MEMORY_MERGE:
+			if (arg2 | arg3 | arg4 | arg5)
+				return -EINVAL;
+			error = !test_bit(MMF_VM_NOKSM, &me->mm->flags);
+			break;
 		default:
 			error = -EINVAL;
 			break;
@@ -92,6 +92,63 @@ static inline void *indirect_to_ptr(void *ptr)
 	return (void *)((unsigned long)ptr & ~RADIX_TREE_INDIRECT_PTR);
 }
 
+/*
+ * An entry for 2^order indices lives in the node whose slots cover
+ * 2^(order - order % RADIX_TREE_MAP_SHIFT) indices each: the item in the
+ * first of the 1 << (order % RADIX_TREE_MAP_SHIFT) slots it takes, sibling
+ * pointers back to that slot in the others. Child nodes are referenced by
+ * indirect pointers from every slot, so any other entry found above the
+ * bottom level is an item covering all the indices below that slot.
+ */
+static inline int is_sibling_entry(struct radix_tree_node *parent, void *entry)
+{
+	void **ptr = indirect_to_ptr(entry);
+
+	return radix_tree_is_indirect_ptr(entry) &&
+		ptr >= (void **)parent->slots &&
+		ptr < (void **)parent->slots + RADIX_TREE_MAP_SIZE;
+}
+
+/* Is @entry, found in a slot of @parent, a child node of it? */
+static inline int is_node_entry(struct radix_tree_node *parent, void *entry)
+{
+	return parent->height > 1 && radix_tree_is_indirect_ptr(entry) &&
+		!is_sibling_entry(parent, entry);
+}
+
+/* The slot of @node holding the entry that @offset belongs to */
+static inline unsigned int canonical_offset(struct radix_tree_node *node,
+					    unsigned int offset)
+{
+	void *entry = rcu_dereference_raw(node->slots[offset]);
+
+	if (is_sibling_entry(node, entry))
+		offset = (void **)indirect_to_ptr(entry) - (void **)node->slots;
+	return offset;
+}
+
+/* Step past slot @i of @node, and past the siblings following it */
+static unsigned int next_slot(struct radix_tree_node *node, unsigned int i,
+			      unsigned int shift, unsigned long *indexp)
+{
+	unsigned long index = *indexp;
+
+	do {
+		index &= ~((1UL << shift) - 1);
+		index += 1UL << shift;
+		if (index == 0) {
+			/* 32-bit wraparound */
+			i = RADIX_TREE_MAP_SIZE;
+			break;
+		}
+		i++;
+	} while (i < RADIX_TREE_MAP_SIZE &&
+		 is_sibling_entry(node, rcu_dereference_raw(node->slots[i])));
+
+	*indexp = index;
+	return i;
+}
+
 static inline gfp_t root_gfp_mask(struct radix_tree_root *root)
 {
 	return root->gfp_mask & __GFP_BITS_MASK;
@@ -275,7 +332,7 @@ static int radix_tree_extend(struct radix_tree_root *root, unsigned long index)
 			return -ENOMEM;
 
 		/* Increase the height.  */
-		node->slots[0] = indirect_to_ptr(root->rnode);
+		node->slots[0] = root->rnode;
 
 		/* Propagate the aggregated tag info into the new root */
 		for (tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
@@ -295,26 +352,41 @@ out:
 }
 
 /**
- *	radix_tree_insert    -    insert into a radix tree
+ *	radix_tree_insert_order    -    insert an entry covering several indices
  *	@root:		radix tree root
- *	@index:		index key
+ *	@index:		first index key, a multiple of 2^@order
+ *	@order:		the entry covers 2^@order indices
  *	@item:		item to insert
  *
- *	Insert an item into the radix tree at position @index.
+ *	Insert an item for the indices @index to @index + 2^@order - 1.
+ *	Lookups of any of them find @item, gang lookups return it once and
+ *	deleting any of them removes it. Tags are kept for the whole entry.
+ *
+ *	Returns -EEXIST if any of the indices is already in use.
  */
-int radix_tree_insert(struct radix_tree_root *root,
-			unsigned long index, void *item)
+int radix_tree_insert_order(struct radix_tree_root *root, unsigned long index,
+			    unsigned int order, void *item)
 {
 	struct radix_tree_node *node = NULL, *slot;
-	unsigned int height, shift;
+	unsigned int height, shift, stop, nr, i;
+	unsigned long last;
 	int offset;
 	int error;
 
 	BUG_ON(radix_tree_is_indirect_ptr(item));
+	if (order >= RADIX_TREE_INDEX_BITS || (index & ((1UL << order) - 1)))
+		return -EINVAL;
+
+	/* The height of the node the entry goes in, and the slots it takes */
+	stop = order / RADIX_TREE_MAP_SHIFT + 1;
+	nr = 1 << (order % RADIX_TREE_MAP_SHIFT);
 
 	/* Make sure the tree is high enough.  */
-	if (index > radix_tree_maxindex(root->height)) {
-		error = radix_tree_extend(root, index);
+	last = index + ((1UL << order) - 1);
+	if (order)
+		last = max(last, radix_tree_maxindex(stop));
+	if (last > radix_tree_maxindex(root->height)) {
+		error = radix_tree_extend(root, last);
 		if (error)
 			return error;
 	}
@@ -332,7 +404,8 @@ int radix_tree_insert(struct radix_tree_root *root,
 				return -ENOMEM;
 			slot->height = height;
 			if (node) {
-				rcu_assign_pointer(node->slots[offset], slot);
+				rcu_assign_pointer(node->slots[offset],
+						   ptr_to_indirect(slot));
 				node->count++;
 			} else
 				rcu_assign_pointer(root->rnode, ptr_to_indirect(slot));
@@ -341,27 +414,55 @@ int radix_tree_insert(struct radix_tree_root *root,
 		/* Go a level down */
 		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
 		node = slot;
+		if (height == stop)
+			break;
 		slot = node->slots[offset];
+		/* inside the range of a larger entry? */
+		if (slot && !is_node_entry(node, slot))
+			return -EEXIST;
+		slot = indirect_to_ptr(slot);
 		shift -= RADIX_TREE_MAP_SHIFT;
 		height--;
 	}
 
-	if (slot != NULL)
-		return -EEXIST;
-
-	if (node) {
-		node->count++;
-		rcu_assign_pointer(node->slots[offset], item);
-		BUG_ON(tag_get(node, 0, offset));
-		BUG_ON(tag_get(node, 1, offset));
-	} else {
+	if (!node) {
+		if (root->rnode != NULL)
+			return -EEXIST;
 		rcu_assign_pointer(root->rnode, item);
 		BUG_ON(root_tag_get(root, 0));
 		BUG_ON(root_tag_get(root, 1));
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (node->slots[offset + i] != NULL)
+			return -EEXIST;
 	}
+	for (i = 1; i < nr; i++)
+		rcu_assign_pointer(node->slots[offset + i],
+				   ptr_to_indirect((void *)&node->slots[offset]));
+	node->count += nr;
+	rcu_assign_pointer(node->slots[offset], item);
+	BUG_ON(tag_get(node, 0, offset));
+	BUG_ON(tag_get(node, 1, offset));
 
 	return 0;
 }
+EXPORT_SYMBOL(radix_tree_insert_order);
+
+/**
+ *	radix_tree_insert    -    insert into a radix tree
+ *	@root:		radix tree root
+ *	@index:		index key
+ *	@item:		item to insert
+ *
+ *	Insert an item into the radix tree at position @index.
+ */
+int radix_tree_insert(struct radix_tree_root *root,
+			unsigned long index, void *item)
+{
+	return radix_tree_insert_order(root, index, 0, item);
+}
 EXPORT_SYMBOL(radix_tree_insert);
 
 /*
@@ -372,7 +473,8 @@ static void *radix_tree_lookup_element(struct radix_tree_root *root,
 				unsigned long index, int is_slot)
 {
 	unsigned int height, shift;
-	struct radix_tree_node *node, **slot;
+	struct radix_tree_node *node;
+	void **slot, *entry;
 
 	node = rcu_dereference_raw(root->rnode);
 	if (node == NULL)
@@ -391,18 +493,20 @@ static void *radix_tree_lookup_element(struct radix_tree_root *root,
 
 	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
 
-	do {
-		slot = (struct radix_tree_node **)
-			(node->slots + ((index>>shift) & RADIX_TREE_MAP_MASK));
-		node = rcu_dereference_raw(*slot);
-		if (node == NULL)
+	for (;;) {
+		slot = (void **)node->slots + canonical_offset(node,
+					(index >> shift) & RADIX_TREE_MAP_MASK);
+		entry = rcu_dereference_raw(*slot);
+		if (entry == NULL)
 			return NULL;
+		if (!is_node_entry(node, entry))
+			break;
 
+		node = indirect_to_ptr(entry);
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
-	} while (height > 0);
+	}
 
-	return is_slot ? (void *)slot : indirect_to_ptr(node);
+	return is_slot ? (void *)slot : indirect_to_ptr(entry);
 }
 
 /**
@@ -459,31 +563,34 @@ void *radix_tree_tag_set(struct radix_tree_root *root,
 			unsigned long index, unsigned int tag)
 {
 	unsigned int height, shift;
-	struct radix_tree_node *slot;
+	struct radix_tree_node *node;
+	void *entry;
 
 	height = root->height;
 	BUG_ON(index > radix_tree_maxindex(height));
 
-	slot = indirect_to_ptr(root->rnode);
+	entry = root->rnode;
 	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
 
-	while (height > 0) {
+	/* only nodes are indirect with the tree locked */
+	while (radix_tree_is_indirect_ptr(entry)) {
 		int offset;
 
-		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
-		if (!tag_get(slot, tag, offset))
-			tag_set(slot, tag, offset);
-		slot = slot->slots[offset];
-		BUG_ON(slot == NULL);
+		node = indirect_to_ptr(entry);
+		offset = canonical_offset(node,
+					  (index >> shift) & RADIX_TREE_MAP_MASK);
+		if (!tag_get(node, tag, offset))
+			tag_set(node, tag, offset);
+		entry = node->slots[offset];
+		BUG_ON(entry == NULL);
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
 	}
 
 	/* set the root's tag bit */
-	if (slot && !root_tag_get(root, tag))
+	if (entry && !root_tag_get(root, tag))
 		root_tag_set(root, tag);
 
-	return slot;
+	return entry;
 }
 EXPORT_SYMBOL(radix_tree_tag_set);
 
@@ -509,7 +616,8 @@ void *radix_tree_tag_clear(struct radix_tree_root *root,
 	 * since the "list" is null terminated.
 	 */
 	struct radix_tree_path path[RADIX_TREE_MAX_PATH + 1], *pathp = path;
-	struct radix_tree_node *slot = NULL;
+	struct radix_tree_node *node;
+	void *entry = NULL;
 	unsigned int height, shift;
 
 	height = root->height;
@@ -518,24 +626,23 @@ void *radix_tree_tag_clear(struct radix_tree_root *root,
 
 	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
 	pathp->node = NULL;
-	slot = indirect_to_ptr(root->rnode);
+	entry = root->rnode;
 
-	while (height > 0) {
+	/* only nodes are indirect with the tree locked */
+	while (radix_tree_is_indirect_ptr(entry)) {
 		int offset;
 
-		if (slot == NULL)
-			goto out;
-
-		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+		node = indirect_to_ptr(entry);
+		offset = canonical_offset(node,
+					  (index >> shift) & RADIX_TREE_MAP_MASK);
 		pathp[1].offset = offset;
-		pathp[1].node = slot;
-		slot = slot->slots[offset];
+		pathp[1].node = node;
+		entry = node->slots[offset];
 		pathp++;
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
 	}
 
-	if (slot == NULL)
+	if (entry == NULL)
 		goto out;
 
 	while (pathp->node) {
@@ -552,7 +659,7 @@ void *radix_tree_tag_clear(struct radix_tree_root *root,
 		root_tag_clear(root, tag);
 
 out:
-	return slot;
+	return entry;
 }
 EXPORT_SYMBOL(radix_tree_tag_clear);
 
@@ -598,11 +705,10 @@ int radix_tree_tag_get(struct radix_tree_root *root,
 
 	for ( ; ; ) {
 		int offset;
+		void *entry;
 
-		if (node == NULL)
-			return 0;
-
-		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+		offset = canonical_offset(node,
+					  (index >> shift) & RADIX_TREE_MAP_MASK);
 
 		/*
 		 * This is just a debug check.  Later, we can bale as soon as
@@ -610,11 +716,13 @@ int radix_tree_tag_get(struct radix_tree_root *root,
 		 */
 		if (!tag_get(node, tag, offset))
 			saw_unset_tag = 1;
-		if (height == 1)
+		entry = rcu_dereference_raw(node->slots[offset]);
+		if (entry == NULL)
+			return 0;
+		if (!is_node_entry(node, entry))
 			return !!tag_get(node, tag, offset);
-		node = rcu_dereference_raw(node->slots[offset]);
+		node = indirect_to_ptr(entry);
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
 	}
 }
 EXPORT_SYMBOL(radix_tree_tag_get);
@@ -686,28 +794,37 @@ unsigned long radix_tree_range_tag_if_tagged(struct radix_tree_root *root,
 
 	for (;;) {
 		int offset;
+		void *entry;
 
 		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
-		if (!slot->slots[offset])
+		entry = slot->slots[offset];
+		if (!entry)
 			goto next;
+		if (is_sibling_entry(slot, entry)) {
+			/* the range starts inside a larger entry */
+			offset = canonical_offset(slot, offset);
+			if (tag_get(slot, settag, offset))
+				goto next;
+			entry = slot->slots[offset];
+		}
 		if (!tag_get(slot, iftag, offset))
 			goto next;
-		if (height > 1) {
+		if (is_node_entry(slot, entry)) {
 			/* Go down one level */
 			height--;
 			shift -= RADIX_TREE_MAP_SHIFT;
 			path[height - 1].node = slot;
 			path[height - 1].offset = offset;
-			slot = slot->slots[offset];
+			slot = indirect_to_ptr(entry);
 			continue;
 		}
 
-		/* tag the leaf */
+		/* tag the item */
 		tagged++;
 		tag_set(slot, settag, offset);
 
 		/* walk back up the path tagging interior nodes */
-		pathp = &path[0];
+		pathp = &path[height - 1];
 		while (pathp->node) {
 			/* stop if we find a node with the tag already set */
 			if (tag_get(pathp->node, settag, pathp->offset))
@@ -827,42 +944,43 @@ __lookup(struct radix_tree_node *slot, void ***results, unsigned long index,
 	unsigned int max_items, unsigned long *next_index)
 {
 	unsigned int nr_found = 0;
-	unsigned int shift, height;
-	unsigned long i;
+	unsigned int shift, height, i;
+	void *entry;
 
 	height = slot->height;
 	if (height == 0)
 		goto out;
 	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
 
-	for ( ; height > 1; height--) {
+	for (;;) {
 		i = (index >> shift) & RADIX_TREE_MAP_MASK;
-		for (;;) {
-			if (slot->slots[i] != NULL)
-				break;
-			index &= ~((1UL << shift) - 1);
-			index += 1UL << shift;
-			if (index == 0)
-				goto out;	/* 32-bit wraparound */
-			i++;
-			if (i == RADIX_TREE_MAP_SIZE)
+
+		/* the lookup starts inside an entry spanning several slots */
+		entry = rcu_dereference_raw(slot->slots[i]);
+		if (is_sibling_entry(slot, entry)) {
+			results[nr_found++] = (void **)slot->slots +
+						canonical_offset(slot, i);
+			i = next_slot(slot, i, shift, &index);
+			if (nr_found == max_items)
 				goto out;
 		}
 
-		shift -= RADIX_TREE_MAP_SHIFT;
-		slot = rcu_dereference_raw(slot->slots[i]);
-		if (slot == NULL)
-			goto out;
-	}
-
-	/* Bottom level: grab some items */
-	for (i = index & RADIX_TREE_MAP_MASK; i < RADIX_TREE_MAP_SIZE; i++) {
-		index++;
-		if (slot->slots[i]) {
-			results[nr_found++] = &(slot->slots[i]);
+		while (i < RADIX_TREE_MAP_SIZE) {
+			entry = rcu_dereference_raw(slot->slots[i]);
+			if (is_node_entry(slot, entry))
+				break;
+			if (entry && !is_sibling_entry(slot, entry))
+				results[nr_found++] = &(slot->slots[i]);
+			i = next_slot(slot, i, shift, &index);
 			if (nr_found == max_items)
 				goto out;
 		}
+		if (i == RADIX_TREE_MAP_SIZE)
+			goto out;
+
+		/* Go a level down */
+		shift -= RADIX_TREE_MAP_SHIFT;
+		slot = indirect_to_ptr(entry);
 	}
 out:
 	*next_index = index;
@@ -1008,38 +1126,33 @@ __lookup_tag(struct radix_tree_node *slot, void ***results, unsigned long index,
 	unsigned int max_items, unsigned long *next_index, unsigned int tag)
 {
 	unsigned int nr_found = 0;
-	unsigned int shift, height;
+	unsigned int shift, height, i;
+	void *entry = NULL;
 
 	height = slot->height;
 	if (height == 0)
 		goto out;
 	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
 
-	while (height > 0) {
-		unsigned long i = (index >> shift) & RADIX_TREE_MAP_MASK ;
+	for (;;) {
+		i = (index >> shift) & RADIX_TREE_MAP_MASK;
 
-		for (;;) {
-			if (tag_get(slot, tag, i))
-				break;
-			index &= ~((1UL << shift) - 1);
-			index += 1UL << shift;
-			if (index == 0)
-				goto out;	/* 32-bit wraparound */
-			i++;
-			if (i == RADIX_TREE_MAP_SIZE)
+		/* the lookup starts inside an entry spanning several slots */
+		if (is_sibling_entry(slot, rcu_dereference_raw(slot->slots[i]))) {
+			unsigned int offset = canonical_offset(slot, i);
+
+			if (tag_get(slot, tag, offset))
+				results[nr_found++] = (void **)slot->slots + offset;
+			i = next_slot(slot, i, shift, &index);
+			if (nr_found == max_items)
 				goto out;
 		}
-		height--;
-		if (height == 0) {	/* Bottom level: grab some items */
-			unsigned long j = index & RADIX_TREE_MAP_MASK;
 
-			for ( ; j < RADIX_TREE_MAP_SIZE; j++) {
-				index++;
-				if (!tag_get(slot, tag, j))
-					continue;
+		while (i < RADIX_TREE_MAP_SIZE) {
+			if (tag_get(slot, tag, i)) {
 				/*
 				 * Even though the tag was found set, we need to
-				 * recheck that we have a non-NULL node, because
+				 * recheck that we have a non-NULL entry, because
 				 * if this lookup is lockless, it may have been
 				 * subsequently deleted.
 				 *
@@ -1047,17 +1160,22 @@ __lookup_tag(struct radix_tree_node *slot, void ***results, unsigned long index,
 				 * lookup ->slots[x] without a lock (ie. can't
 				 * rely on its value remaining the same).
 				 */
-				if (slot->slots[j]) {
-					results[nr_found++] = &(slot->slots[j]);
-					if (nr_found == max_items)
-						goto out;
-				}
+				entry = rcu_dereference_raw(slot->slots[i]);
+				if (is_node_entry(slot, entry))
+					break;
+				if (entry && !is_sibling_entry(slot, entry))
+					results[nr_found++] = &(slot->slots[i]);
 			}
+			i = next_slot(slot, i, shift, &index);
+			if (nr_found == max_items)
+				goto out;
 		}
+		if (i == RADIX_TREE_MAP_SIZE)
+			goto out;
+
+		/* Go a level down */
 		shift -= RADIX_TREE_MAP_SHIFT;
-		slot = rcu_dereference_raw(slot->slots[i]);
-		if (slot == NULL)
-			break;
+		slot = indirect_to_ptr(entry);
 	}
 out:
 	*next_index = index;
@@ -1217,6 +1335,10 @@ static inline void radix_tree_shrink(struct radix_tree_root *root)
 			break;
 		if (!to_free->slots[0])
 			break;
+		/* an item covering all of this node cannot move up */
+		if (to_free->height > 1 &&
+		    !radix_tree_is_indirect_ptr(to_free->slots[0]))
+			break;
 
 		/*
 		 * We don't need rcu_assign_pointer(), since we are simply
@@ -1226,8 +1348,6 @@ static inline void radix_tree_shrink(struct radix_tree_root *root)
 		 * one (root->rnode) as far as dependent read barriers go.
 		 */
 		newptr = to_free->slots[0];
-		if (root->height > 1)
-			newptr = ptr_to_indirect(newptr);
 		root->rnode = newptr;
 		root->height--;
 
@@ -1273,9 +1393,10 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	 * since the "list" is null terminated.
 	 */
 	struct radix_tree_path path[RADIX_TREE_MAX_PATH + 1], *pathp = path;
-	struct radix_tree_node *slot = NULL;
+	struct radix_tree_node *node;
 	struct radix_tree_node *to_free;
-	unsigned int height, shift;
+	void *entry = NULL;
+	unsigned int height, shift, nr;
 	int tag;
 	int offset;
 
@@ -1283,31 +1404,29 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 	if (index > radix_tree_maxindex(height))
 		goto out;
 
-	slot = root->rnode;
+	entry = root->rnode;
 	if (height == 0) {
 		root_tag_clear_all(root);
 		root->rnode = NULL;
 		goto out;
 	}
-	slot = indirect_to_ptr(slot);
 
 	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
 	pathp->node = NULL;
 
-	do {
-		if (slot == NULL)
-			goto out;
-
+	/* only nodes are indirect with the tree locked */
+	while (radix_tree_is_indirect_ptr(entry)) {
+		node = indirect_to_ptr(entry);
 		pathp++;
-		offset = (index >> shift) & RADIX_TREE_MAP_MASK;
+		offset = canonical_offset(node,
+					  (index >> shift) & RADIX_TREE_MAP_MASK);
 		pathp->offset = offset;
-		pathp->node = slot;
-		slot = slot->slots[offset];
+		pathp->node = node;
+		entry = node->slots[offset];
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
-	} while (height > 0);
+	}
 
-	if (slot == NULL)
+	if (entry == NULL)
 		goto out;
 
 	/*
@@ -1318,6 +1437,15 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 			radix_tree_tag_clear(root, index, tag);
 	}
 
+	/* The item's siblings go with it */
+	node = pathp->node;
+	for (nr = 1; pathp->offset + nr < RADIX_TREE_MAP_SIZE; nr++) {
+		if (!is_sibling_entry(node, node->slots[pathp->offset + nr]))
+			break;
+		node->slots[pathp->offset + nr] = NULL;
+	}
+	node->count -= nr - 1;
+
 	to_free = NULL;
 	/* Now free the nodes we do not need anymore */
 	while (pathp->node) {
@@ -1348,7 +1476,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 		radix_tree_node_free(to_free);
 
 out:
-	return slot;
+	return entry;
 }
 EXPORT_SYMBOL(radix_tree_delete);
 
@@ -65,21 +65,25 @@ static void bdi_debug_init(void)
 static int bdi_debug_stats_show(struct seq_file *m, void *v)
 {
 	struct backing_dev_info *bdi = m->private;
-	struct bdi_writeback *wb = &bdi->wb;
 	unsigned long background_thresh;
 	unsigned long dirty_thresh;
 	unsigned long bdi_thresh;
 	unsigned long nr_dirty, nr_io, nr_more_io, nr_wb;
 	struct inode *inode;
+	unsigned int i;
 
 	nr_wb = nr_dirty = nr_io = nr_more_io = 0;
 	spin_lock(&inode_lock);
-	list_for_each_entry(inode, &wb->b_dirty, i_wb_list)
-		nr_dirty++;
-	list_for_each_entry(inode, &wb->b_io, i_wb_list)
-		nr_io++;
-	list_for_each_entry(inode, &wb->b_more_io, i_wb_list)
-		nr_more_io++;
+	for (i = 0; i < bdi->nr_flushers; i++) {
+		struct bdi_writeback *wb = &bdi->wb[i];
+
+		list_for_each_entry(inode, &wb->b_dirty, i_wb_list)
+			nr_dirty++;
+		list_for_each_entry(inode, &wb->b_io, i_wb_list)
+			nr_io++;
+		list_for_each_entry(inode, &wb->b_more_io, i_wb_list)
+			nr_more_io++;
+	}
 	spin_unlock(&inode_lock);
 
 	global_dirty_limits(&background_thresh, &dirty_thresh);
@@ -90,18 +94,27 @@ static int bdi_debug_stats_show(struct seq_file *m, void *v)
 		   "BdiWriteback:     %8lu kB\n"
 		   "BdiReclaimable:   %8lu kB\n"
 		   "BdiDirtyThresh:   %8lu kB\n"
+		   "BdiDirtied:       %8lu kB\n"
+		   "BdiWritten:       %8lu kB\n"
+		   "BdiWriteBandwidth:%8lu kBps\n"
+		   "BdiDirtyRatelimit:%8lu kBps\n"
 		   "DirtyThresh:      %8lu kB\n"
 		   "BackgroundThresh: %8lu kB\n"
 		   "b_dirty:          %8lu\n"
 		   "b_io:             %8lu\n"
 		   "b_more_io:        %8lu\n"
+		   "flushers:         %8u\n"
 		   "bdi_list:         %8u\n"
 		   "state:            %8lx\n",
 		   (unsigned long) K(bdi_stat(bdi, BDI_WRITEBACK)),
 		   (unsigned long) K(bdi_stat(bdi, BDI_RECLAIMABLE)),
-		   K(bdi_thresh), K(dirty_thresh),
+		   K(bdi_thresh),
+		   (unsigned long) K(bdi_stat(bdi, BDI_DIRTIED)),
+		   (unsigned long) K(bdi_stat(bdi, BDI_WRITTEN)),
+		   K(bdi->write_bandwidth), K(bdi->dirty_ratelimit),
+		   K(dirty_thresh),
 		   K(background_thresh), nr_dirty, nr_io, nr_more_io,
-		   !list_empty(&bdi->bdi_list), bdi->state);
+		   bdi->nr_flushers, !list_empty(&bdi->bdi_list), bdi->state);
 #undef K
 
 	return 0;
@@ -210,12 +223,31 @@ static ssize_t max_ratio_store(struct device *dev,
 }
 BDI_SHOW(max_ratio, bdi->max_ratio)
 
+static ssize_t flushers_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct backing_dev_info *bdi = dev_get_drvdata(dev);
+	char *end;
+	unsigned int nr;
+	ssize_t ret = -EINVAL;
+
+	nr = simple_strtoul(buf, &end, 10);
+	if (*buf && (end[0] == '\0' || (end[0] == '\n' && end[1] == '\0'))) {
+		ret = bdi_set_flushers(bdi, nr);
+		if (!ret)
+			ret = count;
+	}
+	return ret;
+}
+BDI_SHOW(flushers, bdi->nr_flushers)
+
 #define __ATTR_RW(attr) __ATTR(attr, 0644, attr##_show, attr##_store)
 
 static struct device_attribute bdi_dev_attrs[] = {
 	__ATTR_RW(read_ahead_kb),
 	__ATTR_RW(min_ratio),
 	__ATTR_RW(max_ratio),
+	__ATTR_RW(flushers),
 	__ATTR_NULL,
 };
 
@@ -252,10 +284,15 @@ subsys_initcall(default_bdi_init);
 
 int bdi_has_dirty_io(struct backing_dev_info *bdi)
 {
-	return wb_has_dirty_io(&bdi->wb);
+	unsigned int i;
+
+	for (i = 0; i < bdi->nr_flushers; i++)
+		if (wb_has_dirty_io(&bdi->wb[i]))
+			return 1;
+	return 0;
 }
 
-static void bdi_flush_io(struct backing_dev_info *bdi)
+static void bdi_flush_io(struct bdi_writeback *wb)
 {
 	struct writeback_control wbc = {
 		.sync_mode		= WB_SYNC_NONE,
@@ -264,7 +301,7 @@ static void bdi_flush_io(struct backing_dev_info *bdi)
 		.nr_to_write		= 1024,
 	};
 
-	writeback_inodes_wb(&bdi->wb, &wbc);
+	writeback_inodes_wb(wb, &wbc);
 }
 
 /*
@@ -309,12 +346,13 @@ static void sync_supers_timer_fn(unsigned long unused)
 
 static void wakeup_timer_fn(unsigned long data)
 {
-	struct backing_dev_info *bdi = (struct backing_dev_info *)data;
+	struct bdi_writeback *wb = (struct bdi_writeback *)data;
+	struct backing_dev_info *bdi = wb->bdi;
 
 	spin_lock_bh(&bdi->wb_lock);
-	if (bdi->wb.task) {
+	if (wb->task) {
 		trace_writeback_wake_thread(bdi);
-		wake_up_process(bdi->wb.task);
+		wake_up_process(wb->task);
 	} else {
 		/*
 		 * When bdi tasks are inactive for long time, they are killed.
@@ -322,14 +360,14 @@ static void wakeup_timer_fn(unsigned long data)
 		 * should create and run the bdi thread.
 		 */
 		trace_writeback_wake_forker_thread(bdi);
-		wake_up_process(default_backing_dev_info.wb.task);
+		wake_up_process(default_backing_dev_info.wb[0].task);
 	}
 	spin_unlock_bh(&bdi->wb_lock);
 }
 
 /*
- * This function is used when the first inode for this bdi is marked dirty. It
- * wakes-up the corresponding bdi thread which should then take care of the
+ * This function is used when the first inode for this flusher is marked dirty.
+ * It wakes-up the corresponding bdi thread which should then take care of the
  * periodic background write-out of dirty inodes. Since the write-out would
  * starts only 'dirty_writeback_interval' centisecs from now anyway, we just
  * set up a timer which wakes the bdi thread up later.
@@ -338,12 +376,12 @@ static void wakeup_timer_fn(unsigned long data)
  * fast-path (used by '__mark_inode_dirty()'), so we save few context switches
  * by delaying the wake-up.
  */
-void bdi_wakeup_thread_delayed(struct backing_dev_info *bdi)
+void wb_wakeup_thread_delayed(struct bdi_writeback *wb)
 {
 	unsigned long timeout;
 
 	timeout = msecs_to_jiffies(dirty_writeback_interval * 10);
-	mod_timer(&bdi->wb.wakeup_timer, jiffies + timeout);
+	mod_timer(&wb->wakeup_timer, jiffies + timeout);
 }
 
 /*
@@ -373,6 +411,8 @@ static int bdi_forker_thread(void *ptr)
 	for (;;) {
 		struct task_struct *task = NULL;
 		struct backing_dev_info *bdi;
+		struct bdi_writeback *wb = NULL;
+		unsigned int i;
 		enum {
 			NO_ACTION,   /* Nothing to do */
 			FORK_THREAD, /* Fork bdi thread */
@@ -383,7 +423,7 @@ static int bdi_forker_thread(void *ptr)
 		 * Temporary measure, we want to make sure we don't see
 		 * dirty data on the default backing_dev_info
 		 */
-		if (wb_has_dirty_io(me) || !list_empty(&me->bdi->work_list)) {
+		if (wb_has_dirty_io(me) || me->nr_works) {
 			del_timer(&me->wakeup_timer);
 			wb_do_writeback(me, 0);
 		}
@@ -392,8 +432,6 @@ static int bdi_forker_thread(void *ptr)
 		set_current_state(TASK_INTERRUPTIBLE);
 
 		list_for_each_entry(bdi, &bdi_list, bdi_list) {
-			bool have_dirty_io;
-
 			if (!bdi_cap_writeback_dirty(bdi) ||
 			     bdi_cap_flush_forker(bdi))
 				continue;
@@ -401,60 +439,76 @@ static int bdi_forker_thread(void *ptr)
 			WARN(!test_bit(BDI_registered, &bdi->state),
 			     "bdi %p/%s is not registered!\n", bdi, bdi->name);
 
-			have_dirty_io = !list_empty(&bdi->work_list) ||
-					wb_has_dirty_io(&bdi->wb);
+			for (i = 0; i < BDI_MAX_FLUSHERS; i++) {
+				bool active = i < bdi->nr_flushers;
+				bool have_dirty_io;
+
+				wb = &bdi->wb[i];
+				have_dirty_io = active && (wb->nr_works ||
+							   wb_has_dirty_io(wb));
 
-			/*
-			 * If the bdi has work to do, but the thread does not
-			 * exist - create it.
-			 */
-			if (!bdi->wb.task && have_dirty_io) {
 				/*
-				 * Set the pending bit - if someone will try to
-				 * unregister this bdi - it'll wait on this bit.
+				 * If the flusher has work to do, but the
+				 * thread does not exist - create it.
 				 */
-				set_bit(BDI_pending, &bdi->state);
-				action = FORK_THREAD;
-				break;
-			}
+				if (!wb->task && have_dirty_io) {
+					/*
+					 * Set the pending bit - if someone will
+					 * try to unregister this bdi - it'll
+					 * wait on this bit.
+					 */
+					set_bit(BDI_pending, &bdi->state);
+					action = FORK_THREAD;
+					break;
+				}
+
+				spin_lock(&bdi->wb_lock);
 
-			spin_lock(&bdi->wb_lock);
-
-			/*
-			 * If there is no work to do and the bdi thread was
-			 * inactive long enough - kill it. The wb_lock is taken
-			 * to make sure no-one adds more work to this bdi and
-			 * wakes the bdi thread up.
-			 */
-			if (bdi->wb.task && !have_dirty_io &&
-			    time_after(jiffies, bdi->wb.last_active +
-						bdi_longest_inactive())) {
-				task = bdi->wb.task;
-				bdi->wb.task = NULL;
+				/*
+				 * If there is no work to do and the thread was
+				 * inactive long enough, or the bdi no longer
+				 * uses this flusher - kill it. The wb_lock is
+				 * taken to make sure no-one adds more work to
+				 * this bdi and wakes the bdi thread up.
+				 */
+				if (wb->task && !have_dirty_io &&
+				    (!active ||
+				     time_after(jiffies, wb->last_active +
+						bdi_longest_inactive()))) {
+					task = wb->task;
+					wb->task = NULL;
+					spin_unlock(&bdi->wb_lock);
+					set_bit(BDI_pending, &bdi->state);
+					action = KILL_THREAD;
+					break;
+				}
 				spin_unlock(&bdi->wb_lock);
-				set_bit(BDI_pending, &bdi->state);
-				action = KILL_THREAD;
-				break;
 			}
-			spin_unlock(&bdi->wb_lock);
+			if (action != NO_ACTION)
+				break;
 		}
 		spin_unlock_bh(&bdi_lock);
 
 		/* Keep working if default bdi still has things to do */
-		if (!list_empty(&me->bdi->work_list))
+		if (me->nr_works)
 			__set_current_state(TASK_RUNNING);
 
 		switch (action) {
 		case FORK_THREAD:
 			__set_current_state(TASK_RUNNING);
-			task = kthread_create(bdi_writeback_thread, &bdi->wb,
-					      "flush-%s", dev_name(bdi->dev));
+			if (wb->nr)
+				task = kthread_create(bdi_writeback_thread, wb,
+					"flush-%s/%u", dev_name(bdi->dev), wb->nr);
+			else
+				task = kthread_create(bdi_writeback_thread, wb,
+						      "flush-%s",
+						      dev_name(bdi->dev));
 			if (IS_ERR(task)) {
 				/*
 				 * If thread creation fails, force writeout of
 				 * the bdi from the thread.
 				 */
-				bdi_flush_io(bdi);
+				bdi_flush_io(wb);
 			} else {
 				/*
 				 * The spinlock makes sure we do not lose
@@ -463,7 +517,7 @@ static int bdi_forker_thread(void *ptr)
 				 * can start it.
 				 */
 				spin_lock_bh(&bdi->wb_lock);
-				bdi->wb.task = task;
+				wb->task = task;
 				spin_unlock_bh(&bdi->wb_lock);
 				wake_up_process(task);
 			}
@@ -537,7 +591,7 @@ int bdi_register(struct backing_dev_info *bdi, struct device *parent,
 	 * on-demand when they need it.
 	 */
 	if (bdi_cap_flush_forker(bdi)) {
-		struct bdi_writeback *wb = &bdi->wb;
+		struct bdi_writeback *wb = &bdi->wb[0];
 
 		wb->task = kthread_run(bdi_forker_thread, wb, "bdi-%s",
 						dev_name(dev));
@@ -568,6 +622,8 @@ EXPORT_SYMBOL(bdi_register_dev);
  */
 static void bdi_wb_shutdown(struct backing_dev_info *bdi)
 {
+	int i;
+
 	if (!bdi_cap_writeback_dirty(bdi))
 		return;
 
@@ -583,14 +639,18 @@ static void bdi_wb_shutdown(struct backing_dev_info *bdi)
 			TASK_UNINTERRUPTIBLE);
 
 	/*
-	 * Finally, kill the kernel thread. We don't need to be RCU
+	 * Finally, kill the kernel threads. We don't need to be RCU
 	 * safe anymore, since the bdi is gone from visibility. Force
-	 * unfreeze of the thread before calling kthread_stop(), otherwise
-	 * it would never exet if it is currently stuck in the refrigerator.
+	 * unfreeze of the threads before calling kthread_stop(), otherwise
+	 * one would never exet if it is currently stuck in the refrigerator.
 	 */
-	if (bdi->wb.task) {
-		thaw_process(bdi->wb.task);
-		kthread_stop(bdi->wb.task);
+	for (i = 0; i < BDI_MAX_FLUSHERS; i++) {
+		struct bdi_writeback *wb = &bdi->wb[i];
+
+		if (wb->task) {
+			thaw_process(wb->task);
+			kthread_stop(wb->task);
+		}
 	}
 }
 
@@ -611,10 +671,13 @@ static void bdi_prune_sb(struct backing_dev_info *bdi)
 
 void bdi_unregister(struct backing_dev_info *bdi)
 {
+	int i;
+
 	if (bdi->dev) {
 		trace_writeback_bdi_unregister(bdi);
 		bdi_prune_sb(bdi);
-		del_timer_sync(&bdi->wb.wakeup_timer);
+		for (i = 0; i < BDI_MAX_FLUSHERS; i++)
+			del_timer_sync(&bdi->wb[i].wakeup_timer);
 
 		if (!bdi_cap_flush_forker(bdi))
 			bdi_wb_shutdown(bdi);
@@ -625,16 +688,18 @@ void bdi_unregister(struct backing_dev_info *bdi)
 }
 EXPORT_SYMBOL(bdi_unregister);
 
-static void bdi_wb_init(struct bdi_writeback *wb, struct backing_dev_info *bdi)
+static void bdi_wb_init(struct bdi_writeback *wb, struct backing_dev_info *bdi,
+			unsigned int nr)
 {
 	memset(wb, 0, sizeof(*wb));
 
 	wb->bdi = bdi;
+	wb->nr = nr;
 	wb->last_old_flush = jiffies;
 	INIT_LIST_HEAD(&wb->b_dirty);
 	INIT_LIST_HEAD(&wb->b_io);
 	INIT_LIST_HEAD(&wb->b_more_io);
-	setup_timer(&wb->wakeup_timer, wakeup_timer_fn, (unsigned long)bdi);
+	setup_timer(&wb->wakeup_timer, wakeup_timer_fn, (unsigned long)wb);
 }
 
 int bdi_init(struct backing_dev_info *bdi)
@@ -650,7 +715,10 @@ int bdi_init(struct backing_dev_info *bdi)
 	INIT_LIST_HEAD(&bdi->bdi_list);
 	INIT_LIST_HEAD(&bdi->work_list);
 
-	bdi_wb_init(&bdi->wb, bdi);
+	for (i = 0; i < BDI_MAX_FLUSHERS; i++)
+		bdi_wb_init(&bdi->wb[i], bdi, i);
+	bdi->nr_flushers = 1;
+	atomic_set(&bdi->wb_running, 0);
 
 	for (i = 0; i < NR_BDI_STAT_ITEMS; i++) {
 		err = percpu_counter_init(&bdi->bdi_stat[i], 0);
@@ -659,6 +727,14 @@ int bdi_init(struct backing_dev_info *bdi)
 	}
 
 	bdi->dirty_exceeded = 0;
+
+	spin_lock_init(&bdi->bw_lock);
+	bdi->bw_time_stamp = jiffies;
+	bdi->dirtied_stamp = 0;
+	bdi->written_stamp = 0;
+	bdi->write_bandwidth = INIT_BW;
+	bdi->dirty_ratelimit = INIT_BW;
+
 	err = prop_local_init_percpu(&bdi->completions);
 
 	if (err) {
@@ -680,12 +756,16 @@ void bdi_destroy(struct backing_dev_info *bdi)
 	 * bdi disappears
 	 */
 	if (bdi_has_dirty_io(bdi)) {
-		struct bdi_writeback *dst = &default_backing_dev_info.wb;
+		struct bdi_writeback *dst = &default_backing_dev_info.wb[0];
 
 		spin_lock(&inode_lock);
-		list_splice(&bdi->wb.b_dirty, &dst->b_dirty);
-		list_splice(&bdi->wb.b_io, &dst->b_io);
-		list_splice(&bdi->wb.b_more_io, &dst->b_more_io);
+		for (i = 0; i < bdi->nr_flushers; i++) {
+			struct bdi_writeback *wb = &bdi->wb[i];
+
+			list_splice(&wb->b_dirty, &dst->b_dirty);
+			list_splice(&wb->b_io, &dst->b_io);
+			list_splice(&wb->b_more_io, &dst->b_more_io);
+		}
 		spin_unlock(&inode_lock);
 	}
 
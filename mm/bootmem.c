@@ -172,7 +172,10 @@ void __init free_bootmem_late(unsigned long addr, unsigned long size)
 }
 
 #ifdef CONFIG_NO_BOOTMEM
-static void __init __free_pages_memory(unsigned long start, unsigned long end)
+#ifndef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+static
+#endif
+void __init __free_pages_memory(unsigned long start, unsigned long end)
 {
 	int i;
 	unsigned long start_aligned, end_aligned;
@@ -198,6 +201,47 @@ static void __init __free_pages_memory(unsigned long start, unsigned long end)
 		__free_pages_bootmem(pfn_to_page(i), 0);
 }
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/*
+ * Free what is below the nodes' deferred struct pages now, leave the rest
+ * to the node threads; if they cannot take another range, set up its
+ * struct pages and free it here after all.
+ */
+static void __init free_pages_memory_early(unsigned long start,
+					   unsigned long end)
+{
+	while (start < end) {
+		unsigned long next = end;
+		bool deferred = false;
+		int nid;
+
+		for_each_online_node(nid) {
+			pg_data_t *pgdat = NODE_DATA(nid);
+			unsigned long dstart = pgdat->first_deferred_pfn;
+			unsigned long dend = pgdat->deferred_end_pfn;
+
+			if (start >= dstart && start < dend) {
+				next = min(end, dend);
+				deferred = true;
+				if (!defer_free_range(nid, start, next)) {
+					memmap_init_deferred(nid, start, next);
+					deferred = false;
+				}
+				break;
+			}
+			if (dstart > start && dstart < next)
+				next = dstart;
+		}
+
+		if (!deferred)
+			__free_pages_memory(start, next);
+		start = next;
+	}
+}
+#else
+#define free_pages_memory_early(start, end) __free_pages_memory(start, end)
+#endif
+
 unsigned long __init free_all_memory_core_early(int nodeid)
 {
 	int i;
@@ -212,7 +256,7 @@ unsigned long __init free_all_memory_core_early(int nodeid)
 		start = range[i].start;
 		end = range[i].end;
 		count += end - start;
-		__free_pages_memory(start, end);
+		free_pages_memory_early(start, end);
 	}
 
 	return count;
@@ -14,6 +14,8 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 #include "internal.h"
 
 #define CREATE_TRACE_POINTS
@@ -383,6 +385,29 @@ static void update_nr_listpages(struct compact_control *cc)
 	cc->nr_freepages = nr_freepages;
 }
 
+/*
+ * Free pageblocks kcompactd keeps available in each zone, so that THP and
+ * other pageblock sized allocations rarely need to compact directly
+ */
+int sysctl_compact_reserve_blocks = 4;
+
+/* Number of free pageblocks in the zone, counting larger blocks as several */
+static unsigned long zone_free_blocks(struct zone *zone)
+{
+	unsigned long nr = 0;
+	unsigned int order;
+
+	for (order = pageblock_order; order < MAX_ORDER; order++)
+		nr += zone->free_area[order].nr_free << (order - pageblock_order);
+
+	return nr;
+}
+
+static bool zone_reserve_met(struct zone *zone)
+{
+	return zone_free_blocks(zone) >= sysctl_compact_reserve_blocks;
+}
+
 static int compact_finished(struct zone *zone,
 			    struct compact_control *cc)
 {
@@ -396,6 +421,13 @@ static int compact_finished(struct zone *zone,
 	if (cc->free_pfn <= cc->migrate_pfn)
 		return COMPACT_COMPLETE;
 
+	/* kcompactd: done once the zone holds its free pageblock reserve */
+	if (cc->compact_mode == COMPACT_MODE_KCOMPACTD) {
+		if (kthread_should_stop() || zone_reserve_met(zone))
+			return COMPACT_PARTIAL;
+		return COMPACT_CONTINUE;
+	}
+
 	/* Compaction run is not finished if the watermark is not met */
 	if (cc->compact_mode != COMPACT_MODE_KSWAPD)
 		watermark = low_wmark_pages(zone);
@@ -651,6 +683,157 @@ static int compact_node(int nid)
 	return 0;
 }
 
+static bool kcompactd_zone_needs_work(struct zone *zone)
+{
+	if (!populated_zone(zone) || zone_reserve_met(zone))
+		return false;
+
+	return compaction_suitable(zone, pageblock_order) == COMPACT_CONTINUE;
+}
+
+/* Compact the zones of the node that are short of free pageblocks */
+static void kcompactd_do_work(pg_data_t *pgdat)
+{
+	int zoneid;
+	struct zone *zone;
+	bool drained = false;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct compact_control cc = {
+			.nr_freepages = 0,
+			.nr_migratepages = 0,
+			.order = pageblock_order,
+			.migratetype = MIGRATE_MOVABLE,
+			.sync = false,
+			.compact_mode = COMPACT_MODE_KCOMPACTD,
+		};
+		int ret;
+
+		zone = &pgdat->node_zones[zoneid];
+		if (!kcompactd_zone_needs_work(zone))
+			continue;
+		if (compaction_deferred(zone))
+			continue;
+
+		if (!drained) {
+			lru_add_drain_all();
+			drained = true;
+		}
+
+		cc.zone = zone;
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		ret = compact_zone(zone, &cc);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+
+		/*
+		 * A full pass that still left the zone short will not do better
+		 * right away: back off the way a failed direct compaction does.
+		 */
+		if (ret == COMPACT_COMPLETE && !zone_reserve_met(zone))
+			defer_compaction(zone);
+		else if (ret == COMPACT_PARTIAL)
+			zone->compact_defer_shift = 0;
+
+		if (kthread_should_stop())
+			break;
+	}
+}
+
+static bool kcompactd_work_requested(pg_data_t *pgdat)
+{
+	return pgdat->kcompactd_wake || kthread_should_stop();
+}
+
+/*
+ * The background compaction thread of a node. Woken by high-order
+ * allocations entering the slow path, and otherwise checking once a
+ * second, it compacts until every zone holds
+ * sysctl_compact_reserve_blocks free pageblocks.
+ */
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				kcompactd_work_requested(pgdat), HZ);
+		pgdat->kcompactd_wake = 0;
+
+		if (kthread_should_stop())
+			break;
+		if (sysctl_compact_reserve_blocks)
+			kcompactd_do_work(pgdat);
+	}
+
+	return 0;
+}
+
+/*
+ * Called from the slow path of high-order allocations: kick the node's
+ * kcompactd if the zone has fallen short of its free pageblock reserve.
+ */
+void wakeup_kcompactd(struct zone *zone)
+{
+	pg_data_t *pgdat = zone->zone_pgdat;
+
+	if (!sysctl_compact_reserve_blocks || zone_reserve_met(zone))
+		return;
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+
+	pgdat->kcompactd_wake = 1;
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	return 0;
+}
+module_init(kcompactd_init)
+
 /* Compact all nodes in the system */
 static int compact_nodes(void)
 {
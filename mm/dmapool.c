@@ -20,6 +20,12 @@
  * least 'size' bytes.  Free blocks are tracked in an unsorted singly-linked
  * list of free blocks within the page.  Used blocks aren't tracked, but we
  * keep a count of how many are currently allocated from each page.
+ *
+ * Pages with a free block are also on the pool's free_list, so allocation
+ * does not search, and all pages are in an rbtree by dma address, for
+ * dma_pool_free() to find the page of a block.  Without the debug checks,
+ * the last few blocks freed on each cpu are kept in a per-cpu cache that
+ * dma_pool_alloc() takes from before it takes the pool lock.
  */
 
 #include <linux/device.h>
@@ -29,7 +35,9 @@
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/poison.h>
+#include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -41,8 +49,22 @@
 #define DMAPOOL_DEBUG 1
 #endif
 
+/* Blocks each cpu keeps of those freed last */
+#define DMA_POOL_PCPU_NR	8
+
+struct dma_pool_pcpu {
+	int nr;
+	struct {
+		void *vaddr;
+		dma_addr_t dma;
+	} blocks[DMA_POOL_PCPU_NR];
+};
+
 struct dma_pool {		/* the pool */
 	struct list_head page_list;
+	struct list_head free_list;	/* pages with a free block */
+	struct rb_root page_tree;	/* pages by dma address */
+	struct dma_pool_pcpu __percpu *pcpu;
 	spinlock_t lock;
 	size_t size;
 	struct device *dev;
@@ -55,6 +77,8 @@ struct dma_pool {		/* the pool */
 
 struct dma_page {		/* cacheable header for 'allocation' bytes */
 	struct list_head page_list;
+	struct list_head free_list;
+	struct rb_node rb_node;
 	void *vaddr;
 	dma_addr_t dma;
 	unsigned int in_use;
@@ -167,6 +191,14 @@ struct dma_pool *dma_pool_create(const char *name, struct device *dev,
 	retval->dev = dev;
 
 	INIT_LIST_HEAD(&retval->page_list);
+	INIT_LIST_HEAD(&retval->free_list);
+	retval->page_tree = RB_ROOT;
+#ifndef DMAPOOL_DEBUG
+	/* the pool works without the cache, just takes the lock more */
+	retval->pcpu = alloc_percpu(struct dma_pool_pcpu);
+#else
+	retval->pcpu = NULL;
+#endif
 	spin_lock_init(&retval->lock);
 	retval->size = size;
 	retval->boundary = boundary;
@@ -185,6 +217,7 @@ struct dma_pool *dma_pool_create(const char *name, struct device *dev,
 		if (!ret)
 			list_add(&retval->pools, &dev->dma_pools);
 		else {
+			free_percpu(retval->pcpu);
 			kfree(retval);
 			retval = NULL;
 		}
@@ -212,6 +245,22 @@ static void pool_initialise_page(struct dma_pool *pool, struct dma_page *page)
 	} while (offset < pool->allocation);
 }
 
+static void pool_insert_page(struct dma_pool *pool, struct dma_page *page)
+{
+	struct rb_node **link = &pool->page_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (page->dma < rb_entry(parent, struct dma_page, rb_node)->dma)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&page->rb_node, parent, link);
+	rb_insert_color(&page->rb_node, &pool->page_tree);
+}
+
 static struct dma_page *pool_alloc_page(struct dma_pool *pool, gfp_t mem_flags)
 {
 	struct dma_page *page;
@@ -227,6 +276,8 @@ static struct dma_page *pool_alloc_page(struct dma_pool *pool, gfp_t mem_flags)
 #endif
 		pool_initialise_page(pool, page);
 		list_add(&page->page_list, &pool->page_list);
+		list_add(&page->free_list, &pool->free_list);
+		pool_insert_page(pool, page);
 		page->in_use = 0;
 		page->offset = 0;
 	} else {
@@ -250,9 +301,99 @@ static void pool_free_page(struct dma_pool *pool, struct dma_page *page)
 #endif
 	dma_free_coherent(pool->dev, pool->allocation, page->vaddr, dma);
 	list_del(&page->page_list);
+	list_del(&page->free_list);
+	rb_erase(&page->rb_node, &pool->page_tree);
 	kfree(page);
 }
 
+static struct dma_page *pool_find_page(struct dma_pool *pool, dma_addr_t dma)
+{
+	struct rb_node *node = pool->page_tree.rb_node;
+	struct dma_page *page;
+
+	while (node) {
+		page = rb_entry(node, struct dma_page, rb_node);
+		if (dma < page->dma)
+			node = node->rb_left;
+		else if (dma >= page->dma + pool->allocation)
+			node = node->rb_right;
+		else
+			return page;
+	}
+	return NULL;
+}
+
+static void pool_put_block(struct dma_pool *pool, void *vaddr, dma_addr_t dma)
+{
+	struct dma_page *page;
+	unsigned long flags;
+	unsigned int offset;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	page = pool_find_page(pool, dma);
+	if (!page) {
+		spin_unlock_irqrestore(&pool->lock, flags);
+		if (pool->dev)
+			dev_err(pool->dev,
+				"dma_pool_free %s, %p/%lx (bad dma)\n",
+				pool->name, vaddr, (unsigned long)dma);
+		else
+			printk(KERN_ERR "dma_pool_free %s, %p/%lx (bad dma)\n",
+			       pool->name, vaddr, (unsigned long)dma);
+		return;
+	}
+
+	offset = vaddr - page->vaddr;
+#ifdef	DMAPOOL_DEBUG
+	if ((dma - page->dma) != offset) {
+		spin_unlock_irqrestore(&pool->lock, flags);
+		if (pool->dev)
+			dev_err(pool->dev,
+				"dma_pool_free %s, %p (bad vaddr)/%Lx\n",
+				pool->name, vaddr, (unsigned long long)dma);
+		else
+			printk(KERN_ERR
+			       "dma_pool_free %s, %p (bad vaddr)/%Lx\n",
+			       pool->name, vaddr, (unsigned long long)dma);
+		return;
+	}
+	{
+		unsigned int chain = page->offset;
+		while (chain < pool->allocation) {
+			if (chain != offset) {
+				chain = *(int *)(page->vaddr + chain);
+				continue;
+			}
+			spin_unlock_irqrestore(&pool->lock, flags);
+			if (pool->dev)
+				dev_err(pool->dev, "dma_pool_free %s, dma %Lx "
+					"already free\n", pool->name,
+					(unsigned long long)dma);
+			else
+				printk(KERN_ERR "dma_pool_free %s, dma %Lx "
+					"already free\n", pool->name,
+					(unsigned long long)dma);
+			return;
+		}
+	}
+	memset(vaddr, POOL_POISON_FREED, pool->size);
+#endif
+
+	page->in_use--;
+	if (page->offset >= pool->allocation)
+		list_add(&page->free_list, &pool->free_list);
+	*(int *)vaddr = page->offset;
+	page->offset = offset;
+	if (waitqueue_active(&pool->waitq))
+		wake_up_locked(&pool->waitq);
+	/*
+	 * Resist a temptation to do
+	 *    if (!is_page_busy(page)) pool_free_page(pool, page);
+	 * Better have a few empty pages hang around.
+	 */
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
 /**
  * dma_pool_destroy - destroys a pool of dma memory blocks.
  * @pool: dma pool that will be destroyed
@@ -269,6 +410,21 @@ void dma_pool_destroy(struct dma_pool *pool)
 		device_remove_file(pool->dev, &dev_attr_pools);
 	mutex_unlock(&pools_lock);
 
+	if (pool->pcpu) {
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct dma_pool_pcpu *pcp = per_cpu_ptr(pool->pcpu, cpu);
+
+			while (pcp->nr) {
+				pcp->nr--;
+				pool_put_block(pool, pcp->blocks[pcp->nr].vaddr,
+					       pcp->blocks[pcp->nr].dma);
+			}
+		}
+		free_percpu(pool->pcpu);
+	}
+
 	while (!list_empty(&pool->page_list)) {
 		struct dma_page *page;
 		page = list_entry(pool->page_list.next,
@@ -284,6 +440,8 @@ void dma_pool_destroy(struct dma_pool *pool)
 				       pool->name, page->vaddr);
 			/* leak the still-in-use consistent memory */
 			list_del(&page->page_list);
+			list_del(&page->free_list);
+			rb_erase(&page->rb_node, &pool->page_tree);
 			kfree(page);
 		} else
 			pool_free_page(pool, page);
@@ -313,11 +471,28 @@ void *dma_pool_alloc(struct dma_pool *pool, gfp_t mem_flags,
 
 	might_sleep_if(mem_flags & __GFP_WAIT);
 
+	if (pool->pcpu) {
+		struct dma_pool_pcpu *pcp;
+
+		retval = NULL;
+		local_irq_save(flags);
+		pcp = this_cpu_ptr(pool->pcpu);
+		if (pcp->nr) {
+			pcp->nr--;
+			retval = pcp->blocks[pcp->nr].vaddr;
+			*handle = pcp->blocks[pcp->nr].dma;
+		}
+		local_irq_restore(flags);
+		if (retval)
+			return retval;
+	}
+
 	spin_lock_irqsave(&pool->lock, flags);
  restart:
-	list_for_each_entry(page, &pool->page_list, page_list) {
-		if (page->offset < pool->allocation)
-			goto ready;
+	if (!list_empty(&pool->free_list)) {
+		page = list_first_entry(&pool->free_list, struct dma_page,
+					free_list);
+		goto ready;
 	}
 	page = pool_alloc_page(pool, GFP_ATOMIC);
 	if (!page) {
@@ -342,6 +517,8 @@ void *dma_pool_alloc(struct dma_pool *pool, gfp_t mem_flags,
 	page->in_use++;
 	offset = page->offset;
 	page->offset = *(int *)(page->vaddr + offset);
+	if (page->offset >= pool->allocation)
+		list_del_init(&page->free_list);
 	retval = offset + page->vaddr;
 	*handle = offset + page->dma;
 #ifdef	DMAPOOL_DEBUG
@@ -353,19 +530,6 @@ void *dma_pool_alloc(struct dma_pool *pool, gfp_t mem_flags,
 }
 EXPORT_SYMBOL(dma_pool_alloc);
 
-static struct dma_page *pool_find_page(struct dma_pool *pool, dma_addr_t dma)
-{
-	struct dma_page *page;
-
-	list_for_each_entry(page, &pool->page_list, page_list) {
-		if (dma < page->dma)
-			continue;
-		if (dma < (page->dma + pool->allocation))
-			return page;
-	}
-	return NULL;
-}
-
 /**
  * dma_pool_free - put block back into dma pool
  * @pool: the dma pool holding the block
@@ -377,71 +541,26 @@ static struct dma_page *pool_find_page(struct dma_pool *pool, dma_addr_t dma)
  */
 void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t dma)
 {
-	struct dma_page *page;
-	unsigned long flags;
-	unsigned int offset;
-
-	spin_lock_irqsave(&pool->lock, flags);
-	page = pool_find_page(pool, dma);
-	if (!page) {
-		spin_unlock_irqrestore(&pool->lock, flags);
-		if (pool->dev)
-			dev_err(pool->dev,
-				"dma_pool_free %s, %p/%lx (bad dma)\n",
-				pool->name, vaddr, (unsigned long)dma);
-		else
-			printk(KERN_ERR "dma_pool_free %s, %p/%lx (bad dma)\n",
-			       pool->name, vaddr, (unsigned long)dma);
-		return;
-	}
-
-	offset = vaddr - page->vaddr;
-#ifdef	DMAPOOL_DEBUG
-	if ((dma - page->dma) != offset) {
-		spin_unlock_irqrestore(&pool->lock, flags);
-		if (pool->dev)
-			dev_err(pool->dev,
-				"dma_pool_free %s, %p (bad vaddr)/%Lx\n",
-				pool->name, vaddr, (unsigned long long)dma);
-		else
-			printk(KERN_ERR
-			       "dma_pool_free %s, %p (bad vaddr)/%Lx\n",
-			       pool->name, vaddr, (unsigned long long)dma);
-		return;
-	}
-	{
-		unsigned int chain = page->offset;
-		while (chain < pool->allocation) {
-			if (chain != offset) {
-				chain = *(int *)(page->vaddr + chain);
-				continue;
-			}
-			spin_unlock_irqrestore(&pool->lock, flags);
-			if (pool->dev)
-				dev_err(pool->dev, "dma_pool_free %s, dma %Lx "
-					"already free\n", pool->name,
-					(unsigned long long)dma);
-			else
-				printk(KERN_ERR "dma_pool_free %s, dma %Lx "
-					"already free\n", pool->name,
-					(unsigned long long)dma);
-			return;
+	/* unless someone waits for a block to be freed to the pool */
+	if (pool->pcpu && !waitqueue_active(&pool->waitq)) {
+		struct dma_pool_pcpu *pcp;
+		unsigned long flags;
+		int cached = 0;
+
+		local_irq_save(flags);
+		pcp = this_cpu_ptr(pool->pcpu);
+		if (pcp->nr < DMA_POOL_PCPU_NR) {
+			pcp->blocks[pcp->nr].vaddr = vaddr;
+			pcp->blocks[pcp->nr].dma = dma;
+			pcp->nr++;
+			cached = 1;
 		}
+		local_irq_restore(flags);
+		if (cached)
+			return;
 	}
-	memset(vaddr, POOL_POISON_FREED, pool->size);
-#endif
 
-	page->in_use--;
-	*(int *)vaddr = page->offset;
-	page->offset = offset;
-	if (waitqueue_active(&pool->waitq))
-		wake_up_locked(&pool->waitq);
-	/*
-	 * Resist a temptation to do
-	 *    if (!is_page_busy(page)) pool_free_page(pool, page);
-	 * Better have a few empty pages hang around.
-	 */
-	spin_unlock_irqrestore(&pool->lock, flags);
+	pool_put_block(pool, vaddr, dma);
 }
 EXPORT_SYMBOL(dma_pool_free);
 
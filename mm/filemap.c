@@ -461,6 +461,120 @@ int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 }
 EXPORT_SYMBOL_GPL(add_to_page_cache_lru);
 
+/**
+ * add_to_page_cache_lru_vec - add a batch of new pages to the page cache
+ * @pvec:	the pages, each with its ->index set, best in ascending order
+ * @mapping:	the page's address_space
+ * @gfp_mask:	page allocation mode
+ *
+ * add_to_page_cache_lru() for a pagevec of pages: they are inserted under
+ * one hold of tree_lock for as long as one radix tree preload lasts, which
+ * is the whole batch when the indices are close, and go on the LRU at once.
+ *
+ * Returns the number of pages added.  Those are moved to the start of
+ * @pvec, locked, the others to its end unlocked, each group in its order.
+ */
+int add_to_page_cache_lru_vec(struct pagevec *pvec,
+			      struct address_space *mapping, gfp_t gfp_mask)
+{
+	struct page *failed[PAGEVEC_SIZE];
+	int nr = pagevec_count(pvec);
+	int nr_failed = 0, nr_added = 0;
+	bool swap_backed = mapping_cap_swap_backed(mapping);
+	struct pagevec lru;
+	int i;
+
+	/* charging may sleep, get it done before the lock */
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		/* see add_to_page_cache_lru() */
+		if (swap_backed)
+			SetPageSwapBacked(page);
+		__set_page_locked(page);
+		if (mem_cgroup_cache_charge(page, current->mm,
+					    gfp_mask & GFP_RECLAIM_MASK)) {
+			__clear_page_locked(page);
+			failed[nr_failed++] = page;
+			continue;
+		}
+		pvec->pages[nr_added++] = page;
+	}
+	nr = nr_added;
+	nr_added = 0;
+
+	i = 0;
+	while (i < nr) {
+		int nr_exist = 0, first = nr_failed;
+
+		if (radix_tree_preload(gfp_mask & ~__GFP_HIGHMEM))
+			break;
+
+		spin_lock_irq(&mapping->tree_lock);
+		for (; i < nr; i++) {
+			struct page *page = pvec->pages[i];
+			int error;
+
+			page_cache_get(page);
+			page->mapping = mapping;
+			error = radix_tree_insert(&mapping->page_tree,
+						  page->index, page);
+			if (unlikely(error)) {
+				page->mapping = NULL;
+				page_cache_release(page);
+				/* the preload ran out, take another one */
+				if (error == -ENOMEM)
+					break;
+				failed[nr_failed++] = page;
+				nr_exist++;
+				continue;
+			}
+			mapping->nrpages++;
+			__inc_zone_page_state(page, NR_FILE_PAGES);
+			if (swap_backed)
+				__inc_zone_page_state(page, NR_SHMEM);
+			pvec->pages[nr_added++] = page;
+		}
+		spin_unlock_irq(&mapping->tree_lock);
+		radix_tree_preload_end();
+
+		while (nr_exist--) {
+			struct page *page = failed[first++];
+
+			mem_cgroup_uncharge_cache_page(page);
+			__clear_page_locked(page);
+		}
+		/* a full preload is enough for the next insert at least */
+	}
+
+	/* whatever is left could not get radix tree nodes */
+	for (; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		mem_cgroup_uncharge_cache_page(page);
+		__clear_page_locked(page);
+		failed[nr_failed++] = page;
+	}
+
+	pagevec_init(&lru, 0);
+	for (i = 0; i < nr_added; i++) {
+		page_cache_get(pvec->pages[i]);
+		pagevec_add(&lru, pvec->pages[i]);
+	}
+	if (pagevec_count(&lru)) {
+		if (swap_backed)
+			__pagevec_lru_add_anon(&lru);
+		else
+			__pagevec_lru_add_file(&lru);
+	}
+
+	for (i = 0; i < nr_failed; i++)
+		pvec->pages[nr_added + i] = failed[i];
+
+	return nr_added;
+}
+EXPORT_SYMBOL_GPL(add_to_page_cache_lru_vec);
+
 #ifdef CONFIG_NUMA
 struct page *__page_cache_alloc(gfp_t gfp)
 {
@@ -621,8 +735,10 @@ int __lock_page_or_retry(struct page *page, struct mm_struct *mm,
 		__lock_page(page);
 		return 1;
 	} else {
-		up_read(&mm->mmap_sem);
-		wait_on_page_locked(page);
+		if (!(flags & FAULT_FLAG_RETRY_NOWAIT)) {
+			up_read(&mm->mmap_sem);
+			wait_on_page_locked(page);
+		}
 		return 0;
 	}
 }
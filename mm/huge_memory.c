@@ -17,6 +17,9 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/ksm.h>
+#include <linux/shmem_fs.h>
+#include <linux/file.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -36,7 +39,17 @@ unsigned long transparent_hugepage_flags __read_mostly =
 	(1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG)|
 #endif
 	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)|
-	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG);
+	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG)|
+	(1<<TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+
+/*
+ * Read faults in hugepage regions map this one zeroed hugepage, shared
+ * by everybody and never written, instead of allocating and clearing a
+ * hugepage of their own. It is allocated by the first such fault and
+ * never freed. Its mappings take no reference and no rmap, and count
+ * nowhere, like those of the small zero page.
+ */
+static struct page *huge_zero_page __read_mostly;
 
 /* default scan 8*512 pte (or vmas) every 30 second */
 static unsigned int khugepaged_pages_to_scan __read_mostly = HPAGE_PMD_NR*8;
@@ -45,7 +58,6 @@ static unsigned int khugepaged_full_scans;
 static unsigned int khugepaged_scan_sleep_millisecs __read_mostly = 10000;
 /* during fragmentation poll the hugepage allocator once every minute */
 static unsigned int khugepaged_alloc_sleep_millisecs __read_mostly = 60000;
-static struct task_struct *khugepaged_thread __read_mostly;
 static DEFINE_MUTEX(khugepaged_mutex);
 static DEFINE_SPINLOCK(khugepaged_mm_lock);
 static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
@@ -56,10 +68,11 @@ static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
  */
 static unsigned int khugepaged_max_ptes_none __read_mostly = HPAGE_PMD_NR-1;
 
-static int khugepaged(void *none);
+static int khugepaged(void *arg);
 static int mm_slots_hash_init(void);
 static int khugepaged_slab_init(void);
 static void khugepaged_slab_free(void);
+static void khugepaged_pools_init(void);
 
 #define MM_SLOTS_HASH_HEADS 1024
 static struct hlist_head *mm_slots_hash __read_mostly;
@@ -70,29 +83,94 @@ static struct kmem_cache *mm_slot_cache __read_mostly;
  * @hash: hash collision list
  * @mm_node: khugepaged scan list headed in khugepaged_scan.mm_head
  * @mm: the mm that this information is valid for
+ * @scanning: the cursor of a khugepaged thread is on it
+ * @rung: only one pmd in 1 << @rung is scanned per pass, see below
+ * @offset: which one, rotated each pass
+ * @pmds: pmds scanned in this pass
+ * @hot_pmds: how many of them had khugepaged_young_hot young ptes or more
  */
 struct mm_slot {
 	struct hlist_node hash;
 	struct list_head mm_node;
 	struct mm_struct *mm;
+	int scanning;
+	unsigned int rung;
+	unsigned int offset;
+	unsigned long pmds;
+	unsigned long hot_pmds;
+};
+
+/*
+ * Like UKSM's rung ladder, khugepaged samples the pmds of an mm by how
+ * much it found there in the last pass: all of them while most pmds are
+ * hot, down to one in 1 << (KHUGEPAGED_RUNGS - 1) when few are. A pmd is
+ * hot when khugepaged_young_hot of its ptes or more are young, that is
+ * where a hugepage saves TLB misses. The pages_to_scan budget left by the
+ * cold mms goes to the hot ones.
+ */
+#define KHUGEPAGED_RUNGS	4
+static const unsigned int khugepaged_rung_hot_pct[KHUGEPAGED_RUNGS] = {
+	50, 25, 10, 0
 };
+static unsigned int khugepaged_young_hot __read_mostly = HPAGE_PMD_NR / 8;
 
 /**
- * struct khugepaged_scan - cursor for scanning
+ * struct khugepaged_scan - the mm list to scan
  * @mm_head: the head of the mm list to scan
- * @mm_slot: the current mm_slot we are scanning
- * @address: the next address inside that to be scanned
  *
- * There is only the one khugepaged_scan instance of this cursor structure.
+ * The khugepaged threads share it, each with its own cursor.
  */
 struct khugepaged_scan {
 	struct list_head mm_head;
-	struct mm_slot *mm_slot;
-	unsigned long address;
 } khugepaged_scan = {
 	.mm_head = LIST_HEAD_INIT(khugepaged_scan.mm_head),
 };
 
+/**
+ * struct khugepaged_worker - one khugepaged thread and its cursor
+ * @thread: the thread, NULL when not running
+ * @mm_slot: the current mm_slot it is scanning, not scanned by another
+ * @address: the next address inside that to be scanned
+ * @index: its place in khugepaged_workers
+ *
+ * The index'th thread runs on the cpus of the (index % online nodes)'th
+ * node, those with an index from khugepaged_nr_threads on exit.
+ */
+struct khugepaged_worker {
+	struct task_struct *thread;
+	struct mm_slot *mm_slot;
+	unsigned long address;
+	unsigned int index;
+};
+
+#define KHUGEPAGED_MAX_THREADS	16
+static struct khugepaged_worker khugepaged_workers[KHUGEPAGED_MAX_THREADS];
+static unsigned int khugepaged_nr_threads __read_mostly = 1;
+
+/**
+ * struct khugepaged_pool - hugepages allocated ahead of the collapses
+ * @lock: protects @pages and @nr
+ * @pages: the ready hugepages of node @nid
+ * @nr: how many
+ * @work: refills the pool, compacting if khugepaged/defrag is set
+ * @nid: the node of the pool
+ *
+ * A collapse takes its hugepage from the pool of the node of the pages it
+ * replaces, and does not wait on compaction nor sleep between attempts
+ * when the pool is refilled in time.
+ */
+#define KHUGEPAGED_POOL_MAX	8
+struct khugepaged_pool {
+	spinlock_t lock;
+	struct page *pages[KHUGEPAGED_POOL_MAX];
+	int nr;
+	struct work_struct work;
+	int nid;
+};
+
+static struct khugepaged_pool khugepaged_pools[MAX_NUMNODES];
+static unsigned int khugepaged_pool_pages __read_mostly = 2;
+
 
 static int set_recommended_min_free_kbytes(void)
 {
@@ -134,24 +212,49 @@ static int set_recommended_min_free_kbytes(void)
 }
 late_initcall(set_recommended_min_free_kbytes);
 
+static int start_khugepaged_thread(struct khugepaged_worker *worker)
+{
+	struct task_struct *thread;
+	int nid, i;
+
+	if (!worker->index)
+		thread = kthread_create(khugepaged, worker, "khugepaged");
+	else
+		thread = kthread_create(khugepaged, worker, "khugepaged/%u",
+					worker->index);
+	if (unlikely(IS_ERR(thread))) {
+		printk(KERN_ERR
+		       "khugepaged: kthread_run(khugepaged) failed\n");
+		return PTR_ERR(thread);
+	}
+
+	nid = first_online_node;
+	for (i = 0; i < worker->index % num_online_nodes(); i++)
+		nid = next_online_node(nid);
+	if (num_online_nodes() > 1 &&
+	    cpumask_any_and(cpumask_of_node(nid), cpu_online_mask) <
+	    nr_cpu_ids)
+		set_cpus_allowed_ptr(thread, cpumask_of_node(nid));
+
+	worker->thread = thread;
+	wake_up_process(thread);
+	return 0;
+}
+
 static int start_khugepaged(void)
 {
 	int err = 0;
 	if (khugepaged_enabled()) {
-		int wakeup;
+		int wakeup, i;
 		if (unlikely(!mm_slot_cache || !mm_slots_hash)) {
 			err = -ENOMEM;
 			goto out;
 		}
 		mutex_lock(&khugepaged_mutex);
-		if (!khugepaged_thread)
-			khugepaged_thread = kthread_run(khugepaged, NULL,
-							"khugepaged");
-		if (unlikely(IS_ERR(khugepaged_thread))) {
-			printk(KERN_ERR
-			       "khugepaged: kthread_run(khugepaged) failed\n");
-			err = PTR_ERR(khugepaged_thread);
-			khugepaged_thread = NULL;
+		for (i = 0; i < khugepaged_nr_threads && !err; i++) {
+			if (!khugepaged_workers[i].thread)
+				err = start_khugepaged_thread(
+						&khugepaged_workers[i]);
 		}
 		wakeup = !list_empty(&khugepaged_scan.mm_head);
 		mutex_unlock(&khugepaged_mutex);
@@ -289,6 +392,22 @@ static ssize_t defrag_store(struct kobject *kobj,
 static struct kobj_attribute defrag_attr =
 	__ATTR(defrag, 0644, defrag_show, defrag_store);
 
+static ssize_t use_zero_page_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return single_flag_show(kobj, attr, buf,
+				TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static ssize_t use_zero_page_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	return single_flag_store(kobj, attr, buf, count,
+				 TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static struct kobj_attribute use_zero_page_attr =
+	__ATTR(use_zero_page, 0644, use_zero_page_show, use_zero_page_store);
+
 #ifdef CONFIG_DEBUG_VM
 static ssize_t debug_cow_show(struct kobject *kobj,
 				struct kobj_attribute *attr, char *buf)
@@ -310,6 +429,7 @@ static struct kobj_attribute debug_cow_attr =
 static struct attribute *hugepage_attr[] = {
 	&enabled_attr.attr,
 	&defrag_attr.attr,
+	&use_zero_page_attr.attr,
 #ifdef CONFIG_DEBUG_VM
 	&debug_cow_attr.attr,
 #endif
@@ -414,6 +534,88 @@ static ssize_t full_scans_show(struct kobject *kobj,
 {
 	return sprintf(buf, "%u\n", khugepaged_full_scans);
 }
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_nr_threads);
+}
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long threads;
+
+	err = strict_strtoul(buf, 10, &threads);
+	if (err || !threads || threads > KHUGEPAGED_MAX_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&khugepaged_mutex);
+	khugepaged_nr_threads = threads;
+	mutex_unlock(&khugepaged_mutex);
+	/* wakeup the ones to exit, start the missing ones */
+	wake_up_interruptible(&khugepaged_wait);
+	err = start_khugepaged();
+	if (err)
+		return err;
+
+	return count;
+}
+static struct kobj_attribute scan_threads_attr =
+	__ATTR(scan_threads, 0644, scan_threads_show,
+	       scan_threads_store);
+
+static ssize_t alloc_pool_pages_show(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_pool_pages);
+}
+static ssize_t alloc_pool_pages_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	int err;
+	unsigned long pages;
+
+	err = strict_strtoul(buf, 10, &pages);
+	if (err || pages > KHUGEPAGED_POOL_MAX)
+		return -EINVAL;
+
+	khugepaged_pool_pages = pages;
+
+	return count;
+}
+static struct kobj_attribute alloc_pool_pages_attr =
+	__ATTR(alloc_pool_pages, 0644, alloc_pool_pages_show,
+	       alloc_pool_pages_store);
+
+static ssize_t young_ptes_hot_show(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_young_hot);
+}
+static ssize_t young_ptes_hot_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long young;
+
+	err = strict_strtoul(buf, 10, &young);
+	if (err || young > HPAGE_PMD_NR)
+		return -EINVAL;
+
+	khugepaged_young_hot = young;
+
+	return count;
+}
+static struct kobj_attribute young_ptes_hot_attr =
+	__ATTR(young_ptes_hot, 0644, young_ptes_hot_show,
+	       young_ptes_hot_store);
+
 static struct kobj_attribute full_scans_attr =
 	__ATTR_RO(full_scans);
 
@@ -475,6 +677,9 @@ static struct attribute *khugepaged_attr[] = {
 	&full_scans_attr.attr,
 	&scan_sleep_millisecs_attr.attr,
 	&alloc_sleep_millisecs_attr.attr,
+	&scan_threads_attr.attr,
+	&alloc_pool_pages_attr.attr,
+	&young_ptes_hot_attr.attr,
 	NULL,
 };
 
@@ -522,6 +727,8 @@ static int __init hugepage_init(void)
 	if (err)
 		goto out;
 
+	khugepaged_pools_init();
+
 	err = mm_slots_hash_init();
 	if (err) {
 		khugepaged_slab_free();
@@ -597,6 +804,52 @@ static inline pmd_t maybe_pmd_mkwrite(pmd_t pmd, struct vm_area_struct *vma)
 	return pmd;
 }
 
+static inline bool is_huge_zero_page(struct page *page)
+{
+	return ACCESS_ONCE(huge_zero_page) == page;
+}
+
+static inline bool is_huge_zero_pmd(pmd_t pmd)
+{
+	return is_huge_zero_page(pmd_page(pmd));
+}
+
+static struct page *get_huge_zero_page(void)
+{
+	struct page *zero_page;
+
+	zero_page = ACCESS_ONCE(huge_zero_page);
+	if (likely(zero_page))
+		return zero_page;
+
+	zero_page = alloc_pages((GFP_TRANSHUGE | __GFP_ZERO) & ~__GFP_MOVABLE,
+				HPAGE_PMD_ORDER);
+	if (!zero_page)
+		return NULL;
+	if (cmpxchg(&huge_zero_page, NULL, zero_page)) {
+		/* somebody else installed one first */
+		__free_pages(zero_page, HPAGE_PMD_ORDER);
+		zero_page = huge_zero_page;
+	}
+	return zero_page;
+}
+
+static bool set_huge_zero_page(pgtable_t pgtable, struct mm_struct *mm,
+			       struct vm_area_struct *vma, unsigned long haddr,
+			       pmd_t *pmd, struct page *zero_page)
+{
+	pmd_t entry;
+
+	if (!pmd_none(*pmd))
+		return false;
+	entry = mk_pmd(zero_page, vma->vm_page_prot);
+	entry = pmd_wrprotect(entry);
+	entry = pmd_mkhuge(entry);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	return true;
+}
+
 static int __do_huge_pmd_anonymous_page(struct mm_struct *mm,
 					struct vm_area_struct *vma,
 					unsigned long haddr, pmd_t *pmd,
@@ -656,14 +909,6 @@ static inline struct page *alloc_hugepage_vma(int defrag,
 			       HPAGE_PMD_ORDER, vma, haddr, nd);
 }
 
-#ifndef CONFIG_NUMA
-static inline struct page *alloc_hugepage(int defrag)
-{
-	return alloc_pages(alloc_hugepage_gfpmask(defrag),
-			   HPAGE_PMD_ORDER);
-}
-#endif
-
 int do_huge_pmd_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			       unsigned long address, pmd_t *pmd,
 			       unsigned int flags)
@@ -677,6 +922,25 @@ int do_huge_pmd_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			return VM_FAULT_OOM;
 		if (unlikely(khugepaged_enter(vma)))
 			return VM_FAULT_OOM;
+		if (!(flags & FAULT_FLAG_WRITE) &&
+		    transparent_hugepage_use_zero_page()) {
+			struct page *zero_page = get_huge_zero_page();
+			pgtable_t pgtable;
+			bool set;
+
+			if (unlikely(!zero_page))
+				goto out;
+			pgtable = pte_alloc_one(mm, haddr);
+			if (unlikely(!pgtable))
+				return VM_FAULT_OOM;
+			spin_lock(&mm->page_table_lock);
+			set = set_huge_zero_page(pgtable, mm, vma, haddr, pmd,
+						 zero_page);
+			spin_unlock(&mm->page_table_lock);
+			if (!set)
+				pte_free(mm, pgtable);
+			return 0;
+		}
 		page = alloc_hugepage_vma(transparent_hugepage_defrag(vma),
 					  vma, haddr, numa_node_id());
 		if (unlikely(!page))
@@ -709,6 +973,106 @@ out:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+static void put_locked_team(struct page *head, int nr)
+{
+	while (nr--) {
+		unlock_page(head + nr);
+		page_cache_release(head + nr);
+	}
+}
+
+/*
+ * Look up and lock the HPAGE_PMD_NR pages of @mapping from @index, with a
+ * reference on each: they make a team if they are all there, uptodate, and
+ * one aligned run of pfns. Returns the first of them, or NULL holding none
+ * if they do not, or if one of them is locked already.
+ */
+static struct page *get_locked_team(struct address_space *mapping,
+				    pgoff_t index)
+{
+	struct page *head, *page;
+	int i;
+
+	head = find_get_page(mapping, index);
+	if (!head)
+		return NULL;
+	if (PageCompound(head) || (page_to_pfn(head) & (HPAGE_PMD_NR - 1))) {
+		page_cache_release(head);
+		return NULL;
+	}
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = i ? find_get_page(mapping, index + i) : head;
+		if (page != head + i)
+			goto out_put;
+		if (!PageUptodate(page) || !trylock_page(page))
+			goto out_put;
+		if (page->mapping != mapping) {
+			unlock_page(page);
+			goto out_put;
+		}
+	}
+	return head;
+
+out_put:
+	if (page)
+		page_cache_release(page);
+	put_locked_team(head, i);
+	return NULL;
+}
+
+/*
+ * Map a team of shmem pages with one huge pmd where @pmd is none. The
+ * caller checked that @vma maps the whole aligned extent around @address
+ * linearly and within i_size. Returns VM_FAULT_FALLBACK unless the page
+ * cache holds a team there, for ->fault to map ptes instead.
+ */
+int do_huge_pmd_team_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			  unsigned long address, pmd_t *pmd,
+			  unsigned int flags)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *head;
+	pgtable_t pgtable;
+	pmd_t entry;
+	int i;
+
+	pgtable = pte_alloc_one(mm, haddr);
+	if (unlikely(!pgtable))
+		return VM_FAULT_FALLBACK;
+
+	/* the page locks hold truncation off until the pmd is in place */
+	head = get_locked_team(vma->vm_file->f_mapping,
+			       linear_page_index(vma, haddr));
+	if (!head) {
+		pte_free(mm, pgtable);
+		return VM_FAULT_FALLBACK;
+	}
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_none(*pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		pte_free(mm, pgtable);
+		put_locked_team(head, HPAGE_PMD_NR);
+		return 0;
+	}
+	entry = mk_pmd(head, vma->vm_page_prot);
+	entry = pmd_mkhuge(pmd_mkyoung(entry));
+	if (flags & FAULT_FLAG_WRITE)
+		entry = maybe_pmd_mkwrite(pmd_mkdirty(entry), vma);
+	/* the references from the lookup are the mapping's */
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		page_add_file_rmap(head + i);
+	add_mm_counter(mm, MM_FILEPAGES, HPAGE_PMD_NR);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	spin_unlock(&mm->page_table_lock);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		unlock_page(head + i);
+	return 0;
+}
+
 int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		  pmd_t *dst_pmd, pmd_t *src_pmd, unsigned long addr,
 		  struct vm_area_struct *vma)
@@ -741,6 +1105,19 @@ int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		wait_split_huge_page(vma->anon_vma, src_pmd); /* src_vma */
 		goto out;
 	}
+	if (is_huge_zero_pmd(pmd)) {
+		/* already write protected, nothing to account */
+		set_pmd_at(dst_mm, addr, dst_pmd, pmd_mkold(pmd));
+		prepare_pmd_huge_pte(pgtable, dst_mm);
+		ret = 0;
+		goto out_unlock;
+	}
+	if (pmd_trans_team(pmd)) {
+		/* shared page cache: the child faults the team in itself */
+		pte_free(dst_mm, pgtable);
+		ret = 0;
+		goto out_unlock;
+	}
 	src_page = pmd_page(pmd);
 	VM_BUG_ON(!PageHead(src_page));
 	get_page(src_page);
@@ -872,21 +1249,95 @@ out_free_pages:
 	goto out;
 }
 
+/*
+ * A write to the huge zero page without a hugepage to copy it to: the
+ * faulting address gets a page of its own, the rest of the range maps
+ * the small zero page.
+ */
+static int do_huge_pmd_wp_zero_page_fallback(struct mm_struct *mm,
+					     struct vm_area_struct *vma,
+					     unsigned long address,
+					     pmd_t *pmd, pmd_t orig_pmd,
+					     unsigned long haddr)
+{
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	struct page *page;
+	int i;
+
+	page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+	if (unlikely(!page))
+		return VM_FAULT_OOM;
+	if (unlikely(mem_cgroup_newpage_charge(page, mm, GFP_KERNEL))) {
+		put_page(page);
+		return VM_FAULT_OOM;
+	}
+	clear_user_highpage(page, address);
+	__SetPageUptodate(page);
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_same(*pmd, orig_pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		mem_cgroup_uncharge_page(page);
+		put_page(page);
+		return 0;
+	}
+
+	pmdp_clear_flush_notify(vma, haddr, pmd);
+	/* leave pmd empty until pte is filled */
+
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		if (haddr == (address & PAGE_MASK)) {
+			entry = mk_pte(page, vma->vm_page_prot);
+			entry = maybe_mkwrite(pte_mkdirty(entry), vma);
+			page_add_new_anon_rmap(page, vma, haddr);
+		} else {
+			entry = pfn_pte(page_to_pfn(ZERO_PAGE(haddr)),
+					vma->vm_page_prot);
+			entry = pte_mkspecial(entry);
+		}
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+
+	mm->nr_ptes++;
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+	add_mm_counter(mm, MM_ANONPAGES, 1);
+	spin_unlock(&mm->page_table_lock);
+
+	return VM_FAULT_WRITE;
+}
+
 int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			unsigned long address, pmd_t *pmd, pmd_t orig_pmd)
 {
 	int ret = 0;
-	struct page *page, *new_page;
+	struct page *page = NULL, *new_page;
 	unsigned long haddr;
 
+	if (pmd_trans_team(orig_pmd)) {
+		/* write protected by mprotect: let the ptes sort it out */
+		split_huge_page_pmd(vma, address, pmd);
+		return VM_FAULT_FALLBACK;
+	}
+
 	VM_BUG_ON(!vma->anon_vma);
 	spin_lock(&mm->page_table_lock);
 	if (unlikely(!pmd_same(*pmd, orig_pmd)))
 		goto out_unlock;
 
+	haddr = address & HPAGE_PMD_MASK;
+	if (is_huge_zero_pmd(orig_pmd))
+		goto alloc;
 	page = pmd_page(orig_pmd);
 	VM_BUG_ON(!PageCompound(page) || !PageHead(page));
-	haddr = address & HPAGE_PMD_MASK;
 	if (page_mapcount(page) == 1) {
 		pmd_t entry;
 		entry = pmd_mkyoung(orig_pmd);
@@ -897,6 +1348,7 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out_unlock;
 	}
 	get_page(page);
+alloc:
 	spin_unlock(&mm->page_table_lock);
 
 	if (transparent_hugepage_enabled(vma) &&
@@ -907,30 +1359,39 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		new_page = NULL;
 
 	if (unlikely(!new_page)) {
-		ret = do_huge_pmd_wp_page_fallback(mm, vma, address,
-						   pmd, orig_pmd, page, haddr);
-		put_page(page);
+		if (!page)
+			ret = do_huge_pmd_wp_zero_page_fallback(mm, vma,
+					address, pmd, orig_pmd, haddr);
+		else {
+			ret = do_huge_pmd_wp_page_fallback(mm, vma, address,
+					pmd, orig_pmd, page, haddr);
+			put_page(page);
+		}
 		goto out;
 	}
 
 	if (unlikely(mem_cgroup_newpage_charge(new_page, mm, GFP_KERNEL))) {
 		put_page(new_page);
-		put_page(page);
+		if (page)
+			put_page(page);
 		ret |= VM_FAULT_OOM;
 		goto out;
 	}
 
-	copy_user_huge_page(new_page, page, haddr, vma, HPAGE_PMD_NR);
+	if (!page)
+		clear_huge_page(new_page, haddr, HPAGE_PMD_NR);
+	else
+		copy_user_huge_page(new_page, page, haddr, vma, HPAGE_PMD_NR);
 	__SetPageUptodate(new_page);
 
 	spin_lock(&mm->page_table_lock);
-	put_page(page);
+	if (page)
+		put_page(page);
 	if (unlikely(!pmd_same(*pmd, orig_pmd))) {
 		mem_cgroup_uncharge_page(new_page);
 		put_page(new_page);
 	} else {
 		pmd_t entry;
-		VM_BUG_ON(!PageHead(page));
 		entry = mk_pmd(new_page, vma->vm_page_prot);
 		entry = maybe_pmd_mkwrite(pmd_mkdirty(entry), vma);
 		entry = pmd_mkhuge(entry);
@@ -938,8 +1399,13 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		page_add_new_anon_rmap(new_page, vma, haddr);
 		set_pmd_at(mm, haddr, pmd, entry);
 		update_mmu_cache(vma, address, entry);
-		page_remove_rmap(page);
-		put_page(page);
+		if (!page)
+			add_mm_counter(mm, MM_ANONPAGES, HPAGE_PMD_NR);
+		else {
+			VM_BUG_ON(!PageHead(page));
+			page_remove_rmap(page);
+			put_page(page);
+		}
 		ret |= VM_FAULT_WRITE;
 	}
 out_unlock:
@@ -961,7 +1427,7 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		goto out;
 
 	page = pmd_page(*pmd);
-	VM_BUG_ON(!PageHead(page));
+	VM_BUG_ON(PageCompound(page) && !PageHead(page));
 	if (flags & FOLL_TOUCH) {
 		pmd_t _pmd;
 		/*
@@ -976,7 +1442,7 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		set_pmd_at(mm, addr & HPAGE_PMD_MASK, pmd, _pmd);
 	}
 	page += (addr & ~HPAGE_PMD_MASK) >> PAGE_SHIFT;
-	VM_BUG_ON(!PageCompound(page));
+	VM_BUG_ON(!PageCompound(page) && !page_may_be_team(page));
 	if (flags & FOLL_GET)
 		get_page(page);
 
@@ -984,8 +1450,33 @@ out:
 	return page;
 }
 
+/*
+ * The pages of a team are unmapped one by one, like the ptes the pmd stood
+ * for: which of them were written through it is not known, so all of them
+ * are dirtied if any was.
+ */
+static void zap_huge_team_pmd(struct mmu_gather *tlb,
+			      struct vm_area_struct *vma, pmd_t orig_pmd)
+{
+	struct page *page = pmd_page(orig_pmd);
+	int i;
+
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		page_remove_rmap(page + i);
+	add_mm_counter(tlb->mm, MM_FILEPAGES, -HPAGE_PMD_NR);
+	spin_unlock(&tlb->mm->page_table_lock);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		if (pmd_dirty(orig_pmd))
+			set_page_dirty(page + i);
+		if (pmd_young(orig_pmd) && likely(!VM_SequentialReadHint(vma)))
+			mark_page_accessed(page + i);
+		tlb_remove_page(tlb, page + i);
+	}
+}
+
 int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
-		 pmd_t *pmd)
+		 pmd_t *pmd, unsigned long addr)
 {
 	int ret = 0;
 
@@ -998,9 +1489,22 @@ int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 		} else {
 			struct page *page;
 			pgtable_t pgtable;
+			pmd_t orig_pmd;
 			pgtable = get_pmd_huge_pte(tlb->mm);
-			page = pmd_page(*pmd);
-			pmd_clear(pmd);
+			orig_pmd = pmdp_get_and_clear(tlb->mm, addr, pmd);
+			page = pmd_page(orig_pmd);
+			if (is_huge_zero_page(page)) {
+				spin_unlock(&tlb->mm->page_table_lock);
+				/* nothing to free, only the tlb to flush */
+				tlb->need_flush = 1;
+				pte_free(tlb->mm, pgtable);
+				return 1;
+			}
+			if (pmd_trans_team(orig_pmd)) {
+				zap_huge_team_pmd(tlb, vma, orig_pmd);
+				pte_free(tlb->mm, pgtable);
+				return 1;
+			}
 			page_remove_rmap(page);
 			VM_BUG_ON(page_mapcount(page) < 0);
 			add_mm_counter(tlb->mm, MM_ANONPAGES, -HPAGE_PMD_NR);
@@ -1399,13 +1903,18 @@ out:
 int hugepage_madvise(struct vm_area_struct *vma,
 		     unsigned long *vm_flags, int advice)
 {
+	unsigned long shared = VM_SHARED | VM_MAYSHARE;
+
+	/* shmem maps teams of its page cache with huge pmds */
+	if (vma->vm_ops && vma->vm_ops->pmd_fault)
+		shared = 0;
+
 	switch (advice) {
 	case MADV_HUGEPAGE:
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_HUGEPAGE |
-				 VM_SHARED   | VM_MAYSHARE   |
+		if (*vm_flags & (VM_HUGEPAGE | shared |
 				 VM_PFNMAP   | VM_IO      | VM_DONTEXPAND |
 				 VM_RESERVED | VM_HUGETLB | VM_INSERTPAGE |
 				 VM_MIXEDMAP | VM_SAO))
@@ -1424,8 +1933,7 @@ int hugepage_madvise(struct vm_area_struct *vma,
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_NOHUGEPAGE |
-				 VM_SHARED   | VM_MAYSHARE   |
+		if (*vm_flags & (VM_NOHUGEPAGE | shared |
 				 VM_PFNMAP   | VM_IO      | VM_DONTEXPAND |
 				 VM_RESERVED | VM_HUGETLB | VM_INSERTPAGE |
 				 VM_MIXEDMAP | VM_SAO))
@@ -1443,15 +1951,115 @@ int hugepage_madvise(struct vm_area_struct *vma,
 	return 0;
 }
 
-static int __init khugepaged_slab_init(void)
+static void khugepaged_pool_refill(struct work_struct *work)
 {
-	mm_slot_cache = kmem_cache_create("khugepaged_mm_slot",
-					  sizeof(struct mm_slot),
-					  __alignof__(struct mm_slot), 0, NULL);
-	if (!mm_slot_cache)
-		return -ENOMEM;
+	struct khugepaged_pool *pool = container_of(work,
+						    struct khugepaged_pool,
+						    work);
+	struct page *page;
+	int added = 0;
+
+	while (khugepaged_enabled() &&
+	       ACCESS_ONCE(pool->nr) < khugepaged_pool_pages) {
+		page = alloc_pages_exact_node(pool->nid,
+			alloc_hugepage_gfpmask(khugepaged_defrag()) |
+			__GFP_THISNODE, HPAGE_PMD_ORDER);
+		if (!page)
+			break;
 
-	return 0;
+		spin_lock(&pool->lock);
+		if (pool->nr < KHUGEPAGED_POOL_MAX) {
+			pool->pages[pool->nr++] = page;
+			page = NULL;
+		}
+		spin_unlock(&pool->lock);
+		if (page) {
+			put_page(page);
+			break;
+		}
+		added = 1;
+		cond_resched();
+	}
+
+	/* cut short the alloc_sleep of who found the pool empty */
+	if (added)
+		wake_up_interruptible(&khugepaged_wait);
+}
+
+static void khugepaged_pool_drain(void)
+{
+	struct khugepaged_pool *pool;
+	struct page *page;
+	int nid;
+
+	for_each_node(nid) {
+		pool = &khugepaged_pools[nid];
+		spin_lock(&pool->lock);
+		while (pool->nr) {
+			page = pool->pages[--pool->nr];
+			spin_unlock(&pool->lock);
+			put_page(page);
+			spin_lock(&pool->lock);
+		}
+		spin_unlock(&pool->lock);
+	}
+}
+
+static void __init khugepaged_pools_init(void)
+{
+	struct khugepaged_pool *pool;
+	int nid, i;
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		pool = &khugepaged_pools[nid];
+		spin_lock_init(&pool->lock);
+		INIT_WORK(&pool->work, khugepaged_pool_refill);
+		pool->nid = nid;
+	}
+
+	for (i = 0; i < KHUGEPAGED_MAX_THREADS; i++)
+		khugepaged_workers[i].index = i;
+	khugepaged_nr_threads = min_t(unsigned int, num_online_nodes(),
+				      KHUGEPAGED_MAX_THREADS);
+}
+
+/*
+ * The hugepage for a collapse on @node: from the pool of that node, or if
+ * it is empty from an allocation that does not wait, while the pool is
+ * being refilled.
+ */
+static struct page *khugepaged_alloc_page(int node)
+{
+	struct khugepaged_pool *pool;
+	struct page *page = NULL;
+
+	if (node < 0 || !node_online(node))
+		node = numa_node_id();
+	pool = &khugepaged_pools[node];
+
+	spin_lock(&pool->lock);
+	if (pool->nr)
+		page = pool->pages[--pool->nr];
+	spin_unlock(&pool->lock);
+
+	if (ACCESS_ONCE(pool->nr) < khugepaged_pool_pages)
+		queue_work(system_long_wq, &pool->work);
+
+	if (!page)
+		page = alloc_pages_exact_node(node,
+				alloc_hugepage_gfpmask(0), HPAGE_PMD_ORDER);
+	return page;
+}
+
+static int __init khugepaged_slab_init(void)
+{
+	mm_slot_cache = kmem_cache_create("khugepaged_mm_slot",
+					  sizeof(struct mm_slot),
+					  __alignof__(struct mm_slot), 0, NULL);
+	if (!mm_slot_cache)
+		return -ENOMEM;
+
+	return 0;
 }
 
 static void __init khugepaged_slab_free(void)
@@ -1580,7 +2188,7 @@ void __khugepaged_exit(struct mm_struct *mm)
 
 	spin_lock(&khugepaged_mm_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && khugepaged_scan.mm_slot != mm_slot) {
+	if (mm_slot && !mm_slot->scanning) {
 		hlist_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
 		free = 1;
@@ -1759,29 +2367,22 @@ static void collapse_huge_page(struct mm_struct *mm,
 	unsigned long hstart, hend;
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
-#ifndef CONFIG_NUMA
-	VM_BUG_ON(!*hpage);
-	new_page = *hpage;
-#else
 	VM_BUG_ON(*hpage);
 	/*
-	 * Allocate the page while the vma is still valid and under
+	 * Get the page while the vma is still valid and under
 	 * the mmap_sem read mode so there is no memory allocation
 	 * later when we take the mmap_sem in write mode. This is more
 	 * friendly behavior (OTOH it may actually hide bugs) to
 	 * filesystems in userland with daemons allocating memory in
-	 * the userland I/O paths.  Allocating memory with the
-	 * mmap_sem in read mode is good idea also to allow greater
-	 * scalability.
+	 * the userland I/O paths. It normally comes from the pool,
+	 * allocated ahead outside of any mmap_sem.
 	 */
-	new_page = alloc_hugepage_vma(khugepaged_defrag(), vma, address,
-				      node);
+	new_page = khugepaged_alloc_page(node);
 	if (unlikely(!new_page)) {
 		up_read(&mm->mmap_sem);
 		*hpage = ERR_PTR(-ENOMEM);
 		return;
 	}
-#endif
 	if (unlikely(mem_cgroup_newpage_charge(new_page, mm, GFP_KERNEL))) {
 		up_read(&mm->mmap_sem);
 		put_page(new_page);
@@ -1807,7 +2408,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 		goto out;
 
 	if ((!(vma->vm_flags & VM_HUGEPAGE) && !khugepaged_always()) ||
-	    (vma->vm_flags & VM_NOHUGEPAGE))
+	    (vma->vm_flags & VM_NOHUGEPAGE) || ksm_vma_huge_hold(vma, address))
 		goto out;
 
 	/* VM_PFNMAP vmas may have vm_ops null but vm_file set */
@@ -1892,23 +2493,20 @@ static void collapse_huge_page(struct mm_struct *mm,
 	mm->nr_ptes--;
 	spin_unlock(&mm->page_table_lock);
 
-#ifndef CONFIG_NUMA
-	*hpage = NULL;
-#endif
 	khugepaged_pages_collapsed++;
+	ksm_vma_huge_collapsed(vma, address, HPAGE_PMD_NR);
 out_up_write:
 	up_write(&mm->mmap_sem);
 	return;
 
 out:
 	mem_cgroup_uncharge_page(new_page);
-#ifdef CONFIG_NUMA
 	put_page(new_page);
-#endif
 	goto out_up_write;
 }
 
 static int khugepaged_scan_pmd(struct mm_struct *mm,
+			       struct mm_slot *mm_slot,
 			       struct vm_area_struct *vma,
 			       unsigned long address,
 			       struct page **hpage)
@@ -1923,6 +2521,8 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 	spinlock_t *ptl;
 	int node = -1;
 
+	mm_slot->pmds++;
+
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
 
 	pgd = pgd_offset(mm, address);
@@ -1967,10 +2567,12 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 			goto out_unmap;
 		if (pte_young(pteval) || PageReferenced(page) ||
 		    mmu_notifier_test_young(vma->vm_mm, address))
-			referenced = 1;
+			referenced++;
 	}
 	if (referenced)
 		ret = 1;
+	if (referenced && referenced >= khugepaged_young_hot)
+		mm_slot->hot_pmds++;
 out_unmap:
 	pte_unmap_unlock(pte, ptl);
 	if (ret)
@@ -1980,6 +2582,161 @@ out:
 	return ret;
 }
 
+/*
+ * Replace the pte table at @pmd with a huge pmd mapping the team found in
+ * the page cache, if every pte is none or maps its page of the team.
+ */
+static void collapse_team_pmd(struct mm_struct *mm,
+			      struct vm_area_struct *vma,
+			      unsigned long address, pmd_t *pmd)
+{
+	struct page *head;
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+	bool young = false;
+	int i, nr_none = 0;
+
+	head = get_locked_team(vma->vm_file->f_mapping,
+			       linear_page_index(vma, address));
+	if (!head)
+		return;
+
+	spin_lock(&mm->page_table_lock);
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd)) {
+		spin_unlock(&mm->page_table_lock);
+		put_locked_team(head, HPAGE_PMD_NR);
+		return;
+	}
+	/* as in collapse_huge_page(), no gup_fast walks the ptes after this */
+	_pmd = pmdp_clear_flush_notify(vma, address, pmd);
+	spin_unlock(&mm->page_table_lock);
+
+	pte = pte_offset_map(&_pmd, address);
+	ptl = pte_lockptr(mm, &_pmd);
+	spin_lock(ptl);
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		pte_t pteval = pte[i];
+
+		if (pte_none(pteval))
+			continue;
+		if (!pte_present(pteval) ||
+		    pte_pfn(pteval) != page_to_pfn(head) + i)
+			break;
+	}
+	if (i < HPAGE_PMD_NR) {
+		spin_unlock(ptl);
+		pte_unmap(pte);
+		spin_lock(&mm->page_table_lock);
+		BUG_ON(!pmd_none(*pmd));
+		set_pmd_at(mm, address, pmd, _pmd);
+		spin_unlock(&mm->page_table_lock);
+		put_locked_team(head, HPAGE_PMD_NR);
+		return;
+	}
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		pte_t pteval = ptep_get_and_clear(mm, address + i * PAGE_SIZE,
+						  pte + i);
+
+		if (pte_none(pteval)) {
+			/* the lookup reference becomes the mapping's */
+			page_add_file_rmap(head + i);
+			nr_none++;
+			continue;
+		}
+		if (pte_dirty(pteval))
+			set_page_dirty(head + i);
+		if (pte_young(pteval))
+			young = true;
+		page_cache_release(head + i);
+	}
+	spin_unlock(ptl);
+	pte_unmap(pte);
+
+	pgtable = pmd_pgtable(_pmd);
+	_pmd = pmd_mkhuge(mk_pmd(head, vma->vm_page_prot));
+	if (young)
+		_pmd = pmd_mkyoung(_pmd);
+
+	spin_lock(&mm->page_table_lock);
+	BUG_ON(!pmd_none(*pmd));
+	add_mm_counter(mm, MM_FILEPAGES, nr_none);
+	set_pmd_at(mm, address, pmd, _pmd);
+	prepare_pmd_huge_pte(pgtable, mm);
+	mm->nr_ptes--;
+	spin_unlock(&mm->page_table_lock);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		unlock_page(head + i);
+	khugepaged_pages_collapsed++;
+}
+
+/*
+ * The shmem counterpart of khugepaged_scan_pmd(): have shmem make the
+ * extent mapped at @address a team, then map that with a huge pmd. Returns
+ * 1 with the mmap_sem released once it got that far.
+ */
+static int khugepaged_scan_team(struct mm_struct *mm,
+				struct mm_slot *mm_slot,
+				struct vm_area_struct *vma,
+				unsigned long address)
+{
+	struct file *file = vma->vm_file;
+	pgoff_t index = linear_page_index(vma, address);
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	mm_slot->pmds++;
+
+	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return 0;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return 0;
+	pmd = pmd_offset(pud, address);
+	/* a none pmd gets its huge one at the next fault, if there is a team */
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd))
+		return 0;
+
+	/* may sleep in migration, with only the read mmap_sem held */
+	if (shmem_collapse_team(vma, address, khugepaged_max_ptes_none))
+		return 0;
+
+	get_file(file);
+	up_read(&mm->mmap_sem);
+	down_write(&mm->mmap_sem);
+	if (unlikely(khugepaged_test_exit(mm)))
+		goto out;
+
+	vma = find_vma(mm, address);
+	if (!vma || vma->vm_file != file || address < vma->vm_start ||
+	    address + HPAGE_PMD_SIZE > vma->vm_end ||
+	    linear_page_index(vma, address) != index)
+		goto out;
+	if (!(vma->vm_flags & VM_MAYSHARE) ||
+	    (vma->vm_flags & (VM_NONLINEAR | VM_LOCKED | VM_NOHUGEPAGE)))
+		goto out;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		goto out;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		goto out;
+	pmd = pmd_offset(pud, address);
+	if (pmd_present(*pmd) && !pmd_trans_huge(*pmd))
+		collapse_team_pmd(mm, vma, address, pmd);
+out:
+	up_write(&mm->mmap_sem);
+	fput(file);
+	return 1;
+}
+
 static void collect_mm_slot(struct mm_slot *mm_slot)
 {
 	struct mm_struct *mm = mm_slot->mm;
@@ -2003,7 +2760,51 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 	}
 }
 
-static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
+/* at the end of a pass, move @mm_slot to the rung its hot pmds deserve */
+static void khugepaged_climb_rung(struct mm_slot *mm_slot)
+{
+	unsigned int rung, pct;
+
+	if (mm_slot->pmds) {
+		pct = mm_slot->hot_pmds * 100 / mm_slot->pmds;
+		for (rung = 0; rung < KHUGEPAGED_RUNGS - 1; rung++)
+			if (pct >= khugepaged_rung_hot_pct[rung])
+				break;
+		mm_slot->rung = rung;
+	}
+	mm_slot->offset++;
+	mm_slot->pmds = 0;
+	mm_slot->hot_pmds = 0;
+}
+
+/* the first mm_slot from @pos on that no other thread is scanning */
+static struct mm_slot *khugepaged_next_mm_slot(struct list_head *pos)
+{
+	struct mm_slot *mm_slot;
+
+	VM_BUG_ON(!spin_is_locked(&khugepaged_mm_lock));
+
+	for (; pos != &khugepaged_scan.mm_head; pos = pos->next) {
+		mm_slot = list_entry(pos, struct mm_slot, mm_node);
+		if (!mm_slot->scanning)
+			return mm_slot;
+	}
+	return NULL;
+}
+
+static void khugepaged_set_cursor(struct khugepaged_worker *worker,
+				  struct mm_slot *mm_slot)
+{
+	if (worker->mm_slot)
+		worker->mm_slot->scanning = 0;
+	worker->mm_slot = mm_slot;
+	worker->address = 0;
+	if (mm_slot)
+		mm_slot->scanning = 1;
+}
+
+static unsigned int khugepaged_scan_mm_slot(struct khugepaged_worker *worker,
+					    unsigned int pages,
 					    struct page **hpage)
 {
 	struct mm_slot *mm_slot;
@@ -2014,14 +2815,14 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 	VM_BUG_ON(!pages);
 	VM_BUG_ON(!spin_is_locked(&khugepaged_mm_lock));
 
-	if (khugepaged_scan.mm_slot)
-		mm_slot = khugepaged_scan.mm_slot;
-	else {
-		mm_slot = list_entry(khugepaged_scan.mm_head.next,
-				     struct mm_slot, mm_node);
-		khugepaged_scan.address = 0;
-		khugepaged_scan.mm_slot = mm_slot;
+	if (!worker->mm_slot) {
+		mm_slot = khugepaged_next_mm_slot(khugepaged_scan.mm_head.next);
+		/* all taken by the other threads */
+		if (!mm_slot)
+			return pages;
+		khugepaged_set_cursor(worker, mm_slot);
 	}
+	mm_slot = worker->mm_slot;
 	spin_unlock(&khugepaged_mm_lock);
 
 	mm = mm_slot->mm;
@@ -2029,11 +2830,12 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 	if (unlikely(khugepaged_test_exit(mm)))
 		vma = NULL;
 	else
-		vma = find_vma(mm, khugepaged_scan.address);
+		vma = find_vma(mm, worker->address);
 
 	progress++;
 	for (; vma; vma = vma->vm_next) {
 		unsigned long hstart, hend;
+		bool team;
 
 		cond_resched();
 		if (unlikely(khugepaged_test_exit(mm))) {
@@ -2041,16 +2843,23 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 			break;
 		}
 
+		/* shmem's huge= mount option decides for team vmas */
+		team = vma->vm_ops && vma->vm_ops->pmd_fault;
 		if ((!(vma->vm_flags & VM_HUGEPAGE) &&
-		     !khugepaged_always()) ||
+		     !khugepaged_always() && !team) ||
 		    (vma->vm_flags & VM_NOHUGEPAGE)) {
 		skip:
 			progress++;
 			continue;
 		}
-		/* VM_PFNMAP vmas may have vm_ops null but vm_file set */
-		if (!vma->anon_vma || vma->vm_ops || vma->vm_file)
+		if (team) {
+			if (!(vma->vm_flags & VM_MAYSHARE) ||
+			    (vma->vm_flags & (VM_NONLINEAR | VM_LOCKED)))
+				goto skip;
+		} else if (!vma->anon_vma || vma->vm_ops || vma->vm_file) {
+			/* VM_PFNMAP vmas may have vm_ops null but vm_file set */
 			goto skip;
+		}
 		if (is_vma_temporary_stack(vma))
 			goto skip;
 
@@ -2060,26 +2869,43 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 		hend = vma->vm_end & HPAGE_PMD_MASK;
 		if (hstart >= hend)
 			goto skip;
-		if (khugepaged_scan.address > hend)
+		if (worker->address > hend)
 			goto skip;
-		if (khugepaged_scan.address < hstart)
-			khugepaged_scan.address = hstart;
-		VM_BUG_ON(khugepaged_scan.address & ~HPAGE_PMD_MASK);
+		if (worker->address < hstart)
+			worker->address = hstart;
+		VM_BUG_ON(worker->address & ~HPAGE_PMD_MASK);
 
-		while (khugepaged_scan.address < hend) {
+		while (worker->address < hend) {
 			int ret;
 			cond_resched();
 			if (unlikely(khugepaged_test_exit(mm)))
 				goto breakouterloop;
 
-			VM_BUG_ON(khugepaged_scan.address < hstart ||
-				  khugepaged_scan.address + HPAGE_PMD_SIZE >
-				  hend);
-			ret = khugepaged_scan_pmd(mm, vma,
-						  khugepaged_scan.address,
-						  hpage);
+			VM_BUG_ON(worker->address < hstart ||
+				  worker->address + HPAGE_PMD_SIZE > hend);
+			if (ksm_vma_huge_hold(vma, worker->address)) {
+				worker->address += HPAGE_PMD_SIZE;
+				if (++progress >= pages)
+					goto breakouterloop;
+				continue;
+			}
+			if (((worker->address >> HPAGE_PMD_SHIFT) +
+			     mm_slot->offset) & ((1U << mm_slot->rung) - 1)) {
+				/* not sampled in this pass */
+				worker->address += HPAGE_PMD_SIZE;
+				if (++progress >= pages)
+					goto breakouterloop;
+				continue;
+			}
+			if (team)
+				ret = khugepaged_scan_team(mm, mm_slot, vma,
+							   worker->address);
+			else
+				ret = khugepaged_scan_pmd(mm, mm_slot, vma,
+							  worker->address,
+							  hpage);
 			/* move to next address */
-			khugepaged_scan.address += HPAGE_PMD_SIZE;
+			worker->address += HPAGE_PMD_SIZE;
 			progress += HPAGE_PMD_NR;
 			if (ret)
 				/* we released mmap_sem so break loop */
@@ -2093,26 +2919,23 @@ breakouterloop:
 breakouterloop_mmap_sem:
 
 	spin_lock(&khugepaged_mm_lock);
-	VM_BUG_ON(khugepaged_scan.mm_slot != mm_slot);
+	VM_BUG_ON(worker->mm_slot != mm_slot);
 	/*
 	 * Release the current mm_slot if this mm is about to die, or
 	 * if we scanned all vmas of this mm.
 	 */
 	if (khugepaged_test_exit(mm) || !vma) {
+		khugepaged_climb_rung(mm_slot);
 		/*
 		 * Make sure that if mm_users is reaching zero while
 		 * khugepaged runs here, khugepaged_exit will find
-		 * mm_slot not pointing to the exiting mm.
+		 * mm_slot not being scanned.
 		 */
-		if (mm_slot->mm_node.next != &khugepaged_scan.mm_head) {
-			khugepaged_scan.mm_slot = list_entry(
-				mm_slot->mm_node.next,
-				struct mm_slot, mm_node);
-			khugepaged_scan.address = 0;
-		} else {
-			khugepaged_scan.mm_slot = NULL;
+		khugepaged_set_cursor(worker,
+			khugepaged_next_mm_slot(mm_slot->mm_node.next));
+		/* the first thread counts the passes of them all */
+		if (!worker->mm_slot && !worker->index)
 			khugepaged_full_scans++;
-		}
 
 		collect_mm_slot(mm_slot);
 	}
@@ -2120,19 +2943,26 @@ breakouterloop_mmap_sem:
 	return progress;
 }
 
-static int khugepaged_has_work(void)
+static int khugepaged_wanted(struct khugepaged_worker *worker)
+{
+	return khugepaged_enabled() &&
+		worker->index < khugepaged_nr_threads;
+}
+
+static int khugepaged_has_work(struct khugepaged_worker *worker)
 {
 	return !list_empty(&khugepaged_scan.mm_head) &&
-		khugepaged_enabled();
+		khugepaged_wanted(worker);
 }
 
-static int khugepaged_wait_event(void)
+static int khugepaged_wait_event(struct khugepaged_worker *worker)
 {
 	return !list_empty(&khugepaged_scan.mm_head) ||
-		!khugepaged_enabled();
+		!khugepaged_wanted(worker);
 }
 
-static void khugepaged_do_scan(struct page **hpage)
+static void khugepaged_do_scan(struct khugepaged_worker *worker,
+			       struct page **hpage)
 {
 	unsigned int progress = 0, pass_through_head = 0;
 	unsigned int pages = khugepaged_pages_to_scan;
@@ -2142,26 +2972,19 @@ static void khugepaged_do_scan(struct page **hpage)
 	while (progress < pages) {
 		cond_resched();
 
-#ifndef CONFIG_NUMA
-		if (!*hpage) {
-			*hpage = alloc_hugepage(khugepaged_defrag());
-			if (unlikely(!*hpage))
-				break;
-		}
-#else
 		if (IS_ERR(*hpage))
 			break;
-#endif
 
 		if (unlikely(kthread_should_stop() || freezing(current)))
 			break;
 
 		spin_lock(&khugepaged_mm_lock);
-		if (!khugepaged_scan.mm_slot)
+		if (!worker->mm_slot)
 			pass_through_head++;
-		if (khugepaged_has_work() &&
+		if (khugepaged_has_work(worker) &&
 		    pass_through_head < 2)
-			progress += khugepaged_scan_mm_slot(pages - progress,
+			progress += khugepaged_scan_mm_slot(worker,
+							    pages - progress,
 							    hpage);
 		else
 			progress = pages;
@@ -2179,49 +3002,21 @@ static void khugepaged_alloc_sleep(void)
 	remove_wait_queue(&khugepaged_wait, &wait);
 }
 
-#ifndef CONFIG_NUMA
-static struct page *khugepaged_alloc_hugepage(void)
+static void khugepaged_loop(struct khugepaged_worker *worker)
 {
-	struct page *hpage;
+	struct page *hpage = NULL;
 
-	do {
-		hpage = alloc_hugepage(khugepaged_defrag());
-		if (!hpage)
-			khugepaged_alloc_sleep();
-	} while (unlikely(!hpage) &&
-		 likely(khugepaged_enabled()));
-	return hpage;
-}
-#endif
-
-static void khugepaged_loop(void)
-{
-	struct page *hpage;
-
-#ifdef CONFIG_NUMA
-	hpage = NULL;
-#endif
-	while (likely(khugepaged_enabled())) {
-#ifndef CONFIG_NUMA
-		hpage = khugepaged_alloc_hugepage();
-		if (unlikely(!hpage))
-			break;
-#else
+	while (likely(khugepaged_wanted(worker))) {
 		if (IS_ERR(hpage)) {
 			khugepaged_alloc_sleep();
 			hpage = NULL;
 		}
-#endif
 
-		khugepaged_do_scan(&hpage);
-#ifndef CONFIG_NUMA
-		if (hpage)
-			put_page(hpage);
-#endif
+		khugepaged_do_scan(worker, &hpage);
 		try_to_freeze();
 		if (unlikely(kthread_should_stop()))
 			break;
-		if (khugepaged_has_work()) {
+		if (khugepaged_has_work(worker)) {
 			DEFINE_WAIT(wait);
 			if (!khugepaged_scan_sleep_millisecs)
 				continue;
@@ -2230,15 +3025,17 @@ static void khugepaged_loop(void)
 				msecs_to_jiffies(
 					khugepaged_scan_sleep_millisecs));
 			remove_wait_queue(&khugepaged_wait, &wait);
-		} else if (khugepaged_enabled())
+		} else if (khugepaged_wanted(worker))
 			wait_event_freezable(khugepaged_wait,
-					     khugepaged_wait_event());
+					     khugepaged_wait_event(worker));
 	}
 }
 
-static int khugepaged(void *none)
+static int khugepaged(void *arg)
 {
+	struct khugepaged_worker *worker = arg;
 	struct mm_slot *mm_slot;
+	int i, last = 1;
 
 	set_freezable();
 	set_user_nice(current, 19);
@@ -2248,32 +3045,111 @@ static int khugepaged(void *none)
 
 	for (;;) {
 		mutex_unlock(&khugepaged_mutex);
-		VM_BUG_ON(khugepaged_thread != current);
-		khugepaged_loop();
-		VM_BUG_ON(khugepaged_thread != current);
+		VM_BUG_ON(worker->thread != current);
+		khugepaged_loop(worker);
+		VM_BUG_ON(worker->thread != current);
 
 		mutex_lock(&khugepaged_mutex);
-		if (!khugepaged_enabled())
+		if (!khugepaged_wanted(worker))
 			break;
 		if (unlikely(kthread_should_stop()))
 			break;
 	}
 
 	spin_lock(&khugepaged_mm_lock);
-	mm_slot = khugepaged_scan.mm_slot;
-	khugepaged_scan.mm_slot = NULL;
+	mm_slot = worker->mm_slot;
+	khugepaged_set_cursor(worker, NULL);
 	if (mm_slot)
 		collect_mm_slot(mm_slot);
 	spin_unlock(&khugepaged_mm_lock);
 
-	khugepaged_thread = NULL;
+	worker->thread = NULL;
+	for (i = 0; i < KHUGEPAGED_MAX_THREADS; i++)
+		if (khugepaged_workers[i].thread)
+			last = 0;
+	/* nobody to collapse with the pooled hugepages until restarted */
+	if (last && !khugepaged_enabled())
+		khugepaged_pool_drain();
 	mutex_unlock(&khugepaged_mutex);
 
 	return 0;
 }
 
-void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
+/* The huge zero page splits into ptes mapping the small zero page */
+static void __split_huge_zero_page_pmd(struct vm_area_struct *vma,
+				       unsigned long haddr, pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	int i;
+
+	pmdp_clear_flush_notify(vma, haddr, pmd);
+	/* leave pmd empty until pte is filled */
+
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		entry = pfn_pte(page_to_pfn(ZERO_PAGE(haddr)),
+				vma->vm_page_prot);
+		entry = pte_mkspecial(entry);
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+
+	mm->nr_ptes++;
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+}
+
+/*
+ * A team splits into ptes mapping the same pages, with the same mapcounts
+ * and references: unlike a compound page, none of them has to change.
+ */
+static void __split_huge_team_pmd(struct vm_area_struct *vma,
+				  unsigned long haddr, pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *page;
+	pgtable_t pgtable;
+	pmd_t _pmd, orig_pmd;
+	int i;
+
+	orig_pmd = pmdp_clear_flush_notify(vma, haddr, pmd);
+	/* leave pmd empty until pte is filled */
+
+	page = pmd_page(orig_pmd);
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		entry = mk_pte(page + i, vma->vm_page_prot);
+		if (pmd_dirty(orig_pmd))
+			entry = pte_mkdirty(entry);
+		if (!pmd_write(orig_pmd))
+			entry = pte_wrprotect(entry);
+		if (!pmd_young(orig_pmd))
+			entry = pte_mkold(entry);
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+
+	mm->nr_ptes++;
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+}
+
+void __split_huge_page_pmd(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd)
 {
+	struct mm_struct *mm = vma->vm_mm;
 	struct page *page;
 
 	spin_lock(&mm->page_table_lock);
@@ -2281,6 +3157,16 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 		spin_unlock(&mm->page_table_lock);
 		return;
 	}
+	if (is_huge_zero_pmd(*pmd)) {
+		__split_huge_zero_page_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
+	if (pmd_trans_team(*pmd)) {
+		__split_huge_team_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
 	page = pmd_page(*pmd);
 	VM_BUG_ON(!page_count(page));
 	get_page(page);
@@ -2292,9 +3178,22 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 	BUG_ON(pmd_trans_huge(*pmd));
 }
 
-static void split_huge_page_address(struct mm_struct *mm,
+void split_huge_page_pmd_mm(struct mm_struct *mm, unsigned long address,
+			    pmd_t *pmd)
+{
+	struct vm_area_struct *vma;
+
+	if (likely(!pmd_trans_huge(*pmd)))
+		return;
+	vma = find_vma(mm, address);
+	BUG_ON(!vma);
+	__split_huge_page_pmd(vma, address, pmd);
+}
+
+static void split_huge_page_address(struct vm_area_struct *vma,
 				    unsigned long address)
 {
+	struct mm_struct *mm = vma->vm_mm;
 	pgd_t *pgd;
 	pud_t *pud;
 	pmd_t *pmd;
@@ -2316,7 +3215,68 @@ static void split_huge_page_address(struct mm_struct *mm,
 	 * Caller holds the mmap_sem write mode, so a huge pmd cannot
 	 * materialize from under us.
 	 */
-	split_huge_page_pmd(mm, pmd);
+	split_huge_page_pmd(vma, address, pmd);
+}
+
+/*
+ * Split all the huge pmds of @vma, with the mmap_sem held for write: for
+ * remap_file_pages(), before it makes the vma nonlinear.
+ */
+void split_huge_page_vma(struct vm_area_struct *vma)
+{
+	unsigned long addr;
+
+	for (addr = ALIGN(vma->vm_start, HPAGE_PMD_SIZE);
+	     addr + HPAGE_PMD_SIZE <= vma->vm_end; addr += HPAGE_PMD_SIZE)
+		split_huge_page_address(vma, addr + PAGE_SIZE);
+}
+
+/*
+ * The team pmd that maps @page at @address, returned with the
+ * page_table_lock held; or NULL if @page is not mapped so there.
+ */
+pmd_t *page_check_team_pmd(struct page *page, struct mm_struct *mm,
+			   unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+
+	pmd = pmd_offset(pud, address);
+	if (!pmd_trans_huge(*pmd))
+		return NULL;
+
+	spin_lock(&mm->page_table_lock);
+	if (likely(pmd_trans_huge(*pmd)) && pmd_trans_team(*pmd) &&
+	    pmd_page(*pmd) + ((address & ~HPAGE_PMD_MASK) >> PAGE_SHIFT) ==
+	    page)
+		return pmd;
+	spin_unlock(&mm->page_table_lock);
+	return NULL;
+}
+
+/*
+ * Split the team pmd mapping @page in @vma, if there is one, for rmap to
+ * find the pte it unmaps.
+ */
+void split_huge_team_page(struct page *page, struct vm_area_struct *vma,
+			  unsigned long address)
+{
+	pmd_t *pmd;
+
+	pmd = page_check_team_pmd(page, vma->vm_mm, address);
+	if (pmd) {
+		__split_huge_team_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&vma->vm_mm->page_table_lock);
+	}
 }
 
 void __vma_adjust_trans_huge(struct vm_area_struct *vma,
@@ -2332,7 +3292,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (start & ~HPAGE_PMD_MASK &&
 	    (start & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (start & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, start);
+		split_huge_page_address(vma, start);
 
 	/*
 	 * If the new end address isn't hpage aligned and it could
@@ -2342,7 +3302,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (end & ~HPAGE_PMD_MASK &&
 	    (end & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (end & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, end);
+		split_huge_page_address(vma, end);
 
 	/*
 	 * If we're also updating the vma->vm_next->vm_start, if the new
@@ -2356,6 +3316,6 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 		if (nstart & ~HPAGE_PMD_MASK &&
 		    (nstart & HPAGE_PMD_MASK) >= next->vm_start &&
 		    (nstart & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= next->vm_end)
-			split_huge_page_address(next->vm_mm, nstart);
+			split_huge_page_address(next, nstart);
 	}
 }
@@ -21,6 +21,7 @@
 #include <linux/rmap.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
+#include <linux/kthread.h>
 
 #include <asm/page.h>
 #include <asm/pgtable.h>
@@ -686,6 +687,95 @@ static int alloc_fresh_huge_page(struct hstate *h, nodemask_t *nodes_allowed)
 	return ret;
 }
 
+/*
+ * Filling a large pool one huge page at a time from a single thread takes
+ * minutes: have one thread per node allocate that node's share locally.
+ */
+struct huge_fill {
+	struct hstate *h;
+	int nid;
+	unsigned long nr;	/* pages wanted from the node */
+	unsigned long done;	/* pages allocated */
+	int *stop;
+	struct completion completion;
+};
+
+static int huge_fill_node(void *arg)
+{
+	struct huge_fill *fill = arg;
+
+	while (fill->done < fill->nr && !ACCESS_ONCE(*fill->stop)) {
+		if (!alloc_fresh_huge_page_node(fill->h, fill->nid)) {
+			count_vm_event(HTLB_BUDDY_PGALLOC_FAIL);
+			break;
+		}
+		count_vm_event(HTLB_BUDDY_PGALLOC);
+		fill->done++;
+		cond_resched();
+	}
+	complete(&fill->completion);
+
+	return 0;
+}
+
+/*
+ * Allocate up to @count fresh huge pages spread evenly over @nodes_allowed,
+ * in parallel, and return how many were. What a node could not provide is
+ * left to the caller's round-robin alloc_fresh_huge_page().
+ */
+static unsigned long alloc_fresh_huge_pages_parallel(struct hstate *h,
+					unsigned long count,
+					nodemask_t *nodes_allowed)
+{
+	int nr_nodes = nodes_weight(*nodes_allowed);
+	struct huge_fill *fills;
+	unsigned long done = 0;
+	int nid, i = 0, stop = 0;
+
+	/* not worth the threads */
+	if (nr_nodes < 2 || count < 2 * nr_nodes)
+		return 0;
+
+	fills = kcalloc(nr_nodes, sizeof(*fills), GFP_KERNEL);
+	if (!fills)
+		return 0;
+
+	for_each_node_mask(nid, *nodes_allowed) {
+		struct huge_fill *fill = &fills[i];
+		const struct cpumask *cpumask = cpumask_of_node(nid);
+		struct task_struct *tsk;
+
+		fill->h = h;
+		fill->nid = nid;
+		fill->nr = count / nr_nodes + (i < count % nr_nodes);
+		fill->stop = &stop;
+		init_completion(&fill->completion);
+
+		tsk = kthread_create(huge_fill_node, fill, "hugefill%d", nid);
+		if (IS_ERR(tsk)) {
+			/* do that node's share ourselves */
+			huge_fill_node(fill);
+		} else {
+			if (!cpumask_empty(cpumask))
+				set_cpus_allowed_ptr(tsk, cpumask);
+			wake_up_process(tsk);
+		}
+		i++;
+	}
+
+	for (i = 0; i < nr_nodes; i++) {
+		/* Bail for signals. Probably ctrl-c from user */
+		if (wait_for_completion_killable(&fills[i].completion)) {
+			stop = 1;
+			wait_for_completion(&fills[i].completion);
+		}
+		done += fills[i].done;
+	}
+	kfree(fills);
+
+	return done;
+}
+
 /*
  * helper for free_pool_huge_page() - return the previously saved
  * node ["this node"] from which to free a huge page.  Advance the
@@ -1116,9 +1206,13 @@ static void __init gather_bootmem_prealloc(void)
 
 static void __init hugetlb_hstate_alloc_pages(struct hstate *h)
 {
-	unsigned long i;
+	unsigned long i = 0;
 
-	for (i = 0; i < h->max_huge_pages; ++i) {
+	if (h->order < MAX_ORDER)
+		i = alloc_fresh_huge_pages_parallel(h, h->max_huge_pages,
+						    &node_states[N_HIGH_MEMORY]);
+
+	for (; i < h->max_huge_pages; ++i) {
 		if (h->order >= MAX_ORDER) {
 			if (!alloc_bootmem_huge_page(h))
 				break;
@@ -1273,6 +1367,17 @@ static unsigned long set_max_huge_pages(struct hstate *h, unsigned long count,
 			break;
 	}
 
+	if (count > persistent_huge_pages(h)) {
+		unsigned long nr = count - persistent_huge_pages(h);
+
+		/* the bulk of it from all nodes at once, the rest below */
+		spin_unlock(&hugetlb_lock);
+		alloc_fresh_huge_pages_parallel(h, nr, nodes_allowed);
+		spin_lock(&hugetlb_lock);
+		if (signal_pending(current))
+			goto out;
+	}
+
 	while (count > persistent_huge_pages(h)) {
 		/*
 		 * If this allocation races such that we no longer need the
@@ -249,6 +249,17 @@ int __get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 		     unsigned long start, int len, unsigned int foll_flags,
 		     struct page **pages, struct vm_area_struct **vmas,
 		     int *nonblocking);
+long populate_vma_pages(struct vm_area_struct *vma, unsigned long start,
+			int nr_pages, unsigned int gup_flags, int *nonblocking);
+
+extern int shmem_drop_unmapped_page(struct page *page);
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+extern void __free_pages_memory(unsigned long start, unsigned long end);
+extern bool defer_free_range(int nid, unsigned long start, unsigned long end);
+extern void memmap_init_deferred(int nid, unsigned long start,
+				 unsigned long end);
+#endif
 
 #define ZONE_RECLAIM_NOSCAN	-2
 #define ZONE_RECLAIM_FULL	-1
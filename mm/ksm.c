@@ -45,8 +45,8 @@
  *      It no longer uses "memcmp" based page detection any more.
  *
  * 6. Misc changes upon KSM:
- *      * It has a fully x86-opitmized memcmp dedicated for 4-byte-aligned page
- *        comparison. It's much faster than default C version on x86.
+ *      * It picks the fastest of several page comparators (SSE2 on x86) at
+ *        startup instead of using the default C memcmp.
  *      * rmap_item now has an struct *page member to loosely cache a
  *        address-->page mapping, which reduces too much time-costly
  *        follow_page().
@@ -73,53 +73,186 @@
 #include <linux/memory.h>
 #include <linux/mmu_notifier.h>
 #include <linux/swap.h>
+#include <linux/swapops.h>
 #include <linux/ksm.h>
+#include <linux/memcontrol.h>
 #include <linux/crypto.h>
 #include <linux/scatterlist.h>
+#include <linux/completion.h>
 #include <crypto/hash.h>
+#include <crypto/sha.h>
 #include <linux/random.h>
 #include <linux/math64.h>
 #include <linux/gcd.h>
 #include <linux/freezer.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kernel_stat.h>
+#include <linux/tick.h>
+#include <linux/pid_namespace.h>
+#include <linux/module.h>
+#include <linux/ctype.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/shmem_fs.h>
 
 #include <asm/tlbflush.h>
+#ifdef CONFIG_X86
+#include <asm/i387.h>
+#endif
 #include "internal.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/ksm.h>
+
+
+
+/*
+ * Page comparators. Only equality matters to the callers: they return 0 if
+ * the two pages are identical and non-zero otherwise. The fastest one on
+ * this machine is chosen by cal_positive_negative_costs() at startup.
+ */
+static int memcmp_page_generic(void *s1, void *s2)
+{
+	return memcmp(s1, s2, PAGE_SIZE);
+}
+
+/*
+ * Compare a cache line worth of words at a time, so that only one branch
+ * is taken per line.
+ */
+static int memcmp_page_words(void *s1, void *s2)
+{
+	unsigned long *a = s1, *b = s2;
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i += 8) {
+		if ((a[i] ^ b[i]) | (a[i + 1] ^ b[i + 1]) |
+		    (a[i + 2] ^ b[i + 2]) | (a[i + 3] ^ b[i + 3]) |
+		    (a[i + 4] ^ b[i + 4]) | (a[i + 5] ^ b[i + 5]) |
+		    (a[i + 6] ^ b[i + 6]) | (a[i + 7] ^ b[i + 7]))
+			return 1;
+	}
 
+	return 0;
+}
 
 #ifdef CONFIG_X86
-#undef memcmp
-#define memcmp memcmpx86
+/*
+ * 64 bytes per loop with SSE2 compares. The second page is usually the one
+ * in the tree which we will not touch again, so it's prefetched non-temporal.
+ */
+static int memcmp_page_sse2(void *s1, void *s2)
+{
+	unsigned long i;
+	unsigned int mask = 0xffff;
+
+	kernel_fpu_begin();
+	for (i = 0; i < PAGE_SIZE; i += 64) {
+		__asm__ __volatile__(
+			"prefetchnta 512(%2)\n\t"
+			"movdqa   (%1), %%xmm0\n\t"
+			"movdqa 16(%1), %%xmm1\n\t"
+			"movdqa 32(%1), %%xmm2\n\t"
+			"movdqa 48(%1), %%xmm3\n\t"
+			"pcmpeqb   (%2), %%xmm0\n\t"
+			"pcmpeqb 16(%2), %%xmm1\n\t"
+			"pcmpeqb 32(%2), %%xmm2\n\t"
+			"pcmpeqb 48(%2), %%xmm3\n\t"
+			"pand %%xmm1, %%xmm0\n\t"
+			"pand %%xmm3, %%xmm2\n\t"
+			"pand %%xmm2, %%xmm0\n\t"
+			"pmovmskb %%xmm0, %0\n\t"
+			: "=r" (mask)
+			: "r" (s1 + i), "r" (s2 + i)
+			: "memory");
+		if (mask != 0xffff)
+			break;
+	}
+	kernel_fpu_end();
+
+	return mask != 0xffff;
+}
+
+/*
+ * Use the SSE4.2 crc32 instruction as the mixing step of random_sample_hash
+ * if the cpu has it, unless "ksm_hash=generic" is given at boot. The crc
+ * step is not cheaply invertible, so delta_hash() to a lower strength hashes
+ * the page again from scratch with this backend.
+ */
+static int ksm_hash_crc32c = -1;
+
+static int __init setup_ksm_hash(char *str)
+{
+	if (!strcmp(str, "generic"))
+		ksm_hash_crc32c = 0;
+	else if (!strcmp(str, "crc32c"))
+		ksm_hash_crc32c = 1;
+	else
+		printk(KERN_WARNING "ksm_hash= cannot parse, ignored\n");
+	return 1;
+}
+__setup("ksm_hash=", setup_ksm_hash);
 
 /*
- * Compare 4-byte-aligned pages at address s1 and s2, with length n
+ * The order random_sample_hash samples the words of a page in is a random
+ * permutation of them, built at boot. With "ksm_sampling=lines" it visits
+ * random cache lines, KSM_SAMPLE_LINE_WORDS random words of each in turn,
+ * so that a strength touches that many times fewer lines of the page; with
+ * "ksm_sampling=words" each word is on its own. Otherwise the layout is the
+ * one cal_positive_negative_costs() finds cheaper to hash on a cold page.
  */
-int memcmpx86(void *s1, void *s2, size_t n)
+#define KSM_SAMPLE_LINE_WORDS	4
+static int ksm_sample_lines = -1;
+
+static int __init setup_ksm_sampling(char *str)
 {
-   size_t num = n / 4;
-   register int res;
-  __asm__ __volatile__
-    ("cld\n\t"
-     "testl %3,%3\n\t"
-     "repe; cmpsd\n\t"
-     "je        1f\n\t"
-     "sbbl      %0,%0\n\t"
-     "orl       $1,%0\n"
-     "1:"
-     : "=&a" (res), "+&S" (s1), "+&D" (s2), "+&c" (num)
-     : "0" (0)
-     : "cc");
+	if (!strcmp(str, "words"))
+		ksm_sample_lines = 0;
+	else if (!strcmp(str, "lines"))
+		ksm_sample_lines = 1;
+	else
+		printk(KERN_WARNING "ksm_sampling= cannot parse, ignored\n");
+	return 1;
+}
+__setup("ksm_sampling=", setup_ksm_sampling);
 
-  return res;
+static inline u32 ksm_crc32c_u32(u32 crc, u32 val)
+{
+	/* crc32l %ecx, %esi, encoded for old binutils */
+	__asm__(".byte 0xf2, 0xf, 0x38, 0xf1, 0xf1"
+		: "=S" (crc)
+		: "0" (crc), "c" (val));
+	return crc;
 }
 #endif
 
+static struct ksm_memcmp_backend {
+	const char *name;
+	int (*cmp)(void *s1, void *s2);
+} ksm_memcmp_backends[] = {
+	{ "generic",	memcmp_page_generic },
+	{ "words",	memcmp_page_words },
+#ifdef CONFIG_X86
+	{ "sse2",	memcmp_page_sse2 },
+#endif
+};
+
+static int (*ksm_memcmp_page)(void *s1, void *s2) = memcmp_page_generic;
+
 /*
  * Flags for rmap_item to judge if it's listed in the stable/unstable tree.
  * The flags use the low bits of rmap_item.address
  */
 #define UNSTABLE_FLAG	0x1
 #define STABLE_FLAG	0x2
+#define HASHED_FLAG	0x4	/* cached_hash is valid */
+#define YOUNG_SHIFT	3	/* visits in a row finding the page hot */
+#define YOUNG_MASK	(0x7UL << YOUNG_SHIFT)
+#define PIN_SHIFT	6	/* backoff level of a page found pinned */
+#define PIN_MASK	(0x7UL << PIN_SHIFT)
 #define get_rmap_addr(x)	((x)->address & PAGE_MASK)
 
 /*
@@ -139,6 +272,7 @@ static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *node_vma_cache;
 static struct kmem_cache *vma_slot_cache;
 static struct kmem_cache *tree_node_cache;
+static struct kmem_cache *vma_pair_cache;
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
 		sizeof(struct __struct), __alignof__(struct __struct),\
 		(__flags), NULL)
@@ -146,12 +280,23 @@ static struct kmem_cache *tree_node_cache;
 /* The scan rounds ksmd is currently in */
 static unsigned long long ksm_scan_round = 1;
 
+/* The objects allocated from the caches above, for metadata_bytes */
+static unsigned long ksm_rmap_items;
+static unsigned long ksm_stable_nodes;
+static unsigned long ksm_tree_nodes;
+static unsigned long ksm_node_vmas;
+static unsigned long ksm_index_pages;
+static unsigned long ksm_small_pool_bytes;
+
 /* The number of pages has been scanned since the start up */
 static unsigned long long ksm_pages_scanned;
 
 /* The number of pages has been scanned when last scan round finished */
 static unsigned long long ksm_pages_scanned_last;
 
+/* jiffies when the current scan round started */
+static unsigned long ksm_round_start_j;
+
 /* The number of nodes in the stable tree */
 static unsigned long ksm_pages_shared;
 
@@ -170,14 +315,160 @@ static unsigned long ksm_scan_batch_pages = 60000;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_sleep_jiffies = 2;
 
+/*
+ * With the CPU governor on, ksmd sizes each batch from the time per page the
+ * last one took, so that scanning takes ksm_max_cpu_percentage of the time.
+ * ksm_scan_batch_pages stays the top speed and sleep_millisecs the usual nap,
+ * which is stretched when even a minimal batch is over budget. The batch is
+ * cut down further when more pages are merged than
+ * ksm_target_merge_rate per second, and halved while the cpus are busy.
+ */
+#define KSM_GOV_BATCH_MIN	64
+static unsigned int ksm_cpu_governor;
+static unsigned int ksm_max_cpu_percentage = 20;
+static unsigned long ksm_target_merge_rate;
+static unsigned long ksm_gov_batch_pages;
+static u64 ksm_gov_ns_per_page;
+
+/*
+ * Memory pressure: when kswapd starts balancing a node, for the next
+ * KSM_PRESSURE_JIFFIES the scanner threads scan ksm_pressure_boost times
+ * the top speed batch, at the default nice, whatever the CPU governor or
+ * idle scan mode say, so that merging frees memory before it is swapped
+ * out. Every kswapd run renews it. 0 disables it.
+ */
+#define KSM_PRESSURE_JIFFIES	HZ
+static unsigned int ksm_pressure_boost = 4;
+static unsigned long ksm_pressure_until;
+static unsigned long ksm_pressure_boosts;
+
+/*
+ * In idle scan mode, a scanner thread only scans at full speed while the
+ * cpus it may run on were at least ksm_idle_scan_threshold percent idle
+ * over the last KSM_IDLE_SAMPLE_JIFFIES. Otherwise it waits, and after
+ * ksm_idle_scan_max_delay milliseconds without scanning it scans a batch of
+ * 1/16 of the usual size anyway, so that the unstable tree does not go
+ * completely stale.
+ */
+#define KSM_IDLE_SAMPLE_JIFFIES	(HZ / 10 ? : 1)
+static unsigned int ksm_idle_scan;
+static unsigned int ksm_idle_scan_threshold = 50;
+static unsigned int ksm_idle_scan_max_delay = 1000;
+
+struct ksm_idle_sample {
+	u64 idle;		/* idle + iowait jiffies of the cpus */
+	unsigned long stamp;	/* jiffies when sampled */
+	int busy;		/* verdict of the last window */
+};
+
 /*
  * The threshold used to filter out thrashing areas,
  * If it == 0, filtering is disabled, otherwise it's the percentage up-bound
  * of the thrashing ratio of all areas. Any area with a bigger thrashing ratio
- * will be considered as having a zero duplication ratio.
+ * will be considered as having a zero duplication ratio. The COWs in ranges
+ * already too hot to be merged do not count.
  */
 static unsigned int ksm_thrash_threshold;
 
+/*
+ * Each range of 1 << KSM_COW_HEAT_SHIFT pages of a slot has a COW counter,
+ * bumped by KSM_COW_HEAT_STEP when a merged page in it is written and halved
+ * for every round ended, lazily. Ranges at ksm_cow_heat_threshold or above are
+ * not merged, the rest of the slot still is. 0 disables it.
+ */
+#define KSM_COW_HEAT_SHIFT	9
+#define KSM_COW_HEAT_STEP	16
+#define KSM_COW_HEAT_MAX	255
+
+static unsigned int ksm_cow_heat_threshold = 64;
+static unsigned long ksm_pages_cow_hot_skipped;
+
+/*
+ * A range whose COW counter climbs to ksm_cow_unmerge_threshold is being
+ * written all over: the rest of its KSM pages are unmerged by a worker,
+ * before the application faults on them one by one. 0 disables it.
+ */
+#define KSM_COW_UNMERGE_QUEUE	64
+static unsigned int ksm_cow_unmerge_threshold = 128;
+static unsigned long ksm_cow_unmerge_ranges;
+static unsigned long ksm_cow_unmerge_dropped;
+
+/*
+ * The ranges a KVM guest wrote to, as harvested from its dirty log, get the
+ * same bump as a COW: merging what the guest keeps writing only breaks again.
+ */
+static unsigned int ksm_guest_dirty_hint = 1;
+static unsigned long ksm_guest_dirty_hinted;
+
+/*
+ * Always-on log2 histograms of the ksmd latencies in ns, read in debugfs as
+ * /sys/kernel/debug/ksm/histograms. Bucket i counts [2^(i-1), 2^i) ns, the
+ * last one everything above, or of the sizes of the collision sub-trees
+ * searched for "subtree". Several scanners update them racily, a lost
+ * count now and then is fine here.
+ */
+enum ksm_hist_item {
+	KSM_HIST_SCAN_BATCH,	/* ksm_do_scan() */
+	KSM_HIST_HASH,		/* hashing of a page, batch average */
+	KSM_HIST_TREE,		/* stable and unstable tree searches of a page */
+	KSM_HIST_MERGE,		/* the rest of cmp_and_merge_page() */
+	KSM_HIST_DELTA_HASH,	/* stable_tree_delta_hash() */
+	KSM_HIST_ROUND_UPDATE,	/* round_update_ladder() */
+	KSM_HIST_SUBTREE,	/* nodes of a sub-tree searched, not ns */
+	NR_KSM_HIST_ITEMS
+};
+
+#define KSM_HIST_BUCKETS	48
+
+struct ksm_hist {
+	unsigned long count;
+	u64 sum;
+	unsigned long buckets[KSM_HIST_BUCKETS];
+};
+
+static struct ksm_hist ksm_hists[NR_KSM_HIST_ITEMS];
+
+static const char * const ksm_hist_names[NR_KSM_HIST_ITEMS] = {
+	"scan_batch",
+	"hash",
+	"tree",
+	"merge",
+	"delta_hash",
+	"round_update",
+	"subtree",
+};
+
+/* try_down_read_slot_mmap_sem() finding the mmap_sem taken */
+static unsigned long ksm_mmap_sem_busy;
+/* scan_slot_run() letting the mmap_sem go early for someone waiting on it */
+static unsigned long ksm_mmap_sem_yields;
+
+static inline void ksm_hist_add(enum ksm_hist_item item, u64 ns)
+{
+	struct ksm_hist *hist = &ksm_hists[item];
+
+	hist->count++;
+	hist->sum += ns;
+	hist->buckets[min_t(int, fls64(ns), KSM_HIST_BUCKETS - 1)]++;
+}
+
+/*
+ * The long loops of ksmd over trees, lists and rmap_list pools offer to
+ * reschedule every so often through ksm_cond_resched(), which keeps the
+ * longest stretch between two such points, *@stamp being the last one.
+ */
+static u64 ksm_resched_max_ns;
+
+static inline void ksm_cond_resched(u64 *stamp)
+{
+	u64 ran = local_clock() - *stamp;
+
+	if (ran > ksm_resched_max_ns)
+		ksm_resched_max_ns = ran;
+	cond_resched();
+	*stamp = local_clock();
+}
+
 /* To avoid the float point arithmetic, this is the scale of a
  * deduplication ratio number.
  */
@@ -196,67 +487,317 @@ static unsigned int ksm_min_scan_ratio = 1;
 static unsigned int ksm_scan_ratio_delta = 5;
 
 /*
- * Inter-vma duplication number table page pointer array, initialized at
- * startup. Whenever ksmd finds that two areas have an identical page,
- * their corresponding table entry is increased. After each scan round
- * is finished, this table is scanned to calculate the estimated
- * duplication ratio for VMAs. Limited number(2048) of VMAs are
- * supported by now. We will migrate it to more scalable data structures
- * in the future.
+ * Inter-vma duplication numbers. Whenever ksmd finds that two areas have an
+ * identical page, the vma_pair of these two slots is increased, allocated
+ * on first use. The pairs are hashed by their slots and also linked on both
+ * of them, so that calculating the duplication ratio of a slot after each
+ * scan round only walks the areas it really shares pages with. The hash
+ * doubles when it gets twice as many pairs as buckets.
  */
-#define KSM_DUP_VMA_MAX		2048
-static unsigned int *ksm_inter_vma_table;
+#define KSM_VMA_PAIR_HASH_BITS		10
+#define KSM_VMA_PAIR_HASH_BITS_MAX	20
+static struct hlist_head *ksm_vma_pair_hash;
+static unsigned int ksm_vma_pair_hash_bits = KSM_VMA_PAIR_HASH_BITS;
+static unsigned long ksm_vma_pair_num;
+
+/* The vma_slots having vma_pairs in this round */
+static LIST_HEAD(ksm_intertab_slots);
 
 /*
- * For mapping of vma_slot and its index in inter-vma duplication number
- * table
+ * The vma_slots scanned in this round: the end of the round only resets
+ * these, not every slot of the ladder. What is counted outside the scan is
+ * stamped with its round instead, see slot_round_sync() and cow_heat_sync().
  */
-static struct vma_slot **ksm_vma_table;
-static unsigned int ksm_vma_table_size = 2048;
-static unsigned long ksm_vma_table_num;
-static unsigned long ksm_vma_table_index_end;
+static LIST_HEAD(ksm_round_slots);
 
-/* Array of all scan_rung, ksm_scan_ladder[0] having the minimum scan ratio */
+/*
+ * Array of all scan_rung, ksm_scan_ladder[0] having the minimum scan ratio.
+ * KSM_SCAN_LADDER_MAX of them are allocated once, ksm_scan_ladder_size are in
+ * use: the scanners keep pointers to rungs across ladder reconfigurations.
+ */
+#define KSM_SCAN_LADDER_MAX	16
 static struct scan_rung *ksm_scan_ladder;
 static unsigned int ksm_scan_ladder_size;
 
-/* The number of VMAs we are keeping track of */
+/* A rung gets its share of a scan batch divided by its quota divisor */
+static unsigned int ksm_rung_quota_div[KSM_SCAN_LADDER_MAX];
+/*
+ * The longest a round of the slots of each rung should take, in msecs, 0 for
+ * none. ksm_do_scan() serves the rungs by the earliest of these deadlines.
+ */
+static unsigned int ksm_rung_revisit_ms[KSM_SCAN_LADDER_MAX];
+
+/* The number of VMAs we are keeping track of, regions of big ones counted */
 static unsigned long ksm_vma_slot_num;
 
+/*
+ * The slots whose vma is gone, off the ladder, their rmap_items being freed
+ * by ksm_slot_del_work. Both under ksm_thread_mutex.
+ */
+static LIST_HEAD(ksm_slots_dying);
+static unsigned long ksm_slots_dying_num;
+
+/*
+ * The pages of the regions a big vma is split into, each one with its own
+ * slot, rung and dedup ratio. A multiple of the entries of one rmap_list_pool
+ * page, it only applies to the vmas created after it is set.
+ */
+#define KSM_REGION_PAGES_MIN	(PAGE_SIZE / sizeof(struct rmap_list_entry))
+static unsigned long ksm_region_pages = 1UL << (30 - PAGE_SHIFT);
+
+/*
+ * Milliseconds a vma must have lived before it gets its vma_slots. With
+ * this set, mmap, munmap and fork only stamp the vma and ksmd discovers
+ * the old enough ones by walking the mms, so that short-lived processes
+ * pay nothing for UKSM. 0 creates the slots with the vma, as it used to.
+ */
+static unsigned int ksm_slot_min_age = 1000;
+static unsigned long ksm_discover_last;
+static int ksm_discover_pending;
+static unsigned long ksm_slots_discovered;
+
+/*
+ * If set, the slots of a vma copied by fork are created at once, start on
+ * the rung of the parent's and skip the pages still COW-shared with it
+ * until their first full scan: the parent's slots scan those.
+ */
+static unsigned int ksm_fork_inherit = 1;
+static unsigned long ksm_pages_fork_skipped;
+
+/*
+ * Boot storms: a new slot of a vma of at least ksm_burst_min_pages enters
+ * the top rung for its first round, instead of crawling up from rung 0 for
+ * many, and then goes where its measured dedup ratio puts it: it stays up
+ * there if it shares, it drops to its lowest rung otherwise. No more than
+ * ksm_burst_max_pages are in such a pass at once, the others enter as
+ * usual. 0 in either disables it.
+ */
+static unsigned long ksm_burst_min_pages = 1UL << (27 - PAGE_SHIFT);
+static unsigned long ksm_burst_max_pages = 1UL << (32 - PAGE_SHIFT);
+static unsigned long ksm_burst_pages;
+static unsigned long ksm_burst_slots;
+
 /* How many times the ksmd has slept since startup */
 static u64 ksm_sleep_times;
 
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
+#define KSM_RUN_UNMERGE	2
+#define KSM_RUN_ESTIMATE	4
 static unsigned int ksm_run = KSM_RUN_STOP;
 
+static int ksmd_should_run(void)
+{
+	return ksm_run & (KSM_RUN_MERGE | KSM_RUN_ESTIMATE);
+}
+
+/*
+ * With run at KSM_RUN_ESTIMATE, ksmd hashes the pages and builds the trees
+ * and the vma pairs as it does to merge, but it only compares the pages it
+ * would merge: nothing is write protected, replaced or COWed. The number
+ * of pages found, zero-filled ones included, is extrapolated over each
+ * slot at the end of a round into ksm_estimate_sharing, the pages merging
+ * would save.
+ */
+static unsigned long ksm_estimate_sharing;
+
+/*
+ * run=2 unmerges all the slots of the ladder with up to this many workers,
+ * each one taking the next slot in turn.
+ */
+#define KSM_UNMERGE_WORKERS_MAX	64
+static unsigned int ksm_unmerge_workers = 4;
+static atomic_long_t ksm_unmerge_slots_skipped = ATOMIC_LONG_INIT(0);
+
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
 static DEFINE_MUTEX(ksm_thread_mutex);
 
 /*
- * List vma_slot_new is for newly created vma_slot waiting to be added by
- * ksmd. If one cannot be added(e.g. due to it's too small), it's moved to
- * vma_slot_noadd. vma_slot_del is the list for vma_slot whose corresponding
- * VMA has been removed/freed.
+ * Control operations, sysfs stores and memory hotplug, take ksm_thread_mutex
+ * with ksm_control_lock(). The scanners see them waiting and let them have
+ * it between two batches of pages, instead of after a whole scan.
+ */
+static atomic_t ksm_control_waiters = ATOMIC_INIT(0);
+
+/*
+ * Number of scanner threads sharing the scan ladder. ksmd itself is thread
+ * 0, the others are created on demand and bound to the NUMA nodes round
+ * robin. Only the hashing runs in parallel, with the mutex dropped: the
+ * ladder is one for all, and the tree lookups and merges stay serialized
+ * on ksm_thread_mutex, so more threads only help when hashing dominates.
+ */
+#define KSM_SCAN_THREADS_MAX	32
+static unsigned int ksm_scan_threads = 1;
+static struct task_struct *ksm_scan_workers[KSM_SCAN_THREADS_MAX];
+static DEFINE_MUTEX(ksm_scan_threads_mutex);
+
+/*
+ * List new is for newly created vma_slot waiting to be added by ksmd. If one
+ * cannot be added(e.g. due to it's too small), it's moved to noadd. del is
+ * the list for vma_slot whose corresponding VMA has been removed/freed.
+ *
+ * There is a set of these lists per cpu, a slot is queued on the one of the
+ * cpu creating it and stays with it, so that mmap, munmap and fork on
+ * different cpus do not serialize on one lock. ksmd walks them all.
+ */
+struct vma_slot_queue {
+	spinlock_t lock;
+	struct list_head new;
+	struct list_head noadd;
+	struct list_head del;
+};
+
+static DEFINE_PER_CPU(struct vma_slot_queue, vma_slot_queues);
+
+static void __init vma_slot_queues_init(void)
+{
+	struct vma_slot_queue *queue;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(vma_slot_queues, cpu);
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->new);
+		INIT_LIST_HEAD(&queue->noadd);
+		INIT_LIST_HEAD(&queue->del);
+	}
+}
+
+/*
+ * If merge_across_nodes is 0, there is one stable tree and one unstable tree
+ * for each NUMA node and pages are only merged with pages on the same node.
+ * If merge_cold_across_nodes is also set, an inactive page which found no
+ * ksm page on its own node may still be merged into one on another node.
+ */
+static unsigned int ksm_merge_across_nodes = 1;
+static unsigned int ksm_merge_cold_across_nodes;
+
+/*
+ * The unstable tree heads. With unstable_split_rung set, the slots of the
+ * rungs from that one up insert into trees of their own, the second group,
+ * so that the one-off pages of the lower rungs do not make their searches
+ * deeper. A search missing in its own trees still probes those of the other
+ * group, without walking or inserting there.
  */
-struct list_head vma_slot_new = LIST_HEAD_INIT(vma_slot_new);
-struct list_head vma_slot_noadd = LIST_HEAD_INIT(vma_slot_noadd);
-struct list_head vma_slot_del = LIST_HEAD_INIT(vma_slot_del);
-static DEFINE_SPINLOCK(vma_slot_list_lock);
+#define KSM_UNSTABLE_GROUPS	2
+
+static struct rb_root root_unstable_tree[KSM_UNSTABLE_GROUPS][MAX_NUMNODES];
+static unsigned int ksm_unstable_split_rung;
 
-/* The unstable tree heads */
-static struct rb_root root_unstable_tree = RB_ROOT;
+/* unstable tree hits found by probing the trees of the other group */
+static unsigned long ksm_unstable_cross_hits;
 
 /*
  * All tree_nodes are in a list to be freed at once when unstable tree is
- * freed after each scan round.
+ * emptied at the end of a scan round.
  */
 static struct list_head unstable_tree_node_list =
 				LIST_HEAD_INIT(unstable_tree_node_list);
 
+/*
+ * With unstable_rounds above 1, the unstable trees are kept from one round
+ * to the next, so that slots of the low rungs, scanned rarely, can still
+ * meet each other there. An rmap_item inserted more than unstable_rounds
+ * rounds ago has expired: it is dropped when a search runs into it, or
+ * when its page is scanned again. The trees are still emptied at the end
+ * of a round if hash_strength changed since the previous one, as their
+ * hashes would not be found any more.
+ */
+static unsigned int ksm_unstable_rounds = 4;
+
+/* the round the unstable trees were last emptied in */
+static u32 ksm_unstable_since = 1;
+static unsigned long ksm_unstable_strength;
+static int ksm_unstable_flush;
+
+/* expired rmap_items dropped from the unstable trees by a search */
+static unsigned long ksm_unstable_expired;
+
 /* List contains all stable nodes */
 static struct list_head stable_node_list = LIST_HEAD_INIT(stable_node_list);
 
+/*
+ * A KSM page freed from the swap cache by reclaim leaves its stable node
+ * parked: out of the stable tree, but keeping all its rmap_items, hashed by
+ * the swap entry. When that entry is read back, the new swap cache page
+ * takes the node over and is the KSM page again, so its sharers fault it
+ * in without a copy each. ksmd then puts the node back in the stable tree.
+ * The nodes parked are on stable_node_parked_list, ksm_swap_lock guards
+ * swap and swap_hlist of all the nodes.
+ */
+#define KSM_SWAP_HASH_BITS	10
+static struct hlist_head ksm_swap_hash[1 << KSM_SWAP_HASH_BITS];
+static HLIST_HEAD(ksm_swap_reshared);
+static DEFINE_SPINLOCK(ksm_swap_lock);
+static struct list_head stable_node_parked_list =
+				LIST_HEAD_INIT(stable_node_parked_list);
+static unsigned int ksm_swap_reshare = 1;
+static unsigned long ksm_swap_nr_parked;
+
+/*
+ * The nodes of the KSM pages memory_failure() hit leave the stable tree for
+ * stable_node_poisoned_list, where no one reads their pages again.
+ */
+static struct list_head stable_node_poisoned_list =
+				LIST_HEAD_INIT(stable_node_poisoned_list);
+static unsigned long ksm_hwpoison_recovered;
+static unsigned long ksm_hwpoison_remapped;
+static unsigned long ksm_pages_swap_reshared;
+
+/*
+ * At most this many rmap_items of a KSM page are looked at by one call of
+ * page_referenced_ksm(), which stops at the first reference found. The next
+ * call resumes where it stopped, so a page with thousands of mappings is
+ * aged by samples of them rather than a walk of all at each reclaim look.
+ * 0 walks them all, as it used to.
+ */
+static unsigned int ksm_rmap_sample = 256;
+static unsigned long ksm_rmap_walks_sampled;
+
+/*
+ * How reclaim ages a KSM page, by the rmap_items sharing it against
+ * ksm_reclaim_share_min: KSM_RECLAIM_PROTECT keeps the widely shared ones
+ * active, since evicting one of them evicts all its mappings at once, and
+ * KSM_RECLAIM_CHEAP lets the lightly shared ones go however recently they
+ * were used, since their mappings cost little to fault back.
+ */
+#define KSM_RECLAIM_DEFAULT	0
+#define KSM_RECLAIM_PROTECT	1
+#define KSM_RECLAIM_CHEAP	2
+static unsigned int ksm_reclaim_policy = KSM_RECLAIM_DEFAULT;
+static unsigned int ksm_reclaim_share_min = 16;
+static unsigned long ksm_reclaim_protected;
+static unsigned long ksm_reclaim_cheap;
+
+/*
+ * A KSM page takes so many rmap_items at most, 0 for no limit. Then the
+ * next identical pages get another copy, chained next to it in the subtree
+ * of its tree_node with the same hash_max, so that the rmap walks, the
+ * migration and the COW of any one of them stay bounded.
+ */
+static unsigned int ksm_max_page_sharing = 256;
+static unsigned long ksm_stable_node_dups;
+
+/*
+ * A page merged, then COWed and back to the same content, as zeroed guest
+ * pages and reset buffers are, is merged again into the ksm page it left
+ * without a tree walk: when cmp_and_merge_page() finds an rmap_item COWed
+ * it notes the kpfn and hash of that ksm page in ksm_remerge_memo for
+ * ksm_remerge_rounds rounds, 0 for none. Ranges left alone as hot with COWs
+ * are still scanned for the items noted there.
+ */
+#define KSM_REMERGE_BITS	10
+struct remerge_memo {
+	struct rmap_item *item;	/* compared, never dereferenced */
+	unsigned long kpfn;
+	u32 hash;		/* of the ksm page at strength */
+	u32 strength;
+	u32 round;
+};
+static struct remerge_memo ksm_remerge_memo[1 << KSM_REMERGE_BITS];
+static unsigned int ksm_remerge_rounds = 4;
+static unsigned long ksm_remerges;
+
 /*
  * When the hash strength is changed, the stable tree must be delta_hashed and
  * re-structured. We use two set of below structs to speed up the
@@ -267,10 +808,34 @@ stable_tree_node_list[2] = {LIST_HEAD_INIT(stable_tree_node_list[0]),
 			    LIST_HEAD_INIT(stable_tree_node_list[1])};
 
 static struct list_head *stable_tree_node_listp = &stable_tree_node_list[0];
-static struct rb_root root_stable_tree[2] = {RB_ROOT, RB_ROOT};
-static struct rb_root *root_stable_treep = &root_stable_tree[0];
+static struct rb_root root_stable_tree[2][MAX_NUMNODES];
+static struct rb_root *root_stable_treep = root_stable_tree[0];
 static unsigned long stable_tree_index;
 
+/*
+ * Instead of re-structuring the whole stable tree at once, the stable nodes
+ * are moved in batches from the old tree, hashed with the old strength, to
+ * the current one. Until stable_node_migrate_list is empty lookups consult
+ * both trees.
+ */
+#define KSM_STABLE_MIGRATE_BATCH	1024
+static struct list_head stable_node_migrate_list =
+				LIST_HEAD_INIT(stable_node_migrate_list);
+static struct rb_root *root_stable_old_treep;
+static struct list_head *stable_tree_old_node_listp;
+static u32 stable_tree_old_strength;
+
+/* The index of the (un)stable tree a page on this node belongs to */
+static inline int get_kpfn_nid(unsigned long kpfn)
+{
+	return ksm_merge_across_nodes ? 0 : pfn_to_nid(kpfn);
+}
+
+static inline int page_tree_nid(struct page *page)
+{
+	return get_kpfn_nid(page_to_pfn(page));
+}
+
 /* The hash strength needed to hash a full page */
 #define HASH_STRENGTH_FULL		(PAGE_SIZE / sizeof(u32))
 
@@ -280,19 +845,265 @@ static unsigned long stable_tree_index;
 /* The random offsets in a page */
 static u32 *random_nums;
 
+/*
+ * Up to ksm_hash_batch pages of a slot are collected, prefetched and hashed
+ * together before their tree walks, to overlap their memory latencies. Only
+ * the first KSM_PREFETCH_SAMPLES sampled words of each page are prefetched.
+ */
+#define KSM_HASH_BATCH_MAX	32
+#define KSM_PREFETCH_SAMPLES	16
+static unsigned int ksm_hash_batch = 8;
+
+/*
+ * A slot is scanned in runs of up to ksm_mmap_sem_run pages, batch after
+ * batch under one hold of its mmap_sem, rather than taking it again for
+ * each batch.
+ */
+static unsigned int ksm_mmap_sem_run = 128;
+
+/*
+ * Write protect the likely merged pages of a hash batch together and flush
+ * the TLB once for them, instead of once per page in write_protect_page().
+ */
+static unsigned int ksm_batch_wrprotect = 1;
+static unsigned long ksm_batch_wrprotect_pages;
+
+/*
+ * If set, a slot is permuted by windows of KSM_SCAN_WINDOW pages rather than
+ * page by page: the pages of a window are scanned in address order and share
+ * their page table walks. It applies from the next pass over a slot.
+ */
+#define KSM_SCAN_WINDOW		PTRS_PER_PTE
+static unsigned int ksm_scan_window;
+static unsigned long ksm_pages_hole_skipped;
+static unsigned long ksm_batch_wrprotect_flushes;
+
 /* The hash strength */
 static unsigned long hash_strength = HASH_STRENGTH_FULL >> 4;
 
+/*
+ * The hash of a zero-filled page at each hash strength. A page hashing to it
+ * is checked for being all zero and then mapped to ZERO_PAGE() directly,
+ * instead of piling up under one huge stable node.
+ */
+static u32 *zero_hash_table;
+static unsigned int ksm_use_zero_pages = 1;
+static unsigned long ksm_pages_zero_merged;
+/* those of them merged by ksm_merge_zero_range() */
+static unsigned long ksm_pages_zero_hinted;
+
+/*
+ * Shared shmem/tmpfs areas get slots when ksm_shmem_zero is set. Their pages
+ * are in the page cache of one inode, there is no COW to fall back on when
+ * one is written, so only the zero-filled ones are dealt with: dropped from
+ * the page cache, to be read back as holes. They never get rmap_items.
+ */
+static unsigned int ksm_shmem_zero;
+static unsigned long ksm_shmem_zero_dropped;
+
+/*
+ * The clean page cache pages met in the slots, mostly of private file
+ * mappings, cannot be merged: each one belongs to the mapping of its inode.
+ * With file_dup set, they are fingerprinted into ksm_file_dup_memo, and a
+ * page found identical to another one noted there in the same round is
+ * counted as a duplicate. The counts of the last full round are reported.
+ */
+#define KSM_FILE_DUP_BITS	12
+struct file_dup_memo {
+	unsigned long pfn;
+	u32 fp;
+	u32 round;
+};
+static struct file_dup_memo *ksm_file_dup_memo;
+static unsigned int ksm_file_dup;
+static unsigned long ksm_file_pages_seen, ksm_file_pages_dup;
+static unsigned long ksm_file_pages_seen_last, ksm_file_pages_dup_last;
+
+/*
+ * With swap_dedup set, reclaim notes the anon pages it adds to swap in
+ * ksm_swap_dedup_memo by fingerprint. An anon page about to be added to
+ * swap that is identical to one noted there, still in the swap cache and
+ * unmapped, gets the swap entry of that one in its pte instead: no swap
+ * slot nor write is spent on it. A fault on either pte then finds the swap
+ * count above one and copies the page, as for a KSM page read from swap.
+ */
+#define KSM_SWAP_DEDUP_BITS	10
+struct swap_dedup_memo {
+	unsigned long pfn;
+	unsigned long swap;
+	u32 fp;
+};
+static struct swap_dedup_memo *ksm_swap_dedup_memo;
+static DEFINE_SPINLOCK(ksm_swap_dedup_lock);
+static unsigned int ksm_swap_dedup;
+static unsigned long ksm_swap_dedup_pages;
+
+/*
+ * Pages left in the unstable tree at the end of a round keep their hash, and
+ * the dirty bit of their pte is cleared when scanned. A page still mapped
+ * clean by the same pte at its next visit is not hashed again.
+ */
+static unsigned int ksm_hash_cache = 1;
+static unsigned long ksm_hash_cache_hits;
+
+/*
+ * A page found young in its pte and on the active LRU list at this many
+ * visits in a row is hot, and not merged until it cools down. 0 disables it.
+ */
+#define KSM_HOT_ROUNDS_MAX	(YOUNG_MASK >> YOUNG_SHIFT)
+static unsigned int ksm_hot_rounds;
+static unsigned long ksm_pages_hot_deferred;
+
+/*
+ * A page with references beyond its mappings, pinned by get_user_pages() for
+ * vhost, RDMA or O_DIRECT, fails write_protect_page() every time. Found so
+ * at two visits in a row it is skipped unhashed, and looked at again about
+ * every 2^(level - 1) visits, the level going up by one each time it still
+ * is.
+ */
+#define KSM_PIN_LEVEL_MAX	(PIN_MASK >> PIN_SHIFT)
+static unsigned int ksm_pin_backoff = 1;
+static unsigned long ksm_pin_failures;
+static unsigned long ksm_pages_pin_skipped;
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * A transparent huge page is split for merging only if at least
+ * ksm_thp_split_threshold of its subpages look mergeable. The verdicts are
+ * remembered for the rest of the round in a small table hashed by the pfn
+ * of the head page.
+ */
+#define KSM_THP_VERDICT_BITS	8
+static unsigned int ksm_thp_split_threshold = HPAGE_PMD_NR / 8;
+static unsigned long ksm_thp_split_avoided;
+
+struct thp_verdict {
+	unsigned long pfn;
+	unsigned long long round;
+	int split;
+};
+static struct thp_verdict ksm_thp_verdicts[1 << KSM_THP_VERDICT_BITS];
+#endif
+
+/*
+ * Mark the vmas which are promoted up the ladder, or in which a huge page was
+ * split for merging, so that khugepaged does not collapse them again.
+ */
+static unsigned int ksm_khugepaged_hold = 1;
+
+/*
+ * The slots of an mm whose tasks are all frozen or stopped go up to the top
+ * rung for one sequential pass: nothing writes there, merging costs no COW.
+ */
+static unsigned int ksm_quiesced_fast = 1;
+
+/*
+ * A slot is placed on the ladder by its dedup ratio decayed over the rounds:
+ * each round weighs 1 >> ksm_dedup_decay of it. It goes up once that is
+ * ksm_rung_hysteresis percent over the mean, down once as much under it, and
+ * at most ksm_rung_jump_max rungs at once, one more for each doubling.
+ */
+#define KSM_DEDUP_DECAY_MAX	4
+static unsigned int ksm_dedup_decay = 2;
+static unsigned int ksm_rung_hysteresis = 25;
+static unsigned int ksm_rung_jump_max = 2;
+
+/*
+ * hash_strength keys the first level of the trees and is shared by all the
+ * slots. A slot whose lookups there find collisions more than
+ * ksm_strong_hash_ratio percent of the time, numeric or sparse content
+ * sampled too thinly, gets strong_hash: its stable tree hits are checked at
+ * full strength before any page is touched, instead of pulling the global
+ * strength up for everyone. It drops it below half that ratio. 0 disables.
+ */
+static unsigned int ksm_strong_hash_ratio = 25;
+static unsigned long ksm_strong_hash_slots;
+static unsigned long ksm_strong_hash_rejected;
+
+/*
+ * A cold page whose samples agree with a stable tree_node, but which is in
+ * none of its stable nodes, is compared line by line with the first one of
+ * them when near_dup_lines is set: differing in that many cache lines or
+ * less, it is counted as a near duplicate, which could be kept as a delta
+ * against that ksm page. 0 disables. The counts of the last full round
+ * are reported.
+ */
+static unsigned int ksm_near_dup_lines;
+static unsigned long ksm_pages_near_dup, ksm_near_dup_lines_total;
+static unsigned long ksm_pages_near_dup_last, ksm_near_dup_lines_last;
+
 /* The delta value each time the hash strength increases or decreases */
 static unsigned long hash_strength_delta;
 #define HASH_STRENGTH_DELTA_MAX	5
 
+/*
+ * One freshly hashed page in ksm_hash_probe_rate is a probe: it is also
+ * hashed at a quarter below and above hash_strength, and at full strength,
+ * into a small direct-mapped table per candidate strength. Same hash but a
+ * different full hash is a collision at that strength. Once a table worth of
+ * probes is taken, the candidate with the lowest estimated cost per page
+ * becomes hash_strength, within a round. 0 leaves it to the per-round
+ * rshash_adjust() state machine.
+ */
+#define KSM_PROBE_BITS		10
+#define KSM_PROBE_CANDIDATES	3	/* below, at and above hash_strength */
+
+struct hash_probe_entry {
+	u32 hash;
+	u32 hash_max;	/* 0 if the entry is empty */
+};
+
+static struct hash_probe_entry
+		ksm_probe_table[KSM_PROBE_CANDIDATES][1 << KSM_PROBE_BITS];
+static unsigned long ksm_probe_strength[KSM_PROBE_CANDIDATES];
+static unsigned long ksm_probe_colli[KSM_PROBE_CANDIDATES];
+static unsigned long ksm_probe_used[KSM_PROBE_CANDIDATES];
+static unsigned long ksm_probes;
+static unsigned long ksm_probe_countdown;
+static unsigned int ksm_hash_probe_rate = 64;
+static unsigned long ksm_hash_probe_moves;
+
+/*
+ * With sketch_size set, each slot keeps a bottom-k MinHash sketch of its
+ * pages: the sketch_size smallest distinct sketch hashes of the ones ksmd
+ * has hashed, zero-filled pages apart. The sketch hash reads fixed words of
+ * the page, just hashed and still in cache, with a fixed seed, unlike the
+ * random_nums of hash_strength, so that the sketches of processes on other
+ * hosts compare: the share of the smallest k of the union of two sketches
+ * found in both estimates the Jaccard similarity of their contents.
+ */
+#define KSM_SKETCH_WORDS	64
+#define KSM_SKETCH_SEED		0x6b736d31
+static unsigned int ksm_sketch_size;
+
+/*
+ * The same hash as a content fingerprint that outlives a reboot: debugfs
+ * ksm/stable_fingerprints reads out the sorted fingerprints of the ksm
+ * pages, and what is written back there after a kexec seeds ksm_seed_fps.
+ * While they last, KSM_SEED_ROUNDS rounds, a page hashed by ksmd with its
+ * fingerprint among them counts as a duplicate found in dup_wide of its
+ * slot, so that the slots which shared before climb the ladder at once
+ * instead of hours later. The merges themselves are found as usual.
+ */
+#define KSM_SEED_ROUNDS		16
+static u32 *ksm_seed_fps;
+static unsigned long ksm_seed_nr;
+static unsigned int ksm_seed_rounds;
+static unsigned long ksm_seed_hits;
+
 /* The time we have saved due to random_sample_hash */
 static u64 rshash_pos;
 
 /* The time we have wasted due to hash collision */
 static u64 rshash_neg;
 
+/*
+ * The full strength hashes computed and the collision sub-trees searched
+ * in this round, and in the last one.
+ */
+static unsigned long ksm_hash_max_pages, ksm_hash_max_pages_last;
+static unsigned long ksm_subtree_lookups, ksm_subtree_lookups_last;
+
 /*
  * The relative cost of memcmp, compared to 1 time unit of random sample
  * hash, this value is tested when ksm module is initialized
@@ -338,23 +1149,119 @@ static struct {
 
 
 
-static inline struct node_vma *alloc_node_vma(void)
-{
-	struct node_vma *node_vma;
-	node_vma = kmem_cache_zalloc(node_vma_cache, GFP_KERNEL);
-	if (node_vma) {
-		INIT_HLIST_HEAD(&node_vma->rmap_hlist);
-		INIT_HLIST_NODE(&node_vma->hlist);
-		node_vma->last_update = 0;
-	}
-	return node_vma;
-}
+/*
+ * Objects ksmd allocates while merging are taken from small magazines of
+ * its own, refilled between two batches with allocations which may sleep.
+ * The magazines are only used under ksm_thread_mutex, like the trees. When
+ * one is empty, the allocation does not sleep either and may fail: all the
+ * callers cope with that.
+ */
+#define KSM_MAGAZINE_SIZE	64
+
+enum ksm_magazine_item {
+	KSM_MAG_RMAP_ITEM,
+	KSM_MAG_STABLE_NODE,
+	KSM_MAG_NODE_VMA,
+	KSM_MAG_TREE_NODE,
+	NR_KSM_MAGAZINES
+};
 
-static inline void free_node_vma(struct node_vma *node_vma)
+struct ksm_magazine {
+	struct kmem_cache **cache;
+	unsigned int nr;
+	void *objs[KSM_MAGAZINE_SIZE];
+};
+
+static struct ksm_magazine ksm_magazines[NR_KSM_MAGAZINES] = {
+	[KSM_MAG_RMAP_ITEM]	= { .cache = &rmap_item_cache },
+	[KSM_MAG_STABLE_NODE]	= { .cache = &stable_node_cache },
+	[KSM_MAG_NODE_VMA]	= { .cache = &node_vma_cache },
+	[KSM_MAG_TREE_NODE]	= { .cache = &tree_node_cache },
+};
+
+static unsigned int ksm_use_magazines = 1;
+
+/* allocations finding their magazine empty */
+static unsigned long ksm_magazine_misses;
+
+static void *ksm_magazine_alloc(enum ksm_magazine_item item, gfp_t gfp)
+{
+	struct ksm_magazine *mag = &ksm_magazines[item];
+	void *obj;
+
+	if (!ksm_use_magazines)
+		return kmem_cache_alloc(*mag->cache, gfp);
+
+	if (!mag->nr) {
+		ksm_magazine_misses++;
+		return kmem_cache_alloc(*mag->cache,
+					(gfp & ~__GFP_WAIT) | __GFP_NOWARN);
+	}
+
+	obj = mag->objs[--mag->nr];
+	if (gfp & __GFP_ZERO)
+		memset(obj, 0, kmem_cache_size(*mag->cache));
+	return obj;
+}
+
+/* fill up the magazines less than half full, called with no mmap_sem held */
+static void ksm_magazines_refill(void)
+{
+	struct ksm_magazine *mag;
+	size_t want;
+
+	for (mag = ksm_magazines; mag < ksm_magazines + NR_KSM_MAGAZINES;
+	     mag++) {
+		if (mag->nr >= KSM_MAGAZINE_SIZE / 2)
+			continue;
+
+		want = KSM_MAGAZINE_SIZE - mag->nr;
+		mag->nr += kmem_cache_alloc_bulk(*mag->cache, GFP_KERNEL |
+					__GFP_NORETRY | __GFP_NOWARN,
+					want, mag->objs + mag->nr);
+		if (mag->nr < KSM_MAGAZINE_SIZE)
+			return;
+	}
+}
+
+static void ksm_magazines_drain(void)
+{
+	struct ksm_magazine *mag;
+
+	for (mag = ksm_magazines; mag < ksm_magazines + NR_KSM_MAGAZINES;
+	     mag++) {
+		kmem_cache_free_bulk(*mag->cache, mag->nr, mag->objs);
+		mag->nr = 0;
+	}
+}
+
+static inline struct node_vma *alloc_node_vma(void)
+{
+	struct node_vma *node_vma;
+	node_vma = ksm_magazine_alloc(KSM_MAG_NODE_VMA, GFP_KERNEL | __GFP_ZERO);
+	if (node_vma) {
+		INIT_HLIST_HEAD(&node_vma->rmap_hlist);
+		INIT_HLIST_NODE(&node_vma->hlist);
+		node_vma->last_update = 0;
+		ksm_node_vmas++;
+	}
+	return node_vma;
+}
+
+static inline void free_node_vma(struct node_vma *node_vma)
 {
+	ksm_node_vmas--;
 	kmem_cache_free(node_vma_cache, node_vma);
 }
 
+/* take an emptied @node_vma off its stable node and free it */
+static inline void unlink_node_vma(struct node_vma *node_vma)
+{
+	hlist_del(&node_vma->hlist);
+	rb_erase(&node_vma->node, &node_vma->head->node_vmas);
+	free_node_vma(node_vma);
+}
+
 
 static inline struct vma_slot *alloc_vma_slot(void)
 {
@@ -371,27 +1278,49 @@ static inline struct vma_slot *alloc_vma_slot(void)
 	if (slot) {
 		INIT_LIST_HEAD(&slot->ksm_list);
 		INIT_LIST_HEAD(&slot->slot_list);
-		slot->ksm_index = -1;
-		slot->need_rerand = 1;
+		INIT_LIST_HEAD(&slot->intertab_list);
+		INIT_LIST_HEAD(&slot->round_list);
+		INIT_LIST_HEAD(&slot->pairs_lo);
+		INIT_LIST_HEAD(&slot->pairs_hi);
 	}
 	return slot;
 }
 
 static inline void free_vma_slot(struct vma_slot *vma_slot)
 {
+	if (vma_slot->rmap_list_pool &&
+	    vma_slot->rmap_list_pool != &vma_slot->pool_one) {
+		kfree(vma_slot->rmap_list_pool);
+		kfree(vma_slot->pool_counts);
+	}
+	if (vma_slot->cow_heat != &vma_slot->cow_heat_one)
+		kfree(vma_slot->cow_heat);
+	kfree(vma_slot->sketch);
+	if (vma_slot->strong_hash)
+		ksm_strong_hash_slots--;
+	if (vma_slot->burst)
+		ksm_burst_pages -= vma_slot->pages;
+	mem_cgroup_ksm_put(vma_slot->memcg);
 	kmem_cache_free(vma_slot_cache, vma_slot);
 }
 
+/* the end of the region of the vma scanned by @slot */
+static inline unsigned long slot_end(struct vma_slot *slot)
+{
+	return slot->vstart + (slot->pages << PAGE_SHIFT);
+}
+
 
 
 static inline struct rmap_item *alloc_rmap_item(void)
 {
 	struct rmap_item *rmap_item;
 
-	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
+	rmap_item = ksm_magazine_alloc(KSM_MAG_RMAP_ITEM, GFP_KERNEL | __GFP_ZERO);
 	if (rmap_item) {
 		/* bug on lowest bit is not clear for flag use */
 		BUG_ON(is_addr(rmap_item));
+		ksm_rmap_items++;
 	}
 	return rmap_item;
 }
@@ -399,44 +1328,465 @@ static inline struct rmap_item *alloc_rmap_item(void)
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
 	rmap_item->slot = NULL;	/* debug safety */
+	ksm_rmap_items--;
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
 
+#ifdef CONFIG_MEMORY_HOTREMOVE
+/*
+ * The stable nodes hashed by the memory section of their kpfn, so that
+ * offlining a memory block only looks at the stable nodes of its sections.
+ * The kpfn of a stable node changes under its page lock, not under
+ * ksm_thread_mutex, hence the lock of its own.
+ */
+#define KSM_KPFN_HASH_BITS	10
+
+static struct hlist_head ksm_kpfn_hash[1 << KSM_KPFN_HASH_BITS];
+static DEFINE_SPINLOCK(ksm_kpfn_lock);
+
+static inline struct hlist_head *ksm_kpfn_bucket(unsigned long pfn)
+{
+	return &ksm_kpfn_hash[hash_long(pfn_to_section_nr(pfn),
+					KSM_KPFN_HASH_BITS)];
+}
+
+static void stable_node_set_kpfn(struct stable_node *stable_node,
+				 unsigned long kpfn)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ksm_kpfn_lock, flags);
+	hlist_del_init(&stable_node->kpfn_hlist);
+	stable_node->kpfn = kpfn;
+	hlist_add_head(&stable_node->kpfn_hlist, ksm_kpfn_bucket(kpfn));
+	spin_unlock_irqrestore(&ksm_kpfn_lock, flags);
+}
+
+static inline void stable_node_init_kpfn(struct stable_node *stable_node)
+{
+	INIT_HLIST_NODE(&stable_node->kpfn_hlist);
+}
+
+static void stable_node_del_kpfn(struct stable_node *stable_node)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ksm_kpfn_lock, flags);
+	hlist_del_init(&stable_node->kpfn_hlist);
+	spin_unlock_irqrestore(&ksm_kpfn_lock, flags);
+}
+#else
+static inline void stable_node_set_kpfn(struct stable_node *stable_node,
+					unsigned long kpfn)
+{
+	stable_node->kpfn = kpfn;
+}
+
+static inline void stable_node_init_kpfn(struct stable_node *stable_node)
+{
+}
+
+static inline void stable_node_del_kpfn(struct stable_node *stable_node)
+{
+}
+#endif /* CONFIG_MEMORY_HOTREMOVE */
+
 static inline struct stable_node *alloc_stable_node(void)
 {
 	struct stable_node *node;
-	node = kmem_cache_alloc(stable_node_cache, GFP_KERNEL | GFP_ATOMIC);
+	node = ksm_magazine_alloc(KSM_MAG_STABLE_NODE,
+				  GFP_KERNEL | GFP_ATOMIC);
 	if (!node)
 		return NULL;
 
 	INIT_HLIST_HEAD(&node->hlist);
+	node->node_vmas = RB_ROOT;
+	node->swap = 0;
+	INIT_HLIST_NODE(&node->swap_hlist);
+	node->walk_start = 0;
+	node->rmap_nr = 0;
+	node->digest[0] = node->digest[1] = 0;
+	node->memcg = NULL;
+	stable_node_init_kpfn(node);
 	list_add(&node->all_list, &stable_node_list);
+	ksm_stable_nodes++;
 	return node;
 }
 
 static inline void free_stable_node(struct stable_node *stable_node)
 {
+	unsigned long flags;
+
+	if (!hlist_unhashed(&stable_node->swap_hlist)) {
+		spin_lock_irqsave(&ksm_swap_lock, flags);
+		hlist_del_init(&stable_node->swap_hlist);
+		if (stable_node->swap)
+			ksm_swap_nr_parked--;
+		spin_unlock_irqrestore(&ksm_swap_lock, flags);
+	}
+	stable_node_del_kpfn(stable_node);
+	if (stable_node->memcg) {
+		mem_cgroup_ksm_stat(stable_node->memcg,
+				    MEM_CGROUP_KSM_PAGES_CHARGED, -1);
+		mem_cgroup_ksm_put(stable_node->memcg);
+	}
 	list_del(&stable_node->all_list);
+	ksm_stable_nodes--;
 	kmem_cache_free(stable_node_cache, stable_node);
 }
 
 static inline struct tree_node *alloc_tree_node(struct list_head *list)
 {
 	struct tree_node *node;
-	node = kmem_cache_zalloc(tree_node_cache, GFP_KERNEL | GFP_ATOMIC);
+	node = ksm_magazine_alloc(KSM_MAG_TREE_NODE,
+				  GFP_KERNEL | GFP_ATOMIC | __GFP_ZERO);
 	if (!node)
 		return NULL;
 
 	list_add(&node->all_list, list);
+	ksm_tree_nodes++;
 	return node;
 }
 
 static inline void free_tree_node(struct tree_node *node)
 {
 	list_del(&node->all_list);
+	ksm_tree_nodes--;
 	kmem_cache_free(tree_node_cache, node);
 }
 
+/*
+ * The tree_nodes of the stable trees and of the unstable trees are also
+ * indexed by (root, hash) in two linear probing hash tables, so that a lookup
+ * costs one or two cache lines instead of a miss per rbtree level. The
+ * rbtrees stay the authority: a table that had to drop entries because it
+ * was too full is no longer complete, and misses in it are checked in the
+ * rbtree. The tables are resized and made complete again at the end of each
+ * round.
+ */
+#define KSM_TREE_INDEX_BITS	12
+#define KSM_TREE_INDEX_BITS_MAX	28
+
+struct tree_index_entry {
+	u32 hash;
+	struct tree_node *node;
+};
+
+struct tree_index {
+	struct tree_index_entry *table;
+	unsigned int bits;
+	unsigned long nr;
+	unsigned long dropped;	/* entries not added to a full table */
+	unsigned long peak;	/* the most entries wanted this round */
+	int complete;		/* every tree_node of the trees is in table */
+};
+
+static struct tree_index ksm_stable_index;
+static struct tree_index ksm_unstable_index;
+static unsigned int ksm_tree_index = 1;
+
+static inline unsigned long tree_index_home(struct tree_index *idx,
+					    struct rb_root *root, u32 hash)
+{
+	return (hash ^ hash_ptr(root, 32)) & ((1UL << idx->bits) - 1);
+}
+
+static struct tree_node *tree_index_lookup(struct tree_index *idx,
+					   struct rb_root *root, u32 hash)
+{
+	unsigned long mask = (1UL << idx->bits) - 1;
+	unsigned long i = tree_index_home(idx, root, hash);
+	struct tree_index_entry *entry;
+
+	for (;; i = (i + 1) & mask) {
+		entry = &idx->table[i];
+		if (!entry->node)
+			return NULL;
+		if (entry->hash == hash && entry->node->root == root)
+			return entry->node;
+	}
+}
+
+static void tree_index_add(struct tree_index *idx, struct tree_node *node)
+{
+	unsigned long mask = (1UL << idx->bits) - 1;
+	unsigned long i;
+
+	if (!idx->table)
+		return;
+
+	if (idx->peak < idx->nr + idx->dropped + 1)
+		idx->peak = idx->nr + idx->dropped + 1;
+
+	/* keep the load under 3/4, resizing waits for the end of the round */
+	if ((idx->nr + 1) * 4 > (mask + 1) * 3) {
+		idx->dropped++;
+		idx->complete = 0;
+		return;
+	}
+
+	i = tree_index_home(idx, node->root, node->hash);
+	while (idx->table[i].node)
+		i = (i + 1) & mask;
+
+	idx->table[i].hash = node->hash;
+	idx->table[i].node = node;
+	idx->nr++;
+}
+
+/* delete by shifting back the entries of the probe sequence after it */
+static void tree_index_del(struct tree_index *idx, struct tree_node *node)
+{
+	unsigned long mask = (1UL << idx->bits) - 1;
+	unsigned long i, j, home;
+
+	if (!idx->table)
+		return;
+
+	i = tree_index_home(idx, node->root, node->hash);
+	while (idx->table[i].node != node) {
+		if (!idx->table[i].node) {
+			/* it was dropped from a full table */
+			if (idx->dropped)
+				idx->dropped--;
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+
+	for (j = (i + 1) & mask; idx->table[j].node; j = (j + 1) & mask) {
+		home = tree_index_home(idx, idx->table[j].node->root,
+				       idx->table[j].hash);
+		/* can the entry at j move to the hole at i? */
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && home <= i && home > j)) {
+			idx->table[i] = idx->table[j];
+			i = j;
+		}
+	}
+
+	idx->table[i].node = NULL;
+	idx->nr--;
+}
+
+static void tree_index_clear(struct tree_index *idx)
+{
+	if (idx->table)
+		memset(idx->table, 0, sizeof(*idx->table) << idx->bits);
+	idx->nr = idx->dropped = idx->peak = 0;
+	idx->complete = 1;
+}
+
+static void tree_index_free(struct tree_index *idx)
+{
+	vfree(idx->table);
+	idx->table = NULL;
+	idx->nr = idx->dropped = idx->peak = 0;
+	idx->complete = 0;
+}
+
+static void tree_index_add_tree(struct tree_index *idx, struct rb_root *root)
+{
+	struct rb_node *node;
+
+	for (node = rb_first(root); node; node = rb_next(node))
+		tree_index_add(idx, rb_entry(node, struct tree_node, node));
+}
+
+/*
+ * tree_index_reserve() - make the table of @idx at least twice as big as
+ * @nr entries. The table is left empty if it was reallocated.
+ *
+ * @return 1 if the table was reallocated
+ */
+static int tree_index_reserve(struct tree_index *idx, unsigned long nr)
+{
+	unsigned int bits = KSM_TREE_INDEX_BITS;
+	struct tree_index_entry *table;
+
+	while (bits < KSM_TREE_INDEX_BITS_MAX && (1UL << bits) < nr * 2)
+		bits++;
+
+	if (idx->table && bits <= idx->bits)
+		return 0;
+
+	table = vzalloc(sizeof(*table) << bits);
+	if (!table)
+		return 0;
+
+	vfree(idx->table);
+	idx->table = table;
+	idx->bits = bits;
+	idx->nr = idx->dropped = idx->peak = 0;
+	idx->complete = 1;
+	return 1;
+}
+
+/*
+ * tree_node_walk() - find the tree_node of a hash in a stable or unstable
+ * tree, without looking at the nodes under it.
+ */
+static struct tree_node *tree_node_walk(struct rb_root *root, u32 hash)
+{
+	struct rb_node *node = root->rb_node;
+	struct tree_node *tree_node;
+
+	while (node) {
+		tree_node = rb_entry(node, struct tree_node, node);
+
+		if (hash < tree_node->hash)
+			node = node->rb_left;
+		else if (hash > tree_node->hash)
+			node = node->rb_right;
+		else
+			return tree_node;
+	}
+
+	return NULL;
+}
+
+static struct tree_node *tree_node_find(struct tree_index *idx,
+					struct rb_root *root, u32 hash)
+{
+	struct tree_node *tree_node;
+
+	if (idx->table) {
+		tree_node = tree_index_lookup(idx, root, hash);
+		if (tree_node || idx->complete)
+			return tree_node;
+	}
+
+	return tree_node_walk(root, hash);
+}
+
+static inline int unstable_tree_group(struct vma_slot *slot)
+{
+	return ksm_unstable_split_rung && slot->rung &&
+	       slot->rung - ksm_scan_ladder >= ksm_unstable_split_rung;
+}
+
+/* the unstable tree_node of @hash on @nid, in any group */
+static struct tree_node *unstable_tree_find(int nid, u32 hash)
+{
+	struct tree_node *tree_node;
+	int group;
+
+	for (group = 0; group < KSM_UNSTABLE_GROUPS; group++) {
+		tree_node = tree_node_find(&ksm_unstable_index,
+					   &root_unstable_tree[group][nid],
+					   hash);
+		if (tree_node || !ksm_unstable_split_rung)
+			return tree_node;
+	}
+
+	return NULL;
+}
+
+/*
+ * A counting Bloom filter of the hashes of every stable tree_node, of the
+ * current stable trees and of the old ones being migrated. Most scanned pages
+ * match nothing, and a zero counter tells so without touching the index or
+ * the trees. A counter that reached 255 sticks there, so that it can never
+ * drop to zero under a hash that is still in a tree; the filter is rebuilt at
+ * the end of a round if that happened or if it got too crowded.
+ */
+#define KSM_FILTER_BITS_MIN	14
+#define KSM_FILTER_BITS_MAX	30
+#define KSM_FILTER_PROBES	3
+#define KSM_FILTER_STUCK	255
+
+struct ksm_filter {
+	u8 *counters;
+	unsigned int bits;
+	int stuck;		/* some counter could not count any more */
+};
+
+static struct ksm_filter ksm_stable_filter;
+static unsigned int ksm_use_stable_filter = 1;
+
+/* stable tree searches answered by the filter, or let through */
+static unsigned long ksm_filter_negative;
+static unsigned long ksm_filter_positive;
+static unsigned long ksm_filter_false_positive;
+
+static inline unsigned long ksm_filter_slot(struct ksm_filter *filter,
+					    u32 hash, int i)
+{
+	u32 step = ((hash >> 16) | (hash << 16)) * GOLDEN_RATIO_PRIME_32;
+
+	return (hash + i * (step | 1)) & ((1UL << filter->bits) - 1);
+}
+
+static void ksm_filter_add(struct ksm_filter *filter, u32 hash)
+{
+	u8 *counter;
+	int i;
+
+	if (!filter->counters)
+		return;
+
+	for (i = 0; i < KSM_FILTER_PROBES; i++) {
+		counter = filter->counters + ksm_filter_slot(filter, hash, i);
+		if (*counter == KSM_FILTER_STUCK)
+			filter->stuck = 1;
+		else
+			(*counter)++;
+	}
+}
+
+static void ksm_filter_del(struct ksm_filter *filter, u32 hash)
+{
+	u8 *counter;
+	int i;
+
+	if (!filter->counters)
+		return;
+
+	for (i = 0; i < KSM_FILTER_PROBES; i++) {
+		counter = filter->counters + ksm_filter_slot(filter, hash, i);
+		if (*counter != KSM_FILTER_STUCK)
+			(*counter)--;
+	}
+}
+
+/* @return 0 if no tree_node has @hash, 1 if one may have */
+static inline int ksm_filter_test(struct ksm_filter *filter, u32 hash)
+{
+	int i;
+
+	if (!filter->counters)
+		return 1;
+
+	for (i = 0; i < KSM_FILTER_PROBES; i++)
+		if (!filter->counters[ksm_filter_slot(filter, hash, i)])
+			return 0;
+
+	return 1;
+}
+
+static void ksm_filter_add_tree(struct ksm_filter *filter,
+				struct rb_root *root)
+{
+	struct rb_node *node;
+
+	for (node = rb_first(root); node; node = rb_next(node))
+		ksm_filter_add(filter,
+			       rb_entry(node, struct tree_node, node)->hash);
+}
+
+/* a stable tree_node was linked to or is being unlinked from its tree */
+static inline void stable_tree_node_added(struct tree_node *tree_node)
+{
+	tree_index_add(&ksm_stable_index, tree_node);
+	ksm_filter_add(&ksm_stable_filter, tree_node->hash);
+}
+
+static inline void stable_tree_node_removed(struct tree_node *tree_node)
+{
+	tree_index_del(&ksm_stable_index, tree_node);
+	ksm_filter_del(&ksm_stable_filter, tree_node->hash);
+}
+
 static void ksm_drop_anon_vma(struct rmap_item *rmap_item)
 {
 	struct anon_vma *anon_vma = rmap_item->anon_vma;
@@ -445,6 +1795,29 @@ static void ksm_drop_anon_vma(struct rmap_item *rmap_item)
 }
 
 
+/*
+ * stable_node_unlink() - unlink a stable node from the collision subtree of
+ * its tree_node. If it was the last one and @remove_tree_node, the tree_node
+ * is unlinked from its tree and freed too.
+ */
+static inline void stable_node_unlink(struct stable_node *stable_node,
+				      int remove_tree_node)
+{
+	struct tree_node *tree_node = stable_node->tree_node;
+
+	rb_erase(&stable_node->node, &tree_node->sub_root);
+
+	if (RB_EMPTY_ROOT(&tree_node->sub_root) && remove_tree_node) {
+		stable_tree_node_removed(tree_node);
+		rb_erase(&tree_node->node, tree_node->root);
+		free_tree_node(tree_node);
+	} else {
+		tree_node->count--;
+	}
+
+	stable_node->tree_node = NULL;
+}
+
 /**
  * Remove a stable node from stable_tree, may unlink from its tree_node and
  * may remove its parent tree_node if no other stable node is pending.
@@ -466,6 +1839,9 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node,
 			hlist_for_each_entry(rmap_item, rmap_hlist,
 					     &node_vma->rmap_hlist, hlist) {
 				ksm_pages_sharing--;
+				rmap_item->slot->pages_ksm--;
+				mem_cgroup_ksm_stat(rmap_item->slot->memcg,
+					MEM_CGROUP_KSM_PAGES_MERGED, -1);
 
 				ksm_drop_anon_vma(rmap_item);
 				rmap_item->address &= PAGE_MASK;
@@ -473,40 +1849,125 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node,
 			free_node_vma(node_vma);
 			cond_resched();
 		}
+		stable_node->node_vmas = RB_ROOT;
 
 		/* the last one is counted as shared */
 		ksm_pages_shared--;
 		ksm_pages_sharing++;
 	}
 
-	if (stable_node->tree_node && unlink_rb) {
-		rb_erase(&stable_node->node,
-			 &stable_node->tree_node->sub_root);
-
-		if (RB_EMPTY_ROOT(&stable_node->tree_node->sub_root) &&
-		    remove_tree_node) {
-			rb_erase(&stable_node->tree_node->node,
-				 root_stable_treep);
-			free_tree_node(stable_node->tree_node);
-		} else {
-			stable_node->tree_node->count--;
-		}
-	}
+	if (stable_node->tree_node && unlink_rb)
+		stable_node_unlink(stable_node, remove_tree_node);
 
 	free_stable_node(stable_node);
 }
 
 
+static inline int in_stable_tree(struct rmap_item *rmap_item)
+{
+	return rmap_item->address & STABLE_FLAG;
+}
+
+enum {
+	KSM_NODE_GONE,		/* its page was freed */
+	KSM_NODE_PARKED,	/* its page was swapped out, see ksm_swap_park */
+	KSM_NODE_RETRY,		/* its page is frozen in the swap cache, or moved */
+};
+
 /*
- * get_ksm_page: checks if the page indicated by the stable node
- * is still its ksm page, despite having held no reference to it.
- * In which case we can trust the content of the page, and it
- * returns the gotten page; but if the page has now been zapped,
- * remove the stale node from the stable tree and return NULL.
- *
- * You would expect the stable_node to hold a reference to the ksm page.
- * But if it increments the page's count, swapping out has to wait for
- * ksmd to come around again before it can free the page, which may take
+ * A page frozen by __remove_mapping() still points to its node until it is
+ * freed at the end of shrink_page_list(), which may sleep before. Only while
+ * it is in the swap cache, under its tree_lock, can ksm_swap_park() still
+ * look at the node: after that the node goes as if the page were freed.
+ */
+static int stable_node_page_state(struct stable_node *stable_node,
+				  void *expected_mapping)
+{
+	struct page *page;
+	unsigned long flags;
+	int state = KSM_NODE_GONE;
+
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	page = pfn_to_page(stable_node->kpfn);
+	if (stable_node->swap)
+		state = KSM_NODE_PARKED;
+	else if (ACCESS_ONCE(page->mapping) == expected_mapping &&
+		 (page_count(page) || PageSwapCache(page)))
+		state = KSM_NODE_RETRY;
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
+
+	return state;
+}
+
+/*
+ * A parked node leaves the stable tree, since its page cannot be compared,
+ * but not the rmap_items, which are still mapping its content from swap.
+ */
+static void stable_node_park(struct stable_node *stable_node,
+			     int unlink_rb, int remove_tree_node)
+{
+	if (stable_node->tree_node && unlink_rb)
+		stable_node_unlink(stable_node, remove_tree_node);
+	list_move(&stable_node->all_list, &stable_node_parked_list);
+}
+
+/*
+ * parked_node_drop() - remove @rmap_item from its node parked over swap.
+ * The node is freed with its last rmap_item.
+ *
+ * @return 0 if the node is not parked anymore, to retry with its page.
+ */
+static int parked_node_drop(struct rmap_item *rmap_item)
+{
+	struct node_vma *node_vma = rmap_item->head;
+	struct stable_node *stable_node = node_vma->head;
+	unsigned long flags;
+	int empty;
+
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	if (!stable_node->swap) {
+		spin_unlock_irqrestore(&ksm_swap_lock, flags);
+		return 0;
+	}
+
+	/* no page to lock: nobody walks it but under ksm_swap_lock */
+	hlist_del(&rmap_item->hlist);
+	stable_node->rmap_nr--;
+	if (hlist_empty(&node_vma->rmap_hlist))
+		unlink_node_vma(node_vma);
+	empty = hlist_empty(&stable_node->hlist);
+	if (empty) {
+		hlist_del_init(&stable_node->swap_hlist);
+		stable_node->swap = 0;
+		ksm_swap_nr_parked--;
+	}
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
+
+	if (empty) {
+		ksm_pages_shared--;
+		free_stable_node(stable_node);
+	} else
+		ksm_pages_sharing--;
+
+	rmap_item->slot->pages_ksm--;
+	mem_cgroup_ksm_stat(rmap_item->slot->memcg,
+			    MEM_CGROUP_KSM_PAGES_MERGED, -1);
+	ksm_drop_anon_vma(rmap_item);
+	rmap_item->address &= PAGE_MASK | YOUNG_MASK | PIN_MASK;
+	rmap_item->hash_max = 0;
+	return 1;
+}
+
+/*
+ * get_ksm_page: checks if the page indicated by the stable node
+ * is still its ksm page, despite having held no reference to it.
+ * In which case we can trust the content of the page, and it
+ * returns the gotten page; but if the page has now been zapped,
+ * remove the stale node from the stable tree and return NULL.
+ *
+ * You would expect the stable_node to hold a reference to the ksm page.
+ * But if it increments the page's count, swapping out has to wait for
+ * ksmd to come around again before it can free the page, which may take
  * seconds or even minutes: much too unresponsive.  So instead we use a
  * "keyhole reference": access to the ksm page from the stable node peeps
  * out through its keyhole to see if that page still holds the right key,
@@ -540,9 +2001,12 @@ static struct page *get_ksm_page(struct stable_node *stable_node,
 	struct page *page;
 	void *expected_mapping;
 
-	page = pfn_to_page(stable_node->kpfn);
 	expected_mapping = (void *)stable_node +
 				(PAGE_MAPPING_ANON | PAGE_MAPPING_KSM);
+again:
+	/* kpfn moves when the page is migrated, see ksm_migrate_page() */
+	page = pfn_to_page(ACCESS_ONCE(stable_node->kpfn));
+	smp_read_barrier_depends();
 	rcu_read_lock();
 	if (page->mapping != expected_mapping)
 		goto stale;
@@ -556,11 +2020,76 @@ static struct page *get_ksm_page(struct stable_node *stable_node,
 	return page;
 stale:
 	rcu_read_unlock();
+	switch (stable_node_page_state(stable_node, expected_mapping)) {
+	case KSM_NODE_RETRY:
+		/*
+		 * Removing it now would leave the page pointing to a freed
+		 * node if page_freeze_refs() is undone, or if it's parked
+		 * right after. Both happen under the tree_lock, quickly; a
+		 * migrated page is followed to its new kpfn.
+		 */
+		cpu_relax();
+		goto again;
+	case KSM_NODE_PARKED:
+		stable_node_park(stable_node, unlink_rb, remove_tree_node);
+		return NULL;
+	}
+
 	remove_node_from_stable_tree(stable_node, unlink_rb, remove_tree_node);
 
 	return NULL;
 }
 
+/*
+ * lock_ksm_page() - lock @page, gotten by get_ksm_page() for @stable_node,
+ * and check that it is still the node's page before it is mapped by a merge.
+ * Migration checks the count of a KSM page once, under the page lock, and
+ * has moved the node to the new page by the time it unlocks: a reference
+ * taken before that check stops it, one taken after sees the page gone.
+ *
+ * @trylock:	if the caller holds another page lock
+ *
+ * @return 1 with @page locked, 0 with it unlocked if it cannot be used.
+ */
+static int lock_ksm_page(struct stable_node *stable_node, struct page *page,
+			 int trylock)
+{
+	void *expected_mapping = (void *)stable_node +
+				 (PAGE_MAPPING_ANON | PAGE_MAPPING_KSM);
+
+	if (!trylock)
+		lock_page(page);
+	else if (!trylock_page(page))
+		return 0;
+
+	if (ACCESS_ONCE(page->mapping) != expected_mapping) {
+		unlock_page(page);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * get_ksm_page_locked() - get_ksm_page() for a page to be mapped, checked
+ * with lock_ksm_page() and returned unlocked, following it if migrated.
+ */
+static struct page *get_ksm_page_locked(struct stable_node *stable_node,
+					int unlink_rb, int remove_tree_node)
+{
+	struct page *page;
+
+again:
+	page = get_ksm_page(stable_node, unlink_rb, remove_tree_node);
+	if (!page)
+		return NULL;
+	if (!lock_ksm_page(stable_node, page, 0)) {
+		put_page(page);
+		goto again;
+	}
+	unlock_page(page);
+	return page;
+}
+
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
@@ -572,11 +2101,17 @@ static inline void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		struct node_vma *node_vma;
 		struct page *page;
 
+again:
 		node_vma = rmap_item->head;
 		stable_node = node_vma->head;
 		page = get_ksm_page(stable_node, 1, 1);
-		if (!page)
+		if (!page) {
+			/* a node parked over swap still holds it */
+			if (in_stable_tree(rmap_item) &&
+			    !parked_node_drop(rmap_item))
+				goto again;
 			goto out;
+		}
 
 		/*
 		 * page lock is needed because it's racing with
@@ -584,11 +2119,10 @@ static inline void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		 */
 		lock_page(page);
 		hlist_del(&rmap_item->hlist);
+		stable_node->rmap_nr--;
 
-		if (hlist_empty(&node_vma->rmap_hlist)) {
-			hlist_del(&node_vma->hlist);
-			free_node_vma(node_vma);
-		}
+		if (hlist_empty(&node_vma->rmap_hlist))
+			unlink_node_vma(node_vma);
 		unlock_page(page);
 
 		put_page(page);
@@ -602,6 +2136,9 @@ static inline void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		} else
 			ksm_pages_sharing--;
 
+		rmap_item->slot->pages_ksm--;
+		mem_cgroup_ksm_stat(rmap_item->slot->memcg,
+				    MEM_CGROUP_KSM_PAGES_MERGED, -1);
 
 		ksm_drop_anon_vma(rmap_item);
 	} else if (rmap_item->address & UNSTABLE_FLAG) {
@@ -609,15 +2146,17 @@ static inline void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		 * Usually ksmd can and must skip the rb_erase, because
 		 * root_unstable_tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
-		 * if this rmap_item was inserted by this scan, rather
-		 * than left over from before.
+		 * if this rmap_item was inserted since the trees were
+		 * last emptied, rather than left over from before.
 		 */
-		if (rmap_item->append_round == ksm_scan_round) {
+		if ((s32)(rmap_item->append_round - ksm_unstable_since) >= 0) {
 			rb_erase(&rmap_item->node,
 				 &rmap_item->tree_node->sub_root);
 			if (RB_EMPTY_ROOT(&rmap_item->tree_node->sub_root)) {
+				tree_index_del(&ksm_unstable_index,
+					       rmap_item->tree_node);
 				rb_erase(&rmap_item->tree_node->node,
-					 &root_unstable_tree);
+					 rmap_item->tree_node->root);
 
 				free_tree_node(rmap_item->tree_node);
 			} else
@@ -626,7 +2165,7 @@ static inline void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		ksm_pages_unshared--;
 	}
 
-	rmap_item->address &= PAGE_MASK;
+	rmap_item->address &= PAGE_MASK | YOUNG_MASK | PIN_MASK;
 	rmap_item->hash_max = 0;
 
 out:
@@ -639,7 +2178,7 @@ out:
  * 2. make sure the mmap_sem is manipulated under valid vma.
  *
  * My concern here is that in some cases, this may make
- * vma_slot_list_lock() waiters to serialized further by some
+ * vma_slot_queue lock waiters to serialized further by some
  * sem->wait_lock, can this really be expensive?
  *
  *
@@ -654,27 +2193,28 @@ static int try_down_read_slot_mmap_sem(struct vma_slot *slot)
 	struct mm_struct *mm;
 	struct rw_semaphore *sem;
 
-	spin_lock(&vma_slot_list_lock);
+	spin_lock(&slot->queue->lock);
 
 	/* the slot_list was removed and inited from new list, when it enters
 	 * ksm_list. If now it's not empty, then it must be moved to del list
 	 */
 	if (!list_empty(&slot->slot_list)) {
-		spin_unlock(&vma_slot_list_lock);
+		spin_unlock(&slot->queue->lock);
 		return -ENOENT;
 	}
 
-	BUG_ON(slot->pages != vma_pages(slot->vma));
+	BUG_ON(slot_end(slot) > slot->vma->vm_end);
 	/* Ok, vma still valid */
 	vma = slot->vma;
 	mm = vma->vm_mm;
 	sem = &mm->mmap_sem;
 	if (down_read_trylock(sem)) {
-		spin_unlock(&vma_slot_list_lock);
+		spin_unlock(&slot->queue->lock);
 		return 0;
 	}
 
-	spin_unlock(&vma_slot_list_lock);
+	spin_unlock(&slot->queue->lock);
+	ksm_mmap_sem_busy++;
 	return -EBUSY;
 }
 
@@ -752,3710 +2292,11462 @@ failout_up:
 }
 
 /*
- * What kind of VMA is considered ?
+ * With unstable_nolock set, the page of an unstable tree hit is merged
+ * without taking the mmap_sem of its mm on top of the one ksmd holds: the
+ * page is only pinned, and its vma is kept alive by the anon_vma lock the
+ * way rmap walkers do, for as long as its ptes are touched. A vma is
+ * unlinked from its anon_vmas before ksm_remove_vma() and the free, so a
+ * slot not yet moved to the del list whose vma is on the page's anon_vma
+ * cannot go away while that lock is held.
  */
-static inline int vma_can_enter(struct vm_area_struct *vma)
-{
-	return !(vma->vm_flags & (VM_PFNMAP | VM_IO  | VM_DONTEXPAND |
-				  VM_RESERVED  | VM_HUGETLB | VM_INSERTPAGE |
-				  VM_NONLINEAR | VM_MIXEDMAP | VM_SAO |
-				  VM_SHARED  | VM_MAYSHARE | VM_GROWSUP
-				  | VM_GROWSDOWN));
-}
+static unsigned int ksm_unstable_nolock = 1;
+
+/* unstable tree merges done without the second mmap_sem */
+static unsigned long ksm_unstable_nolock_merges;
 
 /*
- * Called whenever a fresh new vma is created A new vma_slot.
- * is created and inserted into a global list Must be called.
- * after vma is inserted to its mm      		    .
+ * With ksm_compaction_aware, an unstable tree merge keeps as kpage whichever
+ * of the two pages sits in the pageblock compaction is least able to free.
  */
-inline void ksm_vma_add_new(struct vm_area_struct *vma)
+static unsigned int ksm_compaction_aware = 1;
+
+/* unstable tree merges that kept the tree page for its pageblock */
+static unsigned long ksm_merges_kept_tree;
+
+/**
+ * lock_tree_item_vma() - lock the anon_vma of @page if the vma of @item is
+ * still alive on it and maps @page at the item's address.
+ *
+ * @return	the locked anon_vma, NULL with *err set otherwise: -EBUSY if
+ *		the vma is going away, -EINVAL if the page mapping has changed.
+ */
+static struct anon_vma *lock_tree_item_vma(struct rmap_item *item,
+					   struct page *page, int *err)
 {
-	struct vma_slot *slot;
+	struct vma_slot *slot = item->slot;
+	struct vm_area_struct *vma = NULL;
+	struct anon_vma_chain *avc;
+	struct anon_vma *anon_vma;
 
-	if (!vma_can_enter(vma)) {
-		vma->ksm_vma_slot = NULL;
-		return;
+	*err = -EINVAL;
+	anon_vma = page_lock_anon_vma(page);
+	if (!anon_vma)
+		return NULL;
+
+	spin_lock(&slot->queue->lock);
+	if (list_empty(&slot->slot_list))
+		vma = slot->vma;
+	spin_unlock(&slot->queue->lock);
+
+	if (!vma) {
+		*err = -EBUSY;
+		goto out_unlock;
 	}
 
-	slot = alloc_vma_slot();
-	if (!slot) {
-		vma->ksm_vma_slot = NULL;
-		return;
+	list_for_each_entry(avc, &anon_vma->head, same_anon_vma)
+		if (avc->vma == vma)
+			break;
+
+	if (&avc->same_anon_vma == &anon_vma->head) {
+		*err = -EBUSY;
+		goto out_unlock;
 	}
 
-	vma->ksm_vma_slot = slot;
-	slot->vma = vma;
-	slot->mm = vma->vm_mm;
-	slot->ctime_j = jiffies;
-	slot->pages = vma_pages(vma);
-	spin_lock(&vma_slot_list_lock);
-	list_add_tail(&slot->slot_list, &vma_slot_new);
-	spin_unlock(&vma_slot_list_lock);
+	if (ksm_test_exit(vma->vm_mm) ||
+	    vma_page_address(page, vma) != get_rmap_addr(item))
+		goto out_unlock;
+
+	return anon_vma;
+
+out_unlock:
+	page_unlock_anon_vma(anon_vma);
+	return NULL;
 }
 
-/*
- * Called after vma is unlinked from its mm
- */
-void ksm_remove_vma(struct vm_area_struct *vma)
+/* return 0 on success with the item's page gotten, its mmap_sem untouched */
+static int get_mergeable_page_nolock(struct rmap_item *item)
 {
-	struct vma_slot *slot;
+	struct page *page = item->page;
+	struct anon_vma *anon_vma;
+	int err;
 
-	if (!vma->ksm_vma_slot)
-		return;
+	rcu_read_lock();
+	if (!get_page_unless_zero(page)) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	rcu_read_unlock();
 
-	slot = vma->ksm_vma_slot;
-	spin_lock(&vma_slot_list_lock);
-	if (list_empty(&slot->slot_list)) {
-		/**
-		 * This slot has been added by ksmd, so move to the del list
-		 * waiting ksmd to free it.
-		 */
-		list_add_tail(&slot->slot_list, &vma_slot_del);
-	} else {
-		/**
-		 * It's still on new list. It's ok to free slot directly.
-		 */
-		list_del(&slot->slot_list);
-		free_vma_slot(slot);
+	if (!PageAnon(page) || PageKsm(page)) {
+		put_page(page);
+		return -EINVAL;
 	}
-	spin_unlock(&vma_slot_list_lock);
-	vma->ksm_vma_slot = NULL;
-}
 
-/*   32/3 < they < 32/2 */
-#define shiftl	8
-#define shiftr	12
+	anon_vma = lock_tree_item_vma(item, page, &err);
+	if (!anon_vma) {
+		put_page(page);
+		return err;
+	}
+	page_unlock_anon_vma(anon_vma);
 
-#define HASH_FROM_TO(from, to) 				\
-for (index = from; index < to; index++) {		\
-	pos = random_nums[index];			\
-	hash += key[pos];				\
-	hash += (hash << shiftl);			\
-	hash ^= (hash >> shiftr);			\
+	return 0;
 }
 
+#define KSM_PTE_DIRTY	0x1
+#define KSM_PTE_YOUNG	0x2
+#define KSM_PTE_NONE	0x4	/* the page is not mapped by a pte there */
 
-#define HASH_FROM_DOWN_TO(from, to) 			\
-for (index = from - 1; index >= to; index--) {		\
-	hash ^= (hash >> shiftr);			\
-	hash ^= (hash >> (shiftr*2));			\
-	hash -= (hash << shiftl);			\
-	hash += (hash << (shiftl*2));			\
-	pos = random_nums[index];			\
-	hash -= key[pos];				\
+/*
+ * The young bits of the secondary MMUs, taken in one call for the pages of
+ * a scan batch, so that KVM walks them under one hold of its mmu_lock.
+ */
+#define KSM_YOUNG_RANGE_PAGES	512
+
+struct ksm_young_range {
+	unsigned long start, end;
+	DECLARE_BITMAP(young, KSM_YOUNG_RANGE_PAGES);
+};
+
+/* was the page at @addr young for the secondary MMUs? */
+static int secondary_young(struct mm_struct *mm, unsigned long addr,
+			   struct ksm_young_range *range)
+{
+	if (range && addr >= range->start && addr < range->end)
+		return test_bit((addr - range->start) >> PAGE_SHIFT,
+				range->young);
+	return mmu_notifier_clear_flush_young(mm, addr);
 }
 
 /*
- * The main random sample hash function.
+ * page_pte_test_and_clear() - test and clear the dirty and/or young bits,
+ * as asked by @mask, of the pte mapping @page at @addr.
+ *
+ * A dirty page is dirtied instead so that reclaim still writes it out, and
+ * the pte is flushed with the secondary MMUs told, so that a KVM guest
+ * writing the page faults and dirties the pte again. The young bit is not
+ * flushed from the TLB, like reclaim's aging, only the secondary MMUs are
+ * asked for theirs, or looked up in @range if they were asked already.
+ *
+ * @return the KSM_PTE_* bits found
  */
-static u32 random_sample_hash(void *addr, u32 hash_strength)
+static int page_pte_test_and_clear(struct vm_area_struct *vma,
+				   struct page *page, unsigned long addr,
+				   int mask, struct ksm_young_range *range)
 {
-	u32 hash = 0xdeadbeef;
-	int index, pos, loop = hash_strength;
-	u32 *key = (u32 *)addr;
+	struct mm_struct *mm = vma->vm_mm;
+	spinlock_t *ptl;
+	pte_t *ptep, entry;
+	int ret = 0;
 
-	if (loop > HASH_STRENGTH_FULL)
-		loop = HASH_STRENGTH_FULL;
+	ptep = page_check_address(page, mm, addr, &ptl, 0);
+	if (!ptep)
+		return KSM_PTE_NONE;
 
-	HASH_FROM_TO(0, loop);
+	if ((mask & KSM_PTE_DIRTY) && pte_dirty(*ptep)) {
+		flush_cache_page(vma, addr, page_to_pfn(page));
+		/* change_pte lets KVM write protect its spte, not zap it */
+		entry = ptep_clear_flush(vma, addr, ptep);
+		set_page_dirty(page);
+		set_pte_at_notify(mm, addr, ptep, pte_mkclean(entry));
+		ret |= KSM_PTE_DIRTY;
+	}
 
-	if (hash_strength > HASH_STRENGTH_FULL) {
-		loop = hash_strength - HASH_STRENGTH_FULL;
-		HASH_FROM_TO(0, loop);
+	if (mask & KSM_PTE_YOUNG) {
+		if (ptep_test_and_clear_young(vma, addr, ptep))
+			ret |= KSM_PTE_YOUNG;
+		if (secondary_young(mm, addr, range))
+			ret |= KSM_PTE_YOUNG;
 	}
 
-	return hash;
+	pte_unmap_unlock(ptep, ptl);
+	return ret;
 }
 
+/*
+ * rmap_item_pte_state() - the pte bits of a page about to be scanned, those
+ * the hash cache and the hot page check need.
+ */
+static int rmap_item_pte_state(struct rmap_item *item,
+			       struct ksm_young_range *range)
+{
+	int mask = 0;
+
+	if (ksm_hash_cache)
+		mask |= KSM_PTE_DIRTY;
+	if (ksm_hot_rounds)
+		mask |= KSM_PTE_YOUNG;
+	if (!mask)
+		return KSM_PTE_NONE;
 
-/**
- * It's used when hash strength is adjusted
- *
- * @addr The page's virtual address
- * @from The original hash strength
- * @to   The hash strength changed to
- * @hash The hash value generated with "from" hash value
+	return page_pte_test_and_clear(item->slot->vma, item->page,
+				       get_rmap_addr(item), mask, range);
+}
+
+/*
+ * rmap_item_hot() - count the visits in a row finding the page young and
+ * active. Being active alone is not enough: without memory pressure most
+ * pages end up and stay on the active list.
  *
- * return the hash value
+ * @return 1 if the page is hot and should not be merged now
  */
-static u32 delta_hash(void *addr, int from, int to, u32 hash)
+static int rmap_item_hot(struct rmap_item *item, int pte)
 {
-	u32 *key = (u32 *)addr;
-	int index, pos; /* make sure they are int type */
+	unsigned long young = (item->address & YOUNG_MASK) >> YOUNG_SHIFT;
 
-	if (to > from) {
-		if (from >= HASH_STRENGTH_FULL) {
-			from -= HASH_STRENGTH_FULL;
-			to -= HASH_STRENGTH_FULL;
-			HASH_FROM_TO(from, to);
-		} else if (to <= HASH_STRENGTH_FULL) {
-			HASH_FROM_TO(from, to);
-		} else {
-			HASH_FROM_TO(from, HASH_STRENGTH_FULL);
-			HASH_FROM_TO(0, to - HASH_STRENGTH_FULL);
-		}
+	if (!ksm_hot_rounds)
+		return 0;
+
+	if ((pte & KSM_PTE_YOUNG) && PageActive(item->page)) {
+		if (young < KSM_HOT_ROUNDS_MAX)
+			young++;
 	} else {
-		if (from <= HASH_STRENGTH_FULL) {
-			HASH_FROM_DOWN_TO(from, to);
-		} else if (to >= HASH_STRENGTH_FULL) {
-			from -= HASH_STRENGTH_FULL;
-			to -= HASH_STRENGTH_FULL;
-			HASH_FROM_DOWN_TO(from, to);
-		} else {
-			HASH_FROM_DOWN_TO(from - HASH_STRENGTH_FULL, 0);
-			HASH_FROM_DOWN_TO(HASH_STRENGTH_FULL, to);
-		}
+		young = 0;
 	}
 
-	return hash;
-}
+	item->address = (item->address & ~YOUNG_MASK) |
+			(young << YOUNG_SHIFT);
 
+	return young >= ksm_hot_rounds;
+}
 
-static inline u32 page_hash(struct page *page, unsigned long hash_strength,
-			    int cost_accounting)
+/*
+ * rmap_item_pinned() - if the page of @item is to be skipped as pinned. The
+ * scanner holds a reference of its own to the page, on top of its mappings.
+ */
+static int rmap_item_pinned(struct rmap_item *item)
 {
-	u32 val;
-	unsigned long tmp;
+	unsigned long level = (item->address & PIN_MASK) >> PIN_SHIFT;
+	unsigned long mix = (unsigned long)ksm_scan_round +
+			    (item->address >> PAGE_SHIFT);
+	struct page *page = item->page;
 
-	void *addr = kmap_atomic(page, KM_USER0);
+	if (!ksm_pin_backoff)
+		return 0;
 
-	val = random_sample_hash(addr, hash_strength);
-	kunmap_atomic(addr, KM_USER0);
+	/* backing off, skip it without looking */
+	if (level > 1 && (mix & ((1UL << (level - 1)) - 1)))
+		return 1;
 
-	if (cost_accounting) {
-		tmp = rshash_pos;
-		/* it's sucessfully identified by random sampling
-		 * hash, so increase the positive count.
-		 */
-		rshash_pos += (HASH_STRENGTH_FULL - hash_strength);
-		BUG_ON(tmp > rshash_pos);
+	if (PageTransCompound(page) ||
+	    page_mapcount(page) + 1 + PageSwapCache(page) == page_count(page)) {
+		level = 0;
+	} else {
+		if (level < KSM_PIN_LEVEL_MAX)
+			level++;
+		ksm_pin_failures++;
 	}
 
-	return val;
+	item->address = (item->address & ~PIN_MASK) | (level << PIN_SHIFT);
+
+	return level > 1;
 }
 
-static int memcmp_pages(struct page *page1, struct page *page2,
-			int cost_accounting)
+/*
+ * rmap_item_cached_hash() - get the hash of a page not written since its last
+ * visit from its rmap_item. A stale hash can only cost a missed merge, pages
+ * are always compared before being merged.
+ *
+ * @return 1 if *hash was set
+ */
+static int rmap_item_cached_hash(struct rmap_item *item, int pte, u32 *hash)
 {
-	char *addr1, *addr2;
-	int ret;
+	if (!ksm_hash_cache || (pte & (KSM_PTE_DIRTY | KSM_PTE_NONE)))
+		return 0;
 
-	addr1 = kmap_atomic(page1, KM_USER0);
-	addr2 = kmap_atomic(page2, KM_USER1);
-	ret = memcmp(addr1, addr2, PAGE_SIZE);
-	kunmap_atomic(addr2, KM_USER1);
-	kunmap_atomic(addr1, KM_USER0);
+	if (!(item->address & HASHED_FLAG) ||
+	    item->cached_strength != hash_strength)
+		return 0;
 
-	if (cost_accounting)
-		rshash_neg += memcmp_cost;
-
-	return ret;
+	*hash = item->cached_hash;
+	ksm_hash_cache_hits++;
+	return 1;
 }
 
-static inline int pages_identical(struct page *page1, struct page *page2)
+/*
+ * What kind of VMA is considered ?
+ */
+static inline int vma_is_shared_shmem(struct vm_area_struct *vma)
 {
-	return !memcmp_pages(page1, page2, 0);
+	return (vma->vm_flags & VM_SHARED) && vma->vm_file &&
+	       shmem_mapping(vma->vm_file->f_mapping);
 }
 
-static int write_protect_page(struct vm_area_struct *vma, struct page *page,
-			      pte_t *orig_pte, pte_t *old_pte)
+static inline int vma_can_enter(struct vm_area_struct *vma)
 {
-	struct mm_struct *mm = vma->vm_mm;
-	unsigned long addr;
-	pte_t *ptep;
-	spinlock_t *ptl;
-	int swapped;
-	int err = -EFAULT;
+	unsigned long shared = VM_SHARED | VM_MAYSHARE;
 
-	addr = page_address_in_vma(page, vma);
-	if (addr == -EFAULT)
-		goto out;
+	/* the whole mm opted out, see ksm_set_memory_merge() */
+	if (test_bit(MMF_VM_NOKSM, &vma->vm_mm->flags))
+		return 0;
 
-	BUG_ON(PageTransCompound(page));
-	ptep = page_check_address(page, mm, addr, &ptl, 0);
-	if (!ptep)
-		goto out;
+	if (vma_is_shared_shmem(vma))
+		shared = 0;
 
-	if (old_pte)
-		*old_pte = *ptep;
+	return !(vma->vm_flags & (VM_PFNMAP | VM_IO  | VM_DONTEXPAND |
+				  VM_RESERVED  | VM_HUGETLB | VM_INSERTPAGE |
+				  VM_NONLINEAR | VM_MIXEDMAP | VM_SAO |
+				  VM_GROWSUP | VM_GROWSDOWN | shared));
+}
 
-	if (pte_write(*ptep) || pte_dirty(*ptep)) {
-		pte_t entry;
+/*
+ * Create the vma_slots of @vma and queue them for ksmd. Called with the
+ * mmap_sem of its mm held.
+ *
+ * A vma bigger than ksm_region_pages gets one slot per region of that size,
+ * each one laddered on its own. They are all created, or none.
+ */
+static void ksm_vma_create_slots(struct vm_area_struct *vma,
+				 struct vma_slot *parent)
+{
+	struct vma_slot *slot, *head = NULL, **link = &head;
+	unsigned long start, pages, region = ksm_region_pages;
+	struct vma_slot_queue *queue;
+	struct scan_rung *rung;
 
-		swapped = PageSwapCache(page);
-		flush_cache_page(vma, addr, page_to_pfn(page));
-		/*
-		 * Ok this is tricky, when get_user_pages_fast() run it doesnt
-		 * take any lock, therefore the check that we are going to make
-		 * with the pagecount against the mapcount is racey and
-		 * O_DIRECT can happen right after the check.
-		 * So we clear the pte and flush the tlb before the check
-		 * this assure us that no O_DIRECT can happen after the check
-		 * or in the middle of the check.
-		 */
-		entry = ptep_clear_flush(vma, addr, ptep);
-		/*
-		 * Check that no O_DIRECT or similar I/O is in progress on the
-		 * page
-		 */
-		if (page_mapcount(page) + 1 + swapped != page_count(page)) {
-			set_pte_at(mm, addr, ptep, entry);
-			goto out_unlock;
+	if (!vma_can_enter(vma) || vma->ksm_advice == KSM_ADVICE_UNMERGEABLE)
+		return;
+
+	if (vma_is_shared_shmem(vma) && !ksm_shmem_zero)
+		return;
+
+	for (start = vma->vm_start; start < vma->vm_end;
+	     start += pages << PAGE_SHIFT) {
+		pages = min(region, (vma->vm_end - start) >> PAGE_SHIFT);
+
+		slot = alloc_vma_slot();
+		if (!slot)
+			goto fail;
+
+		slot->vma = vma;
+		slot->mm = vma->vm_mm;
+		slot->ctime_j = jiffies;
+		slot->vstart = start;
+		slot->pages = pages;
+
+		/* regions of the parent's, unless region_pages changed */
+		while (parent && parent->vstart < start)
+			parent = parent->next_region;
+		if (parent && parent->vstart == start &&
+		    parent->pages == pages) {
+			slot->forked = 1;
+			slot->dedup_ratio = parent->dedup_ratio;
+			slot->dedup_avg = parent->dedup_avg;
+			slot->strong_hash = parent->strong_hash;
+			if (slot->strong_hash)
+				ksm_strong_hash_slots++;
+			rung = ACCESS_ONCE(parent->rung);
+			if (rung)
+				slot->enter_rung = rung - ksm_scan_ladder + 1;
 		}
-		if (pte_dirty(entry))
-			set_page_dirty(page);
-		entry = pte_mkclean(pte_wrprotect(entry));
-		set_pte_at_notify(mm, addr, ptep, entry);
+		if (vma->ksm_advice != KSM_ADVICE_NONE)
+			slot->enter_rung = ksm_scan_ladder_size;
+		if (vma->ksm_advice == KSM_ADVICE_ONCE)
+			slot->once = 1;
+		*link = slot;
+		link = &slot->next_region;
 	}
-	*orig_pte = *ptep;
-	err = 0;
 
-out_unlock:
-	pte_unmap_unlock(ptep, ptl);
-out:
-	return err;
+	/* ksmd creates them under a read mmap_sem, others may look */
+	smp_wmb();
+	vma->ksm_vma_slot = head;
+	queue = &get_cpu_var(vma_slot_queues);
+	spin_lock(&queue->lock);
+	for (slot = head; slot; slot = slot->next_region) {
+		slot->queue = queue;
+		list_add_tail(&slot->slot_list, &queue->new);
+	}
+	spin_unlock(&queue->lock);
+	put_cpu_var(vma_slot_queues);
+	return;
+
+fail:
+	while (head) {
+		slot = head;
+		head = slot->next_region;
+		free_vma_slot(slot);
+	}
 }
 
-#define MERGE_ERR_PGERR		1 /* the page is invalid cannot continue */
-#define MERGE_ERR_COLLI		2 /* there is a collision */
-#define MERGE_ERR_CHANGED	3 /* the page has changed since last hash */
+/*
+ * Called whenever a fresh new vma is created. Must be called after vma is
+ * inserted to its mm. A vma split or moved from an old one keeps its age.
+ */
+inline void ksm_vma_add_new(struct vm_area_struct *vma)
+{
+	vma->ksm_vma_slot = NULL;
+	if (!vma->ksm_ctime_j)
+		vma->ksm_ctime_j = jiffies;
 
+	/* ksmd creates the slots once it's old enough */
+	if (ksm_slot_min_age)
+		return;
 
-/**
- * replace_page - replace page in vma by new ksm page
- * @vma:      vma that holds the pte pointing to page
- * @page:     the page we are replacing by kpage
- * @kpage:    the ksm page we replace page by
- * @orig_pte: the original value of the pte
- *
- * Returns 0 on success, MERGE_ERR_PGERR on failure.
+	ksm_vma_create_slots(vma, NULL);
+}
+
+/*
+ * Called by fork for the copy @vma of the parent's @parent, with the
+ * mmap_sem of both mms held for write.
  */
-static int replace_page(struct vm_area_struct *vma, struct page *page,
-			struct page *kpage, pte_t orig_pte)
+void ksm_vma_add_forked(struct vm_area_struct *vma,
+			struct vm_area_struct *parent)
 {
-	struct mm_struct *mm = vma->vm_mm;
-	pgd_t *pgd;
-	pud_t *pud;
-	pmd_t *pmd;
-	pte_t *ptep;
-	spinlock_t *ptl;
-	unsigned long addr;
-	int err = MERGE_ERR_PGERR;
+	if (!ksm_fork_inherit || !parent->ksm_vma_slot) {
+		/* the child's vma starts young, it's likely to exec soon */
+		vma->ksm_ctime_j = 0;
+		ksm_vma_add_new(vma);
+		return;
+	}
 
-	addr = page_address_in_vma(page, vma);
-	if (addr == -EFAULT)
-		goto out;
+	vma->ksm_vma_slot = NULL;
+	ksm_vma_create_slots(vma, parent->ksm_vma_slot);
+}
 
-	pgd = pgd_offset(mm, addr);
-	if (!pgd_present(*pgd))
-		goto out;
+/*
+ * ksm_vma_moved() - called by mremap, with the mmap_sem held for write, when
+ * [@old_addr, @old_addr + @len) of @vma is about to move to @new_addr of
+ * @new_vma. Its KSM pages are not broken: they stay mapped, merged, and the
+ * rmap_items of @vma's slots go when the old range is unmapped. The slots
+ * of @new_vma reach those pages again as soon as they are scanned, so they
+ * are created now and enter at the rung @vma's had climbed to, not at the
+ * bottom where the pages would wait the longest.
+ */
+void ksm_vma_moved(struct vm_area_struct *vma, unsigned long old_addr,
+		   struct vm_area_struct *new_vma, unsigned long new_addr,
+		   unsigned long len)
+{
+	struct vma_slot *slot, *old;
+	struct vma_slot_queue *queue;
+	struct scan_rung *rung;
+	unsigned long start;
 
-	pud = pud_offset(pgd, addr);
-	if (!pud_present(*pud))
-		goto out;
+	if (!vma->ksm_vma_slot)
+		return;
+	if (!new_vma->ksm_vma_slot)
+		ksm_vma_create_slots(new_vma, NULL);
+	if (!new_vma->ksm_vma_slot)
+		return;
 
-	pmd = pmd_offset(pud, addr);
-	BUG_ON(pmd_trans_huge(*pmd));
-	if (!pmd_present(*pmd))
-		goto out;
+	queue = new_vma->ksm_vma_slot->queue;
+	spin_lock(&queue->lock);
+	for (slot = new_vma->ksm_vma_slot; slot; slot = slot->next_region) {
+		if (slot_end(slot) <= new_addr || slot->vstart >= new_addr + len)
+			continue;
+		/* ksmd has taken it already */
+		if (list_empty(&slot->slot_list))
+			continue;
 
-	ptep = pte_offset_map_lock(mm, pmd, addr, &ptl);
-	if (!pte_same(*ptep, orig_pte)) {
-		pte_unmap_unlock(ptep, ptl);
-		goto out;
+		start = max(slot->vstart, new_addr);
+		old = ksm_vma_region(vma, start - new_addr + old_addr);
+		rung = ACCESS_ONCE(old->rung);
+		if (rung && rung - ksm_scan_ladder + 1 > slot->enter_rung)
+			slot->enter_rung = rung - ksm_scan_ladder + 1;
 	}
+	spin_unlock(&queue->lock);
+}
 
-	get_page(kpage);
-	page_add_anon_rmap(kpage, vma, addr);
+/*
+ * ksm_madvise() - called by madvise() with the mmap_sem held for write, on
+ * a @vma already split to the advised range. The slots are created again
+ * for the new advice, at once: an advised vma does not wait slot_min_age.
+ */
+int ksm_madvise(struct vm_area_struct *vma, int advice)
+{
+	int err = 0;
 
-	flush_cache_page(vma, addr, pte_pfn(*ptep));
-	ptep_clear_flush(vma, addr, ptep);
-	set_pte_at_notify(mm, addr, ptep, mk_pte(kpage, vma->vm_page_prot));
+	ksm_remove_vma(vma);
 
-	page_remove_rmap(page);
-	if (!page_mapped(page))
-		try_to_free_swap(page);
-	put_page(page);
+	switch (advice) {
+	case MADV_MERGEABLE:
+		vma->ksm_advice = KSM_ADVICE_MERGEABLE;
+		break;
+	case MADV_MERGE_ONCE:
+		vma->ksm_advice = KSM_ADVICE_ONCE;
+		break;
+	case MADV_UNMERGEABLE:
+		vma->ksm_advice = KSM_ADVICE_UNMERGEABLE;
+		if (vma->anon_vma)
+			err = unmerge_ksm_pages(vma, vma->vm_start,
+						vma->vm_end);
+		return err;
+	}
 
-	pte_unmap_unlock(ptep, ptl);
-	err = 0;
-out:
+	ksm_vma_create_slots(vma, NULL);
 	return err;
 }
 
-
-/**
- *  Fully hash a page with HASH_STRENGTH_MAX return a non-zero hash value. The
- *  zero hash value at HASH_STRENGTH_MAX is used to indicated that its
- *  hash_max member has not been calculated.
- *
- * @page The page needs to be hashed
- * @hash_old The hash value calculated with current hash strength
- *
- * return the new hash value calculated at HASH_STRENGTH_MAX
+/*
+ * ksm_set_memory_merge() - prctl(PR_SET_MEMORY_MERGE). With @merge 0, drop
+ * the slots of every vma of @mm and unmerge its pages: ksmd takes neither
+ * its mmap_sem nor its ptes anymore. With 1, its vmas get slots again.
  */
-static inline u32 page_hash_max(struct page *page, u32 hash_old)
+int ksm_set_memory_merge(struct mm_struct *mm, int merge)
 {
-	u32 hash_max = 0;
-	void *addr;
-
-	addr = kmap_atomic(page, KM_USER0);
-	hash_max = delta_hash(addr, hash_strength,
-			      HASH_STRENGTH_MAX, hash_old);
-
-	kunmap_atomic(addr, KM_USER0);
+	struct vm_area_struct *vma;
+	int err = 0;
 
-	if (!hash_max)
-		hash_max = 1;
+	down_write(&mm->mmap_sem);
+	if (merge) {
+		clear_bit(MMF_VM_NOKSM, &mm->flags);
+		for (vma = mm->mmap; vma; vma = vma->vm_next)
+			if (!vma->ksm_vma_slot)
+				ksm_vma_add_new(vma);
+		goto out;
+	}
 
-	rshash_neg += (HASH_STRENGTH_MAX - hash_strength);
-	return hash_max;
+	set_bit(MMF_VM_NOKSM, &mm->flags);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		ksm_remove_vma(vma);
+		if (!err && vma->anon_vma)
+			err = unmerge_ksm_pages(vma, vma->vm_start,
+						vma->vm_end);
+	}
+out:
+	up_write(&mm->mmap_sem);
+	return err;
 }
 
-/*
- * We compare the hash again, to ensure that it is really a hash collision
- * instead of being caused by page write.
- */
-static inline int check_collision(struct rmap_item *rmap_item,
-				  u32 hash)
+static void ksm_discover_mm(struct mm_struct *mm, unsigned long age)
 {
-	int err;
-	unsigned long tmp;
-	struct page *page = rmap_item->page;
+	struct vm_area_struct *vma;
 
-	/* if this rmap_item has already been hash_maxed, then the collision
-	 * must appears in the second-level rbtree search. In this case we check
-	 * if its hash_max value has been changed. Otherwise, the collision
-	 * happens in the first-level rbtree search, so we check against it's
-	 * current hash value.
-	 */
-	if (rmap_item->hash_max) {
-		tmp = rshash_neg;
-		rshash_neg += memcmp_cost;
-		rshash_neg += (HASH_STRENGTH_MAX - hash_strength);
-		BUG_ON(tmp > rshash_neg);
+	if (!down_read_trylock(&mm->mmap_sem))
+		return;
 
-		if (rmap_item->hash_max == page_hash_max(page, hash))
-			err = MERGE_ERR_COLLI;
-		else
-			err = MERGE_ERR_CHANGED;
-	} else {
-		tmp = rshash_neg;
-		rshash_neg += memcmp_cost + hash_strength;
-		BUG_ON(tmp > rshash_neg);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->ksm_vma_slot || !vma_can_enter(vma) ||
+		    time_before(jiffies, vma->ksm_ctime_j + age))
+			continue;
 
-		if (page_hash(page, hash_strength, 0) == hash)
-			err = MERGE_ERR_COLLI;
-		else
-			err = MERGE_ERR_CHANGED;
+		ksm_vma_create_slots(vma, NULL);
+		if (vma->ksm_vma_slot)
+			ksm_slots_discovered++;
 	}
 
-	return err;
+	up_read(&mm->mmap_sem);
 }
 
-static struct page *page_trans_compound_anon(struct page *page)
+/*
+ * Walk all the mms and create the slots of the vmas that have lived
+ * ksm_slot_min_age. Runs every half of that age, so a vma waits at most
+ * 1.5 times it. Processes are walked by pid, which needs no lock held
+ * across the mms.
+ */
+static void ksm_discover_vmas(void)
 {
-	if (PageTransCompound(page)) {
-		struct page *head = compound_trans_head(page);
-		/*
-		 * head may actually be splitted and freed from under
-		 * us but it's ok here.
-		 */
-		if (PageAnon(head))
-			return head;
+	unsigned long age = msecs_to_jiffies(ksm_slot_min_age);
+	struct task_struct *task;
+	struct mm_struct *mm;
+	struct pid *pid;
+	int nr = 1;
+
+	if (!age && !ksm_discover_pending)
+		return;
+	if (age && time_before(jiffies, ksm_discover_last + age / 2))
+		return;
+	ksm_discover_last = jiffies;
+	ksm_discover_pending = 0;
+
+	for (;;) {
+		mm = NULL;
+		rcu_read_lock();
+		pid = find_ge_pid(nr, &init_pid_ns);
+		if (pid) {
+			nr = pid_nr(pid) + 1;
+			task = pid_task(pid, PIDTYPE_PID);
+			if (task && thread_group_leader(task))
+				mm = get_task_mm(task);
+		}
+		rcu_read_unlock();
+
+		if (!pid)
+			break;
+		if (!mm)
+			continue;
+
+		ksm_discover_mm(mm, age);
+		mmput(mm);
+		cond_resched();
 	}
-	return NULL;
 }
 
-static int page_trans_compound_anon_split(struct page *page)
+/*
+ * Called after vma is unlinked from its mm
+ */
+void ksm_remove_vma(struct vm_area_struct *vma)
 {
-	int ret = 0;
-	struct page *transhuge_head = page_trans_compound_anon(page);
-	if (transhuge_head) {
-		/* Get the reference on the head to split it. */
-		if (get_page_unless_zero(transhuge_head)) {
-			/*
-			 * Recheck we got the reference while the head
-			 * was still anonymous.
+	struct vma_slot *slot, *next;
+	struct vma_slot_queue *queue;
+
+	if (!vma->ksm_vma_slot)
+		return;
+
+	/* the regions of a vma are all queued together */
+	queue = vma->ksm_vma_slot->queue;
+	spin_lock(&queue->lock);
+	for (slot = vma->ksm_vma_slot; slot; slot = next) {
+		next = slot->next_region;
+		if (list_empty(&slot->slot_list)) {
+			/**
+			 * This slot has been added by ksmd, so move to the
+			 * del list waiting ksmd to free it.
 			 */
-			if (PageAnon(transhuge_head))
-				ret = split_huge_page(transhuge_head);
-			else
-				/*
-				 * Retry later if split_huge_page run
-				 * from under us.
-				 */
-				ret = 1;
-			put_page(transhuge_head);
-		} else
-			/* Retry later if split_huge_page run from under us. */
-			ret = 1;
+			list_add_tail(&slot->slot_list, &queue->del);
+		} else if (slot->excluded) {
+			/* ksm_slot_del_work frees it with its rmap_items */
+			slot->excluded = 2;
+		} else {
+			/**
+			 * It's still on new list. It's ok to free slot
+			 * directly.
+			 */
+			list_del(&slot->slot_list);
+			free_vma_slot(slot);
+		}
 	}
-	return ret;
+	spin_unlock(&queue->lock);
+	vma->ksm_vma_slot = NULL;
 }
 
-/**
- * Try to merge a rmap_item.page with a kpage in stable node. kpage must
- * already be a ksm page.
- *
- * @return 0 if the pages were merged, -EFAULT otherwise.
- */
-static int try_to_merge_with_ksm_page(struct rmap_item *rmap_item,
-				      struct page *kpage, u32 hash)
-{
-	struct vm_area_struct *vma = rmap_item->slot->vma;
-	struct mm_struct *mm = vma->vm_mm;
-	pte_t orig_pte = __pte(0);
-	int err = MERGE_ERR_PGERR;
-	struct page *page;
+/*   32/3 < they < 32/2 */
+#define shiftl	8
+#define shiftr	12
 
-	if (ksm_test_exit(mm))
-		goto out;
+#define HASH_FROM_TO(from, to) 				\
+for (index = from; index < to; index++) {		\
+	pos = random_nums[index];			\
+	hash += key[pos];				\
+	hash += (hash << shiftl);			\
+	hash ^= (hash >> shiftr);			\
+}
 
-	page = rmap_item->page;
 
-	if (page == kpage) { /* ksm page forked */
-		err = 0;
-		goto out;
-	}
+#define HASH_FROM_DOWN_TO(from, to) 			\
+for (index = from - 1; index >= to; index--) {		\
+	hash ^= (hash >> shiftr);			\
+	hash ^= (hash >> (shiftr*2));			\
+	hash -= (hash << shiftl);			\
+	hash += (hash << (shiftl*2));			\
+	pos = random_nums[index];			\
+	hash -= key[pos];				\
+}
 
-	if (PageTransCompound(page) && page_trans_compound_anon_split(page))
-		goto out;
-	BUG_ON(PageTransCompound(page));
+#ifdef CONFIG_X86
+#define HASH_FROM_TO_CRC32C(from, to)			\
+for (index = from; index < to; index++) {		\
+	pos = random_nums[index];			\
+	hash = ksm_crc32c_u32(hash, key[pos]);		\
+}
 
-	if (!PageAnon(page) || !PageKsm(kpage))
-		goto out;
+static u32 random_sample_hash_crc32c(void *addr, u32 hash_strength)
+{
+	u32 hash = 0xdeadbeef;
+	int index, pos, loop = hash_strength;
+	u32 *key = (u32 *)addr;
 
-	/*
-	 * We need the page lock to read a stable PageSwapCache in
-	 * write_protect_page().  We use trylock_page() instead of
-	 * lock_page() because we don't want to wait here - we
-	 * prefer to continue scanning and merging different pages,
-	 * then come back to this page when it is unlocked.
-	 */
-	if (!trylock_page(page))
-		goto out;
-	/*
-	 * If this anonymous page is mapped only here, its pte may need
-	 * to be write-protected.  If it's mapped elsewhere, all of its
-	 * ptes are necessarily already write-protected.  But in either
-	 * case, we need to lock and check page_count is not raised.
-	 */
-	if (write_protect_page(vma, page, &orig_pte, NULL) == 0) {
-		if (!kpage) {
-			long map_sharing = atomic_read(&page->_mapcount);
-			/*
-			 * While we hold page lock, upgrade page from
-			 * PageAnon+anon_vma to PageKsm+NULL stable_node:
-			 * stable_tree_insert() will update stable_node.
-			 */
-			set_page_stable_node(page, NULL);
-			if (map_sharing)
-				add_zone_page_state(page_zone(page),
-						    NR_KSM_PAGES_SHARING,
-						    map_sharing);
-			mark_page_accessed(page);
-			err = 0;
-		} else {
-			if (pages_identical(page, kpage))
-				err = replace_page(vma, page, kpage, orig_pte);
-			else
-				err = check_collision(rmap_item, hash);
-		}
-	}
+	if (loop > HASH_STRENGTH_FULL)
+		loop = HASH_STRENGTH_FULL;
 
-	if ((vma->vm_flags & VM_LOCKED) && kpage && !err) {
-		munlock_vma_page(page);
-		if (!PageMlocked(kpage)) {
-			unlock_page(page);
-			lock_page(kpage);
-			mlock_vma_page(kpage);
-			page = kpage;		/* for final unlock */
-		}
+	HASH_FROM_TO_CRC32C(0, loop);
+
+	if (hash_strength > HASH_STRENGTH_FULL) {
+		loop = hash_strength - HASH_STRENGTH_FULL;
+		HASH_FROM_TO_CRC32C(0, loop);
 	}
 
-	unlock_page(page);
-out:
-	return err;
+	return hash;
 }
 
+static u32 delta_hash_crc32c(void *addr, int from, int to, u32 hash)
+{
+	u32 *key = (u32 *)addr;
+	int index, pos;
 
+	if (to <= from)
+		return random_sample_hash_crc32c(addr, to);
 
-/**
- * If two pages fail to merge in try_to_merge_two_pages, then we have a chance
- * to restore a page mapping that has been changed in try_to_merge_two_pages.
- *
- * @return 0 on success.
+	if (from >= HASH_STRENGTH_FULL) {
+		HASH_FROM_TO_CRC32C(from - HASH_STRENGTH_FULL,
+				    to - HASH_STRENGTH_FULL);
+	} else if (to <= HASH_STRENGTH_FULL) {
+		HASH_FROM_TO_CRC32C(from, to);
+	} else {
+		HASH_FROM_TO_CRC32C(from, HASH_STRENGTH_FULL);
+		HASH_FROM_TO_CRC32C(0, to - HASH_STRENGTH_FULL);
+	}
+
+	return hash;
+}
+#endif
+
+/*
+ * The main random sample hash function.
  */
-static int restore_ksm_page_pte(struct vm_area_struct *vma, unsigned long addr,
-			     pte_t orig_pte, pte_t wprt_pte)
+static u32 random_sample_hash(void *addr, u32 hash_strength)
 {
-	struct mm_struct *mm = vma->vm_mm;
-	pgd_t *pgd;
-	pud_t *pud;
-	pmd_t *pmd;
-	pte_t *ptep;
-	spinlock_t *ptl;
-
-	int err = -EFAULT;
+	u32 hash = 0xdeadbeef;
+	int index, pos, loop = hash_strength;
+	u32 *key = (u32 *)addr;
 
-	pgd = pgd_offset(mm, addr);
-	if (!pgd_present(*pgd))
-		goto out;
+#ifdef CONFIG_X86
+	if (ksm_hash_crc32c)
+		return random_sample_hash_crc32c(addr, hash_strength);
+#endif
 
-	pud = pud_offset(pgd, addr);
-	if (!pud_present(*pud))
-		goto out;
+	if (loop > HASH_STRENGTH_FULL)
+		loop = HASH_STRENGTH_FULL;
 
-	pmd = pmd_offset(pud, addr);
-	if (!pmd_present(*pmd))
-		goto out;
+	HASH_FROM_TO(0, loop);
 
-	ptep = pte_offset_map_lock(mm, pmd, addr, &ptl);
-	if (!pte_same(*ptep, wprt_pte)) {
-		/* already copied, let it be */
-		pte_unmap_unlock(ptep, ptl);
-		goto out;
+	if (hash_strength > HASH_STRENGTH_FULL) {
+		loop = hash_strength - HASH_STRENGTH_FULL;
+		HASH_FROM_TO(0, loop);
 	}
 
-	/*
-	 * Good boy, still here. When we still get the ksm page, it does not
-	 * return to the free page pool, there is no way that a pte was changed
-	 * to other page and gets back to this page. And remind that ksm page
-	 * do not reuse in do_wp_page(). So it's safe to restore the original
-	 * pte.
-	 */
-	flush_cache_page(vma, addr, pte_pfn(*ptep));
-	ptep_clear_flush(vma, addr, ptep);
-	set_pte_at_notify(mm, addr, ptep, orig_pte);
-
-	pte_unmap_unlock(ptep, ptl);
-	err = 0;
-out:
-	return err;
+	return hash;
 }
 
+
 /**
- * try_to_merge_two_pages() - take two identical pages and prepare
- * them to be merged into one page(rmap_item->page)
+ * It's used when hash strength is adjusted
  *
- * @return 0 if we successfully merged two identical pages into
- *         one ksm page. MERGE_ERR_COLLI if it's only a hash collision
- *         search in rbtree. MERGE_ERR_CHANGED if rmap_item has been
- *         changed since it's hashed. MERGE_ERR_PGERR otherwise.
+ * @addr The page's virtual address
+ * @from The original hash strength
+ * @to   The hash strength changed to
+ * @hash The hash value generated with "from" hash value
  *
+ * return the hash value
  */
-static int try_to_merge_two_pages(struct rmap_item *rmap_item,
-				  struct rmap_item *tree_rmap_item,
-				  u32 hash)
+static u32 delta_hash(void *addr, int from, int to, u32 hash)
 {
-	pte_t orig_pte1 = __pte(0), orig_pte2 = __pte(0);
-	pte_t wprt_pte1 = __pte(0), wprt_pte2 = __pte(0);
-	struct vm_area_struct *vma1 = rmap_item->slot->vma;
-	struct vm_area_struct *vma2 = tree_rmap_item->slot->vma;
-	struct page *page = rmap_item->page;
-	struct page *tree_page = tree_rmap_item->page;
-	int err = MERGE_ERR_PGERR;
+	u32 *key = (u32 *)addr;
+	int index, pos; /* make sure they are int type */
 
-	long map_sharing;
-	struct address_space *saved_mapping;
+#ifdef CONFIG_X86
+	if (ksm_hash_crc32c)
+		return delta_hash_crc32c(addr, from, to, hash);
+#endif
 
+	if (to > from) {
+		if (from >= HASH_STRENGTH_FULL) {
+			from -= HASH_STRENGTH_FULL;
+			to -= HASH_STRENGTH_FULL;
+			HASH_FROM_TO(from, to);
+		} else if (to <= HASH_STRENGTH_FULL) {
+			HASH_FROM_TO(from, to);
+		} else {
+			HASH_FROM_TO(from, HASH_STRENGTH_FULL);
+			HASH_FROM_TO(0, to - HASH_STRENGTH_FULL);
+		}
+	} else {
+		if (from <= HASH_STRENGTH_FULL) {
+			HASH_FROM_DOWN_TO(from, to);
+		} else if (to >= HASH_STRENGTH_FULL) {
+			from -= HASH_STRENGTH_FULL;
+			to -= HASH_STRENGTH_FULL;
+			HASH_FROM_DOWN_TO(from, to);
+		} else {
+			HASH_FROM_DOWN_TO(from - HASH_STRENGTH_FULL, 0);
+			HASH_FROM_DOWN_TO(HASH_STRENGTH_FULL, to);
+		}
+	}
 
-	if (rmap_item->page == tree_rmap_item->page)
-		goto out;
+	return hash;
+}
 
-	if (PageTransCompound(page) && page_trans_compound_anon_split(page))
-		goto out;
-	BUG_ON(PageTransCompound(page));
-
-	if (PageTransCompound(tree_page) && page_trans_compound_anon_split(tree_page))
-		goto out;
-	BUG_ON(PageTransCompound(tree_page));
-
-	if (!PageAnon(page) || !PageAnon(tree_page))
-		goto out;
 
-	if (!trylock_page(page))
-		goto out;
+/*
+ * Without highmem every page is in the direct map, and the pages hashed or
+ * compared are read through it: no kmap slot is held, so a whole batch can
+ * be in flight at once, see page_hash_batch().
+ */
+#ifdef CONFIG_HIGHMEM
+#define KSM_DIRECT_MAP	0
+#else
+#define KSM_DIRECT_MAP	1
+#endif
 
+static inline void *ksm_map_page(struct page *page, enum km_type type)
+{
+#ifdef CONFIG_HIGHMEM
+	return kmap_atomic(page, type);
+#else
+	return page_address(page);
+#endif
+}
 
-	if (write_protect_page(vma1, page, &wprt_pte1, &orig_pte1) != 0) {
-		unlock_page(page);
-		goto out;
-	}
+static inline void ksm_unmap_page(void *addr, enum km_type type)
+{
+#ifdef CONFIG_HIGHMEM
+	kunmap_atomic(addr, type);
+#endif
+}
 
-	/*
-	 * While we hold page lock, upgrade page from
-	 * PageAnon+anon_vma to PageKsm+NULL stable_node:
-	 * stable_tree_insert() will update stable_node.
-	 */
-	saved_mapping = page->mapping;
-	map_sharing = atomic_read(&page->_mapcount);
-	set_page_stable_node(page, NULL);
-	if (map_sharing)
-		add_zone_page_state(page_zone(page),
-				    NR_KSM_PAGES_SHARING,
-				    map_sharing);
-	mark_page_accessed(page);
-	unlock_page(page);
+/* the pages random_sample_hash_lanes() hashes side by side */
+#define KSM_HASH_LANES	4
 
-	if (!trylock_page(tree_page))
-		goto restore_out;
+static inline void hash_lanes_from_to(u32 **keys, u32 *hash, int nr,
+				      int from, int to)
+{
+	int index, pos, i;
 
-	if (write_protect_page(vma2, tree_page, &wprt_pte2, &orig_pte2) != 0) {
-		unlock_page(tree_page);
-		goto restore_out;
+#ifdef CONFIG_X86
+	if (ksm_hash_crc32c) {
+		for (index = from; index < to; index++) {
+			pos = random_nums[index];
+			for (i = 0; i < nr; i++)
+				hash[i] = ksm_crc32c_u32(hash[i], keys[i][pos]);
+		}
+		return;
 	}
+#endif
 
-	if (pages_identical(page, tree_page)) {
-		err = replace_page(vma2, tree_page, page, wprt_pte2);
-		if (err)
-			goto restore_out;
-
-		if ((vma2->vm_flags & VM_LOCKED)) {
-			munlock_vma_page(tree_page);
-			if (!PageMlocked(page)) {
-				unlock_page(tree_page);
-				lock_page(page);
-				mlock_vma_page(page);
-				tree_page = page; /* for final unlock */
-			}
+	for (index = from; index < to; index++) {
+		pos = random_nums[index];
+		for (i = 0; i < nr; i++) {
+			hash[i] += keys[i][pos];
+			hash[i] += (hash[i] << shiftl);
+			hash[i] ^= (hash[i] >> shiftr);
 		}
+	}
+}
 
-		unlock_page(tree_page);
+/*
+ * random_sample_hash_lanes() - random_sample_hash() of up to KSM_HASH_LANES
+ * pages, one sample of each page after the other, so that the cache misses
+ * of the pages overlap instead of being waited for page after page.
+ */
+static void random_sample_hash_lanes(u32 **keys, u32 *hashes, int nr,
+				     u32 hash_strength)
+{
+	u32 hash[KSM_HASH_LANES];
+	int i, loop = hash_strength;
 
-		goto out; /* success */
+	for (i = 0; i < nr; i++)
+		hash[i] = 0xdeadbeef;
 
-	} else {
-		if (page_hash(page, hash_strength, 0) ==
-		    page_hash(tree_page, hash_strength, 0)) {
-			rshash_neg += memcmp_cost + hash_strength * 2;
-			err = MERGE_ERR_COLLI;
-		} else
-			err = MERGE_ERR_CHANGED;
+	if (loop > HASH_STRENGTH_FULL)
+		loop = HASH_STRENGTH_FULL;
 
-		unlock_page(tree_page);
-	}
+	hash_lanes_from_to(keys, hash, nr, 0, loop);
 
-restore_out:
-	lock_page(page);
-	if (!restore_ksm_page_pte(vma1, get_rmap_addr(rmap_item),
-				  orig_pte1, wprt_pte1))
-		page->mapping = saved_mapping;
+	if (hash_strength > HASH_STRENGTH_FULL)
+		hash_lanes_from_to(keys, hash, nr, 0,
+				   hash_strength - HASH_STRENGTH_FULL);
 
-	unlock_page(page);
-out:
-	return err;
+	for (i = 0; i < nr; i++)
+		hashes[i] = hash[i];
 }
 
-static inline int hash_cmp(u32 new_val, u32 node_val)
+static inline u32 page_hash(struct page *page, unsigned long hash_strength,
+			    int cost_accounting)
 {
-	if (new_val > node_val)
-		return 1;
-	else if (new_val < node_val)
-		return -1;
-	else
-		return 0;
+	u32 val;
+	unsigned long tmp;
+
+	void *addr = ksm_map_page(page, KM_USER0);
+
+	val = random_sample_hash(addr, hash_strength);
+	ksm_unmap_page(addr, KM_USER0);
+
+	if (cost_accounting) {
+		tmp = rshash_pos;
+		/* it's sucessfully identified by random sampling
+		 * hash, so increase the positive count.
+		 */
+		rshash_pos += (HASH_STRENGTH_FULL - hash_strength);
+		BUG_ON(tmp > rshash_pos);
+	}
+
+	return val;
 }
 
-static inline u32 rmap_item_hash_max(struct rmap_item *item, u32 hash)
+static int memcmp_pages(struct page *page1, struct page *page2,
+			int cost_accounting)
 {
-	u32 hash_max = item->hash_max;
+	char *addr1, *addr2;
+	int ret;
 
-	if (!hash_max) {
-		hash_max = page_hash_max(item->page, hash);
+	addr1 = ksm_map_page(page1, KM_USER0);
+	addr2 = ksm_map_page(page2, KM_USER1);
+	ret = ksm_memcmp_page(addr1, addr2);
+	ksm_unmap_page(addr2, KM_USER1);
+	ksm_unmap_page(addr1, KM_USER0);
 
-		item->hash_max = hash_max;
-	}
+	if (cost_accounting)
+		rshash_neg += memcmp_cost;
 
-	return hash_max;
+	return ret;
 }
 
+static inline int pages_identical(struct page *page1, struct page *page2)
+{
+	return !memcmp_pages(page1, page2, 0);
+}
 
+/*
+ * With strong_digest set, a page merged into a ksm page is compared by a
+ * SHA-1 digest, truncated to 128 bits, with the one kept in the stable node
+ * since it was first needed: the ksm page itself is not read again, which
+ * saves a remote or cold read of it. Hashing a page costs more cpu than a
+ * memcmp, and a crafted collision would merge different pages, so this is
+ * only for trusted single-tenant hosts. Merges in the unstable tree are
+ * always compared by memcmp.
+ */
+static unsigned int ksm_strong_digest;
+static struct crypto_ahash *ksm_digest_tfm;
+static unsigned long ksm_digest_compares;
 
-/**
- * stable_tree_search() - search the stable tree for a page
- *
- * @item: 	the rmap_item we are comparing with
- * @hash: 	the hash value of this item->page already calculated
- *
- * @return 	the page we have found, NULL otherwise. The page returned has
- *         	been gotten.
+/*
+ * The digests go through the async hash API: the "sha1" provider of the
+ * highest priority is a hardware engine when the host has one, ksmd sleeps
+ * while it works. Up to two are in flight together. The sampled hashes of
+ * the scan have no engine to go to and stay on the cpu.
  */
-static struct page *stable_tree_search(struct rmap_item *item, u32 hash)
+struct ksm_digest_req {
+	struct ahash_request *req;
+	struct scatterlist sg;
+	struct completion done;
+	u8 out[SHA1_DIGEST_SIZE];
+	int err;
+};
+
+static void ksm_digest_done(struct crypto_async_request *areq, int err)
 {
-	struct rb_node *node = root_stable_treep->rb_node;
-	struct tree_node *tree_node;
-	unsigned long hash_max;
-	struct page *page = item->page;
-	struct stable_node *stable_node;
+	struct ksm_digest_req *dreq = areq->data;
 
-	stable_node = page_stable_node(page);
-	if (stable_node) {
-		/* ksm page forked, that is
-		 * if (PageKsm(page) && !in_stable_tree(rmap_item))
-		 * it's actually gotten once outside.
-		 */
-		get_page(page);
-		return page;
-	}
+	if (err == -EINPROGRESS)
+		return;
 
-	while (node) {
-		int cmp;
+	dreq->err = err;
+	complete(&dreq->done);
+}
 
-		tree_node = rb_entry(node, struct tree_node, node);
+/*
+ * pages_digest() - the digests of the @nr pages into @digests, 0 or -errno.
+ * Sleeps, with no spinlock held.
+ */
+static int pages_digest(struct page **pages, u64 (*digests)[2], int nr)
+{
+	struct ksm_digest_req dreqs[2];
+	struct ksm_digest_req *dreq;
+	int i, err = 0;
 
-		cmp = hash_cmp(hash, tree_node->hash);
+	BUG_ON(nr > ARRAY_SIZE(dreqs));
 
-		if (cmp < 0)
-			node = node->rb_left;
-		else if (cmp > 0)
-			node = node->rb_right;
-		else
+	for (i = 0; i < nr; i++) {
+		dreq = &dreqs[i];
+		dreq->req = ahash_request_alloc(ksm_digest_tfm, GFP_NOWAIT);
+		if (!dreq->req) {
+			err = -ENOMEM;
 			break;
-	}
-
-	if (!node)
-		return NULL;
-
-	if (tree_node->count == 1) {
-		stable_node = rb_entry(tree_node->sub_root.rb_node,
-				       struct stable_node, node);
-		BUG_ON(!stable_node);
+		}
 
-		goto get_page_out;
+		init_completion(&dreq->done);
+		sg_init_table(&dreq->sg, 1);
+		sg_set_page(&dreq->sg, pages[i], PAGE_SIZE, 0);
+		ahash_request_set_callback(dreq->req,
+					   CRYPTO_TFM_REQ_MAY_BACKLOG,
+					   ksm_digest_done, dreq);
+		ahash_request_set_crypt(dreq->req, &dreq->sg, dreq->out,
+					PAGE_SIZE);
+
+		dreq->err = crypto_ahash_digest(dreq->req);
+		if (dreq->err == -EINPROGRESS || dreq->err == -EBUSY)
+			dreq->err = 1;	/* completes later */
 	}
+	nr = i;
+
+	for (i = 0; i < nr; i++) {
+		dreq = &dreqs[i];
+		if (dreq->err == 1)
+			wait_for_completion(&dreq->done);
+		ahash_request_free(dreq->req);
+		if (dreq->err) {
+			err = dreq->err;
+			continue;
+		}
 
-	/*
-	 * ok, we have to search the second
-	 * level subtree, hash the page to a
-	 * full strength.
-	 */
-	node = tree_node->sub_root.rb_node;
-	BUG_ON(!node);
-	hash_max = rmap_item_hash_max(item, hash);
+		memcpy(digests[i], dreq->out, sizeof(digests[i]));
+		/* 0 means not computed */
+		if (!digests[i][0] && !digests[i][1])
+			digests[i][0] = 1;
+	}
 
-	while (node) {
-		int cmp;
+	return err;
+}
 
-		stable_node = rb_entry(node, struct stable_node, node);
+/* @kpage is a ksm page, @page is write-protected and locked */
+static int pages_identical_ksm(struct page *page, struct page *kpage)
+{
+	struct stable_node *stable_node = page_stable_node(kpage);
+	struct page *pages[2] = { page, kpage };
+	u64 digests[2][2];
+	int nr = 1;
 
-		cmp = hash_cmp(hash_max, stable_node->hash_max);
+	if (!ksm_strong_digest || !stable_node)
+		return pages_identical(page, kpage);
 
-		if (cmp < 0)
-			node = node->rb_left;
-		else if (cmp > 0)
-			node = node->rb_right;
-		else
-			goto get_page_out;
-	}
+	if (!stable_node->digest[0] && !stable_node->digest[1])
+		nr = 2;
+	if (pages_digest(pages, digests, nr))
+		return pages_identical(page, kpage);
 
-	return NULL;
+	if (nr == 2)
+		memcpy(stable_node->digest, digests[1],
+		       sizeof(stable_node->digest));
 
-get_page_out:
-	page = get_ksm_page(stable_node, 1, 1);
-	return page;
+	ksm_digest_compares++;
+	return digests[0][0] == stable_node->digest[0] &&
+	       digests[0][1] == stable_node->digest[1];
 }
 
-
-/**
- * try_to_merge_with_stable_page() - when two rmap_items need to be inserted
- * into stable tree, the page was found to be identical to a stable ksm page,
- * this is the last chance we can merge them into one.
- *
- * @item1:	the rmap_item holding the page which we wanted to insert
- *       	into stable tree.
- * @item2:	the other rmap_item we found when unstable tree search
- * @oldpage:	the page currently mapped by the two rmap_items
- * @tree_page: 	the page we found identical in stable tree node
- * @success1:	return if item1 is successfully merged
- * @success2:	return if item2 is successfully merged
- */
-static void try_merge_with_stable(struct rmap_item *item1,
-				  struct rmap_item *item2,
-				  struct page *oldpage,
-				  struct page *tree_page,
-				  int *success1, int *success2)
+static int write_protect_page(struct vm_area_struct *vma, struct page *page,
+			      pte_t *orig_pte, pte_t *old_pte)
 {
-	spinlock_t *ptl1, *ptl2;
-	pte_t *ptep1, *ptep2;
-	unsigned long addr1, addr2;
-	struct vm_area_struct *vma1 = item1->slot->vma;
-	struct vm_area_struct *vma2 = item2->slot->vma;
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long addr;
+	pte_t *ptep;
+	spinlock_t *ptl;
+	int swapped;
+	int err = -EFAULT;
 
-	*success1 = 0;
-	*success2 = 0;
+	addr = page_address_in_vma(page, vma);
+	if (addr == -EFAULT)
+		goto out;
 
-	if (unlikely(oldpage == tree_page)) {
-		/* I don't think this can really happen */
-		goto success_both;
-	}
+	BUG_ON(PageTransCompound(page));
+	ptep = page_check_address(page, mm, addr, &ptl, 0);
+	if (!ptep)
+		goto out;
+
+	if (old_pte)
+		*old_pte = *ptep;
+
+	if (pte_write(*ptep) || pte_dirty(*ptep)) {
+		pte_t entry;
+
+		swapped = PageSwapCache(page);
+		flush_cache_page(vma, addr, page_to_pfn(page));
+		/*
+		 * Ok this is tricky, when get_user_pages_fast() run it doesnt
+		 * take any lock, therefore the check that we are going to make
+		 * with the pagecount against the mapcount is racey and
+		 * O_DIRECT can happen right after the check.
+		 * So we clear the pte and flush the tlb before the check
+		 * this assure us that no O_DIRECT can happen after the check
+		 * or in the middle of the check.
+		 */
+		entry = ptep_clear_flush(vma, addr, ptep);
+		/*
+		 * Check that no O_DIRECT or similar I/O is in progress on the
+		 * page
+		 */
+		if (page_mapcount(page) + 1 + swapped != page_count(page)) {
+			set_pte_at(mm, addr, ptep, entry);
+			goto out_unlock;
+		}
+		if (pte_dirty(entry))
+			set_page_dirty(page);
+		entry = pte_mkclean(pte_wrprotect(entry));
+		set_pte_at_notify(mm, addr, ptep, entry);
+	}
+	*orig_pte = *ptep;
+	err = 0;
+
+out_unlock:
+	pte_unmap_unlock(ptep, ptl);
+out:
+	return err;
+}
+
+#define MERGE_ERR_PGERR		1 /* the page is invalid cannot continue */
+#define MERGE_ERR_COLLI		2 /* there is a collision */
+#define MERGE_ERR_CHANGED	3 /* the page has changed since last hash */
+
+
+/**
+ * replace_page - replace page in vma by new ksm page
+ * @vma:      vma that holds the pte pointing to page
+ * @page:     the page we are replacing by kpage
+ * @kpage:    the ksm page we replace page by, NULL for the zero page
+ * @orig_pte: the original value of the pte
+ *
+ * Returns 0 on success, MERGE_ERR_PGERR on failure.
+ */
+static int replace_page(struct vm_area_struct *vma, struct page *page,
+			struct page *kpage, pte_t orig_pte)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *ptep;
+	spinlock_t *ptl;
+	pte_t newpte;
+	unsigned long addr;
+	int err = MERGE_ERR_PGERR;
+
+	addr = page_address_in_vma(page, vma);
+	if (addr == -EFAULT)
+		goto out;
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		goto out;
+
+	pud = pud_offset(pgd, addr);
+	if (!pud_present(*pud))
+		goto out;
+
+	pmd = pmd_offset(pud, addr);
+	BUG_ON(pmd_trans_huge(*pmd));
+	if (!pmd_present(*pmd))
+		goto out;
+
+	ptep = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	if (!pte_same(*ptep, orig_pte)) {
+		pte_unmap_unlock(ptep, ptl);
+		goto out;
+	}
+
+	if (kpage) {
+		get_page(kpage);
+		page_add_anon_rmap(kpage, vma, addr);
+		newpte = mk_pte(kpage, vma->vm_page_prot);
+	} else {
+		/* the same special pte do_anonymous_page() maps on a read */
+		newpte = pte_mkspecial(pfn_pte(page_to_pfn(ZERO_PAGE(addr)),
+					       vma->vm_page_prot));
+		dec_mm_counter(mm, MM_ANONPAGES);
+	}
+
+	flush_cache_page(vma, addr, pte_pfn(*ptep));
+	ptep_clear_flush(vma, addr, ptep);
+	set_pte_at_notify(mm, addr, ptep, newpte);
+
+	page_remove_rmap(page);
+	if (!page_mapped(page))
+		try_to_free_swap(page);
+	put_page(page);
+
+	pte_unmap_unlock(ptep, ptl);
+	err = 0;
+out:
+	return err;
+}
+
+
+/**
+ *  Fully hash a page with HASH_STRENGTH_MAX return a non-zero hash value. The
+ *  zero hash value at HASH_STRENGTH_MAX is used to indicated that its
+ *  hash_max member has not been calculated.
+ *
+ * @page The page needs to be hashed
+ * @hash_old The hash value calculated with current hash strength
+ *
+ * return the new hash value calculated at HASH_STRENGTH_MAX
+ */
+static inline u32 page_hash_max(struct page *page, u32 hash_old)
+{
+	u32 hash_max = 0;
+	void *addr;
+
+	addr = ksm_map_page(page, KM_USER0);
+	hash_max = delta_hash(addr, hash_strength,
+			      HASH_STRENGTH_MAX, hash_old);
+
+	ksm_unmap_page(addr, KM_USER0);
+
+	if (!hash_max)
+		hash_max = 1;
+
+	rshash_neg += (HASH_STRENGTH_MAX - hash_strength);
+	ksm_hash_max_pages++;
+	return hash_max;
+}
+
+/*
+ * subtree_lookup_cost() - account a search of the collision sub-tree of
+ * @tree_node. Each level walked down misses the cache about as much as a
+ * sample word hashed, so it is a unit of rshash_neg: many near duplicate
+ * pages sharing a low strength hash make their sub-trees deep, and low
+ * strengths cost what they really do.
+ */
+static inline void subtree_lookup_cost(struct tree_node *tree_node)
+{
+	ksm_subtree_lookups++;
+	ksm_hist_add(KSM_HIST_SUBTREE, tree_node->count);
+	rshash_neg += fls_long(tree_node->count);
+}
+
+/*
+ * We compare the hash again, to ensure that it is really a hash collision
+ * instead of being caused by page write.
+ */
+static inline int check_collision(struct rmap_item *rmap_item,
+				  u32 hash)
+{
+	int err;
+	unsigned long tmp;
+	struct page *page = rmap_item->page;
+
+	/* if this rmap_item has already been hash_maxed, then the collision
+	 * must appears in the second-level rbtree search. In this case we check
+	 * if its hash_max value has been changed. Otherwise, the collision
+	 * happens in the first-level rbtree search, so we check against it's
+	 * current hash value.
+	 */
+	if (rmap_item->hash_max) {
+		tmp = rshash_neg;
+		rshash_neg += memcmp_cost;
+		rshash_neg += (HASH_STRENGTH_MAX - hash_strength);
+		BUG_ON(tmp > rshash_neg);
+
+		if (rmap_item->hash_max == page_hash_max(page, hash))
+			err = MERGE_ERR_COLLI;
+		else
+			err = MERGE_ERR_CHANGED;
+	} else {
+		tmp = rshash_neg;
+		rshash_neg += memcmp_cost + hash_strength;
+		BUG_ON(tmp > rshash_neg);
+
+		if (page_hash(page, hash_strength, 0) == hash)
+			err = MERGE_ERR_COLLI;
+		else
+			err = MERGE_ERR_CHANGED;
+	}
+
+	return err;
+}
+
+static struct page *page_trans_compound_anon(struct page *page)
+{
+	if (PageTransCompound(page)) {
+		struct page *head = compound_trans_head(page);
+		/*
+		 * head may actually be splitted and freed from under
+		 * us but it's ok here.
+		 */
+		if (PageAnon(head))
+			return head;
+	}
+	return NULL;
+}
+
+static int page_trans_compound_anon_split(struct page *page)
+{
+	int ret = 0;
+	struct page *transhuge_head = page_trans_compound_anon(page);
+	if (transhuge_head) {
+		/* Get the reference on the head to split it. */
+		if (get_page_unless_zero(transhuge_head)) {
+			/*
+			 * Recheck we got the reference while the head
+			 * was still anonymous.
+			 */
+			if (PageAnon(transhuge_head))
+				ret = split_huge_page(transhuge_head);
+			else
+				/*
+				 * Retry later if split_huge_page run
+				 * from under us.
+				 */
+				ret = 1;
+			put_page(transhuge_head);
+		} else
+			/* Retry later if split_huge_page run from under us. */
+			ret = 1;
+	}
+	return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * thp_subpage_mergeable() - guess from its hash only whether a subpage of
+ * @head would merge: it is zero-filled, or it has a match in the stable tree
+ * or in the unstable tree that is not one of the subpages of @head itself.
+ */
+static int thp_subpage_mergeable(struct page *head, struct page *page, int nid)
+{
+	struct tree_node *tree_node;
+	struct rmap_item *item;
+	u32 hash;
+
+	hash = page_hash(page, hash_strength, 0);
+	if (ksm_use_zero_pages && hash == zero_hash_table[hash_strength])
+		return 1;
+
+	if (tree_node_find(&ksm_stable_index, root_stable_treep + nid, hash))
+		return 1;
+
+	tree_node = unstable_tree_find(nid, hash);
+	if (!tree_node)
+		return 0;
+	if (tree_node->count > 1)
+		return 1;
+
+	item = rb_entry(tree_node->sub_root.rb_node, struct rmap_item, node);
+	return compound_trans_head(item->page) != head;
+}
+
+/*
+ * thp_split_allowed() - should the huge page @page belongs to be split for
+ * merging? The subpages are hashed and looked up until the threshold is
+ * either reached or out of reach. The huge page may be split from under us
+ * meanwhile, that only makes the guess stale.
+ */
+static int thp_split_allowed(struct page *page)
+{
+	struct page *head = page_trans_compound_anon(page);
+	struct thp_verdict *verdict;
+	unsigned long pfn;
+	int i, nid, nr, hits = 0;
+
+	if (!head || !ksm_thp_split_threshold)
+		return 1;
+
+	pfn = page_to_pfn(head);
+	verdict = &ksm_thp_verdicts[hash_long(pfn, KSM_THP_VERDICT_BITS)];
+	if (verdict->pfn == pfn && verdict->round == ksm_scan_round)
+		return verdict->split;
+
+	nid = page_tree_nid(head);
+	nr = hpage_nr_pages(head);
+	for (i = 0; i < nr; i++) {
+		if (hits >= ksm_thp_split_threshold ||
+		    hits + nr - i < ksm_thp_split_threshold)
+			break;
+		hits += thp_subpage_mergeable(head, head + i, nid);
+	}
+
+	verdict->pfn = pfn;
+	verdict->round = ksm_scan_round;
+	verdict->split = hits >= ksm_thp_split_threshold;
+	if (!verdict->split)
+		ksm_thp_split_avoided++;
+
+	return verdict->split;
+}
+#else
+static inline int thp_split_allowed(struct page *page)
+{
+	return 1;
+}
+#endif
+
+/*
+ * page_trans_compound_anon_try_split() - split the huge page of @page mapped
+ * in @slot if it is worth it. Returns non-zero if @page is still part of a
+ * huge page.
+ */
+static int page_trans_compound_anon_try_split(struct vma_slot *slot,
+					      struct page *page)
+{
+	int ret;
+
+	if (!PageTransCompound(page))
+		return 0;
+
+	if (!thp_split_allowed(page))
+		return 1;
+
+	ret = page_trans_compound_anon_split(page);
+	if (!ret && ksm_khugepaged_hold)
+		slot->huge_hold = 1;
+
+	return ret;
+}
+
+/**
+ * Try to merge a rmap_item.page with a kpage in stable node. kpage must
+ * already be a ksm page.
+ *
+ * @return 0 if the pages were merged, -EFAULT otherwise.
+ */
+static int try_to_merge_with_ksm_page(struct rmap_item *rmap_item,
+				      struct page *kpage, u32 hash)
+{
+	struct vm_area_struct *vma = rmap_item->slot->vma;
+	struct mm_struct *mm = vma->vm_mm;
+	pte_t orig_pte = __pte(0);
+	int err = MERGE_ERR_PGERR;
+	struct page *page;
+
+	if (ksm_test_exit(mm))
+		goto out;
+
+	page = rmap_item->page;
+
+	if (page == kpage) { /* ksm page forked */
+		err = 0;
+		goto out;
+	}
+
+	if (page_trans_compound_anon_try_split(rmap_item->slot, page))
+		goto out;
+	BUG_ON(PageTransCompound(page));
+
+	if (!PageAnon(page) || !PageKsm(kpage))
+		goto out;
+
+	/*
+	 * We need the page lock to read a stable PageSwapCache in
+	 * write_protect_page().  We use trylock_page() instead of
+	 * lock_page() because we don't want to wait here - we
+	 * prefer to continue scanning and merging different pages,
+	 * then come back to this page when it is unlocked.
+	 */
+	if (!trylock_page(page))
+		goto out;
+	/*
+	 * If this anonymous page is mapped only here, its pte may need
+	 * to be write-protected.  If it's mapped elsewhere, all of its
+	 * ptes are necessarily already write-protected.  But in either
+	 * case, we need to lock and check page_count is not raised.
+	 */
+	if (write_protect_page(vma, page, &orig_pte, NULL) == 0) {
+		if (!kpage) {
+			long map_sharing = atomic_read(&page->_mapcount);
+			/*
+			 * While we hold page lock, upgrade page from
+			 * PageAnon+anon_vma to PageKsm+NULL stable_node:
+			 * stable_tree_insert() will update stable_node.
+			 */
+			set_page_stable_node(page, NULL);
+			inc_zone_page_state(page, NR_KSM_PAGES_SHARED);
+			if (map_sharing)
+				add_zone_page_state(page_zone(page),
+						    NR_KSM_PAGES_SHARING,
+						    map_sharing);
+			mark_page_accessed(page);
+			err = 0;
+		} else {
+			if (pages_identical_ksm(page, kpage))
+				err = replace_page(vma, page, kpage, orig_pte);
+			else
+				err = check_collision(rmap_item, hash);
+		}
+	}
+
+	if ((vma->vm_flags & VM_LOCKED) && kpage && !err) {
+		munlock_vma_page(page);
+		if (!PageMlocked(kpage)) {
+			unlock_page(page);
+			lock_page(kpage);
+			mlock_vma_page(kpage);
+			page = kpage;		/* for final unlock */
+		}
+	}
+
+	unlock_page(page);
+out:
+	return err;
+}
+
+
+static int page_zero_filled(struct page *page)
+{
+	unsigned long *addr;
+	unsigned int pos;
+	int ret = 1;
+
+	addr = ksm_map_page(page, KM_USER0);
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*addr); pos++) {
+		if (addr[pos]) {
+			ret = 0;
+			break;
+		}
+	}
+	ksm_unmap_page(addr, KM_USER0);
+
+	return ret;
+}
+
+/*
+ * Replace a zero-filled anon @page of @vma, locked by the caller, with the
+ * zero page. The content is checked again after the page is write-protected,
+ * so that it cannot be dirtied between the check and the pte replacement.
+ */
+static int merge_zero_page(struct vm_area_struct *vma, struct page *page)
+{
+	pte_t orig_pte = __pte(0);
+	int err = MERGE_ERR_PGERR;
+
+	if (write_protect_page(vma, page, &orig_pte, NULL) == 0 &&
+	    page_zero_filled(page))
+		err = replace_page(vma, page, NULL, orig_pte);
+
+	if ((vma->vm_flags & VM_LOCKED) && !err)
+		munlock_vma_page(page);
+
+	return err;
+}
+
+/**
+ * Try to replace a zero-filled rmap_item.page with the zero page.
+ *
+ * @return 0 if the page was replaced, MERGE_ERR_PGERR otherwise.
+ */
+static int try_to_merge_zero_page(struct rmap_item *rmap_item)
+{
+	struct vm_area_struct *vma = rmap_item->slot->vma;
+	int err = MERGE_ERR_PGERR;
+	struct page *page;
+
+	if (ksm_test_exit(vma->vm_mm))
+		goto out;
+
+	page = rmap_item->page;
+
+	if (page_trans_compound_anon_try_split(rmap_item->slot, page))
+		goto out;
+	BUG_ON(PageTransCompound(page));
+
+	/* a ksm page is freed through its stable node, leave it there */
+	if (!PageAnon(page) || PageKsm(page) || !page_zero_filled(page))
+		goto out;
+
+	if (!trylock_page(page))
+		goto out;
+
+	err = merge_zero_page(vma, page);
+
+	unlock_page(page);
+out:
+	return err;
+}
+
+/**
+ * ksm_merge_zero_range() - map the anon pages of [@start, @end) in @mm to the
+ * zero page right away, for a virt driver that knows the guest reported them
+ * free and zero-filled. They are only checked for being zero: no hashing, no
+ * tree lookup, no waiting for ksmd to get there. Pages found not zero, KSM or
+ * huge ones are left alone.
+ *
+ * @return the number of pages merged, or -errno.
+ */
+long ksm_merge_zero_range(struct mm_struct *mm, unsigned long start,
+			  unsigned long end)
+{
+	struct vm_area_struct *vma;
+	struct page *page;
+	unsigned long addr;
+	long merged = 0;
+
+	if (!ksm_use_zero_pages)
+		return -EINVAL;
+
+	start &= PAGE_MASK;
+	down_read(&mm->mmap_sem);
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		vma = find_vma(mm, addr);
+		if (!vma || vma->vm_start >= end)
+			break;
+		if (addr < vma->vm_start)
+			addr = vma->vm_start;
+		if (!vma_can_enter(vma) || !vma->anon_vma) {
+			addr = vma->vm_end - PAGE_SIZE;
+			continue;
+		}
+
+		cond_resched();
+		if (ksm_test_exit(mm))
+			break;
+
+		page = follow_page(vma, addr, FOLL_GET);
+		if (IS_ERR_OR_NULL(page))
+			continue;
+
+		if (PageAnon(page) && !PageKsm(page) &&
+		    !PageTransCompound(page) && page_zero_filled(page) &&
+		    trylock_page(page)) {
+			if (!merge_zero_page(vma, page))
+				merged++;
+			unlock_page(page);
+		}
+		put_page(page);
+	}
+	up_read(&mm->mmap_sem);
+
+	ksm_pages_zero_merged += merged;
+	ksm_pages_zero_hinted += merged;
+	return merged;
+}
+EXPORT_SYMBOL_GPL(ksm_merge_zero_range);
+
+/**
+ * If two pages fail to merge in try_to_merge_two_pages, then we have a chance
+ * to restore a page mapping that has been changed in try_to_merge_two_pages.
+ *
+ * @return 0 on success.
+ */
+static int restore_ksm_page_pte(struct vm_area_struct *vma, unsigned long addr,
+			     pte_t orig_pte, pte_t wprt_pte)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *ptep;
+	spinlock_t *ptl;
+
+	int err = -EFAULT;
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		goto out;
+
+	pud = pud_offset(pgd, addr);
+	if (!pud_present(*pud))
+		goto out;
+
+	pmd = pmd_offset(pud, addr);
+	if (!pmd_present(*pmd))
+		goto out;
+
+	ptep = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	if (!pte_same(*ptep, wprt_pte)) {
+		/* already copied, let it be */
+		pte_unmap_unlock(ptep, ptl);
+		goto out;
+	}
+
+	/*
+	 * Good boy, still here. When we still get the ksm page, it does not
+	 * return to the free page pool, there is no way that a pte was changed
+	 * to other page and gets back to this page. And remind that ksm page
+	 * do not reuse in do_wp_page(). So it's safe to restore the original
+	 * pte.
+	 */
+	flush_cache_page(vma, addr, pte_pfn(*ptep));
+	ptep_clear_flush(vma, addr, ptep);
+	set_pte_at_notify(mm, addr, ptep, orig_pte);
+
+	pte_unmap_unlock(ptep, ptl);
+	err = 0;
+out:
+	return err;
+}
+
+/**
+ * undo_merge_nolock() - map the unstable tree page of @item back in place of
+ * @kpage, when it was merged without its mmap_sem and could not be appended
+ * to the stable tree: break_cow() needs that mmap_sem, and kpage mapped there
+ * with no rmap_item would be out of reach of rmap walks.
+ * ksmd still holds @tree_page, locked, which kept the content of kpage since
+ * it was unmapped unless it was mapped again, and @anon_vma, its anon_vma.
+ *
+ * @return 0 on success, -EFAULT if the pte has changed meanwhile.
+ */
+static int undo_merge_nolock(struct rmap_item *item, struct page *kpage,
+			     struct page *tree_page, struct anon_vma *anon_vma)
+{
+	struct vma_slot *slot = item->slot;
+	struct vm_area_struct *vma = NULL;
+	struct anon_vma_chain *avc;
+	unsigned long addr = get_rmap_addr(item);
+	struct mm_struct *mm;
+	spinlock_t *ptl;
+	pte_t *ptep;
+	int err = -EFAULT;
+
+	if (page_mapped(tree_page) || PageSwapCache(tree_page))
+		return err;
+
+	/* the vma is kept alive by the anon_vma lock, as lock_tree_item_vma() */
+	anon_vma_lock(anon_vma);
+	spin_lock(&slot->queue->lock);
+	if (list_empty(&slot->slot_list))
+		vma = slot->vma;
+	spin_unlock(&slot->queue->lock);
+
+	if (!vma)
+		goto out;
+
+	list_for_each_entry(avc, &anon_vma->head, same_anon_vma)
+		if (avc->vma == vma)
+			break;
+
+	if (&avc->same_anon_vma == &anon_vma->head)
+		goto out;
+
+	mm = vma->vm_mm;
+	ptep = page_check_address(kpage, mm, addr, &ptl, 0);
+	if (!ptep)
+		goto out;
+
+	get_page(tree_page);
+	page_add_anon_rmap(tree_page, vma, addr);
+
+	flush_cache_page(vma, addr, pte_pfn(*ptep));
+	ptep_clear_flush(vma, addr, ptep);
+	set_pte_at_notify(mm, addr, ptep, mk_pte(tree_page, vma->vm_page_prot));
+
+	page_remove_rmap(kpage);
+	put_page(kpage);
+
+	pte_unmap_unlock(ptep, ptl);
+	err = 0;
+out:
+	anon_vma_unlock(anon_vma);
+	return err;
+}
+
+/**
+ * try_to_merge_two_pages() - take two identical pages and prepare
+ * them to be merged into one page(rmap_item->page)
+ *
+ * With @nolock, the mmap_sem of tree_rmap_item is not held and its vma is
+ * pinned by the anon_vma lock while its pte is write protected and replaced.
+ *
+ * @return 0 if we successfully merged two identical pages into
+ *         one ksm page. MERGE_ERR_COLLI if it's only a hash collision
+ *         search in rbtree. MERGE_ERR_CHANGED if rmap_item has been
+ *         changed since it's hashed. MERGE_ERR_PGERR otherwise.
+ *
+ */
+static int try_to_merge_two_pages(struct rmap_item *rmap_item,
+				  struct rmap_item *tree_rmap_item,
+				  u32 hash, int nolock)
+{
+	pte_t orig_pte1 = __pte(0), orig_pte2 = __pte(0);
+	pte_t wprt_pte1 = __pte(0), wprt_pte2 = __pte(0);
+	struct vm_area_struct *vma1 = rmap_item->slot->vma;
+	struct vm_area_struct *vma2 = tree_rmap_item->slot->vma;
+	struct page *page = rmap_item->page;
+	struct page *tree_page = tree_rmap_item->page;
+	int err = MERGE_ERR_PGERR;
+	struct anon_vma *anon_vma = NULL;
+	unsigned long vm_flags2;
+	int identical;
+
+	long map_sharing;
+	struct address_space *saved_mapping;
+	u64 start = local_clock();
+
+
+	if (rmap_item->page == tree_rmap_item->page)
+		goto out;
+
+	/* do not split one huge page only to find the other one is kept */
+	if (!thp_split_allowed(page) || !thp_split_allowed(tree_page))
+		goto out;
+
+	if (page_trans_compound_anon_try_split(rmap_item->slot, page))
+		goto out;
+	BUG_ON(PageTransCompound(page));
+
+	if (page_trans_compound_anon_try_split(tree_rmap_item->slot, tree_page))
+		goto out;
+	BUG_ON(PageTransCompound(tree_page));
+
+	if (!PageAnon(page) || !PageAnon(tree_page))
+		goto out;
+
+	if (!trylock_page(page))
+		goto out;
+
+
+	if (write_protect_page(vma1, page, &wprt_pte1, &orig_pte1) != 0) {
+		unlock_page(page);
+		goto out;
+	}
+
+	/*
+	 * While we hold page lock, upgrade page from
+	 * PageAnon+anon_vma to PageKsm+NULL stable_node:
+	 * stable_tree_insert() will update stable_node.
+	 */
+	saved_mapping = page->mapping;
+	map_sharing = atomic_read(&page->_mapcount);
+	set_page_stable_node(page, NULL);
+	inc_zone_page_state(page, NR_KSM_PAGES_SHARED);
+	if (map_sharing)
+		add_zone_page_state(page_zone(page),
+				    NR_KSM_PAGES_SHARING,
+				    map_sharing);
+	mark_page_accessed(page);
+	unlock_page(page);
+
+	if (!trylock_page(tree_page))
+		goto restore_out;
+
+	if (nolock) {
+		anon_vma = lock_tree_item_vma(tree_rmap_item, tree_page, &err);
+		if (!anon_vma) {
+			err = MERGE_ERR_PGERR;
+			unlock_page(tree_page);
+			goto restore_out;
+		}
+	}
+
+	if (write_protect_page(vma2, tree_page, &wprt_pte2, &orig_pte2) != 0) {
+		if (anon_vma)
+			page_unlock_anon_vma(anon_vma);
+		unlock_page(tree_page);
+		goto restore_out;
+	}
+
+	identical = pages_identical(page, tree_page);
+	if (identical)
+		err = replace_page(vma2, tree_page, page, wprt_pte2);
+	vm_flags2 = vma2->vm_flags;
+	if (anon_vma)
+		page_unlock_anon_vma(anon_vma);
+
+	if (identical) {
+		if (err) {
+			unlock_page(tree_page);
+			goto restore_out;
+		}
+
+		if (nolock)
+			ksm_unstable_nolock_merges++;
+
+		if ((vm_flags2 & VM_LOCKED)) {
+			munlock_vma_page(tree_page);
+			if (!PageMlocked(page)) {
+				unlock_page(tree_page);
+				lock_page(page);
+				mlock_vma_page(page);
+				tree_page = page; /* for final unlock */
+			}
+		}
+
+		unlock_page(tree_page);
+
+		goto out; /* success */
+
+	} else {
+		if (page_hash(page, hash_strength, 0) ==
+		    page_hash(tree_page, hash_strength, 0)) {
+			rshash_neg += memcmp_cost + hash_strength * 2;
+			err = MERGE_ERR_COLLI;
+		} else
+			err = MERGE_ERR_CHANGED;
+
+		unlock_page(tree_page);
+	}
+
+restore_out:
+	lock_page(page);
+	if (!restore_ksm_page_pte(vma1, get_rmap_addr(rmap_item),
+				  orig_pte1, wprt_pte1))
+		page->mapping = saved_mapping;
+
+	unlock_page(page);
+out:
+	trace_ksm_merge_two_pages(rmap_item->slot, get_rmap_addr(rmap_item),
+				  tree_rmap_item->slot,
+				  get_rmap_addr(tree_rmap_item),
+				  err, local_clock() - start);
+	return err;
+}
+
+#define KPAGE_BLOCK_SAMPLES	16
+
+/*
+ * kpage_block_pinned() - how much of the pageblock of @page is already out of
+ * compaction's reach: the pages of a sample of it that are neither free nor
+ * on the LRU, or more than all of them when the block is not movable.
+ * A kpage can't be migrated, so it costs the least in such a block.
+ */
+static int kpage_block_pinned(struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long start = page_to_pfn(page) & ~(pageblock_nr_pages - 1);
+	unsigned long stride = max(pageblock_nr_pages / KPAGE_BLOCK_SAMPLES,
+				   1UL);
+	unsigned long pfn;
+	int pinned = 0;
+
+	if (get_pageblock_migratetype(page) != MIGRATE_MOVABLE)
+		return KPAGE_BLOCK_SAMPLES + 1;
+
+	for (pfn = start; pfn < start + pageblock_nr_pages; pfn += stride) {
+		struct page *p;
+
+		if (!pfn_valid_within(pfn) || !pfn_valid(pfn)) {
+			pinned++;
+			continue;
+		}
+		p = pfn_to_page(pfn);
+		if (page_zone(p) != zone) {
+			pinned++;
+			continue;
+		}
+		if (!PageBuddy(p) && (!PageLRU(p) || PageKsm(p)))
+			pinned++;
+	}
+
+	return pinned;
+}
+
+/* Should the merge of @page into @tree_page keep @tree_page instead? */
+static inline int keep_tree_page(struct page *page, struct page *tree_page)
+{
+	if (!ksm_compaction_aware)
+		return 0;
+
+	return kpage_block_pinned(tree_page) > kpage_block_pinned(page);
+}
+
+static inline int hash_cmp(u32 new_val, u32 node_val)
+{
+	if (new_val > node_val)
+		return 1;
+	else if (new_val < node_val)
+		return -1;
+	else
+		return 0;
+}
+
+static inline u32 rmap_item_hash_max(struct rmap_item *item, u32 hash)
+{
+	u32 hash_max = item->hash_max;
+
+	if (!hash_max) {
+		hash_max = page_hash_max(item->page, hash);
+
+		item->hash_max = hash_max;
+	}
+
+	return hash_max;
+}
+
+
+
+static inline int stable_node_full(struct stable_node *stable_node)
+{
+	return ksm_max_page_sharing &&
+	       stable_node->rmap_nr >= ksm_max_page_sharing;
+}
+
+/*
+ * stable_node_with_room() - @stable_node or a copy of it, chained next to it
+ * with the same hash_max, which can take one more rmap_item. NULL if none.
+ */
+static struct stable_node *
+stable_node_with_room(struct stable_node *stable_node)
+{
+	struct stable_node *dup;
+	struct rb_node *rb;
+
+	if (!stable_node_full(stable_node))
+		return stable_node;
+
+	for (rb = rb_prev(&stable_node->node); rb; rb = rb_prev(rb)) {
+		dup = rb_entry(rb, struct stable_node, node);
+		if (dup->hash_max != stable_node->hash_max)
+			break;
+		if (!stable_node_full(dup))
+			return dup;
+	}
+
+	for (rb = rb_next(&stable_node->node); rb; rb = rb_next(rb)) {
+		dup = rb_entry(rb, struct stable_node, node);
+		if (dup->hash_max != stable_node->hash_max)
+			break;
+		if (!stable_node_full(dup))
+			return dup;
+	}
+
+	return NULL;
+}
+
+/*
+ * A page not on the active list and not referenced since it was last
+ * looked at by reclaim is read rarely enough to live on a remote node.
+ */
+static inline int page_is_cold(struct page *page)
+{
+	return !PageActive(page) && !PageReferenced(page);
+}
+
+/* the number of cache lines @page1 and @page2 differ in, up to @limit + 1 */
+static unsigned int pages_lines_differ(struct page *page1, struct page *page2,
+				       unsigned int limit)
+{
+	char *addr1, *addr2;
+	unsigned int off, n = 0;
+
+	addr1 = ksm_map_page(page1, KM_USER0);
+	addr2 = ksm_map_page(page2, KM_USER1);
+	for (off = 0; off < PAGE_SIZE && n <= limit; off += L1_CACHE_BYTES)
+		if (memcmp(addr1 + off, addr2 + off, L1_CACHE_BYTES))
+			n++;
+	ksm_unmap_page(addr2, KM_USER1);
+	ksm_unmap_page(addr1, KM_USER0);
+
+	return n;
+}
+
+static void stable_tree_note_near_dup(struct rmap_item *item,
+				      struct tree_node *tree_node)
+{
+	struct stable_node *stable_node;
+	struct page *kpage;
+	unsigned int n;
+
+	if (!page_is_cold(item->page))
+		return;
+
+	stable_node = rb_entry(rb_first(&tree_node->sub_root),
+			       struct stable_node, node);
+	kpage = get_ksm_page(stable_node, 1, 1);
+	if (!kpage)
+		return;
+
+	n = pages_lines_differ(item->page, kpage, ksm_near_dup_lines);
+	if (n && n <= ksm_near_dup_lines) {
+		ksm_pages_near_dup++;
+		ksm_near_dup_lines_total += n;
+	}
+	put_page(kpage);
+}
+
+/**
+ * __stable_tree_search() - search one stable tree for a page
+ *
+ * @root: 	the root of the stable tree of a node
+ * @item: 	the rmap_item we are comparing with
+ * @hash: 	the hash value of this item->page already calculated
+ * @tree_hash:	the hash value of item->page with the strength of this tree
+ *
+ * @return 	the page we have found, NULL otherwise. The page returned has
+ *         	been gotten.
+ */
+static struct page *__stable_tree_search(struct rb_root *root,
+					 struct rmap_item *item, u32 hash,
+					 u32 tree_hash)
+{
+	struct rb_node *node;
+	struct tree_node *tree_node;
+	unsigned long hash_max;
+	struct page *page;
+	struct stable_node *stable_node;
+
+	if (!ksm_filter_test(&ksm_stable_filter, tree_hash)) {
+		ksm_filter_negative++;
+		return NULL;
+	}
+	ksm_filter_positive++;
+
+	tree_node = tree_node_find(&ksm_stable_index, root, tree_hash);
+	if (!tree_node) {
+		ksm_filter_false_positive++;
+		return NULL;
+	}
+
+	if (tree_node->count == 1) {
+		stable_node = rb_entry(tree_node->sub_root.rb_node,
+				       struct stable_node, node);
+		BUG_ON(!stable_node);
+
+		/* a copy of it is made when merged in the unstable tree */
+		if (stable_node_full(stable_node))
+			return NULL;
+		if (item->slot->strong_hash)
+			goto strong_out;
+		goto get_page_out;
+	}
+
+	/*
+	 * ok, we have to search the second
+	 * level subtree, hash the page to a
+	 * full strength.
+	 */
+	node = tree_node->sub_root.rb_node;
+	BUG_ON(!node);
+	hash_max = rmap_item_hash_max(item, hash);
+	subtree_lookup_cost(tree_node);
+
+	while (node) {
+		int cmp;
+
+		stable_node = rb_entry(node, struct stable_node, node);
+
+		cmp = hash_cmp(hash_max, stable_node->hash_max);
+
+		if (cmp < 0)
+			node = node->rb_left;
+		else if (cmp > 0)
+			node = node->rb_right;
+		else {
+			stable_node = stable_node_with_room(stable_node);
+			if (!stable_node)
+				return NULL;
+			goto get_page_out;
+		}
+	}
+
+	if (ksm_near_dup_lines)
+		stable_tree_note_near_dup(item, tree_node);
+	return NULL;
+
+get_page_out:
+	page = get_ksm_page_locked(stable_node, 1, 1);
+	return page;
+
+strong_out:
+	page = get_ksm_page_locked(stable_node, 1, 1);
+	if (!page)
+		return NULL;
+
+	/* the ksm page hashes to tree_hash, at hash_strength if it's hash */
+	if (!stable_node->hash_max && tree_hash == hash)
+		stable_node->hash_max = page_hash_max(page, hash);
+	if (stable_node->hash_max &&
+	    stable_node->hash_max != rmap_item_hash_max(item, hash)) {
+		put_page(page);
+		item->slot->hash_hits++;
+		item->slot->hash_colli++;
+		ksm_strong_hash_rejected++;
+		return NULL;
+	}
+	return page;
+}
+
+/*
+ * stable_tree_search_nid() - search the stable tree of a node, and the old
+ * one too if it is being migrated. *hash_old is calculated on first use.
+ */
+static struct page *stable_tree_search_nid(struct rmap_item *item, u32 hash,
+					   u32 *hash_old, int *hash_old_ok,
+					   int nid)
+{
+	struct page *kpage;
+	void *addr;
+
+	kpage = __stable_tree_search(root_stable_treep + nid, item, hash, hash);
+	if (kpage || !root_stable_old_treep)
+		return kpage;
+
+	if (!*hash_old_ok) {
+		addr = ksm_map_page(item->page, KM_USER0);
+		*hash_old = delta_hash(addr, hash_strength,
+				       stable_tree_old_strength, hash);
+		ksm_unmap_page(addr, KM_USER0);
+		*hash_old_ok = 1;
+	}
+
+	return __stable_tree_search(root_stable_old_treep + nid, item,
+				    hash, *hash_old);
+}
+
+/**
+ * stable_tree_search() - search the stable tree for a page
+ *
+ * @item: 	the rmap_item we are comparing with
+ * @hash: 	the hash value of this item->page already calculated
+ *
+ * @return 	the page we have found, NULL otherwise. The page returned has
+ *         	been gotten.
+ */
+static struct page *stable_tree_search(struct rmap_item *item, u32 hash)
+{
+	struct page *page = item->page;
+	struct page *kpage;
+	int nid, tree_nid;
+	u32 hash_old = 0;
+	int hash_old_ok = 0;
+
+	if (page_stable_node(page)) {
+		/* ksm page forked, that is
+		 * if (PageKsm(page) && !in_stable_tree(rmap_item))
+		 * it's actually gotten once outside.
+		 */
+		get_page(page);
+		return page;
+	}
+
+	tree_nid = page_tree_nid(page);
+	kpage = stable_tree_search_nid(item, hash, &hash_old, &hash_old_ok,
+				       tree_nid);
+	if (kpage || ksm_merge_across_nodes || !ksm_merge_cold_across_nodes ||
+	    !page_is_cold(page))
+		return kpage;
+
+	for_each_online_node(nid) {
+		if (nid == tree_nid)
+			continue;
+		kpage = stable_tree_search_nid(item, hash, &hash_old,
+					       &hash_old_ok, nid);
+		if (kpage)
+			break;
+	}
+
+	return kpage;
+}
+
+
+/**
+ * try_to_merge_with_stable_page() - when two rmap_items need to be inserted
+ * into stable tree, the page was found to be identical to a stable ksm page,
+ * this is the last chance we can merge them into one.
+ *
+ * @item1:	the rmap_item holding the page which we wanted to insert
+ *       	into stable tree.
+ * @item2:	the other rmap_item we found when unstable tree search
+ * @oldpage:	the page currently mapped by the two rmap_items
+ * @tree_page: 	the page we found identical in stable tree node
+ * @success1:	return if item1 is successfully merged
+ * @success2:	return if item2 is successfully merged
+ */
+static void try_merge_with_stable(struct rmap_item *item1,
+				  struct rmap_item *item2,
+				  struct page *oldpage,
+				  struct page *tree_page,
+				  int *success1, int *success2)
+{
+	spinlock_t *ptl1, *ptl2;
+	pte_t *ptep1, *ptep2;
+	unsigned long addr1, addr2;
+	struct vm_area_struct *vma1 = item1->slot->vma;
+	struct vm_area_struct *vma2 = item2->slot->vma;
+
+	*success1 = 0;
+	*success2 = 0;
+
+	if (unlikely(oldpage == tree_page)) {
+		/* I don't think this can really happen */
+		goto success_both;
+	}
 
 	if (!PageAnon(oldpage) || !PageKsm(oldpage))
 		goto failed;
 
-	/* If the oldpage is still ksm and still pointed
-	 * to in the right place, and still write protected,
-	 * we are confident it's not changed, no need to
-	 * memcmp anymore.
-	 * be ware, we cannot take nested pte locks,
-	 * deadlock risk.
-	 */
-	addr1 = get_rmap_addr(item1);
+	/* If the oldpage is still ksm and still pointed
+	 * to in the right place, and still write protected,
+	 * we are confident it's not changed, no need to
+	 * memcmp anymore.
+	 * be ware, we cannot take nested pte locks,
+	 * deadlock risk.
+	 */
+	addr1 = get_rmap_addr(item1);
+
+	ptep1 = page_check_address(oldpage, vma1->vm_mm, addr1, &ptl1, 0);
+	if (!ptep1)
+		goto failed;
+
+	if (pte_write(*ptep1)) {
+		/* has changed, abort! */
+		pte_unmap_unlock(ptep1, ptl1);
+		goto failed;
+	}
+
+	get_page(tree_page);
+	page_add_anon_rmap(tree_page, vma1, addr1);
+
+	flush_cache_page(vma1, addr1, pte_pfn(*ptep1));
+	ptep_clear_flush(vma1, addr1, ptep1);
+	set_pte_at_notify(vma1->vm_mm, addr1, ptep1,
+			  mk_pte(tree_page, vma1->vm_page_prot));
+
+	page_remove_rmap(oldpage);
+	put_page(oldpage);
+
+	pte_unmap_unlock(ptep1, ptl1);
+
+
+	/* ok, then vma2, remind that pte1 already set */
+	addr2 = get_rmap_addr(item2);
+
+	ptep2 = page_check_address(oldpage, vma2->vm_mm, addr2, &ptl2, 0);
+	if (!ptep2)
+		goto success1;
+
+	if (pte_write(*ptep2)) {
+		/* has changed, abort! */
+		pte_unmap_unlock(ptep2, ptl2);
+		goto success1;
+	}
+
+	get_page(tree_page);
+	page_add_anon_rmap(tree_page, vma2, addr2);
+
+	flush_cache_page(vma2, addr2, pte_pfn(*ptep2));
+	ptep_clear_flush(vma2, addr2, ptep2);
+	set_pte_at_notify(vma2->vm_mm, addr2, ptep2,
+			  mk_pte(tree_page, vma2->vm_page_prot));
+
+	page_remove_rmap(oldpage);
+	put_page(oldpage);
+
+	pte_unmap_unlock(ptep2, ptl2);
+
+
+success_both:
+	*success2 = 1;
+success1:
+	*success1 = 1;
+
+	if ((*success1 && vma1->vm_flags & VM_LOCKED) ||
+	    (*success2 && vma2->vm_flags & VM_LOCKED)) {
+		munlock_vma_page(oldpage);
+		if (!PageMlocked(tree_page)) {
+
+			/*ok, we do not need oldpage any more in the caller
+			 * we can break the lock now.
+			 */
+			unlock_page(oldpage);
+			lock_page(tree_page);
+			mlock_vma_page(tree_page);
+			unlock_page(tree_page);
+			lock_page(oldpage); /* unlocked outside */
+		}
+	}
+
+failed:
+	return;
+}
+
+static inline void stable_node_hash_max(struct stable_node *node,
+					 struct page *page, u32 hash)
+{
+	u32 hash_max = node->hash_max;
+
+	if (!hash_max) {
+		hash_max = page_hash_max(page, hash);
+		node->hash_max = hash_max;
+	}
+}
+
+static inline
+struct stable_node *new_stable_node(struct tree_node *tree_node,
+				    struct page *kpage, u32 hash_max)
+{
+	struct stable_node *new_stable_node;
+
+	new_stable_node = alloc_stable_node();
+	if (!new_stable_node)
+		return NULL;
+
+	stable_node_set_kpfn(new_stable_node, page_to_pfn(kpage));
+	new_stable_node->hash_max = hash_max;
+	new_stable_node->tree_node = tree_node;
+	set_page_stable_node(kpage, new_stable_node);
+
+	/* the memcg kpage stays charged to, credited with what it saves */
+	new_stable_node->memcg = try_get_mem_cgroup_from_page(kpage);
+	mem_cgroup_ksm_stat(new_stable_node->memcg,
+			    MEM_CGROUP_KSM_PAGES_CHARGED, 1);
+
+	return new_stable_node;
+}
+
+static inline
+struct stable_node *first_level_insert(struct tree_node *tree_node,
+				       struct rmap_item *rmap_item,
+				       struct rmap_item *tree_rmap_item,
+				       struct page *kpage, u32 hash,
+				       int *success1, int *success2)
+{
+	int cmp;
+	struct page *tree_page;
+	u32 hash_max = 0;
+	struct stable_node *stable_node, *new_snode;
+	struct rb_node *parent = NULL, **new;
+
+	/* this tree node contains no sub-tree yet */
+	stable_node = rb_entry(tree_node->sub_root.rb_node,
+			       struct stable_node, node);
+
+	tree_page = get_ksm_page(stable_node, 1, 0);
+	if (tree_page) {
+		cmp = memcmp_pages(kpage, tree_page, 1);
+		if (!cmp && stable_node_full(stable_node)) {
+			/* kpage becomes a copy of it, chained next to it */
+			stable_node_hash_max(stable_node, tree_page,
+					     tree_node->hash);
+			put_page(tree_page);
+			hash_max = rmap_item_hash_max(rmap_item, hash);
+			parent = &stable_node->node;
+			new = &parent->rb_right;
+			ksm_stable_node_dups++;
+		} else if (!cmp) {
+			/* kpage is locked, see lock_ksm_page() */
+			if (!lock_ksm_page(stable_node, tree_page, 1)) {
+				put_page(tree_page);
+				goto failed;
+			}
+			unlock_page(tree_page);
+			try_merge_with_stable(rmap_item, tree_rmap_item, kpage,
+					      tree_page, success1, success2);
+			put_page(tree_page);
+			if (!*success1 && !*success2)
+				goto failed;
+
+			return stable_node;
+
+		} else {
+			/*
+			 * collision in first level try to create a subtree.
+			 * A new node need to be created.
+			 */
+			put_page(tree_page);
+
+			stable_node_hash_max(stable_node, tree_page,
+					     tree_node->hash);
+			hash_max = rmap_item_hash_max(rmap_item, hash);
+			cmp = hash_cmp(hash_max, stable_node->hash_max);
+
+			parent = &stable_node->node;
+			if (cmp < 0) {
+				new = &parent->rb_left;
+			} else if (cmp > 0) {
+				new = &parent->rb_right;
+			} else {
+				printk(KERN_ERR "KSM collision1 "
+						"hash_max=%u\n",
+				       hash_max);
+				goto failed;
+			}
+		}
+
+	} else {
+		/* the only stable_node deleted, we reuse its tree_node.
+		 */
+		parent = NULL;
+		new = &tree_node->sub_root.rb_node;
+	}
+
+	new_snode = new_stable_node(tree_node, kpage, hash_max);
+	if (!new_snode)
+		goto failed;
+
+	rb_link_node(&new_snode->node, parent, new);
+	rb_insert_color(&new_snode->node, &tree_node->sub_root);
+	tree_node->count++;
+	*success1 = *success2 = 1;
+
+	return new_snode;
+
+failed:
+	return NULL;
+}
+
+static inline
+struct stable_node *stable_subtree_insert(struct tree_node *tree_node,
+					  struct rmap_item *rmap_item,
+					  struct rmap_item *tree_rmap_item,
+					  struct page *kpage, u32 hash,
+					  int *success1, int *success2)
+{
+	struct page *tree_page;
+	u32 hash_max;
+	struct stable_node *stable_node, *new_snode, *room;
+	struct rb_node *parent, **new;
+	int dup;
+
+research:
+	dup = 0;
+	parent = NULL;
+	new = &tree_node->sub_root.rb_node;
+	BUG_ON(!*new);
+	hash_max = rmap_item_hash_max(rmap_item, hash);
+	while (*new) {
+		int cmp;
+
+		stable_node = rb_entry(*new, struct stable_node, node);
+
+		cmp = hash_cmp(hash_max, stable_node->hash_max);
+
+		if (cmp < 0) {
+			parent = *new;
+			new = &parent->rb_left;
+		} else if (cmp > 0) {
+			parent = *new;
+			new = &parent->rb_right;
+		} else {
+			tree_page = get_ksm_page(stable_node, 1, 0);
+			if (tree_page) {
+				cmp = memcmp_pages(kpage, tree_page, 1);
+				if (!cmp && stable_node_full(stable_node)) {
+					put_page(tree_page);
+					room = stable_node_with_room(stable_node);
+					if (!room) {
+						/* a copy, next to the last */
+						dup = 1;
+						parent = *new;
+						new = &parent->rb_right;
+						continue;
+					}
+
+					/* a copy has room, same content */
+					stable_node = room;
+					tree_page = get_ksm_page(stable_node,
+								 1, 0);
+					if (!tree_page)
+						goto research;
+					cmp = memcmp_pages(kpage, tree_page, 1);
+				}
+				if (!cmp) {
+					if (!lock_ksm_page(stable_node,
+							   tree_page, 1)) {
+						put_page(tree_page);
+						goto failed;
+					}
+					unlock_page(tree_page);
+					try_merge_with_stable(rmap_item,
+						tree_rmap_item, kpage,
+						tree_page, success1, success2);
+
+					put_page(tree_page);
+					if (!*success1 && !*success2)
+						goto failed;
+					/*
+					 * successfully merged with a stable
+					 * node
+					 */
+					return stable_node;
+				} else {
+					put_page(tree_page);
+					goto failed;
+				}
+			} else {
+				/*
+				 * stable node may be deleted,
+				 * and subtree maybe
+				 * restructed, cannot
+				 * continue, research it.
+				 */
+				if (tree_node->count) {
+					goto research;
+				} else {
+					/* reuse the tree node*/
+					parent = NULL;
+					new = &tree_node->sub_root.rb_node;
+				}
+			}
+		}
+	}
+
+	new_snode = new_stable_node(tree_node, kpage, hash_max);
+	if (!new_snode)
+		goto failed;
+
+	rb_link_node(&new_snode->node, parent, new);
+	rb_insert_color(&new_snode->node, &tree_node->sub_root);
+	tree_node->count++;
+	if (dup)
+		ksm_stable_node_dups++;
+	*success1 = *success2 = 1;
+
+	return new_snode;
+
+failed:
+	return NULL;
+}
+
+
+/**
+ * stable_tree_insert() - try to insert a merged page in unstable tree to
+ * the stable tree
+ *
+ * @kpage:		the page need to be inserted
+ * @hash:		the current hash of this page
+ * @rmap_item:		the rmap_item being scanned
+ * @tree_rmap_item:	the rmap_item found on unstable tree
+ * @success1:		return if rmap_item is merged
+ * @success2:		return if tree_rmap_item is merged
+ *
+ * @return 		the stable_node on stable tree if at least one
+ *      		rmap_item is inserted into stable tree, NULL
+ *      		otherwise.
+ */
+static struct stable_node *
+stable_tree_insert(struct page *kpage, u32 hash,
+		   struct rmap_item *rmap_item,
+		   struct rmap_item *tree_rmap_item,
+		   int *success1, int *success2)
+{
+	int nid = page_tree_nid(kpage);
+	struct rb_root *root = root_stable_treep + nid;
+	struct rb_node **new = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct stable_node *stable_node;
+	struct tree_node *tree_node;
+	u32 hash_max = 0;
+
+	*success1 = *success2 = 0;
+
+	while (*new) {
+		int cmp;
+
+		tree_node = rb_entry(*new, struct tree_node, node);
+
+		cmp = hash_cmp(hash, tree_node->hash);
+
+		if (cmp < 0) {
+			parent = *new;
+			new = &parent->rb_left;
+		} else if (cmp > 0) {
+			parent = *new;
+			new = &parent->rb_right;
+		} else
+			break;
+	}
+
+	if (*new) {
+		if (tree_node->count == 1) {
+			stable_node = first_level_insert(tree_node, rmap_item,
+						tree_rmap_item, kpage,
+						hash, success1, success2);
+		} else {
+			stable_node = stable_subtree_insert(tree_node,
+					rmap_item, tree_rmap_item, kpage,
+					hash, success1, success2);
+		}
+	} else {
+
+		/* no tree node found */
+		tree_node = alloc_tree_node(stable_tree_node_listp);
+		if (!tree_node) {
+			stable_node = NULL;
+			goto out;
+		}
+
+		stable_node = new_stable_node(tree_node, kpage, hash_max);
+		if (!stable_node) {
+			free_tree_node(tree_node);
+			goto out;
+		}
+
+		tree_node->hash = hash;
+		tree_node->root = root;
+		rb_link_node(&tree_node->node, parent, new);
+		rb_insert_color(&tree_node->node, root);
+		stable_tree_node_added(tree_node);
+		parent = NULL;
+		new = &tree_node->sub_root.rb_node;
+
+		rb_link_node(&stable_node->node, parent, new);
+		rb_insert_color(&stable_node->node, &tree_node->sub_root);
+		tree_node->count++;
+		*success1 = *success2 = 1;
+	}
+
+out:
+	return stable_node;
+}
+
+
+/**
+ * get_tree_rmap_item_page() - try to get the page and lock the mmap_sem,
+ * or only get the page if @nolock
+ *
+ * @return 	0 on success, -EBUSY if unable to lock the mmap_sem,
+ *         	-EINVAL if the page mapping has been changed.
+ */
+static inline int get_tree_rmap_item_page(struct rmap_item *tree_rmap_item,
+					  int nolock)
+{
+	int err;
+
+	if (nolock)
+		err = get_mergeable_page_nolock(tree_rmap_item);
+	else
+		err = get_mergeable_page_lock_mmap(tree_rmap_item);
+
+	if (err == -EINVAL) {
+		/* its page map has been changed, remove it */
+		remove_rmap_item_from_tree(tree_rmap_item);
+	}
+
+	/* The page is gotten and, unless @nolock, mmap_sem is locked now. */
+	return err;
+}
+
+
+static inline int unstable_item_expired(struct rmap_item *item)
+{
+	return (u32)ksm_scan_round - item->append_round >= ksm_unstable_rounds;
+}
+
+/*
+ * unstable_tree_probe() - the rmap_item of @root with the same hash as
+ * @rmap_item, found through the index when it can be, NULL if none.
+ */
+static struct rmap_item *unstable_tree_probe(struct rmap_item *rmap_item,
+					     u32 hash, struct rb_root *root)
+{
+	struct tree_node *tree_node;
+	struct rmap_item *tree_rmap_item;
+	struct rb_node *node;
+	u32 hash_max;
+	int cmp;
+
+	tree_node = tree_node_find(&ksm_unstable_index, root, hash);
+	if (!tree_node)
+		return NULL;
+
+	if (tree_node->count == 1)
+		return rb_entry(tree_node->sub_root.rb_node,
+				struct rmap_item, node);
+
+	hash_max = rmap_item_hash_max(rmap_item, hash);
+	subtree_lookup_cost(tree_node);
+	node = tree_node->sub_root.rb_node;
+	while (node) {
+		tree_rmap_item = rb_entry(node, struct rmap_item, node);
+
+		cmp = hash_cmp(hash_max, tree_rmap_item->hash_max);
+		if (cmp < 0)
+			node = node->rb_left;
+		else if (cmp > 0)
+			node = node->rb_right;
+		else
+			return tree_rmap_item;
+	}
+
+	return NULL;
+}
+
+/**
+ * unstable_tree_search_insert() - search an unstable tree rmap_item with the
+ * same hash value. Get its page and, unless @nolock, trylock the mmap_sem
+ */
+
+static inline
+struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
+					      u32 hash, int nolock)
+
+{
+	int nid = page_tree_nid(rmap_item->page);
+	int group = unstable_tree_group(rmap_item->slot);
+	struct rb_root *root = &root_unstable_tree[group][nid];
+	struct rb_node **new;
+	struct rb_node *parent;
+	struct tree_node *tree_node, *walk;
+	u32 hash_max;
+	struct rmap_item *tree_rmap_item;
+
+again:
+	new = &root->rb_node;
+	parent = NULL;
+	tree_node = NULL;
+
+	/* the rbtree is walked on a miss anyway, to find where to insert */
+	if (ksm_unstable_index.table)
+		tree_node = tree_index_lookup(&ksm_unstable_index, root, hash);
+
+	while (!tree_node && *new) {
+		int cmp;
+
+		walk = rb_entry(*new, struct tree_node, node);
+
+		cmp = hash_cmp(hash, walk->hash);
+
+		if (cmp < 0) {
+			parent = *new;
+			new = &parent->rb_left;
+		} else if (cmp > 0) {
+			parent = *new;
+			new = &parent->rb_right;
+		} else
+			tree_node = walk;
+	}
+
+	if (tree_node) {
+		/* got the tree_node */
+		if (tree_node->count == 1) {
+			tree_rmap_item = rb_entry(tree_node->sub_root.rb_node,
+						  struct rmap_item, node);
+			BUG_ON(!tree_rmap_item);
+
+			goto get_page_out;
+		}
+
+		/* well, search the collision subtree */
+		new = &tree_node->sub_root.rb_node;
+		BUG_ON(!*new);
+		hash_max = rmap_item_hash_max(rmap_item, hash);
+		subtree_lookup_cost(tree_node);
+
+		while (*new) {
+			int cmp;
+
+			tree_rmap_item = rb_entry(*new, struct rmap_item,
+						  node);
+
+			cmp = hash_cmp(hash_max, tree_rmap_item->hash_max);
+			parent = *new;
+			if (cmp < 0)
+				new = &parent->rb_left;
+			else if (cmp > 0)
+				new = &parent->rb_right;
+			else
+				goto get_page_out;
+		}
+	} else {
+		if (ksm_unstable_split_rung) {
+			tree_rmap_item = unstable_tree_probe(rmap_item, hash,
+					&root_unstable_tree[!group][nid]);
+			if (tree_rmap_item) {
+				ksm_unstable_cross_hits++;
+				goto get_page_out;
+			}
+		}
+
+		/* alloc a new tree_node */
+		tree_node = alloc_tree_node(&unstable_tree_node_list);
+		if (!tree_node)
+			return NULL;
+
+		tree_node->hash = hash;
+		tree_node->root = root;
+		rb_link_node(&tree_node->node, parent, new);
+		rb_insert_color(&tree_node->node, root);
+		tree_index_add(&ksm_unstable_index, tree_node);
+		parent = NULL;
+		new = &tree_node->sub_root.rb_node;
+	}
+
+	/* did not found even in sub-tree */
+	rmap_item->tree_node = tree_node;
+	rmap_item->address |= UNSTABLE_FLAG;
+	rmap_item->append_round = ksm_scan_round;
+	rb_link_node(&rmap_item->node, parent, new);
+	rb_insert_color(&rmap_item->node, &tree_node->sub_root);
+	tree_node->count++;
+
+	ksm_pages_unshared++;
+	return NULL;
+
+get_page_out:
+	if (unstable_item_expired(tree_rmap_item)) {
+		remove_rmap_item_from_tree(tree_rmap_item);
+		ksm_unstable_expired++;
+		goto again;
+	}
+
+	if (tree_rmap_item->page == rmap_item->page)
+		return NULL;
+
+	if (get_tree_rmap_item_page(tree_rmap_item, nolock))
+		return NULL;
+
+	return tree_rmap_item;
+}
+
+static inline struct hlist_head *vma_pair_bucket(struct hlist_head *hash,
+						 unsigned int bits,
+						 struct vma_slot *slot1,
+						 struct vma_slot *slot2)
+{
+	unsigned long key;
+
+	key = hash_ptr(slot1, BITS_PER_LONG) ^ (unsigned long)slot2;
+	return &hash[hash_long(key, bits)];
+}
+
+/*
+ * Double the vma_pair hash. If the allocation fails, the old one is kept,
+ * its chains just get longer.
+ */
+static void vma_pair_hash_grow(void)
+{
+	struct hlist_head *new_hash;
+	struct hlist_node *node, *tmp;
+	struct vma_pair *pair;
+	unsigned int bits = ksm_vma_pair_hash_bits + 1;
+	unsigned long i;
+
+	new_hash = vmalloc(sizeof(struct hlist_head) << bits);
+	if (!new_hash)
+		return;
+
+	for (i = 0; i < (1UL << bits); i++)
+		INIT_HLIST_HEAD(&new_hash[i]);
+
+	for (i = 0; i < (1UL << ksm_vma_pair_hash_bits); i++) {
+		hlist_for_each_entry_safe(pair, node, tmp,
+					  &ksm_vma_pair_hash[i], hlist) {
+			hlist_del(&pair->hlist);
+			hlist_add_head(&pair->hlist,
+				       vma_pair_bucket(new_hash, bits,
+						       pair->slot[0],
+						       pair->slot[1]));
+		}
+	}
+
+	vfree(ksm_vma_pair_hash);
+	ksm_vma_pair_hash = new_hash;
+	ksm_vma_pair_hash_bits = bits;
+}
+
+static struct vma_pair *lookup_vma_pair(struct vma_slot *slot1,
+					struct vma_slot *slot2)
+{
+	struct hlist_head *bucket;
+	struct hlist_node *node;
+	struct vma_pair *pair;
+
+	bucket = vma_pair_bucket(ksm_vma_pair_hash, ksm_vma_pair_hash_bits,
+				 slot1, slot2);
+	hlist_for_each_entry(pair, node, bucket, hlist) {
+		if (pair->slot[0] == slot1 && pair->slot[1] == slot2)
+			return pair;
+	}
+
+	return NULL;
+}
+
+static inline void enter_inter_vma_table(struct vma_slot *slot)
+{
+	if (list_empty(&slot->intertab_list))
+		list_add_tail(&slot->intertab_list, &ksm_intertab_slots);
+}
+
+static struct vma_pair *alloc_vma_pair(struct vma_slot *slot1,
+				       struct vma_slot *slot2)
+{
+	struct vma_pair *pair;
+
+	if (ksm_vma_pair_num >= (2UL << ksm_vma_pair_hash_bits) &&
+	    ksm_vma_pair_hash_bits < KSM_VMA_PAIR_HASH_BITS_MAX)
+		vma_pair_hash_grow();
+
+	pair = kmem_cache_zalloc(vma_pair_cache, GFP_KERNEL);
+	if (!pair)
+		return NULL;
+
+	pair->slot[0] = slot1;
+	pair->slot[1] = slot2;
+	hlist_add_head(&pair->hlist,
+		       vma_pair_bucket(ksm_vma_pair_hash,
+				       ksm_vma_pair_hash_bits, slot1, slot2));
+	list_add(&pair->lo_list, &slot1->pairs_lo);
+	if (slot1 != slot2)
+		list_add(&pair->hi_list, &slot2->pairs_hi);
+	else
+		INIT_LIST_HEAD(&pair->hi_list);
+	ksm_vma_pair_num++;
+
+	enter_inter_vma_table(slot1);
+	enter_inter_vma_table(slot2);
+
+	return pair;
+}
+
+static inline void free_vma_pair(struct vma_pair *pair)
+{
+	hlist_del(&pair->hlist);
+	list_del(&pair->lo_list);
+	list_del(&pair->hi_list);
+	BUG_ON(!ksm_vma_pair_num);
+	ksm_vma_pair_num--;
+	kmem_cache_free(vma_pair_cache, pair);
+}
+
+static inline void inc_vma_intertab_pair(struct vma_slot *slot1,
+					 struct vma_slot *slot2)
+{
+	struct vma_pair *pair;
+
+	/* a slot torn down still has rmap_items in the trees for a while */
+	if (unlikely(!slot1->rung || !slot2->rung))
+		return;
+
+	if (slot1 > slot2)
+		swap(slot1, slot2);
+
+	pair = lookup_vma_pair(slot1, slot2);
+	if (!pair) {
+		/* Losing a count only makes the dedup ratio less precise */
+		pair = alloc_vma_pair(slot1, slot2);
+		if (!pair)
+			return;
+	}
+
+	pair->dup_num++;
+	BUG_ON(!pair->dup_num);
+}
+
+static inline void dec_vma_intertab_pair(struct vma_slot *slot1,
+					 struct vma_slot *slot2)
+{
+	struct vma_pair *pair;
+
+	if (slot1 > slot2)
+		swap(slot1, slot2);
+
+	pair = lookup_vma_pair(slot1, slot2);
+	if (pair && pair->dup_num)
+		pair->dup_num--;
+}
+
+static void hold_anon_vma(struct rmap_item *rmap_item,
+			  struct anon_vma *anon_vma)
+{
+	rmap_item->anon_vma = anon_vma;
+	get_anon_vma(anon_vma);
+}
+
+
+/*
+ * The pairs counted for one page appended to a stable node are at most
+ * KSM_PAIR_FANOUT, the node_vmas updated the latest. The duplication found
+ * on pages shared wider goes to dup_wide of the slot, extrapolated as
+ * its own at the end of the round.
+ */
+#define KSM_PAIR_FANOUT		64
+
+/*
+ * node_vma_find() - the node_vma of @slot on @stable_node, NULL if none
+ * and then *@link and *@parent are where it is to be linked.
+ */
+static struct node_vma *node_vma_find(struct stable_node *stable_node,
+				      struct vma_slot *slot,
+				      struct rb_node ***link,
+				      struct rb_node **parent)
+{
+	struct rb_node **new = &stable_node->node_vmas.rb_node;
+	unsigned long key = (unsigned long)slot;
+	struct node_vma *node_vma;
+
+	*parent = NULL;
+	while (*new) {
+		node_vma = rb_entry(*new, struct node_vma, node);
+		*parent = *new;
+		if (key < node_vma->key)
+			new = &(*new)->rb_left;
+		else if (key > node_vma->key)
+			new = &(*new)->rb_right;
+		else
+			return node_vma;
+	}
+
+	*link = new;
+	return NULL;
+}
+
+/**
+ * stable_tree_append() - append a rmap_item to a stable node. Deduplication
+ * ratio statistics is done in this function.
+ *
+ * The node_vmas updated this round are kept at the head of the hlist, so
+ * that the pairs are counted without walking all the others: a slot
+ * finding a page again, or a copy of it, counts a pair with each of the
+ * other slots which found it this round, once per round.
+ *
+ * @return 0, or -ENOMEM if no node_vma could be allocated for the slot: the
+ * rmap_item is left out and the caller breaks its COW.
+ */
+static int stable_tree_append(struct rmap_item *rmap_item,
+			      struct stable_node *stable_node)
+{
+	struct node_vma *node_vma, *iter, *new_node_vma = NULL;
+	struct vma_slot *slot = rmap_item->slot;
+	struct rb_node **link = NULL, *parent;
+	struct hlist_node *hlist;
+	int pairs = 0;
+
+	BUG_ON(!stable_node);
+	node_vma = node_vma_find(stable_node, slot, &link, &parent);
+	if (!node_vma) {
+		new_node_vma = alloc_node_vma();
+		if (!new_node_vma)
+			return -ENOMEM;
+	}
+
+	rmap_item->address |= STABLE_FLAG;
+	rmap_item->append_round = ksm_scan_round;
+	stable_node->rmap_nr++;
+
+	if (hlist_empty(&stable_node->hlist))
+		ksm_pages_shared++;
+	else
+		ksm_pages_sharing++;
+
+	/* an inner duplicate of the slot this round is not counted again */
+	if (node_vma && node_vma->last_update == ksm_scan_round)
+		goto node_vma_ok;
+
+	hlist_for_each_entry(iter, hlist, &stable_node->hlist, hlist) {
+		if (iter->last_update != ksm_scan_round)
+			break;
+		if (++pairs > KSM_PAIR_FANOUT) {
+			slot->dup_wide++;
+			enter_inter_vma_table(slot);
+			break;
+		}
+		inc_vma_intertab_pair(slot, iter->slot);
+	}
+
+	if (node_vma) {
+		hlist_del(&node_vma->hlist);
+	} else {
+		/* no same vma already in node, use the new node_vma */
+		node_vma = new_node_vma;
+		node_vma->head = stable_node;
+		node_vma->slot = slot;
+		rb_link_node(&node_vma->node, parent, link);
+		rb_insert_color(&node_vma->node, &stable_node->node_vmas);
+	}
+	hlist_add_head(&node_vma->hlist, &stable_node->hlist);
+
+node_vma_ok: /* ok, ready to add to the list */
+	rmap_item->head = node_vma;
+	hlist_add_head(&rmap_item->hlist, &node_vma->rmap_hlist);
+	node_vma->last_update = ksm_scan_round;
+	hold_anon_vma(rmap_item, rmap_item->slot->vma->anon_vma);
+	rmap_item->slot->pages_merged++;
+	rmap_item->slot->pages_merged_total++;
+	rmap_item->slot->pages_ksm++;
+	mem_cgroup_ksm_stat(rmap_item->slot->memcg,
+			    MEM_CGROUP_KSM_PAGES_MERGED, 1);
+	return 0;
+}
+
+/*
+ * We use break_ksm to break COW on a ksm page: it's a stripped down
+ *
+ *	if (get_user_pages(current, mm, addr, 1, 1, 1, &page, NULL) == 1)
+ *		put_page(page);
+ *
+ * but taking great care only to touch a ksm page, in a VM_MERGEABLE vma,
+ * in case the application has unmapped and remapped mm,addr meanwhile.
+ * Could a ksm page appear anywhere else?  Actually yes, in a VM_PFNMAP
+ * mmap of /dev/mem or /dev/kmem, where we would not want to touch it.
+ */
+static int break_ksm(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct page *page;
+	int ret = 0;
+
+	do {
+		cond_resched();
+		page = follow_page(vma, addr, FOLL_GET);
+		if (IS_ERR_OR_NULL(page))
+			break;
+		if (PageKsm(page)) {
+			ret = handle_mm_fault(vma->vm_mm, vma, addr,
+					      FAULT_FLAG_WRITE);
+		} else
+			ret = VM_FAULT_WRITE;
+		put_page(page);
+	} while (!(ret & (VM_FAULT_WRITE | VM_FAULT_SIGBUS | VM_FAULT_OOM)));
+	/*
+	 * We must loop because handle_mm_fault() may back out if there's
+	 * any difficulty e.g. if pte accessed bit gets updated concurrently.
+	 *
+	 * VM_FAULT_WRITE is what we have been hoping for: it indicates that
+	 * COW has been broken, even if the vma does not permit VM_WRITE;
+	 * but note that a concurrent fault might break PageKsm for us.
+	 *
+	 * VM_FAULT_SIGBUS could occur if we race with truncation of the
+	 * backing file, which also invalidates anonymous pages: that's
+	 * okay, that truncation will have unmapped the PageKsm for us.
+	 *
+	 * VM_FAULT_OOM: at the time of writing (late July 2009), setting
+	 * aside mem_cgroup limits, VM_FAULT_OOM would only be set if the
+	 * current task has TIF_MEMDIE set, and will be OOM killed on return
+	 * to user; and ksmd, having no mm, would never be chosen for that.
+	 *
+	 * But if the mm is in a limited mem_cgroup, then the fault may fail
+	 * with VM_FAULT_OOM even if the current task is not TIF_MEMDIE; and
+	 * even ksmd can fail in this way - though it's usually breaking ksm
+	 * just to undo a merge it made a moment before, so unlikely to oom.
+	 *
+	 * That's a pity: we might therefore have more kernel pages allocated
+	 * than we're counting as nodes in the stable tree; but ksm_do_scan
+	 * will retry to break_cow on each pass, so should recover the page
+	 * in due course.  The important thing is to not let VM_MERGEABLE
+	 * be cleared while any such pages might remain in the area.
+	 */
+	return (ret & VM_FAULT_OOM) ? -ENOMEM : 0;
+}
+
+static void break_cow(struct rmap_item *rmap_item)
+{
+	struct vm_area_struct *vma = rmap_item->slot->vma;
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long addr = get_rmap_addr(rmap_item);
+
+	if (ksm_test_exit(mm))
+		goto out;
+
+	trace_ksm_break_cow(rmap_item->slot, addr);
+	break_ksm(vma, addr);
+out:
+	return;
+}
+
+/*
+ * Though it's very tempting to unmerge in_stable_tree(rmap_item)s rather
+ * than check every pte of a given vma, the locking doesn't quite work for
+ * that - an rmap_item is assigned to the stable tree after inserting ksm
+ * page and upping mmap_sem.  Nor does it fit with the way we skip dup'ing
+ * rmap_items from parent to child at fork time (so as not to waste time
+ * if exit comes before the next scan reaches it).
+ *
+ * Similarly, although we'd like to remove rmap_items (so updating counts
+ * and freeing memory) when unmerging an area, it's easier to leave that
+ * to the next pass of ksmd - consider, for example, how ksmd might be
+ * in cmp_and_merge_page on one of the rmap_items we would be removing.
+ */
+#define KSM_UNMERGE_BATCH	64
+
+/*
+ * ksm_pages_in_pmd() - the addresses of the KSM pages mapped from @addr on,
+ * in the page table of @addr and below @end, at most KSM_UNMERGE_BATCH of
+ * them. *next is where to look for more.
+ */
+static int ksm_pages_in_pmd(struct vm_area_struct *vma, unsigned long addr,
+			    unsigned long end, unsigned long *addrs,
+			    unsigned long *next)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *start_pte, *pte;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	int nr = 0;
+
+	*next = pmd_addr_end(addr, end);
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		return 0;
+	pud = pud_offset(pgd, addr);
+	if (!pud_present(*pud))
+		return 0;
+	pmd = pmd_offset(pud, addr);
+	/* a huge pmd maps no KSM page */
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd))
+		return 0;
+
+	start_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	for (; addr < *next; addr += PAGE_SIZE, pte++) {
+		if (!pte_present(*pte))
+			continue;
+		page = vm_normal_page(vma, addr, *pte);
+		if (!page || !PageKsm(page))
+			continue;
+		addrs[nr++] = addr;
+		if (nr == KSM_UNMERGE_BATCH) {
+			*next = addr + PAGE_SIZE;
+			break;
+		}
+	}
+	pte_unmap_unlock(start_pte, ptl);
+
+	return nr;
+}
+
+/*
+ * unmerge_ksm_pages() - break the COW of every KSM page in [start, end) of
+ * @vma. The page tables are walked once and only the KSM pages found there
+ * go through break_ksm(), most of a big area is usually not merged.
+ */
+inline int unmerge_ksm_pages(struct vm_area_struct *vma,
+		      unsigned long start, unsigned long end)
+{
+	unsigned long addrs[KSM_UNMERGE_BATCH];
+	unsigned long addr, next;
+	int i, nr, err = 0;
+
+	for (addr = start; addr < end && !err; addr = next) {
+		if (ksm_test_exit(vma->vm_mm))
+			break;
+		if (signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+
+		nr = ksm_pages_in_pmd(vma, addr, end, addrs, &next);
+		for (i = 0; i < nr && !err; i++)
+			err = break_ksm(vma, addrs[i]);
+		cond_resched();
+	}
+	return err;
+}
+
+struct ksm_unmerge_work {
+	struct work_struct work;
+	struct vma_slot **slots;
+	unsigned long nr;
+	atomic_long_t *next;
+	int err; /* the first one of the slots of this worker */
+};
+
+static void ksm_unmerge_worker(struct work_struct *work)
+{
+	struct ksm_unmerge_work *w = container_of(work,
+						  struct ksm_unmerge_work,
+						  work);
+	struct vma_slot *slot;
+	unsigned long i;
+	int err, tries;
+
+	while ((i = atomic_long_inc_return(w->next) - 1) < w->nr) {
+		slot = w->slots[i];
+		/*
+		 * A scanner may hold the mmap_sem while waiting for the mutex
+		 * we hold, don't wait for it forever.
+		 */
+		for (tries = 0; tries < HZ; tries++) {
+			err = try_down_read_slot_mmap_sem(slot);
+			if (err != -EBUSY)
+				break;
+			schedule_timeout_uninterruptible(1);
+		}
+		if (err == -EBUSY) {
+			atomic_long_inc(&ksm_unmerge_slots_skipped);
+			if (!w->err)
+				w->err = err;
+		}
+		if (err)
+			continue;
+
+		err = unmerge_ksm_pages(slot->vma, slot->vstart,
+					slot_end(slot));
+		up_read(&slot->vma->vm_mm->mmap_sem);
+		if (err && !w->err)
+			w->err = err;
+	}
+}
+
+/*
+ * unmerge_all_slots() - for run=2, unmerge every slot on the ladder, with
+ * ksm_unmerge_workers running in parallel. Called with ksm_thread_mutex
+ * held: the ladder cannot change under the workers, the slots only leave
+ * it once ksmd gets the mutex back and cleans them up.
+ *
+ * @return 0, or the first error of the workers: -EBUSY for a slot whose
+ * mmap_sem could not be had, the slots left merged are counted in
+ * ksm_unmerge_slots_skipped.
+ */
+static int unmerge_all_slots(void)
+{
+	struct ksm_unmerge_work *works;
+	struct vma_slot **slots, *slot;
+	atomic_long_t next = ATOMIC_LONG_INIT(0);
+	unsigned long nr = 0;
+	int i, nr_workers, err = 0;
+
+	if (!ksm_vma_slot_num)
+		return 0;
+
+	slots = vmalloc(ksm_vma_slot_num * sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < ksm_scan_ladder_size; i++)
+		list_for_each_entry(slot, &ksm_scan_ladder[i].vma_list,
+				    ksm_list) {
+			if (nr < ksm_vma_slot_num)
+				slots[nr++] = slot;
+		}
+
+	nr_workers = min_t(unsigned long, ksm_unmerge_workers, nr);
+	works = kcalloc(nr_workers, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		works[i].slots = slots;
+		works[i].nr = nr;
+		works[i].next = &next;
+		INIT_WORK(&works[i].work, ksm_unmerge_worker);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		flush_work(&works[i].work);
+		if (!err)
+			err = works[i].err;
+	}
+
+	kfree(works);
+out:
+	vfree(slots);
+	return err;
+}
+
+/* the ranges ksm_vma_cowed() found thrashing, for ksm_cow_unmerge_worker() */
+struct ksm_cow_unmerge {
+	struct mm_struct *mm;
+	unsigned long start;
+	unsigned long end;
+};
+
+static struct ksm_cow_unmerge ksm_cow_unmerge_queue[KSM_COW_UNMERGE_QUEUE];
+static unsigned int ksm_cow_unmerge_head, ksm_cow_unmerge_tail;
+static DEFINE_SPINLOCK(ksm_cow_unmerge_lock);
+
+static void ksm_cow_unmerge_worker(struct work_struct *work);
+static DECLARE_WORK(ksm_cow_unmerge_work, ksm_cow_unmerge_worker);
+
+/*
+ * ksm_cow_unmerge_range() - have [@start, @end) of @mm unmerged in the
+ * background, called from the COW fault with the mmap_sem held. The mm is
+ * pinned by mm_count only, it may exit before the worker gets to it.
+ */
+static void ksm_cow_unmerge_range(struct mm_struct *mm, unsigned long start,
+				  unsigned long end)
+{
+	struct ksm_cow_unmerge *req;
+
+	spin_lock(&ksm_cow_unmerge_lock);
+	if (ksm_cow_unmerge_head - ksm_cow_unmerge_tail ==
+	    KSM_COW_UNMERGE_QUEUE) {
+		ksm_cow_unmerge_dropped++;
+		spin_unlock(&ksm_cow_unmerge_lock);
+		return;
+	}
+	req = &ksm_cow_unmerge_queue[ksm_cow_unmerge_head++ %
+				     KSM_COW_UNMERGE_QUEUE];
+	atomic_inc(&mm->mm_count);
+	req->mm = mm;
+	req->start = start;
+	req->end = end;
+	ksm_cow_unmerge_ranges++;
+	spin_unlock(&ksm_cow_unmerge_lock);
+
+	queue_work(system_unbound_wq, &ksm_cow_unmerge_work);
+}
+
+static void ksm_cow_unmerge_worker(struct work_struct *work)
+{
+	struct ksm_cow_unmerge req;
+	struct vm_area_struct *vma;
+
+	for (;;) {
+		spin_lock(&ksm_cow_unmerge_lock);
+		if (ksm_cow_unmerge_tail == ksm_cow_unmerge_head) {
+			spin_unlock(&ksm_cow_unmerge_lock);
+			break;
+		}
+		req = ksm_cow_unmerge_queue[ksm_cow_unmerge_tail++ %
+					    KSM_COW_UNMERGE_QUEUE];
+		spin_unlock(&ksm_cow_unmerge_lock);
+
+		if (!atomic_inc_not_zero(&req.mm->mm_users))
+			goto drop;
+
+		down_read(&req.mm->mmap_sem);
+		vma = find_vma(req.mm, req.start);
+		/* only if the range is still in the vma it was heated in */
+		if (vma && vma->vm_start <= req.start &&
+		    vma->vm_end >= req.end && (vma->vm_flags & VM_MERGEABLE))
+			unmerge_ksm_pages(vma, req.start, req.end);
+		up_read(&req.mm->mmap_sem);
+		mmput(req.mm);
+drop:
+		mmdrop(req.mm);
+	}
+}
+
+static inline struct remerge_memo *remerge_memo_of(struct rmap_item *item)
+{
+	return &ksm_remerge_memo[hash_ptr(item, KSM_REMERGE_BITS)];
+}
+
+/* the memo of @rmap_item if it has one not too old, NULL otherwise */
+static struct remerge_memo *remerge_memo_find(struct rmap_item *rmap_item)
+{
+	struct remerge_memo *memo = remerge_memo_of(rmap_item);
+
+	if (memo->item != rmap_item ||
+	    (u32)ksm_scan_round - memo->round >= ksm_remerge_rounds)
+		return NULL;
+	return memo;
+}
+
+/* @rmap_item, still in the stable tree, is found COWed: note its ksm page */
+static void remerge_memo_note(struct rmap_item *rmap_item)
+{
+	struct stable_node *stable_node = rmap_item->head->head;
+	struct tree_node *tree_node = stable_node->tree_node;
+	struct remerge_memo *memo;
+
+	/* in the hell list, or hashed at the strength of the old tree */
+	if (!ksm_remerge_rounds || !tree_node ||
+	    tree_node->root < root_stable_treep ||
+	    tree_node->root >= root_stable_treep + MAX_NUMNODES)
+		return;
+
+	memo = remerge_memo_of(rmap_item);
+	memo->item = rmap_item;
+	memo->kpfn = stable_node->kpfn;
+	memo->hash = tree_node->hash;
+	memo->strength = hash_strength;
+	memo->round = ksm_scan_round;
+}
+
+/*
+ * remerge_memo_page() - the ksm page noted for @rmap_item, with a reference,
+ * if it is still one in the stable tree, hashed to the @hash of the page
+ * now, with room for another rmap_item. NULL otherwise.
+ */
+static struct page *remerge_memo_page(struct rmap_item *rmap_item, u32 hash)
+{
+	struct remerge_memo *memo = remerge_memo_find(rmap_item);
+	struct stable_node *stable_node;
+	struct page *page;
+
+	if (!memo || memo->strength != hash_strength || memo->hash != hash)
+		return NULL;
+	memo->item = NULL;	/* one try only */
+
+	if (!pfn_valid(memo->kpfn) ||
+	    get_kpfn_nid(memo->kpfn) != page_tree_nid(rmap_item->page))
+		return NULL;
+
+	page = pfn_to_page(memo->kpfn);
+	if (!PageKsm(page) || !get_page_unless_zero(page))
+		return NULL;
+
+	stable_node = page_stable_node(page);
+	if (!PageKsm(page) || !stable_node ||
+	    stable_node->kpfn != memo->kpfn || !stable_node->tree_node ||
+	    (ksm_max_page_sharing &&
+	     stable_node->rmap_nr >= ksm_max_page_sharing)) {
+		put_page(page);
+		return NULL;
+	}
+
+	return page;
+}
+
+/*
+ * cmp_and_estimate_page() - cmp_and_merge_page() of KSM_RUN_ESTIMATE: count
+ * @rmap_item as merged in its slot if its page is zero-filled or identical
+ * to one of the stable tree or of the unstable tree, or else insert it in
+ * the unstable tree. Hash collisions are not sorted out in the subtrees.
+ */
+static void cmp_and_estimate_page(struct rmap_item *rmap_item, u32 hash,
+				  int nolock)
+{
+	struct vma_slot *slot = rmap_item->slot;
+	struct page *page = rmap_item->page;
+	struct rmap_item *tree_rmap_item;
+	struct page *kpage;
+	int identical;
+
+	if (hash == zero_hash_table[hash_strength] &&
+	    pages_identical(page, ZERO_PAGE(0))) {
+		slot->pages_merged++;
+		return;
+	}
+
+	kpage = stable_tree_search(rmap_item, hash);
+	if (kpage) {
+		identical = pages_identical(page, kpage);
+		put_page(kpage);
+		if (identical) {
+			/* what it shares with is not known here */
+			slot->pages_merged++;
+			inc_vma_intertab_pair(slot, slot);
+			return;
+		}
+	}
+
+	tree_rmap_item = unstable_tree_search_insert(rmap_item, hash, nolock);
+	if (!tree_rmap_item)
+		return;
+
+	if (pages_identical(page, tree_rmap_item->page)) {
+		slot->pages_merged++;
+		inc_vma_intertab_pair(slot, tree_rmap_item->slot);
+	}
+	put_page(tree_rmap_item->page);
+	if (!nolock)
+		up_read(&tree_rmap_item->slot->vma->vm_mm->mmap_sem);
+}
+
+#ifdef CONFIG_DEBUG_FS
+/*
+ * Sampled page hash traces, read out of debugfs ksm/hash_trace for
+ * tools/ksm/ksmsim to replay the ladder and hash strength policies offline.
+ * A page is sampled when its full strength hash is a multiple of
+ * ksm_hash_trace_rate, so that the copies of a content are all sampled or
+ * none of them, a COW when the hash of its page index is. 0 disables it.
+ * The records not read yet are dropped, and counted, once it is full.
+ */
+#define KSM_TRACE_LEVELS	8
+#define KSM_TRACE_SIZE		16384
+
+enum {
+	KSM_TRACE_PAGE,
+	KSM_TRACE_COW,
+};
+
+/* the layout tools/ksm/ksmsim.c reads, keep both in sync */
+struct ksm_trace_rec {
+	u64 round;
+	u64 slot;		/* only an ID */
+	u32 type;
+	u32 index;		/* of the page in the slot */
+	u32 slot_pages;
+	u32 rung;
+	u32 scan_ratio;		/* of the rung */
+	u32 hash_strength;	/* the current one */
+	u32 hash[KSM_TRACE_LEVELS];	/* at HASH_STRENGTH_FULL >> i */
+};
+
+static unsigned int ksm_hash_trace_rate;
+static struct ksm_trace_rec *ksm_trace_buf;
+static unsigned long ksm_trace_head, ksm_trace_tail;
+static u64 ksm_trace_lost;
+static DEFINE_SPINLOCK(ksm_trace_lock);
+
+static void ksm_trace_add(struct ksm_trace_rec *rec)
+{
+	spin_lock(&ksm_trace_lock);
+	if (ksm_trace_head - ksm_trace_tail < KSM_TRACE_SIZE)
+		ksm_trace_buf[ksm_trace_head++ % KSM_TRACE_SIZE] = *rec;
+	else
+		ksm_trace_lost++;
+	spin_unlock(&ksm_trace_lock);
+}
+
+static void ksm_trace_slot(struct ksm_trace_rec *rec, struct vma_slot *slot,
+			   unsigned long address, u32 type)
+{
+	struct scan_rung *rung = slot->rung;
+
+	rec->round = ksm_scan_round;
+	rec->slot = (unsigned long)slot;
+	rec->type = type;
+	rec->index = (address - slot->vstart) >> PAGE_SHIFT;
+	rec->slot_pages = slot->pages;
+	rec->rung = rung ? rung - ksm_scan_ladder : 0;
+	rec->scan_ratio = rung ? rung->scan_ratio : 0;
+	rec->hash_strength = hash_strength;
+}
+
+static void ksm_trace_page(struct rmap_item *rmap_item)
+{
+	unsigned int rate = ACCESS_ONCE(ksm_hash_trace_rate);
+	struct ksm_trace_rec rec;
+	void *addr;
+	int i;
+
+	if (!rate || !ksm_trace_buf)
+		return;
+
+	addr = ksm_map_page(rmap_item->page, KM_USER0);
+	rec.hash[0] = random_sample_hash(addr, HASH_STRENGTH_FULL);
+	if (rec.hash[0] % rate) {
+		ksm_unmap_page(addr, KM_USER0);
+		return;
+	}
+	for (i = 1; i < KSM_TRACE_LEVELS; i++)
+		rec.hash[i] = random_sample_hash(addr, HASH_STRENGTH_FULL >> i);
+	ksm_unmap_page(addr, KM_USER0);
+
+	ksm_trace_slot(&rec, rmap_item->slot, get_rmap_addr(rmap_item),
+		       KSM_TRACE_PAGE);
+	ksm_trace_add(&rec);
+}
+
+static void ksm_trace_cow(struct vma_slot *slot, unsigned long address)
+{
+	unsigned int rate = ACCESS_ONCE(ksm_hash_trace_rate);
+	struct ksm_trace_rec rec;
+
+	if (!rate || !ksm_trace_buf ||
+	    hash_long(address >> PAGE_SHIFT, 32) % rate)
+		return;
+
+	memset(rec.hash, 0, sizeof(rec.hash));
+	ksm_trace_slot(&rec, slot, address & PAGE_MASK, KSM_TRACE_COW);
+	ksm_trace_add(&rec);
+}
+#else
+static inline void ksm_trace_page(struct rmap_item *rmap_item)
+{
+}
+
+static inline void ksm_trace_cow(struct vma_slot *slot, unsigned long address)
+{
+}
+#endif /* CONFIG_DEBUG_FS */
+
+/*
+ * cmp_and_merge_page() - first see if page can be merged into the stable
+ * tree; if not, compare hash to previous and if it's the same, see if page
+ * can be inserted into the unstable tree, or merged with a page already there
+ * and both transferred to the stable tree.
+ *
+ * @rmap_item: the reverse mapping into the virtual address of this page
+ * @hash: the hash value of rmap_item->page at current hash_strength
+ */
+static void cmp_and_merge_page(struct rmap_item *rmap_item, u32 hash)
+{
+	struct rmap_item *tree_rmap_item;
+	struct page *page;
+	struct page *kpage = NULL;
+	struct anon_vma *tree_anon_vma = NULL;
+	u32 hash_max;
+	int err, undo = 0;
+	unsigned int success1, success2;
+	struct stable_node *snode;
+	int cmp;
+	struct rb_node *parent = NULL, **new;
+	int stable_err = -1, unstable_err = -1;
+	int nolock = ACCESS_ONCE(ksm_unstable_nolock);
+	u64 start = local_clock(), t, tree_ns = 0;
+
+	if (rmap_item->address & STABLE_FLAG)
+		remerge_memo_note(rmap_item);
+	remove_rmap_item_from_tree(rmap_item);
+
+	page = rmap_item->page;
+	ksm_pages_scanned++;
+
+	if (ksm_run & KSM_RUN_ESTIMATE) {
+		cmp_and_estimate_page(rmap_item, hash, nolock);
+		goto out;
+	}
+
+	/* Zero-filled pages go to the zero page, not to the stable tree */
+	if (ksm_use_zero_pages && hash == zero_hash_table[hash_strength] &&
+	    !try_to_merge_zero_page(rmap_item)) {
+		ksm_pages_zero_merged++;
+		stable_err = 0;
+		goto out;
+	}
+
+	/* back to the content of the ksm page it was COWed from? */
+	kpage = remerge_memo_page(rmap_item, hash);
+	if (kpage) {
+		err = try_to_merge_with_ksm_page(rmap_item, kpage, hash);
+		if (!err) {
+			stable_err = 0;
+			ksm_remerges++;
+			lock_page(kpage);
+			if (stable_tree_append(rmap_item,
+					       page_stable_node(kpage)))
+				break_cow(rmap_item);
+			unlock_page(kpage);
+			put_page(kpage);
+			goto out;
+		}
+		put_page(kpage);
+	}
+
+	/* We first start with searching the page inside the stable tree */
+	t = local_clock();
+	kpage = stable_tree_search(rmap_item, hash);
+	tree_ns = local_clock() - t;
+	if (kpage) {
+		err = try_to_merge_with_ksm_page(rmap_item, kpage,
+						 hash);
+		stable_err = err;
+		if (!err) {
+			/*
+			 * The page was successfully merged, add
+			 * its rmap_item to the stable tree.
+			 * page lock is needed because it's
+			 * racing with try_to_unmap_ksm(), etc.
+			 */
+			lock_page(kpage);
+			if (stable_tree_append(rmap_item,
+					       page_stable_node(kpage)))
+				break_cow(rmap_item);
+			unlock_page(kpage);
+			put_page(kpage);
+			goto out; /* success */
+		}
+		put_page(kpage);
+
+		/*
+		 * if it's a collision and it has been search in sub-rbtree
+		 * (hash_max != 0), we want to abort, because if it is
+		 * successfully merged in unstable tree, the collision trends to
+		 * happen again.
+		 */
+		if (err == MERGE_ERR_COLLI && rmap_item->hash_max)
+			goto out;
+	}
+
+	t = local_clock();
+	tree_rmap_item =
+		unstable_tree_search_insert(rmap_item, hash, nolock);
+	tree_ns += local_clock() - t;
+	if (tree_rmap_item) {
+		/*
+		 * Keeping the tree page write protects the page of the other
+		 * mm in place, which needs its mmap_sem: without it, merge the
+		 * usual way round.
+		 */
+		kpage = page;
+		if (keep_tree_page(page, tree_rmap_item->page) &&
+		    (!nolock ||
+		     !try_down_read_slot_mmap_sem(tree_rmap_item->slot))) {
+			nolock = 0;
+			kpage = tree_rmap_item->page;
+		}
+
+		/*
+		 * Without its mmap_sem, the merge of the tree page can only be
+		 * undone through its anon_vma, which is pinned for that.
+		 */
+		if (kpage == page && nolock)
+			tree_anon_vma = page_lock_anon_vma(tree_rmap_item->page);
+		if (tree_anon_vma) {
+			get_anon_vma(tree_anon_vma);
+			page_unlock_anon_vma(tree_anon_vma);
+		}
+
+		if (kpage == page && nolock && !tree_anon_vma)
+			err = MERGE_ERR_PGERR;
+		else if (kpage == page)
+			err = try_to_merge_two_pages(rmap_item, tree_rmap_item,
+						     hash, nolock);
+		else
+			err = try_to_merge_two_pages(tree_rmap_item, rmap_item,
+						     hash, 0);
+		unstable_err = err;
+		/*
+		 * As soon as we merge this page, we want to remove the
+		 * rmap_item of the page we have merged with from the unstable
+		 * tree, and insert it instead as new node in the stable tree.
+		 */
+		if (!err) {
+			if (kpage != page)
+				ksm_merges_kept_tree++;
+			remove_rmap_item_from_tree(tree_rmap_item);
+			lock_page(kpage);
+			snode = stable_tree_insert(kpage, hash,
+						   rmap_item, tree_rmap_item,
+						   &success1, &success2);
+
+			if (success1 && stable_tree_append(rmap_item, snode))
+				success1 = 0;
+			if (!success1)
+				break_cow(rmap_item);
+
+			if (success2 &&
+			    stable_tree_append(tree_rmap_item, snode))
+				success2 = 0;
+			if (!success2 && !nolock)
+				break_cow(tree_rmap_item);
+			else if (!success2 && !try_down_read_slot_mmap_sem(
+						tree_rmap_item->slot)) {
+				break_cow(tree_rmap_item);
+				up_read(&tree_rmap_item->slot->vma->vm_mm->mmap_sem);
+			} else if (!success2)
+				undo = 1;
+
+			unlock_page(kpage);
+
+			/* else map the tree page back, under the anon_vma lock */
+			if (undo) {
+				lock_page(tree_rmap_item->page);
+				undo_merge_nolock(tree_rmap_item, kpage,
+						  tree_rmap_item->page,
+						  tree_anon_vma);
+				unlock_page(tree_rmap_item->page);
+			}
+
+		} else if (err == MERGE_ERR_COLLI) {
+			if (tree_rmap_item->tree_node->count == 1) {
+				rmap_item_hash_max(tree_rmap_item,
+				tree_rmap_item->tree_node->hash);
+			} else
+				BUG_ON(!(tree_rmap_item->hash_max));
+
+			hash_max = rmap_item_hash_max(rmap_item, hash);
+			cmp = hash_cmp(hash_max, tree_rmap_item->hash_max);
+			parent = &tree_rmap_item->node;
+			if (cmp < 0)
+				new = &parent->rb_left;
+			else if (cmp > 0)
+				new = &parent->rb_right;
+			else
+				goto put_up_out;
+
+			rmap_item->tree_node = tree_rmap_item->tree_node;
+			rmap_item->address |= UNSTABLE_FLAG;
+			rmap_item->append_round = ksm_scan_round;
+			rb_link_node(&rmap_item->node, parent, new);
+			rb_insert_color(&rmap_item->node,
+					&tree_rmap_item->tree_node->sub_root);
+			rmap_item->tree_node->count++;
+		} else if (err == MERGE_ERR_CHANGED &&
+			   tree_rmap_item->append_round != (u32)ksm_scan_round) {
+			/* most likely the kept one that was written since */
+			remove_rmap_item_from_tree(tree_rmap_item);
+		}
+put_up_out:
+		if (tree_anon_vma)
+			drop_anon_vma(tree_anon_vma);
+		put_page(tree_rmap_item->page);
+		if (!nolock)
+			up_read(&tree_rmap_item->slot->vma->vm_mm->mmap_sem);
+	}
+
+out:
+	if (stable_err != -1 || unstable_err != -1)
+		rmap_item->slot->hash_hits++;
+	if (stable_err == MERGE_ERR_COLLI || unstable_err == MERGE_ERR_COLLI)
+		rmap_item->slot->hash_colli++;
+
+	t = local_clock() - start;
+	ksm_hist_add(KSM_HIST_TREE, tree_ns);
+	ksm_hist_add(KSM_HIST_MERGE, t - tree_ns);
+	ksm_trace_page(rmap_item);
+	trace_ksm_cmp_and_merge_page(rmap_item->slot, rmap_item->slot->mm,
+				     get_rmap_addr(rmap_item), hash,
+				     stable_err, unstable_err, t, tree_ns);
+}
+
+
+
+
+static inline unsigned long get_pool_index(struct vma_slot *slot,
+					   unsigned long index)
+{
+	unsigned long pool_index;
+
+	pool_index = (sizeof(struct rmap_list_entry *) * index) >> PAGE_SHIFT;
+	if (pool_index >= slot->pool_size)
+		BUG();
+	return pool_index;
+}
+
+static inline unsigned long index_page_offset(unsigned long index)
+{
+	return offset_in_page(sizeof(struct rmap_list_entry *) * index);
+}
+
+/*
+ * The many tiny vmas of interpreters and allocators would each take a pool
+ * page for a few entries: a slot of up to KSM_SMALL_POOL_PAGES pages has
+ * its entries kmalloc'ed instead, sharing the slab pages with the others.
+ * A slot of one pool keeps its rmap_list_pool, pool_counts and cow_heat in
+ * itself, see ksm_vma_enter().
+ */
+#define KSM_SMALL_POOL_PAGES	(PAGE_SIZE / 4 / sizeof(struct rmap_list_entry))
+
+static inline int slot_small_pool(struct vma_slot *slot)
+{
+	return slot->pages <= KSM_SMALL_POOL_PAGES;
+}
+
+/* the entries of the pool of @slot listed in the loops over its pools */
+static inline unsigned long pool_entries_nr(struct vma_slot *slot)
+{
+	if (slot_small_pool(slot))
+		return slot->pages;
+
+	return PAGE_SIZE / sizeof(struct rmap_list_entry);
+}
+
+/*
+ * The pages of the rmap_list_pools are recycled through a small cache of free
+ * pages instead of going back and forth to the buddy allocator as slots are
+ * sorted and freed. The cache is refilled at the end of each round, so the
+ * scan path only takes pages from it. They are never highmem pages, so they
+ * are accessed through page_address() without kmap.
+ */
+#define KSM_INDEX_POOL_LOW	64
+#define KSM_INDEX_POOL_MAX	256
+
+static DEFINE_SPINLOCK(ksm_index_pool_lock);
+static LIST_HEAD(ksm_index_pool);
+static unsigned long ksm_index_pool_pages;
+
+static struct page *alloc_index_page(void)
+{
+	struct page *page = NULL;
+
+	spin_lock(&ksm_index_pool_lock);
+	if (!list_empty(&ksm_index_pool)) {
+		page = list_first_entry(&ksm_index_pool, struct page, lru);
+		list_del(&page->lru);
+		ksm_index_pool_pages--;
+	}
+	spin_unlock(&ksm_index_pool_lock);
+
+	if (page)
+		clear_page(page_address(page));
+	else
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+	if (page)
+		ksm_index_pages++;
+
+	return page;
+}
+
+static void free_index_page(struct page *page)
+{
+	ksm_index_pages--;
+	spin_lock(&ksm_index_pool_lock);
+	if (ksm_index_pool_pages < KSM_INDEX_POOL_MAX) {
+		list_add(&page->lru, &ksm_index_pool);
+		ksm_index_pool_pages++;
+		page = NULL;
+	}
+	spin_unlock(&ksm_index_pool_lock);
+
+	if (page)
+		__free_page(page);
+}
+
+/* the zeroed memory of the pool @pool_index of @slot */
+static void *alloc_slot_pool(struct vma_slot *slot, unsigned long pool_index)
+{
+	size_t size = slot->pages * sizeof(struct rmap_list_entry);
+	struct page *page;
+	void *pool;
+
+	if (slot_small_pool(slot)) {
+		pool = kzalloc(size, GFP_KERNEL);
+		if (pool)
+			ksm_small_pool_bytes += size;
+		return pool;
+	}
+
+	page = alloc_index_page();
+	if (!page)
+		return NULL;
+
+	/* lets the entries find their pool index, see free_entry_item() */
+	page->index = pool_index;
+	return page_address(page);
+}
+
+static void free_slot_pool(struct vma_slot *slot, unsigned long pool_index)
+{
+	void *pool = slot->rmap_list_pool[pool_index];
+
+	if (slot_small_pool(slot)) {
+		ksm_small_pool_bytes -= slot->pages *
+					sizeof(struct rmap_list_entry);
+		kfree(pool);
+	} else {
+		free_index_page(virt_to_page(pool));
+	}
+	slot->rmap_list_pool[pool_index] = NULL;
+}
+
+static void refill_index_pool(void)
+{
+	struct page *pages[16];
+	unsigned long have, nr, i;
+
+	while ((have = ACCESS_ONCE(ksm_index_pool_pages)) <
+	       KSM_INDEX_POOL_LOW) {
+		nr = min_t(unsigned long, KSM_INDEX_POOL_LOW - have,
+			   ARRAY_SIZE(pages));
+		nr = alloc_pages_bulk(GFP_KERNEL | __GFP_NOWARN, nr, pages);
+		if (!nr)
+			break;
+		spin_lock(&ksm_index_pool_lock);
+		for (i = 0; i < nr; i++)
+			list_add(&pages[i]->lru, &ksm_index_pool);
+		ksm_index_pool_pages += nr;
+		spin_unlock(&ksm_index_pool_lock);
+	}
+}
+
+static inline
+struct rmap_list_entry *get_rmap_list_entry(struct vma_slot *slot,
+					    unsigned long index, int need_alloc)
+{
+	unsigned long pool_index;
+	void *addr;
+
+
+	pool_index = get_pool_index(slot, index);
+	if (!slot->rmap_list_pool[pool_index]) {
+		if (!need_alloc)
+			return NULL;
+
+		slot->rmap_list_pool[pool_index] =
+			alloc_slot_pool(slot, pool_index);
+		BUG_ON(!slot->rmap_list_pool[pool_index]);
+	}
+
+	addr = slot->rmap_list_pool[pool_index];
+	addr += index_page_offset(index);
+
+	return addr;
+}
+
+static inline void put_rmap_list_entry(struct vma_slot *slot,
+				       unsigned long index)
+{
+	unsigned long pool_index;
+
+	pool_index = get_pool_index(slot, index);
+	BUG_ON(!slot->rmap_list_pool[pool_index]);
+}
+
+static inline unsigned long get_index_orig_addr(struct vma_slot *slot,
+						unsigned long index)
+{
+	return slot->vstart + (index << PAGE_SHIFT);
+}
+
+static inline struct rmap_item *get_entry_item(struct rmap_list_entry *entry)
+{
+	if (is_addr(entry->addr))
+		return NULL;
+
+	return entry->item;
+}
+
+static inline void inc_rmap_list_pool_count(struct vma_slot *slot,
+					    unsigned long index)
+{
+	unsigned long pool_index;
+
+	pool_index = get_pool_index(slot, index);
+	BUG_ON(!slot->rmap_list_pool[pool_index]);
+	slot->pool_counts[pool_index]++;
+}
+
+static inline void free_entry_item(struct rmap_list_entry *entry)
+{
+	unsigned long pool_index;
+	struct rmap_item *item;
+
+	if (!is_addr(entry->addr)) {
+		BUG_ON(!entry->item);
+		item = entry->item;
+		entry->addr = get_rmap_addr(item);
+		set_is_addr(entry->addr);
+		/* the pool pages are direct-mapped and remember their index */
+		pool_index = 0;
+		if (item->slot->pool_size > 1)
+			pool_index = virt_to_page(entry)->index;
+		remove_rmap_item_from_tree(item);
+		BUG_ON(!item->slot->pool_counts[pool_index]);
+		item->slot->pool_counts[pool_index]--;
+		free_rmap_item(item);
+	}
+}
+
+/* try_free_pool() - free the pool of @index if it holds no rmap_item */
+static inline void try_free_pool(struct vma_slot *slot, unsigned long index)
+{
+	unsigned long pool_index;
+
+	pool_index = get_pool_index(slot, index);
+	if (slot->rmap_list_pool[pool_index] &&
+	    !slot->pool_counts[pool_index])
+		free_slot_pool(slot, pool_index);
+}
+
+/*
+ * vma_fully_scanned() - if all the pages in this slot have been scanned.
+ */
+static inline int vma_fully_scanned(struct vma_slot *slot)
+{
+	return slot->pages_scanned && !(slot->pages_scanned % slot->pages);
+}
+
+/*
+ * slot_in_hole() - if @addr is known to have no page table, see
+ * slot_note_hole(). Only valid under the mmap_sem scan_vma_pages() holds.
+ */
+static inline int slot_in_hole(struct vma_slot *slot, unsigned long addr)
+{
+	return addr >= slot->hole_start && addr < slot->hole_end;
+}
+
+/*
+ * slot_note_hole() - follow_page() found nothing at @addr: if it's because
+ * there is no page table, the other pages of its pmd need no walk either.
+ */
+static void slot_note_hole(struct vma_slot *slot, unsigned long addr)
+{
+	struct mm_struct *mm = slot->vma->vm_mm;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, addr);
+	if (pgd_present(*pgd)) {
+		pud = pud_offset(pgd, addr);
+		if (pud_present(*pud)) {
+			pmd = pmd_offset(pud, addr);
+			if (pmd_present(*pmd))
+				return;
+		}
+	}
+
+	slot->hole_start = addr & PMD_MASK;
+	slot->hole_end = slot->hole_start + PMD_SIZE;
+}
+
+/*
+ * A page of a shared shmem slot, see ksm_shmem_zero: if it is zero-filled,
+ * unmap it and drop it from its page cache. Written through one of its ptes
+ * in between, it is left alone, the content being checked again once it is
+ * unmapped and locked against write(2). A page of a team mapped by a huge
+ * pmd at @addr is not worth splitting the pmd for, and is left alone too.
+ */
+static void slot_drop_shmem_zero(struct vma_slot *slot, struct page *page,
+				 unsigned long addr)
+{
+	struct mm_struct *mm = slot->vma->vm_mm;
+
+	if (!ksm_use_zero_pages)
+		return;
+	if (page_check_team_pmd(page, mm, addr)) {
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
+	if (!page_zero_filled(page))
+		return;
+
+	if (ksm_run & KSM_RUN_ESTIMATE) {
+		slot->pages_merged++;
+		return;
+	}
+
+	if (!trylock_page(page))
+		return;
+
+	if (page->mapping && try_to_unmap(page, TTU_UNMAP) == SWAP_SUCCESS &&
+	    page_zero_filled(page) && shmem_drop_unmapped_page(page)) {
+		ksm_shmem_zero_dropped++;
+		slot->pages_merged++;
+	}
+	unlock_page(page);
+}
+
+/*
+ * Is the anonymous @page at @addr lazily freed by MADV_FREE, not written to
+ * since? Its content is garbage then, for reclaim to discard, not to merge.
+ */
+static int page_lazy_free(struct vm_area_struct *vma, struct page *page,
+			  unsigned long addr)
+{
+	spinlock_t *ptl;
+	pte_t *pte;
+	int ret;
+
+	if (!PageAnon(page) || PageKsm(page) || PageTransCompound(page) ||
+	    PageSwapCache(page) || PageDirty(page))
+		return 0;
+
+	pte = page_check_address(page, vma->vm_mm, addr, &ptl, 0);
+	if (!pte)
+		return 0;
+	ret = !pte_dirty(*pte);
+	pte_unmap_unlock(pte, ptl);
+
+	return ret;
+}
+
+/* the sketch hash of @page: fixed words of it, with a fixed seed */
+static u32 page_fingerprint(struct page *page)
+{
+	u32 words[KSM_SKETCH_WORDS], *key;
+	int i;
+
+	key = ksm_map_page(page, KM_USER0);
+	for (i = 0; i < KSM_SKETCH_WORDS; i++)
+		words[i] = key[i * (HASH_STRENGTH_FULL / KSM_SKETCH_WORDS)];
+	ksm_unmap_page(key, KM_USER0);
+
+	return jhash2(words, KSM_SKETCH_WORDS, KSM_SKETCH_SEED);
+}
+
+static int file_page_dup_of(struct page *page, unsigned long pfn)
+{
+	struct page *other;
+	int ret = 0;
+
+	if (!pfn_valid(pfn))
+		return 0;
+
+	other = pfn_to_page(pfn);
+	if (PageAnon(other) || !get_page_unless_zero(other))
+		return 0;
+
+	if (!PageAnon(other) && other->mapping && PageUptodate(other) &&
+	    !PageDirty(other))
+		ret = pages_identical(page, other);
+	put_page(other);
+
+	return ret;
+}
+
+/*
+ * A clean page cache page of @slot, see ksm_file_dup: count it once per
+ * round, and as a duplicate if another page of the same content was met
+ * earlier in this round.
+ */
+static void slot_note_file_page(struct vma_slot *slot, struct page *page)
+{
+	unsigned long pfn = page_to_pfn(page);
+	struct file_dup_memo *memo;
+	u32 fp;
+
+	if (!ksm_file_dup_memo || !page->mapping || !PageUptodate(page) ||
+	    PageDirty(page) || PageWriteback(page))
+		return;
+
+	fp = page_fingerprint(page);
+	memo = &ksm_file_dup_memo[hash_32(fp, KSM_FILE_DUP_BITS)];
+	if (memo->round == (u32)ksm_scan_round) {
+		/* another mapping of the same page */
+		if (memo->pfn == pfn)
+			return;
+		if (memo->fp == fp && file_page_dup_of(page, memo->pfn)) {
+			ksm_file_pages_seen++;
+			ksm_file_pages_dup++;
+			return;
+		}
+	}
+
+	ksm_file_pages_seen++;
+	memo->pfn = pfn;
+	memo->fp = fp;
+	memo->round = ksm_scan_round;
+}
+
+/*
+ * Replace the only pte of the anon @page, locked, with the swap @entry of
+ * @orig, if their contents are still the same. The pte is cleared before
+ * they are compared, so that @page cannot be written in between.
+ */
+static int replace_page_with_swap(struct page *page, struct page *orig,
+				  swp_entry_t entry)
+{
+	struct anon_vma *anon_vma;
+	struct anon_vma_chain *avc;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm;
+	unsigned long address;
+	spinlock_t *ptl;
+	pte_t *pte, pteval;
+	int err = -EFAULT;
+
+	anon_vma = page_lock_anon_vma(page);
+	if (!anon_vma)
+		return err;
+
+	list_for_each_entry(avc, &anon_vma->head, same_anon_vma) {
+		vma = avc->vma;
+		address = page_address_in_vma(page, vma);
+		if (address == -EFAULT)
+			continue;
+
+		mm = vma->vm_mm;
+		pte = page_check_address(page, mm, address, &ptl, 0);
+		if (!pte)
+			continue;
+
+		flush_cache_page(vma, address, page_to_pfn(page));
+		pteval = ptep_clear_flush_notify(vma, address, pte);
+		/* the ref of reclaim and the one of this pte, no other */
+		if ((vma->vm_flags & VM_LOCKED) || page_mapcount(page) != 1 ||
+		    page_count(page) != 2 || !pages_identical(page, orig)) {
+			set_pte_at(mm, address, pte, pteval);
+			pte_unmap_unlock(pte, ptl);
+			break;
+		}
+
+		if (list_empty(&mm->mmlist)) {
+			spin_lock(&mmlist_lock);
+			if (list_empty(&mm->mmlist))
+				list_add(&mm->mmlist, &init_mm.mmlist);
+			spin_unlock(&mmlist_lock);
+		}
+		dec_mm_counter(mm, MM_ANONPAGES);
+		inc_mm_counter(mm, MM_SWAPENTS);
+		set_pte_at(mm, address, pte, swp_entry_to_pte(entry));
+
+		page_remove_rmap(page);
+		page_cache_release(page);
+		pte_unmap_unlock(pte, ptl);
+		err = 0;
+		break;
+	}
+	page_unlock_anon_vma(anon_vma);
+
+	return err;
+}
+
+/**
+ * ksm_swap_dedup_page() - called by reclaim for the anon @page it has locked,
+ * before adding it to swap. The page noted in ksm_swap_dedup_memo is only
+ * shared with while it is locked, unmapped and only held by the swap cache:
+ * its content is the one of its swap entry, and stays so once the swap
+ * count is raised.
+ *
+ * @return 1 if the pte of @page now holds the swap entry of an identical
+ * page, and @page can be freed, 0 otherwise.
+ */
+int ksm_swap_dedup_page(struct page *page)
+{
+	struct swap_dedup_memo *memo, found;
+	struct page *orig;
+	swp_entry_t entry;
+	u32 fp;
+	int ret = 0;
+
+	if (!ksm_swap_dedup || !ksm_swap_dedup_memo || PageKsm(page) ||
+	    PageTransCompound(page) || page_mapcount(page) != 1)
+		return 0;
+
+	fp = page_fingerprint(page);
+	memo = &ksm_swap_dedup_memo[hash_32(fp, KSM_SWAP_DEDUP_BITS)];
+	spin_lock(&ksm_swap_dedup_lock);
+	found = *memo;
+	spin_unlock(&ksm_swap_dedup_lock);
+
+	if (!found.swap || found.fp != fp || !pfn_valid(found.pfn))
+		return 0;
+
+	orig = pfn_to_page(found.pfn);
+	if (orig == page || !get_page_unless_zero(orig))
+		return 0;
+	if (!trylock_page(orig))
+		goto put;
+
+	entry.val = found.swap;
+	if (!PageSwapCache(orig) || page_private(orig) != entry.val ||
+	    PageKsm(orig) || page_mapped(orig) || page_count(orig) != 2)
+		goto unlock;
+
+	if (swap_duplicate(entry) < 0)
+		goto unlock;
+
+	if (replace_page_with_swap(page, orig, entry)) {
+		swap_free(entry);
+		goto unlock;
+	}
+
+	ksm_swap_dedup_pages++;
+	ret = 1;
+unlock:
+	unlock_page(orig);
+put:
+	put_page(orig);
+	return ret;
+}
+
+/* ksm_swap_dedup_note() - reclaim has just added the anon @page to swap */
+void ksm_swap_dedup_note(struct page *page)
+{
+	struct swap_dedup_memo *memo;
+	u32 fp;
+
+	if (!ksm_swap_dedup || !ksm_swap_dedup_memo || PageKsm(page))
+		return;
+
+	fp = page_fingerprint(page);
+	memo = &ksm_swap_dedup_memo[hash_32(fp, KSM_SWAP_DEDUP_BITS)];
+	spin_lock(&ksm_swap_dedup_lock);
+	memo->pfn = page_to_pfn(page);
+	memo->swap = page_private(page);
+	memo->fp = fp;
+	spin_unlock(&ksm_swap_dedup_lock);
+}
+
+/*
+ * slot_perm_pick() - draw the permutation of the next pass over @slot: the
+ * k-th step visits (k * perm_stride + perm_offset) % n, a bijection on the
+ * n pages, or windows, as long as perm_stride is coprime to n. A stride
+ * around the middle keeps the consecutive steps far apart.
+ */
+static void slot_perm_pick(struct vma_slot *slot)
+{
+	unsigned long n = slot->pages, stride;
+
+	if (slot->quiesced == 1) {
+		slot->perm_window = 0;
+		slot->perm_offset = 0;
+		slot->perm_stride = 1;
+		return;
+	}
+
+	slot->perm_window = ksm_scan_window &&
+			    slot->pages / KSM_SCAN_WINDOW > 1;
+	if (slot->perm_window)
+		n = slot->pages / KSM_SCAN_WINDOW;
+
+	slot->perm_offset = random32() % n;
+	stride = max(n / 4 + random32() % (n / 2 + 1), 1UL);
+	while (gcd(stride, n) != 1)
+		stride++;
+	slot->perm_stride = stride;
+}
+
+/*
+ * slot_perm_index() - the index of the page visited at step @k of the pass.
+ * A partial window at the end always stays there.
+ */
+static inline unsigned long slot_perm_index(struct vma_slot *slot,
+					    unsigned long k)
+{
+	unsigned long n = slot->pages, w = 1;
+	u32 rem;
+
+	if (slot->perm_window) {
+		w = KSM_SCAN_WINDOW;
+		n = slot->pages / w;
+		if (k >= n * w)
+			return k;
+	}
+
+	div_u64_rem((u64)(k / w) * slot->perm_stride + slot->perm_offset,
+		    n, &rem);
+	return rem * w + k % w;
+}
+
+static int scan_index_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * slot_batch_indices() - the indices of the next @nr steps of the pass over
+ * @slot, sorted: the batch then walks its page tables in address order, the
+ * pages sharing a pmd one after another, and a hole found is skipped by all
+ * those after it. The pass still visits every page once.
+ */
+static void slot_batch_indices(struct vma_slot *slot, unsigned long *index,
+			       int nr)
+{
+	unsigned long k = slot->pages_scanned % slot->pages;
+	int i;
+
+	if (!k || !slot->perm_stride)
+		slot_perm_pick(slot);
+
+	for (i = 0; i < nr; i++)
+		index[i] = slot_perm_index(slot, (k + i) % slot->pages);
+	if (nr > 1)
+		sort(index, nr, sizeof(*index), scan_index_cmp, NULL);
+}
+
+/**
+ * get_next_rmap_item() - Get the rmap_item of the page at @scan_index of a
+ * vma_slot, as given by its random permutation. The entries stay in address
+ * order, so only the pool of the page scanned is touched.
+ */
+static struct rmap_item *get_next_rmap_item(struct vma_slot *slot,
+					    unsigned long scan_index)
+{
+	unsigned long addr;
+	struct rmap_item *item = NULL;
+	struct rmap_list_entry *scan_entry;
+	struct page *page;
+
+	addr = get_index_orig_addr(slot, scan_index);
+	BUG_ON(addr >= slot_end(slot) || addr < slot->vstart);
+
+	/* a new entry needs no pool page until it gets an rmap_item */
+	scan_entry = get_rmap_list_entry(slot, scan_index, 0);
+	if (scan_entry)
+		item = get_entry_item(scan_entry);
+
+	if (slot_in_hole(slot, addr)) {
+		ksm_pages_hole_skipped++;
+		slot->pages_holes++;
+		goto nopage;
+	}
+
+	page = follow_page(slot->vma, addr, FOLL_GET);
+	if (IS_ERR_OR_NULL(page)) {
+		if (!page)
+			slot_note_hole(slot, addr);
+		goto nopage;
+	}
+
+	if (!PageAnon(page) && !page_trans_compound_anon(page)) {
+		if (vma_is_shared_shmem(slot->vma))
+			slot_drop_shmem_zero(slot, page, addr);
+		else if (ksm_file_dup)
+			slot_note_file_page(slot, page);
+		goto putpage;
+	}
+
+	if (page_lazy_free(slot->vma, page, addr))
+		goto putpage;
+
+	flush_anon_page(slot->vma, page, addr);
+	flush_dcache_page(page);
+
+	if (!item) {
+		item = alloc_rmap_item();
+		if (item) {
+			/* It has already been zeroed */
+			item->slot = slot;
+			item->address = addr;
+			scan_entry = get_rmap_list_entry(slot, scan_index, 1);
+			scan_entry->item = item;
+			inc_rmap_list_pool_count(slot, scan_index);
+		} else
+			goto putpage;
+	}
+
+	BUG_ON(item->slot != slot);
+	slot->pages_present++;
+	/* the page may have changed */
+	if (item->page != page)
+		item->address &= ~(HASHED_FLAG | PIN_MASK);
+	item->page = page;
+	put_rmap_list_entry(slot, scan_index);
+	return item;
+
+putpage:
+	put_page(page);
+	page = NULL;
+nopage:
+	/* no page, free rmap_item if possible, and its pool once empty */
+	if (item && (!in_stable_tree(item) || !item->head->head->swap)) {
+		free_entry_item(scan_entry);
+		try_free_pool(slot, scan_index);
+	}
+	return NULL;
+}
+
+static inline unsigned long cow_heat_ranges(struct vma_slot *slot)
+{
+	return (slot->pages + (1UL << KSM_COW_HEAT_SHIFT) - 1) >>
+		KSM_COW_HEAT_SHIFT;
+}
+
+/*
+ * cow_heat_sync() - halve the COW counters of @slot once for every round
+ * ended since they last were, on their first use in a round. Whoever wins
+ * the stamp does it, a racing bump may be lost as with any of them.
+ */
+static void cow_heat_sync(struct vma_slot *slot, unsigned char *heat)
+{
+	unsigned long round = (unsigned long)ksm_scan_round;
+	unsigned long old = ACCESS_ONCE(slot->heat_round);
+	unsigned long i, nr, shift;
+
+	if (old == round || cmpxchg(&slot->heat_round, old, round) != old)
+		return;
+
+	shift = min(round - old, 8UL);
+	nr = cow_heat_ranges(slot);
+	for (i = 0; i < nr; i++)
+		heat[i] >>= shift;
+}
+
+/* the COW counter of the range of @addr in @slot, NULL if none */
+static inline unsigned char *cow_heat_of(struct vma_slot *slot,
+					 unsigned long addr)
+{
+	unsigned char *heat = ACCESS_ONCE(slot->cow_heat);
+	unsigned long i;
+
+	if (!heat)
+		return NULL;
+
+	cow_heat_sync(slot, heat);
+
+	i = (addr - slot->vstart) >> (PAGE_SHIFT + KSM_COW_HEAT_SHIFT);
+	if (i >= cow_heat_ranges(slot))
+		return NULL;
+
+	return heat + i;
+}
+
+static inline int cow_heat_hot(struct vma_slot *slot, unsigned long addr)
+{
+	unsigned char *heat;
+
+	if (!ksm_cow_heat_threshold)
+		return 0;
+
+	heat = cow_heat_of(slot, addr);
+	return heat && *heat >= ksm_cow_heat_threshold;
+}
+
+/* restart the per round counters kept outside the scan in a new round */
+static inline void slot_round_sync(struct vma_slot *slot)
+{
+	unsigned long round = (unsigned long)ksm_scan_round;
+
+	if (slot->pages_round != round) {
+		slot->pages_cowed = 0;
+		slot->pages_collapsed = 0;
+		slot->pages_round = round;
+	}
+}
+
+static inline unsigned long slot_round_cowed(struct vma_slot *slot)
+{
+	return slot->pages_round == (unsigned long)ksm_scan_round ?
+		slot->pages_cowed : 0;
+}
+
+static inline unsigned long slot_round_collapsed(struct vma_slot *slot)
+{
+	return slot->pages_round == (unsigned long)ksm_scan_round ?
+		slot->pages_collapsed : 0;
+}
+
+/*
+ * ksm_vma_cowed() - called by the COW fault on a merged page of @vma, with
+ * its mmap_sem held for read. The racy update of the counters is fine.
+ */
+void ksm_vma_cowed(struct vm_area_struct *vma, unsigned long address)
+{
+	struct vma_slot *slot = ksm_vma_region(vma, address);
+	unsigned char *heat = cow_heat_of(slot, address);
+	int hot = cow_heat_hot(slot, address);
+	unsigned long start, end;
+	unsigned int old;
+
+	slot_round_sync(slot);
+
+	if (heat) {
+		old = *heat;
+		*heat = min_t(unsigned int, old + KSM_COW_HEAT_STEP,
+			      KSM_COW_HEAT_MAX);
+		/* the range just started thrashing, unmerge the rest of it */
+		if (ksm_cow_unmerge_threshold &&
+		    old < ksm_cow_unmerge_threshold &&
+		    *heat >= ksm_cow_unmerge_threshold) {
+			start = slot->vstart + ((address - slot->vstart) &
+				~((PAGE_SIZE << KSM_COW_HEAT_SHIFT) - 1));
+			end = min(start + (PAGE_SIZE << KSM_COW_HEAT_SHIFT),
+				  slot_end(slot));
+			ksm_cow_unmerge_range(vma->vm_mm, start, end);
+		}
+	}
+
+	slot->pages_cowed_total++;
+	trace_ksm_page_cowed(slot, vma->vm_mm, address);
+	ksm_trace_cow(slot, address);
+
+	/* a hot range is not merged anymore, it does not thrash the slot */
+	if (!hot)
+		slot->pages_cowed++;
+}
+
+/*
+ * ksm_vma_huge_collapsed() - called by khugepaged after collapsing
+ * @nr_pages at @address of @vma into a huge page, mmap_sem held for write.
+ */
+void ksm_vma_huge_collapsed(struct vm_area_struct *vma, unsigned long address,
+			    unsigned long nr_pages)
+{
+	struct vma_slot *slot = ksm_vma_region(vma, address);
+
+	if (slot) {
+		slot_round_sync(slot);
+		slot->pages_collapsed += nr_pages;
+	}
+}
+
+/*
+ * ksm_vma_stat() - sum up the slots of @vma into @stat, with the mmap_sem
+ * held for read so that they stay. The counters are read racily.
+ */
+void ksm_vma_stat(struct vm_area_struct *vma, struct ksm_vma_stat *stat)
+{
+	struct vma_slot *slot;
+	unsigned long scanned, dedup = 0;
+
+	memset(stat, 0, sizeof(*stat));
+	stat->rung = -1;
+
+	for (slot = vma->ksm_vma_slot; slot; slot = slot->next_region) {
+		stat->pages += slot->pages;
+		stat->pages_merged += slot->pages_merged_total;
+		stat->pages_cowed += slot->pages_cowed_total;
+		stat->pages_ksm += slot->pages_ksm;
+		scanned = slot->pages_scanned - slot->last_scanned;
+		stat->pages_scanned += min(scanned, slot->pages);
+		dedup += slot->last_dedup_ratio * slot->pages;
+		if (slot->rung && slot->rung - ksm_scan_ladder > stat->rung)
+			stat->rung = slot->rung - ksm_scan_ladder;
+	}
+
+	if (stat->pages)
+		stat->dedup_ratio = dedup / stat->pages;
+}
+
+/*
+ * ksm_dirty_log_hint() - called by KVM with the dirty bitmap it has just
+ * harvested of the @npages of guest memory mapped from @start in @mm. Each
+ * range with a dirty page in it is heated once.
+ */
+void ksm_dirty_log_hint(struct mm_struct *mm, unsigned long start,
+			unsigned long *bitmap, unsigned long npages)
+{
+	struct vm_area_struct *vma = NULL;
+	unsigned char *heat, *last = NULL;
+	unsigned long i, addr;
+
+	if (!ksm_guest_dirty_hint || !ksm_cow_heat_threshold)
+		return;
+
+	down_read(&mm->mmap_sem);
+	for (i = find_first_bit(bitmap, npages); i < npages;
+	     i = find_next_bit(bitmap, npages, i + 1)) {
+		addr = start + (i << PAGE_SHIFT);
+		if (!vma || addr >= vma->vm_end) {
+			vma = find_vma(mm, addr);
+			if (!vma)
+				break;
+		}
+		if (addr < vma->vm_start || !vma->ksm_vma_slot)
+			continue;
+
+		heat = cow_heat_of(ksm_vma_region(vma, addr), addr);
+		if (!heat || heat == last)
+			continue;
+
+		*heat = min(*heat + KSM_COW_HEAT_STEP, KSM_COW_HEAT_MAX);
+		ksm_guest_dirty_hinted++;
+		last = heat;
+	}
+	up_read(&mm->mmap_sem);
+}
+EXPORT_SYMBOL_GPL(ksm_dirty_log_hint);
+
+/*
+ * prefetch_page_samples() - issue the loads of the first sampled words of a
+ * page, so that hashing a batch of pages waits for their DRAM misses once.
+ */
+static inline void prefetch_page_samples(struct page *page,
+					 unsigned long strength)
+{
+	u32 *key;
+	unsigned long i;
+
+	if (strength > KSM_PREFETCH_SAMPLES)
+		strength = KSM_PREFETCH_SAMPLES;
+
+	key = ksm_map_page(page, KM_USER0);
+	for (i = 0; i < strength; i++)
+		prefetch(key + random_nums[i]);
+	ksm_unmap_page(key, KM_USER0);
+}
+
+/*
+ * page_hash_batch() - the hashes of the pages of a batch not @cached, taken
+ * KSM_HASH_LANES at a time through the direct map.
+ */
+static void page_hash_batch(struct rmap_item **items, u32 *hashes,
+			    int *cached, int nr, unsigned long strength)
+{
+	u32 *keys[KSM_HASH_LANES];
+	u32 lane_hashes[KSM_HASH_LANES];
+	int idx[KSM_HASH_LANES];
+	int i, j, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (cached[i])
+			continue;
+
+		idx[n] = i;
+		keys[n++] = page_address(items[i]->page);
+		if (n < KSM_HASH_LANES && i < nr - 1)
+			continue;
+
+		random_sample_hash_lanes(keys, lane_hashes, n, strength);
+		for (j = 0; j < n; j++)
+			hashes[idx[j]] = lane_hashes[j];
+		n = 0;
+	}
+
+	if (n) {
+		random_sample_hash_lanes(keys, lane_hashes, n, strength);
+		for (j = 0; j < n; j++)
+			hashes[idx[j]] = lane_hashes[j];
+	}
+}
+
+/**
+ * scan_batch_hash() - hash the pages of a batch of rmap_items about to be
+ * merged, after prefetching all of them.
+ *
+ * With more than one scanner thread, ksm_thread_mutex is dropped while the
+ * pages are hashed so that the other threads can walk the trees meanwhile.
+ * This is the only part of the scan done in parallel, the lookups of the
+ * hashes in the trees wait for the mutex to be taken back.
+ * The slot is marked as owned so that no other thread scans or frees it,
+ * the caller keeps its mmap_sem and a reference on the pages.
+ */
+static void scan_batch_hash(struct vma_slot *slot, struct rmap_item **items,
+			    u32 *hashes, int *cached, int nr)
+{
+	unsigned long strength = hash_strength;
+	int unlocked = ksm_scan_threads > 1;
+	int i, hashed = 0;
+
+	for (i = 0; i < nr; i++)
+		hashed += !cached[i];
+	if (!hashed)
+		return;
+
+	if (unlocked) {
+		slot->scan_owner = current;
+		mutex_unlock(&ksm_thread_mutex);
+	}
+
+	for (i = 0; i < nr; i++)
+		if (!cached[i])
+			prefetch_page_samples(items[i]->page, strength);
+	if (KSM_DIRECT_MAP)
+		page_hash_batch(items, hashes, cached, nr, strength);
+	else
+		for (i = 0; i < nr; i++)
+			if (!cached[i])
+				hashes[i] = page_hash(items[i]->page,
+						      strength, 0);
+
+	if (unlocked) {
+		mutex_lock(&ksm_thread_mutex);
+		slot->scan_owner = NULL;
+
+		/* rshash_adjust() may have changed the strength meanwhile */
+		if (strength != hash_strength) {
+			for (i = 0; i < nr; i++)
+				hashes[i] = page_hash(items[i]->page,
+						      hash_strength, 0);
+		}
+	}
+
+	rshash_pos += hashed * (HASH_STRENGTH_FULL - hash_strength);
+}
+
+/* restart the probes around the current hash_strength */
+static void hash_probe_reset(void)
+{
+	unsigned long delta = max(hash_strength >> 2, 1UL);
+
+	ksm_probe_strength[0] = hash_strength > delta ?
+				hash_strength - delta : 1;
+	ksm_probe_strength[1] = hash_strength;
+	ksm_probe_strength[2] = min(hash_strength + delta,
+				    (unsigned long)HASH_STRENGTH_MAX);
+
+	memset(ksm_probe_table, 0, sizeof(ksm_probe_table));
+	memset(ksm_probe_colli, 0, sizeof(ksm_probe_colli));
+	memset(ksm_probe_used, 0, sizeof(ksm_probe_used));
+	ksm_probes = 0;
+}
+
+/*
+ * hash_probe_page() - take @page, just hashed to @hash at hash_strength, as
+ * a probe if its turn has come. Called with ksm_thread_mutex held.
+ */
+static void hash_probe_page(struct page *page, u32 hash)
+{
+	struct hash_probe_entry *entry;
+	u32 hash_max, h;
+	void *addr;
+	int i;
+
+	if (!ksm_hash_probe_rate || ksm_probe_countdown--)
+		return;
+	ksm_probe_countdown = ksm_hash_probe_rate - 1;
+
+	if (ksm_probe_strength[1] != hash_strength)
+		hash_probe_reset();
+
+	addr = ksm_map_page(page, KM_USER0);
+	hash_max = delta_hash(addr, hash_strength, HASH_STRENGTH_MAX, hash);
+	hash_max = hash_max ? hash_max : 1;
+	for (i = 0; i < KSM_PROBE_CANDIDATES; i++) {
+		h = hash;
+		if (ksm_probe_strength[i] != hash_strength)
+			h = delta_hash(addr, hash_strength,
+				       ksm_probe_strength[i], hash);
+
+		entry = &ksm_probe_table[i][hash_32(h, KSM_PROBE_BITS)];
+		if (!entry->hash_max)
+			ksm_probe_used[i]++;
+		else if (entry->hash == h && entry->hash_max != hash_max)
+			ksm_probe_colli[i]++;
+		entry->hash = h;
+		entry->hash_max = hash_max;
+	}
+	ksm_unmap_page(addr, KM_USER0);
+
+	ksm_probes++;
+}
+
+/* add @h to the @nr sorted hashes of @sketch, keeping the smallest @k */
+static void sketch_insert(u32 *sketch, unsigned int *nr, unsigned int k,
+			  u32 h)
+{
+	unsigned int i, kept;
+
+	if (*nr >= k && h >= sketch[k - 1])
+		return;
+
+	for (i = min(*nr, k); i && sketch[i - 1] > h; i--)
+		;
+	if (i && sketch[i - 1] == h)
+		return;
+
+	kept = *nr < k ? *nr : k - 1;
+	memmove(sketch + i + 1, sketch + i, (kept - i) * sizeof(u32));
+	sketch[i] = h;
+	if (*nr < k)
+		(*nr)++;
+}
+
+static int seed_fps_find(u32 fp)
+{
+	unsigned long lo = 0, hi = ksm_seed_nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ksm_seed_fps[mid] == fp)
+			return 1;
+		if (ksm_seed_fps[mid] < fp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/*
+ * slot_fingerprint_page() - add @page of @slot, just hashed to @hash at
+ * hash_strength, to the sketch of @slot, and look for it in the seeds.
+ * Called with ksm_thread_mutex held.
+ */
+static void slot_fingerprint_page(struct vma_slot *slot, struct page *page,
+				  u32 hash)
+{
+	unsigned int k = ksm_sketch_size;
+	u32 fp;
+
+	if ((!k && !ksm_seed_nr) || hash == zero_hash_table[hash_strength])
+		return;
+
+	fp = page_fingerprint(page);
+
+	if (ksm_seed_nr && seed_fps_find(fp)) {
+		ksm_seed_hits++;
+		slot->dup_wide++;
+		enter_inter_vma_table(slot);
+	}
+
+	if (!k)
+		return;
+
+	if (!slot->sketch) {
+		slot->sketch = kmalloc(KSM_SKETCH_MAX * sizeof(u32),
+				       GFP_NOWAIT | __GFP_NOWARN);
+		if (!slot->sketch)
+			return;
+	}
+
+	sketch_insert(slot->sketch, &slot->sketch_nr, k, fp);
+}
+
+/* done with the seeds of the last boot, with ksm_thread_mutex held */
+static void seed_fps_free(void)
+{
+	vfree(ksm_seed_fps);
+	ksm_seed_fps = NULL;
+	ksm_seed_nr = 0;
+	ksm_seed_rounds = 0;
+}
+
+/*
+ * ksm_mm_sketch() - the sketch of all the slots of @mm into @sketch, room
+ * for KSM_SKETCH_MAX, with the mmap_sem held for read so that they stay.
+ * Returns the number of hashes, in ascending order. The sketches are read
+ * racily.
+ */
+unsigned int ksm_mm_sketch(struct mm_struct *mm, u32 *sketch)
+{
+	unsigned int k = ACCESS_ONCE(ksm_sketch_size);
+	unsigned int i, n, nr = 0;
+	struct vm_area_struct *vma;
+	struct vma_slot *slot;
+	u32 *hashes;
+
+	for (vma = mm->mmap; k && vma; vma = vma->vm_next)
+		for (slot = vma->ksm_vma_slot; slot; slot = slot->next_region) {
+			hashes = ACCESS_ONCE(slot->sketch);
+			if (!hashes)
+				continue;
+			n = min(ACCESS_ONCE(slot->sketch_nr), k);
+			for (i = 0; i < n; i++)
+				sketch_insert(sketch, &nr, k, hashes[i]);
+		}
+
+	return nr;
+}
+
+/*
+ * merge_candidate() - if a page of @hash is likely to be merged: it is zero
+ * filled or its hash is in the current stable tree or in the unstable tree.
+ * Nothing is changed, the merge itself is still up to cmp_and_merge_page().
+ */
+static int merge_candidate(struct page *page, u32 hash)
+{
+	int nid = page_tree_nid(page);
+
+	if (ksm_use_zero_pages && hash == zero_hash_table[hash_strength])
+		return 1;
+
+	if (ksm_filter_test(&ksm_stable_filter, hash) &&
+	    tree_node_find(&ksm_stable_index, root_stable_treep + nid, hash))
+		return 1;
+
+	return !!unstable_tree_find(nid, hash);
+}
+
+/**
+ * scan_batch_wrprotect() - write protect the ptes of the merge candidates of
+ * a batch, all in the same mm, with one TLB flush for all of them.
+ *
+ * As in write_protect_page(), the page counts are checked for O_DIRECT only
+ * after the flush, and a page failing it gets its pte back. The others are
+ * left clean and read-only, which write_protect_page() later finds and does
+ * not flush again; a write meanwhile faults and makes the pte writable, and
+ * write_protect_page() does it all again then. The pages are still compared
+ * before being merged.
+ */
+static void scan_batch_wrprotect(struct vma_slot *slot,
+				 struct rmap_item **items, u32 *hashes, int nr)
+{
+	struct vm_area_struct *vma = slot->vma;
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long start = ULONG_MAX, end = 0, addr;
+	pte_t orig[KSM_HASH_BATCH_MAX];
+	int done[KSM_HASH_BATCH_MAX];
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *ptep, entry;
+	int i, swapped, protected = 0;
+
+	for (i = 0; i < nr; i++) {
+		done[i] = 0;
+		page = items[i]->page;
+		if (PageTransCompound(page) || in_stable_tree(items[i]) ||
+		    !merge_candidate(page, hashes[i]))
+			continue;
+
+		addr = get_rmap_addr(items[i]);
+		ptep = page_check_address(page, mm, addr, &ptl, 0);
+		if (!ptep)
+			continue;
+
+		if (pte_write(*ptep) || pte_dirty(*ptep)) {
+			flush_cache_page(vma, addr, page_to_pfn(page));
+			orig[i] = ptep_get_and_clear(mm, addr, ptep);
+			if (pte_dirty(orig[i]))
+				set_page_dirty(page);
+			entry = pte_mkclean(pte_wrprotect(orig[i]));
+			set_pte_at_notify_batch(mm, addr, ptep, entry);
+
+			done[i] = 1;
+			protected++;
+			start = min(start, addr);
+			end = max(end, addr + PAGE_SIZE);
+		}
+		pte_unmap_unlock(ptep, ptl);
+	}
+
+	if (!protected)
+		return;
+
+	flush_tlb_range(vma, start, end);
+	/* and one flush of the guest TLBs too, if the mm is a KVM guest's */
+	mmu_notifier_change_pte_flush(mm);
+	ksm_batch_wrprotect_flushes++;
+	ksm_batch_wrprotect_pages += protected;
+
+	for (i = 0; i < nr; i++) {
+		if (!done[i])
+			continue;
+
+		page = items[i]->page;
+		swapped = PageSwapCache(page);
+		if (page_mapcount(page) + 1 + swapped == page_count(page))
+			continue;
+
+		/* O_DIRECT or similar was in progress, put the pte back */
+		addr = get_rmap_addr(items[i]);
+		ptep = page_check_address(page, mm, addr, &ptl, 0);
+		if (!ptep)
+			continue;
+
+		entry = pte_mkclean(pte_wrprotect(orig[i]));
+		if (pte_same(*ptep, entry))
+			set_pte_at(mm, addr, ptep, orig[i]);
+		pte_unmap_unlock(ptep, ptl);
+	}
+}
+
+/*
+ * An anon page not merged yet and mapped by more than one process: it's
+ * still COW-shared through the anon_vma since a fork.
+ */
+static inline int page_fork_shared(struct page *page)
+{
+	return PageAnon(page) && !PageKsm(page) && page_mapcount(page) > 1;
+}
+
+/*
+ * scan_batch_young() - ask the secondary MMUs for the young bits of all the
+ * pages of a batch in one call, if they are close enough together.
+ *
+ * @return @range, or NULL if the pages are to be asked one by one
+ */
+static struct ksm_young_range *scan_batch_young(struct vma_slot *slot,
+						struct rmap_item **items, int n,
+						struct ksm_young_range *range)
+{
+	struct mm_struct *mm = slot->vma->vm_mm;
+	unsigned long addr;
+	int i;
+
+	if (!ksm_hot_rounds || n < 2 || !mm_has_notifiers(mm))
+		return NULL;
+
+	range->start = ULONG_MAX;
+	range->end = 0;
+	for (i = 0; i < n; i++) {
+		addr = get_rmap_addr(items[i]);
+		range->start = min(range->start, addr);
+		range->end = max(range->end, addr + PAGE_SIZE);
+	}
+	if (range->end - range->start > KSM_YOUNG_RANGE_PAGES << PAGE_SHIFT)
+		return NULL;
+
+	bitmap_zero(range->young, KSM_YOUNG_RANGE_PAGES);
+	mmu_notifier_clear_flush_young_range(mm, range->start, range->end,
+					     range->young);
+	return range;
+}
+
+/**
+ * scan_vma_pages() - scan the next nr pages in a vma_slot. Called with
+ * mmap_sem locked. nr must not cross the slot's quota or full scan boundary.
+ *
+ * @return the number of them skipped as page table holes, at no cost
+ */
+static unsigned long scan_vma_pages(struct vma_slot *slot, unsigned long nr)
+{
+	unsigned long holes = slot->pages_holes;
+	struct rmap_item *items[KSM_HASH_BATCH_MAX];
+	unsigned long index[KSM_HASH_BATCH_MAX];
+	int was_stable[KSM_HASH_BATCH_MAX];
+	int cached[KSM_HASH_BATCH_MAX];
+	u32 hashes[KSM_HASH_BATCH_MAX];
+	struct ksm_young_range young, *range;
+	struct rmap_item *rmap_item;
+	struct vm_area_struct *vma = slot->vma;
+	int i, pte, nr_items = 0, n = 0, over_budget;
+	u64 start;
+
+	BUG_ON(!slot);
+	BUG_ON(!vma->vm_mm);
+	BUG_ON(!nr || nr > KSM_HASH_BATCH_MAX);
+
+	/*
+	 * Past the merge budget of its memcg, the pages of the slot still use
+	 * up its quota, so that the ladder goes on, but are neither hashed
+	 * nor merged, which spares the CPU the budget is charged for.
+	 */
+	over_budget = mem_cgroup_ksm_over_budget(slot->memcg);
+
+	/* page tables may have come and gone since the mmap_sem was taken */
+	slot->hole_start = slot->hole_end = 0;
+
+	slot_batch_indices(slot, index, nr);
+	for (i = 0; i < nr; i++) {
+		rmap_item = get_next_rmap_item(slot, index[i]);
+		slot->pages_scanned++;
+		if (!rmap_item)
+			continue;
+
+		if (PageKsm(rmap_item->page) && in_stable_tree(rmap_item)) {
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		if (over_budget) {
+			mem_cgroup_ksm_stat(slot->memcg,
+					    MEM_CGROUP_KSM_PAGES_OVER_BUDGET, 1);
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		if (slot->forked && page_fork_shared(rmap_item->page)) {
+			ksm_pages_fork_skipped++;
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		if (cow_heat_hot(slot, get_rmap_addr(rmap_item)) &&
+		    !remerge_memo_find(rmap_item)) {
+			ksm_pages_cow_hot_skipped++;
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		if (rmap_item_pinned(rmap_item)) {
+			ksm_pages_pin_skipped++;
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		items[nr_items++] = rmap_item;
+	}
+
+	range = scan_batch_young(slot, items, nr_items, &young);
+	for (i = 0; i < nr_items; i++) {
+		rmap_item = items[i];
+		pte = rmap_item_pte_state(rmap_item, range);
+		if (rmap_item_hot(rmap_item, pte)) {
+			ksm_pages_hot_deferred++;
+			put_page(rmap_item->page);
+			continue;
+		}
+
+		was_stable[n] = in_stable_tree(rmap_item);
+		cached[n] = rmap_item_cached_hash(rmap_item, pte, &hashes[n]);
+		items[n++] = rmap_item;
+	}
+
+	mem_cgroup_ksm_stat(slot->memcg, MEM_CGROUP_KSM_PAGES_SCANNED, n);
+	if (n) {
+		start = local_clock();
+		scan_batch_hash(slot, items, hashes, cached, n);
+		ksm_hist_add(KSM_HIST_HASH, div_u64(local_clock() - start, n));
+		for (i = 0; i < n; i++) {
+			if (cached[i])
+				continue;
+			hash_probe_page(items[i]->page, hashes[i]);
+			slot_fingerprint_page(slot, items[i]->page, hashes[i]);
+		}
+	}
+	if (ksm_batch_wrprotect && n > 1 && !(ksm_run & KSM_RUN_ESTIMATE))
+		scan_batch_wrprotect(slot, items, hashes, n);
+
+	for (i = 0; i < n; i++) {
+		rmap_item = items[i];
+
+		/*
+		 * another scanner thread, or a merge of an earlier item of
+		 * this batch, may have put it in the stable tree meanwhile;
+		 * run may have been set to unmerge while the mutex was
+		 * dropped for hashing
+		 */
+		if ((was_stable[i] || !in_stable_tree(rmap_item)) &&
+		    ksmd_should_run())
+			cmp_and_merge_page(rmap_item, hashes[i]);
+		put_page(rmap_item->page);
+	}
+
+	if (!slot->slot_scanned) {
+		slot->slot_scanned = 1;
+		list_add_tail(&slot->round_list, &ksm_round_slots);
+	}
+	if (vma_fully_scanned(slot)) {
+		slot->fully_scanned = 1;
+		/* the sharers may all be forked ones, scan them all now */
+		slot->forked = 0;
+		if (slot->once)
+			slot->once = 2;
+		if (slot->quiesced == 1)
+			slot->quiesced = 2;
+		slot->rung->fully_scanned_slots++;
+		BUG_ON(!slot->rung->fully_scanned_slots);
+	}
+
+	return slot->pages_holes - holes;
+}
+
+/*
+ * scan_batch_size() - how many pages of the slot can be scanned in one batch
+ * without crossing the rung's quota, the slot's quota or its full scan.
+ */
+static unsigned long scan_batch_size(struct vma_slot *slot,
+				     struct scan_rung *rung)
+{
+	unsigned long nr = ksm_hash_batch;
+
+	nr = min(nr, (unsigned long)rung->pages_to_scan + 1);
+	nr = min(nr, slot->pages_to_scan -
+		 slot->pages_scanned % slot->pages_to_scan);
+	nr = min(nr, slot->pages - slot->pages_scanned % slot->pages);
+
+	return nr;
+}
+
+/* someone is waiting for @sem, racily: a hint to let it go */
+static inline int ksm_rwsem_contended(struct rw_semaphore *sem)
+{
+	return !list_empty(&sem->wait_list);
+}
+
+/*
+ * scan_slot_run() - scan the batches of @slot of @rung in a run, holding
+ * its mmap_sem, for up to ksm_mmap_sem_run pages. The run ends early at the
+ * end of the quota of the slot or of the rung, when the slot was left by
+ * another scanner thread, or when a fault waits for the mmap_sem, a control
+ * operation for ksm_thread_mutex or the scheduler for us.
+ */
+static void scan_slot_run(struct vma_slot *slot, struct scan_rung *rung)
+{
+	struct rw_semaphore *sem = &slot->mm->mmap_sem;
+	unsigned long nr, run = 0;
+
+	while (!slot->fully_scanned) {
+		nr = scan_batch_size(slot, rung);
+		rung->pages_to_scan -= nr - 1;
+		/* holes don't use up the CPU the quota is for */
+		rung->pages_to_scan += scan_vma_pages(slot, nr);
+		run += nr;
+
+		if (run >= ksm_mmap_sem_run || !rung->pages_to_scan ||
+		    slot->pages_scanned % slot->pages_to_scan == 0 ||
+		    rung->current_scan != &slot->ksm_list)
+			break;
+		if (ksm_rwsem_contended(sem)) {
+			ksm_mmap_sem_yields++;
+			break;
+		}
+		if (atomic_read(&ksm_control_waiters) || need_resched() ||
+		    freezing(current))
+			break;
+
+		/* as the ksm_do_scan() loop takes one page per batch */
+		rung->pages_to_scan--;
+	}
+}
+
+static unsigned long get_vma_random_scan_num(struct vma_slot *slot,
+					     unsigned long scan_ratio)
+{
+	return slot->pages * scan_ratio / KSM_SCAN_RATIO_MAX;
+}
+
+/* the deadline of the round of @rung, in jiffies */
+static inline unsigned long rung_deadline(struct scan_rung *rung)
+{
+	return rung->round_start_j +
+	       msecs_to_jiffies(ksm_rung_revisit_ms[rung - ksm_scan_ladder]);
+}
+
+/* all the slots of @rung had their turn, see if that was in time */
+static inline void rung_round_end(struct scan_rung *rung)
+{
+	if (rung->round_finished)
+		return;
+
+	rung->round_finished = 1;
+	rung->revisit_last_ms = jiffies_to_msecs(jiffies - rung->round_start_j);
+	if (ksm_rung_revisit_ms[rung - ksm_scan_ladder] &&
+	    time_after(jiffies, rung_deadline(rung)))
+		rung->revisit_misses++;
+}
+
+/*
+ * slot_rung_fit() - the lowest rung from @rung up scanning at least a page
+ * of @slot per round, found without a division per rung.
+ */
+static inline struct scan_rung *slot_rung_fit(struct vma_slot *slot,
+					      struct scan_rung *rung)
+{
+	unsigned long ratio = DIV_ROUND_UP(KSM_SCAN_RATIO_MAX, slot->pages);
+
+	/* the top rung scans them all, so this stops there */
+	while (rung->scan_ratio < ratio) {
+		rung++;
+		BUG_ON(rung > &ksm_scan_ladder[ksm_scan_ladder_size - 1]);
+	}
+
+	return rung;
+}
+
+static inline void vma_rung_enter(struct vma_slot *slot,
+				  struct scan_rung *rung)
+{
+	unsigned long pages_to_scan;
+	struct scan_rung *old_rung = slot->rung;
+
+	/* leave the old rung it was in */
+	BUG_ON(list_empty(&slot->ksm_list));
+
+	if (old_rung->current_scan == &slot->ksm_list)
+		old_rung->current_scan = slot->ksm_list.next;
+	list_del_init(&slot->ksm_list);
+	old_rung->vma_num--;
+	if (slot->fully_scanned)
+		old_rung->fully_scanned_slots--;
+
+	if (old_rung->current_scan == &old_rung->vma_list) {
+		/* This rung finishes a round */
+		rung_round_end(old_rung);
+		old_rung->current_scan = old_rung->vma_list.next;
+		BUG_ON(old_rung->current_scan == &old_rung->vma_list &&
+		       !list_empty(&old_rung->vma_list));
+	}
+
+	/* enter the new rung */
+	rung = slot_rung_fit(slot, rung);
+	pages_to_scan = get_vma_random_scan_num(slot, rung->scan_ratio);
+	if (list_empty(&rung->vma_list))
+		rung->current_scan = &slot->ksm_list;
+	list_add(&slot->ksm_list, &rung->vma_list);
+	slot->rung = rung;
+	slot->pages_to_scan = pages_to_scan;
+	slot->rung->vma_num++;
+	if (slot->fully_scanned)
+		rung->fully_scanned_slots++;
+
+	trace_ksm_vma_rung_enter(slot, old_rung - ksm_scan_ladder,
+				 rung - ksm_scan_ladder, pages_to_scan,
+				 slot->dedup_ratio);
+
+	BUG_ON(rung->current_scan == &rung->vma_list &&
+	       !list_empty(&rung->vma_list));
+}
+
+/*
+ * slot_min_rung() - The lowest rung the memcg of the slot lets it fall to,
+ * NULL if the memcg does not want its areas to be merged.
+ */
+static struct scan_rung *slot_min_rung(struct vma_slot *slot)
+{
+	int prio = mem_cgroup_ksm_priority(slot->memcg);
+
+	if (prio < 0)
+		return NULL;
+
+	if (prio >= ksm_scan_ladder_size)
+		prio = ksm_scan_ladder_size - 1;
+
+	return &ksm_scan_ladder[prio];
+}
+
+static inline void vma_rung_up(struct vma_slot *slot, int n)
+{
+	struct scan_rung *top = &ksm_scan_ladder[ksm_scan_ladder_size - 1];
+
+	if (slot->rung == top)
+		return;
+
+	/* excluded by its memcg, see ksm_exclude_vma_slot() */
+	if (!slot_min_rung(slot))
+		return;
+
+	vma_rung_enter(slot, slot->rung + min_t(long, n, top - slot->rung));
+}
+
+static inline void vma_rung_down(struct vma_slot *slot, int n)
+{
+	struct scan_rung *rung = slot_min_rung(slot);
+
+	/* kept up until its sequential pass is done */
+	if (slot->quiesced == 1)
+		return;
+
+	/* excluded by its memcg, the scanner takes it off where it is */
+	if (!rung)
+		return;
+
+	if (slot->rung > rung)
+		rung = slot->rung - min_t(long, n, slot->rung - rung);
+
+	if (slot->rung == rung)
+		return;
+
+	vma_rung_enter(slot, rung);
+}
+
+/*
+ * The first round of a burst slot is over: one not sharing enough to stay
+ * up goes straight down to its lowest rung.
+ */
+static inline void vma_burst_end(struct vma_slot *slot, int up)
+{
+	struct scan_rung *rung;
+
+	if (!slot->burst)
+		return;
+
+	slot->burst = 0;
+	ksm_burst_pages -= slot->pages;
+
+	if (up || slot->quiesced == 1)
+		return;
+
+	rung = slot_min_rung(slot);
+	if (!rung)
+		rung = &ksm_scan_ladder[0];
+	if (slot->rung != rung)
+		vma_rung_enter(slot, rung);
+}
+
+/* the last mm ksm_mm_quiesced() looked at, and what it found, this round */
+static struct mm_struct *ksm_quiesced_mm;
+static unsigned long long ksm_quiesced_round;
+static bool ksm_quiesced_last;
+
+/*
+ * ksm_mm_quiesced() - if all the tasks using @mm are frozen or stopped. The
+ * slots of an mm mostly follow each other on a rung, the answer is kept for
+ * them for the rest of the round.
+ */
+static bool ksm_mm_quiesced(struct mm_struct *mm)
+{
+	struct task_struct *g, *t;
+	bool found = false, quiesced = true;
+
+	if (mm == ksm_quiesced_mm && ksm_quiesced_round == ksm_scan_round)
+		return ksm_quiesced_last;
+
+	read_lock(&tasklist_lock);
+	do_each_thread(g, t) {
+		if (t->mm != mm)
+			continue;
+		found = true;
+		if (!frozen(t) && !task_is_stopped_or_traced(t)) {
+			quiesced = false;
+			goto out;
+		}
+	} while_each_thread(g, t);
+out:
+	read_unlock(&tasklist_lock);
+
+	ksm_quiesced_mm = mm;
+	ksm_quiesced_round = ksm_scan_round;
+	ksm_quiesced_last = found && quiesced;
+
+	return ksm_quiesced_last;
+}
+
+/*
+ * slot_quiesce_check() - at the start of a turn of @slot, see if its mm has
+ * been quiesced or woken since. Returns 1 if it was moved to the top rung.
+ */
+static int slot_quiesce_check(struct vma_slot *slot)
+{
+	struct scan_rung *top = &ksm_scan_ladder[ksm_scan_ladder_size - 1];
+
+	if (!ksm_quiesced_fast || !ksm_mm_quiesced(slot->mm)) {
+		slot->quiesced = 0;
+		return 0;
+	}
+
+	if (slot->quiesced || !slot_min_rung(slot))
+		return 0;
+
+	slot->quiesced = 1;
+	if (slot->rung == top)
+		return 0;
+
+	vma_rung_enter(slot, top);
+	return 1;
+}
+
+static inline unsigned long slot_round_scanned(struct vma_slot *slot)
+{
+	BUG_ON(slot->pages_scanned - slot->last_scanned > slot->pages_scanned);
+	return slot->pages_scanned - slot->last_scanned;
+}
+
+/*
+ * slot_resident() - the pages of the slot estimated mapped, from those found
+ * mapped this round: a sparse slot is rated by what it has, not its size.
+ */
+static inline unsigned long slot_resident(struct vma_slot *slot)
+{
+	unsigned long scanned = slot_round_scanned(slot);
+
+	if (!scanned)
+		return slot->pages;
+
+	return max(1UL, slot->pages * slot->pages_present / scanned);
+}
+
+/**
+ * cal_pair_dedup() - Extrapolate the duplicated pages counted in a vma_pair
+ * this round to the whole areas, and add them to both slots' dedup_num.
+ * Each pair is evaluated once, from its lower slot.
+ */
+static inline void cal_pair_dedup(struct vma_pair *pair)
+{
+	struct vma_slot *slot1 = pair->slot[0], *slot2 = pair->slot[1];
+	unsigned long scanned1, scanned2, num;
+
+	if (!pair->dup_num || !slot1->pages_scanned || !slot2->pages_scanned)
+		return;
+
+	scanned1 = slot_round_scanned(slot1);
+	BUG_ON(!scanned1);
+	num = pair->dup_num * slot1->pages / scanned1;
+
+	if (slot1 == slot2) {
+		slot1->dedup_num += num;
+		return;
+	}
+
+	scanned2 = slot_round_scanned(slot2);
+	BUG_ON(!scanned2);
+	num = num * slot2->pages / scanned2;
+
+	slot1->dedup_num += num;
+	slot2->dedup_num += num;
+}
+
+/**
+ * cal_dedup_ratio() - Calculate the deduplication ratio for this slot, after
+ * cal_pair_dedup() has been done for all the pairs.
+ */
+static inline unsigned long cal_dedup_ratio(struct vma_slot *slot)
+{
+	unsigned long dedup_num = slot->dedup_num;
+	unsigned long pages1 = slot_resident(slot);
+	unsigned long collapsed = slot_round_collapsed(slot);
+	unsigned long cowed = slot_round_cowed(slot);
+	unsigned long ret;
+
+	/* what khugepaged collapsed again is not going to stay merged */
+	if (dedup_num > collapsed)
+		dedup_num -= collapsed;
+	else
+		dedup_num = 0;
+
+	if (!slot->pages_scanned || !dedup_num)
+		return 0;
+
+	ret = (dedup_num * KSM_DEDUP_RATIO_SCALE / pages1);
+
+	/* Thrashing area filtering */
+	if (ksm_thrash_threshold && slot->pages_merged) {
+		if (cowed * 100 / slot->pages_merged > ksm_thrash_threshold) {
+			ret = 0;
+		} else {
+			ret = ret * (slot->pages_merged - cowed)
+			      / slot->pages_merged;
+		}
+	}
+
+	return ret;
+}
+
+
+/**
+ * stable_node_reinsert() - When the hash_strength has been adjusted, the
+ * stable tree need to be restructured, this is the function re-inserting the
+ * stable node.
+ */
+static inline void stable_node_reinsert(struct stable_node *new_node,
+					struct page *page,
+					struct rb_root *root_treep,
+					struct list_head *tree_node_listp,
+					u32 hash)
+{
+	int nid = page_tree_nid(page);
+	struct rb_node **new;
+	struct rb_node *parent = NULL;
+	struct stable_node *stable_node;
+	struct tree_node *tree_node;
+	struct page *tree_page;
+	int cmp;
+
+	root_treep += nid;
+	new = &root_treep->rb_node;
+	while (*new) {
+		int cmp;
+
+		tree_node = rb_entry(*new, struct tree_node, node);
+
+		cmp = hash_cmp(hash, tree_node->hash);
+
+		if (cmp < 0) {
+			parent = *new;
+			new = &parent->rb_left;
+		} else if (cmp > 0) {
+			parent = *new;
+			new = &parent->rb_right;
+		} else
+			break;
+	}
+
+	if (*new) {
+		/* find a stable tree node with same first level hash value */
+		stable_node_hash_max(new_node, page, hash);
+		if (tree_node->count == 1) {
+			stable_node = rb_entry(tree_node->sub_root.rb_node,
+					       struct stable_node, node);
+			tree_page = get_ksm_page(stable_node, 1, 0);
+			if (tree_page) {
+				stable_node_hash_max(stable_node,
+						      tree_page, hash);
+
+				/* prepare for stable node insertion */
+
+				cmp = hash_cmp(new_node->hash_max,
+						   stable_node->hash_max);
+				/* only a full copy is chained, not a collision */
+				if (!cmp && stable_node_full(new_node) &&
+				    pages_identical(page, tree_page))
+					cmp = 1;
+				put_page(tree_page);
+
+				parent = &stable_node->node;
+				if (cmp < 0)
+					new = &parent->rb_left;
+				else if (cmp > 0)
+					new = &parent->rb_right;
+				else
+					goto failed;
+
+				goto add_node;
+			} else {
+				/* the only stable_node deleted, the tree node
+				 * was not deleted.
+				 */
+				goto tree_node_reuse;
+			}
+		}
+
+		/* well, search the collision subtree */
+research:
+		if (!tree_node->count)
+			goto tree_node_reuse;
+		new = &tree_node->sub_root.rb_node;
+		parent = NULL;
+		BUG_ON(!*new);
+		while (*new) {
+			int cmp;
+
+			stable_node = rb_entry(*new, struct stable_node, node);
+
+			cmp = hash_cmp(new_node->hash_max,
+					   stable_node->hash_max);
+
+			/* a full one is chained to a copy of the same content */
+			if (!cmp && stable_node_full(new_node)) {
+				tree_page = get_ksm_page(stable_node, 1, 0);
+				if (!tree_page)
+					goto research;
+				if (pages_identical(page, tree_page))
+					cmp = 1;
+				put_page(tree_page);
+			}
+
+			if (cmp < 0) {
+				parent = *new;
+				new = &parent->rb_left;
+			} else if (cmp > 0) {
+				parent = *new;
+				new = &parent->rb_right;
+			} else {
+				/* oh, no, still a collision */
+				goto failed;
+			}
+		}
+
+		goto add_node;
+	}
+
+	/* no tree node found */
+	tree_node = alloc_tree_node(tree_node_listp);
+	if (!tree_node) {
+		printk(KERN_ERR "KSM: memory allocation error!\n");
+		goto failed;
+	} else {
+		tree_node->hash = hash;
+		tree_node->root = root_treep;
+		rb_link_node(&tree_node->node, parent, new);
+		rb_insert_color(&tree_node->node, root_treep);
+		stable_tree_node_added(tree_node);
+
+tree_node_reuse:
+		/* prepare for stable node insertion */
+		parent = NULL;
+		new = &tree_node->sub_root.rb_node;
+	}
+
+add_node:
+	rb_link_node(&new_node->node, parent, new);
+	rb_insert_color(&new_node->node, &tree_node->sub_root);
+	new_node->tree_node = tree_node;
+	tree_node->count++;
+	return;
+
+failed:
+	/* This can only happen when two nodes have collided
+	 * in two levels.
+	 */
+	new_node->tree_node = NULL;
+	return;
+}
+
+/* tree_nodes freed at once by free_all_tree_nodes() */
+#define KSM_FREE_BULK	32
+
+/*
+ * unstable_tree_cache_hashes() - before the unstable trees are emptied, let
+ * their rmap_items keep the hash they were inserted with. Only the tree_node
+ * pointer is overwritten, the rb_nodes are still walked.
+ */
+static void unstable_tree_cache_hashes(u32 strength)
+{
+	struct tree_node *tree_node;
+	struct rmap_item *item;
+	struct rb_node *node;
+	u64 stamp = local_clock();
+	unsigned long nr = 0;
+
+	list_for_each_entry(tree_node, &unstable_tree_node_list, all_list) {
+		for (node = rb_first(&tree_node->sub_root); node;
+		     node = rb_next(node)) {
+			item = rb_entry(node, struct rmap_item, node);
+			item->cached_hash = tree_node->hash;
+			item->cached_strength = strength;
+			item->address |= HASHED_FLAG;
+		}
+		if (!(++nr % KSM_FREE_BULK))
+			ksm_cond_resched(&stamp);
+	}
+}
+
+static inline void free_all_tree_nodes(struct list_head *list)
+{
+	struct tree_node *node, *tmp;
+	void *objs[KSM_FREE_BULK];
+	u64 stamp = local_clock();
+	size_t nr = 0;
+
+	list_for_each_entry_safe(node, tmp, list, all_list) {
+		list_del(&node->all_list);
+		ksm_tree_nodes--;
+		objs[nr++] = node;
+		if (nr == KSM_FREE_BULK) {
+			kmem_cache_free_bulk(tree_node_cache, nr, objs);
+			nr = 0;
+			ksm_cond_resched(&stamp);
+		}
+	}
+	kmem_cache_free_bulk(tree_node_cache, nr, objs);
+}
+
+/* can the unstable trees be kept for the next round? */
+static inline int unstable_tree_keep(void)
+{
+	return ksm_unstable_rounds > 1 && !ksm_unstable_flush &&
+	       hash_strength == ksm_unstable_strength;
+}
+
+static void unstable_tree_empty(void)
+{
+	int nid, group;
+
+	for (group = 0; group < KSM_UNSTABLE_GROUPS; group++)
+		for (nid = 0; nid < nr_node_ids; nid++)
+			root_unstable_tree[group][nid] = RB_ROOT;
+	free_all_tree_nodes(&unstable_tree_node_list);
+
+	ksm_unstable_since = ksm_scan_round;
+	ksm_unstable_strength = hash_strength;
+	ksm_unstable_flush = 0;
+}
+
+/*
+ * tree_index_round_end() - called when the unstable trees have just been
+ * emptied, or @kept: size the unstable index for the peak of the round, and
+ * grow or rebuild the stable one if it filled up.
+ */
+static void tree_index_round_end(int kept)
+{
+	int nid, group;
+
+	if (!ksm_tree_index) {
+		tree_index_free(&ksm_unstable_index);
+		tree_index_free(&ksm_stable_index);
+		return;
+	}
+
+	if (tree_index_reserve(&ksm_unstable_index, ksm_unstable_index.peak) ||
+	    !kept || !ksm_unstable_index.complete) {
+		tree_index_clear(&ksm_unstable_index);
+		for (group = 0; kept && group < KSM_UNSTABLE_GROUPS; group++)
+			for (nid = 0; nid < nr_node_ids; nid++)
+				tree_index_add_tree(&ksm_unstable_index,
+					&root_unstable_tree[group][nid]);
+	}
+
+	/* only stable tree_nodes are left at this point */
+	if (!tree_index_reserve(&ksm_stable_index, ksm_tree_nodes) &&
+	    ksm_stable_index.complete)
+		return;
+
+	tree_index_clear(&ksm_stable_index);
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		tree_index_add_tree(&ksm_stable_index, root_stable_treep + nid);
+		if (root_stable_old_treep)
+			tree_index_add_tree(&ksm_stable_index,
+					    root_stable_old_treep + nid);
+	}
+}
+
+/*
+ * stable_filter_round_end() - rebuild the stable filter, about 8 counters per
+ * stable tree_node, if it got too small, too big or has stuck counters.
+ */
+static void stable_filter_round_end(void)
+{
+	struct ksm_filter *filter = &ksm_stable_filter;
+	unsigned int bits = KSM_FILTER_BITS_MIN;
+	u8 *counters;
+	int nid;
+
+	if (!ksm_use_stable_filter) {
+		vfree(filter->counters);
+		filter->counters = NULL;
+		return;
+	}
+
+	while (bits < KSM_FILTER_BITS_MAX && (1UL << bits) < ksm_tree_nodes * 8)
+		bits++;
+
+	if (filter->counters && !filter->stuck && bits <= filter->bits &&
+	    bits + 2 > filter->bits)
+		return;
+
+	counters = vzalloc(1UL << bits);
+	if (!counters)
+		return;	/* the old one, if any, is still correct */
+
+	vfree(filter->counters);
+	filter->counters = counters;
+	filter->bits = bits;
+	filter->stuck = 0;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		ksm_filter_add_tree(filter, root_stable_treep + nid);
+		if (root_stable_old_treep)
+			ksm_filter_add_tree(filter, root_stable_old_treep + nid);
+	}
+}
+
+/**
+ * stable_tree_migrate() - Move up to @nr stable nodes from the old stable
+ * tree to the current one, delta hashing them to @strength. The old tree
+ * is freed once it's empty.
+ */
+static void stable_tree_migrate(unsigned long nr, u32 strength)
+{
+	struct tree_node *tree_node;
+	struct stable_node *node;
+	struct page *node_page;
+	u64 stamp = local_clock();
+	unsigned long removed = 0;
+	void *addr;
+	u32 hash;
+
+	if (!root_stable_old_treep)
+		return;
+
+	while (nr-- && !list_empty(&stable_node_migrate_list)) {
+		node = list_first_entry(&stable_node_migrate_list,
+					struct stable_node, all_list);
+
+		/* a stale node is removed from the old tree and freed */
+		node_page = get_ksm_page(node, 1, 1);
+		if (!node_page)
+			continue;
+
+		if (node->tree_node) {
+			hash = node->tree_node->hash;
+			stable_node_unlink(node, 1);
+
+			addr = ksm_map_page(node_page, KM_USER0);
+			hash = delta_hash(addr, stable_tree_old_strength,
+					  strength, hash);
+			ksm_unmap_page(addr, KM_USER0);
+		} else {
+			/*
+			 *it was not inserted to rbtree due to collision in last
+			 *round scan.
+			 */
+			hash = page_hash(node_page, strength, 0);
+		}
+
+		list_move(&node->all_list, &stable_node_list);
+		stable_node_reinsert(node, node_page, root_stable_treep,
+				     stable_tree_node_listp, hash);
+		put_page(node_page);
+		ksm_cond_resched(&stamp);
+	}
+
+	if (!list_empty(&stable_node_migrate_list))
+		return;
+
+	/* nothing links to what may be left in the old tree now */
+	list_for_each_entry(tree_node, stable_tree_old_node_listp, all_list) {
+		stable_tree_node_removed(tree_node);
+		if (!(++removed % KSM_FREE_BULK))
+			ksm_cond_resched(&stamp);
+	}
+	free_all_tree_nodes(stable_tree_old_node_listp);
+	root_stable_old_treep = NULL;
+	stable_tree_old_node_listp = NULL;
+}
+
+/*
+ * stable_tree_reshared_insert() - put the nodes whose page was read back
+ * from swap by ksm_swap_reshare_page() back in the stable tree.
+ */
+static void stable_tree_reshared_insert(void)
+{
+	struct stable_node *node;
+	struct page *node_page;
+	unsigned long flags;
+
+	while (!hlist_empty(&ksm_swap_reshared)) {
+		spin_lock_irqsave(&ksm_swap_lock, flags);
+		node = NULL;
+		if (!hlist_empty(&ksm_swap_reshared)) {
+			node = hlist_entry(ksm_swap_reshared.first,
+					   struct stable_node, swap_hlist);
+			hlist_del_init(&node->swap_hlist);
+		}
+		spin_unlock_irqrestore(&ksm_swap_lock, flags);
+		if (!node)
+			break;
+
+		/* swapped out again meanwhile, it's parked again */
+		node_page = get_ksm_page(node, 1, 1);
+		if (!node_page)
+			continue;
+
+		list_move(&node->all_list, &stable_node_list);
+		if (!node->tree_node)
+			stable_node_reinsert(node, node_page, root_stable_treep,
+					     stable_tree_node_listp,
+					     page_hash(node_page, hash_strength,
+						       0));
+		put_page(node_page);
+		cond_resched();
+	}
+}
+
+/**
+ * stable_tree_delta_hash() - Start moving the stable tree from previous hash
+ * strength to the current hash_strength. The nodes are re-structured into
+ * the other tree by stable_tree_migrate() in batches for each ksm_do_scan().
+ * It's also used to re-distribute the stable nodes when merge_across_nodes
+ * is changed, with prev_hash_strength == hash_strength.
+ */
+static void stable_tree_delta_hash(u32 prev_hash_strength)
+{
+	int nid;
+	u64 start = local_clock();
+
+	/* The previous change is finished first, the strength it moved to */
+	stable_tree_migrate(ULONG_MAX, prev_hash_strength);
+
+	root_stable_old_treep = root_stable_treep;
+	stable_tree_old_node_listp = stable_tree_node_listp;
+	stable_tree_old_strength = prev_hash_strength;
+
+	stable_tree_index = (stable_tree_index + 1) % 2;
+	root_stable_treep = root_stable_tree[stable_tree_index];
+	stable_tree_node_listp = &stable_tree_node_list[stable_tree_index];
+	for (nid = 0; nid < nr_node_ids; nid++)
+		root_stable_treep[nid] = RB_ROOT;
+	BUG_ON(!list_empty(stable_tree_node_listp));
+
+	BUG_ON(!list_empty(&stable_node_migrate_list));
+	list_splice_init(&stable_node_list, &stable_node_migrate_list);
+
+	start = local_clock() - start;
+	ksm_hist_add(KSM_HIST_DELTA_HASH, start);
+	trace_ksm_stable_tree_delta_hash(prev_hash_strength, hash_strength,
+					 ksm_pages_shared, start);
+}
+
+static inline void inc_hash_strength(unsigned long delta)
+{
+	hash_strength += 1 << delta;
+	if (hash_strength > HASH_STRENGTH_MAX)
+		hash_strength = HASH_STRENGTH_MAX;
+}
+
+static inline void dec_hash_strength(unsigned long delta)
+{
+	unsigned long change = 1 << delta;
+
+	if (hash_strength <= change + 1)
+		hash_strength = 1;
+	else
+		hash_strength -= change;
+}
+
+static inline void inc_hash_strength_delta(void)
+{
+	hash_strength_delta++;
+	if (hash_strength_delta > HASH_STRENGTH_DELTA_MAX)
+		hash_strength_delta = HASH_STRENGTH_DELTA_MAX;
+}
+
+static inline unsigned long get_current_neg_ratio(void)
+{
+	if (!rshash_pos || rshash_neg > rshash_pos)
+		return 100;
+
+	return div64_u64(100 * rshash_neg , rshash_pos);
+}
+
+static inline u64 get_current_benefit(void)
+{
+	if (rshash_neg > rshash_pos)
+		return 0;
+
+	return div64_u64((rshash_pos - rshash_neg),
+			 ksm_pages_scanned - ksm_pages_scanned_last);
+}
+
+static inline int judge_rshash_direction(void)
+{
+	u64 current_neg_ratio, stable_benefit;
+	u64 current_benefit, delta = 0;
+	int ret;
+
+	current_neg_ratio = get_current_neg_ratio();
+
+	if (current_neg_ratio == 0) {
+		rshash_neg_cont_zero++;
+		if (rshash_neg_cont_zero > 2)
+			return GO_DOWN;
+		else
+			return STILL;
+	}
+	rshash_neg_cont_zero = 0;
+
+	if (current_neg_ratio > 90) {
+		ret = GO_UP;
+		goto out;
+	}
+
+	/* In case the system are still for a long time. */
+	if (ksm_scan_round % 1024 == 3) {
+		ret = OBSCURE;
+		goto out;
+	}
+
+
+	current_benefit = get_current_benefit();
+	stable_benefit = rshash_state.stable_benefit;
+
+	if (!stable_benefit) {
+		ret = OBSCURE;
+		goto out;
+	}
+
+	if (current_benefit > stable_benefit)
+		delta = current_benefit - stable_benefit;
+	else if (current_benefit < stable_benefit)
+		delta = stable_benefit - current_benefit;
+
+	delta = div64_u64(100 * delta , stable_benefit);
+
+	if (delta > 50) {
+		rshash_cont_obscure++;
+		if (rshash_cont_obscure > 2)
+			return OBSCURE;
+		else
+			return STILL;
+	}
+
+out:
+	rshash_cont_obscure = 0;
+	return STILL;
+}
+
+/**
+ * rshash_adjust() - The main function to control the random sampling state
+ * machine for hash strength adapting.
+ */
+static inline void rshash_adjust(void)
+{
+	unsigned long prev_hash_strength = hash_strength;
+
+	if (ksm_pages_scanned == ksm_pages_scanned_last)
+		return;
+
+	/* the probes adjust it within the round */
+	if (ksm_hash_probe_rate) {
+		rshash_neg = rshash_pos = 0;
+		return;
+	}
+
+	switch (rshash_state.state) {
+	case RSHASH_STILL:
+		switch (judge_rshash_direction()) {
+		case GO_UP:
+			if (rshash_state.pre_direct == GO_DOWN)
+				hash_strength_delta = 0;
+
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.stable_benefit = get_current_benefit();
+			rshash_state.pre_direct = GO_UP;
+			break;
+
+		case GO_DOWN:
+			if (rshash_state.pre_direct == GO_UP)
+				hash_strength_delta = 0;
+
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.stable_benefit = get_current_benefit();
+			rshash_state.pre_direct = GO_DOWN;
+			break;
+
+		case OBSCURE:
+			rshash_state.stable_point = hash_strength;
+			rshash_state.turn_point_down = hash_strength;
+			rshash_state.turn_point_up = hash_strength;
+			rshash_state.turn_benefit_down = get_current_benefit();
+			rshash_state.turn_benefit_up = get_current_benefit();
+			rshash_state.lookup_window_index = 0;
+			rshash_state.state = RSHASH_TRYDOWN;
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+
+			break;
+
+		case STILL:
+			break;
+		default:
+			BUG();
+		}
+		break;
+
+	case RSHASH_TRYDOWN:
+		if (rshash_state.lookup_window_index++ % 5 == 0)
+			rshash_state.below_count = 0;
+
+		if (get_current_benefit() < rshash_state.stable_benefit)
+			rshash_state.below_count++;
+		else if (get_current_benefit() >
+			 rshash_state.turn_benefit_down) {
+			rshash_state.turn_point_down = hash_strength;
+			rshash_state.turn_benefit_down = get_current_benefit();
+		}
+
+		if (rshash_state.below_count >= 3 ||
+		    judge_rshash_direction() == GO_UP) {
+			hash_strength = rshash_state.stable_point;
+			hash_strength_delta = 0;
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.lookup_window_index = 0;
+			rshash_state.state = RSHASH_TRYUP;
+			hash_strength_delta = 0;
+		} else {
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+		}
+		break;
+
+	case RSHASH_TRYUP:
+		if (rshash_state.lookup_window_index++ % 5 == 0)
+			rshash_state.below_count = 0;
+
+		if (get_current_benefit() < rshash_state.stable_benefit)
+			rshash_state.below_count++;
+		else if (get_current_benefit() > rshash_state.turn_benefit_up) {
+			rshash_state.turn_point_up = hash_strength;
+			rshash_state.turn_benefit_up = get_current_benefit();
+		}
+
+		if (rshash_state.below_count >= 3 ||
+		    judge_rshash_direction() == GO_DOWN) {
+			hash_strength = rshash_state.turn_benefit_up >
+				rshash_state.turn_benefit_down ?
+				rshash_state.turn_point_up :
+				rshash_state.turn_point_down;
+
+			rshash_state.state = RSHASH_PRE_STILL;
+		} else {
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+		}
+
+		break;
+
+	case RSHASH_NEW:
+	case RSHASH_PRE_STILL:
+		rshash_state.stable_benefit = get_current_benefit();
+		rshash_state.state = RSHASH_STILL;
+		hash_strength_delta = 0;
+		break;
+	default:
+		BUG();
+	}
+
+	rshash_neg = rshash_pos = 0;
+
+	if (prev_hash_strength != hash_strength)
+		stable_tree_delta_hash(prev_hash_strength);
+}
+
+/*
+ * hash_probe_adjust() - once a table worth of probes is taken, move
+ * hash_strength to the candidate of the lowest estimated cost per page: its
+ * samples, plus the chance of a collision in the trees times what one costs.
+ * The probe tables hold only a sample of the pages in the trees, the
+ * collisions found in them are scaled up by how many more the trees have.
+ * Not while the stable tree is still migrating from the last change.
+ */
+static void hash_probe_adjust(void)
+{
+	unsigned long prev_hash_strength = hash_strength;
+	u64 cost[KSM_PROBE_CANDIDATES], colli;
+	unsigned long nodes, strength;
+	int i, best = 1;
+
+	if (!ksm_hash_probe_rate || ksm_probes < (1 << KSM_PROBE_BITS) ||
+	    root_stable_old_treep)
+		return;
+
+	nodes = ksm_pages_shared + ksm_pages_unshared;
+	for (i = 0; i < KSM_PROBE_CANDIDATES; i++) {
+		strength = ksm_probe_strength[i];
+		colli = 0;
+		if (ksm_probe_used[i])
+			colli = div64_u64((u64)ksm_probe_colli[i] * nodes * 1024,
+					  (u64)ksm_probes * ksm_probe_used[i]);
+		colli = min_t(u64, colli, 1024);
+		cost[i] = (u64)strength * 1024 +
+			  colli * (memcmp_cost + HASH_STRENGTH_MAX - strength);
+	}
+
+	/* a move has to save 5% at least, not to wander on noise */
+	for (i = 0; i < KSM_PROBE_CANDIDATES; i++)
+		if (cost[i] * 100 < cost[best] * 95)
+			best = i;
+
+	if (best != 1) {
+		hash_strength = ksm_probe_strength[best];
+		stable_tree_delta_hash(prev_hash_strength);
+		ksm_hash_probe_moves++;
+	}
+	hash_probe_reset();
+}
+
+static void ksm_intertab_clear(struct vma_slot *slot)
+{
+	struct vma_pair *pair, *tmp;
+
+	list_for_each_entry_safe(pair, tmp, &slot->pairs_lo, lo_list)
+		free_vma_pair(pair);
+
+	list_for_each_entry_safe(pair, tmp, &slot->pairs_hi, hi_list)
+		free_vma_pair(pair);
+
+	list_del_init(&slot->intertab_list);
+	slot->dup_wide = 0;
+}
+
+
+/*
+ * slot_hash_adjust() - at the end of a round, let a slot have strong_hash
+ * from the collisions its lookups found, see ksm_strong_hash_ratio.
+ */
+static inline void slot_hash_adjust(struct vma_slot *slot)
+{
+	unsigned long ratio;
+	unsigned char strong = slot->strong_hash;
+
+	if (!ksm_strong_hash_ratio) {
+		strong = 0;
+	} else if (slot->hash_hits) {
+		ratio = slot->hash_colli * 100 / slot->hash_hits;
+		if (ratio >= ksm_strong_hash_ratio)
+			strong = 1;
+		else if (ratio < ksm_strong_hash_ratio / 2)
+			strong = 0;
+	}
+
+	if (strong != slot->strong_hash) {
+		if (strong)
+			ksm_strong_hash_slots++;
+		else
+			ksm_strong_hash_slots--;
+		slot->strong_hash = strong;
+	}
+	slot->hash_hits = 0;
+	slot->hash_colli = 0;
+}
+
+/* fold the dedup ratio of this round into the decayed one */
+static inline void slot_dedup_decay(struct vma_slot *slot)
+{
+	unsigned long avg = slot->dedup_avg;
+
+	/* a slot without a history takes the first ratio it shows */
+	if (!avg)
+		avg = slot->dedup_ratio;
+	else
+		avg = avg - (avg >> ksm_dedup_decay) +
+		      (slot->dedup_ratio >> ksm_dedup_decay);
+	slot->dedup_avg = avg;
+}
+
+/*
+ * slot_rung_steps() - how many rungs @slot is to go up, or down if negative,
+ * for its decayed dedup ratio against the @mean of them all.
+ */
+static int slot_rung_steps(struct vma_slot *slot, unsigned long mean)
+{
+	unsigned long avg = slot->dedup_avg;
+	unsigned long band = mean * ksm_rung_hysteresis / 100;
+	unsigned long upper = mean + band, lower = mean - band;
+	int steps = 0;
+
+	if (avg && avg >= upper)
+		steps = 1 + ilog2(avg / max(upper, 1UL));
+	else if (!avg || avg < lower)
+		steps = -(1 + ilog2(max(lower, 1UL) / max(avg, 1UL)));
+
+	return clamp_t(int, steps, -(int)ksm_rung_jump_max,
+		       ksm_rung_jump_max);
+}
+
+static void slot_rung_adjust(struct vma_slot *slot, unsigned long mean)
+{
+	int steps = slot_rung_steps(slot, mean);
+
+	if (steps > 0) {
+		vma_rung_up(slot, steps);
+		vma_burst_end(slot, 1);
+		slot->huge_hold = ksm_khugepaged_hold;
+	} else if (steps < 0) {
+		vma_rung_down(slot, -steps);
+		vma_burst_end(slot, 0);
+		slot->huge_hold = 0;
+	} else {
+		/* within the band, it stays where it is */
+		vma_burst_end(slot, slot->dedup_avg >= mean);
+	}
+}
+
+/**
+ * round_update_ladder() - The main function to do update of all the
+ * adjustments whenever a scan round is finished.
+ */
+static void round_update_ladder(void)
+{
+	int i;
+	struct vma_slot *slot, *tmp_slot;
+	struct vma_pair *pair;
+	unsigned long dedup_ratio_max = 0, dedup_ratio_mean = 0;
+	unsigned long threshold;
+	unsigned long pairs = ksm_vma_pair_num;
+	unsigned long estimate = 0;
+	u64 start = local_clock(), stamp = start;
+
+	/* Every pair is on the pairs_lo of exactly one slot of this list */
+	list_for_each_entry(slot, &ksm_intertab_slots, intertab_list) {
+		list_for_each_entry(pair, &slot->pairs_lo, lo_list)
+			cal_pair_dedup(pair);
+		ksm_cond_resched(&stamp);
+	}
+
+	list_for_each_entry(slot, &ksm_intertab_slots, intertab_list) {
+		if (slot->dup_wide && slot_round_scanned(slot))
+			slot->dedup_num += slot->dup_wide * slot->pages /
+					   slot_round_scanned(slot);
+		slot->dedup_ratio = cal_dedup_ratio(slot);
+		slot->last_dedup_ratio = slot->dedup_ratio;
+		slot_dedup_decay(slot);
+		if (dedup_ratio_max < slot->dedup_ratio)
+			dedup_ratio_max = slot->dedup_ratio;
+		dedup_ratio_mean += slot->dedup_avg;
+	}
+
+	dedup_ratio_mean /= ksm_vma_slot_num;
+	threshold = dedup_ratio_mean;
+
+	list_for_each_entry_safe(slot, tmp_slot, &ksm_intertab_slots,
+				 intertab_list) {
+		slot_rung_adjust(slot, threshold);
+
+		ksm_intertab_clear(slot);
+		slot->slot_scanned = 0;
+		slot->dedup_ratio = 0;
+		slot->dedup_num = 0;
+		/* paired from the trees, it may not have been scanned */
+		if (list_empty(&slot->round_list))
+			list_add_tail(&slot->round_list, &ksm_round_slots);
+	}
+
+	BUG_ON(ksm_vma_pair_num != 0);
+
+	/* the others were not scanned, nothing of theirs is to be reset */
+	list_for_each_entry_safe(slot, tmp_slot, &ksm_round_slots,
+				 round_list) {
+		/*
+		 * The slots were scanned but not in inter_tab, their
+		 * dedup must be 0.
+		 */
+		if (slot->slot_scanned) {
+			BUG_ON(slot->dedup_ratio != 0);
+			slot->last_dedup_ratio = 0;
+			slot_dedup_decay(slot);
+			slot_rung_adjust(slot, threshold);
+		}
+
+		if (slot->pages_merged && slot_round_scanned(slot))
+			estimate += slot->pages_merged * slot->pages /
+				    slot_round_scanned(slot);
+		slot->last_scanned = slot->pages_scanned;
+		slot->slot_scanned = 0;
+		slot->pages_merged = 0;
+		slot->pages_present = 0;
+		slot->pages_holes = 0;
+		slot_hash_adjust(slot);
+		/* a MADV_MERGE_ONCE one done stays fully scanned */
+		if (slot->fully_scanned && slot->once != 2) {
+			slot->fully_scanned = 0;
+			slot->rung->fully_scanned_slots--;
+		}
+		BUG_ON(!list_empty(&slot->intertab_list));
+		list_del_init(&slot->round_list);
+		ksm_cond_resched(&stamp);
+	}
+
+	for (i = 0; i < ksm_scan_ladder_size; i++) {
+		ksm_scan_ladder[i].round_finished = 0;
+		ksm_scan_ladder[i].round_start_j = jiffies;
+		BUG_ON(ksm_scan_ladder[i].fully_scanned_slots >
+		       ksm_scan_ladder[i].vma_num);
+	}
+
+	rshash_adjust();
+	refill_index_pool();
+
+	ksm_pages_scanned_last = ksm_pages_scanned;
+	if (ksm_seed_nr && !--ksm_seed_rounds)
+		seed_fps_free();
+	if (ksm_run & KSM_RUN_ESTIMATE)
+		ksm_estimate_sharing = estimate;
+	ksm_file_pages_seen_last = ksm_file_pages_seen;
+	ksm_hash_max_pages_last = ksm_hash_max_pages;
+	ksm_subtree_lookups_last = ksm_subtree_lookups;
+	ksm_hash_max_pages = ksm_subtree_lookups = 0;
+	ksm_file_pages_dup_last = ksm_file_pages_dup;
+	ksm_file_pages_seen = ksm_file_pages_dup = 0;
+	ksm_pages_near_dup_last = ksm_pages_near_dup;
+	ksm_near_dup_lines_last = ksm_near_dup_lines_total;
+	ksm_pages_near_dup = ksm_near_dup_lines_total = 0;
+
+	start = local_clock() - start;
+	ksm_hist_add(KSM_HIST_ROUND_UPDATE, start);
+	trace_ksm_round_update_ladder(ksm_scan_round, ksm_vma_slot_num, pairs,
+				      dedup_ratio_max, dedup_ratio_mean, start);
+}
+
+static inline unsigned int ksm_pages_to_scan(unsigned int batch_pages)
+{
+	return totalram_pages * batch_pages / 1000000;
+}
+
+static inline void cal_ladder_pages_to_scan(unsigned int num)
+{
+	int i;
+
+	for (i = 0; i < ksm_scan_ladder_size; i++) {
+		ksm_scan_ladder[i].pages_to_scan = num
+			* ksm_scan_ladder[i].scan_ratio / KSM_SCAN_RATIO_MAX
+			/ ksm_rung_quota_div[i];
+	}
+}
+
+/* The default quota divisors: the two lowest rungs get 1/16 and 1/4 */
+static void ladder_default_quota(void)
+{
+	int i;
+
+	for (i = 0; i < KSM_SCAN_LADDER_MAX; i++)
+		ksm_rung_quota_div[i] = 1;
+	ksm_rung_quota_div[0] = 16;
+	if (ksm_scan_ladder_size > 2)
+		ksm_rung_quota_div[1] = 4;
+}
+
+/*
+ * ladder_reconfigure() - rebuild the ladder with @n rungs of the increasing
+ * @ratios, the last one being KSM_SCAN_RATIO_MAX. Each slot goes to the
+ * highest new rung not scanning faster than its old one did, no lower than
+ * its memcg lets it fall. The quota divisors are back to the defaults.
+ * Called with ksm_thread_mutex held.
+ */
+static void ladder_reconfigure(unsigned long *ratios, unsigned int n)
+{
+	struct list_head old_lists[KSM_SCAN_LADDER_MAX];
+	unsigned long old_ratios[KSM_SCAN_LADDER_MAX];
+	unsigned int old_size = ksm_scan_ladder_size;
+	struct vma_slot *slot, *tmp;
+	struct scan_rung *rung, *min_rung;
+	int i, j;
+
+	for (i = 0; i < old_size; i++) {
+		INIT_LIST_HEAD(&old_lists[i]);
+		list_splice_init(&ksm_scan_ladder[i].vma_list, &old_lists[i]);
+		old_ratios[i] = ksm_scan_ladder[i].scan_ratio;
+	}
+
+	for (i = 0; i < KSM_SCAN_LADDER_MAX; i++) {
+		rung = &ksm_scan_ladder[i];
+		INIT_LIST_HEAD(&rung->vma_list);
+		rung->current_scan = &rung->vma_list;
+		rung->pages_to_scan = 0;
+		rung->round_finished = 0;
+		rung->round_start_j = jiffies;
+		rung->revisit_misses = 0;
+		rung->fully_scanned_slots = 0;
+		rung->vma_num = 0;
+		rung->scan_ratio = i < n ? ratios[i] : 0;
+		ksm_rung_revisit_ms[i] = 0;
+	}
+	ksm_scan_ladder_size = n;
+
+	for (i = 0; i < old_size; i++) {
+		for (j = n - 1; j > 0 && ratios[j] > old_ratios[i]; j--)
+			;
+
+		list_for_each_entry_safe(slot, tmp, &old_lists[i], ksm_list) {
+			rung = &ksm_scan_ladder[j];
+			min_rung = slot_min_rung(slot);
+			if (min_rung > rung)
+				rung = min_rung;
+
+			rung = slot_rung_fit(slot, rung);
+			slot->pages_to_scan =
+				get_vma_random_scan_num(slot, rung->scan_ratio);
+
+			list_move_tail(&slot->ksm_list, &rung->vma_list);
+			slot->rung = rung;
+			rung->vma_num++;
+			if (slot->fully_scanned)
+				rung->fully_scanned_slots++;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		ksm_scan_ladder[i].current_scan =
+			ksm_scan_ladder[i].vma_list.next;
+
+	ladder_default_quota();
+	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+}
+
+static void ksm_control_lock_nested(unsigned int subclass)
+{
+	atomic_inc(&ksm_control_waiters);
+	mutex_lock_nested(&ksm_thread_mutex, subclass);
+	atomic_dec(&ksm_control_waiters);
+}
+
+static inline void ksm_control_lock(void)
+{
+	ksm_control_lock_nested(0);
+}
+
+/*
+ * ksm_unlink_vma_slot() - take a slot whose vma is gone, or excluded by its
+ * memcg, off the ladder and out of the inter-table, and leave it on
+ * ksm_slots_dying for its rmap_items to be freed by ksm_slot_del_work.
+ * Called with ksm_thread_mutex held.
+ */
+static void ksm_unlink_vma_slot(struct vma_slot *slot)
+{
+	BUG_ON(list_empty(&slot->ksm_list) || !slot->rung);
+
+	if (slot->rung->current_scan == &slot->ksm_list)
+		slot->rung->current_scan = slot->rung->current_scan->next;
+
+	list_del_init(&slot->ksm_list);
+	list_del_init(&slot->round_list);
+	slot->rung->vma_num--;
+	if (slot->fully_scanned)
+		slot->rung->fully_scanned_slots--;
+
+	if (slot->rung->current_scan == &slot->rung->vma_list) {
+		/* This rung finishes a round */
+		rung_round_end(slot->rung);
+		slot->rung->current_scan = slot->rung->vma_list.next;
+		BUG_ON(slot->rung->current_scan == &slot->rung->vma_list
+		       && !list_empty(&slot->rung->vma_list));
+	}
+
+	ksm_intertab_clear(slot);
+	slot->rung = NULL;
+	BUG_ON(!ksm_vma_slot_num);
+	ksm_vma_slot_num--;
+
+	list_add_tail(&slot->ksm_list, &ksm_slots_dying);
+	ksm_slots_dying_num++;
+}
+
+/*
+ * slot_del_node_vma() - take up to @max rmap_items of a dying slot off the
+ * node_vma of @rmap_item, that is off one stable node, under a single lock
+ * of its ksm page instead of one each, and free them. Returns how many went,
+ * 0 if the page is gone and remove_rmap_item_from_tree() has to see to it.
+ */
+static unsigned long slot_del_node_vma(struct vma_slot *slot,
+				       struct rmap_item *rmap_item,
+				       unsigned long max)
+{
+	struct node_vma *node_vma = rmap_item->head;
+	struct stable_node *stable_node = node_vma->head;
+	struct rmap_list_entry *entry;
+	struct rmap_item *item;
+	struct hlist_node *pos, *n;
+	struct page *page;
+	unsigned long nr = 0, index;
+	int last = 0;
+	HLIST_HEAD(items);
+
+	page = get_ksm_page(stable_node, 1, 1);
+	if (!page)
+		return 0;
+
+	lock_page(page);
+	hlist_for_each_entry_safe(item, pos, n, &node_vma->rmap_hlist, hlist) {
+		if (nr >= max)
+			break;
+		hlist_del(&item->hlist);
+		hlist_add_head(&item->hlist, &items);
+		stable_node->rmap_nr--;
+		nr++;
+	}
+	if (hlist_empty(&node_vma->rmap_hlist)) {
+		unlink_node_vma(node_vma);
+		last = hlist_empty(&stable_node->hlist);
+	}
+	unlock_page(page);
+	put_page(page);
+
+	/* see remove_rmap_item_from_tree(): the last one out was shared */
+	ksm_pages_sharing -= nr - last;
+	ksm_pages_shared -= last;
+	slot->pages_ksm -= nr;
+	mem_cgroup_ksm_stat(slot->memcg, MEM_CGROUP_KSM_PAGES_MERGED, -nr);
+
+	hlist_for_each_entry_safe(item, pos, n, &items, hlist) {
+		ksm_drop_anon_vma(item);
+		index = (get_rmap_addr(item) - slot->vstart) >> PAGE_SHIFT;
+		entry = get_rmap_list_entry(slot, index, 0);
+		if (entry && !is_addr(entry->addr) && entry->item == item) {
+			entry->addr = get_rmap_addr(item);
+			set_is_addr(entry->addr);
+			slot->pool_counts[get_pool_index(slot, index)]--;
+		}
+		free_rmap_item(item);
+	}
+
+	return nr;
+}
+
+/*
+ * ksm_slot_free_items() - free about @budget more rmap_items of a dying
+ * slot, and the pools they leave empty. Returns nonzero once all are gone.
+ * Called with ksm_thread_mutex held.
+ */
+static int ksm_slot_free_items(struct vma_slot *slot, unsigned long budget)
+{
+	struct rmap_list_entry *entry;
+	struct rmap_item *item;
+	unsigned long i, j, nr, done = 0;
+
+	if (!slot->rmap_list_pool)
+		return 1;
+
+	for (i = 0; i < slot->pool_size; i++) {
+		if (!slot->rmap_list_pool[i])
+			continue;
+
+		entry = slot->rmap_list_pool[i];
+		for (j = 0; j < pool_entries_nr(slot) && slot->pool_counts[i];
+		     j++, entry++) {
+			if (is_addr(entry->addr) || !entry->item)
+				continue;
+			if (done >= budget)
+				return 0;
+
+			item = entry->item;
+			nr = 0;
+			if (item->address & STABLE_FLAG)
+				nr = slot_del_node_vma(slot, item,
+						       budget - done);
+			if (!nr) {
+				free_entry_item(entry);
+				nr = 1;
+			}
+			done += nr;
+		}
+		BUG_ON(slot->pool_counts[i]);
+		free_slot_pool(slot, i);
+	}
+
+	return 1;
+}
+
+/*
+ * The rmap_items of @slot are all gone, free the rest of it. An excluded
+ * slot whose vma is still there is left on noadd for ksm_remove_vma().
+ */
+static void ksm_free_dead_slot(struct vma_slot *slot)
+{
+	struct vma_slot_queue *queue = slot->queue;
+
+	list_del(&slot->ksm_list);
+	BUG_ON(!ksm_slots_dying_num);
+	ksm_slots_dying_num--;
+
+	if (slot->excluded) {
+		spin_lock(&queue->lock);
+		if (slot->excluded == 1) {
+			slot->excluded = 0;
+			spin_unlock(&queue->lock);
+			return;
+		}
+		list_del(&slot->slot_list);
+		spin_unlock(&queue->lock);
+	}
+	free_vma_slot(slot);
+}
+
+/*
+ * The rmap_items of a big vma gone are too many to free in one go by the
+ * scanner finding it on the del list: it only takes the slot off the ladder,
+ * ksm_slot_del_work frees them KSM_SLOT_DEL_BATCH at a time, letting the
+ * scanners have ksm_thread_mutex between two batches.
+ */
+#define KSM_SLOT_DEL_BATCH	1024
+
+static void ksm_slot_del_worker(struct work_struct *work)
+{
+	struct vma_slot *slot;
+
+	ksm_control_lock();
+	while (!list_empty(&ksm_slots_dying)) {
+		slot = list_first_entry(&ksm_slots_dying, struct vma_slot,
+					ksm_list);
+		if (ksm_slot_free_items(slot, KSM_SLOT_DEL_BATCH))
+			ksm_free_dead_slot(slot);
+
+		mutex_unlock(&ksm_thread_mutex);
+		cond_resched();
+		ksm_control_lock();
+	}
+	mutex_unlock(&ksm_thread_mutex);
+}
+
+static DECLARE_WORK(ksm_slot_del_work, ksm_slot_del_worker);
+
+/*
+ * ksm_exclude_vma_slot() - unmerge a slot whose memcg was excluded from
+ * merging after it entered, and take it off the ladder. Called with
+ * ksm_thread_mutex and its mmap_sem held. Its vma stays: the slot waits on
+ * noadd as one which never entered, try_down_read_slot_mmap_sem() finding
+ * it there keeps the unstable tree off its rmap_items until they are freed.
+ */
+static void ksm_exclude_vma_slot(struct vma_slot *slot)
+{
+	unmerge_ksm_pages(slot->vma, slot->vstart, slot_end(slot));
+	ksm_unlink_vma_slot(slot);
+
+	spin_lock(&slot->queue->lock);
+	slot->excluded = 1;
+	list_add_tail(&slot->slot_list, &slot->queue->noadd);
+	spin_unlock(&slot->queue->lock);
+
+	queue_work(system_unbound_wq, &ksm_slot_del_work);
+}
+
+/*
+ * Under memory pressure, the shrinker drops the rmap_items not in the
+ * stable tree of the slots on the lower half of the ladder, lowest first,
+ * and the pools they leave empty: these only remember pages which did not
+ * merge, and are rebuilt when the slots are scanned again. It gives up when
+ * ksm_thread_mutex is taken, as by the scanner threads allocating.
+ */
+static unsigned long ksm_shrinker_freed;
+
+static unsigned long ksm_shrink_slot(struct vma_slot *slot, unsigned long nr)
+{
+	struct rmap_list_entry *entry;
+	unsigned long i, j, freed = 0;
+
+	for (i = 0; i < slot->pool_size && freed < nr; i++) {
+		if (!slot->rmap_list_pool[i])
+			continue;
+
+		entry = slot->rmap_list_pool[i];
+		for (j = 0; j < pool_entries_nr(slot); j++, entry++) {
+			if (is_addr(entry->addr) || !entry->item ||
+			    in_stable_tree(entry->item))
+				continue;
+			free_entry_item(entry);
+			freed++;
+		}
+
+		if (!slot->pool_counts[i])
+			free_slot_pool(slot, i);
+	}
+
+	return freed;
+}
+
+static int ksm_shrink(struct shrinker *shrink, int nr_to_scan, gfp_t gfp_mask)
+{
+	unsigned int i, rungs = max(ksm_scan_ladder_size / 2, 1U);
+	unsigned long freed = 0;
+	struct vma_slot *slot;
+	long unstable;
+
+	if (!nr_to_scan)
+		goto out;
+
+	if (!mutex_trylock(&ksm_thread_mutex))
+		return -1;
+
+	for (i = 0; i < rungs && freed < nr_to_scan; i++) {
+		list_for_each_entry(slot, &ksm_scan_ladder[i].vma_list,
+				    ksm_list) {
+			/* still being hashed by another scanner thread */
+			if (slot->scan_owner || !slot->rmap_list_pool)
+				continue;
+			freed += ksm_shrink_slot(slot, nr_to_scan - freed);
+			if (freed >= nr_to_scan)
+				break;
+		}
+	}
+	ksm_shrinker_freed += freed;
+	mutex_unlock(&ksm_thread_mutex);
+
+out:
+	/* the rmap_items of the other rungs are counted in too, racily */
+	unstable = ksm_rmap_items - ksm_pages_shared - ksm_pages_sharing;
+	return clamp_t(long, unstable, 0, INT_MAX);
+}
+
+static struct shrinker ksm_shrinker = {
+	.shrink = ksm_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+
+static inline void cleanup_vma_slots(void)
+{
+	struct vma_slot_queue *queue;
+	struct vma_slot *slot;
+	LIST_HEAD(busy_list);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(vma_slot_queues, cpu);
+		if (list_empty(&queue->del))
+			continue;
+
+		spin_lock(&queue->lock);
+		while (!list_empty(&queue->del)) {
+			slot = list_entry(queue->del.next,
+					  struct vma_slot, slot_list);
+			/* still being hashed by another scanner thread */
+			if (slot->scan_owner) {
+				list_move_tail(&slot->slot_list, &busy_list);
+				continue;
+			}
+			list_del(&slot->slot_list);
+			spin_unlock(&queue->lock);
+			ksm_unlink_vma_slot(slot);
+			spin_lock(&queue->lock);
+		}
+		list_splice_init(&busy_list, &queue->del);
+		spin_unlock(&queue->lock);
+	}
+
+	if (!list_empty(&ksm_slots_dying))
+		queue_work(system_unbound_wq, &ksm_slot_del_work);
+}
+
+static inline int rung_fully_scanned(struct scan_rung *rung)
+{
+	return (rung->fully_scanned_slots == rung->vma_num &&
+		rung->fully_scanned_slots);
+}
+
+/*
+ * ksm_scan_make_way() - called by a scanner holding ksm_thread_mutex but no
+ * mmap_sem, between two batches: drop the mutex until the control operations
+ * waiting for it got it. The scan goes on from the ladder as it finds it.
+ */
+static void ksm_scan_make_way(void)
+{
+	if (likely(!atomic_read(&ksm_control_waiters)))
+		return;
+
+	mutex_unlock(&ksm_thread_mutex);
+	while (atomic_read(&ksm_control_waiters))
+		schedule_timeout_uninterruptible(1);
+	mutex_lock(&ksm_thread_mutex);
+}
+
+/**
+ * ksm_do_scan()  - the main worker function.
+ */
+/*
+ * ksm_rung_order() - the order ksm_do_scan() serves the rungs in: those with
+ * a revisit target still in their round by the earliest deadline, then the
+ * others from the top down. The quota a rung leaves goes to the next one.
+ */
+static void ksm_rung_order(int *order)
+{
+	int i, j, k, n = 0;
+
+	for (i = ksm_scan_ladder_size - 1; i >= 0; i--) {
+		struct scan_rung *rung = &ksm_scan_ladder[i];
+
+		if (!ksm_rung_revisit_ms[i] || rung->round_finished)
+			continue;
+		for (j = n; j > 0; j--) {
+			k = order[j - 1];
+			if (!time_before(rung_deadline(rung),
+					 rung_deadline(&ksm_scan_ladder[k])))
+				break;
+			order[j] = k;
+		}
+		order[j] = i;
+		n++;
+	}
+
+	for (i = ksm_scan_ladder_size - 1; i >= 0; i--)
+		if (!ksm_rung_revisit_ms[i] || ksm_scan_ladder[i].round_finished)
+			order[n++] = i;
+}
+
+static void ksm_do_scan(void)
+{
+	struct vma_slot *slot, *iter;
+	struct list_head *next_scan, *iter_head;
+	struct mm_struct *busy_mm;
+	unsigned char round_finished, all_rungs_emtpy;
+	int order[KSM_SCAN_LADDER_MAX];
+	int i, n, err, kept;
+	unsigned long rest_pages;
+
+	might_sleep();
+
+	if (ksm_use_magazines)
+		ksm_magazines_refill();
+	stable_tree_migrate(KSM_STABLE_MIGRATE_BATCH, hash_strength);
+	stable_tree_reshared_insert();
+
+	rest_pages = 0;
+repeat_all:
+	ksm_rung_order(order);
+	for (n = 0; n < ksm_scan_ladder_size; n++) {
+		struct scan_rung *rung = &ksm_scan_ladder[order[n]];
+
+		if (!rung->pages_to_scan)
+			continue;
+
+		if (list_empty(&rung->vma_list)) {
+			rung->pages_to_scan = 0;
+			continue;
+		}
+
+		/*
+		 * if a rung is fully scanned, its rest pages should be
+		 * propagated to the rungs served after it. This can prevent the higher
+		 * rung from waiting a long time while it still has its
+		 * pages_to_scan quota.
+		 *
+		 */
+		if (rung_fully_scanned(rung)) {
+			rest_pages += rung->pages_to_scan;
+			rung->pages_to_scan = 0;
+			continue;
+		}
+
+		rung->pages_to_scan += rest_pages;
+		rest_pages = 0;
+		while (rung->pages_to_scan && likely(!freezing(current))) {
+			rung->pages_to_scan--;
+
+cleanup:
+			cleanup_vma_slots();
+
+			if (list_empty(&rung->vma_list))
+				break;
+
+rescan:
+			BUG_ON(rung->current_scan == &rung->vma_list &&
+			       !list_empty(&rung->vma_list));
+
+			slot = list_entry(rung->current_scan,
+					 struct vma_slot, ksm_list);
+
+			if (slot->scan_owner)
+				err = -EBUSY;
+			else
+				err = try_down_read_slot_mmap_sem(slot);
+			if (err == -ENOENT)
+				goto cleanup;
+
+			busy_mm = slot->mm;
+
+busy:
+			if (err == -EBUSY) {
+				/* skip other vmas on the same mm */
+				iter = slot;
+				iter_head = slot->ksm_list.next;
+
+				while (iter_head != &rung->vma_list) {
+					iter = list_entry(iter_head,
+							  struct vma_slot,
+							  ksm_list);
+					if (iter->vma->vm_mm != busy_mm)
+						break;
+					iter_head = iter_head->next;
+				}
+
+				if (iter->vma->vm_mm != busy_mm) {
+					rung->current_scan = &iter->ksm_list;
+					goto rescan;
+				} else {
+					/* This is the only vma on this rung */
+					break;
+				}
+			}
+
+			BUG_ON(!vma_can_enter(slot->vma));
+			if (ksm_test_exit(slot->vma->vm_mm)) {
+				busy_mm = slot->vma->vm_mm;
+				up_read(&slot->vma->vm_mm->mmap_sem);
+				err = -EBUSY;
+				goto busy;
+			}
+
+			if (unlikely(!slot_min_rung(slot))) {
+				ksm_exclude_vma_slot(slot);
+				up_read(&slot->mm->mmap_sem);
+				goto next_page;
+			}
+
+			if (slot->pages_scanned % slot->pages_to_scan == 0 &&
+			    slot_quiesce_check(slot)) {
+				/* on the top rung now, its pass starts there */
+				up_read(&slot->mm->mmap_sem);
+				goto next_page;
+			}
+
+			/* Ok, we have take the mmap_sem, ready to scan */
+			scan_slot_run(slot, rung);
+			up_read(&slot->mm->mmap_sem);
+
+			/*
+			 * Another scanner thread may have moved on from this
+			 * slot while we were hashing it unlocked.
+			 */
+			if (rung->current_scan != &slot->ksm_list)
+				goto next_page;
+
+			if ((slot->pages_scanned &&
+			     slot->pages_scanned % slot->pages_to_scan == 0)
+			    || slot->fully_scanned) {
+				next_scan = rung->current_scan->next;
+				if (next_scan == &rung->vma_list) {
+					/*
+					 * All the slots in this rung
+					 * have been traveled in this
+					 * round.
+					 */
+					rung_round_end(rung);
+					rung->current_scan =
+						rung->vma_list.next;
+					if (rung_fully_scanned(rung)) {
+						/*
+						 * All the pages in all slots
+						 * have been scanned.
+						 */
+						rest_pages +=
+							rung->pages_to_scan;
+						rung->pages_to_scan = 0;
+						break;
+					}
+				} else {
+					rung->current_scan = next_scan;
+				}
+			}
+next_page:
+			if (ksm_use_magazines)
+				ksm_magazines_refill();
+			ksm_scan_make_way();
+			/* run=2 may have unmerged all while we made way */
+			if (unlikely(!ksmd_should_run()))
+				return;
+			cond_resched();
+		}
+	}
+
+	round_finished = 1;
+	all_rungs_emtpy = 1;
+	for (i = 0; i < ksm_scan_ladder_size; i++) {
+		struct scan_rung *rung = &ksm_scan_ladder[i];
+
+		if (!list_empty(&rung->vma_list)) {
+			all_rungs_emtpy = 0;
+			if (!rung->round_finished)
+				round_finished = 0;
+			break;
+		}
+	}
+
+	if (all_rungs_emtpy)
+		round_finished = 0;
+
+	cleanup_vma_slots();
+
+	if (round_finished) {
+		kept = unstable_tree_keep();
+
+		/* at the strength of this round, rshash_adjust() may change it */
+		if (!kept && ksm_hash_cache)
+			unstable_tree_cache_hashes(hash_strength);
+		round_update_ladder();
+
+		/*
+		 * A number of pages can hang around indefinitely on per-cpu
+		 * pagevecs, raised page count preventing write_protect_page
+		 * from merging them.  Though it doesn't really matter much,
+		 * it is puzzling to see some stuck in pages_volatile until
+		 * other activity jostles them out, and they also prevented
+		 * LTP's KSM test from succeeding deterministically; so drain
+		 * them here (here rather than on entry to ksm_do_scan(),
+		 * so we don't IPI too often when pages_to_scan is set low).
+		 */
+		lru_add_drain_all();
+
+		/* sync with ksm_remove_vma for rb_erase */
+		ksm_scan_round++;
+		ksm_round_start_j = jiffies;
+		if (!kept || !unstable_tree_keep()) {
+			unstable_tree_empty();
+			kept = 0;
+		}
+		tree_index_round_end(kept);
+		stable_filter_round_end();
+	}
+
+	for (i = 0; i < ksm_scan_ladder_size; i++) {
+		struct scan_rung *rung = &ksm_scan_ladder[i];
+
+		/*
+		 * Before we can go sleep, we should make sure that all the
+		 * pages_to_scan quota for this scan has been finished
+		 */
+		if (!list_empty(&rung->vma_list) && rung->pages_to_scan)
+			goto repeat_all;
+	}
+
+	hash_probe_adjust();
+	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+}
+
+#define __round_mask(x, y) ((__typeof__(x))((y)-1))
+#define round_up(x, y) ((((x)-1) | __round_mask(x, y))+1)
+
+static inline unsigned long vma_pool_size(struct vma_slot *slot)
+{
+	return round_up(sizeof(struct rmap_list_entry) * slot->pages,
+			PAGE_SIZE) >> PAGE_SHIFT;
+}
+
+/* a new slot not placed by fork or advice, of a big enough vma */
+static inline int slot_can_burst(struct vma_slot *slot)
+{
+	struct vm_area_struct *vma = slot->vma;
+
+	return ksm_burst_min_pages && !slot->enter_rung &&
+	       (vma->vm_end - vma->vm_start) >> PAGE_SHIFT >=
+	       ksm_burst_min_pages &&
+	       ksm_burst_pages + slot->pages <= ksm_burst_max_pages;
+}
+
+/**
+ *
+ *
+ *
+ * @param slot
+ *
+ * @return int , 1 on success, 0 on failure
+ */
+static int ksm_vma_enter(struct vma_slot *slot)
+{
+	struct scan_rung *rung;
+	unsigned long pages_to_scan, pool_size;
+	int burst = 0;
+
+	BUG_ON(slot_end(slot) > slot->vma->vm_end);
+
+	if (!slot->memcg)
+		slot->memcg = mem_cgroup_ksm_get(slot->mm);
+	rung = slot_min_rung(slot);
+	if (!rung)
+		goto failed;
+
+	/*
+	 * a forked one goes straight to where its parent's has climbed, an
+	 * advised one to the top
+	 */
+	if (slot->enter_rung > rung - ksm_scan_ladder + 1 &&
+	    slot->enter_rung <= ksm_scan_ladder_size)
+		rung = &ksm_scan_ladder[slot->enter_rung - 1];
+	else if (slot_can_burst(slot)) {
+		burst = rung != &ksm_scan_ladder[ksm_scan_ladder_size - 1];
+		rung = &ksm_scan_ladder[ksm_scan_ladder_size - 1];
+	}
+
+	pages_to_scan = get_vma_random_scan_num(slot, rung->scan_ratio);
+	if (pages_to_scan) {
+		if (list_empty(&rung->vma_list))
+			rung->current_scan = &slot->ksm_list;
+		BUG_ON(!list_empty(&slot->ksm_list));
+
+		list_add(&slot->ksm_list, &rung->vma_list);
+		slot->rung = rung;
+		slot->pages_to_scan = pages_to_scan;
+		slot->rung->vma_num++;
+		BUG_ON(PAGE_SIZE % sizeof(struct rmap_list_entry) != 0);
+
+		pool_size = vma_pool_size(slot);
+		slot->pool_size = pool_size;
+
+		if (pool_size == 1) {
+			slot->rmap_list_pool = &slot->pool_one;
+			slot->pool_counts = &slot->pool_count_one;
+		} else {
+			slot->rmap_list_pool = kzalloc(sizeof(void *) *
+						       pool_size, GFP_NOWAIT);
+			slot->pool_counts = kzalloc(sizeof(unsigned long) *
+						    pool_size, GFP_NOWAIT);
+			if (!slot->rmap_list_pool)
+				goto failed;
+
+			if (!slot->pool_counts) {
+				kfree(slot->rmap_list_pool);
+				slot->rmap_list_pool = NULL;
+				goto failed;
+			}
+		}
+
+		/* without it the slot is only filtered as a whole */
+		if (cow_heat_ranges(slot) == 1)
+			slot->cow_heat = &slot->cow_heat_one;
+		else
+			slot->cow_heat = kzalloc(cow_heat_ranges(slot),
+						 GFP_NOWAIT);
+
+		if (burst) {
+			slot->burst = 1;
+			ksm_burst_pages += slot->pages;
+			ksm_burst_slots++;
+		}
+
+		BUG_ON(rung->current_scan == &rung->vma_list &&
+		       !list_empty(&rung->vma_list));
+
+		ksm_vma_slot_num++;
+		BUG_ON(!ksm_vma_slot_num);
+		return 1;
+	}
+
+failed:
+	return 0;
+}
+
+
+static void ksm_enter_queued_slots(struct vma_slot_queue *queue)
+{
+	struct vma_slot *slot;
+	int added;
+
+	spin_lock(&queue->lock);
+	while (!list_empty(&queue->new)) {
+		slot = list_entry(queue->new.next,
+				  struct vma_slot, slot_list);
+		/* too young ones were not given a slot, see slot_min_age */
+		list_del_init(&slot->slot_list);
+		added = 0;
+		if (vma_can_enter(slot->vma))
+			added = ksm_vma_enter(slot);
+
+		if (!added) {
+			/* Put back to new list to be del by its creator */
+			slot->ctime_j = jiffies;
+			list_del(&slot->slot_list);
+			list_add_tail(&slot->slot_list, &queue->noadd);
+		}
+		spin_unlock(&queue->lock);
+		cond_resched();
+		spin_lock(&queue->lock);
+	}
+	spin_unlock(&queue->lock);
+}
+
+static void ksm_enter_all_slots(void)
+{
+	struct vma_slot_queue *queue;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(vma_slot_queues, cpu);
+		if (!list_empty(&queue->new))
+			ksm_enter_queued_slots(queue);
+	}
+}
+
+static inline unsigned long ksm_pages_merged_total(void)
+{
+	return ksm_pages_sharing + ksm_pages_zero_merged;
+}
+
+/*
+ * ksm_governor() - choose the next batch size from the cost of the last one,
+ * which took @scan_ns to scan @scanned pages and merge @merged more.
+ *
+ * @return the jiffies to sleep before the next batch
+ */
+static unsigned int ksm_governor(u64 scan_ns, unsigned long scanned,
+				 unsigned long merged)
+{
+	unsigned int pct = ksm_max_cpu_percentage;
+	unsigned int sleep_jiffies = max_t(unsigned int, ksm_sleep_jiffies, 1);
+	u64 sleep_ns = (u64)jiffies_to_usecs(sleep_jiffies) * NSEC_PER_USEC;
+	u64 ns_per_page, budget_ns, rate, batch;
+
+	if (!scanned)
+		return sleep_jiffies;
+
+	ns_per_page = div64_u64(scan_ns, scanned) ? : 1;
+	if (ksm_gov_ns_per_page)
+		ns_per_page = (ksm_gov_ns_per_page * 3 + ns_per_page) >> 2;
+	ksm_gov_ns_per_page = ns_per_page;
+
+	if (pct >= 100)
+		budget_ns = ns_per_page * ksm_scan_batch_pages;
+	else
+		budget_ns = div_u64(sleep_ns * pct, 100 - pct);
+
+	if (ksm_target_merge_rate) {
+		rate = div64_u64((u64)merged * NSEC_PER_SEC, scan_ns + sleep_ns);
+		if (rate > ksm_target_merge_rate)
+			budget_ns = div64_u64(budget_ns * ksm_target_merge_rate,
+					      rate);
+	}
+
+	if (nr_running() > num_online_cpus())
+		budget_ns >>= 1;
+
+	batch = div64_u64(budget_ns, ns_per_page);
+	if (batch > ksm_scan_batch_pages)
+		batch = ksm_scan_batch_pages;
+
+	if (batch < KSM_GOV_BATCH_MIN && pct < 100) {
+		/* a minimal batch then, and a longer nap to stay in budget */
+		batch = KSM_GOV_BATCH_MIN;
+		sleep_ns = div_u64(ns_per_page * batch * (100 - pct), pct);
+		sleep_jiffies = min_t(u64, nsecs_to_jiffies(sleep_ns), HZ);
+		sleep_jiffies = max_t(unsigned int, sleep_jiffies, 1);
+	}
+
+	ksm_gov_batch_pages = batch;
+	cal_ladder_pages_to_scan(batch);
+
+	return sleep_jiffies;
+}
+
+/*
+ * The idle and iowait time of the cpus of this thread. cpustat is not updated
+ * while a cpu sleeps in NO_HZ idle, the tick-sched accounting is, and its
+ * idle time already includes the iowait one.
+ */
+static u64 ksm_cpus_idle_jiffies(void)
+{
+	u64 idle = 0, idle_us;
+	int cpu;
+
+	for_each_cpu_and(cpu, &current->cpus_allowed, cpu_online_mask) {
+		idle_us = get_cpu_idle_time_us(cpu, NULL);
+		if (idle_us != -1ULL) {
+			idle += div_u64(idle_us * HZ, USEC_PER_SEC);
+			continue;
+		}
+
+		idle += cputime64_to_jiffies64(kstat_cpu(cpu).cpustat.idle);
+		idle += cputime64_to_jiffies64(kstat_cpu(cpu).cpustat.iowait);
+	}
+
+	return idle;
+}
+
+/*
+ * ksm_cpus_busy() - were the cpus of this thread less idle than
+ * ksm_idle_scan_threshold over the last sample window?
+ */
+static int ksm_cpus_busy(struct ksm_idle_sample *sample)
+{
+	unsigned long elapsed = jiffies - sample->stamp;
+	u64 idle, total;
+	int nr_cpus;
+
+	if (elapsed < KSM_IDLE_SAMPLE_JIFFIES)
+		return sample->busy;
+
+	idle = ksm_cpus_idle_jiffies();
+	nr_cpus = cpumask_weight(&current->cpus_allowed);
+	nr_cpus = min_t(int, nr_cpus, num_online_cpus());
+	total = (u64)elapsed * max(nr_cpus, 1);
+
+	sample->busy = (idle - sample->idle) * 100 <
+		       total * ksm_idle_scan_threshold;
+	sample->idle = idle;
+	sample->stamp = jiffies;
+
+	return sample->busy;
+}
+
+static inline int ksm_pressure_active(void)
+{
+	unsigned long until = ACCESS_ONCE(ksm_pressure_until);
+
+	return ksm_pressure_boost && until && time_before(jiffies, until);
+}
+
+/*
+ * ksm_memory_pressure() - called by kswapd when it starts balancing a node
+ * below its high watermarks.
+ */
+void ksm_memory_pressure(void)
+{
+	if (!ksm_pressure_boost || !(ksm_run & KSM_RUN_MERGE))
+		return;
+
+	if (!ksm_pressure_active())
+		ksm_pressure_boosts++;
+	ksm_pressure_until = jiffies + KSM_PRESSURE_JIFFIES;
+}
+
+static int ksm_scan_thread(void *nothing)
+{
+	unsigned int sleep_jiffies;
+	unsigned long long scanned;
+	unsigned long merged, last_scan = jiffies;
+	struct ksm_idle_sample sample = { .stamp = jiffies };
+	int trickle, boost, boosted = 0;
+	u64 start;
+
+	set_freezable();
+	set_user_nice(current, 5);
+	sample.idle = ksm_cpus_idle_jiffies();
+
+	while (!kthread_should_stop()) {
+		sleep_jiffies = ksm_sleep_jiffies;
+		trickle = 0;
+
+		boost = ksm_pressure_active();
+		if (boost != boosted) {
+			set_user_nice(current, boost ? 0 : 5);
+			if (!boost) {
+				mutex_lock(&ksm_thread_mutex);
+				cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+				mutex_unlock(&ksm_thread_mutex);
+			}
+			boosted = boost;
+		}
+
+		if (ksm_idle_scan && !boost && ksmd_should_run() &&
+		    ksm_cpus_busy(&sample)) {
+			if (time_before(jiffies, last_scan +
+				msecs_to_jiffies(ksm_idle_scan_max_delay))) {
+				try_to_freeze();
+				schedule_timeout_interruptible(
+					KSM_IDLE_SAMPLE_JIFFIES);
+				continue;
+			}
+			trickle = 1;
+		}
+
+		mutex_lock(&ksm_thread_mutex);
+		if (ksmd_should_run()) {
+			start = local_clock();
+			scanned = ksm_pages_scanned;
+			merged = ksm_pages_merged_total();
+
+			if (boost)
+				cal_ladder_pages_to_scan(ksm_scan_batch_pages *
+							 ksm_pressure_boost);
+			else if (trickle)
+				cal_ladder_pages_to_scan(max_t(unsigned long,
+					ksm_scan_batch_pages >> 4,
+					KSM_GOV_BATCH_MIN));
+
+			ksm_discover_vmas();
+			ksm_enter_all_slots();
+			ksm_do_scan();
+			last_scan = jiffies;
+			ksm_hist_add(KSM_HIST_SCAN_BATCH, local_clock() - start);
+
+			if (ksm_cpu_governor && !boost) {
+				merged = ksm_pages_merged_total() - merged;
+				sleep_jiffies = ksm_governor(
+					local_clock() - start,
+					ksm_pages_scanned - scanned,
+					(long)merged > 0 ? merged : 0);
+			}
+		}
+		mutex_unlock(&ksm_thread_mutex);
+
+		try_to_freeze();
+
+		if (ksmd_should_run()) {
+			schedule_timeout_interruptible(sleep_jiffies);
+			ksm_sleep_times++;
+		} else {
+			wait_event_freezable(ksm_thread_wait,
+				ksmd_should_run() || kthread_should_stop());
+		}
+	}
+	return 0;
+}
+
+/*
+ * ksm_start_scan_thread() - create the index'th scanner thread bound to the
+ * cpus of a NUMA node. ksmd itself is created by ksm_init().
+ */
+static int ksm_start_scan_thread(unsigned int index)
+{
+	struct task_struct *worker;
+	int nid, i;
 
-	ptep1 = page_check_address(oldpage, vma1->vm_mm, addr1, &ptl1, 0);
-	if (!ptep1)
-		goto failed;
+	worker = kthread_create(ksm_scan_thread, NULL, "ksmd/%u", index);
+	if (IS_ERR(worker))
+		return PTR_ERR(worker);
 
-	if (pte_write(*ptep1)) {
-		/* has changed, abort! */
-		pte_unmap_unlock(ptep1, ptl1);
-		goto failed;
+	nid = first_online_node;
+	for (i = 0; i < index % num_online_nodes(); i++)
+		nid = next_online_node(nid);
+	if (cpumask_any_and(cpumask_of_node(nid), cpu_online_mask) < nr_cpu_ids)
+		set_cpus_allowed_ptr(worker, cpumask_of_node(nid));
+
+	ksm_scan_workers[index] = worker;
+	wake_up_process(worker);
+	return 0;
+}
+
+static inline struct hlist_head *ksm_swap_bucket(unsigned long swap)
+{
+	return &ksm_swap_hash[hash_long(swap, KSM_SWAP_HASH_BITS)];
+}
+
+/*
+ * ksm_swap_park() - called by reclaim with the refs of the KSM @page frozen,
+ * under the tree_lock of the swap cache, before @page leaves it for @swap.
+ * Its stable node cannot be freed meanwhile: get_ksm_page() waits for the
+ * page to be gone, or the node to be parked.
+ */
+void ksm_swap_park(struct page *page, unsigned long swap)
+{
+	struct stable_node *stable_node = page_stable_node(page);
+	unsigned long flags;
+
+	if (!ksm_swap_reshare || !stable_node)
+		return;
+
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	/* not parked while still waiting to be reinserted */
+	if (hlist_unhashed(&stable_node->swap_hlist)) {
+		stable_node->swap = swap;
+		hlist_add_head(&stable_node->swap_hlist, ksm_swap_bucket(swap));
+		ksm_swap_nr_parked++;
 	}
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
+}
 
-	get_page(tree_page);
-	page_add_anon_rmap(tree_page, vma1, addr1);
+/*
+ * ksm_swap_reshare_page() - called by do_swap_page() with the swap cache
+ * @page locked. If it was read back from @swap for a parked stable node
+ * and nobody mapped it yet, it becomes the KSM page of that node again.
+ */
+void ksm_swap_reshare_page(struct page *page, unsigned long swap)
+{
+	struct stable_node *stable_node;
+	struct hlist_node *n;
+	unsigned long flags;
 
-	flush_cache_page(vma1, addr1, pte_pfn(*ptep1));
-	ptep_clear_flush(vma1, addr1, ptep1);
-	set_pte_at_notify(vma1->vm_mm, addr1, ptep1,
-			  mk_pte(tree_page, vma1->vm_page_prot));
+	if (!ACCESS_ONCE(ksm_swap_nr_parked) || page->mapping)
+		return;
 
-	page_remove_rmap(oldpage);
-	put_page(oldpage);
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	hlist_for_each_entry(stable_node, n, ksm_swap_bucket(swap),
+			     swap_hlist) {
+		if (stable_node->swap != swap)
+			continue;
 
-	pte_unmap_unlock(ptep1, ptl1);
+		hlist_del_init(&stable_node->swap_hlist);
+		stable_node->swap = 0;
+		stable_node_set_kpfn(stable_node, page_to_pfn(page));
+		set_page_stable_node(page, stable_node);
+		hlist_add_head(&stable_node->swap_hlist, &ksm_swap_reshared);
+		ksm_swap_nr_parked--;
+		ksm_pages_swap_reshared++;
+		break;
+	}
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
+}
+
+/*
+ * ksm_swap_freed() - called when @swap is freed, with swap_lock held. A node
+ * parked over it has nothing to come back to, ksmd frees it when it finds.
+ */
+void ksm_swap_freed(unsigned long swap)
+{
+	struct stable_node *stable_node;
+	struct hlist_node *n;
+	unsigned long flags;
 
+	if (!ACCESS_ONCE(ksm_swap_nr_parked))
+		return;
 
-	/* ok, then vma2, remind that pte1 already set */
-	addr2 = get_rmap_addr(item2);
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	hlist_for_each_entry(stable_node, n, ksm_swap_bucket(swap),
+			     swap_hlist) {
+		if (stable_node->swap == swap) {
+			hlist_del_init(&stable_node->swap_hlist);
+			stable_node->swap = 0;
+			ksm_swap_nr_parked--;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
+}
 
-	ptep2 = page_check_address(oldpage, vma2->vm_mm, addr2, &ptl2, 0);
-	if (!ptep2)
-		goto success1;
+/*
+ * ksm_swap_parked() - whether @swap holds the page of a stable node parked
+ * over it. Its mappings are wherever the rmap of that node says, not next
+ * to it in swap: swapin_vma_readahead() reads around the fault instead.
+ */
+int ksm_swap_parked(unsigned long swap)
+{
+	struct stable_node *stable_node;
+	struct hlist_node *n;
+	unsigned long flags;
+	int parked = 0;
 
-	if (pte_write(*ptep2)) {
-		/* has changed, abort! */
-		pte_unmap_unlock(ptep2, ptl2);
-		goto success1;
+	if (!ACCESS_ONCE(ksm_swap_nr_parked))
+		return 0;
+
+	spin_lock_irqsave(&ksm_swap_lock, flags);
+	hlist_for_each_entry(stable_node, n, ksm_swap_bucket(swap),
+			     swap_hlist) {
+		if (stable_node->swap == swap) {
+			parked = 1;
+			break;
+		}
 	}
+	spin_unlock_irqrestore(&ksm_swap_lock, flags);
 
-	get_page(tree_page);
-	page_add_anon_rmap(tree_page, vma2, addr2);
+	return parked;
+}
 
-	flush_cache_page(vma2, addr2, pte_pfn(*ptep2));
-	ptep_clear_flush(vma2, addr2, ptep2);
-	set_pte_at_notify(vma2->vm_mm, addr2, ptep2,
-			  mk_pte(tree_page, vma2->vm_page_prot));
+struct page *ksm_does_need_to_copy(struct page *page,
+			struct vm_area_struct *vma, unsigned long address)
+{
+	struct page *new_page;
 
-	page_remove_rmap(oldpage);
-	put_page(oldpage);
+	new_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+	if (new_page) {
+		copy_user_highpage(new_page, page, address, vma);
 
-	pte_unmap_unlock(ptep2, ptl2);
+		SetPageDirty(new_page);
+		__SetPageUptodate(new_page);
+		SetPageSwapBacked(new_page);
+		__set_page_locked(new_page);
 
+		if (page_evictable(new_page, vma))
+			lru_cache_add_lru(new_page, LRU_ACTIVE_ANON);
+		else
+			add_page_to_unevictable_list(new_page);
+	}
 
-success_both:
-	*success2 = 1;
-success1:
-	*success1 = 1;
+	return new_page;
+}
 
-	if ((*success1 && vma1->vm_flags & VM_LOCKED) ||
-	    (*success2 && vma2->vm_flags & VM_LOCKED)) {
-		munlock_vma_page(oldpage);
-		if (!PageMlocked(tree_page)) {
+/* Hold the lock of an anon_vma over so many rmap_items of it at most */
+#define KSM_RMAP_LOCK_BATCH	32
 
-			/*ok, we do not need oldpage any more in the caller
-			 * we can break the lock now.
-			 */
-			unlock_page(oldpage);
-			lock_page(tree_page);
-			mlock_vma_page(tree_page);
-			unlock_page(tree_page);
-			lock_page(oldpage); /* unlocked outside */
+/*
+ * The state of a KSM rmap walk: the anon_vma locked, for how many
+ * rmap_items in a row, and the vma of a slot found in its chain since.
+ */
+struct ksm_rmap_walk {
+	struct anon_vma *locked;
+	int held;
+	struct vm_area_struct *vma;
+};
+
+/*
+ * ksm_rmap_lock() - lock @anon_vma for a KSM rmap walk, keeping the lock
+ * for the rmap_items of a same anon_vma in a row.
+ */
+static inline void ksm_rmap_lock(struct ksm_rmap_walk *walk,
+				 struct anon_vma *anon_vma)
+{
+	if (walk->locked == anon_vma && ++walk->held < KSM_RMAP_LOCK_BATCH)
+		return;
+
+	if (walk->locked)
+		anon_vma_unlock(walk->locked);
+	anon_vma_lock(anon_vma);
+	walk->locked = anon_vma;
+	walk->held = 0;
+	/* unlinked from the chain while unlocked, it may be gone */
+	walk->vma = NULL;
+}
+
+static inline void ksm_rmap_unlock(struct ksm_rmap_walk *walk)
+{
+	if (walk->locked) {
+		anon_vma_unlock(walk->locked);
+		walk->locked = NULL;
+	}
+}
+
+/*
+ * ksm_rmap_own_vma() - the vma of the slot of @rmap_item if it maps its
+ * address, the only one the first pass of a walk looks at. The chain of
+ * its anon_vma, whose lock is held, is searched for it once for all the
+ * rmap_items of the vma in a row: not once per rmap_item, as the rmap_items
+ * of a stable node are grouped by slot.
+ */
+static struct vm_area_struct *ksm_rmap_own_vma(struct ksm_rmap_walk *walk,
+					       struct rmap_item *rmap_item)
+{
+	unsigned long address = get_rmap_addr(rmap_item);
+	struct vm_area_struct *vma = walk->vma;
+	struct anon_vma_chain *vmac;
+
+	if (!vma || vma != rmap_item->slot->vma) {
+		vma = NULL;
+		list_for_each_entry(vmac, &rmap_item->anon_vma->head,
+				    same_anon_vma) {
+			if (vmac->vma == rmap_item->slot->vma) {
+				vma = vmac->vma;
+				break;
+			}
+		}
+		walk->vma = vma;
+	}
+
+	if (!vma || address < vma->vm_start || address >= vma->vm_end)
+		return NULL;
+
+	return vma;
+}
+
+/*
+ * The references to @page through the vmas of @rmap_item's anon_vma, whose
+ * lock is held: the vma of its slot, or the others forked from it.
+ */
+static int rmap_item_referenced(struct page *page, struct rmap_item *rmap_item,
+				struct ksm_rmap_walk *walk,
+				struct mem_cgroup *memcg, int search_new_forks,
+				unsigned int *mapcount, unsigned long *vm_flags)
+{
+	unsigned long address = get_rmap_addr(rmap_item);
+	struct anon_vma_chain *vmac;
+	struct vm_area_struct *vma;
+	int referenced = 0;
+
+	if (!search_new_forks) {
+		vma = ksm_rmap_own_vma(walk, rmap_item);
+		if (!vma || (memcg && !mm_match_cgroup(vma->vm_mm, memcg)))
+			return 0;
+
+		return page_referenced_one(page, vma, address,
+					   mapcount, vm_flags);
+	}
+
+	list_for_each_entry(vmac, &rmap_item->anon_vma->head, same_anon_vma) {
+		vma = vmac->vma;
+		if (address < vma->vm_start || address >= vma->vm_end)
+			continue;
+		/*
+		 * Initially we examine only the vma which covers this
+		 * rmap_item; but later, if there is still work to do, we
+		 * examine covering vmas in other mms: in case they were
+		 * forked from the original since ksmd passed.
+		 */
+		if (rmap_item->slot->vma == vma)
+			continue;
+
+		if (memcg && !mm_match_cgroup(vma->vm_mm, memcg))
+			continue;
+
+		referenced += page_referenced_one(page, vma, address,
+						  mapcount, vm_flags);
+		if (!*mapcount)
+			break;
+	}
+
+	return referenced;
+}
+
+int page_referenced_ksm(struct page *page, struct mem_cgroup *memcg,
+			unsigned long *vm_flags)
+{
+	struct stable_node *stable_node;
+	struct node_vma *node_vma;
+	struct rmap_item *rmap_item;
+	struct hlist_node *hlist, *rmap_hlist;
+	struct ksm_rmap_walk walk = { NULL, };
+	unsigned int mapcount = page_mapcount(page);
+	unsigned int sample = ksm_rmap_sample;
+	unsigned int budget = sample ? sample : UINT_MAX;
+	unsigned int start, pos;
+	int referenced = 0;
+	int pass;
+
+	VM_BUG_ON(!PageKsm(page));
+	VM_BUG_ON(!PageLocked(page));
+
+	stable_node = page_stable_node(page);
+	if (!stable_node)
+		return 0;
+
+	/*
+	 * Pass 0 goes from where the last sample stopped to the end, pass 1
+	 * wraps round to there, pass 2 looks for the vmas forked since.
+	 */
+	start = sample ? stable_node->walk_start : 0;
+	for (pass = 0; pass < 3; pass++) {
+		if (pass == 1 && !start)
+			continue;
+		pos = 0;
+
+		hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
+			hlist_for_each_entry(rmap_item, rmap_hlist,
+					     &node_vma->rmap_hlist, hlist) {
+				if (pass == 1 && pos == start)
+					goto next_pass;
+				if (pass == 0 && pos < start) {
+					pos++;
+					continue;
+				}
+
+				if (!budget--) {
+					ksm_rmap_walks_sampled++;
+					stable_node->walk_start = pos;
+					goto out;
+				}
+				pos++;
+
+				ksm_rmap_lock(&walk, rmap_item->anon_vma);
+				referenced += rmap_item_referenced(page,
+						rmap_item, &walk, memcg,
+						pass == 2, &mapcount, vm_flags);
+
+				/* one reference is all reclaim wants */
+				if (!mapcount || (sample && referenced)) {
+					if (pass != 2)
+						stable_node->walk_start = pos;
+					goto out;
+				}
+			}
+		}
+next_pass:
+		;
+	}
+	stable_node->walk_start = 0;
+out:
+	ksm_rmap_unlock(&walk);
+
+	/* VM_LOCKED in *vm_flags still has its say in the caller */
+	switch (ACCESS_ONCE(ksm_reclaim_policy)) {
+	case KSM_RECLAIM_PROTECT:
+		if (!referenced &&
+		    stable_node->rmap_nr >= ksm_reclaim_share_min) {
+			ksm_reclaim_protected++;
+			referenced = 1;
+		}
+		break;
+	case KSM_RECLAIM_CHEAP:
+		if (referenced &&
+		    stable_node->rmap_nr < ksm_reclaim_share_min) {
+			ksm_reclaim_cheap++;
+			referenced = 0;
 		}
+		break;
 	}
 
-failed:
-	return;
-}
+	return referenced;
+}
+
+int try_to_unmap_ksm(struct page *page, enum ttu_flags flags)
+{
+	struct stable_node *stable_node;
+	struct node_vma *node_vma;
+	struct hlist_node *hlist, *rmap_hlist;
+	struct rmap_item *rmap_item;
+	struct ksm_rmap_walk walk = { NULL, };
+	int ret = SWAP_AGAIN;
+	int search_new_forks = 0;
+	unsigned long address;
+
+	VM_BUG_ON(!PageKsm(page));
+	VM_BUG_ON(!PageLocked(page));
+
+	stable_node = page_stable_node(page);
+	if (!stable_node)
+		return SWAP_FAIL;
+again:
+	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
+		hlist_for_each_entry(rmap_item, rmap_hlist,
+				     &node_vma->rmap_hlist, hlist) {
+			struct anon_vma *anon_vma = rmap_item->anon_vma;
+			struct anon_vma_chain *vmac;
+			struct vm_area_struct *vma;
+
+			ksm_rmap_lock(&walk, anon_vma);
+			address = get_rmap_addr(rmap_item);
+
+			/*
+			 * Initially we examine only the vma which covers this
+			 * rmap_item; but later, if there is still work to do,
+			 * we examine covering vmas in other mms: in case they
+			 * were forked from the original since ksmd passed.
+			 */
+			if (!search_new_forks) {
+				vma = ksm_rmap_own_vma(&walk, rmap_item);
+				if (!vma)
+					continue;
+
+				ret = try_to_unmap_one(page, vma,
+						       address, flags);
+				if (ret != SWAP_AGAIN || !page_mapped(page))
+					goto out;
+				continue;
+			}
+
+			list_for_each_entry(vmac, &anon_vma->head,
+					    same_anon_vma) {
+				vma = vmac->vma;
 
-static inline void stable_node_hash_max(struct stable_node *node,
-					 struct page *page, u32 hash)
-{
-	u32 hash_max = node->hash_max;
+				if (address < vma->vm_start ||
+				    address >= vma->vm_end ||
+				    rmap_item->slot->vma == vma)
+					continue;
 
-	if (!hash_max) {
-		hash_max = page_hash_max(page, hash);
-		node->hash_max = hash_max;
+				ret = try_to_unmap_one(page, vma,
+						       address, flags);
+				if (ret != SWAP_AGAIN || !page_mapped(page))
+					goto out;
+			}
+		}
 	}
+	if (!search_new_forks++)
+		goto again;
+out:
+	ksm_rmap_unlock(&walk);
+	return ret;
 }
 
-static inline
-struct stable_node *new_stable_node(struct tree_node *tree_node,
-				    struct page *kpage, u32 hash_max)
+#ifdef CONFIG_MIGRATION
+int rmap_walk_ksm(struct page *page, int (*rmap_one)(struct page *,
+		  struct vm_area_struct *, unsigned long, void *), void *arg)
 {
-	struct stable_node *new_stable_node;
-
-	new_stable_node = alloc_stable_node();
-	if (!new_stable_node)
-		return NULL;
-
-	new_stable_node->kpfn = page_to_pfn(kpage);
-	new_stable_node->hash_max = hash_max;
-	new_stable_node->tree_node = tree_node;
-	set_page_stable_node(kpage, new_stable_node);
+	struct stable_node *stable_node;
+	struct node_vma *node_vma;
+	struct hlist_node *hlist, *rmap_hlist;
+	struct rmap_item *rmap_item;
+	struct ksm_rmap_walk walk = { NULL, };
+	int ret = SWAP_AGAIN;
+	int search_new_forks = 0;
+	unsigned long address;
 
-	return new_stable_node;
-}
+	VM_BUG_ON(!PageKsm(page));
+	VM_BUG_ON(!PageLocked(page));
 
-static inline
-struct stable_node *first_level_insert(struct tree_node *tree_node,
-				       struct rmap_item *rmap_item,
-				       struct rmap_item *tree_rmap_item,
-				       struct page *kpage, u32 hash,
-				       int *success1, int *success2)
-{
-	int cmp;
-	struct page *tree_page;
-	u32 hash_max = 0;
-	struct stable_node *stable_node, *new_snode;
-	struct rb_node *parent = NULL, **new;
+	stable_node = page_stable_node(page);
+	if (!stable_node)
+		return ret;
+again:
+	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
+		hlist_for_each_entry(rmap_item, rmap_hlist,
+				     &node_vma->rmap_hlist, hlist) {
+			struct anon_vma *anon_vma = rmap_item->anon_vma;
+			struct anon_vma_chain *vmac;
+			struct vm_area_struct *vma;
 
-	/* this tree node contains no sub-tree yet */
-	stable_node = rb_entry(tree_node->sub_root.rb_node,
-			       struct stable_node, node);
+			ksm_rmap_lock(&walk, anon_vma);
+			address = get_rmap_addr(rmap_item);
 
-	tree_page = get_ksm_page(stable_node, 1, 0);
-	if (tree_page) {
-		cmp = memcmp_pages(kpage, tree_page, 1);
-		if (!cmp) {
-			try_merge_with_stable(rmap_item, tree_rmap_item, kpage,
-					      tree_page, success1, success2);
-			put_page(tree_page);
-			if (!*success1 && !*success2)
-				goto failed;
+			if (!search_new_forks) {
+				vma = ksm_rmap_own_vma(&walk, rmap_item);
+				if (!vma)
+					continue;
 
-			return stable_node;
+				ret = rmap_one(page, vma, address, arg);
+				if (ret != SWAP_AGAIN)
+					goto out;
+				continue;
+			}
 
-		} else {
-			/*
-			 * collision in first level try to create a subtree.
-			 * A new node need to be created.
-			 */
-			put_page(tree_page);
+			list_for_each_entry(vmac, &anon_vma->head,
+					    same_anon_vma) {
+				vma = vmac->vma;
 
-			stable_node_hash_max(stable_node, tree_page,
-					     tree_node->hash);
-			hash_max = rmap_item_hash_max(rmap_item, hash);
-			cmp = hash_cmp(hash_max, stable_node->hash_max);
+				if (address < vma->vm_start ||
+				    address >= vma->vm_end ||
+				    rmap_item->slot->vma == vma)
+					continue;
 
-			parent = &stable_node->node;
-			if (cmp < 0) {
-				new = &parent->rb_left;
-			} else if (cmp > 0) {
-				new = &parent->rb_right;
-			} else {
-				printk(KERN_ERR "KSM collision1 "
-						"hash_max=%u\n",
-				       hash_max);
-				goto failed;
+				ret = rmap_one(page, vma, address, arg);
+				if (ret != SWAP_AGAIN)
+					goto out;
 			}
 		}
-
-	} else {
-		/* the only stable_node deleted, we reuse its tree_node.
-		 */
-		parent = NULL;
-		new = &tree_node->sub_root.rb_node;
 	}
+	if (!search_new_forks++)
+		goto again;
+out:
+	ksm_rmap_unlock(&walk);
+	return ret;
+}
 
-	new_snode = new_stable_node(tree_node, kpage, hash_max);
-	if (!new_snode)
-		goto failed;
+/*
+ * ksm_page_mm_only() - whether all the mappings of the KSM @page are of
+ * @mm, as far as its rmap_items tell, and they tell all of them: a mempolicy
+ * migration of @mm may then move it as a page of its own. Called under the
+ * pte lock of one of those mappings, the page lock is only tried.
+ */
+int ksm_page_mm_only(struct page *page, struct mm_struct *mm)
+{
+	struct stable_node *stable_node;
+	struct node_vma *node_vma;
+	struct hlist_node *hlist;
+	int ret = 0;
 
-	rb_link_node(&new_snode->node, parent, new);
-	rb_insert_color(&new_snode->node, &tree_node->sub_root);
-	tree_node->count++;
-	*success1 = *success2 = 1;
+	if (!trylock_page(page))
+		return 0;
 
-	return new_snode;
+	stable_node = page_stable_node(page);
+	if (!stable_node || stable_node->rmap_nr < page_mapcount(page))
+		goto out;
 
-failed:
-	return NULL;
+	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
+		if (node_vma->slot->mm != mm)
+			goto out;
+	}
+	ret = 1;
+out:
+	unlock_page(page);
+	return ret;
 }
 
-static inline
-struct stable_node *stable_subtree_insert(struct tree_node *tree_node,
-					  struct rmap_item *rmap_item,
-					  struct rmap_item *tree_rmap_item,
-					  struct page *kpage, u32 hash,
-					  int *success1, int *success2)
+void ksm_migrate_page(struct page *newpage, struct page *oldpage)
 {
-	struct page *tree_page;
-	u32 hash_max;
-	struct stable_node *stable_node, *new_snode;
-	struct rb_node *parent, **new;
+	struct stable_node *stable_node;
 
-research:
-	parent = NULL;
-	new = &tree_node->sub_root.rb_node;
-	BUG_ON(!*new);
-	hash_max = rmap_item_hash_max(rmap_item, hash);
-	while (*new) {
-		int cmp;
+	VM_BUG_ON(!PageLocked(oldpage));
+	VM_BUG_ON(!PageLocked(newpage));
+	VM_BUG_ON(newpage->mapping != oldpage->mapping);
 
-		stable_node = rb_entry(*new, struct stable_node, node);
+	stable_node = page_stable_node(newpage);
+	if (stable_node) {
+		VM_BUG_ON(stable_node->kpfn != page_to_pfn(oldpage));
+		stable_node_set_kpfn(stable_node, page_to_pfn(newpage));
+		/*
+		 * newpage->mapping was set in advance, get_ksm_page() must
+		 * see the new kpfn before oldpage->mapping is cleared by the
+		 * caller: then it retries with newpage rather than remove the
+		 * stable node.
+		 */
+		smp_wmb();
+	}
+}
+#endif /* CONFIG_MIGRATION */
 
-		cmp = hash_cmp(hash_max, stable_node->hash_max);
+#ifdef CONFIG_MEMORY_FAILURE
+/* The most rmap_items of a poisoned KSM page remapped, and how long to wait */
+#define KSM_HWPOISON_WALK_MAX	4096
+#define KSM_HWPOISON_WAIT	(HZ / 10)
 
-		if (cmp < 0) {
-			parent = *new;
-			new = &parent->rb_left;
-		} else if (cmp > 0) {
-			parent = *new;
-			new = &parent->rb_right;
-		} else {
-			tree_page = get_ksm_page(stable_node, 1, 0);
-			if (tree_page) {
-				cmp = memcmp_pages(kpage, tree_page, 1);
-				if (!cmp) {
-					try_merge_with_stable(rmap_item,
-						tree_rmap_item, kpage,
-						tree_page, success1, success2);
+/*
+ * A copy of the content of @stable_node's page, referenced and locked, or
+ * NULL: one of the nodes chained next to it in its sub-tree with the same
+ * hash_max, which were all found identical to it when chained.
+ */
+static struct page *stable_node_copy(struct stable_node *stable_node)
+{
+	struct stable_node *dup;
+	struct page *page;
+	struct rb_node *rb;
+	int dir;
+
+	for (dir = 0; dir < 2; dir++) {
+		rb = dir ? rb_next(&stable_node->node) :
+			   rb_prev(&stable_node->node);
+		while (rb) {
+			dup = rb_entry(rb, struct stable_node, node);
+			if (dup->hash_max != stable_node->hash_max)
+				break;
 
-					put_page(tree_page);
-					if (!*success1 && !*success2)
-						goto failed;
-					/*
-					 * successfully merged with a stable
-					 * node
-					 */
-					return stable_node;
-				} else {
-					put_page(tree_page);
-					goto failed;
-				}
-			} else {
-				/*
-				 * stable node may be deleted,
-				 * and subtree maybe
-				 * restructed, cannot
-				 * continue, research it.
-				 */
-				if (tree_node->count) {
-					goto research;
-				} else {
-					/* reuse the tree node*/
-					parent = NULL;
-					new = &tree_node->sub_root.rb_node;
-				}
-			}
+			/* on first, get_ksm_page() may remove a stale one */
+			rb = dir ? rb_next(rb) : rb_prev(rb);
+			page = get_ksm_page(dup, 1, 0);
+			if (!page)
+				continue;
+			if (!PageHWPoison(page) && lock_ksm_page(dup, page, 1))
+				return page;
+			put_page(page);
 		}
 	}
 
-	new_snode = new_stable_node(tree_node, kpage, hash_max);
-	if (!new_snode)
-		goto failed;
+	return NULL;
+}
 
-	rb_link_node(&new_snode->node, parent, new);
-	rb_insert_color(&new_snode->node, &tree_node->sub_root);
-	tree_node->count++;
-	*success1 = *success2 = 1;
+/* Map @kpage instead of @page at @addr of @vma, if @page is mapped there */
+static int remap_ksm_page(struct vm_area_struct *vma, unsigned long addr,
+			  struct page *page, struct page *kpage)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	spinlock_t *ptl;
+	pte_t *ptep;
+
+	ptep = page_check_address(page, mm, addr, &ptl, 0);
+	if (!ptep)
+		return -EFAULT;
+
+	get_page(kpage);
+	page_add_anon_rmap(kpage, vma, addr);
+
+	flush_cache_page(vma, addr, pte_pfn(*ptep));
+	ptep_clear_flush(vma, addr, ptep);
+	set_pte_at_notify(mm, addr, ptep, mk_pte(kpage, vma->vm_page_prot));
 
-	return new_snode;
+	page_remove_rmap(page);
+	put_page(page);
+	pte_unmap_unlock(ptep, ptl);
 
-failed:
-	return NULL;
+	return 0;
 }
 
-
-/**
- * stable_tree_insert() - try to insert a merged page in unstable tree to
- * the stable tree
- *
- * @kpage:		the page need to be inserted
- * @hash:		the current hash of this page
- * @rmap_item:		the rmap_item being scanned
- * @tree_rmap_item:	the rmap_item found on unstable tree
- * @success1:		return if rmap_item is merged
- * @success2:		return if tree_rmap_item is merged
+/*
+ * ksm_memory_failure() - called by memory_failure() on the KSM @page it
+ * holds locked. Where a copy of its content is still in the stable tree,
+ * the mappings its rmap_items tell are given that copy instead, up to
+ * KSM_HWPOISON_WALK_MAX of them, and nobody has to be killed for those.
+ * Its node leaves the stable tree in any case, so that ksmd never compares
+ * nor hashes the page again; its rmap_items stay for try_to_unmap_ksm() to
+ * find the mappings left, and go the usual way when their address is
+ * scanned again.
  *
- * @return 		the stable_node on stable tree if at least one
- *      		rmap_item is inserted into stable tree, NULL
- *      		otherwise.
+ * @return 0 if the page is not mapped anymore, -EBUSY otherwise.
  */
-static struct stable_node *
-stable_tree_insert(struct page *kpage, u32 hash,
-		   struct rmap_item *rmap_item,
-		   struct rmap_item *tree_rmap_item,
-		   int *success1, int *success2)
+int ksm_memory_failure(struct page *page)
 {
-	struct rb_node **new = &root_stable_treep->rb_node;
-	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
-	struct tree_node *tree_node;
-	u32 hash_max = 0;
+	struct node_vma *node_vma;
+	struct hlist_node *hlist, *rmap_hlist;
+	struct rmap_item *rmap_item;
+	struct ksm_rmap_walk walk = { NULL, };
+	struct vm_area_struct *vma;
+	struct page *kpage = NULL;
+	unsigned long budget = KSM_HWPOISON_WALK_MAX;
+	int tries;
 
-	*success1 = *success2 = 0;
+	VM_BUG_ON(!PageKsm(page));
+	VM_BUG_ON(!PageLocked(page));
 
-	while (*new) {
-		int cmp;
+	/* ksmd may wait for the page lock we hold: don't wait for it long */
+	atomic_inc(&ksm_control_waiters);
+	for (tries = 0; !mutex_trylock(&ksm_thread_mutex); tries++) {
+		if (tries == KSM_HWPOISON_WAIT) {
+			atomic_dec(&ksm_control_waiters);
+			return -EBUSY;
+		}
+		schedule_timeout_uninterruptible(1);
+	}
+	atomic_dec(&ksm_control_waiters);
 
-		tree_node = rb_entry(*new, struct tree_node, node);
+	stable_node = page_stable_node(page);
+	if (!stable_node || stable_node->swap)
+		goto out;
 
-		cmp = hash_cmp(hash, tree_node->hash);
+	if (stable_node->tree_node)
+		kpage = stable_node_copy(stable_node);
+	if (!kpage)
+		goto unlink;
 
-		if (cmp < 0) {
-			parent = *new;
-			new = &parent->rb_left;
-		} else if (cmp > 0) {
-			parent = *new;
-			new = &parent->rb_right;
-		} else
-			break;
+	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
+		hlist_for_each_entry(rmap_item, rmap_hlist,
+				     &node_vma->rmap_hlist, hlist) {
+			if (!budget--)
+				goto done;
+
+			ksm_rmap_lock(&walk, rmap_item->anon_vma);
+			vma = ksm_rmap_own_vma(&walk, rmap_item);
+			if (vma && !remap_ksm_page(vma, get_rmap_addr(rmap_item),
+						   page, kpage))
+				ksm_hwpoison_remapped++;
+		}
 	}
+done:
+	ksm_rmap_unlock(&walk);
+	unlock_page(kpage);
+	put_page(kpage);
+
+unlink:
+	if (stable_node->tree_node)
+		stable_node_unlink(stable_node, 1);
+	list_move(&stable_node->all_list, &stable_node_poisoned_list);
+	if (!page_mapped(page))
+		ksm_hwpoison_recovered++;
+out:
+	mutex_unlock(&ksm_thread_mutex);
+	return page_mapped(page) ? -EBUSY : 0;
+}
+#endif /* CONFIG_MEMORY_FAILURE */
 
-	if (*new) {
-		if (tree_node->count == 1) {
-			stable_node = first_level_insert(tree_node, rmap_item,
-						tree_rmap_item, kpage,
-						hash, success1, success2);
-		} else {
-			stable_node = stable_subtree_insert(tree_node,
-					rmap_item, tree_rmap_item, kpage,
-					hash, success1, success2);
+#ifdef CONFIG_MEMORY_HOTREMOVE
+/*
+ * ksm_prune_stable_tree() - remove the stable nodes whose kpfn is in
+ * [start_pfn, end_pfn), looking only at the buckets of those sections.
+ */
+static void ksm_prune_stable_tree(unsigned long start_pfn,
+				  unsigned long end_pfn)
+{
+	struct stable_node *stable_node;
+	struct hlist_node *hlist, *n;
+	HLIST_HEAD(offlined);
+	unsigned long pfn, flags;
+
+	spin_lock_irqsave(&ksm_kpfn_lock, flags);
+	for (pfn = start_pfn & PAGE_SECTION_MASK; pfn < end_pfn;
+	     pfn += PAGES_PER_SECTION) {
+		hlist_for_each_entry_safe(stable_node, hlist, n,
+					  ksm_kpfn_bucket(pfn), kpfn_hlist) {
+			if (stable_node->kpfn < start_pfn ||
+			    stable_node->kpfn >= end_pfn)
+				continue;
+			hlist_del(&stable_node->kpfn_hlist);
+			hlist_add_head(&stable_node->kpfn_hlist, &offlined);
 		}
-	} else {
+	}
 
-		/* no tree node found */
-		tree_node = alloc_tree_node(stable_tree_node_listp);
-		if (!tree_node) {
-			stable_node = NULL;
-			goto out;
-		}
+	while (!hlist_empty(&offlined)) {
+		stable_node = hlist_entry(offlined.first, struct stable_node,
+					  kpfn_hlist);
+		hlist_del_init(&stable_node->kpfn_hlist);
+		spin_unlock_irqrestore(&ksm_kpfn_lock, flags);
 
-		stable_node = new_stable_node(tree_node, kpage, hash_max);
-		if (!stable_node) {
-			free_tree_node(tree_node);
-			goto out;
-		}
+		remove_node_from_stable_tree(stable_node, 1, 1);
 
-		tree_node->hash = hash;
-		rb_link_node(&tree_node->node, parent, new);
-		rb_insert_color(&tree_node->node, root_stable_treep);
-		parent = NULL;
-		new = &tree_node->sub_root.rb_node;
+		spin_lock_irqsave(&ksm_kpfn_lock, flags);
+	}
+	spin_unlock_irqrestore(&ksm_kpfn_lock, flags);
+}
 
-		rb_link_node(&stable_node->node, parent, new);
-		rb_insert_color(&stable_node->node, &tree_node->sub_root);
-		tree_node->count++;
-		*success1 = *success2 = 1;
+static int ksm_memory_callback(struct notifier_block *self,
+			       unsigned long action, void *arg)
+{
+	struct memory_notify *mn = arg;
+
+	switch (action) {
+	case MEM_GOING_OFFLINE:
+		/*
+		 * Keep it very simple for now: just lock out ksmd and
+		 * MADV_UNMERGEABLE while any memory is going offline.
+		 * mutex_lock_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_mutex inside notifier chain
+		 * mutex, and later take notifier chain mutex inside
+		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * are inside mem_hotplug_mutex.
+		 */
+		ksm_control_lock_nested(SINGLE_DEPTH_NESTING);
+		break;
+
+	case MEM_OFFLINE:
+		/*
+		 * Most of the work is done by page migration; but there might
+		 * be a few stable_nodes left over, still pointing to struct
+		 * pages which have been offlined: prune those from the tree.
+		 */
+		ksm_prune_stable_tree(mn->start_pfn,
+				      mn->start_pfn + mn->nr_pages);
+		/* fallthrough */
+
+	case MEM_CANCEL_OFFLINE:
+		mutex_unlock(&ksm_thread_mutex);
+		break;
 	}
+	return NOTIFY_OK;
+}
+#endif /* CONFIG_MEMORY_HOTREMOVE */
 
-out:
-	return stable_node;
+#ifdef CONFIG_SYSFS
+/*
+ * This all compiles without CONFIG_SYSFS, but is a waste of space.
+ */
+
+#define KSM_ATTR_RO(_name) \
+	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+#define KSM_ATTR(_name) \
+	static struct kobj_attribute _name##_attr = \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+
+static ssize_t sleep_millisecs_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", jiffies_to_msecs(ksm_sleep_jiffies));
 }
 
+static ssize_t sleep_millisecs_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long msecs;
+	int err;
 
-/**
- * get_tree_rmap_item_page() - try to get the page and lock the mmap_sem
- *
- * @return 	0 on success, -EBUSY if unable to lock the mmap_sem,
- *         	-EINVAL if the page mapping has been changed.
- */
-static inline int get_tree_rmap_item_page(struct rmap_item *tree_rmap_item)
+	err = strict_strtoul(buf, 10, &msecs);
+	if (err || msecs > UINT_MAX)
+		return -EINVAL;
+
+	ksm_sleep_jiffies = msecs_to_jiffies(msecs);
+	printk(KERN_INFO "KSM: sleep interval changed to %u jiffies\n",
+	       ksm_sleep_jiffies);
+
+	return count;
+}
+KSM_ATTR(sleep_millisecs);
+
+static ssize_t cpu_governor_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_cpu_governor);
+}
+
+static ssize_t cpu_governor_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
 {
 	int err;
+	unsigned long knob;
 
-	err = get_mergeable_page_lock_mmap(tree_rmap_item);
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	if (err == -EINVAL) {
-		/* its page map has been changed, remove it */
-		remove_rmap_item_from_tree(tree_rmap_item);
-	}
+	ksm_control_lock();
+	ksm_cpu_governor = knob;
+	ksm_gov_ns_per_page = 0;
+	ksm_gov_batch_pages = 0;
+	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+	mutex_unlock(&ksm_thread_mutex);
 
-	/* The page is gotten and mmap_sem is locked now. */
-	return err;
+	return count;
 }
+KSM_ATTR(cpu_governor);
 
+static ssize_t max_cpu_percentage_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_max_cpu_percentage);
+}
 
-/**
- * unstable_tree_search_insert() - search an unstable tree rmap_item with the
- * same hash value. Get its page and trylock the mmap_sem
- */
-static inline
-struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
-					      u32 hash)
+static ssize_t max_cpu_percentage_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	int err;
+	unsigned long pct;
+
+	err = strict_strtoul(buf, 10, &pct);
+	if (err || !pct || pct > 100)
+		return -EINVAL;
+
+	ksm_max_cpu_percentage = pct;
 
+	return count;
+}
+KSM_ATTR(max_cpu_percentage);
+
+static ssize_t target_merge_rate_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
 {
-	struct rb_node **new = &root_unstable_tree.rb_node;
-	struct rb_node *parent = NULL;
-	struct tree_node *tree_node;
-	u32 hash_max;
-	struct rmap_item *tree_rmap_item;
+	return sprintf(buf, "%lu\n", ksm_target_merge_rate);
+}
 
-	while (*new) {
-		int cmp;
+static ssize_t target_merge_rate_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int err;
+	unsigned long rate;
 
-		tree_node = rb_entry(*new, struct tree_node, node);
+	err = strict_strtoul(buf, 10, &rate);
+	if (err)
+		return -EINVAL;
 
-		cmp = hash_cmp(hash, tree_node->hash);
+	ksm_target_merge_rate = rate;
 
-		if (cmp < 0) {
-			parent = *new;
-			new = &parent->rb_left;
-		} else if (cmp > 0) {
-			parent = *new;
-			new = &parent->rb_right;
-		} else
-			break;
-	}
+	return count;
+}
+KSM_ATTR(target_merge_rate);
 
-	if (*new) {
-		/* got the tree_node */
-		if (tree_node->count == 1) {
-			tree_rmap_item = rb_entry(tree_node->sub_root.rb_node,
-						  struct rmap_item, node);
-			BUG_ON(!tree_rmap_item);
+static ssize_t governor_batch_pages_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_gov_batch_pages);
+}
+KSM_ATTR_RO(governor_batch_pages);
+
+static ssize_t pressure_boost_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_pressure_boost);
+}
+
+static ssize_t pressure_boost_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 16)
+		return -EINVAL;
+
+	ksm_pressure_boost = knob;
+
+	return count;
+}
+KSM_ATTR(pressure_boost);
+
+static ssize_t pressure_boosts_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pressure_boosts);
+}
+KSM_ATTR_RO(pressure_boosts);
+
+static ssize_t shrinker_freed_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_shrinker_freed);
+}
+KSM_ATTR_RO(shrinker_freed);
 
-			goto get_page_out;
-		}
+/* the longest ksmd ran in its long loops without offering to reschedule */
+static ssize_t resched_max_usecs_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		       (unsigned long long)div_u64(ksm_resched_max_ns,
+						   NSEC_PER_USEC));
+}
 
-		/* well, search the collision subtree */
-		new = &tree_node->sub_root.rb_node;
-		BUG_ON(!*new);
-		hash_max = rmap_item_hash_max(rmap_item, hash);
+static ssize_t resched_max_usecs_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-		while (*new) {
-			int cmp;
+	/* only 0, to start measuring again */
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob)
+		return -EINVAL;
 
-			tree_rmap_item = rb_entry(*new, struct rmap_item,
-						  node);
+	ksm_resched_max_ns = 0;
 
-			cmp = hash_cmp(hash_max, tree_rmap_item->hash_max);
-			parent = *new;
-			if (cmp < 0)
-				new = &parent->rb_left;
-			else if (cmp > 0)
-				new = &parent->rb_right;
-			else
-				goto get_page_out;
-		}
-	} else {
-		/* alloc a new tree_node */
-		tree_node = alloc_tree_node(&unstable_tree_node_list);
-		if (!tree_node)
-			return NULL;
+	return count;
+}
+KSM_ATTR(resched_max_usecs);
 
-		tree_node->hash = hash;
-		rb_link_node(&tree_node->node, parent, new);
-		rb_insert_color(&tree_node->node, &root_unstable_tree);
-		parent = NULL;
-		new = &tree_node->sub_root.rb_node;
-	}
+static ssize_t idle_scan_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_idle_scan);
+}
 
-	/* did not found even in sub-tree */
-	rmap_item->tree_node = tree_node;
-	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->append_round = ksm_scan_round;
-	rb_link_node(&rmap_item->node, parent, new);
-	rb_insert_color(&rmap_item->node, &tree_node->sub_root);
+static ssize_t idle_scan_store(struct kobject *kobj,
+			       struct kobj_attribute *attr,
+			       const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	ksm_pages_unshared++;
-	return NULL;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-get_page_out:
-	if (tree_rmap_item->page == rmap_item->page)
-		return NULL;
+	ksm_idle_scan = knob;
 
-	if (get_tree_rmap_item_page(tree_rmap_item))
-		return NULL;
+	return count;
+}
+KSM_ATTR(idle_scan);
 
-	return tree_rmap_item;
+static ssize_t idle_scan_threshold_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_idle_scan_threshold);
 }
 
-static void enter_inter_vma_table(struct vma_slot *slot)
+static ssize_t idle_scan_threshold_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
 {
-	unsigned int i;
+	int err;
+	unsigned long pct;
 
-	for (i = 0; i <= ksm_vma_table_size; i++) {
-		if (!ksm_vma_table[i])
-			break;
-	}
-	BUG_ON(ksm_vma_table[i]);
-	slot->ksm_index = i;
-	ksm_vma_table[i] = slot;
-	ksm_vma_table_num++;
+	err = strict_strtoul(buf, 10, &pct);
+	if (err || pct > 100)
+		return -EINVAL;
 
-	BUG_ON(i > ksm_vma_table_index_end);
-	if (i == ksm_vma_table_index_end)
-		ksm_vma_table_index_end++;
+	ksm_idle_scan_threshold = pct;
 
-	BUG_ON(ksm_vma_table_index_end > ksm_vma_table_size - 1);
+	return count;
 }
+KSM_ATTR(idle_scan_threshold);
 
-static inline unsigned int intertab_vma_offset(int i, int j)
+static ssize_t idle_scan_max_delay_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
 {
-	int swap;
-	if (i < j) {
-		swap = i;
-		i = j;
-		j = swap;
-	}
-
-	return i * (i+1) / 2 + j;
+	return sprintf(buf, "%u\n", ksm_idle_scan_max_delay);
 }
 
-static inline void inc_vma_intertab_pair(struct vma_slot *slot1,
-					 struct vma_slot *slot2)
+static ssize_t idle_scan_max_delay_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
 {
-	unsigned long offset;
+	int err;
+	unsigned long msecs;
 
-	if (slot1->ksm_index == -1)
-		enter_inter_vma_table(slot1);
+	err = strict_strtoul(buf, 10, &msecs);
+	if (err || msecs > UINT_MAX)
+		return -EINVAL;
 
-	if (slot2->ksm_index == -1)
-		enter_inter_vma_table(slot2);
+	ksm_idle_scan_max_delay = msecs;
 
-	offset = intertab_vma_offset(slot1->ksm_index, slot2->ksm_index);
-	ksm_inter_vma_table[offset]++;
-	BUG_ON(!ksm_inter_vma_table[offset]);
+	return count;
 }
+KSM_ATTR(idle_scan_max_delay);
 
-static inline void dec_vma_intertab_pair(struct vma_slot *slot1,
-					 struct vma_slot *slot2)
+static ssize_t min_scan_ratio_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	unsigned long offset;
-	BUG_ON(slot1->ksm_index == -1 || slot2->ksm_index == -1);
-
-	offset = intertab_vma_offset(slot1->ksm_index, slot2->ksm_index);
-	BUG_ON(!ksm_inter_vma_table[offset]);
-	ksm_inter_vma_table[offset]--;
+	return sprintf(buf, "%u\n", ksm_min_scan_ratio);
 }
 
-static void hold_anon_vma(struct rmap_item *rmap_item,
-			  struct anon_vma *anon_vma)
+static ssize_t min_scan_ratio_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	rmap_item->anon_vma = anon_vma;
-	get_anon_vma(anon_vma);
+	unsigned long msr;
+	int err;
+
+	err = strict_strtoul(buf, 10, &msr);
+	if (err || msr > UINT_MAX)
+		return -EINVAL;
+
+	ksm_min_scan_ratio = msr;
+
+	return count;
 }
+KSM_ATTR(min_scan_ratio);
 
+static ssize_t scan_batch_pages_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_scan_batch_pages);
+}
 
-/**
- * stable_tree_append() - append a rmap_item to a stable node. Deduplication
- * ratio statistics is done in this function.
- *
- */
-static void stable_tree_append(struct rmap_item *rmap_item,
-			       struct stable_node *stable_node)
+static ssize_t scan_batch_pages_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
 {
-	struct node_vma *node_vma = NULL, *new_node_vma, *node_vma_iter = NULL;
-	struct hlist_node *hlist, *cont_p = NULL;
-	unsigned long key = (unsigned long)rmap_item->slot;
+	int err;
+	unsigned long batch_pages;
 
-	BUG_ON(!stable_node);
-	rmap_item->address |= STABLE_FLAG;
-	rmap_item->append_round = ksm_scan_round;
+	err = strict_strtoul(buf, 10, &batch_pages);
+	if (err || batch_pages > UINT_MAX)
+		return -EINVAL;
 
-	if (hlist_empty(&stable_node->hlist)) {
-		ksm_pages_shared++;
-		goto node_vma_new;
-	} else {
-		ksm_pages_sharing++;
-	}
+	ksm_scan_batch_pages = batch_pages;
+	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
 
-	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
-		if (node_vma->last_update == ksm_scan_round)
-			inc_vma_intertab_pair(rmap_item->slot, node_vma->slot);
+	return count;
+}
+KSM_ATTR(scan_batch_pages);
 
-		if (node_vma->key >= key)
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_scan_threads);
+}
+
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long threads, i;
+
+	err = strict_strtoul(buf, 10, &threads);
+	if (err || !threads || threads > KSM_SCAN_THREADS_MAX)
+		return -EINVAL;
+
+	mutex_lock(&ksm_scan_threads_mutex);
+	for (i = ksm_scan_threads; i < threads; i++) {
+		err = ksm_start_scan_thread(i);
+		if (err) {
+			threads = i;
 			break;
+		}
 	}
 
-	cont_p = hlist;
+	/*
+	 * Publish the new number before stopping any thread, so the ones to
+	 * be stopped are not waited for by a shrinking ksm_scan_threads.
+	 */
+	i = ksm_scan_threads;
+	ksm_scan_threads = threads;
+	for (; i > threads; i--) {
+		kthread_stop(ksm_scan_workers[i - 1]);
+		ksm_scan_workers[i - 1] = NULL;
+	}
+	mutex_unlock(&ksm_scan_threads_mutex);
 
-	if (node_vma && node_vma->key == key) {
-		if (node_vma->last_update == ksm_scan_round) {
-			/**
-			 * we consider this page a inner duplicate, cancel
-			 * other updates
-			 */
-			hlist_for_each_entry(node_vma_iter, hlist,
-					     &stable_node->hlist, hlist) {
-				if (node_vma_iter->key == key)
-					break;
+	if (err)
+		return err;
 
-				/* only need to increase the same vma */
-				if (node_vma_iter->last_update ==
-				    ksm_scan_round) {
-					dec_vma_intertab_pair(rmap_item->slot,
-							  node_vma_iter->slot);
-				}
-			}
-		} else {
-			/**
-			 * Although it's same vma, it contains no duplicate for this
-			 * round. Continue scan other vma.
-			 */
-			hlist_for_each_entry_continue(node_vma_iter,
-						      hlist, hlist) {
-				if (node_vma_iter->last_update ==
-				    ksm_scan_round) {
-					inc_vma_intertab_pair(rmap_item->slot,
-							  node_vma_iter->slot);
-				}
-			}
+	return count;
+}
+KSM_ATTR(scan_threads);
 
-		}
+static ssize_t hash_batch_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_hash_batch);
+}
 
-		goto node_vma_ok;
-	}
+static ssize_t hash_batch_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int err;
+	unsigned long batch;
 
-node_vma_new:
-	/* no same vma already in node, alloc a new node_vma */
-	new_node_vma = alloc_node_vma();
-	BUG_ON(!new_node_vma);
-	new_node_vma->head = stable_node;
-	new_node_vma->slot = rmap_item->slot;
+	err = strict_strtoul(buf, 10, &batch);
+	if (err || !batch || batch > KSM_HASH_BATCH_MAX)
+		return -EINVAL;
 
-	if (!node_vma) {
-		hlist_add_head(&new_node_vma->hlist, &stable_node->hlist);
-	} else if (node_vma->key != key) {
-		if (node_vma->key < key)
-			hlist_add_after(&node_vma->hlist, &new_node_vma->hlist);
-		else {
-			hlist_for_each_entry_continue(node_vma_iter, cont_p,
-						      hlist) {
-				if (node_vma_iter->last_update ==
-				    ksm_scan_round) {
-					inc_vma_intertab_pair(rmap_item->slot,
-							  node_vma_iter->slot);
-				}
-			}
-			hlist_add_before(&new_node_vma->hlist,
-					 &node_vma->hlist);
-		}
+	ksm_hash_batch = batch;
 
-	}
-	node_vma = new_node_vma;
+	return count;
+}
+KSM_ATTR(hash_batch);
 
-node_vma_ok: /* ok, ready to add to the list */
-	rmap_item->head = node_vma;
-	hlist_add_head(&rmap_item->hlist, &node_vma->rmap_hlist);
-	node_vma->last_update = ksm_scan_round;
-	hold_anon_vma(rmap_item, rmap_item->slot->vma->anon_vma);
-	rmap_item->slot->pages_merged++;
+static ssize_t mmap_sem_run_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_mmap_sem_run);
 }
 
-/*
- * We use break_ksm to break COW on a ksm page: it's a stripped down
- *
- *	if (get_user_pages(current, mm, addr, 1, 1, 1, &page, NULL) == 1)
- *		put_page(page);
- *
- * but taking great care only to touch a ksm page, in a VM_MERGEABLE vma,
- * in case the application has unmapped and remapped mm,addr meanwhile.
- * Could a ksm page appear anywhere else?  Actually yes, in a VM_PFNMAP
- * mmap of /dev/mem or /dev/kmem, where we would not want to touch it.
- */
-static int break_ksm(struct vm_area_struct *vma, unsigned long addr)
+static ssize_t mmap_sem_run_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
 {
-	struct page *page;
-	int ret = 0;
+	int err;
+	unsigned long run;
 
-	do {
-		cond_resched();
-		page = follow_page(vma, addr, FOLL_GET);
-		if (IS_ERR_OR_NULL(page))
-			break;
-		if (PageKsm(page)) {
-			ret = handle_mm_fault(vma->vm_mm, vma, addr,
-					      FAULT_FLAG_WRITE);
-		} else
-			ret = VM_FAULT_WRITE;
-		put_page(page);
-	} while (!(ret & (VM_FAULT_WRITE | VM_FAULT_SIGBUS | VM_FAULT_OOM)));
-	/*
-	 * We must loop because handle_mm_fault() may back out if there's
-	 * any difficulty e.g. if pte accessed bit gets updated concurrently.
-	 *
-	 * VM_FAULT_WRITE is what we have been hoping for: it indicates that
-	 * COW has been broken, even if the vma does not permit VM_WRITE;
-	 * but note that a concurrent fault might break PageKsm for us.
-	 *
-	 * VM_FAULT_SIGBUS could occur if we race with truncation of the
-	 * backing file, which also invalidates anonymous pages: that's
-	 * okay, that truncation will have unmapped the PageKsm for us.
-	 *
-	 * VM_FAULT_OOM: at the time of writing (late July 2009), setting
-	 * aside mem_cgroup limits, VM_FAULT_OOM would only be set if the
-	 * current task has TIF_MEMDIE set, and will be OOM killed on return
-	 * to user; and ksmd, having no mm, would never be chosen for that.
-	 *
-	 * But if the mm is in a limited mem_cgroup, then the fault may fail
-	 * with VM_FAULT_OOM even if the current task is not TIF_MEMDIE; and
-	 * even ksmd can fail in this way - though it's usually breaking ksm
-	 * just to undo a merge it made a moment before, so unlikely to oom.
-	 *
-	 * That's a pity: we might therefore have more kernel pages allocated
-	 * than we're counting as nodes in the stable tree; but ksm_do_scan
-	 * will retry to break_cow on each pass, so should recover the page
-	 * in due course.  The important thing is to not let VM_MERGEABLE
-	 * be cleared while any such pages might remain in the area.
-	 */
-	return (ret & VM_FAULT_OOM) ? -ENOMEM : 0;
+	err = strict_strtoul(buf, 10, &run);
+	if (err || run > UINT_MAX)
+		return -EINVAL;
+
+	ksm_mmap_sem_run = run;
+
+	return count;
+}
+KSM_ATTR(mmap_sem_run);
+
+static ssize_t use_zero_pages_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_use_zero_pages);
+}
+
+static ssize_t use_zero_pages_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	ksm_use_zero_pages = knob;
+
+	return count;
+}
+KSM_ATTR(use_zero_pages);
+
+static ssize_t shmem_zero_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_shmem_zero);
 }
 
-static void break_cow(struct rmap_item *rmap_item)
+static ssize_t shmem_zero_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
 {
-	struct vm_area_struct *vma = rmap_item->slot->vma;
-	struct mm_struct *mm = vma->vm_mm;
-	unsigned long addr = get_rmap_addr(rmap_item);
+	int err;
+	unsigned long knob;
 
-	if (ksm_test_exit(mm))
-		goto out;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	break_ksm(vma, addr);
-out:
-	return;
+	ksm_shmem_zero = knob;
+
+	return count;
 }
+KSM_ATTR(shmem_zero);
 
-/*
- * Though it's very tempting to unmerge in_stable_tree(rmap_item)s rather
- * than check every pte of a given vma, the locking doesn't quite work for
- * that - an rmap_item is assigned to the stable tree after inserting ksm
- * page and upping mmap_sem.  Nor does it fit with the way we skip dup'ing
- * rmap_items from parent to child at fork time (so as not to waste time
- * if exit comes before the next scan reaches it).
- *
- * Similarly, although we'd like to remove rmap_items (so updating counts
- * and freeing memory) when unmerging an area, it's easier to leave that
- * to the next pass of ksmd - consider, for example, how ksmd might be
- * in cmp_and_merge_page on one of the rmap_items we would be removing.
- */
-inline int unmerge_ksm_pages(struct vm_area_struct *vma,
-		      unsigned long start, unsigned long end)
+static ssize_t shmem_zero_dropped_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
 {
-	unsigned long addr;
-	int err = 0;
+	return sprintf(buf, "%lu\n", ksm_shmem_zero_dropped);
+}
+KSM_ATTR_RO(shmem_zero_dropped);
 
-	for (addr = start; addr < end && !err; addr += PAGE_SIZE) {
-		if (ksm_test_exit(vma->vm_mm))
-			break;
-		if (signal_pending(current))
-			err = -ERESTARTSYS;
-		else
-			err = break_ksm(vma, addr);
-	}
-	return err;
+static ssize_t file_dup_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_file_dup);
 }
 
-/*
- * cmp_and_merge_page() - first see if page can be merged into the stable
- * tree; if not, compare hash to previous and if it's the same, see if page
- * can be inserted into the unstable tree, or merged with a page already there
- * and both transferred to the stable tree.
- *
- * @page: the page that we are searching identical page to.
- * @rmap_item: the reverse mapping into the virtual address of this page
- */
-static void cmp_and_merge_page(struct rmap_item *rmap_item)
+static ssize_t file_dup_store(struct kobject *kobj,
+			      struct kobj_attribute *attr,
+			      const char *buf, size_t count)
 {
-	struct rmap_item *tree_rmap_item;
-	struct page *page;
-	struct page *kpage = NULL;
-	u32 hash, hash_max;
+	struct file_dup_memo *memo = NULL;
 	int err;
-	unsigned int success1, success2;
-	struct stable_node *snode;
-	int cmp;
-	struct rb_node *parent = NULL, **new;
-
-	remove_rmap_item_from_tree(rmap_item);
-
-	page = rmap_item->page;
-	hash = page_hash(page, hash_strength, 1);
+	unsigned long knob;
 
-	ksm_pages_scanned++;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(rmap_item, hash);
-	if (kpage) {
-		err = try_to_merge_with_ksm_page(rmap_item, kpage,
-						 hash);
-		if (!err) {
-			/*
-			 * The page was successfully merged, add
-			 * its rmap_item to the stable tree.
-			 * page lock is needed because it's
-			 * racing with try_to_unmap_ksm(), etc.
-			 */
-			lock_page(kpage);
-			stable_tree_append(rmap_item, page_stable_node(kpage));
-			unlock_page(kpage);
-			put_page(kpage);
-			return; /* success */
-		}
-		put_page(kpage);
+	if (knob && !ksm_file_dup_memo) {
+		memo = vzalloc(sizeof(*memo) << KSM_FILE_DUP_BITS);
+		if (!memo)
+			return -ENOMEM;
+	}
 
-		/*
-		 * if it's a collision and it has been search in sub-rbtree
-		 * (hash_max != 0), we want to abort, because if it is
-		 * successfully merged in unstable tree, the collision trends to
-		 * happen again.
-		 */
-		if (err == MERGE_ERR_COLLI && rmap_item->hash_max)
-			return;
+	ksm_control_lock();
+	if (memo && !ksm_file_dup_memo) {
+		ksm_file_dup_memo = memo;
+		memo = NULL;
 	}
+	ksm_file_dup = knob;
+	mutex_unlock(&ksm_thread_mutex);
+	vfree(memo);
 
-	tree_rmap_item =
-		unstable_tree_search_insert(rmap_item, hash);
-	if (tree_rmap_item) {
-		err = try_to_merge_two_pages(rmap_item, tree_rmap_item, hash);
-		/*
-		 * As soon as we merge this page, we want to remove the
-		 * rmap_item of the page we have merged with from the unstable
-		 * tree, and insert it instead as new node in the stable tree.
-		 */
-		if (!err) {
-			kpage = page;
-			remove_rmap_item_from_tree(tree_rmap_item);
-			lock_page(kpage);
-			snode = stable_tree_insert(kpage, hash,
-						   rmap_item, tree_rmap_item,
-						   &success1, &success2);
+	return count;
+}
+KSM_ATTR(file_dup);
 
-			if (success1)
-				stable_tree_append(rmap_item, snode);
-			else
-				break_cow(rmap_item);
+static ssize_t file_pages_seen_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_file_pages_seen_last);
+}
+KSM_ATTR_RO(file_pages_seen);
 
-			if (success2)
-				stable_tree_append(tree_rmap_item, snode);
-			else
-				break_cow(tree_rmap_item);
+static ssize_t file_pages_duplicate_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_file_pages_dup_last);
+}
+KSM_ATTR_RO(file_pages_duplicate);
 
-			unlock_page(kpage);
+static ssize_t swap_dedup_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_swap_dedup);
+}
 
-		} else if (err == MERGE_ERR_COLLI) {
-			if (tree_rmap_item->tree_node->count == 1) {
-				rmap_item_hash_max(tree_rmap_item,
-				tree_rmap_item->tree_node->hash);
-			} else
-				BUG_ON(!(tree_rmap_item->hash_max));
+static ssize_t swap_dedup_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct swap_dedup_memo *memo = NULL;
+	int err;
+	unsigned long knob;
 
-			hash_max = rmap_item_hash_max(rmap_item, hash);
-			cmp = hash_cmp(hash_max, tree_rmap_item->hash_max);
-			parent = &tree_rmap_item->node;
-			if (cmp < 0)
-				new = &parent->rb_left;
-			else if (cmp > 0)
-				new = &parent->rb_right;
-			else
-				goto put_up_out;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-			rmap_item->tree_node = tree_rmap_item->tree_node;
-			rmap_item->address |= UNSTABLE_FLAG;
-			rmap_item->append_round = ksm_scan_round;
-			rb_link_node(&rmap_item->node, parent, new);
-			rb_insert_color(&rmap_item->node,
-					&tree_rmap_item->tree_node->sub_root);
-		}
-put_up_out:
-		put_page(tree_rmap_item->page);
-		up_read(&tree_rmap_item->slot->vma->vm_mm->mmap_sem);
+	if (knob && !ksm_swap_dedup_memo) {
+		memo = vzalloc(sizeof(*memo) << KSM_SWAP_DEDUP_BITS);
+		if (!memo)
+			return -ENOMEM;
 	}
-}
-
 
+	ksm_control_lock();
+	if (memo && !ksm_swap_dedup_memo) {
+		ksm_swap_dedup_memo = memo;
+		memo = NULL;
+	}
+	ksm_swap_dedup = knob;
+	mutex_unlock(&ksm_thread_mutex);
+	vfree(memo);
 
+	return count;
+}
+KSM_ATTR(swap_dedup);
 
-static inline unsigned long get_pool_index(struct vma_slot *slot,
-					   unsigned long index)
+static ssize_t swap_dedup_pages_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
 {
-	unsigned long pool_index;
-
-	pool_index = (sizeof(struct rmap_list_entry *) * index) >> PAGE_SHIFT;
-	if (pool_index >= slot->pool_size)
-		BUG();
-	return pool_index;
+	return sprintf(buf, "%lu\n", ksm_swap_dedup_pages);
 }
+KSM_ATTR_RO(swap_dedup_pages);
 
-static inline unsigned long index_page_offset(unsigned long index)
+static ssize_t pages_zero_merged_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
 {
-	return offset_in_page(sizeof(struct rmap_list_entry *) * index);
+	return sprintf(buf, "%lu\n", ksm_pages_zero_merged);
 }
+KSM_ATTR_RO(pages_zero_merged);
 
-static inline
-struct rmap_list_entry *get_rmap_list_entry(struct vma_slot *slot,
-					    unsigned long index, int need_alloc)
+static ssize_t pages_zero_hinted_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
 {
-	unsigned long pool_index;
-	void *addr;
+	return sprintf(buf, "%lu\n", ksm_pages_zero_hinted);
+}
+KSM_ATTR_RO(pages_zero_hinted);
 
+static ssize_t hash_cache_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_hash_cache);
+}
 
-	pool_index = get_pool_index(slot, index);
-	if (!slot->rmap_list_pool[pool_index]) {
-		if (!need_alloc)
-			return NULL;
+static ssize_t hash_cache_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-		slot->rmap_list_pool[pool_index] =
-			alloc_page(GFP_KERNEL | __GFP_ZERO);
-		BUG_ON(!slot->rmap_list_pool[pool_index]);
-	}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	addr = kmap(slot->rmap_list_pool[pool_index]);
-	addr += index_page_offset(index);
+	ksm_hash_cache = knob;
 
-	return addr;
+	return count;
 }
+KSM_ATTR(hash_cache);
 
-static inline void put_rmap_list_entry(struct vma_slot *slot,
-				       unsigned long index)
+static ssize_t hash_cache_hits_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	unsigned long pool_index;
+	return sprintf(buf, "%lu\n", ksm_hash_cache_hits);
+}
+KSM_ATTR_RO(hash_cache_hits);
 
-	pool_index = get_pool_index(slot, index);
-	BUG_ON(!slot->rmap_list_pool[pool_index]);
-	kunmap(slot->rmap_list_pool[pool_index]);
+static ssize_t batch_wrprotect_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_batch_wrprotect);
 }
 
-static inline int entry_is_new(struct rmap_list_entry *entry)
+static ssize_t batch_wrprotect_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	return !entry->item;
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	ksm_batch_wrprotect = knob;
+
+	return count;
 }
+KSM_ATTR(batch_wrprotect);
 
-static inline unsigned long get_index_orig_addr(struct vma_slot *slot,
-						unsigned long index)
+static ssize_t scan_window_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	return slot->vma->vm_start + (index << PAGE_SHIFT);
+	return sprintf(buf, "%u\n", ksm_scan_window);
 }
 
-static inline unsigned long get_entry_address(struct rmap_list_entry *entry)
+static ssize_t scan_window_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
 {
-	unsigned long addr;
+	int err;
+	unsigned long flags;
 
-	if (is_addr(entry->addr))
-		addr = get_clean_addr(entry->addr);
-	else if (entry->item)
-		addr = get_rmap_addr(entry->item);
-	else
-		BUG();
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
 
-	return addr;
+	ksm_scan_window = flags;
+
+	return count;
 }
+KSM_ATTR(scan_window);
 
-static inline struct rmap_item *get_entry_item(struct rmap_list_entry *entry)
+static ssize_t pages_hole_skipped_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
 {
-	if (is_addr(entry->addr))
-		return NULL;
-
-	return entry->item;
+	return sprintf(buf, "%lu\n", ksm_pages_hole_skipped);
 }
+KSM_ATTR_RO(pages_hole_skipped);
 
-static inline void inc_rmap_list_pool_count(struct vma_slot *slot,
-					    unsigned long index)
+/* pages write protected in batches, and the TLB flushes it took */
+static ssize_t batch_wrprotect_stats_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
 {
-	unsigned long pool_index;
+	return sprintf(buf, "%lu %lu\n", ksm_batch_wrprotect_pages,
+		       ksm_batch_wrprotect_flushes);
+}
+KSM_ATTR_RO(batch_wrprotect_stats);
 
-	pool_index = get_pool_index(slot, index);
-	BUG_ON(!slot->rmap_list_pool[pool_index]);
-	slot->pool_counts[pool_index]++;
+static ssize_t hot_defer_rounds_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_hot_rounds);
 }
 
-static inline void dec_rmap_list_pool_count(struct vma_slot *slot,
-					    unsigned long index)
+static ssize_t hot_defer_rounds_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
 {
-	unsigned long pool_index;
+	int err;
+	unsigned long knob;
 
-	pool_index = get_pool_index(slot, index);
-	BUG_ON(!slot->rmap_list_pool[pool_index]);
-	BUG_ON(!slot->pool_counts[pool_index]);
-	slot->pool_counts[pool_index]--;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > KSM_HOT_ROUNDS_MAX)
+		return -EINVAL;
+
+	ksm_hot_rounds = knob;
+
+	return count;
 }
+KSM_ATTR(hot_defer_rounds);
 
-static inline int entry_has_rmap(struct rmap_list_entry *entry)
+static ssize_t pages_hot_deferred_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
 {
-	return !is_addr(entry->addr) && entry->item;
+	return sprintf(buf, "%lu\n", ksm_pages_hot_deferred);
 }
+KSM_ATTR_RO(pages_hot_deferred);
 
-static inline void swap_entries(struct rmap_list_entry *entry1,
-				unsigned long index1,
-				struct rmap_list_entry *entry2,
-				unsigned long index2)
+static ssize_t pin_backoff_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	struct rmap_list_entry tmp;
-
-	/* swapping two new entries is meaningless */
-	BUG_ON(entry_is_new(entry1) && entry_is_new(entry2));
+	return sprintf(buf, "%u\n", ksm_pin_backoff);
+}
 
-	tmp = *entry1;
-	*entry1 = *entry2;
-	*entry2 = tmp;
+static ssize_t pin_backoff_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	if (entry_has_rmap(entry1))
-		entry1->item->entry_index = index1;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	if (entry_has_rmap(entry2))
-		entry2->item->entry_index = index2;
+	ksm_pin_backoff = knob;
 
-	if (entry_has_rmap(entry1) && !entry_has_rmap(entry2)) {
-		inc_rmap_list_pool_count(entry1->item->slot, index1);
-		dec_rmap_list_pool_count(entry1->item->slot, index2);
-	} else if (!entry_has_rmap(entry1) && entry_has_rmap(entry2)) {
-		inc_rmap_list_pool_count(entry2->item->slot, index2);
-		dec_rmap_list_pool_count(entry2->item->slot, index1);
-	}
+	return count;
 }
+KSM_ATTR(pin_backoff);
 
-static inline void free_entry_item(struct rmap_list_entry *entry)
+static ssize_t pin_stats_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
 {
-	unsigned long index;
-	struct rmap_item *item;
-
-	if (!is_addr(entry->addr)) {
-		BUG_ON(!entry->item);
-		item = entry->item;
-		entry->addr = get_rmap_addr(item);
-		set_is_addr(entry->addr);
-		index = item->entry_index;
-		remove_rmap_item_from_tree(item);
-		dec_rmap_list_pool_count(item->slot, index);
-		free_rmap_item(item);
-	}
+	return sprintf(buf, "%lu %lu\n", ksm_pin_failures,
+		       ksm_pages_pin_skipped);
 }
+KSM_ATTR_RO(pin_stats);
 
-static inline int pool_entry_boundary(unsigned long index)
+/*
+ * The memory taken by the metadata of ksm, to weigh against what it saves.
+ * The objects are counted at their slab object size, without slab overhead.
+ */
+static ssize_t metadata_bytes_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
 {
-	unsigned long linear_addr;
-
-	linear_addr = sizeof(struct rmap_list_entry *) * index;
-	return index && !offset_in_page(linear_addr);
+	unsigned long long bytes;
+
+	bytes = (u64)ksm_rmap_items * kmem_cache_size(rmap_item_cache);
+	bytes += (u64)ksm_stable_nodes * kmem_cache_size(stable_node_cache);
+	bytes += (u64)ksm_tree_nodes * kmem_cache_size(tree_node_cache);
+	bytes += (u64)ksm_node_vmas * kmem_cache_size(node_vma_cache);
+	bytes += (u64)(ksm_vma_slot_num + ksm_slots_dying_num) *
+		 kmem_cache_size(vma_slot_cache);
+	bytes += (u64)ksm_vma_pair_num * kmem_cache_size(vma_pair_cache);
+	bytes += (u64)(ksm_index_pages + ksm_index_pool_pages) << PAGE_SHIFT;
+	bytes += ksm_small_pool_bytes;
+	if (ksm_stable_filter.counters)
+		bytes += 1ULL << ksm_stable_filter.bits;
+	if (ksm_stable_index.table)
+		bytes += (u64)sizeof(struct tree_index_entry) <<
+			 ksm_stable_index.bits;
+	if (ksm_unstable_index.table)
+		bytes += (u64)sizeof(struct tree_index_entry) <<
+			 ksm_unstable_index.bits;
+
+	return sprintf(buf, "%llu\n", bytes);
+}
+KSM_ATTR_RO(metadata_bytes);
+
+static ssize_t khugepaged_hold_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_khugepaged_hold);
 }
 
-static inline void try_free_last_pool(struct vma_slot *slot,
-				      unsigned long index)
+static ssize_t khugepaged_hold_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	unsigned long pool_index;
+	int err;
+	unsigned long knob;
 
-	pool_index = get_pool_index(slot, index);
-	if (slot->rmap_list_pool[pool_index] &&
-	    !slot->pool_counts[pool_index]) {
-		__free_page(slot->rmap_list_pool[pool_index]);
-		slot->rmap_list_pool[pool_index] = NULL;
-		slot->need_sort = 1;
-	}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
+	ksm_khugepaged_hold = knob;
+
+	return count;
 }
+KSM_ATTR(khugepaged_hold);
 
-static inline unsigned long vma_item_index(struct vm_area_struct *vma,
-					   struct rmap_item *item)
+static ssize_t quiesced_fast_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
 {
-	return (get_rmap_addr(item) - vma->vm_start) >> PAGE_SHIFT;
+	return sprintf(buf, "%u\n", ksm_quiesced_fast);
 }
 
-static int within_same_pool(struct vma_slot *slot,
-			    unsigned long i, unsigned long j)
+static ssize_t quiesced_fast_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
 {
-	unsigned long pool_i, pool_j;
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	pool_i = get_pool_index(slot, i);
-	pool_j = get_pool_index(slot, j);
+	ksm_quiesced_fast = knob;
 
-	return (pool_i == pool_j);
+	return count;
 }
+KSM_ATTR(quiesced_fast);
 
-static void sort_rmap_entry_list(struct vma_slot *slot)
+static ssize_t dedup_decay_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	unsigned long i, j;
-	struct rmap_list_entry *entry, *swap_entry;
-
-	entry = get_rmap_list_entry(slot, 0, 0);
-	for (i = 0; i < slot->pages; ) {
+	return sprintf(buf, "%u\n", ksm_dedup_decay);
+}
 
-		if (!entry)
-			goto skip_whole_pool;
+static ssize_t dedup_decay_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-		if (entry_is_new(entry))
-			goto next_entry;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > KSM_DEDUP_DECAY_MAX)
+		return -EINVAL;
 
-		if (is_addr(entry->addr)) {
-			entry->addr = 0;
-			goto next_entry;
-		}
+	ksm_dedup_decay = knob;
 
-		j = vma_item_index(slot->vma, entry->item);
-		if (j == i)
-			goto next_entry;
+	return count;
+}
+KSM_ATTR(dedup_decay);
 
-		if (within_same_pool(slot, i, j))
-			swap_entry = entry + j - i;
-		else
-			swap_entry = get_rmap_list_entry(slot, j, 1);
-
-		swap_entries(entry, i, swap_entry, j);
-		if (!within_same_pool(slot, i, j))
-			put_rmap_list_entry(slot, j);
-		continue;
-
-skip_whole_pool:
-		i += PAGE_SIZE / sizeof(*entry);
-		if (i < slot->pages)
-			entry = get_rmap_list_entry(slot, i, 0);
-		continue;
-
-next_entry:
-		if (i >= slot->pages - 1 ||
-		    !within_same_pool(slot, i, i + 1)) {
-			put_rmap_list_entry(slot, i);
-			if (i + 1 < slot->pages)
-				entry = get_rmap_list_entry(slot, i + 1, 0);
-		} else
-			entry++;
-		i++;
-		continue;
-	}
+static ssize_t rung_hysteresis_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_rung_hysteresis);
+}
 
-	/* free empty pool entries which contain no rmap_item */
-	/* CAN be simplied to based on only pool_counts when bug freed !!!!! */
-	for (i = 0; i < slot->pool_size; i++) {
-		unsigned char has_rmap;
-		void *addr;
+static ssize_t rung_hysteresis_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-		if (!slot->rmap_list_pool[i])
-			continue;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 100)
+		return -EINVAL;
 
-		has_rmap = 0;
-		addr = kmap(slot->rmap_list_pool[i]);
-		BUG_ON(!addr);
-		for (j = 0; j < PAGE_SIZE / sizeof(*entry); j++) {
-			entry = (struct rmap_list_entry *)addr + j;
-			if (is_addr(entry->addr))
-				continue;
-			if (!entry->item)
-				continue;
-			has_rmap = 1;
-		}
-		kunmap(slot->rmap_list_pool[i]);
-		if (!has_rmap) {
-			BUG_ON(slot->pool_counts[i]);
-			__free_page(slot->rmap_list_pool[i]);
-			slot->rmap_list_pool[i] = NULL;
-		}
-	}
+	ksm_rung_hysteresis = knob;
 
-	slot->need_sort = 0;
+	return count;
 }
+KSM_ATTR(rung_hysteresis);
 
-/*
- * vma_fully_scanned() - if all the pages in this slot have been scanned.
- */
-static inline int vma_fully_scanned(struct vma_slot *slot)
+static ssize_t rung_jump_max_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
 {
-	return slot->pages_scanned && !(slot->pages_scanned % slot->pages);
+	return sprintf(buf, "%u\n", ksm_rung_jump_max);
 }
 
-/**
- * get_next_rmap_item() - Get the next rmap_item in a vma_slot according to
- * its random permutation. This function is embedded with the random
- * permutation index management code.
- */
-static struct rmap_item *get_next_rmap_item(struct vma_slot *slot)
+static ssize_t rung_jump_max_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
 {
-	unsigned long rand_range, addr, swap_index, scan_index;
-	struct rmap_item *item = NULL;
-	struct rmap_list_entry *scan_entry, *swap_entry = NULL;
-	struct page *page;
+	int err;
+	unsigned long knob;
 
-	scan_index = swap_index = slot->pages_scanned % slot->pages;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || !knob || knob > KSM_SCAN_LADDER_MAX)
+		return -EINVAL;
 
-	if (pool_entry_boundary(scan_index))
-		try_free_last_pool(slot, scan_index - 1);
+	ksm_rung_jump_max = knob;
 
-	if (vma_fully_scanned(slot)) {
-		slot->need_rerand = slot->need_sort;
-		if (slot->need_sort)
-			sort_rmap_entry_list(slot);
-	}
+	return count;
+}
+KSM_ATTR(rung_jump_max);
 
-	scan_entry = get_rmap_list_entry(slot, scan_index, 1);
-	if (entry_is_new(scan_entry)) {
-		scan_entry->addr = get_index_orig_addr(slot, scan_index);
-		set_is_addr(scan_entry->addr);
-	}
+static ssize_t tree_index_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_tree_index);
+}
 
-	if (slot->need_rerand) {
-		rand_range = slot->pages - scan_index;
-		BUG_ON(!rand_range);
-		swap_index = scan_index + (random32() % rand_range);
-	}
+/* the tables are built or freed at the end of the current round */
+static ssize_t tree_index_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	if (swap_index != scan_index) {
-		swap_entry = get_rmap_list_entry(slot, swap_index, 1);
-		if (entry_is_new(swap_entry)) {
-			swap_entry->addr = get_index_orig_addr(slot,
-							       swap_index);
-			set_is_addr(swap_entry->addr);
-		}
-		swap_entries(scan_entry, scan_index, swap_entry, swap_index);
-	}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	addr = get_entry_address(scan_entry);
-	item = get_entry_item(scan_entry);
-	BUG_ON(addr > slot->vma->vm_end || addr < slot->vma->vm_start);
+	ksm_tree_index = knob;
 
-	page = follow_page(slot->vma, addr, FOLL_GET);
-	if (IS_ERR_OR_NULL(page))
-		goto nopage;
+	return count;
+}
+KSM_ATTR(tree_index);
 
-	if (!PageAnon(page) && !page_trans_compound_anon(page))
-		goto putpage;
+static ssize_t stable_filter_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_use_stable_filter);
+}
 
-	flush_anon_page(slot->vma, page, addr);
-	flush_dcache_page(page);
+/* the filter is built or freed at the end of the current round */
+static ssize_t stable_filter_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	if (!item) {
-		item = alloc_rmap_item();
-		if (item) {
-			/* It has already been zeroed */
-			item->slot = slot;
-			item->address = addr;
-			item->entry_index = scan_index;
-			scan_entry->item = item;
-			inc_rmap_list_pool_count(slot, scan_index);
-		} else
-			goto putpage;
-	}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	BUG_ON(item->slot != slot);
-	/* the page may have changed */
-	item->page = page;
-	put_rmap_list_entry(slot, scan_index);
-	if (swap_entry)
-		put_rmap_list_entry(slot, swap_index);
-	return item;
+	ksm_use_stable_filter = knob;
 
-putpage:
-	put_page(page);
-	page = NULL;
-nopage:
-	/* no page, store addr back and free rmap_item if possible */
-	free_entry_item(scan_entry);
-	put_rmap_list_entry(slot, scan_index);
-	if (swap_entry)
-		put_rmap_list_entry(slot, swap_index);
-	return NULL;
+	return count;
 }
+KSM_ATTR(stable_filter);
 
-static inline int in_stable_tree(struct rmap_item *rmap_item)
+/* negative positive false_positive, of the stable tree searches */
+static ssize_t stable_filter_stats_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
 {
-	return rmap_item->address & STABLE_FLAG;
+	return sprintf(buf, "%lu %lu %lu\n", ksm_filter_negative,
+		       ksm_filter_positive, ksm_filter_false_positive);
 }
+KSM_ATTR_RO(stable_filter_stats);
 
-/**
- * scan_vma_one_page() - scan the next page in a vma_slot. Called with
- * mmap_sem locked.
- */
-static void scan_vma_one_page(struct vma_slot *slot)
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static ssize_t thp_split_threshold_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
 {
-	struct mm_struct *mm;
-	struct rmap_item *rmap_item = NULL;
-	struct vm_area_struct *vma = slot->vma;
+	return sprintf(buf, "%u\n", ksm_thp_split_threshold);
+}
 
-	mm = vma->vm_mm;
-	BUG_ON(!mm);
-	BUG_ON(!slot);
+static ssize_t thp_split_threshold_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
+{
+	int err;
+	unsigned long threshold;
 
-	rmap_item = get_next_rmap_item(slot);
-	if (!rmap_item)
-		goto out1;
+	err = strict_strtoul(buf, 10, &threshold);
+	if (err || threshold > HPAGE_PMD_NR)
+		return -EINVAL;
 
-	if (PageKsm(rmap_item->page) && in_stable_tree(rmap_item))
-		goto out2;
+	ksm_thp_split_threshold = threshold;
 
-	cmp_and_merge_page(rmap_item);
-out2:
-	put_page(rmap_item->page);
-out1:
-	slot->pages_scanned++;
-	slot->slot_scanned = 1;
-	if (vma_fully_scanned(slot)) {
-		slot->fully_scanned = 1;
-		slot->rung->fully_scanned_slots++;
-		BUG_ON(!slot->rung->fully_scanned_slots);
-	}
+	return count;
 }
+KSM_ATTR(thp_split_threshold);
 
-static unsigned long get_vma_random_scan_num(struct vma_slot *slot,
-					     unsigned long scan_ratio)
+static ssize_t thp_split_avoided_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
 {
-	return slot->pages * scan_ratio / KSM_SCAN_RATIO_MAX;
+	return sprintf(buf, "%lu\n", ksm_thp_split_avoided);
 }
+KSM_ATTR_RO(thp_split_avoided);
+#endif
 
-static inline void vma_rung_enter(struct vma_slot *slot,
-				  struct scan_rung *rung)
+static ssize_t run_show(struct kobject *kobj, struct kobj_attribute *attr,
+			char *buf)
 {
-	unsigned long pages_to_scan;
-	struct scan_rung *old_rung = slot->rung;
+	return sprintf(buf, "%u\n", ksm_run);
+}
 
-	/* leave the old rung it was in */
-	BUG_ON(list_empty(&slot->ksm_list));
+static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
+			 const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-	if (old_rung->current_scan == &slot->ksm_list)
-		old_rung->current_scan = slot->ksm_list.next;
-	list_del_init(&slot->ksm_list);
-	old_rung->vma_num--;
-	if (slot->fully_scanned)
-		old_rung->fully_scanned_slots--;
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > UINT_MAX)
+		return -EINVAL;
+	if (flags > KSM_RUN_UNMERGE && flags != KSM_RUN_ESTIMATE)
+		return -EINVAL;
 
-	if (old_rung->current_scan == &old_rung->vma_list) {
-		/* This rung finishes a round */
-		old_rung->round_finished = 1;
-		old_rung->current_scan = old_rung->vma_list.next;
-		BUG_ON(old_rung->current_scan == &old_rung->vma_list &&
-		       !list_empty(&old_rung->vma_list));
+	ksm_control_lock();
+	if (ksm_run != flags) {
+		ksm_run = flags;
+		if (flags & KSM_RUN_UNMERGE) {
+			/* some pages are still merged, the writer may retry */
+			err = unmerge_all_slots();
+			if (err) {
+				ksm_run = KSM_RUN_STOP;
+				count = err;
+			}
+		}
 	}
+	mutex_unlock(&ksm_thread_mutex);
 
-	/* enter the new rung */
-	while (!(pages_to_scan =
-		get_vma_random_scan_num(slot, rung->scan_ratio))) {
-		rung++;
-		BUG_ON(rung > &ksm_scan_ladder[ksm_scan_ladder_size - 1]);
-	}
-	if (list_empty(&rung->vma_list))
-		rung->current_scan = &slot->ksm_list;
-	list_add(&slot->ksm_list, &rung->vma_list);
-	slot->rung = rung;
-	slot->pages_to_scan = pages_to_scan;
-	slot->rung->vma_num++;
-	if (slot->fully_scanned)
-		rung->fully_scanned_slots++;
+	if (flags & (KSM_RUN_MERGE | KSM_RUN_ESTIMATE))
+		wake_up_interruptible(&ksm_thread_wait);
 
-	BUG_ON(rung->current_scan == &rung->vma_list &&
-	       !list_empty(&rung->vma_list));
+	return count;
 }
+KSM_ATTR(run);
 
-static inline void vma_rung_up(struct vma_slot *slot)
+static ssize_t estimate_pages_sharing_show(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   char *buf)
 {
-	if (slot->rung == &ksm_scan_ladder[ksm_scan_ladder_size-1])
-		return;
-
-	vma_rung_enter(slot, slot->rung + 1);
+	return sprintf(buf, "%lu\n", ksm_estimate_sharing);
 }
+KSM_ATTR_RO(estimate_pages_sharing);
 
-static inline void vma_rung_down(struct vma_slot *slot)
+static ssize_t unmerge_workers_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	if (slot->rung == &ksm_scan_ladder[0])
-		return;
-
-	vma_rung_enter(slot, slot->rung - 1);
+	return sprintf(buf, "%u\n", ksm_unmerge_workers);
 }
 
-/**
- * cal_dedup_ratio() - Calculate the deduplication ratio for this slot.
- */
-static inline unsigned long cal_dedup_ratio(struct vma_slot *slot)
+static ssize_t unmerge_workers_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	int i;
-	unsigned long dedup_num = 0, pages1 = slot->pages, scanned1;
-	unsigned int index;
-	unsigned long ret;
-
-	if (!slot->pages_scanned)
-		return 0;
-
-	scanned1 = slot->pages_scanned - slot->last_scanned;
-	BUG_ON(scanned1 > slot->pages_scanned);
-
-	for (i = 0; i < ksm_vma_table_index_end; i++) {
-		struct vma_slot *slot2 = ksm_vma_table[i];
-		unsigned long pages2, scanned2;
-
-		if (!slot2 || i == slot->ksm_index || !slot2->pages_scanned)
-			continue;
+	int err;
+	unsigned long workers;
 
-		pages2 = slot2->pages;
+	err = strict_strtoul(buf, 10, &workers);
+	if (err || !workers || workers > KSM_UNMERGE_WORKERS_MAX)
+		return -EINVAL;
 
-		scanned2 = slot2->pages_scanned - slot2->last_scanned;
-		BUG_ON(scanned2 > slot2->pages_scanned);
+	ksm_unmerge_workers = workers;
 
-		index = intertab_vma_offset(slot->ksm_index, i);
-		BUG_ON(ksm_inter_vma_table[index] && (!scanned1 || !scanned2));
-		if (ksm_inter_vma_table[index]) {
-			dedup_num += ksm_inter_vma_table[index] *
-				     pages1 / scanned1 * pages2 / scanned2;
-		}
-	}
+	return count;
+}
+KSM_ATTR(unmerge_workers);
 
-	index = intertab_vma_offset(slot->ksm_index, slot->ksm_index);
-	BUG_ON(ksm_inter_vma_table[index] && !scanned1);
-	if (ksm_inter_vma_table[index])
-		dedup_num += ksm_inter_vma_table[index] * pages1 / scanned1;
+static ssize_t unmerge_slots_skipped_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	return sprintf(buf, "%ld\n",
+		       atomic_long_read(&ksm_unmerge_slots_skipped));
+}
+KSM_ATTR_RO(unmerge_slots_skipped);
 
-	ret = (dedup_num * KSM_DEDUP_RATIO_SCALE / pages1);
+static ssize_t slots_dying_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_slots_dying_num);
+}
+KSM_ATTR_RO(slots_dying);
 
-	/* Thrashing area filtering */
-	if (ksm_thrash_threshold) {
-		if (slot->pages_cowed * 100 / slot->pages_merged
-		    > ksm_thrash_threshold) {
-			ret = 0;
-		} else {
-			ret = ret * (slot->pages_merged - slot->pages_cowed)
-			      / slot->pages_merged;
-		}
-	}
 
-	return ret;
+static ssize_t thrash_threshold_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_thrash_threshold);
 }
 
-
-/**
- * stable_node_reinsert() - When the hash_strength has been adjusted, the
- * stable tree need to be restructured, this is the function re-inserting the
- * stable node.
- */
-static inline void stable_node_reinsert(struct stable_node *new_node,
-					struct page *page,
-					struct rb_root *root_treep,
-					struct list_head *tree_node_listp,
-					u32 hash)
+static ssize_t thrash_threshold_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
 {
-	struct rb_node **new = &root_treep->rb_node;
-	struct rb_node *parent = NULL;
-	struct stable_node *stable_node;
-	struct tree_node *tree_node;
-	struct page *tree_page;
-	int cmp;
+	int err;
+	unsigned long flags;
+
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 99)
+		return -EINVAL;
+
+	ksm_thrash_threshold = flags;
 
-	while (*new) {
-		int cmp;
+	return count;
+}
+KSM_ATTR(thrash_threshold);
 
-		tree_node = rb_entry(*new, struct tree_node, node);
+static ssize_t strong_hash_ratio_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_strong_hash_ratio);
+}
 
-		cmp = hash_cmp(hash, tree_node->hash);
+static ssize_t strong_hash_ratio_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int err;
+	unsigned long ratio;
 
-		if (cmp < 0) {
-			parent = *new;
-			new = &parent->rb_left;
-		} else if (cmp > 0) {
-			parent = *new;
-			new = &parent->rb_right;
-		} else
-			break;
-	}
+	err = strict_strtoul(buf, 10, &ratio);
+	if (err || ratio > 100)
+		return -EINVAL;
 
-	if (*new) {
-		/* find a stable tree node with same first level hash value */
-		stable_node_hash_max(new_node, page, hash);
-		if (tree_node->count == 1) {
-			stable_node = rb_entry(tree_node->sub_root.rb_node,
-					       struct stable_node, node);
-			tree_page = get_ksm_page(stable_node, 1, 0);
-			if (tree_page) {
-				stable_node_hash_max(stable_node,
-						      tree_page, hash);
-				put_page(tree_page);
+	ksm_strong_hash_ratio = ratio;
 
-				/* prepare for stable node insertion */
+	return count;
+}
+KSM_ATTR(strong_hash_ratio);
 
-				cmp = hash_cmp(new_node->hash_max,
-						   stable_node->hash_max);
-				parent = &stable_node->node;
-				if (cmp < 0)
-					new = &parent->rb_left;
-				else if (cmp > 0)
-					new = &parent->rb_right;
-				else
-					goto failed;
+static ssize_t strong_hash_slots_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_strong_hash_slots);
+}
+KSM_ATTR_RO(strong_hash_slots);
 
-				goto add_node;
-			} else {
-				/* the only stable_node deleted, the tree node
-				 * was not deleted.
-				 */
-				goto tree_node_reuse;
-			}
-		}
+static ssize_t strong_hash_rejected_show(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_strong_hash_rejected);
+}
+KSM_ATTR_RO(strong_hash_rejected);
 
-		/* well, search the collision subtree */
-		new = &tree_node->sub_root.rb_node;
-		parent = NULL;
-		BUG_ON(!*new);
-		while (*new) {
-			int cmp;
+/* of the last round, the pages hashed at full strength for the sub-trees */
+static ssize_t hash_max_pages_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_hash_max_pages_last);
+}
+KSM_ATTR_RO(hash_max_pages);
 
-			stable_node = rb_entry(*new, struct stable_node, node);
+static ssize_t subtree_lookups_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_subtree_lookups_last);
+}
+KSM_ATTR_RO(subtree_lookups);
 
-			cmp = hash_cmp(new_node->hash_max,
-					   stable_node->hash_max);
+static ssize_t near_dup_lines_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_near_dup_lines);
+}
 
-			if (cmp < 0) {
-				parent = *new;
-				new = &parent->rb_left;
-			} else if (cmp > 0) {
-				parent = *new;
-				new = &parent->rb_right;
-			} else {
-				/* oh, no, still a collision */
-				goto failed;
-			}
-		}
+static ssize_t near_dup_lines_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-		goto add_node;
-	}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob >= PAGE_SIZE / L1_CACHE_BYTES)
+		return -EINVAL;
 
-	/* no tree node found */
-	tree_node = alloc_tree_node(tree_node_listp);
-	if (!tree_node) {
-		printk(KERN_ERR "KSM: memory allocation error!\n");
-		goto failed;
-	} else {
-		tree_node->hash = hash;
-		rb_link_node(&tree_node->node, parent, new);
-		rb_insert_color(&tree_node->node, root_treep);
+	ksm_near_dup_lines = knob;
 
-tree_node_reuse:
-		/* prepare for stable node insertion */
-		parent = NULL;
-		new = &tree_node->sub_root.rb_node;
-	}
+	return count;
+}
+KSM_ATTR(near_dup_lines);
 
-add_node:
-	rb_link_node(&new_node->node, parent, new);
-	rb_insert_color(&new_node->node, &tree_node->sub_root);
-	new_node->tree_node = tree_node;
-	tree_node->count++;
-	return;
+static ssize_t pages_near_dup_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_near_dup_last);
+}
+KSM_ATTR_RO(pages_near_dup);
 
-failed:
-	/* This can only happen when two nodes have collided
-	 * in two levels.
-	 */
-	new_node->tree_node = NULL;
-	return;
+static ssize_t near_dup_lines_total_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_near_dup_lines_last);
 }
+KSM_ATTR_RO(near_dup_lines_total);
 
-static inline void free_all_tree_nodes(struct list_head *list)
+static ssize_t strong_digest_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
 {
-	struct tree_node *node, *tmp;
+	return sprintf(buf, "%u\n", ksm_strong_digest);
+}
 
-	list_for_each_entry_safe(node, tmp, list, all_list) {
-		free_tree_node(node);
+static ssize_t strong_digest_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct crypto_ahash *tfm;
+	unsigned long flags;
+	int err;
+
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
+
+	/* allocated once, it may load the sha1 module */
+	if (flags && !ksm_digest_tfm) {
+		tfm = crypto_alloc_ahash("sha1", 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		if (cmpxchg(&ksm_digest_tfm, NULL, tfm))
+			crypto_free_ahash(tfm);
 	}
+
+	ksm_control_lock();
+	ksm_strong_digest = flags;
+	mutex_unlock(&ksm_thread_mutex);
+
+	return count;
 }
+KSM_ATTR(strong_digest);
 
-/**
- * stable_tree_delta_hash() - Delta hash the stable tree from previous hash
- * strength to the current hash_strength. It re-structures the hole tree.
- */
-static inline void stable_tree_delta_hash(u32 prev_hash_strength)
+static ssize_t digest_compares_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	struct stable_node *node, *tmp;
-	struct rb_root *root_new_treep;
-	struct list_head *new_tree_node_listp;
+	return sprintf(buf, "%lu\n", ksm_digest_compares);
+}
+KSM_ATTR_RO(digest_compares);
 
-	stable_tree_index = (stable_tree_index + 1) % 2;
-	root_new_treep = &root_stable_tree[stable_tree_index];
-	new_tree_node_listp = &stable_tree_node_list[stable_tree_index];
-	*root_new_treep = RB_ROOT;
-	BUG_ON(!list_empty(new_tree_node_listp));
+static ssize_t hwpoison_recovered_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_hwpoison_recovered);
+}
+KSM_ATTR_RO(hwpoison_recovered);
 
-	/*
-	 * we need to be safe, the node could be removed by get_ksm_page()
-	 */
-	list_for_each_entry_safe(node, tmp, &stable_node_list, all_list) {
-		void *addr;
-		struct page *node_page;
-		u32 hash;
+static ssize_t hwpoison_remapped_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_hwpoison_remapped);
+}
+KSM_ATTR_RO(hwpoison_remapped);
 
-		/*
-		 * We are completely re-structuring the stable nodes to a new
-		 * stable tree. We don't want to touch the old tree unlinks and
-		 * old tree_nodes. The old tree_nodes will be freed at once.
-		 */
-		node_page = get_ksm_page(node, 0, 0);
-		if (!node_page)
-			continue;
+static ssize_t unstable_nolock_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_unstable_nolock);
+}
 
-		if (node->tree_node) {
-			hash = node->tree_node->hash;
+static ssize_t unstable_nolock_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-			addr = kmap_atomic(node_page, KM_USER0);
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
 
-			hash = delta_hash(addr, prev_hash_strength,
-					  hash_strength, hash);
-			kunmap_atomic(addr, KM_USER0);
-		} else {
-			/*
-			 *it was not inserted to rbtree due to collision in last
-			 *round scan.
-			 */
-			hash = page_hash(node_page, hash_strength, 0);
-		}
+	ksm_unstable_nolock = flags;
 
-		stable_node_reinsert(node, node_page, root_new_treep,
-				     new_tree_node_listp, hash);
-		put_page(node_page);
-	}
+	return count;
+}
+KSM_ATTR(unstable_nolock);
 
-	root_stable_treep = root_new_treep;
-	free_all_tree_nodes(stable_tree_node_listp);
-	BUG_ON(!list_empty(stable_tree_node_listp));
-	stable_tree_node_listp = new_tree_node_listp;
+static ssize_t unstable_nolock_merges_show(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_unstable_nolock_merges);
 }
+KSM_ATTR_RO(unstable_nolock_merges);
 
-static inline void inc_hash_strength(unsigned long delta)
+static ssize_t compaction_aware_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
 {
-	hash_strength += 1 << delta;
-	if (hash_strength > HASH_STRENGTH_MAX)
-		hash_strength = HASH_STRENGTH_MAX;
+	return sprintf(buf, "%u\n", ksm_compaction_aware);
 }
 
-static inline void dec_hash_strength(unsigned long delta)
+static ssize_t compaction_aware_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
 {
-	unsigned long change = 1 << delta;
+	int err;
+	unsigned long knob;
 
-	if (hash_strength <= change + 1)
-		hash_strength = 1;
-	else
-		hash_strength -= change;
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	ksm_compaction_aware = knob;
+
+	return count;
 }
+KSM_ATTR(compaction_aware);
 
-static inline void inc_hash_strength_delta(void)
+static ssize_t merges_kept_tree_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
 {
-	hash_strength_delta++;
-	if (hash_strength_delta > HASH_STRENGTH_DELTA_MAX)
-		hash_strength_delta = HASH_STRENGTH_DELTA_MAX;
+	return sprintf(buf, "%lu\n", ksm_merges_kept_tree);
 }
+KSM_ATTR_RO(merges_kept_tree);
 
-static inline unsigned long get_current_neg_ratio(void)
+static ssize_t unstable_rounds_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	if (!rshash_pos || rshash_neg > rshash_pos)
-		return 100;
-
-	return div64_u64(100 * rshash_neg , rshash_pos);
+	return sprintf(buf, "%u\n", ksm_unstable_rounds);
 }
 
-static inline u64 get_current_benefit(void)
+static ssize_t unstable_rounds_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	if (rshash_neg > rshash_pos)
-		return 0;
+	int err;
+	unsigned long rounds;
 
-	return div64_u64((rshash_pos - rshash_neg),
-			 ksm_pages_scanned - ksm_pages_scanned_last);
+	err = strict_strtoul(buf, 10, &rounds);
+	if (err || !rounds || rounds > UINT_MAX)
+		return -EINVAL;
+
+	ksm_unstable_rounds = rounds;
+
+	return count;
 }
+KSM_ATTR(unstable_rounds);
 
-static inline int judge_rshash_direction(void)
+static ssize_t unstable_expired_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
 {
-	u64 current_neg_ratio, stable_benefit;
-	u64 current_benefit, delta = 0;
-	int ret;
+	return sprintf(buf, "%lu\n", ksm_unstable_expired);
+}
+KSM_ATTR_RO(unstable_expired);
 
-	current_neg_ratio = get_current_neg_ratio();
+static ssize_t unstable_split_rung_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_unstable_split_rung);
+}
 
-	if (current_neg_ratio == 0) {
-		rshash_neg_cont_zero++;
-		if (rshash_neg_cont_zero > 2)
-			return GO_DOWN;
-		else
-			return STILL;
-	}
-	rshash_neg_cont_zero = 0;
+static ssize_t unstable_split_rung_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
+{
+	int err;
+	unsigned long rung;
 
-	if (current_neg_ratio > 90) {
-		ret = GO_UP;
-		goto out;
-	}
+	err = strict_strtoul(buf, 10, &rung);
+	if (err || rung >= KSM_SCAN_LADDER_MAX)
+		return -EINVAL;
 
-	/* In case the system are still for a long time. */
-	if (ksm_scan_round % 1024 == 3) {
-		ret = OBSCURE;
-		goto out;
+	ksm_control_lock();
+	if (ksm_unstable_split_rung != rung) {
+		ksm_unstable_split_rung = rung;
+		/* the kept entries are in the trees of the old split */
+		ksm_unstable_flush = 1;
 	}
+	mutex_unlock(&ksm_thread_mutex);
 
+	return count;
+}
+KSM_ATTR(unstable_split_rung);
 
-	current_benefit = get_current_benefit();
-	stable_benefit = rshash_state.stable_benefit;
+static ssize_t unstable_cross_hits_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_unstable_cross_hits);
+}
+KSM_ATTR_RO(unstable_cross_hits);
 
-	if (!stable_benefit) {
-		ret = OBSCURE;
-		goto out;
-	}
+static ssize_t use_magazines_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_use_magazines);
+}
 
-	if (current_benefit > stable_benefit)
-		delta = current_benefit - stable_benefit;
-	else if (current_benefit < stable_benefit)
-		delta = stable_benefit - current_benefit;
+static ssize_t use_magazines_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	delta = div64_u64(100 * delta , stable_benefit);
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
-	if (delta > 50) {
-		rshash_cont_obscure++;
-		if (rshash_cont_obscure > 2)
-			return OBSCURE;
-		else
-			return STILL;
-	}
+	ksm_control_lock();
+	ksm_use_magazines = knob;
+	if (!knob)
+		ksm_magazines_drain();
+	mutex_unlock(&ksm_thread_mutex);
 
-out:
-	rshash_cont_obscure = 0;
-	return STILL;
+	return count;
 }
+KSM_ATTR(use_magazines);
 
-/**
- * rshash_adjust() - The main function to control the random sampling state
- * machine for hash strength adapting.
- */
-static inline void rshash_adjust(void)
+static ssize_t magazine_misses_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	unsigned long prev_hash_strength = hash_strength;
+	return sprintf(buf, "%lu\n", ksm_magazine_misses);
+}
+KSM_ATTR_RO(magazine_misses);
 
-	if (ksm_pages_scanned == ksm_pages_scanned_last)
-		return;
+static ssize_t reclaim_policy_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_reclaim_policy);
+}
 
-	switch (rshash_state.state) {
-	case RSHASH_STILL:
-		switch (judge_rshash_direction()) {
-		case GO_UP:
-			if (rshash_state.pre_direct == GO_DOWN)
-				hash_strength_delta = 0;
+static ssize_t reclaim_policy_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long policy;
 
-			inc_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
-			rshash_state.stable_benefit = get_current_benefit();
-			rshash_state.pre_direct = GO_UP;
-			break;
+	err = strict_strtoul(buf, 10, &policy);
+	if (err || policy > KSM_RECLAIM_CHEAP)
+		return -EINVAL;
 
-		case GO_DOWN:
-			if (rshash_state.pre_direct == GO_UP)
-				hash_strength_delta = 0;
+	ksm_reclaim_policy = policy;
 
-			dec_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
-			rshash_state.stable_benefit = get_current_benefit();
-			rshash_state.pre_direct = GO_DOWN;
-			break;
+	return count;
+}
+KSM_ATTR(reclaim_policy);
 
-		case OBSCURE:
-			rshash_state.stable_point = hash_strength;
-			rshash_state.turn_point_down = hash_strength;
-			rshash_state.turn_point_up = hash_strength;
-			rshash_state.turn_benefit_down = get_current_benefit();
-			rshash_state.turn_benefit_up = get_current_benefit();
-			rshash_state.lookup_window_index = 0;
-			rshash_state.state = RSHASH_TRYDOWN;
-			dec_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
+static ssize_t reclaim_share_min_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_reclaim_share_min);
+}
 
-			break;
+static ssize_t reclaim_share_min_store(struct kobject *kobj,
+				       struct kobj_attribute *attr,
+				       const char *buf, size_t count)
+{
+	int err;
+	unsigned long share;
 
-		case STILL:
-			break;
-		default:
-			BUG();
-		}
-		break;
+	err = strict_strtoul(buf, 10, &share);
+	if (err || share > UINT_MAX)
+		return -EINVAL;
 
-	case RSHASH_TRYDOWN:
-		if (rshash_state.lookup_window_index++ % 5 == 0)
-			rshash_state.below_count = 0;
+	ksm_reclaim_share_min = share;
 
-		if (get_current_benefit() < rshash_state.stable_benefit)
-			rshash_state.below_count++;
-		else if (get_current_benefit() >
-			 rshash_state.turn_benefit_down) {
-			rshash_state.turn_point_down = hash_strength;
-			rshash_state.turn_benefit_down = get_current_benefit();
-		}
+	return count;
+}
+KSM_ATTR(reclaim_share_min);
 
-		if (rshash_state.below_count >= 3 ||
-		    judge_rshash_direction() == GO_UP) {
-			hash_strength = rshash_state.stable_point;
-			hash_strength_delta = 0;
-			inc_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
-			rshash_state.lookup_window_index = 0;
-			rshash_state.state = RSHASH_TRYUP;
-			hash_strength_delta = 0;
-		} else {
-			dec_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
-		}
-		break;
+static ssize_t reclaim_protected_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_reclaim_protected);
+}
+KSM_ATTR_RO(reclaim_protected);
 
-	case RSHASH_TRYUP:
-		if (rshash_state.lookup_window_index++ % 5 == 0)
-			rshash_state.below_count = 0;
+static ssize_t reclaim_cheap_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_reclaim_cheap);
+}
+KSM_ATTR_RO(reclaim_cheap);
 
-		if (get_current_benefit() < rshash_state.stable_benefit)
-			rshash_state.below_count++;
-		else if (get_current_benefit() > rshash_state.turn_benefit_up) {
-			rshash_state.turn_point_up = hash_strength;
-			rshash_state.turn_benefit_up = get_current_benefit();
-		}
+static ssize_t remerge_rounds_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_remerge_rounds);
+}
 
-		if (rshash_state.below_count >= 3 ||
-		    judge_rshash_direction() == GO_DOWN) {
-			hash_strength = rshash_state.turn_benefit_up >
-				rshash_state.turn_benefit_down ?
-				rshash_state.turn_point_up :
-				rshash_state.turn_point_down;
+static ssize_t remerge_rounds_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int err;
+	unsigned long rounds;
 
-			rshash_state.state = RSHASH_PRE_STILL;
-		} else {
-			inc_hash_strength(hash_strength_delta);
-			inc_hash_strength_delta();
-		}
+	err = strict_strtoul(buf, 10, &rounds);
+	if (err || rounds > UINT_MAX)
+		return -EINVAL;
 
-		break;
+	ksm_remerge_rounds = rounds;
 
-	case RSHASH_NEW:
-	case RSHASH_PRE_STILL:
-		rshash_state.stable_benefit = get_current_benefit();
-		rshash_state.state = RSHASH_STILL;
-		hash_strength_delta = 0;
-		break;
-	default:
-		BUG();
-	}
+	return count;
+}
+KSM_ATTR(remerge_rounds);
 
-	rshash_neg = rshash_pos = 0;
+static ssize_t remerges_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_remerges);
+}
+KSM_ATTR_RO(remerges);
 
-	if (prev_hash_strength != hash_strength)
-		stable_tree_delta_hash(prev_hash_strength);
+static ssize_t region_pages_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_region_pages);
 }
 
-static void ksm_intertab_clear(struct vma_slot *slot)
+static ssize_t region_pages_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
 {
-	int i;
-	unsigned index;
+	int err;
+	unsigned long pages;
 
-	for (i = 0; i <= slot->ksm_index; i++) {
-		index = intertab_vma_offset(slot->ksm_index, i);
-		ksm_inter_vma_table[index] = 0;
-	}
+	err = strict_strtoul(buf, 10, &pages);
+	if (err || !pages || pages % KSM_REGION_PAGES_MIN)
+		return -EINVAL;
 
-	for (i = slot->ksm_index + 1; i < ksm_vma_table_index_end; i++) {
-		index = intertab_vma_offset(slot->ksm_index, i);
-		ksm_inter_vma_table[index] = 0;
-	}
+	ksm_region_pages = pages;
+
+	return count;
 }
+KSM_ATTR(region_pages);
 
+static ssize_t slot_min_age_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_slot_min_age);
+}
 
-/**
- * round_update_ladder() - The main function to do update of all the
- * adjustments whenever a scan round is finished.
- */
-static void round_update_ladder(void)
+static ssize_t slot_min_age_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
 {
-	int i;
-	struct vma_slot *slot, *tmp_slot;
-	unsigned long dedup_ratio_max = 0, dedup_ratio_mean = 0;
-	unsigned long threshold;
-	struct list_head tmp_list;
+	int err;
+	unsigned long msecs;
 
-	for (i = 0; i < ksm_vma_table_index_end; i++) {
-		slot = ksm_vma_table[i];
+	err = strict_strtoul(buf, 10, &msecs);
+	if (err || msecs > UINT_MAX)
+		return -EINVAL;
 
-		if (slot) {
-			slot->dedup_ratio = cal_dedup_ratio(slot);
-			if (dedup_ratio_max < slot->dedup_ratio)
-				dedup_ratio_max = slot->dedup_ratio;
-			dedup_ratio_mean += slot->dedup_ratio;
-		}
-	}
+	/* the vmas left without a slot get theirs on the next batch */
+	if (!msecs && ksm_slot_min_age)
+		ksm_discover_pending = 1;
+	ksm_slot_min_age = msecs;
 
-	dedup_ratio_mean /= ksm_vma_slot_num;
-	threshold = dedup_ratio_mean;
+	return count;
+}
+KSM_ATTR(slot_min_age);
 
-	for (i = 0; i < ksm_vma_table_index_end; i++) {
-		slot = ksm_vma_table[i];
+static ssize_t slots_discovered_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_slots_discovered);
+}
+KSM_ATTR_RO(slots_discovered);
 
-		if (slot) {
-			if (slot->dedup_ratio  &&
-			    slot->dedup_ratio >= threshold) {
-				vma_rung_up(slot);
-			} else {
-				vma_rung_down(slot);
-			}
+static ssize_t fork_inherit_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_fork_inherit);
+}
 
-			ksm_intertab_clear(slot);
-			ksm_vma_table_num--;
-			ksm_vma_table[i] = NULL;
-			slot->ksm_index = -1;
-			slot->slot_scanned = 0;
-			slot->dedup_ratio = 0;
-		}
-	}
+static ssize_t fork_inherit_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-	INIT_LIST_HEAD(&tmp_list);
-	for (i = 0; i < ksm_scan_ladder_size; i++) {
-		list_for_each_entry_safe(slot, tmp_slot,
-					 &ksm_scan_ladder[i].vma_list,
-					 ksm_list) {
-			/*
-			 * The slots were scanned but not in inter_tab, their
-			 * dedup must be 0.
-			 */
-			if (slot->slot_scanned) {
-				BUG_ON(slot->dedup_ratio != 0);
-				vma_rung_down(slot);
-			}
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
 
-			slot->dedup_ratio = 0;
-		}
-	}
+	ksm_fork_inherit = flags;
 
-	BUG_ON(ksm_vma_table_num != 0);
-	ksm_vma_table_index_end = 0;
+	return count;
+}
+KSM_ATTR(fork_inherit);
 
-	for (i = 0; i < ksm_scan_ladder_size; i++) {
-		ksm_scan_ladder[i].round_finished = 0;
+static ssize_t pages_fork_skipped_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_fork_skipped);
+}
+KSM_ATTR_RO(pages_fork_skipped);
 
-		list_for_each_entry(slot, &ksm_scan_ladder[i].vma_list,
-				    ksm_list) {
-			slot->last_scanned = slot->pages_scanned;
-			slot->slot_scanned = 0;
-			slot->pages_cowed = 0;
-			slot->pages_merged = 0;
-			if (slot->fully_scanned) {
-				slot->fully_scanned = 0;
-				ksm_scan_ladder[i].fully_scanned_slots--;
-			}
-			BUG_ON(slot->ksm_index != -1);
-		}
+static ssize_t burst_min_pages_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_burst_min_pages);
+}
 
-		BUG_ON(ksm_scan_ladder[i].fully_scanned_slots);
-	}
+static ssize_t burst_min_pages_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned long pages;
 
-	rshash_adjust();
+	err = strict_strtoul(buf, 10, &pages);
+	if (err)
+		return -EINVAL;
 
-	ksm_pages_scanned_last = ksm_pages_scanned;
+	ksm_burst_min_pages = pages;
+
+	return count;
 }
+KSM_ATTR(burst_min_pages);
 
-static inline unsigned int ksm_pages_to_scan(unsigned int batch_pages)
+static ssize_t burst_max_pages_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	return totalram_pages * batch_pages / 1000000;
+	return sprintf(buf, "%lu\n", ksm_burst_max_pages);
 }
 
-static inline void cal_ladder_pages_to_scan(unsigned int num)
+static ssize_t burst_max_pages_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
 {
-	int i;
+	int err;
+	unsigned long pages;
 
-	for (i = 0; i < ksm_scan_ladder_size; i++) {
-		ksm_scan_ladder[i].pages_to_scan = num
-			* ksm_scan_ladder[i].scan_ratio / KSM_SCAN_RATIO_MAX;
-	}
-	ksm_scan_ladder[0].pages_to_scan /= 16;
-	ksm_scan_ladder[1].pages_to_scan /= 4;
+	err = strict_strtoul(buf, 10, &pages);
+	if (err)
+		return -EINVAL;
+
+	/* the slots already in their pass finish it */
+	ksm_burst_max_pages = pages;
+
+	return count;
 }
+KSM_ATTR(burst_max_pages);
 
-static inline void ksm_del_vma_slot(struct vma_slot *slot)
+static ssize_t burst_pages_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	int i, j;
-	struct rmap_list_entry *entry;
+	return sprintf(buf, "%lu\n", ksm_burst_pages);
+}
+KSM_ATTR_RO(burst_pages);
 
-	/* mutex lock contention maybe intensive, other idea ? */
-	BUG_ON(list_empty(&slot->ksm_list) || !slot->rung);
+static ssize_t burst_slots_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_burst_slots);
+}
+KSM_ATTR_RO(burst_slots);
 
-	if (slot->rung->current_scan == &slot->ksm_list)
-		slot->rung->current_scan = slot->rung->current_scan->next;
+static ssize_t swap_reshare_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_swap_reshare);
+}
 
-	list_del_init(&slot->ksm_list);
-	slot->rung->vma_num--;
-	if (slot->fully_scanned)
-		slot->rung->fully_scanned_slots--;
+static ssize_t swap_reshare_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-	if (slot->rung->current_scan == &slot->rung->vma_list) {
-		/* This rung finishes a round */
-		slot->rung->round_finished = 1;
-		slot->rung->current_scan = slot->rung->vma_list.next;
-		BUG_ON(slot->rung->current_scan == &slot->rung->vma_list
-		       && !list_empty(&slot->rung->vma_list));
-	}
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
 
-	for (i = 0; i < ksm_vma_table_index_end; i++) {
-		if ((slot == ksm_vma_table[i])) {
-			ksm_intertab_clear(slot);
-			ksm_vma_table_num--;
-			ksm_vma_table[i] = NULL;
-			if (i == ksm_vma_table_index_end - 1)
-				ksm_vma_table_index_end--;
-			break;
-		}
-	}
+	ksm_swap_reshare = flags;
 
-	if (!slot->rmap_list_pool)
-		goto out;
+	return count;
+}
+KSM_ATTR(swap_reshare);
 
-	for (i = 0; i < slot->pool_size; i++) {
-		void *addr;
+static ssize_t swap_reshare_stats_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "parked %lu reshared %lu\n",
+		       ksm_swap_nr_parked, ksm_pages_swap_reshared);
+}
+KSM_ATTR_RO(swap_reshare_stats);
 
-		if (!slot->rmap_list_pool[i])
-			continue;
+static ssize_t rmap_sample_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_rmap_sample);
+}
 
-		addr = kmap(slot->rmap_list_pool[i]);
-		BUG_ON(!addr);
-		for (j = 0; j < PAGE_SIZE / sizeof(*entry); j++) {
-			entry = (struct rmap_list_entry *)addr + j;
-			if (is_addr(entry->addr))
-				continue;
-			if (!entry->item)
-				continue;
+static ssize_t rmap_sample_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int err;
+	unsigned long items;
 
-			remove_rmap_item_from_tree(entry->item);
-			free_rmap_item(entry->item);
-			slot->pool_counts[i]--;
-		}
-		BUG_ON(slot->pool_counts[i]);
-		kunmap(slot->rmap_list_pool[i]);
-		__free_page(slot->rmap_list_pool[i]);
-	}
-	kfree(slot->rmap_list_pool);
-	kfree(slot->pool_counts);
+	err = strict_strtoul(buf, 10, &items);
+	if (err || items > UINT_MAX)
+		return -EINVAL;
 
-out:
-	slot->rung = NULL;
-	free_vma_slot(slot);
-	BUG_ON(!ksm_vma_slot_num);
-	ksm_vma_slot_num--;
-}
+	ksm_rmap_sample = items;
 
+	return count;
+}
+KSM_ATTR(rmap_sample);
 
-static inline void cleanup_vma_slots(void)
+static ssize_t rmap_walks_sampled_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
 {
-	struct vma_slot *slot;
-
-	spin_lock(&vma_slot_list_lock);
-	while (!list_empty(&vma_slot_del)) {
-		slot = list_entry(vma_slot_del.next,
-				  struct vma_slot, slot_list);
-		list_del(&slot->slot_list);
-		spin_unlock(&vma_slot_list_lock);
-		ksm_del_vma_slot(slot);
-		spin_lock(&vma_slot_list_lock);
-	}
-	spin_unlock(&vma_slot_list_lock);
+	return sprintf(buf, "%lu\n", ksm_rmap_walks_sampled);
 }
+KSM_ATTR_RO(rmap_walks_sampled);
 
-static inline int rung_fully_scanned(struct scan_rung *rung)
+static ssize_t max_page_sharing_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
 {
-	return (rung->fully_scanned_slots == rung->vma_num &&
-		rung->fully_scanned_slots);
+	return sprintf(buf, "%u\n", ksm_max_page_sharing);
 }
 
-/**
- * ksm_do_scan()  - the main worker function.
- */
-static void ksm_do_scan(void)
+static ssize_t max_page_sharing_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
 {
-	struct vma_slot *slot, *iter;
-	struct list_head *next_scan, *iter_head;
-	struct mm_struct *busy_mm;
-	unsigned char round_finished, all_rungs_emtpy;
-	int i, err;
-	unsigned long rest_pages;
-
-	might_sleep();
-
-	rest_pages = 0;
-repeat_all:
-	for (i = ksm_scan_ladder_size - 1; i >= 0; i--) {
-		struct scan_rung *rung = &ksm_scan_ladder[i];
-
-		if (!rung->pages_to_scan)
-			continue;
+	int err;
+	unsigned long sharing;
 
-		if (list_empty(&rung->vma_list)) {
-			rung->pages_to_scan = 0;
-			continue;
-		}
+	err = strict_strtoul(buf, 10, &sharing);
+	if (err || sharing == 1 || sharing > UINT_MAX)
+		return -EINVAL;
 
-		/*
-		 * if a higher rung is fully scanned, its rest pages should be
-		 * propagated to the lower rungs. This can prevent the higher
-		 * rung from waiting a long time while it still has its
-		 * pages_to_scan quota.
-		 *
-		 */
-		if (rung_fully_scanned(rung)) {
-			rest_pages += rung->pages_to_scan;
-			rung->pages_to_scan = 0;
-			continue;
-		}
+	ksm_max_page_sharing = sharing;
 
-		rung->pages_to_scan += rest_pages;
-		rest_pages = 0;
-		while (rung->pages_to_scan && likely(!freezing(current))) {
-			rung->pages_to_scan--;
+	return count;
+}
+KSM_ATTR(max_page_sharing);
 
-cleanup:
-			cleanup_vma_slots();
+static ssize_t stable_node_dups_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_stable_node_dups);
+}
+KSM_ATTR_RO(stable_node_dups);
 
-			if (list_empty(&rung->vma_list))
-				break;
+static ssize_t cow_heat_threshold_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_cow_heat_threshold);
+}
 
-rescan:
-			BUG_ON(rung->current_scan == &rung->vma_list &&
-			       !list_empty(&rung->vma_list));
+static ssize_t cow_heat_threshold_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-			slot = list_entry(rung->current_scan,
-					 struct vma_slot, ksm_list);
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > KSM_COW_HEAT_MAX)
+		return -EINVAL;
 
-			err = try_down_read_slot_mmap_sem(slot);
-			if (err == -ENOENT)
-				goto cleanup;
+	ksm_cow_heat_threshold = flags;
 
-			busy_mm = slot->mm;
+	return count;
+}
+KSM_ATTR(cow_heat_threshold);
 
-busy:
-			if (err == -EBUSY) {
-				/* skip other vmas on the same mm */
-				iter = slot;
-				iter_head = slot->ksm_list.next;
+static ssize_t cow_unmerge_threshold_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_cow_unmerge_threshold);
+}
 
-				while (iter_head != &rung->vma_list) {
-					iter = list_entry(iter_head,
-							  struct vma_slot,
-							  ksm_list);
-					if (iter->vma->vm_mm != busy_mm)
-						break;
-					iter_head = iter_head->next;
-				}
+static ssize_t cow_unmerge_threshold_store(struct kobject *kobj,
+					   struct kobj_attribute *attr,
+					   const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-				if (iter->vma->vm_mm != busy_mm) {
-					rung->current_scan = &iter->ksm_list;
-					goto rescan;
-				} else {
-					/* This is the only vma on this rung */
-					break;
-				}
-			}
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > KSM_COW_HEAT_MAX)
+		return -EINVAL;
 
-			BUG_ON(!vma_can_enter(slot->vma));
-			if (ksm_test_exit(slot->vma->vm_mm)) {
-				busy_mm = slot->vma->vm_mm;
-				up_read(&slot->vma->vm_mm->mmap_sem);
-				err = -EBUSY;
-				goto busy;
-			}
+	ksm_cow_unmerge_threshold = knob;
 
+	return count;
+}
+KSM_ATTR(cow_unmerge_threshold);
 
-			/* Ok, we have take the mmap_sem, ready to scan */
-			if (!slot->fully_scanned)
-				scan_vma_one_page(slot);
-			up_read(&slot->vma->vm_mm->mmap_sem);
+static ssize_t cow_unmerge_stats_show(struct kobject *kobj,
+				      struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu %lu\n", ksm_cow_unmerge_ranges,
+		       ksm_cow_unmerge_dropped);
+}
+KSM_ATTR_RO(cow_unmerge_stats);
 
-			if ((slot->pages_scanned &&
-			     slot->pages_scanned % slot->pages_to_scan == 0)
-			    || slot->fully_scanned) {
-				next_scan = rung->current_scan->next;
-				if (next_scan == &rung->vma_list) {
-					/*
-					 * All the slots in this rung
-					 * have been traveled in this
-					 * round.
-					 */
-					rung->round_finished = 1;
-					rung->current_scan =
-						rung->vma_list.next;
-					if (rung_fully_scanned(rung)) {
-						/*
-						 * All the pages in all slots
-						 * have been scanned.
-						 */
-						rest_pages +=
-							rung->pages_to_scan;
-						rung->pages_to_scan = 0;
-						break;
-					}
-				} else {
-					rung->current_scan = next_scan;
-				}
-			}
+static ssize_t pages_cow_hot_skipped_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_cow_hot_skipped);
+}
+KSM_ATTR_RO(pages_cow_hot_skipped);
 
-			cond_resched();
-		}
-	}
+static ssize_t guest_dirty_hint_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_guest_dirty_hint);
+}
 
-	round_finished = 1;
-	all_rungs_emtpy = 1;
-	for (i = 0; i < ksm_scan_ladder_size; i++) {
-		struct scan_rung *rung = &ksm_scan_ladder[i];
+static ssize_t guest_dirty_hint_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	int err;
+	unsigned long flags;
 
-		if (!list_empty(&rung->vma_list)) {
-			all_rungs_emtpy = 0;
-			if (!rung->round_finished)
-				round_finished = 0;
-			break;
-		}
-	}
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
 
-	if (all_rungs_emtpy)
-		round_finished = 0;
+	ksm_guest_dirty_hint = flags;
 
-	cleanup_vma_slots();
+	return count;
+}
+KSM_ATTR(guest_dirty_hint);
 
-	if (round_finished) {
-		round_update_ladder();
+static ssize_t guest_dirty_hinted_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_guest_dirty_hinted);
+}
+KSM_ATTR_RO(guest_dirty_hinted);
 
-		/*
-		 * A number of pages can hang around indefinitely on per-cpu
-		 * pagevecs, raised page count preventing write_protect_page
-		 * from merging them.  Though it doesn't really matter much,
-		 * it is puzzling to see some stuck in pages_volatile until
-		 * other activity jostles them out, and they also prevented
-		 * LTP's KSM test from succeeding deterministically; so drain
-		 * them here (here rather than on entry to ksm_do_scan(),
-		 * so we don't IPI too often when pages_to_scan is set low).
-		 */
-		lru_add_drain_all();
+#ifdef CONFIG_NUMA
+static ssize_t merge_across_nodes_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_merge_across_nodes);
+}
 
-		/* sync with ksm_remove_vma for rb_erase */
-		ksm_scan_round++;
-		root_unstable_tree = RB_ROOT;
-		free_all_tree_nodes(&unstable_tree_node_list);
-	}
+static ssize_t merge_across_nodes_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
 
-	for (i = 0; i < ksm_scan_ladder_size; i++) {
-		struct scan_rung *rung = &ksm_scan_ladder[i];
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
 
+	ksm_control_lock();
+	if (ksm_merge_across_nodes != knob) {
+		ksm_merge_across_nodes = knob;
 		/*
-		 * Before we can go sleep, we should make sure that all the
-		 * pages_to_scan quota for this scan has been finished
+		 * Re-distribute the stable nodes to the trees of the new
+		 * layout. The unstable trees are rebuilt at the end of this
+		 * round, their tree_nodes remember which tree they are
+		 * linked in.
 		 */
-		if (!list_empty(&rung->vma_list) && rung->pages_to_scan)
-			goto repeat_all;
+		ksm_unstable_flush = 1;
+		stable_tree_delta_hash(hash_strength);
+		stable_tree_migrate(ULONG_MAX, hash_strength);
 	}
+	mutex_unlock(&ksm_thread_mutex);
 
-	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+	return count;
 }
+KSM_ATTR(merge_across_nodes);
 
-static int ksmd_should_run(void)
+static ssize_t merge_cold_across_nodes_show(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    char *buf)
 {
-	return ksm_run & KSM_RUN_MERGE;
+	return sprintf(buf, "%u\n", ksm_merge_cold_across_nodes);
 }
 
-#define __round_mask(x, y) ((__typeof__(x))((y)-1))
-#define round_up(x, y) ((((x)-1) | __round_mask(x, y))+1)
+static ssize_t merge_cold_across_nodes_store(struct kobject *kobj,
+					     struct kobj_attribute *attr,
+					     const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	ksm_merge_cold_across_nodes = knob;
+
+	return count;
+}
+KSM_ATTR(merge_cold_across_nodes);
+#endif /* CONFIG_NUMA */
 
-static inline unsigned long vma_pool_size(struct vm_area_struct *vma)
+static ssize_t pages_shared_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
 {
-	return round_up(sizeof(struct rmap_list_entry) * vma_pages(vma),
-			PAGE_SIZE) >> PAGE_SHIFT;
+	return sprintf(buf, "%lu\n", ksm_pages_shared);
 }
+KSM_ATTR_RO(pages_shared);
 
-/**
- *
- *
- *
- * @param slot
- *
- * @return int , 1 on success, 0 on failure
- */
-static int ksm_vma_enter(struct vma_slot *slot)
+static ssize_t pages_sharing_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
 {
-	struct scan_rung *rung;
-	unsigned long pages_to_scan, pool_size;
+	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+}
+KSM_ATTR_RO(pages_sharing);
 
-	BUG_ON(slot->pages != vma_pages(slot->vma));
-	rung = &ksm_scan_ladder[0];
+static ssize_t pages_unshared_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+}
+KSM_ATTR_RO(pages_unshared);
 
-	pages_to_scan = get_vma_random_scan_num(slot, rung->scan_ratio);
-	if (pages_to_scan) {
-		if (list_empty(&rung->vma_list))
-			rung->current_scan = &slot->ksm_list;
-		BUG_ON(!list_empty(&slot->ksm_list));
+static ssize_t full_scans_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", ksm_scan_round);
+}
+KSM_ATTR_RO(full_scans);
 
-		list_add(&slot->ksm_list, &rung->vma_list);
-		slot->rung = rung;
-		slot->pages_to_scan = pages_to_scan;
-		slot->rung->vma_num++;
-		BUG_ON(PAGE_SIZE % sizeof(struct rmap_list_entry) != 0);
+/*
+ * rung_round_progress() - the pages of their round quota the slots of @rung
+ * have scanned into @done, the ones still to scan into @left.
+ */
+static void rung_round_progress(struct scan_rung *rung, unsigned long *done,
+				unsigned long *left)
+{
+	struct vma_slot *slot;
+	unsigned long scanned;
+
+	*done = *left = 0;
+	list_for_each_entry(slot, &rung->vma_list, ksm_list) {
+		scanned = slot_round_scanned(slot);
+		if (rung->round_finished || slot->fully_scanned ||
+		    scanned > slot->pages_to_scan)
+			scanned = slot->pages_to_scan;
+		*done += scanned;
+		*left += slot->pages_to_scan - scanned;
+	}
+}
 
-		pool_size = vma_pool_size(slot->vma);
+static ssize_t round_elapsed_msecs_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", jiffies_to_msecs(jiffies -
+						     ksm_round_start_j));
+}
+KSM_ATTR_RO(round_elapsed_msecs);
 
-		slot->rmap_list_pool = kzalloc(sizeof(struct page *) *
-					       pool_size, GFP_NOWAIT);
-		slot->pool_counts = kzalloc(sizeof(unsigned long) * pool_size,
-					    GFP_NOWAIT);
-		slot->pool_size = pool_size;
-		if (!slot->rmap_list_pool)
-			goto failed;
+/*
+ * The round ends with its slowest rung: each rung is projected at the pace
+ * it had since the round started. -1 until each unfinished rung has begun.
+ */
+static ssize_t round_eta_msecs_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	unsigned long elapsed = jiffies - ksm_round_start_j;
+	unsigned long done, left, eta = 0;
+	int i, unknown = 0;
 
-		if (!slot->pool_counts) {
-			kfree(slot->rmap_list_pool);
-			goto failed;
+	ksm_control_lock();
+	for (i = 0; i < ksm_scan_ladder_size; i++) {
+		rung_round_progress(&ksm_scan_ladder[i], &done, &left);
+		if (!left)
+			continue;
+		if (!done) {
+			unknown = 1;
+			break;
 		}
-
-		BUG_ON(rung->current_scan == &rung->vma_list &&
-		       !list_empty(&rung->vma_list));
-
-		ksm_vma_slot_num++;
-		BUG_ON(!ksm_vma_slot_num);
-		return 1;
+		eta = max_t(unsigned long, eta,
+			    div64_u64((u64)elapsed * left, done));
 	}
+	mutex_unlock(&ksm_thread_mutex);
 
-failed:
-	return 0;
+	if (unknown)
+		return sprintf(buf, "-1\n");
+	return sprintf(buf, "%u\n", jiffies_to_msecs(eta));
 }
+KSM_ATTR_RO(round_eta_msecs);
 
-
-static void ksm_enter_all_slots(void)
+static ssize_t pages_resident_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
 {
 	struct vma_slot *slot;
-	int added;
+	unsigned long pages = 0;
+	int i;
 
-	spin_lock(&vma_slot_list_lock);
-	while (!list_empty(&vma_slot_new)) {
-		slot = list_entry(vma_slot_new.next,
-				  struct vma_slot, slot_list);
-		/**
-		 * slots are sorted by ctime_j, if one found to be too
-		 * young, just stop scanning the rest ones.
-		 */
-		/*
+	ksm_control_lock();
+	for (i = 0; i < ksm_scan_ladder_size; i++)
+		list_for_each_entry(slot, &ksm_scan_ladder[i].vma_list,
+				    ksm_list)
+			pages += slot_resident(slot);
+	mutex_unlock(&ksm_thread_mutex);
 
-			if (time_before(jiffies, slot->ctime_j +
-					msecs_to_jiffies(1000))) {
-				spin_unlock(&vma_slot_list_lock);
-				return;
-			}
-		*/
+	return sprintf(buf, "%lu\n", pages);
+}
+KSM_ATTR_RO(pages_resident);
 
-		list_del_init(&slot->slot_list);
-		added = 0;
-		if (vma_can_enter(slot->vma))
-			added = ksm_vma_enter(slot);
+static ssize_t pages_scanned_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+       return sprintf(buf, "%llu\n", ksm_pages_scanned);
+}
+KSM_ATTR_RO(pages_scanned);
 
-		if (!added) {
-			/* Put back to new list to be del by its creator */
-			slot->ctime_j = jiffies;
-			list_del(&slot->slot_list);
-			list_add_tail(&slot->slot_list, &vma_slot_noadd);
-		}
-		spin_unlock(&vma_slot_list_lock);
-		cond_resched();
-		spin_lock(&vma_slot_list_lock);
-	}
-	spin_unlock(&vma_slot_list_lock);
+static ssize_t hash_strength_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", hash_strength);
 }
+KSM_ATTR_RO(hash_strength);
 
-static int ksm_scan_thread(void *nothing)
+static ssize_t hash_probe_rate_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
 {
-	set_freezable();
-	set_user_nice(current, 5);
+	return sprintf(buf, "%u\n", ksm_hash_probe_rate);
+}
 
-	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
-		if (ksmd_should_run()) {
-			ksm_enter_all_slots();
-			ksm_do_scan();
-		}
-		mutex_unlock(&ksm_thread_mutex);
+static ssize_t hash_probe_rate_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int err;
+	unsigned long rate;
 
-		try_to_freeze();
+	err = strict_strtoul(buf, 10, &rate);
+	if (err || rate > UINT_MAX)
+		return -EINVAL;
 
-		if (ksmd_should_run()) {
-			schedule_timeout_interruptible(ksm_sleep_jiffies);
-			ksm_sleep_times++;
-		} else {
-			wait_event_freezable(ksm_thread_wait,
-				ksmd_should_run() || kthread_should_stop());
-		}
-	}
-	return 0;
+	ksm_control_lock();
+	ksm_hash_probe_rate = rate;
+	ksm_probe_countdown = 0;
+	hash_probe_reset();
+	mutex_unlock(&ksm_thread_mutex);
+
+	return count;
 }
+KSM_ATTR(hash_probe_rate);
 
-struct page *ksm_does_need_to_copy(struct page *page,
-			struct vm_area_struct *vma, unsigned long address)
+static ssize_t sketch_size_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	struct page *new_page;
+	return sprintf(buf, "%u\n", ksm_sketch_size);
+}
 
-	new_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
-	if (new_page) {
-		copy_user_highpage(new_page, page, address, vma);
+/* the sketches restart from scratch at their new size */
+static ssize_t sketch_size_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct vma_slot *slot;
+	unsigned long size;
+	int err, i;
 
-		SetPageDirty(new_page);
-		__SetPageUptodate(new_page);
-		SetPageSwapBacked(new_page);
-		__set_page_locked(new_page);
+	err = strict_strtoul(buf, 10, &size);
+	if (err || size > KSM_SKETCH_MAX)
+		return -EINVAL;
 
-		if (page_evictable(new_page, vma))
-			lru_cache_add_lru(new_page, LRU_ACTIVE_ANON);
-		else
-			add_page_to_unevictable_list(new_page);
+	ksm_control_lock();
+	if (size != ksm_sketch_size) {
+		ksm_sketch_size = size;
+		for (i = 0; i < ksm_scan_ladder_size; i++)
+			list_for_each_entry(slot, &ksm_scan_ladder[i].vma_list,
+					    ksm_list)
+				slot->sketch_nr = 0;
 	}
+	mutex_unlock(&ksm_thread_mutex);
 
-	return new_page;
+	return count;
 }
+KSM_ATTR(sketch_size);
 
-int page_referenced_ksm(struct page *page, struct mem_cgroup *memcg,
-			unsigned long *vm_flags)
+static ssize_t seed_hits_show(struct kobject *kobj,
+			      struct kobj_attribute *attr, char *buf)
 {
-	struct stable_node *stable_node;
-	struct node_vma *node_vma;
-	struct rmap_item *rmap_item;
-	struct hlist_node *hlist, *rmap_hlist;
-	unsigned int mapcount = page_mapcount(page);
-	int referenced = 0;
-	int search_new_forks = 0;
-	unsigned long address;
+	return sprintf(buf, "%lu\n", ksm_seed_hits);
+}
+KSM_ATTR_RO(seed_hits);
 
-	VM_BUG_ON(!PageKsm(page));
-	VM_BUG_ON(!PageLocked(page));
+static ssize_t hash_probe_moves_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_hash_probe_moves);
+}
+KSM_ATTR_RO(hash_probe_moves);
 
-	stable_node = page_stable_node(page);
-	if (!stable_node)
-		return 0;
+static ssize_t sleep_times_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", ksm_sleep_times);
+}
+KSM_ATTR_RO(sleep_times);
 
 
-again:
-	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
-		hlist_for_each_entry(rmap_item, rmap_hlist,
-				     &node_vma->rmap_hlist, hlist) {
-			struct anon_vma *anon_vma = rmap_item->anon_vma;
-			struct anon_vma_chain *vmac;
-			struct vm_area_struct *vma;
+static struct attribute *ksm_attrs[] = {
+	&sleep_millisecs_attr.attr,
+	&cpu_governor_attr.attr,
+	&max_cpu_percentage_attr.attr,
+	&target_merge_rate_attr.attr,
+	&governor_batch_pages_attr.attr,
+	&pressure_boost_attr.attr,
+	&pressure_boosts_attr.attr,
+	&shrinker_freed_attr.attr,
+	&resched_max_usecs_attr.attr,
+	&idle_scan_attr.attr,
+	&idle_scan_threshold_attr.attr,
+	&idle_scan_max_delay_attr.attr,
+	&scan_batch_pages_attr.attr,
+	&scan_threads_attr.attr,
+	&hash_batch_attr.attr,
+	&mmap_sem_run_attr.attr,
+	&use_zero_pages_attr.attr,
+	&shmem_zero_attr.attr,
+	&shmem_zero_dropped_attr.attr,
+	&file_dup_attr.attr,
+	&file_pages_seen_attr.attr,
+	&file_pages_duplicate_attr.attr,
+	&swap_dedup_attr.attr,
+	&swap_dedup_pages_attr.attr,
+	&pages_zero_merged_attr.attr,
+	&pages_zero_hinted_attr.attr,
+	&hash_cache_attr.attr,
+	&hash_cache_hits_attr.attr,
+	&batch_wrprotect_attr.attr,
+	&scan_window_attr.attr,
+	&pages_hole_skipped_attr.attr,
+	&batch_wrprotect_stats_attr.attr,
+	&hot_defer_rounds_attr.attr,
+	&pages_hot_deferred_attr.attr,
+	&pin_backoff_attr.attr,
+	&pin_stats_attr.attr,
+	&khugepaged_hold_attr.attr,
+	&quiesced_fast_attr.attr,
+	&dedup_decay_attr.attr,
+	&rung_hysteresis_attr.attr,
+	&rung_jump_max_attr.attr,
+	&tree_index_attr.attr,
+	&stable_filter_attr.attr,
+	&stable_filter_stats_attr.attr,
+	&metadata_bytes_attr.attr,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	&thp_split_threshold_attr.attr,
+	&thp_split_avoided_attr.attr,
+#endif
+	&run_attr.attr,
+	&estimate_pages_sharing_attr.attr,
+	&pages_shared_attr.attr,
+	&pages_sharing_attr.attr,
+	&pages_unshared_attr.attr,
+	&full_scans_attr.attr,
+	&round_elapsed_msecs_attr.attr,
+	&round_eta_msecs_attr.attr,
+	&pages_resident_attr.attr,
+	&min_scan_ratio_attr.attr,
+	&pages_scanned_attr.attr,
+	&hash_strength_attr.attr,
+	&hash_probe_rate_attr.attr,
+	&sketch_size_attr.attr,
+	&seed_hits_attr.attr,
+	&hash_probe_moves_attr.attr,
+	&sleep_times_attr.attr,
+	&thrash_threshold_attr.attr,
+	&strong_hash_ratio_attr.attr,
+	&strong_hash_slots_attr.attr,
+	&strong_hash_rejected_attr.attr,
+	&hash_max_pages_attr.attr,
+	&subtree_lookups_attr.attr,
+	&near_dup_lines_attr.attr,
+	&pages_near_dup_attr.attr,
+	&near_dup_lines_total_attr.attr,
+	&strong_digest_attr.attr,
+	&digest_compares_attr.attr,
+	&hwpoison_recovered_attr.attr,
+	&hwpoison_remapped_attr.attr,
+	&unstable_nolock_attr.attr,
+	&unstable_nolock_merges_attr.attr,
+	&compaction_aware_attr.attr,
+	&merges_kept_tree_attr.attr,
+	&unstable_rounds_attr.attr,
+	&unstable_expired_attr.attr,
+	&unstable_split_rung_attr.attr,
+	&unstable_cross_hits_attr.attr,
+	&use_magazines_attr.attr,
+	&magazine_misses_attr.attr,
+	&reclaim_policy_attr.attr,
+	&reclaim_share_min_attr.attr,
+	&reclaim_protected_attr.attr,
+	&reclaim_cheap_attr.attr,
+	&remerge_rounds_attr.attr,
+	&remerges_attr.attr,
+	&region_pages_attr.attr,
+	&slot_min_age_attr.attr,
+	&slots_discovered_attr.attr,
+	&fork_inherit_attr.attr,
+	&pages_fork_skipped_attr.attr,
+	&burst_min_pages_attr.attr,
+	&burst_max_pages_attr.attr,
+	&burst_pages_attr.attr,
+	&burst_slots_attr.attr,
+	&swap_reshare_attr.attr,
+	&swap_reshare_stats_attr.attr,
+	&rmap_sample_attr.attr,
+	&rmap_walks_sampled_attr.attr,
+	&max_page_sharing_attr.attr,
+	&stable_node_dups_attr.attr,
+	&guest_dirty_hint_attr.attr,
+	&guest_dirty_hinted_attr.attr,
+	&unmerge_workers_attr.attr,
+	&unmerge_slots_skipped_attr.attr,
+	&slots_dying_attr.attr,
+	&cow_heat_threshold_attr.attr,
+	&pages_cow_hot_skipped_attr.attr,
+	&cow_unmerge_threshold_attr.attr,
+	&cow_unmerge_stats_attr.attr,
+#ifdef CONFIG_NUMA
+	&merge_across_nodes_attr.attr,
+	&merge_cold_across_nodes_attr.attr,
+#endif
+	NULL,
+};
 
-			anon_vma_lock(anon_vma);
-			list_for_each_entry(vmac, &anon_vma->head,
-					    same_anon_vma) {
-				vma = vmac->vma;
-				address = get_rmap_addr(rmap_item);
+static struct attribute_group ksm_attr_group = {
+	.attrs = ksm_attrs,
+};
 
-				if (address < vma->vm_start ||
-				    address >= vma->vm_end)
-					continue;
-				/*
-				 * Initially we examine only the vma which
-				 * covers this rmap_item; but later, if there
-				 * is still work to do, we examine covering
-				 * vmas in other mms: in case they were forked
-				 * from the original since ksmd passed.
-				 */
-				if ((rmap_item->slot->vma == vma) ==
-				    search_new_forks)
-					continue;
+/*
+ * /sys/kernel/mm/ksm/ladder/: the geometry of the scan ladder. scan_ratios
+ * takes the increasing scan ratio of each rung, in unit of
+ * 1/KSM_SCAN_RATIO_MAX and ending with KSM_SCAN_RATIO_MAX, their number
+ * setting the number of rungs. quota_divisors divides the share of a scan
+ * batch of each rung, they are reset to the defaults by a new scan_ratios.
+ * revisit_msecs sets the longest a round of each rung should take, 0 for no
+ * limit: revisit_last_msecs reports how long the last ones took and
+ * revisit_misses how many took longer. A new scan_ratios clears them.
+ */
+static int ladder_parse(const char *buf, unsigned long *vals)
+{
+	unsigned int n = 0;
+	char *end;
+
+	while (*(buf = skip_spaces(buf))) {
+		if (n == KSM_SCAN_LADDER_MAX)
+			return -EINVAL;
+		vals[n] = simple_strtoul(buf, &end, 10);
+		if (end == buf || (*end && !isspace(*end)))
+			return -EINVAL;
+		buf = end;
+		n++;
+	}
 
-				if (memcg &&
-				    !mm_match_cgroup(vma->vm_mm, memcg))
-					continue;
+	return n;
+}
 
-				referenced +=
-					page_referenced_one(page, vma,
-						address, &mapcount, vm_flags);
-				if (!search_new_forks || !mapcount)
-					break;
-			}
+static ssize_t ladder_show(char *buf, unsigned long (*val)(int))
+{
+	ssize_t len = 0;
+	int i;
 
-			anon_vma_unlock(anon_vma);
-			if (!mapcount)
-				goto out;
-		}
-	}
-	if (!search_new_forks++)
-		goto again;
-out:
-	return referenced;
+	ksm_control_lock();
+	for (i = 0; i < ksm_scan_ladder_size; i++)
+		len += sprintf(buf + len, i ? " %lu" : "%lu", val(i));
+	mutex_unlock(&ksm_thread_mutex);
+	len += sprintf(buf + len, "\n");
+
+	return len;
+}
+
+static unsigned long rung_scan_ratio(int i)
+{
+	return ksm_scan_ladder[i].scan_ratio;
+}
+
+static unsigned long rung_quota_div(int i)
+{
+	return ksm_rung_quota_div[i];
+}
+
+static unsigned long rung_revisit_ms(int i)
+{
+	return ksm_rung_revisit_ms[i];
 }
 
-int try_to_unmap_ksm(struct page *page, enum ttu_flags flags)
+static unsigned long rung_revisit_last(int i)
 {
-	struct stable_node *stable_node;
-	struct node_vma *node_vma;
-	struct hlist_node *hlist, *rmap_hlist;
-	struct rmap_item *rmap_item;
-	int ret = SWAP_AGAIN;
-	int search_new_forks = 0;
-	unsigned long address;
+	return ksm_scan_ladder[i].revisit_last_ms;
+}
 
-	VM_BUG_ON(!PageKsm(page));
-	VM_BUG_ON(!PageLocked(page));
+static unsigned long rung_revisit_misses(int i)
+{
+	return ksm_scan_ladder[i].revisit_misses;
+}
 
-	stable_node = page_stable_node(page);
-	if (!stable_node)
-		return SWAP_FAIL;
-again:
-	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
-		hlist_for_each_entry(rmap_item, rmap_hlist,
-				     &node_vma->rmap_hlist, hlist) {
-			struct anon_vma *anon_vma = rmap_item->anon_vma;
-			struct anon_vma_chain *vmac;
-			struct vm_area_struct *vma;
+static unsigned long rung_vma_num(int i)
+{
+	return ksm_scan_ladder[i].vma_num;
+}
 
-			anon_vma_lock(anon_vma);
-			list_for_each_entry(vmac, &anon_vma->head,
-					    same_anon_vma) {
-				vma = vmac->vma;
-				address = get_rmap_addr(rmap_item);
+/* in percent of the round quota of the rung */
+static unsigned long rung_coverage(int i)
+{
+	unsigned long done, left;
 
-				if (address < vma->vm_start ||
-				    address >= vma->vm_end)
-					continue;
-				/*
-				 * Initially we examine only the vma which
-				 * covers this rmap_item; but later, if there
-				 * is still work to do, we examine covering
-				 * vmas in other mms: in case they were forked
-				 * from the original since ksmd passed.
-				 */
-				if ((rmap_item->slot->vma == vma) ==
-				    search_new_forks)
-					continue;
+	rung_round_progress(&ksm_scan_ladder[i], &done, &left);
 
-				ret = try_to_unmap_one(page, vma,
-						       address, flags);
-				if (ret != SWAP_AGAIN || !page_mapped(page)) {
-					anon_vma_unlock(anon_vma);
-					goto out;
-				}
-			}
-			anon_vma_unlock(anon_vma);
-		}
-	}
-	if (!search_new_forks++)
-		goto again;
-out:
-	return ret;
+	return done + left ? done * 100 / (done + left) : 100;
 }
 
-#ifdef CONFIG_MIGRATION
-int rmap_walk_ksm(struct page *page, int (*rmap_one)(struct page *,
-		  struct vm_area_struct *, unsigned long, void *), void *arg)
+static ssize_t scan_ratios_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
 {
-	struct stable_node *stable_node;
-	struct node_vma *node_vma;
-	struct hlist_node *hlist, *rmap_hlist;
-	struct rmap_item *rmap_item;
-	int ret = SWAP_AGAIN;
-	int search_new_forks = 0;
-	unsigned long address;
-
-	VM_BUG_ON(!PageKsm(page));
-	VM_BUG_ON(!PageLocked(page));
+	return ladder_show(buf, rung_scan_ratio);
+}
 
-	stable_node = page_stable_node(page);
-	if (!stable_node)
-		return ret;
-again:
-	hlist_for_each_entry(node_vma, hlist, &stable_node->hlist, hlist) {
-		hlist_for_each_entry(rmap_item, rmap_hlist,
-				     &node_vma->rmap_hlist, hlist) {
-			struct anon_vma *anon_vma = rmap_item->anon_vma;
-			struct anon_vma_chain *vmac;
-			struct vm_area_struct *vma;
+static ssize_t scan_ratios_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	unsigned long ratios[KSM_SCAN_LADDER_MAX];
+	int i, n;
 
-			anon_vma_lock(anon_vma);
-			list_for_each_entry(vmac, &anon_vma->head,
-					    same_anon_vma) {
-				vma = vmac->vma;
-				address = get_rmap_addr(rmap_item);
+	n = ladder_parse(buf, ratios);
+	if (n < 1 || ratios[n - 1] != KSM_SCAN_RATIO_MAX || !ratios[0])
+		return -EINVAL;
+	for (i = 1; i < n; i++)
+		if (ratios[i] <= ratios[i - 1])
+			return -EINVAL;
 
-				if (address < vma->vm_start ||
-				    address >= vma->vm_end)
-					continue;
+	ksm_control_lock();
+	ladder_reconfigure(ratios, n);
+	mutex_unlock(&ksm_thread_mutex);
 
-				if ((rmap_item->slot->vma == vma) ==
-				    search_new_forks)
-					continue;
+	return count;
+}
+KSM_ATTR(scan_ratios);
 
-				ret = rmap_one(page, vma, address, arg);
-				if (ret != SWAP_AGAIN) {
-					anon_vma_unlock(anon_vma);
-					goto out;
-				}
-			}
-			anon_vma_unlock(anon_vma);
-		}
-	}
-	if (!search_new_forks++)
-		goto again;
-out:
-	return ret;
+static ssize_t quota_divisors_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return ladder_show(buf, rung_quota_div);
 }
 
-void ksm_migrate_page(struct page *newpage, struct page *oldpage)
+static ssize_t quota_divisors_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
 {
-	struct stable_node *stable_node;
+	unsigned long divs[KSM_SCAN_LADDER_MAX];
+	int i, n;
 
-	VM_BUG_ON(!PageLocked(oldpage));
-	VM_BUG_ON(!PageLocked(newpage));
-	VM_BUG_ON(newpage->mapping != oldpage->mapping);
+	n = ladder_parse(buf, divs);
+	if (n < 1)
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (!divs[i] || divs[i] > UINT_MAX)
+			return -EINVAL;
 
-	stable_node = page_stable_node(newpage);
-	if (stable_node) {
-		VM_BUG_ON(stable_node->kpfn != page_to_pfn(oldpage));
-		stable_node->kpfn = page_to_pfn(newpage);
+	ksm_control_lock();
+	if (n != ksm_scan_ladder_size) {
+		mutex_unlock(&ksm_thread_mutex);
+		return -EINVAL;
 	}
+	for (i = 0; i < n; i++)
+		ksm_rung_quota_div[i] = divs[i];
+	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+	mutex_unlock(&ksm_thread_mutex);
+
+	return count;
 }
-#endif /* CONFIG_MIGRATION */
+KSM_ATTR(quota_divisors);
 
-#ifdef CONFIG_MEMORY_HOTREMOVE
-static struct stable_node *ksm_check_stable_tree(unsigned long start_pfn,
-						 unsigned long end_pfn)
+static ssize_t revisit_msecs_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
 {
-	struct rb_node *node;
+	return ladder_show(buf, rung_revisit_ms);
+}
 
-	for (node = rb_first(root_stable_treep); node; node = rb_next(node)) {
-		struct stable_node *stable_node;
+static ssize_t revisit_msecs_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	unsigned long msecs[KSM_SCAN_LADDER_MAX];
+	int i, n;
 
-		stable_node = rb_entry(node, struct stable_node, node);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			return stable_node;
+	n = ladder_parse(buf, msecs);
+	if (n < 1)
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (msecs[i] > UINT_MAX)
+			return -EINVAL;
+
+	ksm_control_lock();
+	if (n != ksm_scan_ladder_size) {
+		mutex_unlock(&ksm_thread_mutex);
+		return -EINVAL;
 	}
-	return NULL;
+	for (i = 0; i < n; i++) {
+		ksm_rung_revisit_ms[i] = msecs[i];
+		ksm_scan_ladder[i].revisit_misses = 0;
+	}
+	mutex_unlock(&ksm_thread_mutex);
+
+	return count;
 }
+KSM_ATTR(revisit_msecs);
 
-static int ksm_memory_callback(struct notifier_block *self,
-			       unsigned long action, void *arg)
+static ssize_t revisit_last_msecs_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
 {
-	struct memory_notify *mn = arg;
-	struct stable_node *stable_node;
+	return ladder_show(buf, rung_revisit_last);
+}
+KSM_ATTR_RO(revisit_last_msecs);
 
-	switch (action) {
-	case MEM_GOING_OFFLINE:
-		/*
-		 * Keep it very simple for now: just lock out ksmd and
-		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
-		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
-		 * are inside mem_hotplug_mutex.
-		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
-		break;
+static ssize_t revisit_misses_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return ladder_show(buf, rung_revisit_misses);
+}
+KSM_ATTR_RO(revisit_misses);
 
-	case MEM_OFFLINE:
-		/*
-		 * Most of the work is done by page migration; but there might
-		 * be a few stable_nodes left over, still pointing to struct
-		 * pages which have been offlined: prune those from the tree.
-		 */
-		while ((stable_node = ksm_check_stable_tree(mn->start_pfn,
-					mn->start_pfn + mn->nr_pages)) != NULL)
-			remove_node_from_stable_tree(stable_node, 1, 1);
-		/* fallthrough */
+static ssize_t rungs_show(struct kobject *kobj,
+			  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_scan_ladder_size);
+}
+KSM_ATTR_RO(rungs);
 
-	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
-		break;
-	}
-	return NOTIFY_OK;
+static ssize_t rung_slots_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return ladder_show(buf, rung_vma_num);
 }
-#endif /* CONFIG_MEMORY_HOTREMOVE */
+KSM_ATTR_RO(rung_slots);
 
-#ifdef CONFIG_SYSFS
-/*
- * This all compiles without CONFIG_SYSFS, but is a waste of space.
- */
+static ssize_t rung_coverage_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return ladder_show(buf, rung_coverage);
+}
+KSM_ATTR_RO(rung_coverage);
 
-#define KSM_ATTR_RO(_name) \
-	static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
-#define KSM_ATTR(_name) \
-	static struct kobj_attribute _name##_attr = \
-		__ATTR(_name, 0644, _name##_show, _name##_store)
+static struct attribute *ksm_ladder_attrs[] = {
+	&scan_ratios_attr.attr,
+	&quota_divisors_attr.attr,
+	&revisit_msecs_attr.attr,
+	&revisit_last_msecs_attr.attr,
+	&revisit_misses_attr.attr,
+	&rungs_attr.attr,
+	&rung_slots_attr.attr,
+	&rung_coverage_attr.attr,
+	NULL,
+};
 
-static ssize_t sleep_millisecs_show(struct kobject *kobj,
-				    struct kobj_attribute *attr, char *buf)
+static struct attribute_group ksm_ladder_attr_group = {
+	.attrs = ksm_ladder_attrs,
+	.name = "ladder",
+};
+
+static struct kobject *ksm_kobj;
+#endif /* CONFIG_SYSFS */
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *ksm_debugfs_dir;
+
+static int ksm_hists_show(struct seq_file *m, void *v)
 {
-	return sprintf(buf, "%u\n", jiffies_to_msecs(ksm_sleep_jiffies));
+	struct ksm_hist *hist;
+	int i, j;
+
+	seq_printf(m, "mmap_sem_busy %lu\n", ksm_mmap_sem_busy);
+	seq_printf(m, "mmap_sem_yields %lu\n", ksm_mmap_sem_yields);
+	for (i = 0; i < NR_KSM_HIST_ITEMS; i++) {
+		hist = &ksm_hists[i];
+		seq_printf(m, "%s count %lu sum_ns %llu\n", ksm_hist_names[i],
+			   hist->count, (unsigned long long)hist->sum);
+		for (j = 0; j < KSM_HIST_BUCKETS; j++) {
+			if (!hist->buckets[j])
+				continue;
+			seq_printf(m, "  %llu %lu\n",
+				   j ? 1ULL << (j - 1) : 0ULL,
+				   hist->buckets[j]);
+		}
+	}
+
+	return 0;
 }
 
-static ssize_t sleep_millisecs_store(struct kobject *kobj,
-				     struct kobj_attribute *attr,
-				     const char *buf, size_t count)
+static int ksm_hists_open(struct inode *inode, struct file *file)
 {
-	unsigned long msecs;
-	int err;
+	return single_open(file, ksm_hists_show, NULL);
+}
 
-	err = strict_strtoul(buf, 10, &msecs);
-	if (err || msecs > UINT_MAX)
-		return -EINVAL;
+static const struct file_operations ksm_hists_fops = {
+	.open		= ksm_hists_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	ksm_sleep_jiffies = msecs_to_jiffies(msecs);
-	printk(KERN_INFO "KSM: sleep interval changed to %u jiffies\n",
-	       ksm_sleep_jiffies);
+static int seed_fp_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
 
-	return count;
+	return x < y ? -1 : x > y;
 }
-KSM_ATTR(sleep_millisecs);
 
-static ssize_t min_scan_ratio_show(struct kobject *kobj,
-				    struct kobj_attribute *attr, char *buf)
+/* the fingerprints read out, or written in, through one open file */
+struct ksm_fp_buf {
+	u32 *fps;
+	unsigned long nr;
+	unsigned long size;	/* room for so many */
+};
+
+/* the pages of @list, stable nodes got with a reference, racily checked */
+static void stable_fps_collect(struct ksm_fp_buf *buf, struct list_head *list)
 {
-	return sprintf(buf, "%u\n", ksm_min_scan_ratio);
+	struct stable_node *stable_node;
+	struct page *page;
+
+	list_for_each_entry(stable_node, list, all_list) {
+		if (buf->nr == buf->size)
+			return;
+		if (stable_node->swap || !pfn_valid(stable_node->kpfn))
+			continue;
+
+		page = pfn_to_page(stable_node->kpfn);
+		if (!PageKsm(page) || !get_page_unless_zero(page))
+			continue;
+		if (PageKsm(page) && page_stable_node(page) == stable_node)
+			buf->fps[buf->nr++] = page_fingerprint(page);
+		put_page(page);
+	}
 }
 
-static ssize_t min_scan_ratio_store(struct kobject *kobj,
-				     struct kobj_attribute *attr,
-				     const char *buf, size_t count)
+static int stable_fps_open(struct inode *inode, struct file *file)
 {
-	unsigned long msr;
-	int err;
+	struct ksm_fp_buf *buf;
 
-	err = strict_strtoul(buf, 10, &msr);
-	if (err || msr > UINT_MAX)
-		return -EINVAL;
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
-	ksm_min_scan_ratio = msr;
+	if (file->f_mode & FMODE_READ) {
+		ksm_control_lock();
+		buf->size = ksm_stable_nodes;
+		buf->fps = buf->size ? vmalloc(buf->size * sizeof(u32)) : NULL;
+		if (buf->fps) {
+			stable_fps_collect(buf, &stable_node_list);
+			stable_fps_collect(buf, &stable_node_migrate_list);
+		}
+		mutex_unlock(&ksm_thread_mutex);
 
-	return count;
+		if (buf->size && !buf->fps) {
+			kfree(buf);
+			return -ENOMEM;
+		}
+		sort(buf->fps, buf->nr, sizeof(u32), seed_fp_cmp, NULL);
+	}
+
+	file->private_data = buf;
+	return 0;
 }
-KSM_ATTR(min_scan_ratio);
 
-static ssize_t scan_batch_pages_show(struct kobject *kobj,
-				  struct kobj_attribute *attr, char *buf)
+static ssize_t stable_fps_read(struct file *file, char __user *ubuf,
+			       size_t count, loff_t *ppos)
 {
-	return sprintf(buf, "%lu\n", ksm_scan_batch_pages);
+	struct ksm_fp_buf *buf = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf->fps,
+				       buf->nr * sizeof(u32));
 }
 
-static ssize_t scan_batch_pages_store(struct kobject *kobj,
-				   struct kobj_attribute *attr,
-				   const char *buf, size_t count)
+/* the fingerprints written are appended, to be seeded when closing */
+static ssize_t stable_fps_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct ksm_fp_buf *buf = file->private_data;
+	unsigned long nr = count / sizeof(u32), size;
+	u32 *fps;
+
+	if (!nr || buf->nr + nr > totalram_pages)
+		return -EINVAL;
+
+	if (buf->nr + nr > buf->size) {
+		size = max(buf->size * 2, buf->nr + nr);
+		size = min(size, (unsigned long)totalram_pages);
+		fps = vmalloc(size * sizeof(u32));
+		if (!fps)
+			return -ENOMEM;
+		if (buf->nr)
+			memcpy(fps, buf->fps, buf->nr * sizeof(u32));
+		vfree(buf->fps);
+		buf->fps = fps;
+		buf->size = size;
+	}
+
+	if (copy_from_user(buf->fps + buf->nr, ubuf, nr * sizeof(u32)))
+		return -EFAULT;
+	buf->nr += nr;
+
+	return nr * sizeof(u32);
+}
+
+static int stable_fps_release(struct inode *inode, struct file *file)
 {
-	int err;
-	unsigned long batch_pages;
+	struct ksm_fp_buf *buf = file->private_data;
 
-	err = strict_strtoul(buf, 10, &batch_pages);
-	if (err || batch_pages > UINT_MAX)
-		return -EINVAL;
+	if ((file->f_mode & FMODE_WRITE) && buf->nr) {
+		sort(buf->fps, buf->nr, sizeof(u32), seed_fp_cmp, NULL);
 
-	ksm_scan_batch_pages = batch_pages;
-	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
+		ksm_control_lock();
+		seed_fps_free();
+		ksm_seed_fps = buf->fps;
+		ksm_seed_nr = buf->nr;
+		ksm_seed_rounds = KSM_SEED_ROUNDS;
+		mutex_unlock(&ksm_thread_mutex);
+		buf->fps = NULL;
+	}
 
-	return count;
+	vfree(buf->fps);
+	kfree(buf);
+	return 0;
 }
-KSM_ATTR(scan_batch_pages);
 
-static ssize_t run_show(struct kobject *kobj, struct kobj_attribute *attr,
-			char *buf)
+static const struct file_operations ksm_stable_fps_fops = {
+	.open		= stable_fps_open,
+	.read		= stable_fps_read,
+	.write		= stable_fps_write,
+	.release	= stable_fps_release,
+	.llseek		= default_llseek,
+};
+
+static ssize_t hash_trace_rate_read(struct file *file, char __user *ubuf,
+				    size_t count, loff_t *ppos)
 {
-	return sprintf(buf, "%u\n", ksm_run);
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u\n", ksm_hash_trace_rate);
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
 }
 
-static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
-			 const char *buf, size_t count)
+/* the buffer is allocated when first enabled, and kept */
+static ssize_t hash_trace_rate_write(struct file *file,
+				     const char __user *ubuf, size_t count,
+				     loff_t *ppos)
 {
+	struct ksm_trace_rec *rec;
+	unsigned long rate;
+	char buf[32];
 	int err;
-	unsigned long flags;
 
-	err = strict_strtoul(buf, 10, &flags);
-	if (err || flags > UINT_MAX)
+	if (count >= sizeof(buf))
 		return -EINVAL;
-	if (flags > KSM_RUN_MERGE)
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	err = strict_strtoul(strstrip(buf), 10, &rate);
+	if (err || rate > UINT_MAX)
 		return -EINVAL;
 
-	mutex_lock(&ksm_thread_mutex);
-	if (ksm_run != flags) {
-		ksm_run = flags;
+	if (rate && !ksm_trace_buf) {
+		rec = vmalloc(KSM_TRACE_SIZE * sizeof(*rec));
+		if (!rec)
+			return -ENOMEM;
+		spin_lock(&ksm_trace_lock);
+		if (!ksm_trace_buf)
+			ksm_trace_buf = rec;
+		else
+			vfree(rec);
+		spin_unlock(&ksm_trace_lock);
 	}
-	mutex_unlock(&ksm_thread_mutex);
-
-	if (flags & KSM_RUN_MERGE)
-		wake_up_interruptible(&ksm_thread_wait);
+	ksm_hash_trace_rate = rate;
 
 	return count;
 }
-KSM_ATTR(run);
 
+static const struct file_operations ksm_hash_trace_rate_fops = {
+	.read		= hash_trace_rate_read,
+	.write		= hash_trace_rate_write,
+	.llseek		= default_llseek,
+};
 
-static ssize_t thrash_threshold_show(struct kobject *kobj,
-				     struct kobj_attribute *attr, char *buf)
+/* hands out, and consumes, whole records */
+static ssize_t hash_trace_read(struct file *file, char __user *ubuf,
+			       size_t count, loff_t *ppos)
 {
-	return sprintf(buf, "%u\n", ksm_thrash_threshold);
+	struct ksm_trace_rec rec;
+	ssize_t done = 0;
+
+	while (count - done >= sizeof(rec)) {
+		spin_lock(&ksm_trace_lock);
+		if (ksm_trace_tail == ksm_trace_head) {
+			spin_unlock(&ksm_trace_lock);
+			break;
+		}
+		rec = ksm_trace_buf[ksm_trace_tail++ % KSM_TRACE_SIZE];
+		spin_unlock(&ksm_trace_lock);
+
+		if (copy_to_user(ubuf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+
+	return done;
 }
 
-static ssize_t thrash_threshold_store(struct kobject *kobj,
-				      struct kobj_attribute *attr,
-				      const char *buf, size_t count)
+static const struct file_operations ksm_hash_trace_fops = {
+	.read		= hash_trace_read,
+	.llseek		= noop_llseek,
+};
+
+static void __init ksm_debugfs_init(void)
 {
-	int err;
-	unsigned long flags;
+	ksm_debugfs_dir = debugfs_create_dir("ksm", NULL);
+	if (!ksm_debugfs_dir)
+		return;
 
-	err = strict_strtoul(buf, 10, &flags);
-	if (err || flags > 99)
-		return -EINVAL;
+	debugfs_create_file("histograms", 0400, ksm_debugfs_dir, NULL,
+			    &ksm_hists_fops);
+	debugfs_create_file("stable_fingerprints", 0600, ksm_debugfs_dir,
+			    NULL, &ksm_stable_fps_fops);
+	debugfs_create_file("hash_trace_rate", 0600, ksm_debugfs_dir, NULL,
+			    &ksm_hash_trace_rate_fops);
+	debugfs_create_file("hash_trace", 0400, ksm_debugfs_dir, NULL,
+			    &ksm_hash_trace_fops);
+	debugfs_create_u64("hash_trace_lost", 0400, ksm_debugfs_dir,
+			   &ksm_trace_lost);
+}
+#else
+static inline void ksm_debugfs_init(void)
+{
+}
+#endif /* CONFIG_DEBUG_FS */
 
-	ksm_thrash_threshold = flags;
+#ifdef CONFIG_KSM_BENCHMARK
+/*
+ * Reading /sys/kernel/debug/ksm/bench runs a micro-benchmark of the hashing,
+ * page comparing and tree searching primitives on bench_pages random pages
+ * and a tree of bench_tree_size nodes. Each result line is
+ * "<test> <parameter> <cycles per operation>".
+ */
+#define KSM_BENCH_PASSES	4
 
-	return count;
-}
-KSM_ATTR(thrash_threshold);
+static u32 ksm_bench_pages = 256;
+static u32 ksm_bench_tree_size = 65536;
+static u32 ksm_bench_sink;
 
-static ssize_t pages_shared_show(struct kobject *kobj,
-				 struct kobj_attribute *attr, char *buf)
+static u64 ksm_bench_per_op(cycles_t start, unsigned long ops)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	u64 cycles = get_cycles() - start;
+
+	do_div(cycles, ops);
+	return cycles;
 }
-KSM_ATTR_RO(pages_shared);
 
-static ssize_t pages_sharing_show(struct kobject *kobj,
-				  struct kobj_attribute *attr, char *buf)
+static void ksm_bench_hash(struct seq_file *m, void **addrs, unsigned int nr)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	unsigned int strength, pass, i;
+	cycles_t start;
+	u32 hash;
+
+	for (strength = 1; strength <= HASH_STRENGTH_MAX;
+	     strength = strength < HASH_STRENGTH_FULL ?
+			strength * 2 : HASH_STRENGTH_MAX + 1) {
+		start = get_cycles();
+		for (pass = 0; pass < KSM_BENCH_PASSES; pass++)
+			for (i = 0; i < nr; i++)
+				ksm_bench_sink += random_sample_hash(addrs[i],
+								    strength);
+		seq_printf(m, "random_sample_hash %u %llu\n", strength,
+			   ksm_bench_per_op(start, KSM_BENCH_PASSES * nr));
+		cond_resched();
+	}
+
+	if (HASH_STRENGTH_MAX > HASH_STRENGTH_FULL) {
+		start = get_cycles();
+		for (pass = 0; pass < KSM_BENCH_PASSES; pass++)
+			for (i = 0; i < nr; i++)
+				ksm_bench_sink += random_sample_hash(addrs[i],
+							HASH_STRENGTH_MAX);
+		seq_printf(m, "random_sample_hash %lu %llu\n",
+			   (unsigned long)HASH_STRENGTH_MAX,
+			   ksm_bench_per_op(start, KSM_BENCH_PASSES * nr));
+	}
+
+	/* delta_hash by one doubling (up) or halving (down) of the strength */
+	for (strength = 1; strength < HASH_STRENGTH_FULL; strength *= 2) {
+		hash = random_sample_hash(addrs[0], strength);
+		start = get_cycles();
+		for (pass = 0; pass < KSM_BENCH_PASSES; pass++)
+			for (i = 0; i < nr; i++)
+				ksm_bench_sink += delta_hash(addrs[i], strength,
+							     strength * 2,
+							     hash);
+		seq_printf(m, "delta_hash_up %u %llu\n", strength,
+			   ksm_bench_per_op(start, KSM_BENCH_PASSES * nr));
+
+		hash = random_sample_hash(addrs[0], strength * 2);
+		start = get_cycles();
+		for (pass = 0; pass < KSM_BENCH_PASSES; pass++)
+			for (i = 0; i < nr; i++)
+				ksm_bench_sink += delta_hash(addrs[i],
+							     strength * 2,
+							     strength, hash);
+		seq_printf(m, "delta_hash_down %u %llu\n", strength * 2,
+			   ksm_bench_per_op(start, KSM_BENCH_PASSES * nr));
+		cond_resched();
+	}
 }
-KSM_ATTR_RO(pages_sharing);
 
-static ssize_t pages_unshared_show(struct kobject *kobj,
-				   struct kobj_attribute *attr, char *buf)
+/* pages are compared in identical pairs, the worst case of a full compare */
+static void ksm_bench_memcmp(struct seq_file *m, void **addrs,
+			     unsigned int nr)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	unsigned int pass, i;
+	cycles_t start;
+
+	for (i = 0; i + 1 < nr; i += 2)
+		memcpy(addrs[i + 1], addrs[i], PAGE_SIZE);
+
+	start = get_cycles();
+	for (pass = 0; pass < KSM_BENCH_PASSES; pass++)
+		for (i = 0; i + 1 < nr; i += 2)
+			ksm_bench_sink += ksm_memcmp_page(addrs[i],
+							  addrs[i + 1]);
+	seq_printf(m, "memcmp_pages %lu %llu\n", PAGE_SIZE,
+		   ksm_bench_per_op(start, KSM_BENCH_PASSES * (nr / 2)));
 }
-KSM_ATTR_RO(pages_unshared);
 
-static ssize_t full_scans_show(struct kobject *kobj,
-			       struct kobj_attribute *attr, char *buf)
+/*
+ * Searches miss on purpose: the tree has even hashes and odd ones are looked
+ * up, so no stable node is dereferenced. The first level of the unstable
+ * tree is the same tree_node rbtree, the index in front of both is the same
+ * hash table too.
+ */
+static int ksm_bench_tree(struct seq_file *m, unsigned int size)
 {
-	return sprintf(buf, "%llu\n", ksm_scan_round);
+	struct rb_root root = RB_ROOT;
+	struct tree_index index;
+	struct list_head list;
+	struct tree_node *tree_node;
+	struct rb_node **new, *parent;
+	unsigned int i, nodes = 0;
+	cycles_t start;
+	u32 hash;
+	int cmp;
+
+	INIT_LIST_HEAD(&list);
+	for (i = 0; i < size; i++) {
+		hash = random32() & ~1U;
+		new = &root.rb_node;
+		parent = NULL;
+		while (*new) {
+			tree_node = rb_entry(*new, struct tree_node, node);
+			cmp = hash_cmp(hash, tree_node->hash);
+			if (!cmp)
+				break;
+			parent = *new;
+			new = cmp < 0 ? &parent->rb_left : &parent->rb_right;
+		}
+		if (*new)
+			continue;
+
+		tree_node = alloc_tree_node(&list);
+		if (!tree_node) {
+			free_all_tree_nodes(&list);
+			return -ENOMEM;
+		}
+		tree_node->hash = hash;
+		tree_node->root = &root;
+		rb_link_node(&tree_node->node, parent, new);
+		rb_insert_color(&tree_node->node, &root);
+		nodes++;
+		if (!(i % 4096))
+			cond_resched();
+	}
+
+	start = get_cycles();
+	for (i = 0; i < KSM_BENCH_PASSES * size; i++) {
+		hash = random32() | 1;
+		if (tree_node_walk(&root, hash))
+			BUG();
+	}
+	seq_printf(m, "tree_search %u %llu\n", nodes,
+		   ksm_bench_per_op(start, KSM_BENCH_PASSES * size));
+
+	memset(&index, 0, sizeof(index));
+	if (tree_index_reserve(&index, nodes)) {
+		tree_index_add_tree(&index, &root);
+		start = get_cycles();
+		for (i = 0; i < KSM_BENCH_PASSES * size; i++) {
+			hash = random32() | 1;
+			if (tree_index_lookup(&index, &root, hash))
+				BUG();
+		}
+		seq_printf(m, "tree_index_search %u %llu\n", nodes,
+			   ksm_bench_per_op(start, KSM_BENCH_PASSES * size));
+		tree_index_free(&index);
+	}
+
+	free_all_tree_nodes(&list);
+	return 0;
 }
-KSM_ATTR_RO(full_scans);
 
-static ssize_t pages_scanned_show(struct kobject *kobj,
-				  struct kobj_attribute *attr, char *buf)
+static int ksm_bench_show(struct seq_file *m, void *v)
 {
-       return sprintf(buf, "%llu\n", ksm_pages_scanned);
+	unsigned int nr = clamp_t(u32, ksm_bench_pages, 2, 65536);
+	unsigned int size = clamp_t(u32, ksm_bench_tree_size, 1, 1 << 24);
+	struct page **pages;
+	void **addrs;
+	unsigned int i;
+	int err = -ENOMEM;
+
+	pages = vzalloc(nr * sizeof(*pages));
+	addrs = vzalloc(nr * sizeof(*addrs));
+	if (!pages || !addrs)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i])
+			goto out;
+		addrs[i] = page_address(pages[i]);
+		get_random_bytes(addrs[i], PAGE_SIZE);
+	}
+
+	/* keep ksmd off the cpu caches and from changing the backends */
+	ksm_control_lock();
+	seq_printf(m, "# test parameter cycles_per_op\n");
+#ifdef CONFIG_X86
+	seq_printf(m, "# hash %s\n", ksm_hash_crc32c ? "crc32c" : "generic");
+#else
+	seq_printf(m, "# hash generic\n");
+#endif
+	for (i = 0; i < ARRAY_SIZE(ksm_memcmp_backends); i++) {
+		if (ksm_memcmp_backends[i].cmp == ksm_memcmp_page)
+			seq_printf(m, "# memcmp %s\n",
+				   ksm_memcmp_backends[i].name);
+	}
+	ksm_bench_hash(m, addrs, nr);
+	ksm_bench_memcmp(m, addrs, nr);
+	err = ksm_bench_tree(m, size);
+	mutex_unlock(&ksm_thread_mutex);
+
+out:
+	for (i = 0; pages && i < nr && pages[i]; i++)
+		__free_page(pages[i]);
+	vfree(addrs);
+	vfree(pages);
+	return err;
 }
-KSM_ATTR_RO(pages_scanned);
 
-static ssize_t hash_strength_show(struct kobject *kobj,
-				  struct kobj_attribute *attr, char *buf)
+static int ksm_bench_open(struct inode *inode, struct file *file)
 {
-	return sprintf(buf, "%lu\n", hash_strength);
+	return single_open(file, ksm_bench_show, NULL);
 }
-KSM_ATTR_RO(hash_strength);
 
-static ssize_t sleep_times_show(struct kobject *kobj,
-				  struct kobj_attribute *attr, char *buf)
+static const struct file_operations ksm_bench_fops = {
+	.open		= ksm_bench_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init ksm_bench_init(void)
 {
-	return sprintf(buf, "%llu\n", ksm_sleep_times);
-}
-KSM_ATTR_RO(sleep_times);
+	struct dentry *dir = ksm_debugfs_dir;
 
+	if (!dir)
+		return -ENOMEM;
 
-static struct attribute *ksm_attrs[] = {
-	&sleep_millisecs_attr.attr,
-	&scan_batch_pages_attr.attr,
-	&run_attr.attr,
-	&pages_shared_attr.attr,
-	&pages_sharing_attr.attr,
-	&pages_unshared_attr.attr,
-	&full_scans_attr.attr,
-	&min_scan_ratio_attr.attr,
-	&pages_scanned_attr.attr,
-	&hash_strength_attr.attr,
-	&sleep_times_attr.attr,
-	&thrash_threshold_attr.attr,
-	NULL,
-};
+	debugfs_create_u32("bench_pages", 0644, dir, &ksm_bench_pages);
+	debugfs_create_u32("bench_tree_size", 0644, dir,
+			   &ksm_bench_tree_size);
+	debugfs_create_file("bench", 0400, dir, NULL, &ksm_bench_fops);
 
-static struct attribute_group ksm_attr_group = {
-	.attrs = ksm_attrs,
-	.name = "ksm",
-};
-#endif /* CONFIG_SYSFS */
+	return 0;
+}
+#else
+static inline int ksm_bench_init(void)
+{
+	return 0;
+}
+#endif /* CONFIG_KSM_BENCHMARK */
 
 static inline void init_scan_ladder(void)
 {
@@ -4466,19 +13758,168 @@ static inline void init_scan_ladder(void)
 
 	pages_to_scan = ksm_scan_batch_pages;
 
-	for (i = 0; i < ksm_scan_ladder_size; i++,
+	for (i = 0; i < KSM_SCAN_LADDER_MAX; i++,
 	      mul *= ksm_scan_ratio_delta) {
 
-		ksm_scan_ladder[i].scan_ratio = ksm_min_scan_ratio * mul;
+		if (i < ksm_scan_ladder_size)
+			ksm_scan_ladder[i].scan_ratio = ksm_min_scan_ratio * mul;
 		INIT_LIST_HEAD(&ksm_scan_ladder[i].vma_list);
+		ksm_scan_ladder[i].current_scan = &ksm_scan_ladder[i].vma_list;
 		ksm_scan_ladder[i].vma_num = 0;
 		ksm_scan_ladder[i].round_finished = 0;
+		ksm_scan_ladder[i].round_start_j = jiffies;
 		ksm_scan_ladder[i].fully_scanned_slots = 0;
 	}
+	ladder_default_quota();
 
 	cal_ladder_pages_to_scan(ksm_scan_batch_pages);
 }
 
+/*
+ * choose_memcmp_backend() - time each page comparator on two pages differing
+ * only in their last byte and keep the fastest one.
+ */
+static void choose_memcmp_backend(struct page *p1, struct page *p2)
+{
+	struct ksm_memcmp_backend *best = &ksm_memcmp_backends[0];
+	u64 t, best_t = ULLONG_MAX;
+	ktime_t start;
+	char *addr1, *addr2;
+	int i, j;
+
+	addr1 = kmap(p1);
+	addr2 = kmap(p2);
+	for (i = 0; i < ARRAY_SIZE(ksm_memcmp_backends); i++) {
+		struct ksm_memcmp_backend *b = &ksm_memcmp_backends[i];
+
+#ifdef CONFIG_X86
+		if (b->cmp == memcmp_page_sse2 && !cpu_has_xmm2)
+			continue;
+#endif
+		/* a comparator must see the difference in the last byte */
+		if (!b->cmp(addr1, addr2))
+			continue;
+
+		start = ktime_get();
+		for (j = 0; j < 1000; j++)
+			b->cmp(addr1, addr2);
+		t = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		if (t < best_t) {
+			best_t = t;
+			best = b;
+		}
+	}
+	kunmap(p2);
+	kunmap(p1);
+
+	ksm_memcmp_page = best->cmp;
+	printk(KERN_INFO "KSM: using %s page comparator.\n", best->name);
+}
+
+static void ksm_shuffle(u32 *nums, unsigned long nr)
+{
+	unsigned long i, swap_index;
+	u32 tmp;
+
+	for (i = 0; i + 1 < nr; i++) {
+		swap_index = i + random32() % (nr - i);
+		tmp = nums[i];
+		nums[i] = nums[swap_index];
+		nums[swap_index] = tmp;
+	}
+}
+
+/*
+ * random_nums_build() - lay random_nums out by cache lines if @lines, by
+ * words otherwise. Returns the layout built, words if short of memory.
+ */
+static int random_nums_build(int lines)
+{
+	unsigned long words = L1_CACHE_BYTES / sizeof(u32);
+	unsigned long nr_lines = HASH_STRENGTH_FULL / words;
+	unsigned long i, j, pass, pos = 0;
+	u32 *order = NULL, *tmp = NULL;
+
+	for (i = 0; i < HASH_STRENGTH_FULL; i++)
+		random_nums[i] = i;
+
+	if (lines && words > KSM_SAMPLE_LINE_WORDS) {
+		order = kmalloc(nr_lines * sizeof(u32), GFP_KERNEL);
+		tmp = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	}
+	if (!order || !tmp) {
+		kfree(order);
+		kfree(tmp);
+		ksm_shuffle(random_nums, HASH_STRENGTH_FULL);
+		return 0;
+	}
+
+	/* the words of each line in random order, then the lines */
+	for (i = 0; i < nr_lines; i++) {
+		ksm_shuffle(random_nums + i * words, words);
+		order[i] = i;
+	}
+	ksm_shuffle(order, nr_lines);
+
+	for (pass = 0; pass < words; pass += KSM_SAMPLE_LINE_WORDS)
+		for (j = 0; j < nr_lines; j++)
+			for (i = pass; i < pass + KSM_SAMPLE_LINE_WORDS &&
+			     i < words; i++)
+				tmp[pos++] = random_nums[order[j] * words + i];
+
+	memcpy(random_nums, tmp, PAGE_SIZE);
+	kfree(tmp);
+	kfree(order);
+	return 1;
+}
+
+#ifdef CONFIG_X86
+/* the ns hashing @page at the initial strength costs, its lines flushed */
+static u64 cold_sample_hash_cost(struct page *page)
+{
+	void *addr = page_address(page);
+	u64 t, ns = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		clflush_cache_range(addr, PAGE_SIZE);
+		t = local_clock();
+		page_hash(page, hash_strength, 0);
+		ns += local_clock() - t;
+	}
+	return ns;
+}
+#endif
+
+/*
+ * choose_sampling_layout() - build random_nums in the layout asked for at
+ * boot or, if none, in the cheaper one to hash @page with, a lowmem page.
+ */
+static void choose_sampling_layout(struct page *page)
+{
+#ifdef CONFIG_X86
+	u64 words_ns, lines_ns;
+
+	if (ksm_sample_lines < 0 && cpu_has_clflush) {
+		random_nums_build(0);
+		words_ns = cold_sample_hash_cost(page);
+		if (random_nums_build(1)) {
+			lines_ns = cold_sample_hash_cost(page);
+			ksm_sample_lines = lines_ns < words_ns;
+			printk(KERN_INFO "KSM: cold sample hash %llu ns by "
+			       "words, %llu ns by lines.\n",
+			       words_ns >> 8, lines_ns >> 8);
+		}
+	}
+#endif
+	if (ksm_sample_lines < 0)
+		ksm_sample_lines = 0;
+	ksm_sample_lines = random_nums_build(ksm_sample_lines);
+	printk(KERN_INFO "KSM: sampling by %s.\n",
+	       ksm_sample_lines ? "cache lines" : "words");
+}
+
 static inline int cal_positive_negative_costs(void)
 {
 	struct page *p1, *p2;
@@ -4505,6 +13946,12 @@ static inline int cal_positive_negative_costs(void)
 	kunmap_atomic(addr2, KM_USER1);
 	kunmap_atomic(addr1, KM_USER0);
 
+	/* the costs below are then measured with the chosen layout */
+	choose_sampling_layout(p1);
+
+	/* memcmp_cost below is then measured with the chosen comparator */
+	choose_memcmp_backend(p1, p2);
+
 	time_start = jiffies;
 	while (jiffies - time_start < HASH_STRENGTH_FULL / 10) {
 		for (i = 0; i < 100; i++)
@@ -4529,28 +13976,41 @@ static inline int cal_positive_negative_costs(void)
 static inline int init_random_sampling(void)
 {
 	unsigned long i;
+	int err;
+
+#ifdef CONFIG_X86
+	if (ksm_hash_crc32c && !cpu_has_xmm4_2)
+		ksm_hash_crc32c = 0;
+	printk(KERN_INFO "KSM: using %s random sample hash.\n",
+	       ksm_hash_crc32c ? "crc32c" : "generic");
+#endif
+
 	random_nums = kmalloc(PAGE_SIZE, GFP_KERNEL);
 	if (!random_nums)
 		return -ENOMEM;
 
-	for (i = 0; i < HASH_STRENGTH_FULL; i++)
-		random_nums[i] = i;
-
-	for (i = 0; i < HASH_STRENGTH_FULL; i++) {
-		unsigned long rand_range, swap_index, tmp;
+	/* random_nums is laid out there, before any hash is taken */
+	err = cal_positive_negative_costs();
+	if (err) {
+		kfree(random_nums);
+		return err;
+	}
 
-		rand_range = HASH_STRENGTH_FULL - i;
-		swap_index = random32() % rand_range;
-		tmp = random_nums[i];
-		random_nums[i] =  random_nums[swap_index];
-		random_nums[swap_index] = tmp;
+	zero_hash_table = kmalloc(sizeof(u32) * (HASH_STRENGTH_MAX + 1),
+				  GFP_KERNEL);
+	if (!zero_hash_table) {
+		kfree(random_nums);
+		return -ENOMEM;
 	}
 
+	for (i = 0; i <= HASH_STRENGTH_MAX; i++)
+		zero_hash_table[i] = page_hash(ZERO_PAGE(0), i, 0);
+
 	rshash_state.state = RSHASH_NEW;
 	rshash_state.below_count = 0;
 	rshash_state.lookup_window_index = 0;
 
-	return cal_positive_negative_costs();
+	return 0;
 }
 
 static int __init ksm_slab_init(void)
@@ -4567,6 +14027,7 @@ static int __init ksm_slab_init(void)
 	if (!node_vma_cache)
 		goto out_free2;
 
+	vma_slot_queues_init();
 	vma_slot_cache = KSM_KMEM_CACHE(vma_slot, 0);
 	if (!vma_slot_cache)
 		goto out_free3;
@@ -4575,8 +14036,14 @@ static int __init ksm_slab_init(void)
 	if (!tree_node_cache)
 		goto out_free4;
 
+	vma_pair_cache = KSM_KMEM_CACHE(vma_pair, 0);
+	if (!vma_pair_cache)
+		goto out_free5;
+
 	return 0;
 
+out_free5:
+	kmem_cache_destroy(tree_node_cache);
 out_free4:
 	kmem_cache_destroy(vma_slot_cache);
 out_free3:
@@ -4596,12 +14063,14 @@ static void __init ksm_slab_free(void)
 	kmem_cache_destroy(node_vma_cache);
 	kmem_cache_destroy(vma_slot_cache);
 	kmem_cache_destroy(tree_node_cache);
+	kmem_cache_destroy(vma_pair_cache);
 }
 
 static int __init ksm_init(void)
 {
 	struct task_struct *ksm_thread;
 	int err;
+	unsigned long i;
 	unsigned int allocsize;
 	unsigned int sr = ksm_min_scan_ratio;
 
@@ -4610,8 +14079,9 @@ static int __init ksm_init(void)
 		sr *= ksm_scan_ratio_delta;
 		ksm_scan_ladder_size++;
 	}
+	BUG_ON(ksm_scan_ladder_size > KSM_SCAN_LADDER_MAX);
 	ksm_scan_ladder = kzalloc(sizeof(struct scan_rung) *
-				  ksm_scan_ladder_size, GFP_KERNEL);
+				  KSM_SCAN_LADDER_MAX, GFP_KERNEL);
 	if (!ksm_scan_ladder) {
 		printk(KERN_ERR "ksm scan ladder allocation failed, size=%d\n",
 		       ksm_scan_ladder_size);
@@ -4619,27 +14089,17 @@ static int __init ksm_init(void)
 		goto out;
 	}
 	init_scan_ladder();
+	ksm_round_start_j = jiffies;
 
-	allocsize = KSM_DUP_VMA_MAX * KSM_DUP_VMA_MAX *
-		sizeof(unsigned int) / 2;
-
-	ksm_inter_vma_table = vmalloc(allocsize);
-	if (!ksm_inter_vma_table) {
+	allocsize = sizeof(struct hlist_head) << ksm_vma_pair_hash_bits;
+	ksm_vma_pair_hash = vmalloc(allocsize);
+	if (!ksm_vma_pair_hash) {
 		err = ENOMEM;
 		goto out_free3;
 	}
 
-	memset(ksm_inter_vma_table, 0, allocsize);
-
-	ksm_vma_table = kzalloc(sizeof(struct vma_slot *) *
-				ksm_vma_table_size, GFP_KERNEL);
-
-	if (!ksm_vma_table) {
-		printk(KERN_ERR "ksm_vma_table allocation failed, size=%d\n",
-		       ksm_vma_table_size);
-		err = ENOMEM;
-		goto out;
-	}
+	for (i = 0; i < (1UL << ksm_vma_pair_hash_bits); i++)
+		INIT_HLIST_HEAD(&ksm_vma_pair_hash[i]);
 
 	err = init_random_sampling();
 	if (err)
@@ -4655,11 +14115,19 @@ static int __init ksm_init(void)
 		err = PTR_ERR(ksm_thread);
 		goto out_free1;
 	}
+	ksm_scan_workers[0] = ksm_thread;
 
 #ifdef CONFIG_SYSFS
-	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
+	err = -ENOMEM;
+	ksm_kobj = kobject_create_and_add("ksm", mm_kobj);
+	if (ksm_kobj)
+		err = sysfs_create_group(ksm_kobj, &ksm_attr_group);
+	if (!err)
+		err = sysfs_create_group(ksm_kobj, &ksm_ladder_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
+		if (ksm_kobj)
+			kobject_put(ksm_kobj);
 		kthread_stop(ksm_thread);
 		goto out_free1;
 	}
@@ -4675,14 +14143,18 @@ static int __init ksm_init(void)
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
 #endif
+	register_shrinker(&ksm_shrinker);
+	ksm_debugfs_init();
+	ksm_bench_init();
 	return 0;
 
 out_free1:
 	ksm_slab_free();
 out_free4:
+	kfree(zero_hash_table);
 	kfree(random_nums);
 out_free:
-	vfree(ksm_inter_vma_table);
+	vfree(ksm_vma_pair_hash);
 out_free3:
 	kfree(ksm_scan_ladder);
 
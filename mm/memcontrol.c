@@ -265,11 +265,27 @@ struct mem_cgroup {
 	 */
 	struct mem_cgroup_stat_cpu *stat;
 	/*
-	 * used when a cpu is offlined or other synchronizations
-	 * See mem_cgroup_read_stat().
+	 * used for MEM_CGROUP_ON_MOVE when a cpu is offlined
 	 */
 	struct mem_cgroup_stat_cpu nocpu_base;
 	spinlock_t pcp_counter_lock;
+	/*
+	 * The per cpu counters folded, of this cgroup and of its hierarchy.
+	 * See mem_cgroup_stat_fold().
+	 */
+	atomic_long_t stat_local[MEM_CGROUP_STAT_DATA];
+	atomic_long_t stat_total[MEM_CGROUP_STAT_DATA];
+
+#ifdef CONFIG_KSM
+	/*
+	 * The lowest scan rung of the KSM scanner for the areas of this
+	 * cgroup, -1 if they must not be merged at all.
+	 */
+	int ksm_priority;
+	/* the most KSM page mappings its areas may have, 0 for no limit */
+	unsigned long ksm_merge_budget;
+	atomic_long_t ksm_stat[MEM_CGROUP_KSM_NSTATS];
+#endif
 };
 
 /* Stuffs for move charges at task migration. */
@@ -547,40 +563,71 @@ mem_cgroup_largest_soft_limit_node(struct mem_cgroup_tree_per_zone *mctz)
 }
 
 /*
- * Implementation Note: reading percpu statistics for memcg.
+ * Implementation Note: the statistics of memcg, as vmstat[] does.
  *
- * Both of vmstat[] and percpu_counter has threshold and do periodic
- * synchronization to implement "quick" read. There are trade-off between
- * reading cost and precision of value. Then, we may have a chance to implement
- * a periodic synchronizion of counter in memcg's counter.
- *
- * But this _read() function is used for user interface now. The user accounts
- * memory usage by memory cgroup and he _always_ requires exact value because
- * he accounts memory. Even if we provide quick-and-fuzzy read, we always
- * have to visit all online cpus and make sum. So, for now, unnecessary
- * synchronization is not implemented. (just implemented for cpu hotplug)
- *
- * If there are kernel internal actions which can make use of some not-exact
- * value, and reading all cpu value can be performance bottleneck in some
- * common workload, threashold and synchonization as vmstat[] should be
- * implemented.
+ * Each cpu collects its changes to the MEM_CGROUP_STAT_DATA counters of a
+ * memcg in mem->stat, and folds them into the atomic stat_local of the memcg
+ * and stat_total of it and its hierarchical parents when they go beyond
+ * MEM_CGROUP_STAT_THRESHOLD, or every sysctl_stat_interval from
+ * memcg_stat_update(), or when the cpu goes away. Reading a counter, local
+ * or for the whole hierarchy below, is then one atomic read whatever the
+ * number of cpus and cgroups, at most the thresholds of the cpus off until
+ * their next periodic fold.
+ */
+#define MEM_CGROUP_STAT_THRESHOLD	32
+
+static void mem_cgroup_stat_fold(struct mem_cgroup *mem,
+				 enum mem_cgroup_stat_index idx, s64 val)
+{
+	atomic_long_add(val, &mem->stat_local[idx]);
+	for (; mem; mem = parent_mem_cgroup(mem))
+		atomic_long_add(val, &mem->stat_total[idx]);
+}
+
+/* Must be called with preemption disabled */
+static void __mem_cgroup_stat_add(struct mem_cgroup *mem,
+				  enum mem_cgroup_stat_index idx, int val)
+{
+	s64 x = __this_cpu_read(mem->stat->count[idx]) + val;
+
+	if (unlikely(x > MEM_CGROUP_STAT_THRESHOLD ||
+		     x < -MEM_CGROUP_STAT_THRESHOLD)) {
+		mem_cgroup_stat_fold(mem, idx, x);
+		x = 0;
+	}
+	__this_cpu_write(mem->stat->count[idx], x);
+}
+
+static void mem_cgroup_stat_add(struct mem_cgroup *mem,
+				enum mem_cgroup_stat_index idx, int val)
+{
+	preempt_disable();
+	__mem_cgroup_stat_add(mem, idx, val);
+	preempt_enable();
+}
+
+/*
+ * Fold the changes @cpu has collected for @mem: from @cpu itself with
+ * preemption disabled, or when @cpu or @mem is dead.
  */
+static void mem_cgroup_stat_fold_cpu(struct mem_cgroup *mem, int cpu)
+{
+	int i;
+	s64 x;
+
+	for (i = 0; i < MEM_CGROUP_STAT_DATA; i++) {
+		x = per_cpu(mem->stat->count[i], cpu);
+		if (x) {
+			per_cpu(mem->stat->count[i], cpu) = 0;
+			mem_cgroup_stat_fold(mem, i, x);
+		}
+	}
+}
+
 static s64 mem_cgroup_read_stat(struct mem_cgroup *mem,
 		enum mem_cgroup_stat_index idx)
 {
-	int cpu;
-	s64 val = 0;
-
-	get_online_cpus();
-	for_each_online_cpu(cpu)
-		val += per_cpu(mem->stat->count[idx], cpu);
-#ifdef CONFIG_HOTPLUG_CPU
-	spin_lock(&mem->pcp_counter_lock);
-	val += mem->nocpu_base.count[idx];
-	spin_unlock(&mem->pcp_counter_lock);
-#endif
-	put_online_cpus();
-	return val;
+	return atomic_long_read(&mem->stat_local[idx]);
 }
 
 static s64 mem_cgroup_local_usage(struct mem_cgroup *mem)
@@ -596,7 +643,7 @@ static void mem_cgroup_swap_statistics(struct mem_cgroup *mem,
 					 bool charge)
 {
 	int val = (charge) ? 1 : -1;
-	this_cpu_add(mem->stat->count[MEM_CGROUP_STAT_SWAPOUT], val);
+	mem_cgroup_stat_add(mem, MEM_CGROUP_STAT_SWAPOUT, val);
 }
 
 static void mem_cgroup_charge_statistics(struct mem_cgroup *mem,
@@ -605,15 +652,15 @@ static void mem_cgroup_charge_statistics(struct mem_cgroup *mem,
 	preempt_disable();
 
 	if (file)
-		__this_cpu_add(mem->stat->count[MEM_CGROUP_STAT_CACHE], nr_pages);
+		__mem_cgroup_stat_add(mem, MEM_CGROUP_STAT_CACHE, nr_pages);
 	else
-		__this_cpu_add(mem->stat->count[MEM_CGROUP_STAT_RSS], nr_pages);
+		__mem_cgroup_stat_add(mem, MEM_CGROUP_STAT_RSS, nr_pages);
 
 	/* pagein of a big page is an event. So, ignore page size */
 	if (nr_pages > 0)
-		__this_cpu_inc(mem->stat->count[MEM_CGROUP_STAT_PGPGIN_COUNT]);
+		__mem_cgroup_stat_add(mem, MEM_CGROUP_STAT_PGPGIN_COUNT, 1);
 	else {
-		__this_cpu_inc(mem->stat->count[MEM_CGROUP_STAT_PGPGOUT_COUNT]);
+		__mem_cgroup_stat_add(mem, MEM_CGROUP_STAT_PGPGOUT_COUNT, 1);
 		nr_pages = -nr_pages; /* for event */
 	}
 
@@ -779,6 +826,44 @@ static struct mem_cgroup *mem_cgroup_get_next(struct mem_cgroup *iter,
 #define for_each_mem_cgroup_all(iter) \
 	for_each_mem_cgroup_tree_cond(iter, NULL, true)
 
+/* the periodic fold of the stats, see mem_cgroup_stat_fold() */
+static DEFINE_PER_CPU(struct delayed_work, memcg_stat_work);
+
+static void memcg_stat_update(struct work_struct *w)
+{
+	struct mem_cgroup *iter;
+
+	for_each_mem_cgroup_all(iter) {
+		preempt_disable();
+		mem_cgroup_stat_fold_cpu(iter, smp_processor_id());
+		preempt_enable();
+	}
+	schedule_delayed_work(&__get_cpu_var(memcg_stat_work),
+		round_jiffies_relative(sysctl_stat_interval));
+}
+
+static void __cpuinit memcg_stat_start(int cpu)
+{
+	/* already pending if it was brought up before memcg_stat_init() */
+	schedule_delayed_work_on(cpu, &per_cpu(memcg_stat_work, cpu),
+				 __round_jiffies_relative(HZ, cpu));
+}
+
+static int __init memcg_stat_init(void)
+{
+	int cpu;
+
+	if (mem_cgroup_disabled())
+		return 0;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+		memcg_stat_start(cpu);
+	put_online_cpus();
+	return 0;
+}
+module_init(memcg_stat_init);
+
 
 static inline bool mem_cgroup_is_root(struct mem_cgroup *mem)
 {
@@ -917,6 +1002,36 @@ void mem_cgroup_move_lists(struct page *page,
 	mem_cgroup_add_lru_list(page, to);
 }
 
+/**
+ * mem_cgroup_scan_tasks - call @fn on the tasks of @mem's cgroups
+ * @mem: the memcg, with its descendants if it uses the hierarchy
+ * @fn: called on each task, the scan stops when it returns non-zero
+ * @arg: passed on to @fn
+ *
+ * The cost depends only on the number of tasks in the memcg.  @fn is
+ * called under css_set_lock and must not sleep.  Returns what @fn
+ * returned last.
+ */
+int mem_cgroup_scan_tasks(struct mem_cgroup *mem,
+			  int (*fn)(struct task_struct *, void *), void *arg)
+{
+	struct mem_cgroup *iter;
+	int ret = 0;
+
+	for_each_mem_cgroup_tree_cond(iter, mem, !ret) {
+		struct cgroup *cgroup = iter->css.cgroup;
+		struct task_struct *task;
+		struct cgroup_iter it;
+
+		cgroup_iter_start(cgroup, &it);
+		while (!ret && (task = cgroup_iter_next(cgroup, &it)))
+			ret = fn(task, arg);
+		cgroup_iter_end(cgroup, &it);
+	}
+
+	return ret;
+}
+
 int task_in_mem_cgroup(struct task_struct *task, const struct mem_cgroup *mem)
 {
 	int ret;
@@ -1067,7 +1182,7 @@ unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 		if (scan >= nr_to_scan)
 			break;
 
-		page = pc->page;
+		page = lookup_cgroup_page(pc);
 		if (unlikely(!PageCgroupUsed(pc)))
 			continue;
 		if (unlikely(!PageLRU(page)))
@@ -1647,7 +1762,7 @@ void mem_cgroup_update_page_stat(struct page *page,
 		BUG();
 	}
 
-	this_cpu_add(mem->stat->count[idx], val);
+	mem_cgroup_stat_add(mem, idx, val);
 
 out:
 	if (unlikely(need_unlock))
@@ -1659,12 +1774,16 @@ EXPORT_SYMBOL(mem_cgroup_update_page_stat);
 
 /*
  * size of first charge trial. "32" comes from vmscan.c's magic value.
- * TODO: maybe necessary to use big numbers in big irons.
+ * A cpu charging fast doubles its batch at each refill, up to
+ * CHARGE_SIZE_MAX, see memcg_stock_batch().
  */
 #define CHARGE_SIZE	(32 * PAGE_SIZE)
+#define CHARGE_SIZE_MAX	(1024 * PAGE_SIZE)
 struct memcg_stock_pcp {
 	struct mem_cgroup *cached; /* this never be root cgroup */
 	int charge;
+	int batch;		/* the size of the last refill */
+	unsigned long stamp;	/* jiffies at the last refill */
 	struct work_struct work;
 };
 static DEFINE_PER_CPU(struct memcg_stock_pcp, memcg_stock);
@@ -1718,9 +1837,10 @@ static void drain_local_stock(struct work_struct *dummy)
 
 /*
  * Cache charges(val) which is from res_counter, to local per_cpu area.
- * This will be consumed by consume_stock() function, later.
+ * This will be consumed by consume_stock() function, later. @batch is
+ * what was charged for it, with the page the refill was needed for.
  */
-static void refill_stock(struct mem_cgroup *mem, int val)
+static void refill_stock(struct mem_cgroup *mem, int val, int batch)
 {
 	struct memcg_stock_pcp *stock = &get_cpu_var(memcg_stock);
 
@@ -1729,6 +1849,66 @@ static void refill_stock(struct mem_cgroup *mem, int val)
 		stock->cached = mem;
 	}
 	stock->charge += val;
+	stock->batch = batch;
+	stock->stamp = jiffies;
+	put_cpu_var(memcg_stock);
+}
+
+/*
+ * The room left under the limits of @mem itself, read racily: it only
+ * sizes a batch, which is charged for real afterwards.
+ */
+static unsigned long long mem_cgroup_headroom(struct mem_cgroup *mem)
+{
+	unsigned long long room, limit, usage;
+
+	limit = ACCESS_ONCE(mem->res.limit);
+	usage = ACCESS_ONCE(mem->res.usage);
+	room = usage < limit ? limit - usage : 0;
+	if (do_swap_account) {
+		limit = ACCESS_ONCE(mem->memsw.limit);
+		usage = ACCESS_ONCE(mem->memsw.usage);
+		room = min(room, usage < limit ? limit - usage : 0);
+	}
+	return room;
+}
+
+/*
+ * How much to charge @mem at once when the stock of this cpu runs out.
+ * Running out again within HZ/10 of the last refill doubles the batch,
+ * an idle second or another memcg start over from CHARGE_SIZE. Above
+ * that, no cpu stocks more than its share of half the headroom left,
+ * so that the stocks shrink by themselves when nearing the limit rather
+ * than having to be drained.
+ */
+static int memcg_stock_batch(struct mem_cgroup *mem)
+{
+	struct memcg_stock_pcp *stock = &get_cpu_var(memcg_stock);
+	unsigned long long share;
+	int batch = stock->batch;
+
+	if (stock->cached != mem || batch < CHARGE_SIZE ||
+	    time_after(jiffies, stock->stamp + HZ))
+		batch = CHARGE_SIZE;
+	else if (time_before(jiffies, stock->stamp + HZ / 10 + 1))
+		batch = min_t(int, batch * 2, CHARGE_SIZE_MAX);
+	put_cpu_var(memcg_stock);
+
+	if (batch > CHARGE_SIZE) {
+		share = mem_cgroup_headroom(mem);
+		do_div(share, 2 * num_online_cpus());
+		if (share < batch)
+			batch = max_t(int, share & PAGE_MASK, CHARGE_SIZE);
+	}
+	return batch;
+}
+
+/* A batch failed: the next one of this cpu starts over from CHARGE_SIZE */
+static void memcg_stock_batch_reset(void)
+{
+	struct memcg_stock_pcp *stock = &get_cpu_var(memcg_stock);
+
+	stock->batch = 0;
 	put_cpu_var(memcg_stock);
 }
 
@@ -1771,20 +1951,14 @@ static void drain_all_stock_sync(void)
 }
 
 /*
- * This function drains percpu counter value from DEAD cpu and
- * move it to local cpu. Note that this function can be preempted.
+ * This function folds the percpu counter values of a DEAD cpu.
+ * Note that this function can be preempted.
  */
 static void mem_cgroup_drain_pcp_counter(struct mem_cgroup *mem, int cpu)
 {
-	int i;
+	mem_cgroup_stat_fold_cpu(mem, cpu);
 
 	spin_lock(&mem->pcp_counter_lock);
-	for (i = 0; i < MEM_CGROUP_STAT_DATA; i++) {
-		s64 x = per_cpu(mem->stat->count[i], cpu);
-
-		per_cpu(mem->stat->count[i], cpu) = 0;
-		mem->nocpu_base.count[i] += x;
-	}
 	/* need to clear ON_MOVE value, works as a kind of lock. */
 	per_cpu(mem->stat->count[MEM_CGROUP_ON_MOVE], cpu) = 0;
 	spin_unlock(&mem->pcp_counter_lock);
@@ -1810,10 +1984,21 @@ static int __cpuinit memcg_cpu_hotplug_callback(struct notifier_block *nb,
 	if ((action == CPU_ONLINE)) {
 		for_each_mem_cgroup_all(iter)
 			synchronize_mem_cgroup_on_move(iter, cpu);
+		memcg_stat_start(cpu);
+		return NOTIFY_OK;
+	}
+
+	if (action == CPU_DOWN_PREPARE || action == CPU_DOWN_PREPARE_FROZEN) {
+		cancel_delayed_work_sync(&per_cpu(memcg_stat_work, cpu));
 		return NOTIFY_OK;
 	}
 
-	if ((action != CPU_DEAD) || action != CPU_DEAD_FROZEN)
+	if (action == CPU_DOWN_FAILED || action == CPU_DOWN_FAILED_FROZEN) {
+		memcg_stat_start(cpu);
+		return NOTIFY_OK;
+	}
+
+	if (action != CPU_DEAD && action != CPU_DEAD_FROZEN)
 		return NOTIFY_OK;
 
 	for_each_mem_cgroup_all(iter)
@@ -1835,7 +2020,7 @@ enum {
 };
 
 static int __mem_cgroup_do_charge(struct mem_cgroup *mem, gfp_t gfp_mask,
-				int csize, bool oom_check)
+				int csize, int page_size, bool oom_check)
 {
 	struct mem_cgroup *mem_over_limit;
 	struct res_counter *fail_res;
@@ -1858,13 +2043,13 @@ static int __mem_cgroup_do_charge(struct mem_cgroup *mem, gfp_t gfp_mask,
 		mem_over_limit = mem_cgroup_from_res_counter(fail_res, res);
 	/*
 	 * csize can be either a huge page (HPAGE_SIZE), a batch of
-	 * regular pages (CHARGE_SIZE), or a single regular page
+	 * regular pages (memcg_stock_batch()), or a single regular page
 	 * (PAGE_SIZE).
 	 *
 	 * Never reclaim on behalf of optional batching, retry with a
 	 * single page instead.
 	 */
-	if (csize == CHARGE_SIZE)
+	if (csize > page_size)
 		return CHARGE_RETRY;
 
 	if (!(gfp_mask & __GFP_WAIT))
@@ -1913,9 +2098,10 @@ static int __mem_cgroup_try_charge(struct mm_struct *mm,
 				   int page_size)
 {
 	int nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
+	bool batched = false;
 	struct mem_cgroup *mem = NULL;
 	int ret;
-	int csize = max(CHARGE_SIZE, (unsigned long) page_size);
+	int csize = page_size;
 
 	/*
 	 * Unlike gloval-vm's OOM-kill, we're not in memory shortage
@@ -1998,12 +2184,20 @@ again:
 			nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
 		}
 
-		ret = __mem_cgroup_do_charge(mem, gfp_mask, csize, oom_check);
+		if (!batched && page_size == PAGE_SIZE) {
+			csize = memcg_stock_batch(mem);
+			batched = true;
+		}
+
+		ret = __mem_cgroup_do_charge(mem, gfp_mask, csize, page_size,
+					     oom_check);
 
 		switch (ret) {
 		case CHARGE_OK:
 			break;
 		case CHARGE_RETRY: /* not in OOM situation but retry */
+			if (csize > page_size)
+				memcg_stock_batch_reset();
 			csize = page_size;
 			css_put(&mem->css);
 			mem = NULL;
@@ -2026,7 +2220,7 @@ again:
 	} while (ret != CHARGE_OK);
 
 	if (csize > page_size)
-		refill_stock(mem, csize - page_size);
+		refill_stock(mem, csize - page_size, csize);
 	css_put(&mem->css);
 done:
 	*memcg = mem;
@@ -2158,11 +2352,12 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *mem,
 	 * Insert ancestor (and ancestor's ancestors), to softlimit RB-tree.
 	 * if they exceeds softlimit.
 	 */
-	memcg_check_events(mem, pc->page);
+	memcg_check_events(mem, lookup_cgroup_page(pc));
 }
 
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 
+/* the array id in the flags is copied too: a huge page is in one array */
 #define PCGF_NOCOPY_AT_SPLIT ((1 << PCG_LOCK) | (1 << PCG_MOVE_LOCK) |\
 			(1 << PCG_ACCT_LRU) | (1 << PCG_MIGRATION))
 /*
@@ -2227,7 +2422,7 @@ static void __mem_cgroup_move_account(struct page_cgroup *pc,
 	int nr_pages = charge_size >> PAGE_SHIFT;
 
 	VM_BUG_ON(from == to);
-	VM_BUG_ON(PageLRU(pc->page));
+	VM_BUG_ON(PageLRU(lookup_cgroup_page(pc)));
 	VM_BUG_ON(!page_is_cgroup_locked(pc));
 	VM_BUG_ON(!PageCgroupUsed(pc));
 	VM_BUG_ON(pc->mem_cgroup != from);
@@ -2235,8 +2430,8 @@ static void __mem_cgroup_move_account(struct page_cgroup *pc,
 	if (PageCgroupFileMapped(pc)) {
 		/* Update mapped_file data for mem_cgroup */
 		preempt_disable();
-		__this_cpu_dec(from->stat->count[MEM_CGROUP_STAT_FILE_MAPPED]);
-		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_MAPPED]);
+		__mem_cgroup_stat_add(from, MEM_CGROUP_STAT_FILE_MAPPED, -1);
+		__mem_cgroup_stat_add(to, MEM_CGROUP_STAT_FILE_MAPPED, 1);
 		preempt_enable();
 	}
 	mem_cgroup_charge_statistics(from, PageCgroupCache(pc), -nr_pages);
@@ -2264,6 +2459,7 @@ static int mem_cgroup_move_account(struct page_cgroup *pc,
 		struct mem_cgroup *from, struct mem_cgroup *to,
 		bool uncharge, int charge_size)
 {
+	struct page *page = lookup_cgroup_page(pc);
 	int ret = -EINVAL;
 	unsigned long flags;
 	/*
@@ -2272,7 +2468,7 @@ static int mem_cgroup_move_account(struct page_cgroup *pc,
 	 * Do this check under compound_page_lock(). The caller should
 	 * hold it.
 	 */
-	if ((charge_size > PAGE_SIZE) && !PageTransHuge(pc->page))
+	if ((charge_size > PAGE_SIZE) && !PageTransHuge(page))
 		return -EBUSY;
 
 	lock_page_cgroup(pc);
@@ -2286,8 +2482,8 @@ static int mem_cgroup_move_account(struct page_cgroup *pc,
 	/*
 	 * check events
 	 */
-	memcg_check_events(to, pc->page);
-	memcg_check_events(from, pc->page);
+	memcg_check_events(to, page);
+	memcg_check_events(from, page);
 	return ret;
 }
 
@@ -2299,7 +2495,7 @@ static int mem_cgroup_move_parent(struct page_cgroup *pc,
 				  struct mem_cgroup *child,
 				  gfp_t gfp_mask)
 {
-	struct page *page = pc->page;
+	struct page *page = lookup_cgroup_page(pc);
 	struct cgroup *cg = child->css.cgroup;
 	struct cgroup *pcg = cg->parent;
 	struct mem_cgroup *parent;
@@ -3454,12 +3650,8 @@ static int mem_cgroup_hierarchy_write(struct cgroup *cont, struct cftype *cft,
 static u64 mem_cgroup_get_recursive_idx_stat(struct mem_cgroup *mem,
 				enum mem_cgroup_stat_index idx)
 {
-	struct mem_cgroup *iter;
-	s64 val = 0;
-
 	/* each per cpu's value can be minus.Then, use s64 */
-	for_each_mem_cgroup_tree(iter, mem)
-		val += mem_cgroup_read_stat(iter, idx);
+	s64 val = atomic_long_read(&mem->stat_total[idx]);
 
 	if (val < 0) /* race ? */
 		val = 0;
@@ -3690,28 +3882,32 @@ struct {
 };
 
 
+/* the per cpu stats folded for @mem, or for its whole hierarchy */
 static void
-mem_cgroup_get_local_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
+mem_cgroup_get_cpu_stat(struct mem_cgroup *mem, struct mcs_total_stat *s,
+			atomic_long_t *stat)
+{
+	s->stat[MCS_CACHE] +=
+		atomic_long_read(&stat[MEM_CGROUP_STAT_CACHE]) * PAGE_SIZE;
+	s->stat[MCS_RSS] +=
+		atomic_long_read(&stat[MEM_CGROUP_STAT_RSS]) * PAGE_SIZE;
+	s->stat[MCS_FILE_MAPPED] +=
+		atomic_long_read(&stat[MEM_CGROUP_STAT_FILE_MAPPED]) * PAGE_SIZE;
+	s->stat[MCS_PGPGIN] +=
+		atomic_long_read(&stat[MEM_CGROUP_STAT_PGPGIN_COUNT]);
+	s->stat[MCS_PGPGOUT] +=
+		atomic_long_read(&stat[MEM_CGROUP_STAT_PGPGOUT_COUNT]);
+	if (do_swap_account)
+		s->stat[MCS_SWAP] +=
+			atomic_long_read(&stat[MEM_CGROUP_STAT_SWAPOUT]) *
+			PAGE_SIZE;
+}
+
+static void
+mem_cgroup_get_zone_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
 {
 	s64 val;
 
-	/* per cpu stat */
-	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_CACHE);
-	s->stat[MCS_CACHE] += val * PAGE_SIZE;
-	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_RSS);
-	s->stat[MCS_RSS] += val * PAGE_SIZE;
-	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_FILE_MAPPED);
-	s->stat[MCS_FILE_MAPPED] += val * PAGE_SIZE;
-	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_PGPGIN_COUNT);
-	s->stat[MCS_PGPGIN] += val;
-	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_PGPGOUT_COUNT);
-	s->stat[MCS_PGPGOUT] += val;
-	if (do_swap_account) {
-		val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_SWAPOUT);
-		s->stat[MCS_SWAP] += val * PAGE_SIZE;
-	}
-
-	/* per zone stat */
 	val = mem_cgroup_get_local_zonestat(mem, LRU_INACTIVE_ANON);
 	s->stat[MCS_INACTIVE_ANON] += val * PAGE_SIZE;
 	val = mem_cgroup_get_local_zonestat(mem, LRU_ACTIVE_ANON);
@@ -3724,13 +3920,21 @@ mem_cgroup_get_local_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
 	s->stat[MCS_UNEVICTABLE] += val * PAGE_SIZE;
 }
 
+static void
+mem_cgroup_get_local_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
+{
+	mem_cgroup_get_cpu_stat(mem, s, mem->stat_local);
+	mem_cgroup_get_zone_stat(mem, s);
+}
+
 static void
 mem_cgroup_get_total_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
 {
 	struct mem_cgroup *iter;
 
+	mem_cgroup_get_cpu_stat(mem, s, mem->stat_total);
 	for_each_mem_cgroup_tree(iter, mem)
-		mem_cgroup_get_local_stat(iter, s);
+		mem_cgroup_get_zone_stat(iter, s);
 }
 
 static int mem_control_stat_show(struct cgroup *cont, struct cftype *cft,
@@ -3837,6 +4041,105 @@ static int mem_cgroup_swappiness_write(struct cgroup *cgrp, struct cftype *cft,
 	return 0;
 }
 
+#ifdef CONFIG_KSM
+/*
+ * The KSM scanner keeps a reference on the memcg of each area it scans,
+ * taken when the area enters the scanner.
+ */
+struct mem_cgroup *mem_cgroup_ksm_get(struct mm_struct *mm)
+{
+	if (mem_cgroup_disabled())
+		return NULL;
+
+	return try_get_mem_cgroup_from_mm(mm);
+}
+
+void mem_cgroup_ksm_put(struct mem_cgroup *mem)
+{
+	if (mem)
+		css_put(&mem->css);
+}
+
+int mem_cgroup_ksm_priority(struct mem_cgroup *mem)
+{
+	return mem ? mem->ksm_priority : 0;
+}
+
+void mem_cgroup_ksm_stat(struct mem_cgroup *mem,
+			 enum mem_cgroup_ksm_stat_item idx, long val)
+{
+	if (mem)
+		atomic_long_add(val, &mem->ksm_stat[idx]);
+}
+
+/*
+ * Has the cgroup used up its merge budget? The check is racy against the
+ * merges of other scanner threads, a batch may go over it by a few pages.
+ */
+int mem_cgroup_ksm_over_budget(struct mem_cgroup *mem)
+{
+	unsigned long budget;
+
+	if (!mem)
+		return 0;
+
+	budget = ACCESS_ONCE(mem->ksm_merge_budget);
+	return budget &&
+	       atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_MERGED]) >=
+	       (long)budget;
+}
+
+static s64 mem_cgroup_ksm_priority_read(struct cgroup *cgrp,
+					struct cftype *cft)
+{
+	return mem_cgroup_from_cont(cgrp)->ksm_priority;
+}
+
+static int mem_cgroup_ksm_priority_write(struct cgroup *cgrp,
+					 struct cftype *cft, s64 val)
+{
+	if (val < -1 || val > INT_MAX)
+		return -EINVAL;
+
+	mem_cgroup_from_cont(cgrp)->ksm_priority = val;
+	return 0;
+}
+
+static u64 mem_cgroup_ksm_merge_budget_read(struct cgroup *cgrp,
+					    struct cftype *cft)
+{
+	return mem_cgroup_from_cont(cgrp)->ksm_merge_budget;
+}
+
+static int mem_cgroup_ksm_merge_budget_write(struct cgroup *cgrp,
+					     struct cftype *cft, u64 val)
+{
+	if (val > LONG_MAX)
+		return -EINVAL;
+
+	mem_cgroup_from_cont(cgrp)->ksm_merge_budget = val;
+	return 0;
+}
+
+static int mem_cgroup_ksm_stat_read(struct cgroup *cgrp, struct cftype *cft,
+				    struct cgroup_map_cb *cb)
+{
+	struct mem_cgroup *mem = mem_cgroup_from_cont(cgrp);
+
+	cb->fill(cb, "pages_scanned",
+		 atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_SCANNED]));
+	cb->fill(cb, "pages_merged",
+		 atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_MERGED]));
+	cb->fill(cb, "pages_cowed",
+		 atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_COWED]));
+	cb->fill(cb, "pages_charged",
+		 atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_CHARGED]));
+	cb->fill(cb, "pages_over_budget",
+		 atomic_long_read(&mem->ksm_stat[MEM_CGROUP_KSM_PAGES_OVER_BUDGET]));
+	return 0;
+}
+#endif /* CONFIG_KSM */
+
 static void __mem_cgroup_threshold(struct mem_cgroup *memcg, bool swap)
 {
 	struct mem_cgroup_threshold_ary *t;
@@ -4231,6 +4534,22 @@ static struct cftype mem_cgroup_files[] = {
 		.unregister_event = mem_cgroup_oom_unregister_event,
 		.private = MEMFILE_PRIVATE(_OOM_TYPE, OOM_CONTROL),
 	},
+#ifdef CONFIG_KSM
+	{
+		.name = "ksm_priority",
+		.read_s64 = mem_cgroup_ksm_priority_read,
+		.write_s64 = mem_cgroup_ksm_priority_write,
+	},
+	{
+		.name = "ksm_merge_budget",
+		.read_u64 = mem_cgroup_ksm_merge_budget_read,
+		.write_u64 = mem_cgroup_ksm_merge_budget_write,
+	},
+	{
+		.name = "ksm_stat",
+		.read_map = mem_cgroup_ksm_stat_read,
+	},
+#endif
 };
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR_SWAP
@@ -4354,7 +4673,7 @@ out_free:
 
 static void __mem_cgroup_free(struct mem_cgroup *mem)
 {
-	int node;
+	int node, cpu;
 
 	mem_cgroup_remove_from_trees(mem);
 	free_css_id(&mem_cgroup_subsys, &mem->css);
@@ -4362,6 +4681,9 @@ static void __mem_cgroup_free(struct mem_cgroup *mem)
 	for_each_node_state(node, N_POSSIBLE)
 		free_mem_cgroup_per_zone_info(mem, node);
 
+	/* no cpu can change them any more */
+	for_each_possible_cpu(cpu)
+		mem_cgroup_stat_fold_cpu(mem, cpu);
 	free_percpu(mem->stat);
 	if (sizeof(struct mem_cgroup) < PAGE_SIZE)
 		kfree(mem);
@@ -4463,6 +4785,9 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 			struct memcg_stock_pcp *stock =
 						&per_cpu(memcg_stock, cpu);
 			INIT_WORK(&stock->work, drain_local_stock);
+			INIT_DELAYED_WORK_DEFERRABLE(
+				&per_cpu(memcg_stat_work, cpu),
+				memcg_stat_update);
 		}
 		hotcpu_notifier(memcg_cpu_hotplug_callback, 0);
 	} else {
@@ -4491,6 +4816,12 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 
 	if (parent)
 		mem->swappiness = get_swappiness(parent);
+#ifdef CONFIG_KSM
+	if (parent) {
+		mem->ksm_priority = parent->ksm_priority;
+		mem->ksm_merge_budget = parent->ksm_merge_budget;
+	}
+#endif
 	atomic_set(&mem->refcnt, 1);
 	mem->move_charge_at_immigrate = 0;
 	mutex_init(&mem->thresholds_lock);
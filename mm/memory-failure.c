@@ -287,7 +287,7 @@ struct to_kill {
  * TBD would GFP_NOIO be enough?
  */
 static void add_to_kill(struct task_struct *tsk, struct page *p,
-		       struct vm_area_struct *vma,
+		       struct vm_area_struct *vma, unsigned long addr,
 		       struct list_head *to_kill,
 		       struct to_kill **tkc)
 {
@@ -304,7 +304,7 @@ static void add_to_kill(struct task_struct *tsk, struct page *p,
 			return;
 		}
 	}
-	tk->addr = page_address_in_vma(p, vma);
+	tk->addr = addr;
 	tk->addr_valid = 1;
 
 	/*
@@ -400,7 +400,9 @@ static void collect_procs_anon(struct page *page, struct list_head *to_kill,
 			if (!page_mapped_in_vma(page, vma))
 				continue;
 			if (vma->vm_mm == tsk->mm)
-				add_to_kill(tsk, page, vma, to_kill, tkc);
+				add_to_kill(tsk, page, vma,
+					    page_address_in_vma(page, vma),
+					    to_kill, tkc);
 		}
 	}
 	page_unlock_anon_vma(av);
@@ -446,13 +448,69 @@ static void collect_procs_file(struct page *page, struct list_head *to_kill,
 			 * to be informed of all such data corruptions.
 			 */
 			if (vma->vm_mm == tsk->mm)
-				add_to_kill(tsk, page, vma, to_kill, tkc);
+				add_to_kill(tsk, page, vma,
+					    page_address_in_vma(page, vma),
+					    to_kill, tkc);
 		}
 	}
 	spin_unlock(&mapping->i_mmap_lock);
 	read_unlock(&tasklist_lock);
 }
 
+#if defined(CONFIG_KSM) && defined(CONFIG_MIGRATION)
+/* The most vmas the rmap walk of a KSM page looks at for processes */
+#define KSM_COLLECT_MAX		4096
+
+struct ksm_collect {
+	struct list_head *to_kill;
+	struct to_kill **tkc;
+	int budget;
+};
+
+static int collect_procs_ksm_one(struct page *page, struct vm_area_struct *vma,
+				 unsigned long addr, void *arg)
+{
+	struct ksm_collect *kc = arg;
+	struct task_struct *tsk;
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	if (!kc->budget--)
+		return SWAP_FAIL;
+
+	/* given a copy of the page by ksm_memory_failure() */
+	pte = page_check_address(page, vma->vm_mm, addr, &ptl, 0);
+	if (!pte)
+		return SWAP_AGAIN;
+	pte_unmap_unlock(pte, ptl);
+
+	for_each_process(tsk) {
+		if (task_early_kill(tsk) && tsk->mm == vma->vm_mm)
+			add_to_kill(tsk, page, vma, addr, kc->to_kill, kc->tkc);
+	}
+	return SWAP_AGAIN;
+}
+
+/*
+ * Collect processes when the error hit a KSM page: its stable node knows
+ * where it is mapped, a bounded walk of it finds them.
+ */
+static void collect_procs_ksm(struct page *page, struct list_head *to_kill,
+			      struct to_kill **tkc)
+{
+	struct ksm_collect kc = { to_kill, tkc, KSM_COLLECT_MAX };
+
+	read_lock(&tasklist_lock);
+	rmap_walk_ksm(page, collect_procs_ksm_one, &kc);
+	read_unlock(&tasklist_lock);
+}
+#else
+static void collect_procs_ksm(struct page *page, struct list_head *to_kill,
+			      struct to_kill **tkc)
+{
+}
+#endif
+
 /*
  * Collect the processes who have the corrupted page mapped to kill.
  * This is done in two steps for locking reasons.
@@ -469,7 +527,9 @@ static void collect_procs(struct page *page, struct list_head *tokill)
 	tk = kmalloc(sizeof(struct to_kill), GFP_NOIO);
 	if (!tk)
 		return;
-	if (PageAnon(page))
+	if (PageKsm(page))
+		collect_procs_ksm(page, tokill, &tk);
+	else if (PageAnon(page))
 		collect_procs_anon(page, tokill, &tk);
 	else
 		collect_procs_file(page, tokill, &tk);
@@ -866,8 +926,12 @@ static int hwpoison_user_mappings(struct page *p, unsigned long pfn,
 	if (!page_mapped(hpage))
 		return SWAP_SUCCESS;
 
-	if (PageKsm(p))
-		return SWAP_FAIL;
+	/*
+	 * The mappings of a KSM page which a copy of it in the stable tree
+	 * can take over are given that copy, the others are unmapped below.
+	 */
+	if (PageKsm(p) && !ksm_memory_failure(p))
+		return SWAP_SUCCESS;
 
 	if (PageSwapCache(p)) {
 		printk(KERN_ERR
@@ -44,6 +44,7 @@
 #include <linux/mman.h>
 #include <linux/swap.h>
 #include <linux/highmem.h>
+#include <linux/prefetch.h>
 #include <linux/pagemap.h>
 #include <linux/ksm.h>
 #include <linux/rmap.h>
@@ -57,6 +58,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/debugfs.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -647,6 +649,50 @@ out:
 	return pfn_to_page(pfn);
 }
 
+/*
+ * The references fork takes on a run of ptes mapping the same page, as a
+ * KSM page merged from many does, are taken at once: one atomic operation
+ * on each count instead of one per pte. The parent's pte, under its lock
+ * until fork_batch_flush(), holds the page meanwhile.
+ */
+struct fork_batch {
+	struct page *page;
+	int nr;
+};
+
+static void fork_batch_flush(struct fork_batch *batch)
+{
+	struct page *page = batch->page;
+
+	if (!page)
+		return;
+
+	if (batch->nr == 1) {
+		get_page(page);
+		page_dup_rmap(page);
+	} else {
+		VM_BUG_ON(PageTail(page));
+		atomic_add(batch->nr, &page->_count);
+		atomic_add(batch->nr, &page->_mapcount);
+	}
+#ifdef CONFIG_KSM
+	if (PageKsm(page)) /* follows page_dup_rmap() */
+		mod_zone_page_state(page_zone(page), NR_KSM_PAGES_SHARING,
+				    batch->nr);
+#endif
+	batch->page = NULL;
+	batch->nr = 0;
+}
+
+static inline void fork_batch_add(struct fork_batch *batch, struct page *page)
+{
+	if (batch->page != page || PageTail(page)) {
+		fork_batch_flush(batch);
+		batch->page = page;
+	}
+	batch->nr++;
+}
+
 /*
  * copy one vm_area from one task to the other. Assumes the page tables
  * already present in the new task to be cleared in the whole range
@@ -656,7 +702,7 @@ out:
 static inline unsigned long
 copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		pte_t *dst_pte, pte_t *src_pte, struct vm_area_struct *vma,
-		unsigned long addr, int *rss)
+		unsigned long addr, int *rss, struct fork_batch *batch)
 {
 	unsigned long vm_flags = vma->vm_flags;
 	pte_t pte = *src_pte;
@@ -713,16 +759,11 @@ copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 
 	page = vm_normal_page(vma, addr, pte);
 	if (page) {
-		get_page(page);
-		page_dup_rmap(page);
+		fork_batch_add(batch, page);
 		if (PageAnon(page))
 			rss[MM_ANONPAGES]++;
 		else
 			rss[MM_FILEPAGES]++;
-#ifdef CONFIG_KSM
-		if (PageKsm(page)) /* follows page_dup_rmap() */
-			inc_zone_page_state(page, NR_KSM_PAGES_SHARING);
-#endif
 	}
 
 out_set_pte:
@@ -740,6 +781,7 @@ int copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	int progress = 0;
 	int rss[NR_MM_COUNTERS];
 	swp_entry_t entry = (swp_entry_t){0};
+	struct fork_batch batch = { NULL, 0 };
 
 again:
 	init_rss_vec(rss);
@@ -770,12 +812,13 @@ again:
 			continue;
 		}
 		entry.val = copy_one_pte(dst_mm, src_mm, dst_pte, src_pte,
-							vma, addr, rss);
+						vma, addr, rss, &batch);
 		if (entry.val)
 			break;
 		progress += 8;
 	} while (dst_pte++, src_pte++, addr += PAGE_SIZE, addr != end);
 
+	fork_batch_flush(&batch);
 	arch_leave_lazy_mmu_mode();
 	spin_unlock(src_ptl);
 	pte_unmap(orig_src_pte);
@@ -910,6 +953,36 @@ int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	return ret;
 }
 
+/*
+ * Likewise, zap_pte_range() drops the mappings and references of a run of
+ * ptes on the same page at once. The gather keeps the last reference until
+ * the tlb is flushed.
+ */
+struct zap_batch {
+	struct page *page;
+	int nr;
+	unsigned long addr;	/* of the last pte, for print_bad_pte() */
+	pte_t pte;
+};
+
+static void zap_batch_flush(struct mmu_gather *tlb, struct vm_area_struct *vma,
+			    struct zap_batch *batch)
+{
+	struct page *page = batch->page;
+
+	if (!page)
+		return;
+
+	page_remove_rmap_nr(page, batch->nr);
+	if (unlikely(page_mapcount(page) < 0))
+		print_bad_pte(vma, batch->addr, batch->pte, page);
+	if (batch->nr > 1)
+		atomic_sub(batch->nr - 1, &page->_count);
+	batch->page = NULL;
+	batch->nr = 0;
+	tlb_remove_page(tlb, page);
+}
+
 static unsigned long zap_pte_range(struct mmu_gather *tlb,
 				struct vm_area_struct *vma, pmd_t *pmd,
 				unsigned long addr, unsigned long end,
@@ -919,10 +992,12 @@ static unsigned long zap_pte_range(struct mmu_gather *tlb,
 	pte_t *pte;
 	spinlock_t *ptl;
 	int rss[NR_MM_COUNTERS];
+	struct zap_batch batch = { NULL, 0 };
 
 	init_rss_vec(rss);
 
 	pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	flush_tlb_batched_pending(mm);
 	arch_enter_lazy_mmu_mode();
 	do {
 		pte_t ptent = *pte;
@@ -975,10 +1050,13 @@ static unsigned long zap_pte_range(struct mmu_gather *tlb,
 					mark_page_accessed(page);
 				rss[MM_FILEPAGES]--;
 			}
-			page_remove_rmap(page);
-			if (unlikely(page_mapcount(page) < 0))
-				print_bad_pte(vma, addr, ptent, page);
-			tlb_remove_page(tlb, page);
+			if (batch.page != page || PageTail(page)) {
+				zap_batch_flush(tlb, vma, &batch);
+				batch.page = page;
+			}
+			batch.nr++;
+			batch.addr = addr;
+			batch.pte = ptent;
 			continue;
 		}
 		/*
@@ -1001,6 +1079,7 @@ static unsigned long zap_pte_range(struct mmu_gather *tlb,
 		pte_clear_not_present_full(mm, addr, pte, tlb->fullmm);
 	} while (pte++, addr += PAGE_SIZE, (addr != end && *zap_work > 0));
 
+	zap_batch_flush(tlb, vma, &batch);
 	add_mm_rss_vec(mm, rss);
 	arch_leave_lazy_mmu_mode();
 	pte_unmap_unlock(pte - 1, ptl);
@@ -1022,8 +1101,8 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		if (pmd_trans_huge(*pmd)) {
 			if (next-addr != HPAGE_PMD_SIZE) {
 				VM_BUG_ON(!rwsem_is_locked(&tlb->mm->mmap_sem));
-				split_huge_page_pmd(vma->vm_mm, pmd);
-			} else if (zap_huge_pmd(tlb, vma, pmd)) {
+				split_huge_page_pmd(vma, addr, pmd);
+			} else if (zap_huge_pmd(tlb, vma, pmd, addr)) {
 				(*zap_work)--;
 				continue;
 			}
@@ -1312,7 +1391,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	}
 	if (pmd_trans_huge(*pmd)) {
 		if (flags & FOLL_SPLIT) {
-			split_huge_page_pmd(mm, pmd);
+			split_huge_page_pmd(vma, address, pmd);
 			goto split_fallthrough;
 		}
 		spin_lock(&mm->page_table_lock);
@@ -1524,6 +1603,8 @@ int __get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 					fault_flags |= FAULT_FLAG_WRITE;
 				if (nonblocking)
 					fault_flags |= FAULT_FLAG_ALLOW_RETRY;
+				if (foll_flags & FOLL_NOWAIT)
+					fault_flags |= (FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_RETRY_NOWAIT);
 
 				ret = handle_mm_fault(mm, vma, start,
 							fault_flags);
@@ -1543,7 +1624,8 @@ int __get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 					tsk->min_flt++;
 
 				if (ret & VM_FAULT_RETRY) {
-					*nonblocking = 0;
+					if (nonblocking)
+						*nonblocking = 0;
 					return i;
 				}
 
@@ -1651,6 +1733,39 @@ int get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 }
 EXPORT_SYMBOL(get_user_pages);
 
+/**
+ * get_user_page_nowait() - pin one user page without sleeping on the fault
+ * @tsk:	task_struct of target task
+ * @mm:		mm_struct of target mm
+ * @start:	starting user address
+ * @write:	whether pages will be written to by the caller
+ * @force:	whether to force write access even if user mapping is
+ *		readonly. This will result in the page being COWed even
+ *		in MAP_SHARED mappings. You do not want this.
+ * @page:	the pinned page is returned here on success
+ *
+ * Like get_user_pages() of a single page, but if the fault would have to
+ * wait for a disk transfer or, when breaking the COW of a KSM page, for
+ * memory to be reclaimed, it is not waited upon and 0 is returned instead.
+ * mmap_sem is held on entry and still held on return in every case.
+ *
+ * Meant for callers, such as the KVM async page fault, which have a
+ * better use for the time than blocking and will come back later.
+ */
+int get_user_page_nowait(struct task_struct *tsk, struct mm_struct *mm,
+		unsigned long start, int write, int force, struct page **page)
+{
+	int flags = FOLL_TOUCH | FOLL_NOWAIT | FOLL_GET;
+
+	if (write)
+		flags |= FOLL_WRITE;
+	if (force)
+		flags |= FOLL_FORCE;
+
+	return __get_user_pages(tsk, mm, start, 1, flags, page, NULL, NULL);
+}
+EXPORT_SYMBOL(get_user_page_nowait);
+
 /**
  * get_dump_page() - pin user page in memory while writing it to core dump
  * @addr: user address
@@ -2165,8 +2280,11 @@ static inline void cow_user_page(struct page *dst, struct page *src, unsigned lo
 	} else {
 		copy_user_highpage(dst, src, va, vma);
 #ifdef CONFIG_KSM
-		if (vma->ksm_vma_slot && PageKsm(src))
-			vma->ksm_vma_slot->pages_cowed++;
+		if (vma->ksm_vma_slot && PageKsm(src)) {
+			ksm_vma_cowed(vma, va);
+			mem_cgroup_ksm_stat(vma->ksm_vma_slot->memcg,
+					    MEM_CGROUP_KSM_PAGES_COWED, 1);
+		}
 #endif
 	}
 }
@@ -2191,7 +2309,7 @@ static inline void cow_user_page(struct page *dst, struct page *src, unsigned lo
  */
 static int do_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pte_t *page_table, pmd_t *pmd,
-		spinlock_t *ptl, pte_t orig_pte)
+		spinlock_t *ptl, pte_t orig_pte, unsigned int flags)
 	__releases(ptl)
 {
 	struct page *old_page, *new_page;
@@ -2359,6 +2477,13 @@ reuse:
 gotten:
 	pte_unmap_unlock(page_table, ptl);
 
+	/*
+	 * A KSM page is shared by many and rarely hot in this cpu's cache:
+	 * get its lines on the way while the new page is being allocated.
+	 */
+	if (old_page && PageKsm(old_page) && !PageHighMem(old_page))
+		prefetch_range(page_address(old_page), PAGE_SIZE);
+
 	if (unlikely(anon_vma_prepare(vma)))
 		goto oom;
 
@@ -2367,9 +2492,26 @@ gotten:
 		if (!new_page)
 			goto oom;
 	} else {
-		new_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
-		if (!new_page)
-			goto oom;
+		/*
+		 * Breaking the COW of a KSM page is what a guest write to a
+		 * merged page ends up in: don't let it wait on reclaim when
+		 * the caller has something better to do meanwhile.
+		 */
+		if (old_page && PageKsm(old_page) &&
+		    (flags & FAULT_FLAG_RETRY_NOWAIT)) {
+			new_page = alloc_page_vma(
+					(GFP_HIGHUSER_MOVABLE & ~__GFP_WAIT) |
+					__GFP_NOWARN, vma, address);
+			if (!new_page) {
+				page_cache_release(old_page);
+				return VM_FAULT_RETRY;
+			}
+		} else {
+			new_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE,
+						  vma, address);
+			if (!new_page)
+				goto oom;
+		}
 		cow_user_page(new_page, old_page, address, vma);
 	}
 	__SetPageUptodate(new_page);
@@ -2739,8 +2881,8 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	page = lookup_swap_cache(entry);
 	if (!page) {
 		grab_swap_token(mm); /* Contend for token _before_ read-in */
-		page = swapin_readahead(entry,
-					GFP_HIGHUSER_MOVABLE, vma, address);
+		page = swapin_vma_readahead(entry, GFP_HIGHUSER_MOVABLE,
+					    vma, address, pmd);
 		if (!page) {
 			/*
 			 * Back out if somebody else faulted in this pte
@@ -2782,6 +2924,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (unlikely(!PageSwapCache(page) || page_private(page) != entry.val))
 		goto out_page;
 
+	ksm_swap_reshare_page(page, entry.val);
 	if (ksm_might_need_to_copy(page, vma, address)) {
 		swapcache = page;
 		page = ksm_does_need_to_copy(page, vma, address);
@@ -2858,7 +3001,8 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	}
 
 	if (flags & FAULT_FLAG_WRITE) {
-		ret |= do_wp_page(mm, vma, address, page_table, pmd, ptl, pte);
+		ret |= do_wp_page(mm, vma, address, page_table, pmd, ptl, pte,
+				  flags);
 		if (ret & VM_FAULT_ERROR)
 			ret &= VM_FAULT_ERROR;
 		goto out;
@@ -2918,6 +3062,137 @@ static inline int check_stack_guard_page(struct vm_area_struct *vma, unsigned lo
 	return 0;
 }
 
+/*
+ * A read fault also maps the neighbours of the faulting page that need no
+ * I/O nor allocation, within the aligned window of fault_around_bytes: the
+ * uptodate pages of the page cache, or the zero page for the untouched
+ * ptes of an anonymous vma. PAGE_SIZE turns it off.
+ */
+static unsigned long fault_around_bytes __read_mostly = 65536;
+
+#ifdef CONFIG_DEBUG_FS
+static int fault_around_bytes_get(void *data, u64 *val)
+{
+	*val = fault_around_bytes;
+	return 0;
+}
+
+static int fault_around_bytes_set(void *data, u64 val)
+{
+	if (val / PAGE_SIZE > PTRS_PER_PTE)
+		return -EINVAL;
+	if (val > PAGE_SIZE)
+		fault_around_bytes = rounddown_pow_of_two(val);
+	else
+		fault_around_bytes = PAGE_SIZE;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(fault_around_bytes_fops,
+		fault_around_bytes_get, fault_around_bytes_set, "%llu\n");
+
+static int __init fault_around_debugfs(void)
+{
+	if (!debugfs_create_file("fault_around_bytes", 0644, NULL, NULL,
+				 &fault_around_bytes_fops))
+		printk(KERN_WARNING "Failed to create fault_around_bytes in debugfs\n");
+	return 0;
+}
+late_initcall(fault_around_debugfs);
+#endif
+
+/*
+ * fault_around_range() - the first and last + 1 addresses of the window
+ * around @address, which never crosses its pmd nor @vma. 0 if it is off.
+ */
+static int fault_around_range(struct vm_area_struct *vma,
+		unsigned long address, unsigned long *start, unsigned long *end)
+{
+	unsigned long mask = ~(ACCESS_ONCE(fault_around_bytes) - 1) & PAGE_MASK;
+
+	if (mask == PAGE_MASK)
+		return 0;
+
+	*start = max(address & mask, vma->vm_start);
+	*end = min((address & mask) - mask, vma->vm_end);
+	return 1;
+}
+
+/*
+ * do_anon_fault_around() - map the zero page at the untouched ptes around
+ * @address of @vma, whose pte was just set at @page_table, under its ptl.
+ * Not for a vma which could be collapsed to a huge page, nor for a stack.
+ */
+static void do_anon_fault_around(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		pte_t *page_table)
+{
+	unsigned long addr, start, end;
+	pte_t *pte;
+
+	if (vma->vm_flags & (VM_GROWSDOWN | VM_GROWSUP) ||
+	    transparent_hugepage_enabled(vma) ||
+	    !fault_around_range(vma, address, &start, &end))
+		return;
+
+	pte = page_table - ((address - start) >> PAGE_SHIFT);
+	for (addr = start; addr < end; addr += PAGE_SIZE, pte++) {
+		if (!pte_none(*pte))
+			continue;
+		set_pte_at(mm, addr, pte, pte_mkspecial(pfn_pte(
+				my_zero_pfn(addr), vma->vm_page_prot)));
+		update_mmu_cache(vma, addr, pte);
+	}
+}
+
+/*
+ * do_file_fault_around() - map read-only the pages of the page cache around
+ * the one at @pgoff, just mapped at @address and @page_table under its ptl,
+ * that are uptodate and can be locked right away. Those the readahead is
+ * waiting a fault on are left for that fault.
+ */
+static void do_file_fault_around(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		pte_t *page_table, pgoff_t pgoff)
+{
+	struct address_space *mapping = vma->vm_file->f_mapping;
+	unsigned long addr, start, end;
+	struct page *page;
+	pgoff_t size;
+	pte_t *pte;
+
+	if (!fault_around_range(vma, address, &start, &end))
+		return;
+
+	size = DIV_ROUND_UP(i_size_read(mapping->host), PAGE_CACHE_SIZE);
+	pte = page_table - ((address - start) >> PAGE_SHIFT);
+	pgoff -= (address - start) >> PAGE_SHIFT;
+	for (addr = start; addr < end; addr += PAGE_SIZE, pte++, pgoff++) {
+		if (!pte_none(*pte) || pgoff >= size)
+			continue;
+		page = find_get_page(mapping, pgoff);
+		if (!page)
+			continue;
+		if (!PageUptodate(page) || PageReadahead(page) ||
+		    PageHWPoison(page) || !trylock_page(page))
+			goto skip;
+		if (page->mapping != mapping || !PageUptodate(page))
+			goto unlock;
+
+		flush_icache_page(vma, page);
+		inc_mm_counter_fast(mm, MM_FILEPAGES);
+		page_add_file_rmap(page);
+		set_pte_at(mm, addr, pte, mk_pte(page, vma->vm_page_prot));
+		update_mmu_cache(vma, addr, pte);
+		/* the pte keeps the reference */
+		unlock_page(page);
+		continue;
+unlock:
+		unlock_page(page);
+skip:
+		page_cache_release(page);
+	}
+}
+
 /*
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
  * but allow concurrent faults), and pte mapped but not yet locked.
@@ -2944,13 +3219,18 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
 		if (!pte_none(*page_table))
 			goto unlock;
-		goto setpte;
+		set_pte_at(mm, address, page_table, entry);
+		update_mmu_cache(vma, address, page_table);
+		do_anon_fault_around(mm, vma, address, page_table);
+		goto unlock;
 	}
 
 	/* Allocate our own private page. */
 	if (unlikely(anon_vma_prepare(vma)))
 		goto oom;
-	page = alloc_zeroed_user_highpage_movable(vma, address);
+	page = zero_pool_get(vma, address);
+	if (!page)
+		page = alloc_zeroed_user_highpage_movable(vma, address);
 	if (!page)
 		goto oom;
 	__SetPageUptodate(page);
@@ -2968,7 +3248,6 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	inc_mm_counter_fast(mm, MM_ANONPAGES);
 	page_add_new_anon_rmap(page, vma, address);
-setpte:
 	set_pte_at(mm, address, page_table, entry);
 
 	/* No need to invalidate - it was non-present before */
@@ -3129,6 +3408,11 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 
 		/* no need to invalidate: a not-present page won't be cached */
 		update_mmu_cache(vma, address, page_table);
+
+		if (!(flags & (FAULT_FLAG_WRITE | FAULT_FLAG_NONLINEAR)) &&
+		    vma->vm_ops->fault == filemap_fault)
+			do_file_fault_around(mm, vma, address, page_table,
+					     pgoff);
 	} else {
 		if (charged)
 			mem_cgroup_uncharge_page(page);
@@ -3260,7 +3544,7 @@ int handle_pte_fault(struct mm_struct *mm,
 	if (flags & FAULT_FLAG_WRITE) {
 		if (!pte_write(entry))
 			return do_wp_page(mm, vma, address,
-					pte, pmd, ptl, entry);
+					pte, pmd, ptl, entry, flags);
 		entry = pte_mkdirty(entry);
 	}
 	entry = pte_mkyoung(entry);
@@ -3309,7 +3593,11 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
-	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
+	if (pmd_none(*pmd) && vma->vm_ops && vma->vm_ops->pmd_fault) {
+		int ret = vma->vm_ops->pmd_fault(vma, address, pmd, flags);
+		if (!(ret & VM_FAULT_FALLBACK))
+			return ret;
+	} else if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
 		if (!vma->vm_ops)
 			return do_huge_pmd_anonymous_page(mm, vma, address,
 							  pmd, flags);
@@ -3317,12 +3605,16 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		pmd_t orig_pmd = *pmd;
 		barrier();
 		if (pmd_trans_huge(orig_pmd)) {
+			int ret = 0;
+
 			if (flags & FAULT_FLAG_WRITE &&
 			    !pmd_write(orig_pmd) &&
 			    !pmd_trans_splitting(orig_pmd))
-				return do_huge_pmd_wp_page(mm, vma, address,
-							   pmd, orig_pmd);
-			return 0;
+				ret = do_huge_pmd_wp_page(mm, vma, address,
+							  pmd, orig_pmd);
+			/* a team split to ptes for the write to fault on */
+			if (!(ret & VM_FAULT_FALLBACK))
+				return ret;
 		}
 	}
 
@@ -3417,8 +3709,8 @@ int make_pages_present(unsigned long addr, unsigned long end)
 	BUG_ON(addr >= end);
 	BUG_ON(end > vma->vm_end);
 	len = DIV_ROUND_UP(end, PAGE_SIZE) - addr/PAGE_SIZE;
-	ret = get_user_pages(current, current->mm, addr,
-			len, write, 0, NULL, NULL);
+	ret = populate_vma_pages(vma, addr & PAGE_MASK, len,
+			FOLL_TOUCH | (write ? FOLL_WRITE : 0), NULL);
 	if (ret < 0)
 		return ret;
 	return ret == len ? 0 : -EFAULT;
@@ -24,11 +24,13 @@
 #include <linux/ioport.h>
 #include <linux/delay.h>
 #include <linux/migrate.h>
+#include <linux/compaction.h>
 #include <linux/page-isolation.h>
 #include <linux/pfn.h>
 #include <linux/suspend.h>
 #include <linux/mm_inline.h>
 #include <linux/firmware-map.h>
+#include <linux/workqueue.h>
 
 #include <asm/tlbflush.h>
 
@@ -383,19 +385,127 @@ void online_page(struct page *page)
 	__free_page(page);
 }
 
-static int online_pages_range(unsigned long start_pfn, unsigned long nr_pages,
-			void *arg)
+/* What one onlining worker takes on at a time */
+#define ONLINE_CHUNK_PAGES	PAGES_PER_SECTION
+
+/* Free the reserved pages of [start_pfn, end_pfn) in the largest blocks */
+static void online_pages_chunk(unsigned long start_pfn, unsigned long end_pfn)
 {
+	unsigned long pfn = start_pfn;
 	unsigned long i;
-	unsigned long onlined_pages = *(unsigned long *)arg;
-	struct page *page;
-	if (PageReserved(pfn_to_page(start_pfn)))
-		for (i = 0; i < nr_pages; i++) {
-			page = pfn_to_page(start_pfn + i);
-			online_page(page);
-			onlined_pages++;
+
+	while (pfn < end_pfn) {
+		struct page *page = pfn_to_page(pfn);
+		unsigned int order = MAX_ORDER - 1;
+
+		if (pfn)
+			order = min_t(unsigned int, order, __ffs(pfn));
+		while (pfn + (1UL << order) > end_pfn)
+			order--;
+
+		for (i = 0; i < (1UL << order); i++) {
+			ClearPageReserved(page + i);
+			set_page_count(page + i, 0);
+		}
+		set_page_refcounted(page);
+		__free_pages(page, order);
+
+		pfn += 1UL << order;
+		cond_resched();
+	}
+}
+
+struct online_pages_work {
+	struct work_struct work;
+	atomic_long_t *next_pfn;
+	unsigned long end_pfn;
+};
+
+/* Take chunks of the range until there are none left */
+static void online_pages_run(atomic_long_t *next_pfn, unsigned long end_pfn)
+{
+	unsigned long pfn;
+
+	for (;;) {
+		pfn = atomic_long_add_return(ONLINE_CHUNK_PAGES, next_pfn) -
+			ONLINE_CHUNK_PAGES;
+		if (pfn >= end_pfn)
+			break;
+		online_pages_chunk(pfn, min(pfn + ONLINE_CHUNK_PAGES, end_pfn));
+	}
+}
+
+static void online_pages_worker(struct work_struct *work)
+{
+	struct online_pages_work *w =
+		container_of(work, struct online_pages_work, work);
+
+	online_pages_run(w->next_pfn, w->end_pfn);
+}
+
+/*
+ * Hand the range to all the cpus of @nid, or all cpus if it has none yet,
+ * besides this one: that touches the new struct pages from the node they
+ * live on, many at a time. Without memory for the work items it is done
+ * here alone.
+ */
+static void online_pages_parallel(int nid, unsigned long start_pfn,
+				  unsigned long end_pfn)
+{
+	atomic_long_t next_pfn = ATOMIC_LONG_INIT(start_pfn);
+	struct online_pages_work *works = NULL;
+	const struct cpumask *cpus;
+	int cpu, i, nr = 0;
+
+	get_online_cpus();
+	if (end_pfn - start_pfn > ONLINE_CHUNK_PAGES)
+		works = kcalloc(nr_cpu_ids, sizeof(*works), GFP_KERNEL);
+	if (works) {
+		cpus = cpumask_of_node(nid);
+		if (!cpumask_intersects(cpus, cpu_online_mask))
+			cpus = cpu_online_mask;
+		for_each_cpu_and(cpu, cpus, cpu_online_mask) {
+			struct online_pages_work *w = &works[nr++];
+
+			INIT_WORK(&w->work, online_pages_worker);
+			w->next_pfn = &next_pfn;
+			w->end_pfn = end_pfn;
+			queue_work_on(cpu, system_long_wq, &w->work);
 		}
-	*(unsigned long *)arg = onlined_pages;
+	}
+
+	online_pages_run(&next_pfn, end_pfn);
+
+	for (i = 0; i < nr; i++)
+		flush_work(&works[i].work);
+	put_online_cpus();
+	kfree(works);
+}
+
+static int online_pages_range(unsigned long start_pfn, unsigned long nr_pages,
+			void *arg)
+{
+	unsigned long end_pfn = start_pfn + nr_pages;
+	struct page *page = pfn_to_page(start_pfn);
+
+	if (!PageReserved(page))
+		return 0;
+
+	/* what online_page() counts page by page */
+	totalram_pages += nr_pages;
+	if (end_pfn > num_physpages)
+		num_physpages = end_pfn;
+#ifdef CONFIG_HIGHMEM
+	if (PageHighMem(page))
+		totalhigh_pages += nr_pages;
+#endif
+#ifdef CONFIG_FLATMEM
+	max_mapnr = max(end_pfn - 1, max_mapnr);
+#endif
+
+	online_pages_parallel(page_to_nid(page), start_pfn, end_pfn);
+
+	*(unsigned long *)arg += nr_pages;
 	return 0;
 }
 
@@ -463,6 +573,7 @@ int online_pages(unsigned long pfn, unsigned long nr_pages)
 	calculate_zone_inactive_ratio(zone);
 	if (onlined_pages) {
 		kswapd_run(zone_to_nid(zone));
+		kcompactd_run(zone_to_nid(zone));
 		node_set_state(zone_to_nid(zone), N_HIGH_MEMORY);
 	}
 
@@ -898,6 +1009,7 @@ repeat:
 	if (!node_present_pages(node)) {
 		node_clear_state(node, N_HIGH_MEMORY);
 		kswapd_stop(node);
+		kcompactd_stop(node);
 	}
 
 	vm_total_pages = nr_free_pagecache_pages();
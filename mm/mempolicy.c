@@ -458,8 +458,8 @@ static const struct mempolicy_operations mpol_ops[MPOL_MAX] = {
 };
 
 static void gather_stats(struct page *, void *, int pte_dirty);
-static void migrate_page_add(struct page *page, struct list_head *pagelist,
-				unsigned long flags);
+static void migrate_page_add(struct page *page, struct vm_area_struct *vma,
+				struct list_head *pagelist, unsigned long flags);
 
 /* Scan through pages checking if pages follow certain conditions. */
 static int check_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
@@ -484,9 +484,8 @@ static int check_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
 		/*
 		 * vm_normal_page() filters out zero pages, but there might
 		 * still be PageReserved pages to skip, perhaps in a VDSO.
-		 * And we cannot move PageKsm pages sensibly or safely yet.
 		 */
-		if (PageReserved(page) || PageKsm(page))
+		if (PageReserved(page))
 			continue;
 		nid = page_to_nid(page);
 		if (node_isset(nid, *nodes) == !!(flags & MPOL_MF_INVERT))
@@ -495,7 +494,7 @@ static int check_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
 		if (flags & MPOL_MF_STATS)
 			gather_stats(page, private, pte_dirty(*pte));
 		else if (flags & (MPOL_MF_MOVE | MPOL_MF_MOVE_ALL))
-			migrate_page_add(page, private, flags);
+			migrate_page_add(page, vma, private, flags);
 		else
 			break;
 	} while (pte++, addr += PAGE_SIZE, addr != end);
@@ -514,7 +513,7 @@ static inline int check_pmd_range(struct vm_area_struct *vma, pud_t *pud,
 	pmd = pmd_offset(pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
-		split_huge_page_pmd(vma->vm_mm, pmd);
+		split_huge_page_pmd(vma, addr, pmd);
 		if (pmd_none_or_clear_bad(pmd))
 			continue;
 		if (check_pte_range(vma, pmd, addr, next, nodes,
@@ -895,13 +894,16 @@ static long do_get_mempolicy(int *policy, nodemask_t *nmask,
 /*
  * page migration
  */
-static void migrate_page_add(struct page *page, struct list_head *pagelist,
-				unsigned long flags)
+static void migrate_page_add(struct page *page, struct vm_area_struct *vma,
+				struct list_head *pagelist, unsigned long flags)
 {
 	/*
-	 * Avoid migrating a page that is shared with others.
+	 * Avoid migrating a page that is shared with others. A KSM page is
+	 * shared by content, not on purpose: its stable node moves along
+	 * with it, when all the mappings it has are of this mm.
 	 */
-	if ((flags & MPOL_MF_MOVE_ALL) || page_mapcount(page) == 1) {
+	if ((flags & MPOL_MF_MOVE_ALL) || page_mapcount(page) == 1 ||
+	    (PageKsm(page) && ksm_page_mm_only(page, vma->vm_mm))) {
 		if (!isolate_lru_page(page)) {
 			list_add_tail(&page->lru, pagelist);
 			inc_zone_page_state(page, NR_ISOLATED_ANON +
@@ -936,8 +938,7 @@ static int migrate_to_node(struct mm_struct *mm, int source, int dest,
 		return PTR_ERR(vma);
 
 	if (!list_empty(&pagelist)) {
-		err = migrate_pages(&pagelist, new_node_page, dest,
-								false, true);
+		err = migrate_pages_batched(&pagelist, new_node_page, dest);
 		if (err)
 			putback_lru_pages(&pagelist);
 	}
@@ -1061,8 +1062,8 @@ static struct page *new_vma_page(struct page *page, unsigned long private, int *
 }
 #else
 
-static void migrate_page_add(struct page *page, struct list_head *pagelist,
-				unsigned long flags)
+static void migrate_page_add(struct page *page, struct vm_area_struct *vma,
+				struct list_head *pagelist, unsigned long flags)
 {
 }
 
@@ -14,6 +14,13 @@
 #include <linux/mempool.h>
 #include <linux/blkdev.h>
 #include <linux/writeback.h>
+#include <linux/percpu.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+
+/* Pools with per-cpu caches, for draining the caches of dead cpus */
+static LIST_HEAD(mempool_pcpu_pools);
+static DEFINE_MUTEX(mempool_pcpu_mutex);
 
 static void add_element(mempool_t *pool, void *element)
 {
@@ -95,6 +102,130 @@ mempool_t *mempool_create_node(int min_nr, mempool_alloc_t *alloc_fn,
 }
 EXPORT_SYMBOL(mempool_create_node);
 
+/**
+ * mempool_enable_percpu - cache elements per cpu in front of the reserve
+ * @pool:      pointer to the memory pool which was allocated via
+ *             mempool_create().
+ * @nr:        the number of elements each cpu may cache, at most
+ *             MEMPOOL_PCPU_MAX.
+ *
+ * Once the underlying allocator fails, mempool_alloc() takes elements
+ * from the local cache before it takes pool->lock for the reserve, and
+ * mempool_free() puts them back there while nobody waits for the pool.
+ * The cached elements are on top of the min_nr guaranteed ones. Before
+ * mempool_alloc() sleeps on an empty reserve it moves what the caches
+ * hold into the reserve, so no element is out of its reach.
+ *
+ * This function might sleep; call it right after creating the pool.
+ */
+int mempool_enable_percpu(mempool_t *pool, int nr)
+{
+	struct mempool_pcpu __percpu *pcpu;
+
+	if (nr <= 0 || nr > MEMPOOL_PCPU_MAX || pool->pcpu)
+		return -EINVAL;
+
+	pcpu = alloc_percpu(struct mempool_pcpu);
+	if (!pcpu)
+		return -ENOMEM;
+
+	mutex_lock(&mempool_pcpu_mutex);
+	list_add(&pool->pcpu_list, &mempool_pcpu_pools);
+	mutex_unlock(&mempool_pcpu_mutex);
+
+	pool->pcpu_nr = nr;
+	smp_wmb();
+	pool->pcpu = pcpu;
+	return 0;
+}
+EXPORT_SYMBOL(mempool_enable_percpu);
+
+static void *pcpu_get_element(mempool_t *pool)
+{
+	struct mempool_pcpu *pcp;
+	void *element = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pcp = this_cpu_ptr(pool->pcpu);
+	if (pcp->nr)
+		element = pcp->elements[--pcp->nr];
+	local_irq_restore(flags);
+
+	return element;
+}
+
+static int pcpu_put_element(mempool_t *pool, void *element)
+{
+	struct mempool_pcpu *pcp;
+	unsigned long flags;
+	int ret = 0;
+
+	local_irq_save(flags);
+	pcp = this_cpu_ptr(pool->pcpu);
+	if (pcp->nr < pool->pcpu_nr) {
+		pcp->elements[pcp->nr++] = element;
+		ret = 1;
+	}
+	local_irq_restore(flags);
+
+	return ret;
+}
+
+/* Run on each cpu: fill the reserve from the local cache */
+static void pcpu_flush_elements(void *info)
+{
+	mempool_t *pool = info;
+	struct mempool_pcpu *pcp = this_cpu_ptr(pool->pcpu);
+
+	spin_lock(&pool->lock);
+	while (pcp->nr && pool->curr_nr < pool->min_nr)
+		add_element(pool, pcp->elements[--pcp->nr]);
+	spin_unlock(&pool->lock);
+}
+
+/* Empty the cache of @cpu, which is dead or the pool going away */
+static void pcpu_drain_elements(mempool_t *pool, int cpu)
+{
+	struct mempool_pcpu *pcp = per_cpu_ptr(pool->pcpu, cpu);
+	unsigned long flags;
+	void *element;
+
+	while (pcp->nr) {
+		element = pcp->elements[--pcp->nr];
+		spin_lock_irqsave(&pool->lock, flags);
+		if (pool->curr_nr < pool->min_nr) {
+			add_element(pool, element);
+			element = NULL;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+		if (element)
+			pool->free(element, pool->pool_data);
+	}
+	wake_up(&pool->wait);
+}
+
+static int __cpuinit mempool_cpu_callback(struct notifier_block *nfb,
+					  unsigned long action, void *hcpu)
+{
+	mempool_t *pool;
+
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
+		mutex_lock(&mempool_pcpu_mutex);
+		list_for_each_entry(pool, &mempool_pcpu_pools, pcpu_list)
+			pcpu_drain_elements(pool, (long)hcpu);
+		mutex_unlock(&mempool_pcpu_mutex);
+	}
+	return NOTIFY_OK;
+}
+
+static int __init mempool_pcpu_init(void)
+{
+	hotcpu_notifier(mempool_cpu_callback, 0);
+	return 0;
+}
+module_init(mempool_pcpu_init);
+
 /**
  * mempool_resize - resize an existing memory pool
  * @pool:       pointer to the memory pool which was allocated via
@@ -178,10 +309,23 @@ EXPORT_SYMBOL(mempool_resize);
  *
  * this function only sleeps if the free_fn() function sleeps. The caller
  * has to guarantee that all elements have been returned to the pool (ie:
- * freed) prior to calling mempool_destroy().
+ * freed) prior to calling mempool_destroy(). It also sleeps if the pool
+ * has per-cpu caches.
  */
 void mempool_destroy(mempool_t *pool)
 {
+	if (pool->pcpu) {
+		int cpu;
+
+		mutex_lock(&mempool_pcpu_mutex);
+		list_del(&pool->pcpu_list);
+		mutex_unlock(&mempool_pcpu_mutex);
+
+		for_each_possible_cpu(cpu)
+			pcpu_drain_elements(pool, cpu);
+		free_percpu(pool->pcpu);
+	}
+
 	/* Check for outstanding elements */
 	BUG_ON(pool->curr_nr != pool->min_nr);
 	free_pool(pool);
@@ -220,6 +364,12 @@ repeat_alloc:
 	if (likely(element != NULL))
 		return element;
 
+	if (pool->pcpu) {
+		element = pcpu_get_element(pool);
+		if (element)
+			return element;
+	}
+
 	spin_lock_irqsave(&pool->lock, flags);
 	if (likely(pool->curr_nr)) {
 		element = remove_element(pool);
@@ -232,6 +382,13 @@ repeat_alloc:
 	if (!(gfp_mask & __GFP_WAIT))
 		return NULL;
 
+	/* Elements idle in the other cpus' caches are ours too */
+	if (pool->pcpu) {
+		on_each_cpu(pcpu_flush_elements, pool, 1);
+		if (pool->curr_nr)
+			goto repeat_alloc;
+	}
+
 	/* Now start performing page reclaim */
 	gfp_temp = gfp_mask;
 	init_wait(&wait);
@@ -266,6 +423,11 @@ void mempool_free(void *element, mempool_t *pool)
 		return;
 
 	smp_mb();
+	/* keep the freeing local unless someone sleeps on the reserve */
+	if (pool->pcpu && !waitqueue_active(&pool->wait) &&
+	    pcpu_put_element(pool, element))
+		return;
+
 	if (pool->curr_nr < pool->min_nr) {
 		spin_lock_irqsave(&pool->lock, flags);
 		if (pool->curr_nr < pool->min_nr) {
@@ -343,15 +343,10 @@ int migrate_huge_page_move_mapping(struct address_space *mapping,
 }
 
 /*
- * Copy the page to its new location
+ * Move the state of the page to its new location, its data copied already
  */
-void migrate_page_copy(struct page *newpage, struct page *page)
+static void migrate_page_copy_state(struct page *newpage, struct page *page)
 {
-	if (PageHuge(page))
-		copy_huge_page(newpage, page);
-	else
-		copy_highpage(newpage, page);
-
 	if (PageError(page))
 		SetPageError(newpage);
 	if (PageReferenced(page))
@@ -396,6 +391,19 @@ void migrate_page_copy(struct page *newpage, struct page *page)
 		end_page_writeback(newpage);
 }
 
+/*
+ * Copy the page to its new location
+ */
+void migrate_page_copy(struct page *newpage, struct page *page)
+{
+	if (PageHuge(page))
+		copy_huge_page(newpage, page);
+	else
+		copy_highpage(newpage, page);
+
+	migrate_page_copy_state(newpage, page);
+}
+
 /************************************************************
  *                    Migration functions
  ***********************************************************/
@@ -564,7 +572,7 @@ static int fallback_migrate_page(struct address_space *mapping,
  *  == 0 - success
  */
 static int move_to_new_page(struct page *newpage, struct page *page,
-						int remap_swapcache)
+					int remap_swapcache, int copied)
 {
 	struct address_space *mapping;
 	int rc;
@@ -584,7 +592,12 @@ static int move_to_new_page(struct page *newpage, struct page *page,
 		SetPageSwapBacked(newpage);
 
 	mapping = page_mapping(page);
-	if (!mapping)
+	if (copied) {
+		/* an anon page, its data copied by migrate_batch_copy() */
+		rc = migrate_page_move_mapping(mapping, newpage, page);
+		if (!rc)
+			migrate_page_copy_state(newpage, page);
+	} else if (!mapping)
 		rc = migrate_page(mapping, newpage, page);
 	else if (mapping->a_ops->migratepage)
 		/*
@@ -664,18 +677,11 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	}
 
 	/*
-	 * Only memory hotplug's offline_pages() caller has locked out KSM,
-	 * and can safely migrate a KSM page.  The other cases have skipped
-	 * PageKsm along with PageReserved - but it is only now when we have
-	 * the page lock that we can be certain it will not go KSM beneath us
-	 * (KSM will not upgrade a page from PageAnon to PageKsm when it sees
-	 * its pagecount raised, but only here do we take the page lock which
-	 * serializes that).
+	 * A KSM page is migrated like any anon page, without locking out KSM:
+	 * get_ksm_page() follows stable_node->kpfn to the new page once
+	 * ksm_migrate_page() has moved it, and KSM will not upgrade a page
+	 * from PageAnon to PageKsm when it sees its pagecount raised.
 	 */
-	if (PageKsm(page) && !offlining) {
-		rc = -EBUSY;
-		goto unlock;
-	}
 
 	/* charge against new page */
 	charge = mem_cgroup_prepare_migration(page, newpage, &mem);
@@ -698,7 +704,8 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	 * File Caches may use write_page() or lock_page() in migration, then,
 	 * just care Anon page here.
 	 */
-	if (PageAnon(page)) {
+	/* the anon_vmas of a KSM page are held by its rmap_items */
+	if (PageAnon(page) && !PageKsm(page)) {
 		/*
 		 * Only page_lock_anon_vma() understands the subtleties of
 		 * getting a hold on an anon_vma from outside one of its mms.
@@ -757,7 +764,7 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 
 skip_unmap:
 	if (!page_mapped(page))
-		rc = move_to_new_page(newpage, page, remap_swapcache);
+		rc = move_to_new_page(newpage, page, remap_swapcache, 0);
 
 	if (rc && remap_swapcache)
 		remove_migration_ptes(page, page);
@@ -850,7 +857,7 @@ static int unmap_and_move_huge_page(new_page_t get_new_page,
 	try_to_unmap(hpage, TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
 
 	if (!page_mapped(hpage))
-		rc = move_to_new_page(new_hpage, hpage, 1);
+		rc = move_to_new_page(new_hpage, hpage, 1, 0);
 
 	if (rc)
 		remove_migration_ptes(hpage, hpage);
@@ -942,6 +949,224 @@ out:
 	return nr_failed + retry;
 }
 
+/*
+ * Threads, the caller included, that copy the pages of a migration batch.
+ * 1 copies them in the caller only.
+ */
+int sysctl_migrate_copy_threads = 1;
+
+/* Pages unmapped under one TLB flush, copied and remapped together */
+#define MIGRATE_BATCH		32
+
+struct migrate_batch {
+	struct page *page;
+	struct page *newpage;
+	struct mem_cgroup *mem;
+	struct anon_vma *anon_vma;
+};
+
+struct migrate_copy_work {
+	struct work_struct work;
+	struct migrate_batch *batch;
+	int nr;
+	atomic_t *next;
+};
+
+static void migrate_copy_pages(struct migrate_batch *batch, int nr,
+			       atomic_t *next)
+{
+	int i;
+
+	while ((i = atomic_inc_return(next) - 1) < nr) {
+		if (!page_mapped(batch[i].page))
+			copy_highpage(batch[i].newpage, batch[i].page);
+	}
+}
+
+static void migrate_copy_worker(struct work_struct *work)
+{
+	struct migrate_copy_work *w = container_of(work,
+						   struct migrate_copy_work,
+						   work);
+
+	migrate_copy_pages(w->batch, w->nr, w->next);
+}
+
+/*
+ * Copy the data of the unmapped pages of @batch, spread over the cpus of
+ * the node they go to when sysctl_migrate_copy_threads allows.
+ */
+static void migrate_batch_copy(struct migrate_batch *batch, int nr)
+{
+	struct migrate_copy_work works[8];
+	const struct cpumask *cpus;
+	atomic_t next = ATOMIC_INIT(0);
+	int cpu, i, nr_works = 0;
+
+	nr_works = min3(sysctl_migrate_copy_threads - 1,
+			(int)ARRAY_SIZE(works), nr / 4);
+	if (nr_works <= 0)
+		goto copy;
+
+	get_online_cpus();
+	cpus = cpumask_of_node(page_to_nid(batch[0].newpage));
+	i = 0;
+	for_each_cpu_and(cpu, cpus, cpu_online_mask) {
+		if (i == nr_works)
+			break;
+		if (cpu == raw_smp_processor_id())
+			continue;
+		INIT_WORK_ONSTACK(&works[i].work, migrate_copy_worker);
+		works[i].batch = batch;
+		works[i].nr = nr;
+		works[i].next = &next;
+		schedule_work_on(cpu, &works[i].work);
+		i++;
+	}
+	nr_works = i;
+
+	migrate_copy_pages(batch, nr, &next);
+	for (i = 0; i < nr_works; i++) {
+		flush_work(&works[i].work);
+		destroy_work_on_stack(&works[i].work);
+	}
+	put_online_cpus();
+	return;
+
+copy:
+	migrate_copy_pages(batch, nr, &next);
+}
+
+/*
+ * Lock @page and get it a new page, in @entry, if a migration batch can
+ * carry it: an anon page, KSM ones included, locked without waiting and not
+ * under writeback, whose swap cache migrate_page() handles anyway. Returns
+ * 0 if it has to go the usual way.
+ */
+static int migrate_batch_prepare(struct page *page,
+			new_page_t get_new_page, unsigned long private,
+			struct migrate_batch *entry)
+{
+	struct anon_vma *anon_vma = NULL;
+	struct page *newpage;
+	int *result = NULL;
+
+	if (!PageAnon(page) || PageTransHuge(page) || page_count(page) == 1)
+		return 0;
+	if (!trylock_page(page))
+		return 0;
+	if (PageWriteback(page))
+		goto unlock;
+
+	if (!PageKsm(page)) {
+		anon_vma = page_lock_anon_vma(page);
+		if (!anon_vma)
+			goto unlock;
+		get_anon_vma(anon_vma);
+		page_unlock_anon_vma(anon_vma);
+	}
+
+	newpage = get_new_page(page, private, &result);
+	if (!newpage)
+		goto drop;
+	if (mem_cgroup_prepare_migration(page, newpage, &entry->mem)) {
+		putback_lru_page(newpage);
+		goto drop;
+	}
+
+	entry->page = page;
+	entry->newpage = newpage;
+	entry->anon_vma = anon_vma;
+	return 1;
+
+drop:
+	if (anon_vma)
+		drop_anon_vma(anon_vma);
+unlock:
+	unlock_page(page);
+	return 0;
+}
+
+/*
+ * migrate_pages_batched - migrate_pages(), sync and not offlining, for the
+ * mempolicy migrations of many anon pages at a time. The ptes of up to
+ * MIGRATE_BATCH pages are replaced by migration entries under one TLB flush
+ * per mm, instead of one per pte, the data of the batch is then copied by
+ * sysctl_migrate_copy_threads, and the pages remapped. The pages no batch
+ * can carry, and those a batch failed to move, go through migrate_pages().
+ * The batched pages report no result through @get_new_page.
+ *
+ * Return: Number of pages not migrated or error code.
+ */
+int migrate_pages_batched(struct list_head *from,
+		new_page_t get_new_page, unsigned long private)
+{
+	struct migrate_batch *batch;
+	struct tlbflush_unmap_batch tlb_ubc = { .nr = 0 };
+	struct page *page, *page2;
+	LIST_HEAD(left);
+	int i, nr, rc;
+
+	batch = kmalloc(sizeof(*batch) * MIGRATE_BATCH, GFP_KERNEL);
+	if (!batch)
+		goto rest;
+
+	current->tlb_ubc = &tlb_ubc;
+	while (!list_empty(from)) {
+		nr = 0;
+		list_for_each_entry_safe(page, page2, from, lru) {
+			if (nr == MIGRATE_BATCH)
+				break;
+			list_move_tail(&page->lru, &left);
+			if (!migrate_batch_prepare(page, get_new_page, private,
+						   &batch[nr]))
+				continue;
+			try_to_unmap(page, TTU_MIGRATION | TTU_IGNORE_MLOCK |
+				     TTU_IGNORE_ACCESS | TTU_BATCH_FLUSH);
+			nr++;
+		}
+		if (!nr)
+			break;
+
+		/* no stale TLB entry may write to a page while it's copied */
+		try_to_unmap_flush();
+		migrate_batch_copy(batch, nr);
+
+		for (i = 0; i < nr; i++) {
+			struct migrate_batch *b = &batch[i];
+
+			rc = -EAGAIN;
+			if (!page_mapped(b->page))
+				rc = move_to_new_page(b->newpage, b->page, 1, 1);
+			if (rc)
+				remove_migration_ptes(b->page, b->page);
+			if (b->anon_vma)
+				drop_anon_vma(b->anon_vma);
+			mem_cgroup_end_migration(b->mem, b->page, b->newpage,
+						 rc == 0);
+			unlock_page(b->page);
+
+			/* one not moved is retried the usual way */
+			if (!rc) {
+				list_del(&b->page->lru);
+				dec_zone_page_state(b->page, NR_ISOLATED_ANON);
+				putback_lru_page(b->page);
+			}
+			putback_lru_page(b->newpage);
+		}
+		cond_resched();
+	}
+	try_to_unmap_flush();
+	current->tlb_ubc = NULL;
+	kfree(batch);
+
+rest:
+	list_splice(&left, from);
+	if (list_empty(from))
+		return 0;
+	return migrate_pages(from, get_new_page, private, false, true);
+}
+
 int migrate_huge_pages(struct list_head *from,
 		new_page_t get_new_page, unsigned long private, bool offlining,
 		bool sync)
@@ -1053,7 +1278,7 @@ static int do_move_page_to_node_array(struct mm_struct *mm,
 			goto set_status;
 
 		/* Use PageReserved to check for zero page */
-		if (PageReserved(page) || PageKsm(page))
+		if (PageReserved(page))
 			goto put_and_set;
 
 		pp->page = page;
@@ -1217,7 +1442,7 @@ static void do_pages_stat_array(struct mm_struct *mm, unsigned long nr_pages,
 
 		err = -ENOENT;
 		/* Use PageReserved to check for zero page */
-		if (!page || PageReserved(page) || PageKsm(page))
+		if (!page || PageReserved(page))
 			goto set_status;
 
 		err = page_to_nid(page);
@@ -18,6 +18,8 @@
 #include <linux/rmap.h>
 #include <linux/mmzone.h>
 #include <linux/hugetlb.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
 
 #include "internal.h"
 
@@ -142,6 +144,188 @@ static inline int stack_guard_page(struct vm_area_struct *vma, unsigned long add
 		!vma_stack_continue(vma->vm_prev, addr);
 }
 
+/*
+ * Threads, the caller included, that populate_vma_pages() spreads a large
+ * range over. 1 populates in the caller only.
+ */
+int sysctl_populate_threads = 1;
+
+/* Pages a thread populates at a time, and half the least range spread */
+#define POPULATE_CHUNK_PAGES	1024
+
+struct populate_work {
+	struct mm_struct *mm;
+	unsigned long start;
+	int nr_pages;
+	unsigned int gup_flags;
+	int nr_chunks;
+	atomic_t next_chunk;
+	int stop;
+
+	/* the first chunk which came short, and how */
+	spinlock_t lock;
+	int fail_chunk;
+	int fail_done;
+	int fail_err;
+
+	/* what the helpers borrow from the caller */
+	cpumask_var_t cpus;
+	struct mempolicy *mempolicy;
+#ifdef CONFIG_CPUSETS
+	nodemask_t mems_allowed;
+#endif
+	atomic_t running;
+	struct completion done;
+};
+
+static void populate_chunks(struct populate_work *w)
+{
+	int chunk;
+
+	while (!ACCESS_ONCE(w->stop) &&
+	       (chunk = atomic_inc_return(&w->next_chunk) - 1) < w->nr_chunks) {
+		unsigned long addr = w->start +
+			((unsigned long)chunk * POPULATE_CHUNK_PAGES << PAGE_SHIFT);
+		int nr = min(POPULATE_CHUNK_PAGES,
+			     w->nr_pages - chunk * POPULATE_CHUNK_PAGES);
+		int ret;
+
+		ret = __get_user_pages(current, w->mm, addr, nr, w->gup_flags,
+				       NULL, NULL, NULL);
+		if (ret != nr) {
+			/* the chunks after it aren't wanted anymore */
+			spin_lock(&w->lock);
+			if (chunk < w->fail_chunk) {
+				w->fail_chunk = chunk;
+				w->fail_done = ret > 0 ? ret : 0;
+				w->fail_err = ret < 0 ? ret : -EFAULT;
+			}
+			spin_unlock(&w->lock);
+			w->stop = 1;
+		}
+		if (fatal_signal_pending(current))
+			w->stop = 1;
+		cond_resched();
+	}
+}
+
+static int populate_thread(void *arg)
+{
+	struct populate_work *w = arg;
+
+	/* allocate as the caller's policy and cpuset would have it */
+#ifdef CONFIG_NUMA
+	current->mempolicy = w->mempolicy;
+#endif
+#ifdef CONFIG_CPUSETS
+	current->mems_allowed = w->mems_allowed;
+#endif
+	populate_chunks(w);
+#ifdef CONFIG_NUMA
+	current->mempolicy = NULL;
+#endif
+
+	if (atomic_dec_and_test(&w->running))
+		complete(&w->done);
+	return 0;
+}
+
+/*
+ * populate_vma_pages() - __get_user_pages() of [@start, @start + @nr_pages)
+ * in @vma, without pages, shared between sysctl_populate_threads threads
+ * when the range is large. The helpers run where the caller may, on the
+ * caller's node unless a memory policy says otherwise, and fault the
+ * range in POPULATE_CHUNK_PAGES at a time while the caller, doing its share
+ * too, keeps mmap_sem held for them. They never drop it: @nonblocking is
+ * only honoured when the range is populated by the caller alone.
+ *
+ * Returns what __get_user_pages() would: the pages populated from @start
+ * on, or -errno if none.
+ */
+long populate_vma_pages(struct vm_area_struct *vma, unsigned long start,
+			int nr_pages, unsigned int gup_flags, int *nonblocking)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct populate_work *w;
+	int i, nr_threads;
+	long ret;
+
+	nr_threads = min(sysctl_populate_threads,
+			 DIV_ROUND_UP(nr_pages, POPULATE_CHUNK_PAGES));
+	if (nr_threads < 2 || nr_pages < 2 * POPULATE_CHUNK_PAGES ||
+	    is_vm_hugetlb_page(vma) ||
+	    (vma->vm_flags & (VM_IO | VM_PFNMAP | VM_MIXEDMAP)))
+		goto single;
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		goto single;
+	if (!alloc_cpumask_var(&w->cpus, GFP_KERNEL)) {
+		kfree(w);
+		goto single;
+	}
+
+	w->mm = mm;
+	w->start = start;
+	w->nr_pages = nr_pages;
+	w->gup_flags = gup_flags;
+	w->nr_chunks = DIV_ROUND_UP(nr_pages, POPULATE_CHUNK_PAGES);
+	atomic_set(&w->next_chunk, 0);
+	spin_lock_init(&w->lock);
+	w->fail_chunk = w->nr_chunks;
+	atomic_set(&w->running, 1);
+	init_completion(&w->done);
+
+	cpumask_copy(w->cpus, &current->cpus_allowed);
+#ifdef CONFIG_NUMA
+	w->mempolicy = current->mempolicy;
+	mpol_get(w->mempolicy);
+	/* local allocation: stay on the caller's node */
+	if (!w->mempolicy && !vma->vm_policy &&
+	    cpumask_intersects(w->cpus, cpumask_of_node(numa_node_id())))
+		cpumask_and(w->cpus, w->cpus, cpumask_of_node(numa_node_id()));
+#endif
+#ifdef CONFIG_CPUSETS
+	w->mems_allowed = current->mems_allowed;
+#endif
+	nr_threads = min_t(int, nr_threads, cpumask_weight(w->cpus));
+
+	for (i = 1; i < nr_threads; i++) {
+		struct task_struct *tsk;
+
+		tsk = kthread_create(populate_thread, w, "populate/%d",
+				     task_pid_nr(current));
+		if (IS_ERR(tsk))
+			break;
+		set_cpus_allowed_ptr(tsk, w->cpus);
+		atomic_inc(&w->running);
+		wake_up_process(tsk);
+	}
+
+	populate_chunks(w);
+	if (!atomic_dec_and_test(&w->running))
+		wait_for_completion(&w->done);
+
+	if (w->fail_chunk == w->nr_chunks)
+		ret = nr_pages;
+	else {
+		ret = (long)w->fail_chunk * POPULATE_CHUNK_PAGES + w->fail_done;
+		if (!ret)
+			ret = w->fail_err;
+	}
+
+#ifdef CONFIG_NUMA
+	mpol_put(w->mempolicy);
+#endif
+	free_cpumask_var(w->cpus);
+	kfree(w);
+	return ret;
+
+single:
+	return __get_user_pages(current, mm, start, nr_pages, gup_flags,
+				NULL, NULL, nonblocking);
+}
+
 /**
  * __mlock_vma_pages_range() -  mlock a range of pages in the vma.
  * @vma:   target vma
@@ -194,8 +378,7 @@ static long __mlock_vma_pages_range(struct vm_area_struct *vma,
 		nr_pages--;
 	}
 
-	return __get_user_pages(current, mm, addr, nr_pages, gup_flags,
-				NULL, NULL, nonblocking);
+	return populate_vma_pages(vma, addr, nr_pages, gup_flags, nonblocking);
 }
 
 /*
@@ -30,6 +30,7 @@
 #include <linux/perf_event.h>
 #include <linux/audit.h>
 #include <linux/khugepaged.h>
+#include <linux/vmacache.h>
 #include <linux/ksm.h>
 
 #include <asm/uaccess.h>
@@ -509,8 +510,7 @@ __vma_unlink(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (next)
 		next->vm_prev = prev;
 	rb_erase(&vma->vm_rb, &mm->mm_rb);
-	if (mm->mmap_cache == vma)
-		mm->mmap_cache = prev;
+	vmacache_invalidate(mm);
 }
 
 /*
@@ -581,9 +581,9 @@ again:			remove_next = 1 + (end > next->vm_end);
 		 * shrinking vma had, to cover any anon pages imported.
 		 */
 		if (exporter && exporter->anon_vma && !importer->anon_vma) {
+			importer->anon_vma = exporter->anon_vma;
 			if (anon_vma_clone(importer, exporter))
 				return -ENOMEM;
-			importer->anon_vma = exporter->anon_vma;
 		}
 	}
 
@@ -1642,9 +1642,8 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 
 	if (mm) {
 		/* Check the cache first. */
-		/* (Cache hit rate is typically around 35%.) */
-		vma = mm->mmap_cache;
-		if (!(vma && vma->vm_end > addr && vma->vm_start <= addr)) {
+		vma = vmacache_find(mm, addr);
+		if (!vma) {
 			struct rb_node * rb_node;
 
 			rb_node = mm->mm_rb.rb_node;
@@ -1665,7 +1664,7 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 					rb_node = rb_node->rb_right;
 			}
 			if (vma)
-				mm->mmap_cache = vma;
+				vmacache_update(addr, vma);
 		}
 	}
 	return vma;
@@ -1988,7 +1987,7 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 	else
 		addr = vma ?  vma->vm_start : mm->mmap_base;
 	mm->unmap_area(mm, addr);
-	mm->mmap_cache = NULL;		/* Kill the cache. */
+	vmacache_invalidate(mm);	/* Kill the cache. */
 }
 
 /*
@@ -2302,6 +2301,172 @@ out:
 
 EXPORT_SYMBOL(do_brk);
 
+/*
+ * Threads, the exiting task included, that exit_mmap() spreads the unmap of
+ * a large mm over. 1 unmaps in the exiting task only.
+ */
+int sysctl_exit_mmap_threads = 1;
+
+/*
+ * The address space is cut into segments of about EXIT_MMAP_CHUNK for the
+ * threads to unmap, so that the single vma of a big guest is shared too.
+ * The cuts are at multiples of it, pmd aligned: no pte page and no huge
+ * pmd is ever across two segments. Hugetlb and pfn vmas are not cut.
+ */
+#define EXIT_MMAP_CHUNK		(1UL << 30)
+
+struct exit_mmap_seg {
+	struct vm_area_struct *vma;	/* the first vma of the segment */
+	unsigned long start;
+	unsigned long end;
+};
+
+struct exit_mmap_work {
+	struct work_struct work;
+	struct mm_struct *mm;
+	struct exit_mmap_seg *segs;
+	unsigned long nr_segs;
+	atomic_long_t *next;
+	unsigned long nr_accounted;
+};
+
+/* Count the segments of @mm, and fill in @segs if not NULL */
+static unsigned long exit_mmap_segments(struct mm_struct *mm,
+					struct exit_mmap_seg *segs)
+{
+	struct vm_area_struct *vma, *seg_vma = NULL;
+	unsigned long nr = 0, seg_start = 0, size = 0;
+	unsigned long start, cut, end = 0;
+
+#define EMIT_SEG(__end)						\
+	do {							\
+		if (segs) {					\
+			segs[nr].vma = seg_vma;			\
+			segs[nr].start = seg_start;		\
+			segs[nr].end = (__end);			\
+		}						\
+		nr++;						\
+	} while (0)
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		start = vma->vm_start;
+		if (!seg_vma) {
+			seg_vma = vma;
+			seg_start = start;
+		}
+		if (!(vma->vm_flags & (VM_HUGETLB | VM_PFNMAP))) {
+			for (cut = ALIGN(start + 1, EXIT_MMAP_CHUNK);
+			     cut > start && cut < vma->vm_end;
+			     cut += EXIT_MMAP_CHUNK) {
+				EMIT_SEG(cut);
+				seg_vma = vma;
+				seg_start = start = cut;
+				size = 0;
+			}
+		}
+		size += vma->vm_end - start;
+		end = vma->vm_end;
+		if (size >= EXIT_MMAP_CHUNK) {
+			EMIT_SEG(end);
+			seg_vma = NULL;
+			size = 0;
+		}
+	}
+	if (seg_vma)
+		EMIT_SEG(end);
+#undef EMIT_SEG
+
+	return nr;
+}
+
+static void exit_mmap_unmap_segs(struct exit_mmap_work *w)
+{
+	struct mmu_gather *tlb;
+	struct exit_mmap_seg *seg;
+	unsigned long i;
+
+	while ((i = atomic_long_inc_return(w->next) - 1) < w->nr_segs) {
+		seg = &w->segs[i];
+		tlb = tlb_gather_mmu(w->mm, 1);
+		unmap_vmas(&tlb, seg->vma, seg->start, seg->end,
+			   &w->nr_accounted, NULL);
+		tlb_finish_mmu(tlb, seg->start, seg->end);
+		cond_resched();
+	}
+}
+
+static void exit_mmap_worker(struct work_struct *work)
+{
+	exit_mmap_unmap_segs(container_of(work, struct exit_mmap_work, work));
+}
+
+/*
+ * exit_unmap_vmas() - unmap all of a dead @mm and return the end of the
+ * last vma. A large one is shared between sysctl_exit_mmap_threads: the
+ * exiting task and helpers on the unbound workqueue take its segments in
+ * turn, each with its own mmu_gather and tlb flushes. The helpers are not
+ * waited for if they have not started by the time the exiting task is done,
+ * a memory short system may take long to find a thread to run them.
+ */
+static unsigned long exit_unmap_vmas(struct mm_struct *mm,
+				     unsigned long *nr_accounted)
+{
+	atomic_long_t next = ATOMIC_LONG_INIT(0);
+	struct exit_mmap_work *works = NULL;
+	struct exit_mmap_seg *segs = NULL;
+	struct mmu_gather *tlb;
+	unsigned long nr_segs, end;
+	int i, nr_threads;
+
+	nr_threads = min_t(int, sysctl_exit_mmap_threads, num_online_cpus());
+	if (nr_threads < 2 ||
+	    get_mm_rss(mm) < 2 * (EXIT_MMAP_CHUNK >> PAGE_SHIFT))
+		goto single;
+
+	nr_segs = exit_mmap_segments(mm, NULL);
+	nr_threads = min_t(unsigned long, nr_threads, nr_segs);
+	if (nr_threads < 2)
+		goto single;
+
+	segs = kmalloc(nr_segs * sizeof(*segs), GFP_KERNEL | __GFP_NOWARN);
+	works = kcalloc(nr_threads, sizeof(*works), GFP_KERNEL | __GFP_NOWARN);
+	if (!segs || !works)
+		goto single;
+	exit_mmap_segments(mm, segs);
+
+	for (i = 0; i < nr_threads; i++) {
+		works[i].mm = mm;
+		works[i].segs = segs;
+		works[i].nr_segs = nr_segs;
+		works[i].next = &next;
+	}
+	for (i = 1; i < nr_threads; i++) {
+		INIT_WORK(&works[i].work, exit_mmap_worker);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	exit_mmap_unmap_segs(&works[0]);
+
+	for (i = 1; i < nr_threads; i++)
+		cancel_work_sync(&works[i].work);
+	for (i = 0; i < nr_threads; i++)
+		*nr_accounted += works[i].nr_accounted;
+	end = segs[nr_segs - 1].end;
+
+	kfree(works);
+	kfree(segs);
+	return end;
+
+single:
+	kfree(works);
+	kfree(segs);
+	tlb = tlb_gather_mmu(mm, 1);
+	/* Use -1 here to ensure all VMAs in the mm are unmapped */
+	end = unmap_vmas(&tlb, mm->mmap, 0, -1, nr_accounted, NULL);
+	tlb_finish_mmu(tlb, 0, end);
+	return end;
+}
+
 /* Release all mmaps. */
 void exit_mmap(struct mm_struct *mm)
 {
@@ -2330,12 +2495,11 @@ void exit_mmap(struct mm_struct *mm)
 
 	lru_add_drain();
 	flush_cache_mm(mm);
-	tlb = tlb_gather_mmu(mm, 1);
 	/* update_hiwater_rss(mm) here? but nobody should be looking */
-	/* Use -1 here to ensure all VMAs in the mm are unmapped */
-	end = unmap_vmas(&tlb, vma, 0, -1, &nr_accounted, NULL);
+	end = exit_unmap_vmas(mm, &nr_accounted);
 	vm_unacct_memory(nr_accounted);
 
+	tlb = tlb_gather_mmu(mm, 1);
 	free_pgtables(tlb, vma, FIRST_USER_ADDRESS, 0);
 	tlb_finish_mmu(tlb, 0, end);
 
@@ -100,6 +100,43 @@ int __mmu_notifier_clear_flush_young(struct mm_struct *mm,
 	return young;
 }
 
+/*
+ * The same for all the pages of [start, end), setting the bit of each page
+ * found young in the @young bitmap: one call for those notifiers which can,
+ * one call per page for the others.
+ */
+int __mmu_notifier_clear_flush_young_range(struct mm_struct *mm,
+					   unsigned long start,
+					   unsigned long end,
+					   unsigned long *young)
+{
+	struct mmu_notifier *mn;
+	struct hlist_node *n;
+	unsigned long address;
+	int any = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(mn, n, &mm->mmu_notifier_mm->list, hlist) {
+		if (mn->ops->clear_flush_young_range) {
+			any |= mn->ops->clear_flush_young_range(mn, mm, start,
+								end, young);
+			continue;
+		}
+		if (!mn->ops->clear_flush_young)
+			continue;
+		for (address = start; address < end; address += PAGE_SIZE) {
+			if (mn->ops->clear_flush_young(mn, mm, address)) {
+				__set_bit((address - start) >> PAGE_SHIFT,
+					  young);
+				any = 1;
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	return any;
+}
+
 int __mmu_notifier_test_young(struct mm_struct *mm,
 			      unsigned long address)
 {
@@ -140,6 +177,37 @@ void __mmu_notifier_change_pte(struct mm_struct *mm, unsigned long address,
 	rcu_read_unlock();
 }
 
+void __mmu_notifier_change_pte_batch(struct mm_struct *mm,
+				     unsigned long address, pte_t pte)
+{
+	struct mmu_notifier *mn;
+	struct hlist_node *n;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(mn, n, &mm->mmu_notifier_mm->list, hlist) {
+		if (mn->ops->change_pte_batch)
+			mn->ops->change_pte_batch(mn, mm, address, pte);
+		else if (mn->ops->change_pte)
+			mn->ops->change_pte(mn, mm, address, pte);
+		else if (mn->ops->invalidate_page)
+			mn->ops->invalidate_page(mn, mm, address);
+	}
+	rcu_read_unlock();
+}
+
+void __mmu_notifier_change_pte_flush(struct mm_struct *mm)
+{
+	struct mmu_notifier *mn;
+	struct hlist_node *n;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(mn, n, &mm->mmu_notifier_mm->list, hlist) {
+		if (mn->ops->change_pte_batch && mn->ops->change_pte_flush)
+			mn->ops->change_pte_flush(mn, mm);
+	}
+	rcu_read_unlock();
+}
+
 void __mmu_notifier_invalidate_page(struct mm_struct *mm,
 					  unsigned long address)
 {
@@ -23,6 +23,7 @@
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 #include <asm/tlbflush.h>
+#include <asm/pgalloc.h>
 
 #include "internal.h"
 
@@ -41,7 +42,7 @@ static pmd_t *get_old_pmd(struct mm_struct *mm, unsigned long addr)
 		return NULL;
 
 	pmd = pmd_offset(pud, addr);
-	split_huge_page_pmd(mm, pmd);
+	split_huge_page_pmd_mm(mm, addr, pmd);
 	if (pmd_none_or_clear_bad(pmd))
 		return NULL;
 
@@ -65,8 +66,6 @@ static pmd_t *alloc_new_pmd(struct mm_struct *mm, struct vm_area_struct *vma,
 		return NULL;
 
 	VM_BUG_ON(pmd_trans_huge(*pmd));
-	if (pmd_none(*pmd) && __pte_alloc(mm, vma, pmd, addr))
-		return NULL;
 
 	return pmd;
 }
@@ -106,6 +105,7 @@ static void move_ptes(struct vm_area_struct *vma, pmd_t *old_pmd,
 	new_ptl = pte_lockptr(mm, new_pmd);
 	if (new_ptl != old_ptl)
 		spin_lock_nested(new_ptl, SINGLE_DEPTH_NESTING);
+	flush_tlb_batched_pending(mm);
 	arch_enter_lazy_mmu_mode();
 
 	for (; old_addr < old_end; old_pte++, old_addr += PAGE_SIZE,
@@ -127,6 +127,49 @@ static void move_ptes(struct vm_area_struct *vma, pmd_t *old_pmd,
 	mmu_notifier_invalidate_range_end(vma->vm_mm, old_start, old_end);
 }
 
+/*
+ * Move the page table under @old_pmd as a whole to the empty @new_pmd, both
+ * of them covering a PMD_SIZE extent, instead of its ptes one by one. The
+ * rmap walkers look the page table up unlocked before taking its pte lock,
+ * which goes along with it: they are kept out by the i_mmap and anon_vma
+ * locks they hold throughout.
+ */
+static int move_normal_pmd(struct vm_area_struct *vma, unsigned long old_addr,
+		struct vm_area_struct *new_vma, unsigned long new_addr,
+		pmd_t *old_pmd, pmd_t *new_pmd)
+{
+	struct address_space *mapping = NULL;
+	struct mm_struct *mm = vma->vm_mm;
+	pmd_t pmd;
+
+	if (!pmd_none(*new_pmd))
+		return 0;
+
+	mmu_notifier_invalidate_range_start(mm, old_addr, old_addr + PMD_SIZE);
+	if (vma->vm_file) {
+		mapping = vma->vm_file->f_mapping;
+		spin_lock(&mapping->i_mmap_lock);
+		new_vma->vm_truncate_count = 0;
+	}
+	vma_lock_anon_vma(vma);
+
+	spin_lock(&mm->page_table_lock);
+	flush_tlb_batched_pending(mm);
+	pmd = *old_pmd;
+	pmd_clear(old_pmd);
+	VM_BUG_ON(!pmd_none(*new_pmd));
+	pmd_populate(mm, new_pmd, pmd_pgtable(pmd));
+	spin_unlock(&mm->page_table_lock);
+	flush_tlb_range(vma, old_addr, old_addr + PMD_SIZE);
+
+	vma_unlock_anon_vma(vma);
+	if (mapping)
+		spin_unlock(&mapping->i_mmap_lock);
+	mmu_notifier_invalidate_range_end(mm, old_addr, old_addr + PMD_SIZE);
+
+	return 1;
+}
+
 #define LATENCY_LIMIT	(64 * PAGE_SIZE)
 
 unsigned long move_page_tables(struct vm_area_struct *vma,
@@ -154,6 +197,13 @@ unsigned long move_page_tables(struct vm_area_struct *vma,
 		next = (new_addr + PMD_SIZE) & PMD_MASK;
 		if (extent > next - new_addr)
 			extent = next - new_addr;
+		if (extent == PMD_SIZE &&
+		    move_normal_pmd(vma, old_addr, new_vma, new_addr,
+				    old_pmd, new_pmd))
+			continue;
+		if (pmd_none(*new_pmd) &&
+		    __pte_alloc(new_vma->vm_mm, new_vma, new_pmd, new_addr))
+			break;
 		if (extent > LATENCY_LIMIT)
 			extent = LATENCY_LIMIT;
 		move_ptes(vma, old_pmd, old_addr, old_addr + extent,
@@ -175,7 +225,6 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 	unsigned long excess = 0;
 	unsigned long hiwater_vm;
 	int split = 0;
-	int err;
 
 	/*
 	 * We'd prefer to avoid failure later on in do_munmap:
@@ -184,22 +233,18 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 	if (mm->map_count >= sysctl_max_map_count - 3)
 		return -ENOMEM;
 
-	/*
-	 * Advise KSM to break any KSM pages in the area to be moved:
-	 * it would be confusing if they were to turn up at the new
-	 * location, where they happen to coincide with different KSM
-	 * pages recently unmapped.  But leave vma->vm_flags as it was,
-	 * so KSM can come around to merge on vma and new_vma afterwards.
-	 */
-	err = unmerge_ksm_pages(vma, old_addr, old_addr + old_len);
-	if (err)
-		return err;
-
 	new_pgoff = vma->vm_pgoff + ((old_addr - vma->vm_start) >> PAGE_SHIFT);
 	new_vma = copy_vma(&vma, new_addr, new_len, new_pgoff);
 	if (!new_vma)
 		return -ENOMEM;
 
+	/*
+	 * The KSM pages in the area move with it, still merged: the
+	 * rmap_items of vma's slots go with the old range, and new_vma's
+	 * slots find the pages again when scanned, see ksm_vma_moved().
+	 */
+	ksm_vma_moved(vma, old_addr, new_vma, new_addr, old_len);
+
 	moved_len = move_page_tables(vma, old_addr, new_vma, new_addr, old_len);
 	if (moved_len < old_len) {
 		/*
@@ -282,9 +282,91 @@ static enum oom_constraint constrained_alloc(struct zonelist *zonelist,
 }
 #endif
 
+struct oom_scan {
+	struct task_struct *chosen;
+	unsigned int points;
+	unsigned long totalpages;
+	struct mem_cgroup *mem;
+	const nodemask_t *nodemask;
+};
+
+/*
+ * Weigh @p against the task chosen so far.  Returns non-zero to end the
+ * scan, with the chosen task ERR_PTR(-1UL) when the oom kill should wait.
+ */
+static int oom_scan_task(struct task_struct *p, void *arg)
+{
+	struct oom_scan *scan = arg;
+	unsigned int points;
+
+	if (oom_unkillable_task(p, scan->mem, scan->nodemask))
+		return 0;
+
+	/*
+	 * This task already has access to memory reserves and is
+	 * being killed. Don't allow any other task access to the
+	 * memory reserve.
+	 *
+	 * Note: this may have a chance of deadlock if it gets
+	 * blocked waiting for another task which itself is waiting
+	 * for memory. Is there a better alternative?
+	 */
+	if (test_tsk_thread_flag(p, TIF_MEMDIE)) {
+		scan->chosen = ERR_PTR(-1UL);
+		return 1;
+	}
+
+	/*
+	 * This is in the process of releasing memory so wait for it
+	 * to finish before killing some other task by mistake.
+	 *
+	 * However, if p is the current task, we allow the 'kill' to
+	 * go ahead if it is exiting: this will simply set TIF_MEMDIE,
+	 * which will allow it to gain access to memory reserves in
+	 * the process of exiting and releasing its resources.
+	 * Otherwise we could get an easy OOM deadlock.
+	 */
+	if (thread_group_empty(p) && (p->flags & PF_EXITING) && p->mm) {
+		if (p != current) {
+			scan->chosen = ERR_PTR(-1UL);
+			return 1;
+		}
+
+		scan->chosen = p;
+		scan->points = 1000;
+	}
+
+	points = oom_badness(p, scan->mem, scan->nodemask, scan->totalpages);
+	if (points > scan->points) {
+		scan->chosen = p;
+		scan->points = points;
+	}
+	return 0;
+}
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+/*
+ * The memcg scan sees every thread of the cgroups: weigh each mm once,
+ * through the thread that owns it and so charges the memcg.
+ */
+static int oom_scan_memcg_task(struct task_struct *p, void *arg)
+{
+	bool owner;
+
+	task_lock(p);
+	owner = p->mm && p->mm->owner == p;
+	task_unlock(p);
+
+	return owner ? oom_scan_task(p, arg) : 0;
+}
+#endif
+
 /*
  * Simple selection loop. We chose the process with the highest
- * number of 'points'. We expect the caller will lock the tasklist.
+ * number of 'points'.  A memcg oom only walks the tasks of the memcg's
+ * cgroups, anything else walks all processes under RCU: neither holds
+ * tasklist_lock, so fork and exit go on while we look.  The chosen task
+ * is returned with a reference held.
  *
  * (not docbooked, we don't want this one cluttering up the manual)
  */
@@ -292,54 +374,29 @@ static struct task_struct *select_bad_process(unsigned int *ppoints,
 		unsigned long totalpages, struct mem_cgroup *mem,
 		const nodemask_t *nodemask)
 {
+	struct oom_scan scan = {
+		.totalpages = totalpages,
+		.mem = mem,
+		.nodemask = nodemask,
+	};
 	struct task_struct *p;
-	struct task_struct *chosen = NULL;
-	*ppoints = 0;
 
+	rcu_read_lock();
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+	if (mem)
+		mem_cgroup_scan_tasks(mem, oom_scan_memcg_task, &scan);
+	else
+#endif
 	for_each_process(p) {
-		unsigned int points;
-
-		if (oom_unkillable_task(p, mem, nodemask))
-			continue;
-
-		/*
-		 * This task already has access to memory reserves and is
-		 * being killed. Don't allow any other task access to the
-		 * memory reserve.
-		 *
-		 * Note: this may have a chance of deadlock if it gets
-		 * blocked waiting for another task which itself is waiting
-		 * for memory. Is there a better alternative?
-		 */
-		if (test_tsk_thread_flag(p, TIF_MEMDIE))
-			return ERR_PTR(-1UL);
-
-		/*
-		 * This is in the process of releasing memory so wait for it
-		 * to finish before killing some other task by mistake.
-		 *
-		 * However, if p is the current task, we allow the 'kill' to
-		 * go ahead if it is exiting: this will simply set TIF_MEMDIE,
-		 * which will allow it to gain access to memory reserves in
-		 * the process of exiting and releasing its resources.
-		 * Otherwise we could get an easy OOM deadlock.
-		 */
-		if (thread_group_empty(p) && (p->flags & PF_EXITING) && p->mm) {
-			if (p != current)
-				return ERR_PTR(-1UL);
-
-			chosen = p;
-			*ppoints = 1000;
-		}
-
-		points = oom_badness(p, mem, nodemask, totalpages);
-		if (points > *ppoints) {
-			chosen = p;
-			*ppoints = points;
-		}
+		if (oom_scan_task(p, &scan))
+			break;
 	}
+	if (!IS_ERR_OR_NULL(scan.chosen))
+		get_task_struct(scan.chosen);
+	rcu_read_unlock();
 
-	return chosen;
+	*ppoints = scan.points;
+	return scan.chosen;
 }
 
 /**
@@ -506,6 +563,28 @@ static int oom_kill_process(struct task_struct *p, gfp_t gfp_mask, int order,
 	return oom_kill_task(victim, mem);
 }
 
+/*
+ * oom_kill_process() for a task select_bad_process() chose without
+ * tasklist_lock: takes the lock and drops the reference to @p.
+ */
+static int oom_kill_chosen(struct task_struct *p, gfp_t gfp_mask, int order,
+			   unsigned int points, unsigned long totalpages,
+			   struct mem_cgroup *mem, nodemask_t *nodemask,
+			   const char *message)
+{
+	int ret = 1;
+
+	read_lock(&tasklist_lock);
+	/* it may have exited since, look again then */
+	if (pid_alive(p))
+		ret = oom_kill_process(p, gfp_mask, order, points, totalpages,
+				       mem, nodemask, message);
+	read_unlock(&tasklist_lock);
+	put_task_struct(p);
+
+	return ret;
+}
+
 /*
  * Determines whether the kernel must panic because of the panic_on_oom sysctl.
  */
@@ -539,17 +618,14 @@ void mem_cgroup_out_of_memory(struct mem_cgroup *mem, gfp_t gfp_mask)
 
 	check_panic_on_oom(CONSTRAINT_MEMCG, gfp_mask, 0, NULL);
 	limit = mem_cgroup_get_limit(mem) >> PAGE_SHIFT;
-	read_lock(&tasklist_lock);
 retry:
 	p = select_bad_process(&points, limit, mem, NULL);
 	if (!p || PTR_ERR(p) == -1UL)
-		goto out;
+		return;
 
-	if (oom_kill_process(p, gfp_mask, 0, points, limit, mem, NULL,
+	if (oom_kill_chosen(p, gfp_mask, 0, points, limit, mem, NULL,
 				"Memory cgroup out of memory"))
 		goto retry;
-out:
-	read_unlock(&tasklist_lock);
 }
 #endif
 
@@ -702,7 +778,6 @@ void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 	mpol_mask = (constraint == CONSTRAINT_MEMORY_POLICY) ? nodemask : NULL;
 	check_panic_on_oom(constraint, gfp_mask, order, mpol_mask);
 
-	read_lock(&tasklist_lock);
 	if (sysctl_oom_kill_allocating_task &&
 	    !oom_unkillable_task(current, NULL, nodemask) &&
 	    current->mm && !atomic_read(&current->mm->oom_disable_count)) {
@@ -711,30 +786,32 @@ void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 		 * non-zero, current could not be killed so we must fallback to
 		 * the tasklist scan.
 		 */
-		if (!oom_kill_process(current, gfp_mask, order, 0, totalpages,
-				NULL, nodemask,
-				"Out of memory (oom_kill_allocating_task)"))
-			goto out;
+		read_lock(&tasklist_lock);
+		killed = !oom_kill_process(current, gfp_mask, order, 0,
+				totalpages, NULL, nodemask,
+				"Out of memory (oom_kill_allocating_task)");
+		read_unlock(&tasklist_lock);
+		if (killed)
+			return;
 	}
 
 retry:
 	p = select_bad_process(&points, totalpages, NULL, mpol_mask);
 	if (PTR_ERR(p) == -1UL)
-		goto out;
+		return;
 
 	/* Found nothing?!?! Either we hang forever, or we panic. */
 	if (!p) {
+		read_lock(&tasklist_lock);
 		dump_header(NULL, gfp_mask, order, NULL, mpol_mask);
 		read_unlock(&tasklist_lock);
 		panic("Out of memory and no killable processes...\n");
 	}
 
-	if (oom_kill_process(p, gfp_mask, order, points, totalpages, NULL,
+	if (oom_kill_chosen(p, gfp_mask, order, points, totalpages, NULL,
 				nodemask, "Out of memory"))
 		goto retry;
 	killed = 1;
-out:
-	read_unlock(&tasklist_lock);
 
 	/*
 	 * Give "p" a good chance of killing itself before we
@@ -37,24 +37,25 @@
 #include <trace/events/writeback.h>
 
 /*
- * After a CPU has dirtied this many pages, balance_dirty_pages_ratelimited
- * will look to see if it needs to force writeback or throttling.
+ * A task dirtying pages looks in balance_dirty_pages() at least once every
+ * this many pages, however far below the dirty limits the system is.
  */
 static long ratelimit_pages = 32;
 
 /*
- * When balance_dirty_pages decides that the caller needs to perform some
- * non-background writeback, this is how many pages it will attempt to write.
- * It should be somewhat larger than dirtied pages to ensure that reasonably
- * large amounts of I/O are submitted.
+ * Write bandwidth and the dirty ratelimit are estimated every 200ms.
  */
-static inline long sync_writeback_pages(unsigned long dirtied)
-{
-	if (dirtied < ratelimit_pages)
-		dirtied = ratelimit_pages;
+#define BANDWIDTH_INTERVAL	max(HZ/5, 1)
 
-	return dirtied + dirtied / 2;
-}
+/*
+ * A throttled task sleeps at most 200ms at a time.
+ */
+#define MAX_PAUSE		max(HZ/5, 1)
+
+/*
+ * Fixed point shift of the position ratio, 1 << RATELIMIT_CALC_SHIFT is 1.
+ */
+#define RATELIMIT_CALC_SHIFT	10
 
 /* The following parameters are exported via /proc/sys/vm */
 
@@ -219,6 +220,7 @@ int dirty_bytes_handler(struct ctl_table *table, int write,
  */
 static inline void __bdi_writeout_inc(struct backing_dev_info *bdi)
 {
+	__inc_bdi_stat(bdi, BDI_WRITTEN);
 	__prop_inc_percpu_max(&vm_completions, &bdi->completions,
 			      bdi->max_prop_frac);
 }
@@ -468,37 +470,175 @@ unsigned long bdi_dirty_limit(struct backing_dev_info *bdi, unsigned long dirty)
 	return bdi_dirty;
 }
 
+/*
+ * How many pages a task may dirty before it looks again: the square root
+ * of its distance to the dirty limit, so that tasks far below it poll
+ * rarely and tasks close to it poll often.
+ */
+static unsigned long dirty_poll_interval(unsigned long dirty,
+					 unsigned long thresh)
+{
+	unsigned long interval = 1;
+
+	if (thresh > dirty)
+		interval = 1UL << (ilog2(thresh - dirty) >> 1);
+
+	return min_t(unsigned long, interval, ratelimit_pages);
+}
+
+/*
+ * bdi_position_ratio - how much faster or slower than its base rate @bdi's
+ * dirtiers may go, as a fixed point number
+ *
+ * The global part is 2 at @freerun, 1 at the setpoint halfway to @limit and
+ * 0 at @limit, so the number of dirty pages settles around the setpoint.
+ * A bdi over its own share of the limit is slowed down further in proportion,
+ * down to an eighth, so that one device filling up cannot starve the others.
+ */
+static unsigned long bdi_position_ratio(unsigned long freerun,
+					unsigned long limit,
+					unsigned long dirty,
+					unsigned long bdi_thresh,
+					unsigned long bdi_dirty)
+{
+	unsigned long pos_ratio;
+	unsigned long bdi_ratio;
+
+	if (dirty >= limit)
+		return 0;
+
+	pos_ratio = div_u64((u64)(limit - dirty) << (RATELIMIT_CALC_SHIFT + 1),
+			    limit - freerun + 1);
+	pos_ratio = min_t(unsigned long, pos_ratio, 2 << RATELIMIT_CALC_SHIFT);
+
+	if (bdi_dirty > bdi_thresh) {
+		bdi_ratio = div_u64((u64)bdi_thresh << RATELIMIT_CALC_SHIFT,
+				    bdi_dirty);
+		bdi_ratio = max_t(unsigned long, bdi_ratio,
+				  1 << (RATELIMIT_CALC_SHIFT - 3));
+		pos_ratio = (pos_ratio * bdi_ratio) >> RATELIMIT_CALC_SHIFT;
+	}
+
+	return pos_ratio;
+}
+
+/*
+ * The write bandwidth is a running average of what the bdi wrote back in
+ * each interval, over a period of about three seconds:
+ *
+ *                   bw * elapsed + write_bandwidth * (period - elapsed)
+ * write_bandwidth = ---------------------------------------------------
+ *                                         period
+ */
+static void bdi_update_write_bandwidth(struct backing_dev_info *bdi,
+				       unsigned long elapsed,
+				       unsigned long written)
+{
+	const unsigned long period = roundup_pow_of_two(3 * HZ);
+	u64 bw;
+
+	bw = (u64)(written - bdi->written_stamp) * HZ;
+	bw += (u64)bdi->write_bandwidth * (period - elapsed);
+	bw >>= ilog2(period);
+
+	bdi->write_bandwidth = max_t(unsigned long, bw, 1);
+}
+
+/*
+ * The dirty ratelimit is the rate each dirtier of the bdi gets at the
+ * setpoint. The tasks throttled at task_ratelimit dirtied dirty_rate pages
+ * per second between them, while the bdi wrote write_bandwidth; had each of
+ * them been held to
+ *
+ *	balanced = task_ratelimit * write_bandwidth / dirty_rate
+ *
+ * they would have dirtied exactly as fast as the bdi writes. The ratelimit
+ * moves an eighth of the way towards that every interval, which is smooth
+ * enough not to oscillate and still follows a changing number of dirtiers.
+ */
+static void bdi_update_dirty_ratelimit(struct backing_dev_info *bdi,
+				       unsigned long pos_ratio,
+				       unsigned long elapsed,
+				       unsigned long dirtied)
+{
+	unsigned long ratelimit = bdi->dirty_ratelimit;
+	unsigned long dirty_rate, task_ratelimit, balanced;
+
+	dirty_rate = (dirtied - bdi->dirtied_stamp) * HZ / elapsed;
+	task_ratelimit = ((u64)ratelimit * pos_ratio >> RATELIMIT_CALC_SHIFT) + 1;
+	balanced = div_u64((u64)task_ratelimit * bdi->write_bandwidth,
+			   dirty_rate | 1);
+	balanced = min(balanced, bdi->write_bandwidth);
+
+	if (balanced > ratelimit)
+		ratelimit += (balanced - ratelimit + 7) >> 3;
+	else
+		ratelimit -= (ratelimit - balanced) >> 3;
+
+	bdi->dirty_ratelimit = max(ratelimit, 1UL);
+}
+
+static void bdi_update_bandwidth(struct backing_dev_info *bdi,
+				 unsigned long pos_ratio)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed;
+	unsigned long dirtied, written;
+
+	if (time_before(now, bdi->bw_time_stamp + BANDWIDTH_INTERVAL))
+		return;
+	if (!spin_trylock(&bdi->bw_lock))
+		return;
+
+	elapsed = now - bdi->bw_time_stamp;
+	if (elapsed < BANDWIDTH_INTERVAL)
+		goto unlock;
+
+	dirtied = bdi_stat(bdi, BDI_DIRTIED);
+	written = bdi_stat(bdi, BDI_WRITTEN);
+
+	/*
+	 * Nobody was throttled for over a second: that stretch says nothing
+	 * about how fast the bdi can write, start afresh from here.
+	 */
+	if (elapsed <= HZ) {
+		bdi_update_write_bandwidth(bdi, elapsed, written);
+		bdi_update_dirty_ratelimit(bdi, pos_ratio, elapsed, dirtied);
+	}
+
+	bdi->dirtied_stamp = dirtied;
+	bdi->written_stamp = written;
+	bdi->bw_time_stamp = now;
+unlock:
+	spin_unlock(&bdi->bw_lock);
+}
+
 /*
  * balance_dirty_pages() must be called by processes which are generating dirty
- * data.  It looks at the number of dirty pages in the machine and will force
- * the caller to perform writeback if the system is over `vm_dirty_ratio'.
- * If we're over `background_thresh' then the writeback threads are woken to
- * perform some writeout.
+ * data.  It looks at the number of dirty pages in the machine and, once that
+ * is past the midpoint of the background and dirty thresholds, puts the
+ * caller to sleep for as long as it takes the bdi to write @pages_dirtied
+ * pages at the rate this task is allowed: the bdi's dirty ratelimit scaled
+ * by the position ratio.  The writeback itself is left to the flusher
+ * threads, which are woken if they are not already at work.
  */
 static void balance_dirty_pages(struct address_space *mapping,
-				unsigned long write_chunk)
+				unsigned long pages_dirtied)
 {
-	long nr_reclaimable, bdi_nr_reclaimable;
-	long nr_writeback, bdi_nr_writeback;
+	unsigned long nr_reclaimable, bdi_nr_reclaimable;
+	unsigned long nr_dirty, bdi_dirty;
 	unsigned long background_thresh;
 	unsigned long dirty_thresh;
 	unsigned long bdi_thresh;
-	unsigned long pages_written = 0;
-	unsigned long pause = 1;
+	unsigned long freerun, pos_ratio, task_ratelimit;
+	long pause;
 	bool dirty_exceeded = false;
 	struct backing_dev_info *bdi = mapping->backing_dev_info;
 
 	for (;;) {
-		struct writeback_control wbc = {
-			.sync_mode	= WB_SYNC_NONE,
-			.older_than_this = NULL,
-			.nr_to_write	= write_chunk,
-			.range_cyclic	= 1,
-		};
-
 		nr_reclaimable = global_page_state(NR_FILE_DIRTY) +
 					global_page_state(NR_UNSTABLE_NFS);
-		nr_writeback = global_page_state(NR_WRITEBACK);
+		nr_dirty = nr_reclaimable + global_page_state(NR_WRITEBACK);
 
 		global_dirty_limits(&background_thresh, &dirty_thresh);
 
@@ -507,9 +647,16 @@ static void balance_dirty_pages(struct address_space *mapping,
 		 * catch-up. This avoids (excessively) small writeouts
 		 * when the bdi limits are ramping up.
 		 */
-		if (nr_reclaimable + nr_writeback <=
-				(background_thresh + dirty_thresh) / 2)
+		freerun = (background_thresh + dirty_thresh) / 2;
+		if (nr_dirty <= freerun) {
+			current->nr_dirtied = 0;
+			current->nr_dirtied_pause =
+				dirty_poll_interval(nr_dirty, dirty_thresh);
 			break;
+		}
+
+		if (unlikely(!writeback_in_progress(bdi)))
+			bdi_start_background_writeback(bdi);
 
 		bdi_thresh = bdi_dirty_limit(bdi, dirty_thresh);
 		bdi_thresh = task_dirty_limit(current, bdi_thresh);
@@ -526,10 +673,12 @@ static void balance_dirty_pages(struct address_space *mapping,
 		 */
 		if (bdi_thresh < 2*bdi_stat_error(bdi)) {
 			bdi_nr_reclaimable = bdi_stat_sum(bdi, BDI_RECLAIMABLE);
-			bdi_nr_writeback = bdi_stat_sum(bdi, BDI_WRITEBACK);
+			bdi_dirty = bdi_nr_reclaimable +
+				    bdi_stat_sum(bdi, BDI_WRITEBACK);
 		} else {
 			bdi_nr_reclaimable = bdi_stat(bdi, BDI_RECLAIMABLE);
-			bdi_nr_writeback = bdi_stat(bdi, BDI_WRITEBACK);
+			bdi_dirty = bdi_nr_reclaimable +
+				    bdi_stat(bdi, BDI_WRITEBACK);
 		}
 
 		/*
@@ -538,44 +687,46 @@ static void balance_dirty_pages(struct address_space *mapping,
 		 * bdi or process from holding back light ones; The latter is
 		 * the last resort safeguard.
 		 */
-		dirty_exceeded =
-			(bdi_nr_reclaimable + bdi_nr_writeback > bdi_thresh)
-			|| (nr_reclaimable + nr_writeback > dirty_thresh);
+		dirty_exceeded = (bdi_dirty > bdi_thresh) ||
+				 (nr_dirty > dirty_thresh);
+		if (dirty_exceeded && !bdi->dirty_exceeded)
+			bdi->dirty_exceeded = 1;
 
-		if (!dirty_exceeded)
-			break;
+		pos_ratio = bdi_position_ratio(freerun, dirty_thresh, nr_dirty,
+					       bdi_thresh, bdi_dirty);
+		bdi_update_bandwidth(bdi, pos_ratio);
 
-		if (!bdi->dirty_exceeded)
-			bdi->dirty_exceeded = 1;
+		task_ratelimit = ((u64)bdi->dirty_ratelimit * pos_ratio) >>
+							RATELIMIT_CALC_SHIFT;
+		if (unlikely(!task_ratelimit))
+			pause = MAX_PAUSE;
+		else
+			pause = min_t(long, HZ * pages_dirtied / task_ratelimit,
+				      MAX_PAUSE);
 
-		/* Note: nr_reclaimable denotes nr_dirty + nr_unstable.
-		 * Unstable writes are a feature of certain networked
-		 * filesystems (i.e. NFS) in which data may have been
-		 * written to the server's write cache, but has not yet
-		 * been flushed to permanent storage.
-		 * Only move pages to writeback if this bdi is over its
-		 * threshold otherwise wait until the disk writes catch
-		 * up.
+		/*
+		 * Look again after about a tenth of a second's worth of
+		 * pages at the rate allowed, or sooner near the limit.
 		 */
-		trace_wbc_balance_dirty_start(&wbc, bdi);
-		if (bdi_nr_reclaimable > bdi_thresh) {
-			writeback_inodes_wb(&bdi->wb, &wbc);
-			pages_written += write_chunk - wbc.nr_to_write;
-			trace_wbc_balance_dirty_written(&wbc, bdi);
-			if (pages_written >= write_chunk)
-				break;		/* We've done our duty */
-		}
-		trace_wbc_balance_dirty_wait(&wbc, bdi);
+		current->nr_dirtied = 0;
+		current->nr_dirtied_pause = clamp_t(unsigned long,
+					task_ratelimit / 10, 1,
+					dirty_poll_interval(nr_dirty,
+							    dirty_thresh));
+		if (pause <= 0)
+			break;
+
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		io_schedule_timeout(pause);
 
 		/*
-		 * Increase the delay for each loop, up to our previous
-		 * default of taking a 100ms nap.
+		 * Over the hard limit the task stays here until writeback
+		 * brings the dirty pages back under it.
 		 */
-		pause <<= 1;
-		if (pause > HZ / 10)
-			pause = HZ / 10;
+		if (nr_dirty <= dirty_thresh)
+			break;
+		if (fatal_signal_pending(current))
+			break;
 	}
 
 	if (!dirty_exceeded && bdi->dirty_exceeded)
@@ -592,8 +743,10 @@ static void balance_dirty_pages(struct address_space *mapping,
 	 * In normal mode, we start background writeout at the lower
 	 * background_thresh, to keep the amount of dirty memory low.
 	 */
-	if ((laptop_mode && pages_written) ||
-	    (!laptop_mode && (nr_reclaimable > background_thresh)))
+	if (laptop_mode)
+		return;
+
+	if (nr_reclaimable > background_thresh)
 		bdi_start_background_writeback(bdi);
 }
 
@@ -607,8 +760,6 @@ void set_page_dirty_balance(struct page *page, int page_mkwrite)
 	}
 }
 
-static DEFINE_PER_CPU(unsigned long, bdp_ratelimits) = 0;
-
 /**
  * balance_dirty_pages_ratelimited_nr - balance dirty memory state
  * @mapping: address_space which was dirtied
@@ -616,38 +767,29 @@ static DEFINE_PER_CPU(unsigned long, bdp_ratelimits) = 0;
  *
  * Processes which are dirtying memory should call in here once for each page
  * which was newly dirtied.  The function will periodically check the system's
- * dirty state and will initiate writeback if needed.
+ * dirty state and will throttle the caller if needed.
  *
- * On really big machines, get_writeback_state is expensive, so try to avoid
- * calling it too often (ratelimiting).  But once we're over the dirty memory
- * limit we decrease the ratelimiting by a lot, to prevent individual processes
- * from overshooting the limit by (ratelimit_pages) each.
+ * The pages are counted per task as they are accounted dirty, so
+ * @nr_pages_dirtied only tells that some were.  How many a task may dirty
+ * before it looks again was set on its last visit to balance_dirty_pages(),
+ * and is cut down while the bdi is over its limit, to prevent individual
+ * processes from overshooting it by much.
  */
 void balance_dirty_pages_ratelimited_nr(struct address_space *mapping,
 					unsigned long nr_pages_dirtied)
 {
-	unsigned long ratelimit;
-	unsigned long *p;
-
-	ratelimit = ratelimit_pages;
-	if (mapping->backing_dev_info->dirty_exceeded)
-		ratelimit = 8;
+	struct backing_dev_info *bdi = mapping->backing_dev_info;
+	int ratelimit;
 
-	/*
-	 * Check the rate limiting. Also, we do not want to throttle real-time
-	 * tasks in balance_dirty_pages(). Period.
-	 */
-	preempt_disable();
-	p =  &__get_cpu_var(bdp_ratelimits);
-	*p += nr_pages_dirtied;
-	if (unlikely(*p >= ratelimit)) {
-		ratelimit = sync_writeback_pages(*p);
-		*p = 0;
-		preempt_enable();
-		balance_dirty_pages(mapping, ratelimit);
+	if (!bdi_cap_account_dirty(bdi))
 		return;
-	}
-	preempt_enable();
+
+	ratelimit = current->nr_dirtied_pause;
+	if (bdi->dirty_exceeded)
+		ratelimit = min(ratelimit, 32 >> (PAGE_SHIFT - 10));
+
+	if (unlikely(current->nr_dirtied >= ratelimit))
+		balance_dirty_pages(mapping, current->nr_dirtied);
 }
 EXPORT_SYMBOL(balance_dirty_pages_ratelimited_nr);
 
@@ -737,18 +879,15 @@ void laptop_sync_completion(void)
 /*
  * If ratelimit_pages is too high then we can get into dirty-data overload
  * if a large number of processes all perform writes at the same time.
- * If it is too low then SMP machines will call the (expensive)
- * get_writeback_state too often.
+ * If it is too low then SMP machines will read the global dirty state
+ * too often.
  *
  * Here we set ratelimit_pages to a level which ensures that when all CPUs are
  * dirtying in parallel, we cannot go more than 3% (1/32) over the dirty memory
- * thresholds before writeback cuts in.
+ * thresholds before their tasks are throttled.
  *
- * But the limit should not be set too high.  Because it also controls the
- * amount of memory which the balance_dirty_pages() caller has to write back.
- * If this is too large then the caller will block on the IO queue all the
- * time.  So limit it to four megabytes - the balance_dirty_pages() caller
- * will write six megabyte chunks, max.
+ * But the limit should not be set too high, because it is also the most a
+ * task can dirty between two pauses.  So limit it to four megabytes.
  */
 
 void writeback_set_ratelimit(void)
@@ -1039,11 +1178,17 @@ static int __writepage(struct page *page, struct writeback_control *wbc,
 int generic_writepages(struct address_space *mapping,
 		       struct writeback_control *wbc)
 {
+	struct blk_plug plug;
+	int ret;
+
 	/* deal with chardevs and other special file */
 	if (!mapping->a_ops->writepage)
 		return 0;
 
-	return write_cache_pages(mapping, wbc, __writepage, mapping);
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, __writepage, mapping);
+	blk_finish_plug(&plug);
+	return ret;
 }
 
 EXPORT_SYMBOL(generic_writepages);
@@ -1120,7 +1265,9 @@ void account_page_dirtied(struct page *page, struct address_space *mapping)
 		__inc_zone_page_state(page, NR_FILE_DIRTY);
 		__inc_zone_page_state(page, NR_DIRTIED);
 		__inc_bdi_stat(mapping->backing_dev_info, BDI_RECLAIMABLE);
+		__inc_bdi_stat(mapping->backing_dev_info, BDI_DIRTIED);
 		task_dirty_inc(current);
+		current->nr_dirtied++;
 		task_io_account_write(PAGE_CACHE_SIZE);
 	}
 }
@@ -51,6 +51,7 @@
 #include <linux/kmemleak.h>
 #include <linux/memory.h>
 #include <linux/compaction.h>
+#include <linux/kthread.h>
 #include <trace/events/kmem.h>
 #include <linux/ftrace_event.h>
 
@@ -1148,6 +1149,47 @@ void mark_free_pages(struct zone *zone)
 }
 #endif /* CONFIG_PM */
 
+/*
+ * The pcp lists adapt their chunks of buddy add/remove to the recent
+ * traffic: each time frees overflow pcp->high with no refill in between,
+ * twice as many pages go back at once, and each time allocations find a
+ * list empty with no free drained in between, twice as many come, up to
+ * batch << PCP_MAX_FACTOR and within pcp->high. A storm of either then
+ * takes zone->lock about once per pcp->high pages, not once per batch.
+ */
+#define PCP_MAX_FACTOR	3
+
+/* how many pages an overflowing pcp list gives back to the buddy */
+static int nr_pcp_free(struct per_cpu_pages *pcp, int remote)
+{
+	/* the zone->lock of another node costs more: the largest chunks */
+	int factor = remote ? PCP_MAX_FACTOR : pcp->free_factor;
+	int count = pcp->batch << factor;
+
+	/* keep a batch back for the next allocations */
+	count = min(count, max(pcp->count - pcp->batch, pcp->batch));
+	count = min(count, pcp->count);
+
+	if (pcp->free_factor < PCP_MAX_FACTOR)
+		pcp->free_factor++;
+	pcp->alloc_factor >>= 1;
+	return count;
+}
+
+/* how many pages an empty pcp list takes from the buddy */
+static int nr_pcp_alloc(struct per_cpu_pages *pcp)
+{
+	int count = pcp->batch << pcp->alloc_factor;
+
+	/* not beyond pcp->high, where the next free would drain them */
+	count = min(count, max(pcp->high - pcp->count, pcp->batch));
+
+	if (pcp->alloc_factor < PCP_MAX_FACTOR)
+		pcp->alloc_factor++;
+	pcp->free_factor >>= 1;
+	return count;
+}
+
 /*
  * Free a 0-order page
  * cold == 1 ? free a cold page : free a hot page
@@ -1192,8 +1234,10 @@ void free_hot_cold_page(struct page *page, int cold)
 		list_add(&page->lru, &pcp->lists[migratetype]);
 	pcp->count++;
 	if (pcp->count >= pcp->high) {
-		free_pcppages_bulk(zone, pcp->batch, pcp);
-		pcp->count -= pcp->batch;
+		int count = nr_pcp_free(pcp, zone_to_nid(zone) != numa_node_id());
+
+		free_pcppages_bulk(zone, count, pcp);
+		pcp->count -= count;
 	}
 
 out:
@@ -1297,7 +1341,7 @@ again:
 		list = &pcp->lists[migratetype];
 		if (list_empty(list)) {
 			pcp->count += rmqueue_bulk(zone, 0,
-					pcp->batch, list,
+					nr_pcp_alloc(pcp), list,
 					migratetype, cold);
 			if (unlikely(list_empty(list)))
 				goto failed;
@@ -2029,6 +2073,10 @@ restart:
 		wake_all_kswapd(order, zonelist, high_zoneidx,
 						zone_idx(preferred_zone));
 
+	/* Have the free pageblock reserve refilled in the background */
+	if (order > PAGE_ALLOC_COSTLY_ORDER)
+		wakeup_kcompactd(preferred_zone);
+
 	/*
 	 * OK, we're below the kswapd watermark and have kicked background
 	 * reclaim. Now things get more complex, so set up alloc_flags according
@@ -2225,6 +2273,108 @@ __alloc_pages_nodemask(gfp_t gfp_mask, unsigned int order,
 }
 EXPORT_SYMBOL(__alloc_pages_nodemask);
 
+/**
+ * __alloc_pages_bulk - allocate a batch of order-0 pages
+ * @gfp_mask: GFP flags for the allocation
+ * @zonelist: the zonelist to allocate from, in order
+ * @nodemask: the allowed nodes, or NULL
+ * @nr_pages: number of pages wanted
+ * @pages: array the pages are stored into
+ *
+ * Takes as many free pages as it can from each zone of the zonelist which
+ * is above its low watermark by what is still missing, under a single hold
+ * of its zone->lock, falling back to the next zones and nodes. Nothing is
+ * reclaimed: if even the first page can't be had that way, a single page
+ * goes through the usual allocator slow path.
+ *
+ * Returns the number of pages stored at the start of @pages, which may be
+ * less than @nr_pages, or 0 if none could be allocated.
+ */
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, struct zonelist *zonelist,
+				 nodemask_t *nodemask, unsigned long nr_pages,
+				 struct page **pages)
+{
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	int migratetype = allocflags_to_migratetype(gfp_mask);
+	struct zone *preferred_zone, *zone;
+	struct zoneref *z;
+	unsigned long nr = 0;
+
+	if (!nr_pages)
+		return 0;
+
+	gfp_mask &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(gfp_mask);
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	if (nr_pages == 1 || should_fail_alloc_page(gfp_mask, 0) ||
+	    unlikely(!zonelist->_zonerefs->zone))
+		goto single;
+
+	get_mems_allowed();
+	first_zones_zonelist(zonelist, high_zoneidx,
+				nodemask ? : &cpuset_current_mems_allowed,
+				&preferred_zone);
+	if (!preferred_zone) {
+		put_mems_allowed();
+		goto single;
+	}
+
+	for_each_zone_zonelist_nodemask(zone, z, zonelist,
+						high_zoneidx, nodemask) {
+		unsigned long flags, mark, taken, i, start = nr;
+
+		if (!cpuset_zone_allowed_softwall(zone,
+						  gfp_mask | __GFP_HARDWALL))
+			continue;
+
+		mark = low_wmark_pages(zone) + (nr_pages - nr);
+		if (!zone_watermark_ok(zone, 0, mark,
+				       zone_idx(preferred_zone), 0))
+			continue;
+
+		spin_lock_irqsave(&zone->lock, flags);
+		for (taken = 0; nr + taken < nr_pages; taken++) {
+			struct page *page = __rmqueue(zone, 0, migratetype);
+
+			if (!page)
+				break;
+			pages[nr + taken] = page;
+		}
+		spin_unlock(&zone->lock);
+		__mod_zone_page_state(zone, NR_FREE_PAGES, -taken);
+		__count_zone_vm_events(PGALLOC, zone, taken);
+		for (i = 0; i < taken; i++)
+			zone_statistics(preferred_zone, zone);
+		local_irq_restore(flags);
+
+		/* as in buffered_rmqueue(), a bad page is left alone */
+		for (i = 0; i < taken; i++) {
+			struct page *page = pages[start + i];
+
+			VM_BUG_ON(bad_range(zone, page));
+			if (prep_new_page(page, 0, gfp_mask))
+				continue;
+			trace_mm_page_alloc(page, 0, gfp_mask, migratetype);
+			pages[nr++] = page;
+		}
+
+		if (nr == nr_pages)
+			break;
+	}
+	put_mems_allowed();
+
+	if (nr)
+		return nr;
+
+single:
+	pages[0] = __alloc_pages_nodemask(gfp_mask, 0, zonelist, nodemask);
+	return pages[0] ? 1 : 0;
+}
+EXPORT_SYMBOL(__alloc_pages_bulk);
+
 /*
  * Common helper functions.
  */
@@ -3289,6 +3439,74 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 	}
 }
 
+static void __meminit __init_single_page(struct page *page, unsigned long pfn,
+					unsigned long zone, int nid)
+{
+	struct zone *z = &NODE_DATA(nid)->node_zones[zone];
+
+	set_page_links(page, zone, nid, pfn);
+	mminit_verify_page_links(page, zone, nid, pfn);
+	init_page_count(page);
+	reset_page_mapcount(page);
+	SetPageReserved(page);
+	/*
+	 * Mark the block movable so that blocks are reserved for
+	 * movable at startup. This will force kernel allocations
+	 * to reserve their blocks rather than leaking throughout
+	 * the address space during boot when many long-lived
+	 * kernel allocations are made. Later some blocks near
+	 * the start are marked MIGRATE_RESERVE by
+	 * setup_zone_migrate_reserve()
+	 *
+	 * bitmap is created for zone's valid pfn range. but memmap
+	 * can be created for invalid pages (for alignment)
+	 * check here not to call set_pageblock_migratetype() against
+	 * pfn out of zone.
+	 */
+	if ((z->zone_start_pfn <= pfn)
+	    && (pfn < z->zone_start_pfn + z->spanned_pages)
+	    && !(pfn & (pageblock_nr_pages - 1)))
+		set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+
+	INIT_LIST_HEAD(&page->lru);
+#ifdef WANT_PAGE_VIRTUAL
+	/* The shift won't overflow because ZONE_NORMAL is below 4G. */
+	if (!is_highmem_idx(zone))
+		set_page_address(page, __va(pfn << PAGE_SHIFT));
+#endif
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* Pages of each node set up at boot, the rest of its ZONE_NORMAL waits */
+#define DEFERRED_INIT_PAGES	(2UL << (30 - PAGE_SHIFT))
+
+/*
+ * Should memmap_init_zone() leave the struct pages from @pfn on to the
+ * node's thread?  Only at a pageblock boundary, so that the thread sets
+ * up whole pageblocks.
+ */
+static bool __meminit defer_memmap_init(int nid, unsigned long zone,
+					unsigned long pfn, unsigned long end_pfn)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+
+	if (zone != ZONE_NORMAL || (pfn & (pageblock_nr_pages - 1)))
+		return false;
+	if (pfn < pgdat->node_start_pfn + DEFERRED_INIT_PAGES)
+		return false;
+
+	pgdat->first_deferred_pfn = pfn;
+	pgdat->deferred_end_pfn = end_pfn;
+	return true;
+}
+#else
+static inline bool defer_memmap_init(int nid, unsigned long zone,
+				     unsigned long pfn, unsigned long end_pfn)
+{
+	return false;
+}
+#endif
+
 /*
  * Initially all pages are reserved - free ones are freed
  * up by free_all_bootmem() once the early boot process is
@@ -3297,15 +3515,12 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		unsigned long start_pfn, enum memmap_context context)
 {
-	struct page *page;
 	unsigned long end_pfn = start_pfn + size;
 	unsigned long pfn;
-	struct zone *z;
 
 	if (highest_memmap_pfn < end_pfn - 1)
 		highest_memmap_pfn = end_pfn - 1;
 
-	z = &NODE_DATA(nid)->node_zones[zone];
 	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
 		/*
 		 * There can be holes in boot-time mem_map[]s
@@ -3317,40 +3532,134 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 				continue;
 			if (!early_pfn_in_nid(pfn, nid))
 				continue;
+			if (defer_memmap_init(nid, zone, pfn, end_pfn))
+				break;
 		}
+		__init_single_page(pfn_to_page(pfn), pfn, zone, nid);
+	}
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/*
+ * The free memory among the deferred struct pages, freed by the node
+ * threads.  Only a few reservations sit that high, so a short table does.
+ */
+#define DEFERRED_FREE_RANGES	256
+
+static struct deferred_range {
+	int nid;
+	unsigned long start, end;
+} deferred_free[DEFERRED_FREE_RANGES] __initdata;
+static int nr_deferred_free __initdata;
+
+bool __init defer_free_range(int nid, unsigned long start, unsigned long end)
+{
+	if (nr_deferred_free == DEFERRED_FREE_RANGES)
+		return false;
+
+	deferred_free[nr_deferred_free].nid = nid;
+	deferred_free[nr_deferred_free].start = start;
+	deferred_free[nr_deferred_free].end = end;
+	nr_deferred_free++;
+	return true;
+}
+
+/*
+ * Set up the deferred struct pages in [@start, @end).  The memmap was
+ * zeroed when it was allocated, and a struct page that was set up has
+ * at least PG_reserved: the ones with flags are already done.
+ */
+void __init memmap_init_deferred(int nid, unsigned long start,
+				 unsigned long end)
+{
+	unsigned long pfn;
+
+	for (pfn = start; pfn < end; pfn++) {
+		struct page *page;
+
+		if (!early_pfn_valid(pfn))
+			continue;
+		if (!early_pfn_in_nid(pfn, nid))
+			continue;
 		page = pfn_to_page(pfn);
-		set_page_links(page, zone, nid, pfn);
-		mminit_verify_page_links(page, zone, nid, pfn);
-		init_page_count(page);
-		reset_page_mapcount(page);
-		SetPageReserved(page);
-		/*
-		 * Mark the block movable so that blocks are reserved for
-		 * movable at startup. This will force kernel allocations
-		 * to reserve their blocks rather than leaking throughout
-		 * the address space during boot when many long-lived
-		 * kernel allocations are made. Later some blocks near
-		 * the start are marked MIGRATE_RESERVE by
-		 * setup_zone_migrate_reserve()
-		 *
-		 * bitmap is created for zone's valid pfn range. but memmap
-		 * can be created for invalid pages (for alignment)
-		 * check here not to call set_pageblock_migratetype() against
-		 * pfn out of zone.
-		 */
-		if ((z->zone_start_pfn <= pfn)
-		    && (pfn < z->zone_start_pfn + z->spanned_pages)
-		    && !(pfn & (pageblock_nr_pages - 1)))
-			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+		if (page->flags)
+			continue;
+		__init_single_page(page, pfn, ZONE_NORMAL, nid);
+	}
+}
 
-		INIT_LIST_HEAD(&page->lru);
-#ifdef WANT_PAGE_VIRTUAL
-		/* The shift won't overflow because ZONE_NORMAL is below 4G. */
-		if (!is_highmem_idx(zone))
-			set_page_address(page, __va(pfn << PAGE_SHIFT));
-#endif
+/* Work the threads do between two cond_resched()s */
+#define DEFERRED_INIT_CHUNK	(1UL << (MAX_ORDER - 1))
+
+static atomic_t pgdat_init_n_undone __initdata;
+static __initdata DECLARE_COMPLETION(pgdat_init_all_done);
+
+static int __init deferred_init_memmap(void *data)
+{
+	pg_data_t *pgdat = data;
+	int nid = pgdat->node_id;
+	const struct cpumask *cpumask = cpumask_of_node(nid);
+	unsigned long start = jiffies, nr_free = 0;
+	unsigned long pfn, end;
+	int i;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
+	for (pfn = pgdat->first_deferred_pfn; pfn < pgdat->deferred_end_pfn;
+	     pfn = end) {
+		end = min(pfn + DEFERRED_INIT_CHUNK, pgdat->deferred_end_pfn);
+		memmap_init_deferred(nid, pfn, end);
+		cond_resched();
+	}
+
+	for (i = 0; i < nr_deferred_free; i++) {
+		struct deferred_range *r = &deferred_free[i];
+
+		if (r->nid != nid)
+			continue;
+		for (pfn = r->start; pfn < r->end; pfn = end) {
+			end = min(pfn + DEFERRED_INIT_CHUNK, r->end);
+			__free_pages_memory(pfn, end);
+			cond_resched();
+		}
+		nr_free += r->end - r->start;
 	}
+
+	printk(KERN_INFO "node %d initialised, %lu pages freed in %ums\n",
+	       nid, nr_free, jiffies_to_msecs(jiffies - start));
+
+	if (atomic_dec_and_test(&pgdat_init_n_undone))
+		complete(&pgdat_init_all_done);
+	return 0;
+}
+
+/*
+ * Start a thread on each node with deferred struct pages, and wait for
+ * them all: nothing after this may find a struct page not set up.
+ */
+void __init page_alloc_init_late(void)
+{
+	struct task_struct *p;
+	int nid;
+
+	atomic_set(&pgdat_init_n_undone, 1);
+	for_each_online_node(nid) {
+		pg_data_t *pgdat = NODE_DATA(nid);
+
+		if (pgdat->first_deferred_pfn >= pgdat->deferred_end_pfn)
+			continue;
+		atomic_inc(&pgdat_init_n_undone);
+		p = kthread_run(deferred_init_memmap, pgdat, "pgdatinit%d", nid);
+		if (IS_ERR(p)) {
+			printk(KERN_ERR "Failed to start pgdatinit%d\n", nid);
+			deferred_init_memmap(pgdat);
+		}
+	}
+	if (!atomic_dec_and_test(&pgdat_init_n_undone))
+		wait_for_completion(&pgdat_init_all_done);
 }
+#endif
 
 static void __meminit zone_init_free_lists(struct zone *zone)
 {
@@ -4136,6 +4445,12 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
+	init_waitqueue_head(&pgdat->kswapd_worker_wait);
+	pgdat->kswapd_priority = -1;
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+	pgdat->kcompactd_wake = 0;
+#endif
 	pgdat_page_cgroup_init(pgdat);
 	
 	for (j = 0; j < MAX_NR_ZONES; j++) {
@@ -4262,6 +4577,10 @@ void __paginginit free_area_init_node(int nid, unsigned long *zones_size,
 
 	pgdat->node_id = nid;
 	pgdat->node_start_pfn = node_start_pfn;
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	pgdat->first_deferred_pfn = ULONG_MAX;
+	pgdat->deferred_end_pfn = 0;
+#endif
 	calculate_node_totalpages(pgdat, zones_size, zholes_size);
 
 	alloc_node_mem_map(pgdat);
@@ -43,61 +43,138 @@ static struct bio *get_swap_bio(gfp_t gfp_flags,
 static void end_swap_bio_write(struct bio *bio, int err)
 {
 	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
-	struct page *page = bio->bi_io_vec[0].bv_page;
-
-	if (!uptodate) {
-		SetPageError(page);
-		/*
-		 * We failed to write the page out to swap-space.
-		 * Re-dirty the page in order to avoid it being reclaimed.
-		 * Also print a dire warning that things will go BAD (tm)
-		 * very quickly.
-		 *
-		 * Also clear PG_reclaim to avoid rotate_reclaimable_page()
-		 */
-		set_page_dirty(page);
-		printk(KERN_ALERT "Write-error on swap-device (%u:%u:%Lu)\n",
-				imajor(bio->bi_bdev->bd_inode),
-				iminor(bio->bi_bdev->bd_inode),
-				(unsigned long long)bio->bi_sector);
-		ClearPageReclaim(page);
-	}
-	end_page_writeback(page);
+	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
+
+	do {
+		struct page *page = bvec->bv_page;
+
+		if (!uptodate) {
+			SetPageError(page);
+			/*
+			 * We failed to write the page out to swap-space.
+			 * Re-dirty the page in order to avoid it being
+			 * reclaimed. Also print a dire warning that things
+			 * will go BAD (tm) very quickly.
+			 *
+			 * Also clear PG_reclaim to avoid
+			 * rotate_reclaimable_page()
+			 */
+			set_page_dirty(page);
+			printk(KERN_ALERT "Write-error on swap-device "
+					"(%u:%u:%Lu)\n",
+					imajor(bio->bi_bdev->bd_inode),
+					iminor(bio->bi_bdev->bd_inode),
+					(unsigned long long)bio->bi_sector);
+			ClearPageReclaim(page);
+		}
+		end_page_writeback(page);
+	} while (--bvec >= bio->bi_io_vec);
 	bio_put(bio);
 }
 
 void end_swap_bio_read(struct bio *bio, int err)
 {
 	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
-	struct page *page = bio->bi_io_vec[0].bv_page;
-
-	if (!uptodate) {
-		SetPageError(page);
-		ClearPageUptodate(page);
-		printk(KERN_ALERT "Read-error on swap-device (%u:%u:%Lu)\n",
-				imajor(bio->bi_bdev->bd_inode),
-				iminor(bio->bi_bdev->bd_inode),
-				(unsigned long long)bio->bi_sector);
-	} else {
-		SetPageUptodate(page);
-	}
-	unlock_page(page);
+	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
+
+	do {
+		struct page *page = bvec->bv_page;
+
+		if (!uptodate) {
+			SetPageError(page);
+			ClearPageUptodate(page);
+			printk(KERN_ALERT "Read-error on swap-device "
+					"(%u:%u:%Lu)\n",
+					imajor(bio->bi_bdev->bd_inode),
+					iminor(bio->bi_bdev->bd_inode),
+					(unsigned long long)bio->bi_sector);
+		} else {
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+	} while (--bvec >= bio->bi_io_vec);
 	bio_put(bio);
 }
 
+/*
+ * Reclaim and swap readahead queue pages of consecutive swap slots on a
+ * swap_plug, which sends them down as one bio of up to SWAP_PLUG_PAGES
+ * instead of leaving the elevator to merge a bio per page.
+ */
+#define SWAP_PLUG_PAGES		SWAP_CLUSTER_MAX
+
+void swap_plug_flush(struct swap_plug *plug)
+{
+	if (plug->bio) {
+		submit_bio(plug->rw, plug->bio);
+		plug->bio = NULL;
+	}
+}
+
+/*
+ * Add @page, at @sector of @bdev, to the bio pending on @plug: the page
+ * continues it or it is submitted and a new one started. The bio holding
+ * @page is left pending, for the caller to mark the page under I/O first.
+ * Returns false if no bio could be had.
+ */
+static bool swap_plug_add(struct swap_plug *plug, struct page *page,
+			  struct block_device *bdev, sector_t sector, int rw,
+			  bio_end_io_t end_io, gfp_t gfp_flags)
+{
+	struct bio *bio = plug->bio;
+
+	if (bio && bio->bi_bdev == bdev && plug->next == sector &&
+	    plug->rw == rw && bio_add_page(bio, page, PAGE_SIZE, 0))
+		goto added;
+
+	swap_plug_flush(plug);
+	bio = bio_alloc(gfp_flags, SWAP_PLUG_PAGES);
+	if (!bio)
+		return false;
+	bio->bi_sector = sector;
+	bio->bi_bdev = bdev;
+	bio->bi_end_io = end_io;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return false;
+	}
+	plug->bio = bio;
+	plug->rw = rw;
+added:
+	plug->next = sector + (PAGE_SIZE >> 9);
+	return true;
+}
+
+static bool swap_plug_page(struct swap_plug *plug, struct page *page, int rw,
+			   bio_end_io_t end_io, gfp_t gfp_flags)
+{
+	struct block_device *bdev;
+	sector_t sector;
+
+	sector = map_swap_page(page, &bdev) << (PAGE_SHIFT - 9);
+	return swap_plug_add(plug, page, bdev, sector, rw, end_io, gfp_flags);
+}
+
 /*
  * We may have stale swap cache pages in memory: notice
  * them here and get rid of the unnecessary final write.
  */
 int swap_writepage(struct page *page, struct writeback_control *wbc)
 {
-	struct bio *bio;
+	struct bio *bio = NULL;
 	int ret = 0, rw = WRITE;
 
 	if (try_to_free_swap(page)) {
 		unlock_page(page);
 		goto out;
 	}
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		rw |= REQ_SYNC | REQ_UNPLUG;
+	else if (wbc->swap_plug &&
+		 swap_plug_page(wbc->swap_plug, page, rw, end_swap_bio_write,
+				GFP_NOIO))
+		goto plugged;
+
 	bio = get_swap_bio(GFP_NOIO, page, end_swap_bio_write);
 	if (bio == NULL) {
 		set_page_dirty(page);
@@ -105,23 +182,32 @@ int swap_writepage(struct page *page, struct writeback_control *wbc)
 		ret = -ENOMEM;
 		goto out;
 	}
-	if (wbc->sync_mode == WB_SYNC_ALL)
-		rw |= REQ_SYNC | REQ_UNPLUG;
+plugged:
 	count_vm_event(PSWPOUT);
 	set_page_writeback(page);
 	unlock_page(page);
-	submit_bio(rw, bio);
+	if (bio)
+		submit_bio(rw, bio);
 out:
 	return ret;
 }
 
-int swap_readpage(struct page *page)
+/*
+ * swap_readpage_plugged - like swap_readpage(), queueing the read on @plug
+ * if it has one: the page then stays locked until swap_plug_flush().
+ */
+int swap_readpage_plugged(struct page *page, struct swap_plug *plug)
 {
 	struct bio *bio;
 	int ret = 0;
 
 	VM_BUG_ON(!PageLocked(page));
 	VM_BUG_ON(PageUptodate(page));
+	if (plug && swap_plug_page(plug, page, READ, end_swap_bio_read,
+				   GFP_KERNEL)) {
+		count_vm_event(PSWPIN);
+		goto out;
+	}
 	bio = get_swap_bio(GFP_KERNEL, page, end_swap_bio_read);
 	if (bio == NULL) {
 		unlock_page(page);
@@ -133,3 +219,8 @@ int swap_readpage(struct page *page)
 out:
 	return ret;
 }
+
+int swap_readpage(struct page *page)
+{
+	return swap_readpage_plugged(page, NULL);
+}
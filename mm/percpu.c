@@ -30,16 +30,13 @@
  * There are usually many small percpu allocations many of them being
  * as small as 4 bytes.  The allocator organizes chunks into lists
  * according to free size and tries to allocate from the fullest one.
- * Each chunk keeps the maximum contiguous area size hint which is
- * guaranteed to be equal to or larger than the maximum contiguous
- * area in the chunk.  This helps the allocator not to iterate the
- * chunk maps unnecessarily.
- *
- * Allocation state in each chunk is kept using an array of integers
- * on chunk->map.  A positive value in the map represents a free
- * region and negative allocated.  Allocation inside a chunk is done
- * by scanning this map sequentially and serving the first matching
- * entry.  This is mostly copied from the percpu_modalloc() allocator.
+ * Each chunk keeps the exact size of its largest contiguous free area,
+ * so the allocator never looks into a chunk that cannot serve it.
+ *
+ * Allocation state in each chunk is kept in bitmaps of its 4 byte
+ * units, with hints for each page-sized block of them, see
+ * pcpu_chunk_update().  Allocation inside a chunk searches only the
+ * blocks which can fit the area, and the first match is served.
  * Chunks can be determined from the address using the index field
  * in the page struct. The index field contains a pointer to the chunk.
  *
@@ -74,7 +71,11 @@
 #include <asm/io.h>
 
 #define PCPU_SLOT_BASE_SHIFT		5	/* 1-31 shares the same slot */
-#define PCPU_DFL_MAP_ALLOC		16	/* start a map with 16 ents */
+#define PCPU_MIN_ALLOC_SHIFT		2	/* areas are made of ints */
+#define PCPU_MIN_ALLOC_SIZE		(1 << PCPU_MIN_ALLOC_SHIFT)
+#define PCPU_BITMAP_BLOCK_SIZE		PAGE_SIZE	/* hints per page */
+#define PCPU_BITMAP_BLOCK_BITS		(PCPU_BITMAP_BLOCK_SIZE >>	\
+					 PCPU_MIN_ALLOC_SHIFT)
 
 #ifdef CONFIG_SMP
 /* default addr <-> pcpu_ptr mapping, override in asm/percpu.h if necessary */
@@ -96,14 +97,24 @@
 #define __pcpu_ptr_to_addr(ptr)		(void __force *)(ptr)
 #endif	/* CONFIG_SMP */
 
+/* hints of one PCPU_BITMAP_BLOCK_SIZE block of a chunk, in units */
+struct pcpu_block_md {
+	int			contig_hint;	/* longest free run */
+	int			left_free;	/* free run at the start */
+	int			right_free;	/* free run at the end */
+	int			first_free;	/* first free unit */
+};
+
 struct pcpu_chunk {
 	struct list_head	list;		/* linked to pcpu_slot lists */
 	int			free_size;	/* free bytes in the chunk */
-	int			contig_hint;	/* max contiguous size hint */
+	int			contig_hint;	/* max contiguous size */
 	void			*base_addr;	/* base address of this chunk */
-	int			map_used;	/* # of map entries used */
-	int			map_alloc;	/* # of map entries allocated */
-	int			*map;		/* allocation map */
+	int			nr_bits;	/* # of units in the maps */
+	int			first_free;	/* no free unit before this */
+	unsigned long		*alloc_map;	/* allocated units */
+	unsigned long		*bound_map;	/* area starts and ends */
+	struct pcpu_block_md	*md_blocks;	/* hints per block */
 	void			*data;		/* chunk data */
 	bool			immutable;	/* no [de]population allowed */
 	unsigned long		populated[];	/* populated bitmap */
@@ -153,27 +164,28 @@ static int pcpu_reserved_chunk_limit;
  * Synchronization rules.
  *
  * There are two locks - pcpu_alloc_mutex and pcpu_lock.  The former
- * protects allocation/reclaim paths, chunks, populated bitmap and
- * vmalloc mapping.  The latter is a spinlock and protects the index
- * data structures - chunk slots, chunks and area maps in chunks.
- *
- * During allocation, pcpu_alloc_mutex is kept locked all the time and
- * pcpu_lock is grabbed and released as necessary.  All actual memory
- * allocations are done using GFP_KERNEL with pcpu_lock released.  In
- * general, percpu memory can't be allocated with irq off but
- * irqsave/restore are still used in alloc path so that it can be used
- * from early init path - sched_init() specifically.
+ * protects the populated bitmaps, vmalloc mapping and the reclaim of
+ * chunks.  The latter is a spinlock and protects the index data
+ * structures - chunk slots, chunks and area maps in chunks.
+ *
+ * Areas are found and allocated under pcpu_lock alone: the area maps
+ * never need extending, so allocation drops it only to create a chunk
+ * or to populate pages.  An area whose pages are all populated is only
+ * cleared; populating takes pcpu_alloc_mutex and commits the populated
+ * bitmap under pcpu_lock.  All actual memory allocations are done using
+ * GFP_KERNEL with pcpu_lock released.  In general, percpu memory can't
+ * be allocated with irq off but irqsave/restore are still used in alloc
+ * path so that it can be used from early init path - sched_init()
+ * specifically.
  *
  * Free path accesses and alters only the index data structures, so it
  * can be safely called from atomic context.  When memory needs to be
  * returned to the system, free path schedules reclaim_work which
- * grabs both pcpu_alloc_mutex and pcpu_lock, unlinks chunks to be
- * reclaimed, release both locks and frees the chunks.  Note that it's
- * necessary to grab both locks to remove a chunk from circulation as
- * allocation path might be referencing the chunk with only
- * pcpu_alloc_mutex locked.
+ * grabs both pcpu_alloc_mutex and pcpu_lock, unlinks fully free chunks,
+ * release both locks and frees the chunks.  A chunk allocation is
+ * populating has that area allocated, so it is never among them.
  */
-static DEFINE_MUTEX(pcpu_alloc_mutex);	/* protects whole alloc and reclaim */
+static DEFINE_MUTEX(pcpu_alloc_mutex);	/* protects population and reclaim */
 static DEFINE_SPINLOCK(pcpu_lock);	/* protects index data structures */
 
 static struct list_head *pcpu_slot __read_mostly; /* chunk list slots */
@@ -337,125 +349,187 @@ static void pcpu_chunk_relocate(struct pcpu_chunk *chunk, int oslot)
 	}
 }
 
+/*
+ * Area maps.  Each chunk keeps a bitmap of its PCPU_MIN_ALLOC_SIZE units,
+ * set where allocated, and a bound map with a bit where every area starts
+ * and one past where it ends, which is how free finds an area's size.
+ * For each PCPU_BITMAP_BLOCK_SIZE block there are exact hints of its
+ * longest free run, the free runs at either end and its first free unit;
+ * the chunk's contig_hint and first_free are derived from those.
+ * Allocation looks only at blocks the hints say can fit and searches the
+ * bitmap a word at a time, and no map ever needs to grow.
+ */
+static int pcpu_chunk_nr_blocks(const struct pcpu_chunk *chunk)
+{
+	return DIV_ROUND_UP(chunk->nr_bits, PCPU_BITMAP_BLOCK_BITS);
+}
+
+static int pcpu_block_bits(const struct pcpu_chunk *chunk, int index)
+{
+	return min(chunk->nr_bits - index * PCPU_BITMAP_BLOCK_BITS,
+		   PCPU_BITMAP_BLOCK_BITS);
+}
+
+/* bytes of metadata a chunk of @nr_bits units needs, see pcpu_chunk_init_md() */
+static size_t pcpu_chunk_md_size(int nr_bits)
+{
+	return (BITS_TO_LONGS(nr_bits) + BITS_TO_LONGS(nr_bits + 1)) *
+		sizeof(unsigned long) +
+		DIV_ROUND_UP(nr_bits, PCPU_BITMAP_BLOCK_BITS) *
+		sizeof(struct pcpu_block_md);
+}
+
 /**
- * pcpu_need_to_extend - determine whether chunk area map needs to be extended
+ * pcpu_block_refresh - recompute the hints of one block
  * @chunk: chunk of interest
- *
- * Determine whether area map of @chunk needs to be extended to
- * accomodate a new allocation.
+ * @index: index of the block
  *
  * CONTEXT:
  * pcpu_lock.
- *
- * RETURNS:
- * New target map allocation length if extension is necessary, 0
- * otherwise.
  */
-static int pcpu_need_to_extend(struct pcpu_chunk *chunk)
+static void pcpu_block_refresh(struct pcpu_chunk *chunk, int index)
 {
-	int new_alloc;
-
-	if (chunk->map_alloc >= chunk->map_used + 2)
-		return 0;
-
-	new_alloc = PCPU_DFL_MAP_ALLOC;
-	while (new_alloc < chunk->map_used + 2)
-		new_alloc *= 2;
-
-	return new_alloc;
+	struct pcpu_block_md *block = &chunk->md_blocks[index];
+	int start = index * PCPU_BITMAP_BLOCK_BITS;
+	int end = start + pcpu_block_bits(chunk, index);
+	int rs, re;
+
+	block->contig_hint = 0;
+	block->left_free = 0;
+	block->right_free = 0;
+	block->first_free = end - start;
+
+	for (rs = find_next_zero_bit(chunk->alloc_map, end, start); rs < end;
+	     rs = find_next_zero_bit(chunk->alloc_map, end, re)) {
+		re = find_next_bit(chunk->alloc_map, end, rs);
+		if (rs == start)
+			block->left_free = re - rs;
+		if (re == end)
+			block->right_free = re - rs;
+		if (block->first_free == end - start)
+			block->first_free = rs - start;
+		block->contig_hint = max(block->contig_hint, re - rs);
+	}
 }
 
 /**
- * pcpu_extend_area_map - extend area map of a chunk
+ * pcpu_chunk_update - update hints after an allocation or free
  * @chunk: chunk of interest
- * @new_alloc: new target allocation length of the area map
+ * @off: first unit allocated or freed
+ * @bits: number of units allocated or freed
  *
- * Extend area map of @chunk to have @new_alloc entries.
+ * Refresh the blocks the area touched, then the chunk's own hints from
+ * all the blocks: free runs crossing block boundaries are put together
+ * from the blocks' end runs.
  *
  * CONTEXT:
- * Does GFP_KERNEL allocation.  Grabs and releases pcpu_lock.
- *
- * RETURNS:
- * 0 on success, -errno on failure.
+ * pcpu_lock.
  */
-static int pcpu_extend_area_map(struct pcpu_chunk *chunk, int new_alloc)
+static void pcpu_chunk_update(struct pcpu_chunk *chunk, int off, int bits)
 {
-	int *old = NULL, *new = NULL;
-	size_t old_size = 0, new_size = new_alloc * sizeof(new[0]);
-	unsigned long flags;
-
-	new = pcpu_mem_alloc(new_size);
-	if (!new)
-		return -ENOMEM;
-
-	/* acquire pcpu_lock and switch to new area map */
-	spin_lock_irqsave(&pcpu_lock, flags);
-
-	if (new_alloc <= chunk->map_alloc)
-		goto out_unlock;
-
-	old_size = chunk->map_alloc * sizeof(chunk->map[0]);
-	old = chunk->map;
-
-	memcpy(new, old, old_size);
-
-	chunk->map_alloc = new_alloc;
-	chunk->map = new;
-	new = NULL;
-
-out_unlock:
-	spin_unlock_irqrestore(&pcpu_lock, flags);
-
-	/*
-	 * pcpu_mem_free() might end up calling vfree() which uses
-	 * IRQ-unsafe lock and thus can't be called under pcpu_lock.
-	 */
-	pcpu_mem_free(old, old_size);
-	pcpu_mem_free(new, new_size);
+	int nr_blocks = pcpu_chunk_nr_blocks(chunk);
+	int contig = 0, run = 0, i;
+
+	for (i = off / PCPU_BITMAP_BLOCK_BITS;
+	     i <= (off + bits - 1) / PCPU_BITMAP_BLOCK_BITS; i++)
+		pcpu_block_refresh(chunk, i);
+
+	chunk->first_free = chunk->nr_bits;
+	for (i = 0; i < nr_blocks; i++) {
+		struct pcpu_block_md *block = &chunk->md_blocks[i];
+		int block_bits = pcpu_block_bits(chunk, i);
+
+		if (chunk->first_free == chunk->nr_bits &&
+		    block->first_free < block_bits)
+			chunk->first_free = i * PCPU_BITMAP_BLOCK_BITS +
+					    block->first_free;
+
+		contig = max(contig, block->contig_hint);
+		if (block->left_free == block_bits) {
+			run += block_bits;
+		} else {
+			contig = max(contig, run + block->left_free);
+			run = block->right_free;
+		}
+	}
+	contig = max(contig, run);
 
-	return 0;
+	chunk->contig_hint = contig << PCPU_MIN_ALLOC_SHIFT;
 }
 
 /**
- * pcpu_split_block - split a map block
+ * pcpu_chunk_init_md - set up the area maps of a chunk
  * @chunk: chunk of interest
- * @i: index of map block to split
- * @head: head size in bytes (can be 0)
- * @tail: tail size in bytes (can be 0)
- *
- * Split the @i'th map block into two or three blocks.  If @head is
- * non-zero, @head bytes block is inserted before block @i moving it
- * to @i+1 and reducing its size by @head bytes.
+ * @buf: zeroed memory of pcpu_chunk_md_size(@nr_bits) bytes
+ * @nr_bits: number of units the chunk serves
  *
- * If @tail is non-zero, the target block, which can be @i or @i+1
- * depending on @head, is reduced by @tail bytes and @tail byte block
- * is inserted after the target block.
+ * The chunk starts out all free.
+ */
+static void pcpu_chunk_init_md(struct pcpu_chunk *chunk, void *buf,
+			       int nr_bits)
+{
+	chunk->nr_bits = nr_bits;
+	chunk->alloc_map = buf;
+	chunk->bound_map = chunk->alloc_map + BITS_TO_LONGS(nr_bits);
+	chunk->md_blocks = (void *)(chunk->bound_map +
+				    BITS_TO_LONGS(nr_bits + 1));
+	chunk->free_size = nr_bits << PCPU_MIN_ALLOC_SHIFT;
+	pcpu_chunk_update(chunk, 0, nr_bits);
+}
+
+/**
+ * pcpu_find_area - find a free area in a chunk
+ * @chunk: chunk of interest
+ * @bits: size of the area in units
+ * @align: alignment of the area in units, a power of two
  *
- * @chunk->map must have enough free slots to accomodate the split.
+ * A free area either lies within a block, whose contig_hint then says
+ * it may, or starts in a block's free tail and runs on into the next.
  *
  * CONTEXT:
  * pcpu_lock.
+ *
+ * RETURNS:
+ * The first unit of the area, -1 if no matching area is found.
  */
-static void pcpu_split_block(struct pcpu_chunk *chunk, int i,
-			     int head, int tail)
+static int pcpu_find_area(struct pcpu_chunk *chunk, int bits, int align)
 {
-	int nr_extra = !!head + !!tail;
+	int nr_blocks = pcpu_chunk_nr_blocks(chunk);
+	int i, j, start, end, off;
+
+	for (i = chunk->first_free / PCPU_BITMAP_BLOCK_BITS; i < nr_blocks;
+	     i++) {
+		struct pcpu_block_md *block = &chunk->md_blocks[i];
+
+		start = i * PCPU_BITMAP_BLOCK_BITS;
+		end = start + pcpu_block_bits(chunk, i);
+
+		if (block->contig_hint >= bits) {
+			off = bitmap_find_next_zero_area(chunk->alloc_map, end,
+						start + block->first_free,
+						bits, align - 1);
+			if (off + bits <= end)
+				return off;
+		}
 
-	BUG_ON(chunk->map_alloc < chunk->map_used + nr_extra);
+		if (!block->right_free)
+			continue;
 
-	/* insert new subblocks */
-	memmove(&chunk->map[i + nr_extra], &chunk->map[i],
-		sizeof(chunk->map[0]) * (chunk->map_used - i));
-	chunk->map_used += nr_extra;
+		start = end - block->right_free;
+		for (j = i + 1; j < nr_blocks; j++) {
+			struct pcpu_block_md *next = &chunk->md_blocks[j];
 
-	if (head) {
-		chunk->map[i + 1] = chunk->map[i] - head;
-		chunk->map[i++] = head;
-	}
-	if (tail) {
-		chunk->map[i++] -= tail;
-		chunk->map[i] = tail;
+			end += next->left_free;
+			if (ALIGN(start, align) + bits <= end ||
+			    next->left_free != pcpu_block_bits(chunk, j))
+				break;
+		}
+		off = ALIGN(start, align);
+		if (off + bits <= end)
+			return off;
 	}
+
+	return -1;
 }
 
 /**
@@ -468,8 +542,6 @@ static void pcpu_split_block(struct pcpu_chunk *chunk, int i,
  * Note that this function only allocates the offset.  It doesn't
  * populate or map the area.
  *
- * @chunk->map must have at least two free slots.
- *
  * CONTEXT:
  * pcpu_lock.
  *
@@ -480,78 +552,24 @@ static void pcpu_split_block(struct pcpu_chunk *chunk, int i,
 static int pcpu_alloc_area(struct pcpu_chunk *chunk, int size, int align)
 {
 	int oslot = pcpu_chunk_slot(chunk);
-	int max_contig = 0;
-	int i, off;
-
-	for (i = 0, off = 0; i < chunk->map_used; off += abs(chunk->map[i++])) {
-		bool is_last = i + 1 == chunk->map_used;
-		int head, tail;
-
-		/* extra for alignment requirement */
-		head = ALIGN(off, align) - off;
-		BUG_ON(i == 0 && head != 0);
-
-		if (chunk->map[i] < 0)
-			continue;
-		if (chunk->map[i] < head + size) {
-			max_contig = max(chunk->map[i], max_contig);
-			continue;
-		}
-
-		/*
-		 * If head is small or the previous block is free,
-		 * merge'em.  Note that 'small' is defined as smaller
-		 * than sizeof(int), which is very small but isn't too
-		 * uncommon for percpu allocations.
-		 */
-		if (head && (head < sizeof(int) || chunk->map[i - 1] > 0)) {
-			if (chunk->map[i - 1] > 0)
-				chunk->map[i - 1] += head;
-			else {
-				chunk->map[i - 1] -= head;
-				chunk->free_size -= head;
-			}
-			chunk->map[i] -= head;
-			off += head;
-			head = 0;
-		}
-
-		/* if tail is small, just keep it around */
-		tail = chunk->map[i] - head - size;
-		if (tail < sizeof(int))
-			tail = 0;
-
-		/* split if warranted */
-		if (head || tail) {
-			pcpu_split_block(chunk, i, head, tail);
-			if (head) {
-				i++;
-				off += head;
-				max_contig = max(chunk->map[i - 1], max_contig);
-			}
-			if (tail)
-				max_contig = max(chunk->map[i + 1], max_contig);
-		}
-
-		/* update hint and mark allocated */
-		if (is_last)
-			chunk->contig_hint = max_contig; /* fully scanned */
-		else
-			chunk->contig_hint = max(chunk->contig_hint,
-						 max_contig);
+	int bits = DIV_ROUND_UP(size, PCPU_MIN_ALLOC_SIZE);
+	int off;
 
-		chunk->free_size -= chunk->map[i];
-		chunk->map[i] = -chunk->map[i];
+	off = pcpu_find_area(chunk, bits,
+			     max(align >> PCPU_MIN_ALLOC_SHIFT, 1));
+	if (off < 0)
+		return -1;
 
-		pcpu_chunk_relocate(chunk, oslot);
-		return off;
-	}
+	bitmap_set(chunk->alloc_map, off, bits);
+	set_bit(off, chunk->bound_map);
+	bitmap_clear(chunk->bound_map, off + 1, bits - 1);
+	set_bit(off + bits, chunk->bound_map);
 
-	chunk->contig_hint = max_contig;	/* fully scanned */
+	chunk->free_size -= bits << PCPU_MIN_ALLOC_SHIFT;
+	pcpu_chunk_update(chunk, off, bits);
 	pcpu_chunk_relocate(chunk, oslot);
 
-	/* tell the upper layer that this chunk has no matching area */
-	return -1;
+	return off << PCPU_MIN_ALLOC_SHIFT;
 }
 
 /**
@@ -569,57 +587,41 @@ static int pcpu_alloc_area(struct pcpu_chunk *chunk, int size, int align)
 static void pcpu_free_area(struct pcpu_chunk *chunk, int freeme)
 {
 	int oslot = pcpu_chunk_slot(chunk);
-	int i, off;
+	int off = freeme >> PCPU_MIN_ALLOC_SHIFT;
+	int bits;
 
-	for (i = 0, off = 0; i < chunk->map_used; off += abs(chunk->map[i++]))
-		if (off == freeme)
-			break;
-	BUG_ON(off != freeme);
-	BUG_ON(chunk->map[i] > 0);
-
-	chunk->map[i] = -chunk->map[i];
-	chunk->free_size += chunk->map[i];
-
-	/* merge with previous? */
-	if (i > 0 && chunk->map[i - 1] >= 0) {
-		chunk->map[i - 1] += chunk->map[i];
-		chunk->map_used--;
-		memmove(&chunk->map[i], &chunk->map[i + 1],
-			(chunk->map_used - i) * sizeof(chunk->map[0]));
-		i--;
-	}
-	/* merge with next? */
-	if (i + 1 < chunk->map_used && chunk->map[i + 1] >= 0) {
-		chunk->map[i] += chunk->map[i + 1];
-		chunk->map_used--;
-		memmove(&chunk->map[i + 1], &chunk->map[i + 2],
-			(chunk->map_used - (i + 1)) * sizeof(chunk->map[0]));
-	}
+	BUG_ON(freeme & (PCPU_MIN_ALLOC_SIZE - 1));
+	BUG_ON(off >= chunk->nr_bits);
+	BUG_ON(!test_bit(off, chunk->bound_map) ||
+	       !test_bit(off, chunk->alloc_map));
+
+	bits = find_next_bit(chunk->bound_map, chunk->nr_bits + 1,
+			     off + 1) - off;
+	bitmap_clear(chunk->alloc_map, off, bits);
 
-	chunk->contig_hint = max(chunk->map[i], chunk->contig_hint);
+	chunk->free_size += bits << PCPU_MIN_ALLOC_SHIFT;
+	pcpu_chunk_update(chunk, off, bits);
 	pcpu_chunk_relocate(chunk, oslot);
 }
 
 static struct pcpu_chunk *pcpu_alloc_chunk(void)
 {
 	struct pcpu_chunk *chunk;
+	int nr_bits = pcpu_unit_size >> PCPU_MIN_ALLOC_SHIFT;
+	void *md;
 
 	chunk = pcpu_mem_alloc(pcpu_chunk_struct_size);
 	if (!chunk)
 		return NULL;
 
-	chunk->map = pcpu_mem_alloc(PCPU_DFL_MAP_ALLOC * sizeof(chunk->map[0]));
-	if (!chunk->map) {
+	md = pcpu_mem_alloc(pcpu_chunk_md_size(nr_bits));
+	if (!md) {
 		kfree(chunk);
 		return NULL;
 	}
 
-	chunk->map_alloc = PCPU_DFL_MAP_ALLOC;
-	chunk->map[chunk->map_used++] = pcpu_unit_size;
-
 	INIT_LIST_HEAD(&chunk->list);
-	chunk->free_size = pcpu_unit_size;
-	chunk->contig_hint = pcpu_unit_size;
+	pcpu_chunk_init_md(chunk, md, nr_bits);
 
 	return chunk;
 }
@@ -628,7 +630,7 @@ static void pcpu_free_chunk(struct pcpu_chunk *chunk)
 {
 	if (!chunk)
 		return;
-	pcpu_mem_free(chunk->map, chunk->map_alloc * sizeof(chunk->map[0]));
+	pcpu_mem_free(chunk->alloc_map, pcpu_chunk_md_size(chunk->nr_bits));
 	kfree(chunk);
 }
 
@@ -707,8 +709,10 @@ static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved)
 	static int warn_limit = 10;
 	struct pcpu_chunk *chunk;
 	const char *err;
-	int slot, off, new_alloc;
+	int slot, off, rs, re;
+	bool populated;
 	unsigned long flags;
+	unsigned int cpu;
 
 	if (unlikely(!size || size > PCPU_MIN_UNIT_SIZE || align > PAGE_SIZE)) {
 		WARN(true, "illegal size (%zu) or align (%zu) for "
@@ -716,31 +720,18 @@ static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved)
 		return NULL;
 	}
 
-	mutex_lock(&pcpu_alloc_mutex);
 	spin_lock_irqsave(&pcpu_lock, flags);
 
 	/* serve reserved allocations from the reserved chunk if available */
 	if (reserved && pcpu_reserved_chunk) {
 		chunk = pcpu_reserved_chunk;
 
-		if (size > chunk->contig_hint) {
-			err = "alloc from reserved chunk failed";
-			goto fail_unlock;
-		}
-
-		while ((new_alloc = pcpu_need_to_extend(chunk))) {
-			spin_unlock_irqrestore(&pcpu_lock, flags);
-			if (pcpu_extend_area_map(chunk, new_alloc) < 0) {
-				err = "failed to extend area map of reserved chunk";
-				goto fail_unlock_mutex;
-			}
-			spin_lock_irqsave(&pcpu_lock, flags);
+		if (size <= chunk->contig_hint) {
+			off = pcpu_alloc_area(chunk, size, align);
+			if (off >= 0)
+				goto area_found;
 		}
 
-		off = pcpu_alloc_area(chunk, size, align);
-		if (off >= 0)
-			goto area_found;
-
 		err = "alloc from reserved chunk failed";
 		goto fail_unlock;
 	}
@@ -752,22 +743,6 @@ restart:
 			if (size > chunk->contig_hint)
 				continue;
 
-			new_alloc = pcpu_need_to_extend(chunk);
-			if (new_alloc) {
-				spin_unlock_irqrestore(&pcpu_lock, flags);
-				if (pcpu_extend_area_map(chunk,
-							 new_alloc) < 0) {
-					err = "failed to extend area map";
-					goto fail_unlock_mutex;
-				}
-				spin_lock_irqsave(&pcpu_lock, flags);
-				/*
-				 * pcpu_lock has been dropped, need to
-				 * restart cpu_slot list walking.
-				 */
-				goto restart;
-			}
-
 			off = pcpu_alloc_area(chunk, size, align);
 			if (off >= 0)
 				goto area_found;
@@ -780,7 +755,7 @@ restart:
 	chunk = pcpu_create_chunk();
 	if (!chunk) {
 		err = "failed to allocate new chunk";
-		goto fail_unlock_mutex;
+		goto fail;
 	}
 
 	spin_lock_irqsave(&pcpu_lock, flags);
@@ -788,25 +763,35 @@ restart:
 	goto restart;
 
 area_found:
+	rs = PFN_DOWN(off);
+	pcpu_next_pop(chunk, &rs, &re, PFN_UP(off + size));
+	populated = rs == PFN_DOWN(off) && re == PFN_UP(off + size);
 	spin_unlock_irqrestore(&pcpu_lock, flags);
 
-	/* populate, map and clear the area */
-	if (pcpu_populate_chunk(chunk, off, size)) {
-		spin_lock_irqsave(&pcpu_lock, flags);
-		pcpu_free_area(chunk, off);
-		err = "failed to populate";
-		goto fail_unlock;
+	if (populated) {
+		/* the pages are there already, only clear the area */
+		for_each_possible_cpu(cpu)
+			memset((void *)pcpu_chunk_addr(chunk, cpu, 0) + off, 0,
+			       size);
+	} else {
+		/* populate, map and clear the area */
+		mutex_lock(&pcpu_alloc_mutex);
+		rs = pcpu_populate_chunk(chunk, off, size);
+		mutex_unlock(&pcpu_alloc_mutex);
+		if (rs) {
+			spin_lock_irqsave(&pcpu_lock, flags);
+			pcpu_free_area(chunk, off);
+			err = "failed to populate";
+			goto fail_unlock;
+		}
 	}
 
-	mutex_unlock(&pcpu_alloc_mutex);
-
 	/* return address relative to base address */
 	return __addr_to_pcpu_ptr(chunk->base_addr + off);
 
 fail_unlock:
 	spin_unlock_irqrestore(&pcpu_lock, flags);
-fail_unlock_mutex:
-	mutex_unlock(&pcpu_alloc_mutex);
+fail:
 	if (warn_limit) {
 		pr_warning("PERCPU: allocation failed, size=%zu align=%zu, "
 			   "%s\n", size, align, err);
@@ -1129,6 +1114,22 @@ static void pcpu_dump_alloc_info(const char *lvl,
 	printk("\n");
 }
 
+/*
+ * Mark the first @size bytes of a first chunk, which hold what the other
+ * half of the first chunk serves, allocated for good.
+ */
+static void __init pcpu_chunk_reserve_head(struct pcpu_chunk *chunk,
+					   int size)
+{
+	int bits = DIV_ROUND_UP(size, PCPU_MIN_ALLOC_SIZE);
+
+	bitmap_set(chunk->alloc_map, 0, bits);
+	set_bit(0, chunk->bound_map);
+	set_bit(bits, chunk->bound_map);
+	chunk->free_size -= bits << PCPU_MIN_ALLOC_SHIFT;
+	pcpu_chunk_update(chunk, 0, bits);
+}
+
 /**
  * pcpu_setup_first_chunk - initialize the first percpu chunk
  * @ai: pcpu_alloc_info describing how to percpu area is shaped
@@ -1189,8 +1190,6 @@ int __init pcpu_setup_first_chunk(const struct pcpu_alloc_info *ai,
 				  void *base_addr)
 {
 	static char cpus_buf[4096] __initdata;
-	static int smap[PERCPU_DYNAMIC_EARLY_SLOTS] __initdata;
-	static int dmap[PERCPU_DYNAMIC_EARLY_SLOTS] __initdata;
 	size_t dyn_size = ai->dyn_size;
 	size_t size_sum = ai->static_size + ai->reserved_size + dyn_size;
 	struct pcpu_chunk *schunk, *dchunk = NULL;
@@ -1199,7 +1198,7 @@ int __init pcpu_setup_first_chunk(const struct pcpu_alloc_info *ai,
 	unsigned long *unit_off;
 	unsigned int cpu;
 	int *unit_map;
-	int group, unit, i;
+	int group, unit, i, nr_bits;
 
 	cpumask_scnprintf(cpus_buf, sizeof(cpus_buf), cpu_possible_mask);
 
@@ -1298,38 +1297,35 @@ int __init pcpu_setup_first_chunk(const struct pcpu_alloc_info *ai,
 	schunk = alloc_bootmem(pcpu_chunk_struct_size);
 	INIT_LIST_HEAD(&schunk->list);
 	schunk->base_addr = base_addr;
-	schunk->map = smap;
-	schunk->map_alloc = ARRAY_SIZE(smap);
 	schunk->immutable = true;
 	bitmap_fill(schunk->populated, pcpu_unit_pages);
 
 	if (ai->reserved_size) {
-		schunk->free_size = ai->reserved_size;
 		pcpu_reserved_chunk = schunk;
 		pcpu_reserved_chunk_limit = ai->static_size + ai->reserved_size;
+		nr_bits = pcpu_reserved_chunk_limit >> PCPU_MIN_ALLOC_SHIFT;
 	} else {
-		schunk->free_size = dyn_size;
+		nr_bits = (ai->static_size + dyn_size) >> PCPU_MIN_ALLOC_SHIFT;
 		dyn_size = 0;			/* dynamic area covered */
 	}
-	schunk->contig_hint = schunk->free_size;
-
-	schunk->map[schunk->map_used++] = -ai->static_size;
-	if (schunk->free_size)
-		schunk->map[schunk->map_used++] = schunk->free_size;
+	pcpu_chunk_init_md(schunk, alloc_bootmem(pcpu_chunk_md_size(nr_bits)),
+			   nr_bits);
+	pcpu_chunk_reserve_head(schunk, ai->static_size);
 
 	/* init dynamic chunk if necessary */
 	if (dyn_size) {
 		dchunk = alloc_bootmem(pcpu_chunk_struct_size);
 		INIT_LIST_HEAD(&dchunk->list);
 		dchunk->base_addr = base_addr;
-		dchunk->map = dmap;
-		dchunk->map_alloc = ARRAY_SIZE(dmap);
 		dchunk->immutable = true;
 		bitmap_fill(dchunk->populated, pcpu_unit_pages);
 
-		dchunk->contig_hint = dchunk->free_size = dyn_size;
-		dchunk->map[dchunk->map_used++] = -pcpu_reserved_chunk_limit;
-		dchunk->map[dchunk->map_used++] = dchunk->free_size;
+		nr_bits = (pcpu_reserved_chunk_limit + dyn_size) >>
+			  PCPU_MIN_ALLOC_SHIFT;
+		pcpu_chunk_init_md(dchunk,
+				   alloc_bootmem(pcpu_chunk_md_size(nr_bits)),
+				   nr_bits);
+		pcpu_chunk_reserve_head(dchunk, pcpu_reserved_chunk_limit);
 	}
 
 	/* link the first chunk in */
@@ -1867,33 +1863,3 @@ void __init setup_per_cpu_areas(void)
 }
 
 #endif	/* CONFIG_SMP */
-
-/*
- * First and reserved chunks are initialized with temporary allocation
- * map in initdata so that they can be used before slab is online.
- * This function is called after slab is brought up and replaces those
- * with properly allocated maps.
- */
-void __init percpu_init_late(void)
-{
-	struct pcpu_chunk *target_chunks[] =
-		{ pcpu_first_chunk, pcpu_reserved_chunk, NULL };
-	struct pcpu_chunk *chunk;
-	unsigned long flags;
-	int i;
-
-	for (i = 0; (chunk = target_chunks[i]); i++) {
-		int *map;
-		const size_t size = PERCPU_DYNAMIC_EARLY_SLOTS * sizeof(map[0]);
-
-		BUILD_BUG_ON(size > PAGE_SIZE);
-
-		map = pcpu_mem_alloc(size);
-		BUG_ON(!map);
-
-		spin_lock_irqsave(&pcpu_lock, flags);
-		memcpy(map, chunk->map, size);
-		chunk->map = map;
-		spin_unlock_irqrestore(&pcpu_lock, flags);
-	}
-}
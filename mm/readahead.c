@@ -109,8 +109,12 @@ EXPORT_SYMBOL(read_cache_pages);
 static int read_pages(struct address_space *mapping, struct file *filp,
 		struct list_head *pages, unsigned nr_pages)
 {
+	struct pagevec pvec;
+	struct blk_plug plug;
 	unsigned page_idx;
-	int ret;
+	int ret, i, added;
+
+	blk_start_plug(&plug);
 
 	if (mapping->a_ops->readpages) {
 		ret = mapping->a_ops->readpages(filp, mapping, pages, nr_pages);
@@ -119,17 +123,23 @@ static int read_pages(struct address_space *mapping, struct file *filp,
 		goto out;
 	}
 
+	pagevec_init(&pvec, 0);
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
 		struct page *page = list_to_page(pages);
 		list_del(&page->lru);
-		if (!add_to_page_cache_lru(page, mapping,
-					page->index, GFP_KERNEL)) {
-			mapping->a_ops->readpage(filp, page);
-		}
-		page_cache_release(page);
+		if (pagevec_add(&pvec, page) && page_idx + 1 < nr_pages)
+			continue;
+
+		added = add_to_page_cache_lru_vec(&pvec, mapping, GFP_KERNEL);
+		for (i = 0; i < added; i++)
+			mapping->a_ops->readpage(filp, pvec.pages[i]);
+		for (i = 0; i < pagevec_count(&pvec); i++)
+			page_cache_release(pvec.pages[i]);
+		pagevec_reinit(&pvec);
 	}
 	ret = 0;
 out:
+	blk_finish_plug(&plug);
 	return ret;
 }
 
@@ -247,6 +257,7 @@ unsigned long ra_submit(struct file_ra_state *ra,
 {
 	int actual;
 
+	ra->accounted = 0;
 	actual = __do_page_cache_readahead(mapping, filp,
 					ra->start, ra->size, ra->async_size);
 
@@ -330,6 +341,57 @@ static unsigned long get_next_ra_size(struct file_ra_state *ra,
  * it approaches max_readhead.
  */
 
+/*
+ * Readahead feedback.
+ *
+ * When the reader leaves a readahead window, ra_feedback() works out how
+ * much of the window it used, and folds the rest into ra->waste:
+ *
+ *	- it went on to the next window: all of it was used
+ *	- it missed on a page inside the window: the pages from there on were
+ *	  read ahead and evicted before use, the window thrashes
+ *	- it missed somewhere else: what lies beyond its last read was not
+ *	  used, the window was too large for the access pattern
+ *
+ * ra_window_max() then shrinks the largest window by the share wasted, so
+ * both the initial size and the ramp up follow what the reader really
+ * consumes.
+ */
+static void ra_feedback(struct file_ra_state *ra, pgoff_t offset,
+			bool hit_readahead_marker)
+{
+	pgoff_t end = ra->start + ra->size;
+	unsigned long used, wasted;
+	pgoff_t last;
+
+	if (!ra->size || ra->accounted)
+		return;
+
+	if (offset == end - ra->async_size || offset == end) {
+		used = ra->size;
+	} else if (!hit_readahead_marker &&
+		   offset >= ra->start && offset < end) {
+		used = offset - ra->start;
+	} else {
+		last = ra->prev_pos >> PAGE_CACHE_SHIFT;
+		if (ra->prev_pos < 0 || last < ra->start)
+			used = 0;
+		else
+			used = min_t(unsigned long, last + 1 - ra->start,
+				     ra->size);
+	}
+	wasted = ra->size - used;
+
+	ra->waste = (3 * ra->waste + wasted * 100 / ra->size) / 4;
+	ra->accounted = 1;
+}
+
+static unsigned long ra_window_max(struct file_ra_state *ra,
+				   unsigned long max)
+{
+	return max_t(unsigned long, max * (100 - ra->waste) / 100, 1);
+}
+
 /*
  * Count contiguously cached pages from @offset-1 to @offset-@max,
  * this count is a conservative estimation of
@@ -394,6 +456,9 @@ ondemand_readahead(struct address_space *mapping,
 {
 	unsigned long max = max_sane_readahead(ra->ra_pages);
 
+	ra_feedback(ra, offset, hit_readahead_marker);
+	max = ra_window_max(ra, max);
+
 	/*
 	 * start of file
 	 */
@@ -67,7 +67,15 @@ static struct kmem_cache *anon_vma_chain_cachep;
 
 static inline struct anon_vma *anon_vma_alloc(void)
 {
-	return kmem_cache_alloc(anon_vma_cachep, GFP_KERNEL);
+	struct anon_vma *anon_vma;
+
+	anon_vma = kmem_cache_alloc(anon_vma_cachep, GFP_KERNEL);
+	if (anon_vma) {
+		anon_vma->num_children = 0;
+		anon_vma->num_active_vmas = 0;
+		anon_vma->parent = anon_vma;
+	}
+	return anon_vma;
 }
 
 void anon_vma_free(struct anon_vma *anon_vma)
@@ -138,6 +146,7 @@ int anon_vma_prepare(struct vm_area_struct *vma)
 			 * the root of any anon_vma tree that might form.
 			 */
 			anon_vma->root = anon_vma;
+			anon_vma->num_children++; /* self-parent link */
 		}
 
 		anon_vma_lock(anon_vma);
@@ -149,6 +158,7 @@ int anon_vma_prepare(struct vm_area_struct *vma)
 			avc->vma = vma;
 			list_add(&avc->same_vma, &vma->anon_vma_chain);
 			list_add_tail(&avc->same_anon_vma, &anon_vma->head);
+			anon_vma->num_active_vmas++;
 			allocated = NULL;
 			avc = NULL;
 		}
@@ -188,20 +198,53 @@ static void anon_vma_chain_link(struct vm_area_struct *vma,
 /*
  * Attach the anon_vmas from src to dst.
  * Returns 0 on success, -ENOMEM on failure.
+ *
+ * If dst->anon_vma is NULL this function tries to find and reuse an
+ * existing anon_vma which has no vmas and only one child anon_vma. This
+ * prevents degradation of the anon_vma hierarchy to an endless linear
+ * chain in case of a constantly forking task. On the other hand, an
+ * anon_vma with more than one child isn't reused even if there was no
+ * alive vma, thus the rmap walker has a good chance of avoiding
+ * scanning the whole hierarchy when it searches where a page is mapped.
  */
 int anon_vma_clone(struct vm_area_struct *dst, struct vm_area_struct *src)
 {
 	struct anon_vma_chain *avc, *pavc;
 
 	list_for_each_entry_reverse(pavc, &src->anon_vma_chain, same_vma) {
+		struct anon_vma *anon_vma = pavc->anon_vma;
+
 		avc = anon_vma_chain_alloc();
 		if (!avc)
 			goto enomem_failure;
-		anon_vma_chain_link(dst, avc, pavc->anon_vma);
+		anon_vma_chain_link(dst, avc, anon_vma);
+
+		/*
+		 * Reuse the existing anon_vma if it has no vma and only one
+		 * anon_vma child.
+		 *
+		 * Do not choose the parent anon_vma, otherwise the first child
+		 * would always reuse it. The root anon_vma is never reused:
+		 * it has a self-parent reference and at least one child.
+		 */
+		if (!dst->anon_vma && anon_vma != src->anon_vma &&
+		    anon_vma->num_children < 2 &&
+		    anon_vma->num_active_vmas == 0)
+			dst->anon_vma = anon_vma;
+	}
+	if (dst->anon_vma) {
+		anon_vma_lock(dst->anon_vma);
+		dst->anon_vma->num_active_vmas++;
+		anon_vma_unlock(dst->anon_vma);
 	}
 	return 0;
 
  enomem_failure:
+	/*
+	 * dst->anon_vma is dropped here otherwise its num_active_vmas would
+	 * be decremented in unlink_anon_vmas() without having been incremented.
+	 */
+	dst->anon_vma = NULL;
 	unlink_anon_vmas(dst);
 	return -ENOMEM;
 }
@@ -220,6 +263,9 @@ int anon_vma_fork(struct vm_area_struct *vma, struct vm_area_struct *pvma)
 	if (!pvma->anon_vma)
 		return 0;
 
+	/* Drop inherited anon_vma, we'll reuse an existing or allocate new. */
+	vma->anon_vma = NULL;
+
 	/*
 	 * First, attach the new VMA to the parent VMA's anon_vmas,
 	 * so rmap can find non-COWed pages in child processes.
@@ -227,6 +273,10 @@ int anon_vma_fork(struct vm_area_struct *vma, struct vm_area_struct *pvma)
 	if (anon_vma_clone(vma, pvma))
 		return -ENOMEM;
 
+	/* An existing anon_vma has been reused, all done then. */
+	if (vma->anon_vma)
+		return 0;
+
 	/* Then add our own anon_vma. */
 	anon_vma = anon_vma_alloc();
 	if (!anon_vma)
@@ -240,6 +290,8 @@ int anon_vma_fork(struct vm_area_struct *vma, struct vm_area_struct *pvma)
 	 * lock any of the anon_vmas in this anon_vma tree.
 	 */
 	anon_vma->root = pvma->anon_vma->root;
+	anon_vma->parent = pvma->anon_vma;
+	anon_vma->num_active_vmas++;
 	/*
 	 * With KSM refcounts, an anon_vma can stay around longer than the
 	 * process it belongs to.  The root anon_vma needs to be pinned
@@ -249,6 +301,9 @@ int anon_vma_fork(struct vm_area_struct *vma, struct vm_area_struct *pvma)
 	/* Mark this anon_vma as the one where our new (COWed) pages go. */
 	vma->anon_vma = anon_vma;
 	anon_vma_chain_link(vma, avc, anon_vma);
+	anon_vma_lock(anon_vma);
+	anon_vma->parent->num_children++;
+	anon_vma_unlock(anon_vma);
 
 	return 0;
 
@@ -271,6 +326,10 @@ static void anon_vma_unlink(struct anon_vma_chain *anon_vma_chain)
 	anon_vma_lock(anon_vma);
 	list_del(&anon_vma_chain->same_anon_vma);
 
+	/* Once no vma is chained to it, it no longer counts as a child */
+	if (list_empty(&anon_vma->head))
+		anon_vma->parent->num_children--;
+
 	/* We must garbage collect the anon_vma if it's empty */
 	empty = list_empty(&anon_vma->head) && !anonvma_external_refcount(anon_vma);
 	anon_vma_unlock(anon_vma);
@@ -287,6 +346,12 @@ void unlink_anon_vmas(struct vm_area_struct *vma)
 {
 	struct anon_vma_chain *avc, *next;
 
+	if (vma->anon_vma) {
+		anon_vma_lock(vma->anon_vma);
+		vma->anon_vma->num_active_vmas--;
+		anon_vma_unlock(vma->anon_vma);
+	}
+
 	/*
 	 * Unlink each anon_vma chained to the VMA.  This list is ordered
 	 * from newest to oldest, ensuring the root anon_vma gets freed last.
@@ -495,6 +560,7 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 			unsigned long *vm_flags)
 {
 	struct mm_struct *mm = vma->vm_mm;
+	pmd_t *pmd;
 	int referenced = 0;
 
 	/*
@@ -515,8 +581,6 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 		referenced++;
 
 	if (unlikely(PageTransHuge(page))) {
-		pmd_t *pmd;
-
 		spin_lock(&mm->page_table_lock);
 		pmd = page_check_address_pmd(page, mm, address,
 					     PAGE_CHECK_ADDRESS_PMD_FLAG);
@@ -524,6 +588,19 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 		    pmdp_clear_flush_young_notify(vma, address, pmd))
 			referenced++;
 		spin_unlock(&mm->page_table_lock);
+	} else if (page_may_be_team(page) &&
+		   (pmd = page_check_team_pmd(page, mm, address))) {
+		/*
+		 * A huge pmd mapping a team has one young bit for all its
+		 * pages: only the first of them clears it, the rest see it.
+		 */
+		if (page == pmd_page(*pmd) ?
+		    pmdp_clear_flush_young_notify(vma, address & HPAGE_PMD_MASK,
+						  pmd) :
+		    pmd_young(*pmd))
+			if (likely(!VM_SequentialReadHint(vma)))
+				referenced++;
+		spin_unlock(&mm->page_table_lock);
 	} else {
 		pte_t *pte;
 		spinlock_t *ptl;
@@ -590,6 +667,10 @@ static int page_referenced_anon(struct page *page,
 	return referenced;
 }
 
+static int __page_referenced_file(struct page *page,
+				  struct mem_cgroup *mem_cont,
+				  unsigned long *vm_flags);
+
 /**
  * page_referenced_file - referenced check for object-based rmap
  * @page: the page we're checking references on.
@@ -607,12 +688,8 @@ static int page_referenced_file(struct page *page,
 				struct mem_cgroup *mem_cont,
 				unsigned long *vm_flags)
 {
-	unsigned int mapcount;
 	struct address_space *mapping = page->mapping;
-	pgoff_t pgoff = page->index << (PAGE_CACHE_SHIFT - PAGE_SHIFT);
-	struct vm_area_struct *vma;
-	struct prio_tree_iter iter;
-	int referenced = 0;
+	int referenced;
 
 	/*
 	 * The caller's checks on page->mapping and !PageAnon have made
@@ -630,6 +707,26 @@ static int page_referenced_file(struct page *page,
 	BUG_ON(!PageLocked(page));
 
 	spin_lock(&mapping->i_mmap_lock);
+	referenced = __page_referenced_file(page, mem_cont, vm_flags);
+	spin_unlock(&mapping->i_mmap_lock);
+
+	return referenced;
+}
+
+/*
+ * The walk of page_referenced_file(), with the page locked and
+ * page->mapping->i_mmap_lock held.
+ */
+static int __page_referenced_file(struct page *page,
+				  struct mem_cgroup *mem_cont,
+				  unsigned long *vm_flags)
+{
+	unsigned int mapcount;
+	struct address_space *mapping = page->mapping;
+	pgoff_t pgoff = page->index << (PAGE_CACHE_SHIFT - PAGE_SHIFT);
+	struct vm_area_struct *vma;
+	struct prio_tree_iter iter;
+	int referenced = 0;
 
 	/*
 	 * i_mmap_lock does not stabilize mapcount at all, but mapcount
@@ -654,7 +751,6 @@ static int page_referenced_file(struct page *page,
 			break;
 	}
 
-	spin_unlock(&mapping->i_mmap_lock);
 	return referenced;
 }
 
@@ -704,6 +800,171 @@ out:
 	return referenced;
 }
 
+static inline int page_batch_anon(struct page *page)
+{
+	return PageAnon(page) && !PageKsm(page);
+}
+
+/*
+ * One walk of the locked @anon_vma for the pages @idx of @pages, all of
+ * which belong to it.
+ */
+static void page_referenced_anon_batch(struct anon_vma *anon_vma,
+				       struct page **pages, int *idx, int n,
+				       struct mem_cgroup *mem_cont,
+				       int *referenced,
+				       unsigned long *vm_flags)
+{
+	unsigned int mapcount[PAGE_REFERENCED_BATCH];
+	struct anon_vma_chain *avc;
+	int k, left = n;
+
+	for (k = 0; k < n; k++)
+		mapcount[k] = page_mapcount(pages[idx[k]]);
+
+	list_for_each_entry(avc, &anon_vma->head, same_anon_vma) {
+		struct vm_area_struct *vma = avc->vma;
+
+		if (mem_cont && !mm_match_cgroup(vma->vm_mm, mem_cont))
+			continue;
+
+		for (k = 0; k < n; k++) {
+			struct page *page = pages[idx[k]];
+			unsigned long address;
+
+			if (!mapcount[k])
+				continue;
+			address = vma_address(page, vma);
+			if (address == -EFAULT)
+				continue;
+			referenced[idx[k]] += page_referenced_one(page, vma,
+					address, &mapcount[k],
+					&vm_flags[idx[k]]);
+			if (!mapcount[k])
+				left--;
+		}
+		if (!left)
+			break;
+	}
+}
+
+/**
+ * page_referenced_batch - page_referenced() on a batch of unlocked pages
+ * @pages: the pages to test, at most PAGE_REFERENCED_BATCH
+ * @nr: number of pages
+ * @mem_cont: target memory controller
+ * @referenced: returns what page_referenced() would for each page
+ * @vm_flags: returns the vm_flags page_referenced() would for each page
+ *
+ * The pages of one anon_vma are tested in a single walk of it, and those of
+ * one mapping under a single hold of its i_mmap_lock, instead of taking the
+ * lock and walking the rmap once for every page.
+ */
+void page_referenced_batch(struct page **pages, int nr,
+			   struct mem_cgroup *mem_cont, int *referenced,
+			   unsigned long *vm_flags)
+{
+	int idx[PAGE_REFERENCED_BATCH];
+	unsigned long done = 0, tested = 0;
+	int i, j, n;
+
+	VM_BUG_ON(nr > PAGE_REFERENCED_BATCH);
+
+	for (i = 0; i < nr; i++) {
+		referenced[i] = 0;
+		vm_flags[i] = 0;
+		if (!page_mapped(pages[i]) || !page_rmapping(pages[i]))
+			done |= 1UL << i;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct page *page = pages[i];
+
+		if (done & (1UL << i))
+			continue;
+		done |= 1UL << i;
+
+		if (page_batch_anon(page)) {
+			struct anon_vma *anon_vma = page_lock_anon_vma(page);
+
+			if (!anon_vma)
+				continue;
+			/*
+			 * Holding the root lock, a page still mapped and
+			 * pointing to this anon_vma keeps pointing to a live
+			 * one of the same tree.
+			 */
+			idx[0] = i;
+			n = 1;
+			for (j = i + 1; j < nr; j++) {
+				if ((done & (1UL << j)) ||
+				    !page_batch_anon(pages[j]) ||
+				    page_anon_vma(pages[j]) != anon_vma ||
+				    !page_mapped(pages[j]))
+					continue;
+				done |= 1UL << j;
+				idx[n++] = j;
+			}
+			page_referenced_anon_batch(anon_vma, pages, idx, n,
+						   mem_cont, referenced,
+						   vm_flags);
+			page_unlock_anon_vma(anon_vma);
+		} else if (!PageAnon(page)) {
+			struct address_space *mapping;
+
+			if (!trylock_page(page)) {
+				referenced[i]++;
+				continue;
+			}
+			mapping = page->mapping;
+			if (!mapping || !page_mapped(page)) {
+				unlock_page(page);
+				continue;
+			}
+			idx[0] = i;
+			n = 1;
+			for (j = i + 1; j < nr; j++) {
+				if ((done & (1UL << j)) ||
+				    PageAnon(pages[j]) ||
+				    pages[j]->mapping != mapping)
+					continue;
+				if (!trylock_page(pages[j]))
+					continue;
+				/* truncated meanwhile? */
+				if (pages[j]->mapping != mapping ||
+				    !page_mapped(pages[j])) {
+					unlock_page(pages[j]);
+					continue;
+				}
+				done |= 1UL << j;
+				idx[n++] = j;
+			}
+
+			spin_lock(&mapping->i_mmap_lock);
+			for (j = 0; j < n; j++)
+				referenced[idx[j]] += __page_referenced_file(
+						pages[idx[j]], mem_cont,
+						&vm_flags[idx[j]]);
+			spin_unlock(&mapping->i_mmap_lock);
+
+			for (j = 0; j < n; j++)
+				unlock_page(pages[idx[j]]);
+		} else {
+			/* KSM pages have their own walk */
+			referenced[i] = page_referenced(page, 0, mem_cont,
+							&vm_flags[i]);
+			tested |= 1UL << i;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (tested & (1UL << i))
+			continue;
+		if (page_test_and_clear_young(pages[i]))
+			referenced[i]++;
+	}
+}
+
 static int page_mkclean_one(struct page *page, struct vm_area_struct *vma,
 			    unsigned long address)
 {
@@ -891,7 +1152,8 @@ void do_page_add_anon_rmap(struct page *page,
 	}
 #ifdef CONFIG_KSM
 	if (unlikely(PageKsm(page))) {
-		__inc_zone_page_state(page, NR_KSM_PAGES_SHARING);
+		__inc_zone_page_state(page, first ? NR_KSM_PAGES_SHARED :
+					    NR_KSM_PAGES_SHARING);
 		return;
 	}
 #endif
@@ -952,13 +1214,18 @@ void page_add_file_rmap(struct page *page)
  */
 void page_remove_rmap(struct page *page)
 {
+	/* page still mapped by someone else? */
+	if (!atomic_add_negative(-1, &page->_mapcount)) {
 #ifdef CONFIG_KSM
-	if (PageKsm(page))
-		__dec_zone_page_state(page, NR_KSM_PAGES_SHARING);
+		if (PageKsm(page))
+			__dec_zone_page_state(page, NR_KSM_PAGES_SHARING);
 #endif
-	/* page still mapped by someone else? */
-	if (!atomic_add_negative(-1, &page->_mapcount))
 		return;
+	}
+#ifdef CONFIG_KSM
+	if (PageKsm(page))
+		__dec_zone_page_state(page, NR_KSM_PAGES_SHARED);
+#endif
 
 	/*
 	 * Now that the last pte has gone, s390 must transfer dirty
@@ -999,10 +1266,105 @@ void page_remove_rmap(struct page *page)
 	 */
 }
 
+/**
+ * page_remove_rmap_nr - take down @nr pte mappings from a page
+ * @page: page to remove mappings from
+ * @nr: how many
+ *
+ * The same as @nr page_remove_rmap() calls, with a single atomic operation
+ * on the mapcount for all but the last one.
+ *
+ * The caller needs to hold the pte lock.
+ */
+void page_remove_rmap_nr(struct page *page, int nr)
+{
+	if (nr > 1) {
+		/* the last one is left below, the page stays mapped */
+		atomic_sub(nr - 1, &page->_mapcount);
+#ifdef CONFIG_KSM
+		if (PageKsm(page))
+			__mod_zone_page_state(page_zone(page),
+					      NR_KSM_PAGES_SHARING, 1 - nr);
+#endif
+	}
+	page_remove_rmap(page);
+}
+
 /*
  * Subfunctions of try_to_unmap: try_to_unmap_one called
  * repeatedly from either try_to_unmap_anon or try_to_unmap_file.
  */
+void try_to_unmap_flush(void)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = current->tlb_ubc;
+	int i;
+
+	if (!tlb_ubc)
+		return;
+
+	for (i = 0; i < tlb_ubc->nr; i++) {
+		flush_tlb_mm(tlb_ubc->mms[i]);
+		mmdrop(tlb_ubc->mms[i]);
+	}
+	tlb_ubc->nr = 0;
+	tlb_ubc->writable = 0;
+}
+
+void try_to_unmap_flush_dirty(void)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = current->tlb_ubc;
+
+	if (tlb_ubc && tlb_ubc->writable)
+		try_to_unmap_flush();
+}
+
+/*
+ * Called under the pte lock by who changes or zaps ptes of @mm, that
+ * reclaim may have cleared without flushing: their TLB entries must be
+ * gone before the lock is released, as if the ptes had been flushed.
+ */
+void flush_tlb_batched_pending(struct mm_struct *mm)
+{
+	if (ACCESS_ONCE(mm->tlb_flush_batched)) {
+		/* cleared first, not to miss a pte cleared meanwhile */
+		mm->tlb_flush_batched = 0;
+		smp_mb();
+		flush_tlb_mm(mm);
+	}
+}
+
+/*
+ * Whether the flush of a pte of @mm can wait in current->tlb_ubc: only
+ * worth it when other cpus run @mm, and an IPI would be sent. Called
+ * under the pte lock.
+ */
+static int set_tlb_ubc_flush_pending(struct mm_struct *mm,
+				     enum ttu_flags flags)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = current->tlb_ubc;
+	int i, cpu, others;
+
+	if (!(flags & TTU_BATCH_FLUSH) || !tlb_ubc)
+		return 0;
+
+	cpu = get_cpu();
+	others = cpumask_any_but(mm_cpumask(mm), cpu) < nr_cpu_ids;
+	put_cpu();
+	if (!others)
+		return 0;
+
+	for (i = 0; i < tlb_ubc->nr; i++)
+		if (tlb_ubc->mms[i] == mm)
+			goto found;
+	if (tlb_ubc->nr == TLB_UBC_MMS)
+		return 0;
+	atomic_inc(&mm->mm_count);
+	tlb_ubc->mms[tlb_ubc->nr++] = mm;
+found:
+	mm->tlb_flush_batched = 1;
+	return 1;
+}
+
 int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 		     unsigned long address, enum ttu_flags flags)
 {
@@ -1012,6 +1374,10 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	spinlock_t *ptl;
 	int ret = SWAP_AGAIN;
 
+	/* a team mapped by a huge pmd is split to ptes to unmap one of it */
+	if (page_may_be_team(page))
+		split_huge_team_page(page, vma, address);
+
 	pte = page_check_address(page, mm, address, &ptl, 0);
 	if (!pte)
 		goto out;
@@ -1028,6 +1394,12 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 		if (TTU_ACTION(flags) == TTU_MUNLOCK)
 			goto out_unmap;
 	}
+	/* written to since MADV_FREE: not to be discarded, but swapped */
+	if ((flags & TTU_FREE) && pte_dirty(*pte)) {
+		set_page_dirty(page);
+		ret = SWAP_FAIL;
+		goto out_unmap;
+	}
 	if (!(flags & TTU_IGNORE_ACCESS)) {
 		if (ptep_clear_flush_young_notify(vma, address, pte)) {
 			ret = SWAP_FAIL;
@@ -1037,7 +1409,13 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 
 	/* Nuke the page table entry. */
 	flush_cache_page(vma, address, page_to_pfn(page));
-	pteval = ptep_clear_flush_notify(vma, address, pte);
+	if (set_tlb_ubc_flush_pending(mm, flags)) {
+		pteval = ptep_get_and_clear(mm, address, pte);
+		if (pte_dirty(pteval))
+			current->tlb_ubc->writable = 1;
+		mmu_notifier_invalidate_page(mm, address);
+	} else
+		pteval = ptep_clear_flush_notify(vma, address, pte);
 
 	/* Move the dirty bit to the physical page now the pte is gone. */
 	if (pte_dirty(pteval))
@@ -1056,6 +1434,16 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else if (PageAnon(page)) {
 		swp_entry_t entry = { .val = page_private(page) };
 
+		if ((flags & TTU_FREE) && !PageSwapCache(page)) {
+			/* dirtied as it was unmapped */
+			if (PageDirty(page)) {
+				set_pte_at(mm, address, pte, pteval);
+				ret = SWAP_FAIL;
+				goto out_unmap;
+			}
+			dec_mm_counter(mm, MM_ANONPAGES);
+			goto discard;
+		}
 		if (PageSwapCache(page)) {
 			/*
 			 * Store the swap location in the pte.
@@ -1093,6 +1481,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else
 		dec_mm_counter(mm, MM_FILEPAGES);
 
+discard:
 	page_remove_rmap(page);
 	page_cache_release(page);
 
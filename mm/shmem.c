@@ -60,11 +60,15 @@ static struct vfsmount *shm_mnt;
 #include <linux/highmem.h>
 #include <linux/seq_file.h>
 #include <linux/magic.h>
+#include <linux/khugepaged.h>
+#include <linux/mm_inline.h>
 
 #include <asm/uaccess.h>
 #include <asm/div64.h>
 #include <asm/pgtable.h>
 
+#include "internal.h"
+
 /*
  * The maximum size of a shmem/tmpfs file is limited by the maximum size of
  * its triple-indirect swap vector - see illustration at shmem_swp_entry().
@@ -107,6 +111,12 @@ enum sgp_type {
 	SGP_WRITE,	/* may exceed i_size, may allocate page */
 };
 
+/* The huge= mount option: when an aligned extent is allocated as a team */
+#define SHMEM_HUGE_NEVER	0	/* never */
+#define SHMEM_HUGE_ALWAYS	1	/* whenever an extent is empty */
+#define SHMEM_HUGE_WITHIN_SIZE	2	/* if the extent is within i_size */
+#define SHMEM_HUGE_ADVISE	3	/* where madvised MADV_HUGEPAGE */
+
 #ifdef CONFIG_TMPFS
 static unsigned long shmem_default_max_blocks(void)
 {
@@ -207,6 +217,12 @@ static inline int shmem_acct_block(unsigned long flags)
 		security_vm_enough_memory_kern(VM_ACCT(PAGE_CACHE_SIZE)) : 0;
 }
 
+static inline int shmem_acct_blocks(unsigned long flags, long pages)
+{
+	return (flags & VM_NORESERVE) ?
+		security_vm_enough_memory_kern(pages * VM_ACCT(PAGE_CACHE_SIZE)) : 0;
+}
+
 static inline void shmem_unacct_blocks(unsigned long flags, long pages)
 {
 	if (flags & VM_NORESERVE)
@@ -1165,8 +1181,8 @@ static struct page *shmem_swapin(swp_entry_t entry, gfp_t gfp,
 	return page;
 }
 
-static struct page *shmem_alloc_page(gfp_t gfp,
-			struct shmem_inode_info *info, unsigned long idx)
+static struct page *shmem_alloc_pages(gfp_t gfp, struct shmem_inode_info *info,
+			unsigned long idx, unsigned int order)
 {
 	struct vm_area_struct pvma;
 
@@ -1177,9 +1193,9 @@ static struct page *shmem_alloc_page(gfp_t gfp,
 	pvma.vm_policy = mpol_shared_policy_lookup(&info->policy, idx);
 
 	/*
-	 * alloc_page_vma() will drop the shared policy reference
+	 * alloc_pages_vma() will drop the shared policy reference
 	 */
-	return alloc_page_vma(gfp, &pvma, 0);
+	return alloc_pages_vma(gfp, order, &pvma, 0, numa_node_id());
 }
 #else /* !CONFIG_NUMA */
 #ifdef CONFIG_TMPFS
@@ -1194,12 +1210,19 @@ static inline struct page *shmem_swapin(swp_entry_t entry, gfp_t gfp,
 	return swapin_readahead(entry, gfp, NULL, 0);
 }
 
+static inline struct page *shmem_alloc_pages(gfp_t gfp,
+			struct shmem_inode_info *info, unsigned long idx,
+			unsigned int order)
+{
+	return alloc_pages(gfp, order);
+}
+#endif /* CONFIG_NUMA */
+
 static inline struct page *shmem_alloc_page(gfp_t gfp,
 			struct shmem_inode_info *info, unsigned long idx)
 {
-	return alloc_page(gfp);
+	return shmem_alloc_pages(gfp, info, idx, 0);
 }
-#endif /* CONFIG_NUMA */
 
 #if !defined(CONFIG_NUMA) || !defined(CONFIG_TMPFS)
 static inline struct mempolicy *shmem_get_sbmpol(struct shmem_sb_info *sbinfo)
@@ -1208,6 +1231,168 @@ static inline struct mempolicy *shmem_get_sbmpol(struct shmem_sb_info *sbinfo)
 }
 #endif
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * A team is HPAGE_PMD_NR order-0 pages of the page cache, physically
+ * contiguous and aligned like a huge page, at an aligned extent of the file:
+ * each page is accounted, swapped and truncated on its own as ever, but the
+ * extent can be mapped by a huge pmd (see do_huge_pmd_team_page()).
+ */
+
+/* Huge allocations fail fast rather than reclaim and compact for long */
+#define SHMEM_TEAM_GFP	(__GFP_NOMEMALLOC | __GFP_NORETRY | __GFP_NOWARN | \
+			 __GFP_NO_KSWAPD)
+
+/*
+ * Does the huge= option of @inode's mount let the extent at @index be a
+ * team? @vma is the mapping faulted on, or NULL.
+ */
+static bool shmem_huge_enabled(struct inode *inode, pgoff_t index,
+			       struct vm_area_struct *vma)
+{
+	if (index + HPAGE_PMD_NR > SHMEM_MAX_INDEX)
+		return false;
+	if (vma && (vma->vm_flags & VM_NOHUGEPAGE))
+		return false;
+
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return true;
+	case SHMEM_HUGE_WITHIN_SIZE:
+		return index + HPAGE_PMD_NR <=
+			DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE);
+	case SHMEM_HUGE_ADVISE:
+		return vma && (vma->vm_flags & VM_HUGEPAGE);
+	}
+	return false;
+}
+
+/* Insert one new page of a team, as shmem_getpage() would a page of its own */
+static int shmem_add_team_page(struct inode *inode, struct page *page,
+			       unsigned long idx, gfp_t gfp)
+{
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+	swp_entry_t *entry;
+	int error;
+
+	clear_highpage(page);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	SetPageSwapBacked(page);
+
+	error = mem_cgroup_cache_charge(page, current->mm, GFP_KERNEL);
+	if (error)
+		return error;
+	error = radix_tree_preload(gfp & ~__GFP_HIGHMEM);
+	if (error) {
+		mem_cgroup_uncharge_cache_page(page);
+		return error;
+	}
+	radix_tree_preload_end();
+
+	spin_lock(&info->lock);
+	entry = shmem_swp_alloc(info, idx, SGP_WRITE);
+	if (IS_ERR(entry))
+		error = PTR_ERR(entry);
+	else {
+		if (entry->val)
+			error = -EEXIST;
+		shmem_swp_unmap(entry);
+	}
+	if (!error && sbinfo->max_blocks &&
+	    percpu_counter_compare(&sbinfo->used_blocks,
+				   sbinfo->max_blocks) > 0)
+		error = -ENOSPC;
+	if (error)
+		mem_cgroup_uncharge_cache_page(page);
+	else
+		error = add_to_page_cache_lru(page, inode->i_mapping, idx,
+					      GFP_NOWAIT);
+	if (!error) {
+		if (sbinfo->max_blocks) {
+			percpu_counter_inc(&sbinfo->used_blocks);
+			spin_lock(&inode->i_lock);
+			inode->i_blocks += BLOCKS_PER_PAGE;
+			spin_unlock(&inode->i_lock);
+		}
+		info->flags |= SHMEM_PAGEIN;
+		info->alloced++;
+	}
+	spin_unlock(&info->lock);
+
+	if (!error) {
+		unlock_page(page);
+		page_cache_release(page);
+	}
+	return error;
+}
+
+/*
+ * Allocate the aligned extent of @inode around @idx as a team, if its mount
+ * allows and nothing of the extent is in memory or on swap yet. Returns 0
+ * once all of it is in the page cache.
+ */
+static int shmem_add_team(struct inode *inode, unsigned long idx,
+			  struct vm_area_struct *vma)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+	unsigned long index = idx & ~(HPAGE_PMD_NR - 1);
+	struct page *team, *page;
+	gfp_t gfp = mapping_gfp_mask(mapping);
+	int i, nr = 0, error = 0;
+
+	if (!shmem_huge_enabled(inode, index, vma))
+		return -EINVAL;
+
+	if (find_get_pages(mapping, index, 1, &page)) {
+		bool busy = page->index < index + HPAGE_PMD_NR;
+
+		page_cache_release(page);
+		if (busy)
+			return -EEXIST;
+	}
+
+	if (sbinfo->max_blocks &&
+	    (sbinfo->max_blocks < HPAGE_PMD_NR ||
+	     percpu_counter_compare(&sbinfo->used_blocks,
+				    sbinfo->max_blocks - HPAGE_PMD_NR) > 0))
+		return -ENOSPC;
+	if (shmem_acct_blocks(info->flags, HPAGE_PMD_NR))
+		return -ENOSPC;
+
+	team = shmem_alloc_pages(gfp | SHMEM_TEAM_GFP, info, index,
+				 HPAGE_PMD_ORDER);
+	if (!team) {
+		shmem_unacct_blocks(info->flags, HPAGE_PMD_NR);
+		return -ENOMEM;
+	}
+	split_page(team, HPAGE_PMD_ORDER);
+
+	/* a page raced in or swap ran out: keep what got in, free the rest */
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = team + i;
+		if (!error)
+			error = shmem_add_team_page(inode, page, index + i, gfp);
+		if (error)
+			page_cache_release(page);
+		else
+			nr++;
+	}
+	shmem_unacct_blocks(info->flags, HPAGE_PMD_NR - nr);
+
+	return error;
+}
+#else
+static inline int shmem_add_team(struct inode *inode, unsigned long idx,
+				 struct vm_area_struct *vma)
+{
+	return -EINVAL;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 /*
  * shmem_getpage - either get the page from swap or allocate a new one
  *
@@ -1227,6 +1412,7 @@ static int shmem_getpage(struct inode *inode, unsigned long idx,
 	swp_entry_t *entry;
 	swp_entry_t swap;
 	gfp_t gfp;
+	bool team_tried = false;
 	int error;
 
 	if (idx >= SHMEM_MAX_INDEX)
@@ -1249,6 +1435,12 @@ repeat:
 	if (filepage && PageUptodate(filepage))
 		goto done;
 	gfp = mapping_gfp_mask(mapping);
+	if (!filepage && (sgp == SGP_CACHE || sgp == SGP_WRITE) && !team_tried) {
+		/* the first page touched of an empty extent may bring its team */
+		team_tried = true;
+		if (!shmem_add_team(inode, idx, NULL))
+			goto repeat;
+	}
 	if (!filepage) {
 		/*
 		 * Try to preload while we can wait, to not make a habit of
@@ -1522,6 +1714,185 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return ret | VM_FAULT_LOCKED;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Could a huge pmd map @vma at @haddr? Only if the vma is shared, maps all
+ * of an aligned extent there, within i_size, and the mount's huge= policy
+ * lets that be a team. Sets *@index to the start of the extent.
+ */
+static bool shmem_vma_huge(struct vm_area_struct *vma, unsigned long haddr,
+			   pgoff_t *index)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+
+	if (!(vma->vm_flags & VM_MAYSHARE) ||
+	    (vma->vm_flags & (VM_NONLINEAR | VM_LOCKED)))
+		return false;
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return false;
+	*index = linear_page_index(vma, haddr);
+	if (*index & (HPAGE_PMD_NR - 1))
+		return false;
+	if ((loff_t)(*index + HPAGE_PMD_NR) << PAGE_CACHE_SHIFT >
+	    i_size_read(inode))
+		return false;
+	return shmem_huge_enabled(inode, *index, vma);
+}
+
+static int shmem_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd, unsigned int flags)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	pgoff_t index;
+
+	if (!shmem_vma_huge(vma, address & HPAGE_PMD_MASK, &index))
+		return VM_FAULT_FALLBACK;
+
+	/* an empty extent gets its team now, or else ->fault maps ptes */
+	shmem_add_team(inode, index, vma);
+	return do_huge_pmd_team_page(vma->vm_mm, vma, address, pmd, flags);
+}
+
+struct shmem_team_alloc {
+	struct page *team;
+	DECLARE_BITMAP(used, HPAGE_PMD_NR);
+};
+
+/*
+ * migrate_pages() callback: each page moves to its place in the team. A page
+ * retried after a failure would get the page freed by that failure, so the
+ * second try of a page fails the migration instead.
+ */
+static struct page *shmem_team_new_page(struct page *page,
+					unsigned long private, int **result)
+{
+	struct shmem_team_alloc *alloc = (struct shmem_team_alloc *)private;
+	unsigned long i = page->index & (HPAGE_PMD_NR - 1);
+
+	if (test_and_set_bit(i, alloc->used))
+		return NULL;
+	return alloc->team + i;
+}
+
+/**
+ * shmem_collapse_team - make the extent @vma maps at @haddr a team
+ * @vma: a shmem vma, its mmap_sem held for read
+ * @haddr: the huge page aligned address of the extent
+ * @max_holes: how many of its pages may be allocated or swapped in for it
+ *
+ * For khugepaged: the pages of the extent are filled in and then migrated
+ * into a newly allocated team, wherever they are mapped. Returns 0 if the
+ * extent is a team, which a huge pmd may map once the ptes are gone.
+ */
+int shmem_collapse_team(struct vm_area_struct *vma, unsigned long haddr,
+			unsigned int max_holes)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_team_alloc alloc;
+	unsigned long pfn = 0;
+	unsigned int holes = 0;
+	bool team = true;
+	LIST_HEAD(pagelist);
+	struct page *page;
+	pgoff_t index;
+	int i, error;
+
+	if (!shmem_vma_huge(vma, haddr, &index))
+		return -EINVAL;
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = find_get_page(mapping, index + i);
+		if (!page) {
+			holes++;
+			team = false;
+			continue;
+		}
+		if (!i)
+			pfn = page_to_pfn(page);
+		if (PageCompound(page) || pfn & (HPAGE_PMD_NR - 1) ||
+		    page_to_pfn(page) != pfn + i)
+			team = false;
+		page_cache_release(page);
+	}
+	if (team)
+		return 0;
+	if (holes > max_holes)
+		return -EBUSY;
+
+	for (i = 0; holes && i < HPAGE_PMD_NR; i++) {
+		page = find_get_page(mapping, index + i);
+		if (page) {
+			page_cache_release(page);
+			continue;
+		}
+		page = NULL;
+		error = shmem_getpage(inode, index + i, &page, SGP_CACHE, NULL);
+		if (error)
+			return error;
+		unlock_page(page);
+		page_cache_release(page);
+		holes--;
+	}
+
+	alloc.team = shmem_alloc_pages(mapping_gfp_mask(mapping) |
+				       SHMEM_TEAM_GFP, info, index,
+				       HPAGE_PMD_ORDER);
+	if (!alloc.team)
+		return -ENOMEM;
+	split_page(alloc.team, HPAGE_PMD_ORDER);
+	bitmap_zero(alloc.used, HPAGE_PMD_NR);
+
+	lru_add_drain();
+	error = 0;
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = find_get_page(mapping, index + i);
+		if (!page) {
+			error = -EAGAIN;
+			break;
+		}
+		error = isolate_lru_page(page);
+		page_cache_release(page);
+		if (error)
+			break;
+		list_add_tail(&page->lru, &pagelist);
+		inc_zone_page_state(page, NR_ISOLATED_ANON +
+				    page_is_file_cache(page));
+	}
+	if (!error && migrate_pages(&pagelist, shmem_team_new_page,
+				    (unsigned long)&alloc, false, true))
+		error = -EAGAIN;
+	putback_lru_pages(&pagelist);
+
+	/* pages handed out are in the page cache now, or freed by migration */
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		if (!test_bit(i, alloc.used))
+			__free_page(alloc.team + i);
+
+	return error;
+}
+
+/* Have khugepaged look at the mm for extents it can collapse into teams */
+static int shmem_khugepaged_enter(struct vm_area_struct *vma)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+
+	if (!(vma->vm_flags & VM_MAYSHARE) ||
+	    SHMEM_SB(inode->i_sb)->huge == SHMEM_HUGE_NEVER)
+		return 0;
+	if (!test_bit(MMF_VM_HUGEPAGE, &vma->vm_mm->flags) &&
+	    __khugepaged_enter(vma->vm_mm))
+		return -ENOMEM;
+	return 0;
+}
+#else
+static inline int shmem_khugepaged_enter(struct vm_area_struct *vma)
+{
+	return 0;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 #ifdef CONFIG_NUMA
 static int shmem_set_policy(struct vm_area_struct *vma, struct mempolicy *new)
 {
@@ -1571,7 +1942,7 @@ static int shmem_mmap(struct file *file, struct vm_area_struct *vma)
 	file_accessed(file);
 	vma->vm_ops = &shmem_vm_ops;
 	vma->vm_flags |= VM_CAN_NONLINEAR;
-	return 0;
+	return shmem_khugepaged_enter(vma);
 }
 
 static struct inode *shmem_get_inode(struct super_block *sb, const struct inode *dir,
@@ -2175,6 +2546,29 @@ static const struct export_operations shmem_export_ops = {
 	.fh_to_dentry	= shmem_fh_to_dentry,
 };
 
+static const char *shmem_huge_names[] = {
+	[SHMEM_HUGE_NEVER]	= "never",
+	[SHMEM_HUGE_ALWAYS]	= "always",
+	[SHMEM_HUGE_WITHIN_SIZE] = "within_size",
+	[SHMEM_HUGE_ADVISE]	= "advise",
+};
+
+static int shmem_parse_huge(const char *value)
+{
+	int huge;
+
+	for (huge = 0; huge < ARRAY_SIZE(shmem_huge_names); huge++)
+		if (!strcmp(value, shmem_huge_names[huge]))
+			break;
+	if (huge == ARRAY_SIZE(shmem_huge_names))
+		return -EINVAL;
+#ifndef CONFIG_TRANSPARENT_HUGEPAGE
+	if (huge != SHMEM_HUGE_NEVER)
+		return -EINVAL;
+#endif
+	return huge;
+}
+
 static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 			       bool remount)
 {
@@ -2250,6 +2644,11 @@ static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 		} else if (!strcmp(this_char,"mpol")) {
 			if (mpol_parse_str(value, &sbinfo->mpol, 1))
 				goto bad_val;
+		} else if (!strcmp(this_char,"huge")) {
+			int huge = shmem_parse_huge(value);
+			if (huge < 0)
+				goto bad_val;
+			sbinfo->huge = huge;
 		} else {
 			printk(KERN_ERR "tmpfs: Bad mount option %s\n",
 			       this_char);
@@ -2296,6 +2695,7 @@ static int shmem_remount_fs(struct super_block *sb, int *flags, char *data)
 	sbinfo->max_blocks  = config.max_blocks;
 	sbinfo->max_inodes  = config.max_inodes;
 	sbinfo->free_inodes = config.max_inodes - inodes;
+	sbinfo->huge        = config.huge;
 
 	mpol_put(sbinfo->mpol);
 	sbinfo->mpol        = config.mpol;	/* transfers initial ref */
@@ -2319,6 +2719,8 @@ static int shmem_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_printf(seq, ",uid=%u", sbinfo->uid);
 	if (sbinfo->gid != 0)
 		seq_printf(seq, ",gid=%u", sbinfo->gid);
+	if (sbinfo->huge)
+		seq_printf(seq, ",huge=%s", shmem_huge_names[sbinfo->huge]);
 	shmem_show_mpol(seq, sbinfo->mpol);
 	return 0;
 }
@@ -2463,6 +2865,49 @@ static const struct address_space_operations shmem_aops = {
 	.error_remove_page = generic_error_remove_page,
 };
 
+/*
+ * Is @mapping the page cache of a shmem/tmpfs inode?
+ */
+int shmem_mapping(struct address_space *mapping)
+{
+	return mapping && mapping->a_ops == &shmem_aops;
+}
+
+/*
+ * Drop @page from the page cache of its shmem inode, to be read back as a
+ * hole, that is zero. For ksm, which found it zero-filled: @page is locked,
+ * no longer mapped, and its caller holds a reference. Returns 1 if dropped.
+ */
+int shmem_drop_unmapped_page(struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct inode *inode;
+	struct shmem_inode_info *info;
+
+	BUG_ON(!PageLocked(page));
+	if (!shmem_mapping(mapping) || page_mapped(page) ||
+	    PageWriteback(page) || PageSwapCache(page))
+		return 0;
+
+	inode = mapping->host;
+	info = SHMEM_I(inode);
+	if (info->flags & VM_LOCKED)
+		return 0;
+
+	/* the page cache and the caller, nobody else may be reading it */
+	if (page_count(page) != 2)
+		return 0;
+
+	ClearPageDirty(page);
+	remove_from_page_cache(page);
+	page_cache_release(page);	/* pagecache ref */
+
+	spin_lock(&info->lock);
+	shmem_recalc_inode(inode);
+	spin_unlock(&info->lock);
+	return 1;
+}
+
 static const struct file_operations shmem_file_operations = {
 	.mmap		= shmem_mmap,
 #ifdef CONFIG_TMPFS
@@ -2538,6 +2983,9 @@ static const struct super_operations shmem_ops = {
 
 static const struct vm_operations_struct shmem_vm_ops = {
 	.fault		= shmem_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.pmd_fault	= shmem_pmd_fault,
+#endif
 #ifdef CONFIG_NUMA
 	.set_policy     = shmem_set_policy,
 	.get_policy     = shmem_get_policy,
@@ -2699,6 +3147,16 @@ out:
 }
 #endif
 
+int shmem_mapping(struct address_space *mapping)
+{
+	return 0;
+}
+
+int shmem_drop_unmapped_page(struct page *page)
+{
+	return 0;
+}
+
 #define shmem_vm_ops				generic_file_vm_ops
 #define shmem_file_operations			ramfs_file_operations
 #define shmem_get_inode(sb, dir, mode, dev, flags)	ramfs_get_inode(sb, dir, mode, dev)
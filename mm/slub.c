@@ -144,6 +144,9 @@ static inline int kmem_cache_debug(struct kmem_cache *s)
  */
 #define MAX_PARTIAL 10
 
+/* Maximum number of frozen partial slabs kept by each cpu */
+#define MAX_CPU_PARTIAL 64
+
 #define DEBUG_DEFAULT_FLAGS (SLAB_DEBUG_FREE | SLAB_RED_ZONE | \
 				SLAB_POISON | SLAB_STORE_USER)
 
@@ -1347,9 +1350,12 @@ static inline int lock_and_freeze_slab(struct kmem_cache_node *n,
 /*
  * Try to allocate a partial slab from a specific node.
  */
-static struct page *get_partial_node(struct kmem_cache_node *n)
+static struct page *get_partial_node(struct kmem_cache *s,
+				     struct kmem_cache_node *n)
 {
-	struct page *page;
+	struct kmem_cache_cpu *c;
+	struct page *page, *next;
+	unsigned int extra;
 
 	/*
 	 * Racy check. If we mistakenly see no partial slabs then we
@@ -1366,6 +1372,20 @@ static struct page *get_partial_node(struct kmem_cache_node *n)
 			goto out;
 	page = NULL;
 out:
+	/* and half a cpu partial list more while we hold list_lock */
+	c = __this_cpu_ptr(s->cpu_slab);
+	extra = s->cpu_partial / 2;
+	if (page && c->nr_partial + extra <= s->cpu_partial) {
+		next = list_entry(n->partial.next, struct page, lru);
+		while (extra-- && &next->lru != &n->partial &&
+		       lock_and_freeze_slab(n, next)) {
+			slab_unlock(next);
+			list_add(&next->lru, &c->partial);
+			c->nr_partial++;
+			stat(s, CPU_PARTIAL_NODE);
+			next = list_entry(n->partial.next, struct page, lru);
+		}
+	}
 	spin_unlock(&n->list_lock);
 	return page;
 }
@@ -1413,7 +1433,7 @@ static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
 
 		if (n && cpuset_zone_allowed_hardwall(zone, flags) &&
 				n->nr_partial > s->min_partial) {
-			page = get_partial_node(n);
+			page = get_partial_node(s, n);
 			if (page) {
 				put_mems_allowed();
 				return page;
@@ -1433,7 +1453,7 @@ static struct page *get_partial(struct kmem_cache *s, gfp_t flags, int node)
 	struct page *page;
 	int searchnode = (node == NUMA_NO_NODE) ? numa_node_id() : node;
 
-	page = get_partial_node(get_node(s, searchnode));
+	page = get_partial_node(s, get_node(s, searchnode));
 	if (page || node != -1)
 		return page;
 
@@ -1487,6 +1507,62 @@ static void unfreeze_slab(struct kmem_cache *s, struct page *page, int tail)
 	}
 }
 
+/*
+ * Each cpu also keeps a few partial slabs of its own, frozen so that
+ * frees to them only take their slab lock. A slab freed into when full
+ * goes there instead of to the node partial list, and slabs taken from
+ * the node partial list come several at a time, so that storms of
+ * remote frees and of refills take list_lock once per batch of slabs.
+ * The list is only touched with interrupts disabled by its own cpu.
+ */
+static void unfreeze_partials(struct kmem_cache *s, struct kmem_cache_cpu *c)
+{
+	struct page *page, *next;
+
+	if (!c->nr_partial)
+		return;
+
+	stat(s, CPU_PARTIAL_DRAIN);
+	list_for_each_entry_safe(page, next, &c->partial, lru) {
+		list_del(&page->lru);
+		slab_lock(page);
+		unfreeze_slab(s, page, 1);
+	}
+	c->nr_partial = 0;
+}
+
+/*
+ * Put a frozen slab, locked, on the partial list of this cpu, making
+ * room first if needed.
+ */
+static void put_cpu_partial(struct kmem_cache *s, struct page *page)
+{
+	struct kmem_cache_cpu *c = __this_cpu_ptr(s->cpu_slab);
+
+	if (c->nr_partial >= s->cpu_partial)
+		unfreeze_partials(s, c);
+	list_add(&page->lru, &c->partial);
+	c->nr_partial++;
+}
+
+/* Pop a slab of @node off the partial list of this cpu and lock it */
+static struct page *get_cpu_partial(struct kmem_cache *s,
+				    struct kmem_cache_cpu *c, int node)
+{
+	struct page *page;
+
+	list_for_each_entry(page, &c->partial, lru) {
+		if (node != NUMA_NO_NODE && page_to_nid(page) != node)
+			continue;
+		list_del(&page->lru);
+		c->nr_partial--;
+		slab_lock(page);
+		stat(s, CPU_PARTIAL_ALLOC);
+		return page;
+	}
+	return NULL;
+}
+
 /*
  * Remove the cpu slab
  */
@@ -1537,8 +1613,11 @@ static inline void __flush_cpu_slab(struct kmem_cache *s, int cpu)
 {
 	struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu_slab, cpu);
 
-	if (likely(c && c->page))
+	if (unlikely(!c))
+		return;
+	if (c->page)
 		flush_slab(s, c);
+	unfreeze_partials(s, c);
 }
 
 static void flush_cpu_slab(void *d)
@@ -1685,6 +1764,12 @@ another_slab:
 	deactivate_slab(s, c);
 
 new_slab:
+	new = get_cpu_partial(s, c, node);
+	if (new) {
+		c->page = new;
+		goto load_freelist;
+	}
+
 	new = get_partial(s, gfpflags, node);
 	if (new) {
 		c->page = new;
@@ -1859,8 +1944,14 @@ checks_ok:
 	 * then add it.
 	 */
 	if (unlikely(!prior)) {
-		add_partial(get_node(s, page_to_nid(page)), page, 1);
-		stat(s, FREE_ADD_PARTIAL);
+		if (s->cpu_partial) {
+			__SetPageSlubFrozen(page);
+			put_cpu_partial(s, page);
+			stat(s, CPU_PARTIAL_FREE);
+		} else {
+			add_partial(get_node(s, page_to_nid(page)), page, 1);
+			stat(s, FREE_ADD_PARTIAL);
+		}
 	}
 
 out_unlock:
@@ -1933,6 +2024,89 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/*
+ * Free @nr objects of @s with interrupts disabled once for all of them:
+ * those of the current cpu slab go on its lockless freelist as in
+ * slab_free(), the others take the slow path.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		slab_free_hook(s, p[i]);
+
+	local_irq_save(flags);
+	c = __this_cpu_ptr(s->cpu_slab);
+	for (i = 0; i < nr; i++) {
+		void **object = p[i];
+		struct page *page = virt_to_head_page(object);
+
+		slab_free_hook_irq(s, object);
+
+		if (likely(page == c->page && c->node != NUMA_NO_NODE)) {
+			set_freepointer(s, object, c->freelist);
+			c->freelist = object;
+			stat(s, FREE_FASTPATH);
+		} else
+			__slab_free(s, page, object, _RET_IP_);
+	}
+	local_irq_restore(flags);
+
+	for (i = 0; i < nr; i++)
+		trace_kmem_cache_free(_RET_IP_, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/*
+ * Allocate up to @nr objects of @s into @p, popping the cpu freelist with
+ * interrupts disabled once for all of them. Returns how many were
+ * allocated, fewer than @nr only if the slow path ran out of memory.
+ */
+size_t kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t gfpflags,
+			     size_t nr, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i;
+
+	if (slab_pre_alloc_hook(s, gfpflags))
+		return 0;
+
+	local_irq_save(flags);
+	c = __this_cpu_ptr(s->cpu_slab);
+	for (i = 0; i < nr; i++) {
+		void **object = c->freelist;
+
+		if (unlikely(!object)) {
+			object = __slab_alloc(s, gfpflags, NUMA_NO_NODE,
+					      _RET_IP_, c);
+			if (unlikely(!object))
+				break;
+			/* it may have enabled interrupts and moved us */
+			c = __this_cpu_ptr(s->cpu_slab);
+		} else {
+			c->freelist = get_freepointer(s, object);
+			stat(s, ALLOC_FASTPATH);
+		}
+		p[i] = object;
+	}
+	local_irq_restore(flags);
+
+	nr = i;
+	for (i = 0; i < nr; i++) {
+		if (unlikely(gfpflags & __GFP_ZERO))
+			memset(p[i], 0, s->objsize);
+		slab_post_alloc_hook(s, gfpflags, p[i]);
+		trace_kmem_cache_alloc(_RET_IP_, p[i], s->objsize, s->size,
+				       gfpflags);
+	}
+	return nr;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /*
  * Object placement in a slab is made very easy because we always start at
  * offset 0. If we tune the size of the object to the alignment then we can
@@ -2107,12 +2281,18 @@ init_kmem_cache_node(struct kmem_cache_node *n, struct kmem_cache *s)
 
 static inline int alloc_kmem_cache_cpus(struct kmem_cache *s)
 {
+	int cpu;
+
 	BUILD_BUG_ON(PERCPU_DYNAMIC_EARLY_SIZE <
 			SLUB_PAGE_SHIFT * sizeof(struct kmem_cache_cpu));
 
 	s->cpu_slab = alloc_percpu(struct kmem_cache_cpu);
+	if (!s->cpu_slab)
+		return 0;
 
-	return s->cpu_slab != NULL;
+	for_each_possible_cpu(cpu)
+		INIT_LIST_HEAD(&per_cpu_ptr(s->cpu_slab, cpu)->partial);
+	return 1;
 }
 
 static struct kmem_cache *kmem_cache_node;
@@ -2370,6 +2550,21 @@ static int kmem_cache_open(struct kmem_cache *s,
 	 * list to avoid pounding the page allocator excessively.
 	 */
 	set_min_partial(s, ilog2(s->size));
+
+	/*
+	 * Fewer slabs of the larger objects on the cpu partial lists. The
+	 * debug checks want every slab on the node lists.
+	 */
+	if (kmem_cache_debug(s))
+		s->cpu_partial = 0;
+	else if (s->size >= PAGE_SIZE)
+		s->cpu_partial = 2;
+	else if (s->size >= 1024)
+		s->cpu_partial = 4;
+	else if (s->size >= 256)
+		s->cpu_partial = 8;
+	else
+		s->cpu_partial = 16;
 	s->refcount = 1;
 #ifdef CONFIG_NUMA
 	s->remote_node_defrag_ratio = 1000;
@@ -3944,6 +4139,29 @@ static ssize_t min_partial_store(struct kmem_cache *s, const char *buf,
 }
 SLAB_ATTR(min_partial);
 
+static ssize_t cpu_partial_show(struct kmem_cache *s, char *buf)
+{
+	return sprintf(buf, "%u\n", s->cpu_partial);
+}
+
+static ssize_t cpu_partial_store(struct kmem_cache *s, const char *buf,
+				 size_t length)
+{
+	unsigned long slabs;
+	int err;
+
+	err = strict_strtoul(buf, 10, &slabs);
+	if (err)
+		return err;
+	if (slabs && kmem_cache_debug(s))
+		return -EINVAL;
+
+	s->cpu_partial = min_t(unsigned long, slabs, MAX_CPU_PARTIAL);
+	flush_all(s);
+	return length;
+}
+SLAB_ATTR(cpu_partial);
+
 static ssize_t ctor_show(struct kmem_cache *s, char *buf)
 {
 	if (!s->ctor)
@@ -4284,6 +4502,10 @@ STAT_ATTR(DEACTIVATE_TO_HEAD, deactivate_to_head);
 STAT_ATTR(DEACTIVATE_TO_TAIL, deactivate_to_tail);
 STAT_ATTR(DEACTIVATE_REMOTE_FREES, deactivate_remote_frees);
 STAT_ATTR(ORDER_FALLBACK, order_fallback);
+STAT_ATTR(CPU_PARTIAL_ALLOC, cpu_partial_alloc);
+STAT_ATTR(CPU_PARTIAL_FREE, cpu_partial_free);
+STAT_ATTR(CPU_PARTIAL_NODE, cpu_partial_node);
+STAT_ATTR(CPU_PARTIAL_DRAIN, cpu_partial_drain);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -4292,6 +4514,7 @@ static struct attribute *slab_attrs[] = {
 	&objs_per_slab_attr.attr,
 	&order_attr.attr,
 	&min_partial_attr.attr,
+	&cpu_partial_attr.attr,
 	&objects_attr.attr,
 	&objects_partial_attr.attr,
 	&partial_attr.attr,
@@ -4340,6 +4563,10 @@ static struct attribute *slab_attrs[] = {
 	&deactivate_to_tail_attr.attr,
 	&deactivate_remote_frees_attr.attr,
 	&order_fallback_attr.attr,
+	&cpu_partial_alloc_attr.attr,
+	&cpu_partial_free_attr.attr,
+	&cpu_partial_node_attr.attr,
+	&cpu_partial_drain_attr.attr,
 #endif
 #ifdef CONFIG_FAILSLAB
 	&failslab_attr.attr,
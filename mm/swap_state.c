@@ -19,6 +19,7 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/ksm.h>
 
 #include <asm/pgtable.h>
 
@@ -276,14 +277,48 @@ struct page * lookup_swap_cache(swp_entry_t entry)
 	return page;
 }
 
-/* 
+/*
+ * The pages queued on a swap_plug stay locked until its bio is submitted,
+ * and whoever waits on them could be holding up our allocation: try not to
+ * sleep for one meanwhile, and submit the bio before we must.
+ */
+static struct page *swap_plug_alloc_page(gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			struct swap_plug *plug)
+{
+	struct page *page;
+
+	if (plug && plug->bio) {
+		page = alloc_page_vma((gfp_mask & ~__GFP_WAIT) | __GFP_NOWARN,
+				      vma, addr);
+		if (page)
+			return page;
+		swap_plug_flush(plug);
+	}
+	return alloc_page_vma(gfp_mask, vma, addr);
+}
+
+static int swap_plug_preload(gfp_t gfp_mask, struct swap_plug *plug)
+{
+	if (plug && plug->bio) {
+		if (!radix_tree_preload((gfp_mask & GFP_KERNEL & ~__GFP_WAIT) |
+					__GFP_NOWARN))
+			return 0;
+		swap_plug_flush(plug);
+	}
+	return radix_tree_preload(gfp_mask & GFP_KERNEL);
+}
+
+/*
  * Locate a page of swap in physical memory, reserving swap cache space
- * and reading the disk if it is not already cached.
+ * and reading the disk if it is not already cached; the read is queued
+ * on @plug if there is one.
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+static struct page *__read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			struct swap_plug *plug)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
@@ -302,7 +337,8 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		 * Get a new page to read into from swap.
 		 */
 		if (!new_page) {
-			new_page = alloc_page_vma(gfp_mask, vma, addr);
+			new_page = swap_plug_alloc_page(gfp_mask, vma, addr,
+							plug);
 			if (!new_page)
 				break;		/* Out of memory */
 		}
@@ -310,7 +346,7 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		/*
 		 * call radix_tree_preload() while we can wait.
 		 */
-		err = radix_tree_preload(gfp_mask & GFP_KERNEL);
+		err = swap_plug_preload(gfp_mask, plug);
 		if (err)
 			break;
 
@@ -320,6 +356,9 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/* or a free slot not given back yet, see get_swap_page */
+			if (swap_slot_pending(entry))
+				break;
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
@@ -337,7 +376,7 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			 * Initiate read into locked page and return.
 			 */
 			lru_cache_add_anon(new_page);
-			swap_readpage(new_page);
+			swap_readpage_plugged(new_page, plug);
 			return new_page;
 		}
 		radix_tree_preload_end();
@@ -355,6 +394,12 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	return __read_swap_cache_async(entry, gfp_mask, vma, addr, NULL);
+}
+
 /**
  * swapin_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
@@ -381,6 +426,7 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	struct page *page;
 	unsigned long offset;
 	unsigned long end_offset;
+	struct swap_plug plug = { .bio = NULL };
 
 	/*
 	 * Get starting offset for readaround, and number of pages to read.
@@ -391,13 +437,144 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	 */
 	nr_pages = valid_swaphandles(entry, &offset);
 	for (end_offset = offset + nr_pages; offset < end_offset; offset++) {
-		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
+		/* Ok, do the async read-ahead now, as one bio if we can */
+		page = __read_swap_cache_async(swp_entry(swp_type(entry), offset),
+						gfp_mask, vma, addr, &plug);
 		if (!page)
 			break;
 		page_cache_release(page);
 	}
+	swap_plug_flush(&plug);
 	lru_add_drain();	/* Push any new pages onto the LRU now */
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/*
+ * With vma_ra_enabled set, or for a KSM page whose stable node is parked
+ * over swap, readahead follows the ptes around the fault rather than the
+ * swap offset: the slots next to a page swapped out from several mms, or
+ * in the middle of a busy swap device, seldom belong to the same area.
+ */
+#define SWAP_RA_ORDER_CEILING	5
+
+static int swap_vma_ra_enabled __read_mostly;
+
+static struct page *swap_vma_readahead(swp_entry_t fentry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			pmd_t *pmd)
+{
+	pte_t ptes[1 << SWAP_RA_ORDER_CEILING], *pte;
+	unsigned long start, end, faddr = addr & PAGE_MASK;
+	int i, nr, win_bytes;
+	swp_entry_t entry;
+	struct page *page;
+	struct swap_plug plug = { .bio = NULL };
+
+	win_bytes = PAGE_SIZE << min(page_cluster, SWAP_RA_ORDER_CEILING);
+	if (win_bytes == PAGE_SIZE)
+		goto out;
+
+	/* an aligned window never crosses the pmd, which is smaller */
+	start = max(faddr & ~(unsigned long)(win_bytes - 1), vma->vm_start);
+	end = min((faddr | (win_bytes - 1)) + 1, vma->vm_end);
+	nr = (end - start) >> PAGE_SHIFT;
+
+	/* mmap_sem held for read: the pte table cannot go away */
+	pte = pte_offset_map(pmd, start);
+	for (i = 0; i < nr; i++)
+		ptes[i] = pte[i];
+	pte_unmap(pte);
+
+	for (i = 0; i < nr; i++, start += PAGE_SIZE) {
+		if (start == faddr || !is_swap_pte(ptes[i]))
+			continue;
+		entry = pte_to_swp_entry(ptes[i]);
+		if (unlikely(non_swap_entry(entry)))
+			continue;
+		page = __read_swap_cache_async(entry, gfp_mask, vma, start,
+					       &plug);
+		if (!page)
+			break;
+		page_cache_release(page);
+	}
+	swap_plug_flush(&plug);
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+out:
+	return read_swap_cache_async(fentry, gfp_mask, vma, addr);
+}
+
+/**
+ * swapin_vma_readahead - swap in pages in hope we need them soon
+ * @entry: swap entry that faulted at @addr
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma @addr belongs to
+ * @addr: faulting address
+ * @pmd: pmd of @addr in @vma->vm_mm
+ *
+ * Like swapin_readahead(), for the faults of a real vma: reads ahead the
+ * swap entries of the neighbouring ptes instead when that is wanted.
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+struct page *swapin_vma_readahead(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			pmd_t *pmd)
+{
+	if (swap_vma_ra_enabled || ksm_swap_parked(entry.val))
+		return swap_vma_readahead(entry, gfp_mask, vma, addr, pmd);
+	return swapin_readahead(entry, gfp_mask, vma, addr);
+}
+
+#ifdef CONFIG_SYSFS
+static ssize_t vma_ra_enabled_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", swap_vma_ra_enabled ? "true" : "false");
+}
+
+static ssize_t vma_ra_enabled_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	if (!strncmp(buf, "true", 4) || !strncmp(buf, "1", 1))
+		swap_vma_ra_enabled = 1;
+	else if (!strncmp(buf, "false", 5) || !strncmp(buf, "0", 1))
+		swap_vma_ra_enabled = 0;
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute vma_ra_enabled_attr =
+	__ATTR(vma_ra_enabled, 0644, vma_ra_enabled_show,
+	       vma_ra_enabled_store);
+
+static struct attribute *swap_attrs[] = {
+	&vma_ra_enabled_attr.attr,
+	NULL,
+};
+
+static struct attribute_group swap_attr_group = {
+	.attrs = swap_attrs,
+};
+
+static int __init swap_init_sysfs(void)
+{
+	struct kobject *swap_kobj;
+	int err;
+
+	swap_kobj = kobject_create_and_add("swap", mm_kobj);
+	if (!swap_kobj) {
+		printk(KERN_ERR "swap: failed kobject create\n");
+		return -ENOMEM;
+	}
+
+	err = sysfs_create_group(swap_kobj, &swap_attr_group);
+	if (err) {
+		printk(KERN_ERR "swap: failed register swap group\n");
+		kobject_put(swap_kobj);
+	}
+	return err;
+}
+subsys_initcall(swap_init_sysfs);
+#endif /* CONFIG_SYSFS */
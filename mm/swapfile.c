@@ -31,6 +31,8 @@
 #include <linux/syscalls.h>
 #include <linux/memcontrol.h>
 #include <linux/poll.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
 
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
@@ -441,17 +443,24 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to @n slots for the swap cache in @entries, all under one
+ * swap_lock. Returns the number allocated.
+ */
+static int get_swap_pages(int n, swp_entry_t entries[])
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int nr = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
-	nr_swap_pages--;
+	if (n > nr_swap_pages)
+		n = nr_swap_pages;
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -469,18 +478,81 @@ swp_entry_t get_swap_page(void)
 
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (nr < n) {
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			entries[nr++] = swp_entry(type, offset);
 		}
+		if (nr == n)
+			break;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
+	nr_swap_pages += n - nr;
 noswap:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return nr;
+}
+
+/*
+ * Each cpu allocates its swap slots from a cache refilled
+ * SWAP_SLOTS_CACHE_SIZE at a time, and gives back the slots it frees
+ * in batches of as many, to take swap_lock once per batch. A slot
+ * waiting in either stays marked SWAP_HAS_CACHE with no count, so that
+ * nobody else takes it meanwhile. Both are drained and bypassed while
+ * swapoff runs, and when a cpu goes away.
+ */
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* refilling can sleep */
+	int		nr;
+	int		cur;
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	spinlock_t	free_lock;
+	int		n_ret;
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+static bool swap_slot_cache_initialized __read_mostly;
+static bool swap_slot_cache_enabled;	/* under the locks of each cache */
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+
+/* Not worth caching when the cpus could sit on most of what is left */
+static inline bool swap_slots_worth_caching(void)
+{
+	return nr_swap_pages > num_online_cpus() * SWAP_SLOTS_CACHE_SIZE * 2;
+}
+
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry = { 0 };
+
+	if (swap_slot_cache_initialized) {
+		cache = &per_cpu(swp_slots, raw_smp_processor_id());
+
+		mutex_lock(&cache->alloc_lock);
+		if (swap_slot_cache_enabled) {
+			if (!cache->nr && swap_slots_worth_caching()) {
+				cache->cur = 0;
+				cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE,
+							   cache->slots);
+			}
+			if (cache->nr) {
+				entry = cache->slots[cache->cur++];
+				cache->nr--;
+			}
+		}
+		mutex_unlock(&cache->alloc_lock);
+		if (entry.val)
+			return entry;
+	}
+
+	get_swap_pages(1, &entry);
+	return entry;
 }
 
 /* The only caller of this function is now susupend routine */
@@ -575,28 +647,160 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 		mem_cgroup_uncharge_swap(entry);
 
 	usage = count | has_cache;
-	p->swap_map[offset] = usage;
-
-	/* free if no reference */
-	if (!usage) {
-		struct gendisk *disk = p->bdev->bd_disk;
-		if (offset < p->lowest_bit)
-			p->lowest_bit = offset;
-		if (offset > p->highest_bit)
-			p->highest_bit = offset;
-		if (swap_list.next >= 0 &&
-		    p->prio > swap_info[swap_list.next]->prio)
-			swap_list.next = p->type;
-		nr_swap_pages++;
-		p->inuse_pages--;
-		if ((p->flags & SWP_BLKDEV) &&
-				disk->fops->swap_slot_free_notify)
-			disk->fops->swap_slot_free_notify(p->bdev, offset);
-	}
+	/* with no reference left, the caller frees it by free_swap_slot() */
+	p->swap_map[offset] = usage ? usage : SWAP_HAS_CACHE;
 
 	return usage;
 }
 
+/* Give back the slot of @entry, which swap_entry_free() left unused */
+static void swap_entry_release(struct swap_info_struct *p, swp_entry_t entry)
+{
+	unsigned long offset = swp_offset(entry);
+	struct gendisk *disk = p->bdev->bd_disk;
+
+	VM_BUG_ON(p->swap_map[offset] != SWAP_HAS_CACHE);
+	p->swap_map[offset] = 0;
+
+	if (offset < p->lowest_bit)
+		p->lowest_bit = offset;
+	if (offset > p->highest_bit)
+		p->highest_bit = offset;
+	if (swap_list.next >= 0 &&
+	    p->prio > swap_info[swap_list.next]->prio)
+		swap_list.next = p->type;
+	nr_swap_pages++;
+	p->inuse_pages--;
+	if ((p->flags & SWP_BLKDEV) &&
+			disk->fops->swap_slot_free_notify)
+		disk->fops->swap_slot_free_notify(p->bdev, offset);
+	ksm_swap_freed(entry.val);
+}
+
+static void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	int i;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++)
+		swap_entry_release(swap_info[swp_type(entries[i])],
+				   entries[i]);
+	spin_unlock(&swap_lock);
+}
+
+static void free_swap_slot(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache;
+
+	if (swap_slot_cache_initialized) {
+		cache = &per_cpu(swp_slots, raw_smp_processor_id());
+
+		spin_lock(&cache->free_lock);
+		if (swap_slot_cache_enabled) {
+			if (cache->n_ret == SWAP_SLOTS_CACHE_SIZE) {
+				swapcache_free_entries(cache->slots_ret,
+						       cache->n_ret);
+				cache->n_ret = 0;
+			}
+			cache->slots_ret[cache->n_ret++] = entry;
+			spin_unlock(&cache->free_lock);
+			return;
+		}
+		spin_unlock(&cache->free_lock);
+	}
+
+	swapcache_free_entries(&entry, 1);
+}
+
+static void drain_slots_cache_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->alloc_lock);
+	if (cache->nr) {
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->nr = 0;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	spin_lock(&cache->free_lock);
+	if (cache->n_ret) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	spin_unlock(&cache->free_lock);
+}
+
+/*
+ * try_to_unuse() must not find slots that nobody is going to add to the
+ * swap cache: keep them out of the caches until reenabled.
+ */
+static void disable_swap_slots_cache(void)
+{
+	unsigned int cpu;
+
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slot_cache_enabled = false;
+	for_each_possible_cpu(cpu)
+		drain_slots_cache_cpu(cpu);
+}
+
+static void reenable_swap_slots_cache(void)
+{
+	swap_slot_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_slots_cache_cpu((long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_cache_init(void)
+{
+	struct swap_slots_cache *cache;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swp_slots, cpu);
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+
+	swap_slot_cache_enabled = true;
+	smp_wmb();
+	swap_slot_cache_initialized = true;
+	return 0;
+}
+module_init(swap_slots_cache_init);
+
+/*
+ * swap_slot_pending - whether @entry has no reference left, but waits in a
+ * slots cache to be allocated or freed: swapcache_prepare() keeps failing
+ * with -EEXIST on it, and read_swap_cache_async() should give it up.
+ */
+int swap_slot_pending(swp_entry_t entry)
+{
+	struct swap_info_struct *p;
+	unsigned long offset = swp_offset(entry);
+	int pending = 0;
+
+	if (!swap_slot_cache_enabled)
+		return 0;
+
+	spin_lock(&swap_lock);
+	p = swap_info[swp_type(entry)];
+	if (p && (p->flags & SWP_USED) && offset < p->max)
+		pending = p->swap_map[offset] == SWAP_HAS_CACHE;
+	spin_unlock(&swap_lock);
+
+	return pending;
+}
+
 /*
  * Caller has made sure that the swapdevice corresponding to entry
  * is still around or has not been recycled.
@@ -604,11 +808,14 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 void swap_free(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
+	unsigned char usage;
 
 	p = swap_info_get(entry);
 	if (p) {
-		swap_entry_free(p, entry, 1);
+		usage = swap_entry_free(p, entry, 1);
 		spin_unlock(&swap_lock);
+		if (!usage)
+			free_swap_slot(entry);
 	}
 }
 
@@ -626,6 +833,8 @@ void swapcache_free(swp_entry_t entry, struct page *page)
 		if (page)
 			mem_cgroup_uncharge_swapcache(page, entry, count != 0);
 		spin_unlock(&swap_lock);
+		if (!count)
+			free_swap_slot(entry);
 	}
 }
 
@@ -719,13 +928,15 @@ int free_swap_and_cache(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
 	struct page *page = NULL;
+	unsigned char usage;
 
 	if (non_swap_entry(entry))
 		return 1;
 
 	p = swap_info_get(entry);
 	if (p) {
-		if (swap_entry_free(p, entry, 1) == SWAP_HAS_CACHE) {
+		usage = swap_entry_free(p, entry, 1);
+		if (usage == SWAP_HAS_CACHE) {
 			page = find_get_page(&swapper_space, entry.val);
 			if (page && !trylock_page(page)) {
 				page_cache_release(page);
@@ -733,6 +944,8 @@ int free_swap_and_cache(swp_entry_t entry)
 			}
 		}
 		spin_unlock(&swap_lock);
+		if (!usage)
+			free_swap_slot(entry);
 	}
 	if (page) {
 		/*
@@ -1616,9 +1829,11 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	disable_swap_slots_cache();
 	current->flags |= PF_OOM_ORIGIN;
 	err = try_to_unuse(type);
 	current->flags &= ~PF_OOM_ORIGIN;
+	reenable_swap_slots_cache();
 
 	if (err) {
 		/* re-insert swap space back into swap_list */
@@ -508,6 +508,19 @@ static unsigned long lazy_max_pages(void)
 
 static atomic_t vmap_lazy_nr = ATOMIC_INIT(0);
 
+/*
+ * The lazily freed areas wait for the purge on the queue of the node they
+ * were freed from, rather than being looked for through vmap_area_list
+ * among all the live ones: the freers of different nodes don't share a
+ * lock nor a cacheline, and a purge only visits what it frees.
+ */
+struct vmap_purge_queue {
+	spinlock_t lock;
+	struct list_head list;
+} ____cacheline_aligned_in_smp;
+
+static struct vmap_purge_queue vmap_purge_queue[MAX_NUMNODES];
+
 /* for per-CPU blocks */
 static void purge_fragmented_blocks_allcpus(void);
 
@@ -535,9 +548,10 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 {
 	static DEFINE_SPINLOCK(purge_lock);
 	LIST_HEAD(valist);
+	struct vmap_purge_queue *q;
 	struct vmap_area *va;
 	struct vmap_area *n_va;
-	int nr = 0;
+	int node, nr = 0;
 
 	/*
 	 * If sync is 0 but force_flush is 1, we'll go sync anyway but callers
@@ -553,20 +567,24 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (sync)
 		purge_fragmented_blocks_allcpus();
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(va, &vmap_area_list, list) {
-		if (va->flags & VM_LAZY_FREE) {
-			if (va->va_start < *start)
-				*start = va->va_start;
-			if (va->va_end > *end)
-				*end = va->va_end;
-			nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
-			list_add_tail(&va->purge_list, &valist);
-			va->flags |= VM_LAZY_FREEING;
-			va->flags &= ~VM_LAZY_FREE;
-		}
+	for_each_node(node) {
+		q = &vmap_purge_queue[node];
+		if (list_empty(&q->list))
+			continue;
+		spin_lock(&q->lock);
+		list_splice_tail_init(&q->list, &valist);
+		spin_unlock(&q->lock);
+	}
+
+	list_for_each_entry(va, &valist, purge_list) {
+		if (va->va_start < *start)
+			*start = va->va_start;
+		if (va->va_end > *end)
+			*end = va->va_end;
+		nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+		va->flags |= VM_LAZY_FREEING;
+		va->flags &= ~VM_LAZY_FREE;
 	}
-	rcu_read_unlock();
 
 	if (nr)
 		atomic_sub(nr, &vmap_lazy_nr);
@@ -611,7 +629,12 @@ static void purge_vmap_area_lazy(void)
  */
 static void free_vmap_area_noflush(struct vmap_area *va)
 {
+	struct vmap_purge_queue *q = &vmap_purge_queue[numa_node_id()];
+
 	va->flags |= VM_LAZY_FREE;
+	spin_lock(&q->lock);
+	list_add_tail(&va->purge_list, &q->list);
+	spin_unlock(&q->lock);
 	atomic_add((va->va_end - va->va_start) >> PAGE_SHIFT, &vmap_lazy_nr);
 	if (unlikely(atomic_read(&vmap_lazy_nr) > lazy_max_pages()))
 		try_purge_vmap_area_lazy();
@@ -691,8 +714,21 @@ static bool vmap_initialized __read_mostly = false;
 struct vmap_block_queue {
 	spinlock_t lock;
 	struct list_head free;
+	int cpu;
 };
 
+/*
+ * The cpus which may have blocks with no allocation left in their queue,
+ * for purge_fragmented_blocks_allcpus() to visit only those.
+ */
+static struct cpumask vmap_block_purgeable;
+
+static inline void vmap_block_note_purgeable(struct vmap_block_queue *vbq)
+{
+	if (!cpumask_test_cpu(vbq->cpu, &vmap_block_purgeable))
+		cpumask_set_cpu(vbq->cpu, &vmap_block_purgeable);
+}
+
 struct vmap_block {
 	spinlock_t lock;
 	struct vmap_area *va;
@@ -780,6 +816,7 @@ static struct vmap_block *new_vmap_block(gfp_t gfp_mask)
 	spin_lock(&vbq->lock);
 	list_add_rcu(&vb->free_list, &vbq->free);
 	spin_unlock(&vbq->lock);
+	vmap_block_note_purgeable(vb->vbq);
 	put_cpu_var(vmap_block_queue);
 
 	return vb;
@@ -851,8 +888,10 @@ static void purge_fragmented_blocks_allcpus(void)
 {
 	int cpu;
 
-	for_each_possible_cpu(cpu)
+	for_each_cpu(cpu, &vmap_block_purgeable) {
+		cpumask_clear_cpu(cpu, &vmap_block_purgeable);
 		purge_fragmented_blocks(cpu);
+	}
 }
 
 static void *vb_alloc(unsigned long size, gfp_t gfp_mask)
@@ -951,8 +990,11 @@ static void vb_free(const void *addr, unsigned long size)
 		BUG_ON(vb->free);
 		spin_unlock(&vb->lock);
 		free_vmap_block(vb);
-	} else
+	} else {
+		if (vb->free + vb->dirty == VMAP_BBMAP_BITS)
+			vmap_block_note_purgeable(vb->vbq);
 		spin_unlock(&vb->lock);
+	}
 }
 
 /**
@@ -1116,6 +1158,12 @@ void __init vmalloc_init(void)
 		vbq = &per_cpu(vmap_block_queue, i);
 		spin_lock_init(&vbq->lock);
 		INIT_LIST_HEAD(&vbq->free);
+		vbq->cpu = i;
+	}
+
+	for (i = 0; i < MAX_NUMNODES; i++) {
+		spin_lock_init(&vmap_purge_queue[i].lock);
+		INIT_LIST_HEAD(&vmap_purge_queue[i].list);
 	}
 
 	/* Import existing vmlist entries. */
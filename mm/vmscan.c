@@ -16,6 +16,7 @@
 #include <linux/gfp.h>
 #include <linux/kernel_stat.h>
 #include <linux/swap.h>
+#include <linux/ksm.h>
 #include <linux/pagemap.h>
 #include <linux/init.h>
 #include <linux/highmem.h>
@@ -381,7 +382,7 @@ typedef enum {
  * Calls ->writepage().
  */
 static pageout_t pageout(struct page *page, struct address_space *mapping,
-			 struct scan_control *sc)
+			 struct scan_control *sc, struct swap_plug *plug)
 {
 	/*
 	 * If the page is dirty, only perform writeback if that write
@@ -430,6 +431,18 @@ static pageout_t pageout(struct page *page, struct address_space *mapping,
 			.for_reclaim = 1,
 		};
 
+		/*
+		 * The swap-backed pages of a list often got consecutive slots:
+		 * let swap_writepage() gather them into one bio, unless each
+		 * write is waited for below. Any other ->writepage may block,
+		 * so the pending bio is sent down before it.
+		 */
+		if (PageSwapBacked(page) &&
+		    !(sc->reclaim_mode & RECLAIM_MODE_SYNC))
+			wbc.swap_plug = plug;
+		else
+			swap_plug_flush(plug);
+
 		SetPageReclaim(page);
 		res = mapping->a_ops->writepage(page, &wbc);
 		if (res < 0)
@@ -506,6 +519,8 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 
 	if (PageSwapCache(page)) {
 		swp_entry_t swap = { .val = page_private(page) };
+		if (PageKsm(page))
+			ksm_swap_park(page, swap.val);
 		__delete_from_swap_cache(page);
 		spin_unlock_irq(&mapping->tree_lock);
 		swapcache_free(swap, page);
@@ -711,8 +726,13 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 	unsigned long nr_dirty = 0;
 	unsigned long nr_congested = 0;
 	unsigned long nr_reclaimed = 0;
+	struct tlbflush_unmap_batch tlb_ubc = { .nr = 0 };
+	struct swap_plug swap_plug = { .bio = NULL };
+	/* of a page migration batch this direct reclaim interrupted */
+	struct tlbflush_unmap_batch *saved_ubc = current->tlb_ubc;
 
 	cond_resched();
+	current->tlb_ubc = &tlb_ubc;
 
 	while (!list_empty(page_list)) {
 		enum page_references references;
@@ -780,10 +800,39 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		 * Try to allocate it some swap space here.
 		 */
 		if (PageAnon(page) && !PageSwapCache(page)) {
+			/*
+			 * Still clean since MADV_FREE cleaned it: discard it
+			 * without writing it anywhere, unless a pte has been
+			 * dirtied meanwhile - then it goes to swap as ever.
+			 */
+			if (!PageDirty(page) && !PageKsm(page) &&
+			    page_mapped(page)) {
+				switch (try_to_unmap(page, TTU_UNMAP | TTU_FREE)) {
+				case SWAP_MLOCK:
+					goto cull_mlocked;
+				case SWAP_SUCCESS:
+					unlock_page(page);
+					if (put_page_testzero(page))
+						goto free_it;
+					nr_reclaimed++;
+					continue;
+				default:
+					break;
+				}
+			}
 			if (!(sc->gfp_mask & __GFP_IO))
 				goto keep_locked;
+			if (ksm_swap_dedup_page(page)) {
+				/* unmapped, sharing the swap of its twin */
+				unlock_page(page);
+				if (put_page_testzero(page))
+					goto free_it;
+				nr_reclaimed++;
+				continue;
+			}
 			if (!add_to_swap(page))
 				goto activate_locked;
+			ksm_swap_dedup_note(page);
 			may_enter_fs = 1;
 		}
 
@@ -794,7 +843,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		 * processes. Try to unmap it here.
 		 */
 		if (page_mapped(page) && mapping) {
-			switch (try_to_unmap(page, TTU_UNMAP)) {
+			switch (try_to_unmap(page, TTU_UNMAP | TTU_BATCH_FLUSH)) {
 			case SWAP_FAIL:
 				goto activate_locked;
 			case SWAP_AGAIN:
@@ -817,7 +866,8 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 				goto keep_locked;
 
 			/* Page is dirty, try to write it out here */
-			switch (pageout(page, mapping, sc)) {
+			try_to_unmap_flush_dirty();
+			switch (pageout(page, mapping, sc, &swap_plug)) {
 			case PAGE_KEEP:
 				nr_congested++;
 				goto keep_locked;
@@ -939,6 +989,11 @@ keep_lumpy:
 	if (nr_dirty == nr_congested && nr_dirty != 0)
 		zone_set_flag(zone, ZONE_CONGESTED);
 
+	swap_plug_flush(&swap_plug);
+
+	/* no stale TLB entry may outlive the pages it maps */
+	try_to_unmap_flush();
+	current->tlb_ubc = saved_ubc;
 	free_page_list(&free_pages);
 
 	list_splice(&ret_pages, page_list);
@@ -1504,7 +1559,9 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 {
 	unsigned long nr_taken;
 	unsigned long pgscanned;
-	unsigned long vm_flags;
+	struct page *pages[PAGE_REFERENCED_BATCH];
+	int referenced[PAGE_REFERENCED_BATCH];
+	unsigned long vm_flags[PAGE_REFERENCED_BATCH];
 	LIST_HEAD(l_hold);	/* The pages which were snipped off */
 	LIST_HEAD(l_active);
 	LIST_HEAD(l_inactive);
@@ -1542,34 +1599,51 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	spin_unlock_irq(&zone->lru_lock);
 
 	while (!list_empty(&l_hold)) {
-		cond_resched();
-		page = lru_to_page(&l_hold);
-		list_del(&page->lru);
+		int i, nr = 0;
 
-		if (unlikely(!page_evictable(page, NULL))) {
-			putback_lru_page(page);
-			continue;
-		}
+		cond_resched();
+		/*
+		 * Test the references of a batch at a time, so that pages of
+		 * the same anon_vma or mapping share one rmap walk.
+		 */
+		while (nr < PAGE_REFERENCED_BATCH && !list_empty(&l_hold)) {
+			page = lru_to_page(&l_hold);
+			list_del(&page->lru);
 
-		if (page_referenced(page, 0, sc->mem_cgroup, &vm_flags)) {
-			nr_rotated += hpage_nr_pages(page);
-			/*
-			 * Identify referenced, file-backed active pages and
-			 * give them one more trip around the active list. So
-			 * that executable code get better chances to stay in
-			 * memory under moderate memory pressure.  Anon pages
-			 * are not likely to be evicted by use-once streaming
-			 * IO, plus JVM can create lots of anon VM_EXEC pages,
-			 * so we ignore them here.
-			 */
-			if ((vm_flags & VM_EXEC) && page_is_file_cache(page)) {
-				list_add(&page->lru, &l_active);
+			if (unlikely(!page_evictable(page, NULL))) {
+				putback_lru_page(page);
 				continue;
 			}
+			pages[nr++] = page;
 		}
+		page_referenced_batch(pages, nr, sc->mem_cgroup, referenced,
+				      vm_flags);
+
+		for (i = 0; i < nr; i++) {
+			page = pages[i];
+
+			if (referenced[i]) {
+				nr_rotated += hpage_nr_pages(page);
+				/*
+				 * Identify referenced, file-backed active
+				 * pages and give them one more trip around
+				 * the active list. So that executable code get
+				 * better chances to stay in memory under
+				 * moderate memory pressure.  Anon pages are
+				 * not likely to be evicted by use-once
+				 * streaming IO, plus JVM can create lots of
+				 * anon VM_EXEC pages, so we ignore them here.
+				 */
+				if ((vm_flags[i] & VM_EXEC) &&
+				    page_is_file_cache(page)) {
+					list_add(&page->lru, &l_active);
+					continue;
+				}
+			}
 
-		ClearPageActive(page);	/* we are de-activating */
-		list_add(&page->lru, &l_inactive);
+			ClearPageActive(page);	/* we are de-activating */
+			list_add(&page->lru, &l_inactive);
+		}
 	}
 
 	/*
@@ -1896,7 +1970,9 @@ static void shrink_zone(int priority, struct zone *zone,
 	enum lru_list l;
 	unsigned long nr_reclaimed, nr_scanned;
 	unsigned long nr_to_reclaim = sc->nr_to_reclaim;
+	struct blk_plug plug;
 
+	blk_start_plug(&plug);
 restart:
 	nr_reclaimed = 0;
 	nr_scanned = sc->nr_scanned;
@@ -1938,6 +2014,7 @@ restart:
 	if (should_continue_reclaim(zone, nr_reclaimed,
 					sc->nr_scanned - nr_scanned, sc))
 		goto restart;
+	blk_finish_plug(&plug);
 
 	throttle_vm_writeout(sc->gfp_mask);
 }
@@ -2381,6 +2458,19 @@ loop_again:
 		if (i < 0)
 			goto out;
 
+		/* have the workers of the node reclaim alongside */
+		pgdat->kswapd_order = order;
+		pgdat->kswapd_end_zone = end_zone;
+		if (pgdat->kswapd_priority != priority) {
+			pgdat->kswapd_priority = priority;
+			if (waitqueue_active(&pgdat->kswapd_worker_wait))
+				wake_up_interruptible(&pgdat->kswapd_worker_wait);
+		}
+
+		/* merging before swapping: let ksmd speed up for a while */
+		if (priority == DEF_PRIORITY)
+			ksm_memory_pressure();
+
 		for (i = 0; i <= end_zone; i++) {
 			struct zone *zone = pgdat->node_zones + i;
 
@@ -2573,6 +2663,7 @@ out:
 	 * was awake, order will remain at the higher level
 	 */
 	*classzone_idx = end_zone;
+	pgdat->kswapd_priority = -1;
 	return order;
 }
 
@@ -2708,6 +2799,137 @@ static int kswapd(void *p)
 	return 0;
 }
 
+/*
+ * Number of reclaim threads per node: kswapd itself and kswapd_threads - 1
+ * workers, which reclaim from the zones kswapd is balancing while it is.
+ */
+int kswapd_threads = 1;
+static DEFINE_MUTEX(kswapd_threads_lock);
+
+/*
+ * One pass of a worker over the zones the running balance_pgdat() still has
+ * to balance, at its priority. Concurrent workers share a zone's LRU lists
+ * through the SWAP_CLUSTER_MAX batches shrink_zone() isolates from them.
+ * Returns 0 if no zone needed reclaim.
+ */
+static int kswapd_worker_shrink(pg_data_t *pgdat)
+{
+	int priority = ACCESS_ONCE(pgdat->kswapd_priority);
+	int order = ACCESS_ONCE(pgdat->kswapd_order);
+	int end_zone = ACCESS_ONCE(pgdat->kswapd_end_zone);
+	struct scan_control sc = {
+		.gfp_mask = GFP_KERNEL,
+		.may_writepage = !laptop_mode,
+		.may_unmap = 1,
+		.may_swap = 1,
+		.nr_to_reclaim = ULONG_MAX,
+		.swappiness = vm_swappiness,
+		.order = order,
+		.mem_cgroup = NULL,
+	};
+	int i, shrunk = 0;
+
+	if (priority < 0)
+		return 0;
+
+	for (i = 0; i <= end_zone && i < pgdat->nr_zones; i++) {
+		struct zone *zone = pgdat->node_zones + i;
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (zone->all_unreclaimable && priority != DEF_PRIORITY)
+			continue;
+
+		if (zone_watermark_ok_safe(zone, order,
+				high_wmark_pages(zone), end_zone, 0))
+			continue;
+
+		sc.nr_scanned = 0;
+		shrink_zone(priority, zone, &sc);
+		shrunk = 1;
+		cond_resched();
+	}
+
+	return shrunk;
+}
+
+static int kswapd_worker(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	struct reclaim_state reclaim_state = {
+		.reclaimed_slab = 0,
+	};
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+
+	lockdep_set_current_reclaim_state(GFP_KERNEL);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+	current->reclaim_state = &reclaim_state;
+
+	/* see kswapd() */
+	tsk->flags |= PF_MEMALLOC | PF_SWAPWRITE | PF_KSWAPD;
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(pgdat->kswapd_worker_wait,
+				     pgdat->kswapd_priority >= 0 ||
+				     kthread_should_stop());
+		if (try_to_freeze() || kthread_should_stop())
+			continue;
+
+		/* kswapd still balancing what we found balanced: nap */
+		if (!kswapd_worker_shrink(pgdat))
+			schedule_timeout_interruptible(HZ/10);
+	}
+	return 0;
+}
+
+/* Start or stop the workers of a node to match kswapd_threads */
+static void kswapd_update_workers(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int i;
+
+	for (i = 0; i < MAX_KSWAPD_THREADS - 1; i++) {
+		struct task_struct *worker = pgdat->kswapd_workers[i];
+
+		if (pgdat->kswapd && i < kswapd_threads - 1) {
+			if (worker)
+				continue;
+			worker = kthread_run(kswapd_worker, pgdat,
+					     "kswapd%d:%d", nid, i + 1);
+			if (IS_ERR(worker)) {
+				printk(KERN_ERR "Failed to start kswapd worker "
+				       "%d on node %d\n", i + 1, nid);
+				break;
+			}
+			pgdat->kswapd_workers[i] = worker;
+		} else if (worker) {
+			kthread_stop(worker);
+			pgdat->kswapd_workers[i] = NULL;
+		}
+	}
+}
+
+int kswapd_threads_sysctl_handler(struct ctl_table *table, int write,
+				  void __user *buffer, size_t *length,
+				  loff_t *ppos)
+{
+	int nid, ret;
+
+	mutex_lock(&kswapd_threads_lock);
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write)
+		for_each_node_state(nid, N_HIGH_MEMORY)
+			kswapd_update_workers(nid);
+	mutex_unlock(&kswapd_threads_lock);
+
+	return ret;
+}
+
 /*
  * A zone is low on free memory, so wake its kswapd task to service it.
  */
@@ -2826,9 +3048,20 @@ static int __devinit cpu_callback(struct notifier_block *nfb,
 
 			mask = cpumask_of_node(pgdat->node_id);
 
-			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids) {
+				int i;
+
 				/* One of our CPUs online: restore mask */
 				set_cpus_allowed_ptr(pgdat->kswapd, mask);
+
+				mutex_lock(&kswapd_threads_lock);
+				for (i = 0; i < MAX_KSWAPD_THREADS - 1; i++)
+					if (pgdat->kswapd_workers[i])
+						set_cpus_allowed_ptr(
+						    pgdat->kswapd_workers[i],
+						    mask);
+				mutex_unlock(&kswapd_threads_lock);
+			}
 		}
 	}
 	return NOTIFY_OK;
@@ -2851,8 +3084,13 @@ int kswapd_run(int nid)
 		/* failure at boot is fatal */
 		BUG_ON(system_state == SYSTEM_BOOTING);
 		printk("Failed to start kswapd on node %d\n",nid);
+		pgdat->kswapd = NULL;
 		ret = -1;
 	}
+
+	mutex_lock(&kswapd_threads_lock);
+	kswapd_update_workers(nid);
+	mutex_unlock(&kswapd_threads_lock);
 	return ret;
 }
 
@@ -2861,10 +3099,17 @@ int kswapd_run(int nid)
  */
 void kswapd_stop(int nid)
 {
-	struct task_struct *kswapd = NODE_DATA(nid)->kswapd;
-
-	if (kswapd)
+	pg_data_t *pgdat = NODE_DATA(nid);
+	struct task_struct *kswapd = pgdat->kswapd;
+
+	if (kswapd) {
+		/* with pgdat->kswapd cleared, its workers are stopped too */
+		mutex_lock(&kswapd_threads_lock);
+		pgdat->kswapd = NULL;
+		kswapd_update_workers(nid);
+		mutex_unlock(&kswapd_threads_lock);
 		kthread_stop(kswapd);
+	}
 }
 
 static int __init kswapd_init(void)
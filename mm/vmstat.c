@@ -881,6 +881,10 @@ static const char * const vmstat_text[] = {
 	"numa_other",
 #endif
 	"nr_anon_transparent_hugepages",
+#ifdef CONFIG_KSM
+	"nr_ksm_pages_sharing",
+	"nr_ksm_pages_shared",
+#endif
 	"nr_dirty_threshold",
 	"nr_dirty_background_threshold",
 
@@ -0,0 +1,269 @@
+/*
+ * linux/mm/zero_pool.c
+ *
+ * Pools of pre-zeroed pages, one per node, that anonymous first-touch faults
+ * take from instead of clearing a page on the faulting cpu. A SCHED_IDLE
+ * kzerod thread per node refills its pool with cpu time nobody else wants.
+ * The pools are off until vm.zero_pool_pages is set.
+ */
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <linux/sysctl.h>
+#include <linux/module.h>
+#include <linux/nodemask.h>
+#include <linux/mutex.h>
+
+struct zero_pool {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned long nr;
+	wait_queue_head_t wait;
+	struct task_struct *kzerod;
+} ____cacheline_aligned_in_smp;
+
+static struct zero_pool zero_pools[MAX_NUMNODES];
+
+/* Pages kept zeroed in each node's pool, 0 disables the pools */
+int sysctl_zero_pool_pages;
+static DEFINE_MUTEX(zero_pool_mutex);
+
+/* Pages kzerod allocates and clears at a time */
+#define ZERO_POOL_BATCH		16
+
+#define ZERO_POOL_GFP	((GFP_HIGHUSER_MOVABLE | __GFP_THISNODE | \
+			  __GFP_NOWARN | __GFP_NO_KSWAPD) & ~__GFP_WAIT)
+
+/* kzerod is woken once its pool is down to three quarters */
+static inline unsigned long zero_pool_low(void)
+{
+	return sysctl_zero_pool_pages - sysctl_zero_pool_pages / 4;
+}
+
+/**
+ * zero_pool_get - a pre-zeroed page for an anonymous fault at @address
+ * @vma: the vma faulted on
+ * @address: the faulting address
+ *
+ * Returns NULL if the pools are off, the local one is empty, or the memory
+ * policy may want the page from a node other than the local one.
+ */
+struct page *zero_pool_get(struct vm_area_struct *vma, unsigned long address)
+{
+	struct zero_pool *pool;
+	struct page *page = NULL;
+
+	if (!sysctl_zero_pool_pages)
+		return NULL;
+#ifdef CONFIG_NUMA
+	if (vma->vm_policy || current->mempolicy)
+		return NULL;
+#endif
+
+	pool = &zero_pools[numa_node_id()];
+	if (list_empty(&pool->pages))
+		goto wake;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->pages)) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_del(&page->lru);
+		pool->nr--;
+	}
+	spin_unlock(&pool->lock);
+
+wake:
+	if (pool->nr < zero_pool_low() && waitqueue_active(&pool->wait))
+		wake_up_interruptible(&pool->wait);
+
+	return page;
+}
+
+/* Free pool pages until at most @keep are left, returns how many went */
+static unsigned long zero_pool_trim(struct zero_pool *pool, unsigned long keep,
+				    unsigned long max)
+{
+	unsigned long freed = 0;
+	LIST_HEAD(list);
+	struct page *page, *next;
+
+	spin_lock(&pool->lock);
+	while (pool->nr > keep && freed < max) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move(&page->lru, &list);
+		pool->nr--;
+		freed++;
+	}
+	spin_unlock(&pool->lock);
+
+	list_for_each_entry_safe(page, next, &list, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+
+	return freed;
+}
+
+/* Is the node well enough off to spare pages for its pool? */
+static bool zero_pool_has_room(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int i;
+
+	for (i = 0; i < pgdat->nr_zones; i++) {
+		struct zone *zone = pgdat->node_zones + i;
+
+		if (!populated_zone(zone))
+			continue;
+		if (zone_watermark_ok(zone, 0, high_wmark_pages(zone) +
+				      2 * ZERO_POOL_BATCH, 0, 0))
+			return true;
+	}
+
+	return false;
+}
+
+static void zero_pool_refill(struct zero_pool *pool, int nid)
+{
+	struct page *pages[ZERO_POOL_BATCH];
+	unsigned long have, nr, i;
+
+	while ((have = ACCESS_ONCE(pool->nr)) < sysctl_zero_pool_pages) {
+		if (kthread_should_stop() || freezing(current))
+			return;
+
+		nr = 0;
+		if (zero_pool_has_room(nid)) {
+			nr = min_t(unsigned long, sysctl_zero_pool_pages - have,
+				   ZERO_POOL_BATCH);
+			nr = alloc_pages_bulk_node(nid, ZERO_POOL_GFP, nr,
+						   pages);
+		}
+		if (!nr) {
+			/* try again once memory is less tight */
+			schedule_timeout_interruptible(HZ);
+			return;
+		}
+
+		for (i = 0; i < nr; i++) {
+			clear_highpage(pages[i]);
+			cond_resched();
+		}
+
+		spin_lock(&pool->lock);
+		for (i = 0; i < nr; i++)
+			list_add(&pages[i]->lru, &pool->pages);
+		pool->nr += nr;
+		spin_unlock(&pool->lock);
+	}
+}
+
+static inline int zero_pool_wants_pages(struct zero_pool *pool)
+{
+	return ACCESS_ONCE(pool->nr) < sysctl_zero_pool_pages;
+}
+
+static int kzerod(void *p)
+{
+	struct zero_pool *pool = p;
+	int nid = pool - zero_pools;
+	struct sched_param param = { .sched_priority = 0 };
+	const struct cpumask *cpumask = cpumask_of_node(nid);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+	sched_setscheduler(current, SCHED_IDLE, &param);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(pool->wait, zero_pool_wants_pages(pool) ||
+				     kthread_should_stop());
+		zero_pool_refill(pool, nid);
+	}
+
+	return 0;
+}
+
+/* Start or stop the kzerod threads and trim the pools to the new size */
+static void zero_pool_update(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		struct zero_pool *pool = &zero_pools[nid];
+
+		if (sysctl_zero_pool_pages && !pool->kzerod) {
+			pool->kzerod = kthread_run(kzerod, pool, "kzerod%d",
+						   nid);
+			if (IS_ERR(pool->kzerod)) {
+				printk(KERN_ERR "Failed to start kzerod on "
+				       "node %d\n", nid);
+				pool->kzerod = NULL;
+			}
+		} else if (!sysctl_zero_pool_pages && pool->kzerod) {
+			kthread_stop(pool->kzerod);
+			pool->kzerod = NULL;
+		}
+
+		zero_pool_trim(pool, sysctl_zero_pool_pages, ULONG_MAX);
+		if (pool->kzerod)
+			wake_up_interruptible(&pool->wait);
+	}
+}
+
+int zero_pool_sysctl_handler(struct ctl_table *table, int write,
+			     void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int ret;
+
+	mutex_lock(&zero_pool_mutex);
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (!ret && write)
+		zero_pool_update();
+	mutex_unlock(&zero_pool_mutex);
+
+	return ret;
+}
+
+/* Under memory pressure the pools give their pages back */
+static int shrink_zero_pools(struct shrinker *shrink, int nr_to_scan,
+			     gfp_t gfp_mask)
+{
+	unsigned long nr = 0;
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		struct zero_pool *pool = &zero_pools[nid];
+
+		if (nr_to_scan > 0)
+			nr_to_scan -= zero_pool_trim(pool, 0, nr_to_scan);
+		nr += pool->nr;
+	}
+
+	return nr;
+}
+
+static struct shrinker zero_pool_shrinker = {
+	.shrink = shrink_zero_pools,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int __init zero_pool_init(void)
+{
+	int nid;
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		struct zero_pool *pool = &zero_pools[nid];
+
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->pages);
+		init_waitqueue_head(&pool->wait);
+	}
+	register_shrinker(&zero_pool_shrinker);
+
+	return 0;
+}
+module_init(zero_pool_init)
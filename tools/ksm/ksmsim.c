@@ -0,0 +1,957 @@
+/*
+ * ksmsim: replay UKSM scan policies over a sampled page hash trace
+ *
+ * Compile by:
+ *
+ * gcc -O2 -o ksmsim ksmsim.c
+ *
+ * Capture a trace with:
+ *
+ * echo 64 > /sys/kernel/debug/ksm/hash_trace_rate
+ * cat /sys/kernel/debug/ksm/hash_trace > trace	# for as long as wanted
+ *
+ * A page is in the trace whenever ksmd hashes it and the full strength hash
+ * of its content is a multiple of the rate, so the pages of a content are
+ * all there or none of them, and a COW of a merged page when the hash of its
+ * index is. ksmsim then runs the ladder of mm/ksm.c, cal_dedup_ratio() and
+ * rshash_adjust() over them with other parameters, round by round.
+ *
+ * It can only leave out pages the kernel scanned, not scan more: a slot on
+ * a rung scanning more than the one it was captured on sees what was
+ * captured. The hash strength is rounded up to the next one recorded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+/* from mm/ksm.c, keep both in sync */
+#define KSM_TRACE_LEVELS	8
+
+enum {
+	KSM_TRACE_PAGE,
+	KSM_TRACE_COW,
+};
+
+struct ksm_trace_rec {
+	u64 round;
+	u64 slot;
+	u32 type;
+	u32 index;
+	u32 slot_pages;
+	u32 rung;
+	u32 scan_ratio;
+	u32 hash_strength;
+	u32 hash[KSM_TRACE_LEVELS];
+};
+
+#define KSM_DEDUP_RATIO_SCALE	100
+#define KSM_SCAN_RATIO_MAX	125
+#define KSM_SCAN_LADDER_MAX	16
+#define HASH_STRENGTH_DELTA_MAX	5
+
+static unsigned long page_size = 4096;
+#define HASH_STRENGTH_FULL	(page_size / sizeof(u32))
+#define HASH_STRENGTH_MAX	(HASH_STRENGTH_FULL + 10)
+
+/* the parameters replayed */
+static unsigned int ksm_min_scan_ratio = 1;
+static unsigned int ksm_scan_ratio_delta = 5;
+static unsigned int ksm_thrash_threshold;
+static unsigned long memcmp_cost = 100;
+static unsigned long hash_strength;
+static unsigned long trace_rate = 1;
+static int baseline;
+static int verbose;
+
+static unsigned int ksm_scan_ladder_size;
+static unsigned int scan_ratio[KSM_SCAN_LADDER_MAX];
+
+static void fatal(const char *x)
+{
+	fprintf(stderr, "ksmsim: %s\n", x);
+	exit(EXIT_FAILURE);
+}
+
+/* room for one more of the @nr elements of @size at @p, of room for @room */
+static void *grow(void *p, unsigned long nr, unsigned long *room, size_t size)
+{
+	if (nr < *room)
+		return p;
+
+	*room = *room ? *room * 2 : 256;
+	p = realloc(p, *room * size);
+	if (!p)
+		fatal("out of memory");
+	return p;
+}
+
+/*
+ * A u64 -> u64 open addressing hash, doubled when half full.
+ */
+struct map_entry {
+	u64 key;
+	u64 val;
+	int used;
+};
+
+struct map {
+	struct map_entry *e;
+	size_t size, nr;
+};
+
+static u64 mix64(u64 x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static struct map_entry *map_slot(struct map *m, u64 key)
+{
+	size_t i = mix64(key) & (m->size - 1);
+
+	while (m->e[i].used && m->e[i].key != key)
+		i = (i + 1) & (m->size - 1);
+	return &m->e[i];
+}
+
+static void map_grow(struct map *m)
+{
+	struct map_entry *old = m->e;
+	size_t i, size = m->size;
+
+	m->size = size ? size * 2 : 1024;
+	m->e = calloc(m->size, sizeof(*m->e));
+	if (!m->e)
+		fatal("out of memory");
+	m->nr = 0;
+	for (i = 0; i < size; i++) {
+		if (old[i].used) {
+			*map_slot(m, old[i].key) = old[i];
+			m->nr++;
+		}
+	}
+	free(old);
+}
+
+static u64 *map_find(struct map *m, u64 key)
+{
+	struct map_entry *e;
+
+	if (!m->size)
+		return NULL;
+	e = map_slot(m, key);
+	return e->used ? &e->val : NULL;
+}
+
+/* the value of @key, inserted as 0 if not there */
+static u64 *map_get(struct map *m, u64 key)
+{
+	struct map_entry *e;
+
+	if (m->nr * 2 >= m->size)
+		map_grow(m);
+	e = map_slot(m, key);
+	if (!e->used) {
+		e->used = 1;
+		e->key = key;
+		e->val = 0;
+		m->nr++;
+	}
+	return &e->val;
+}
+
+static void map_clear(struct map *m)
+{
+	if (m->size)
+		memset(m->e, 0, m->size * sizeof(*m->e));
+	m->nr = 0;
+}
+
+/* the part of struct vma_slot the ladder looks at */
+struct slot {
+	u64 id;
+	unsigned long pages;
+	int rung;
+	unsigned long pages_scanned;
+	unsigned long last_scanned;
+	unsigned long pages_merged;
+	unsigned long pages_cowed;
+	unsigned long dedup_num;
+	unsigned long dedup_ratio;
+	int slot_scanned;
+};
+
+struct content {
+	u32 hash[KSM_TRACE_LEVELS];
+	unsigned long merged;	/* pages merged into it */
+	unsigned long owner;	/* the slot it was first merged in */
+};
+
+static struct slot *slots;
+static unsigned long nr_slots, slots_size;
+static struct map slot_map;		/* slot id -> index in slots */
+
+static struct content *contents;
+static unsigned long nr_contents, contents_size;
+static struct map content_map;		/* full hash -> index in contents */
+
+/* (slot, page index) -> 1 + content, with PAGE_MERGED if merged */
+#define PAGE_MERGED		(1ULL << 63)
+static struct map page_map;
+
+/* a page in the unstable tree, this round */
+struct unstable_page {
+	u64 page;
+	unsigned long slot;
+};
+
+static struct unstable_page *unstable_pages;
+static unsigned long nr_unstable, unstable_size;
+
+static struct map stable_keys;		/* key -> contents merged with it */
+static struct map unstable;		/* full hash -> 1 + unstable_page */
+static struct map unstable_keys;	/* key -> pages, this round */
+static struct map pairs;		/* slot1 << 32 | slot2 -> dup_num */
+
+static unsigned long long ksm_scan_round;
+static unsigned long ksm_pages_scanned, ksm_pages_scanned_last;
+static unsigned long nr_merged, nr_stable;
+static u64 rshash_pos, rshash_neg;
+static unsigned long hash_strength_changes;
+
+static unsigned long hash_strength_delta;
+static unsigned long rshash_neg_cont_zero;
+static unsigned long rshash_cont_obscure;
+
+enum rshash_states {
+	RSHASH_STILL,
+	RSHASH_TRYUP,
+	RSHASH_TRYDOWN,
+	RSHASH_NEW,
+	RSHASH_PRE_STILL,
+};
+
+enum rshash_direct {
+	GO_UP,
+	GO_DOWN,
+	OBSCURE,
+	STILL,
+};
+
+static struct {
+	enum rshash_states state;
+	enum rshash_direct pre_direct;
+	unsigned char below_count;
+	unsigned char lookup_window_index;
+	u64 stable_benefit;
+	unsigned long turn_point_down;
+	unsigned long turn_benefit_down;
+	unsigned long turn_point_up;
+	unsigned long turn_benefit_up;
+	unsigned long stable_point;
+} rshash_state = { .state = RSHASH_NEW };
+
+static void init_ladder(void)
+{
+	unsigned int sr = ksm_min_scan_ratio, i;
+
+	ksm_scan_ladder_size = 1;
+	while (sr < KSM_SCAN_RATIO_MAX) {
+		sr *= ksm_scan_ratio_delta;
+		ksm_scan_ladder_size++;
+	}
+	if (ksm_scan_ladder_size > KSM_SCAN_LADDER_MAX)
+		fatal("too many rungs, raise the scan ratio delta");
+
+	for (i = 0, sr = ksm_min_scan_ratio; i < ksm_scan_ladder_size;
+	     i++, sr *= ksm_scan_ratio_delta)
+		scan_ratio[i] = sr;
+}
+
+/* the recorded level hashing at least as many words as @strength */
+static int hash_level(unsigned long strength)
+{
+	int i;
+
+	for (i = KSM_TRACE_LEVELS - 1; i > 0; i--) {
+		if ((HASH_STRENGTH_FULL >> i) >= strength)
+			return i;
+	}
+	return 0;
+}
+
+static struct slot *slot_of(struct ksm_trace_rec *rec)
+{
+	u64 *idx = map_get(&slot_map, rec->slot);
+	struct slot *slot;
+
+	if (*idx)
+		return &slots[*idx - 1];
+
+	slots = grow(slots, nr_slots, &slots_size, sizeof(*slots));
+	slot = &slots[nr_slots++];
+	*idx = nr_slots;
+
+	memset(slot, 0, sizeof(*slot));
+	slot->id = rec->slot;
+	slot->pages = rec->slot_pages / trace_rate ? : 1;
+	/* where the kernel put it: its parent's rung, or advised */
+	slot->rung = rec->rung < ksm_scan_ladder_size ? rec->rung : 0;
+
+	return slot;
+}
+
+static struct content *content_of(struct ksm_trace_rec *rec,
+				  unsigned long *index)
+{
+	u64 *idx = map_get(&content_map, rec->hash[0]);
+
+	if (!*idx) {
+		contents = grow(contents, nr_contents, &contents_size,
+				sizeof(*contents));
+		memcpy(contents[nr_contents].hash, rec->hash,
+		       sizeof(rec->hash));
+		contents[nr_contents].merged = 0;
+		*idx = ++nr_contents;
+	}
+
+	*index = *idx - 1;
+	return &contents[*idx - 1];
+}
+
+static u64 stable_key(struct content *c)
+{
+	return c->hash[hash_level(hash_strength)];
+}
+
+static void content_unmerge(struct content *c)
+{
+	u64 *n;
+
+	if (--c->merged)
+		return;
+
+	nr_stable--;
+	n = map_find(&stable_keys, stable_key(c));
+	if (n && *n)
+		(*n)--;
+}
+
+static void content_merge(struct content *c, struct slot *slot)
+{
+	if (!c->merged++) {
+		nr_stable++;
+		c->owner = slot - slots;
+		(*map_get(&stable_keys, stable_key(c)))++;
+	}
+	nr_merged++;
+}
+
+static void pair_dup(struct slot *a, struct slot *b)
+{
+	unsigned long x = a - slots, y = b - slots;
+
+	if (x > y) {
+		unsigned long t = x;
+		x = y;
+		y = t;
+	}
+	(*map_get(&pairs, (u64)x << 32 | y))++;
+}
+
+static unsigned long slot_round_scanned(struct slot *slot)
+{
+	return slot->pages_scanned - slot->last_scanned;
+}
+
+/* a page of @rec that left its content, for being rewritten or COWed */
+static void page_leave(u64 *page)
+{
+	if (*page & PAGE_MERGED) {
+		content_unmerge(&contents[(*page & ~PAGE_MERGED) - 1]);
+		nr_merged--;
+	}
+	*page = 0;
+}
+
+/* 1 if the slot, on its rung, scans the page captured on another rung */
+static int page_kept(struct slot *slot, struct ksm_trace_rec *rec)
+{
+	u64 r;
+
+	if (baseline || !rec->scan_ratio ||
+	    scan_ratio[slot->rung] >= rec->scan_ratio)
+		return 1;
+
+	r = mix64(rec->slot ^ (u64)rec->index << 20 ^ rec->round << 44);
+	return r % rec->scan_ratio < scan_ratio[slot->rung];
+}
+
+/* as subtree_lookup_cost(): a level walked per bit of the sub-tree size */
+static unsigned long subtree_cost(u64 nodes)
+{
+	return nodes > 1 ? 64 - __builtin_clzll(nodes) : 0;
+}
+
+static void scan_page(struct ksm_trace_rec *rec)
+{
+	struct slot *slot = slot_of(rec), *other;
+	unsigned long strength, ci;
+	struct unstable_page *up;
+	struct content *c;
+	u64 *page, *n, *m, key, pk;
+
+	if (baseline)
+		slot->rung = rec->rung < ksm_scan_ladder_size ? rec->rung : 0;
+	if (!page_kept(slot, rec))
+		return;
+
+	strength = baseline ? rec->hash_strength : hash_strength;
+	key = rec->hash[hash_level(strength)];
+
+	ksm_pages_scanned++;
+	slot->pages_scanned++;
+	slot->slot_scanned = 1;
+	rshash_pos += HASH_STRENGTH_FULL > strength ?
+		      HASH_STRENGTH_FULL - strength : 0;
+
+	c = content_of(rec, &ci);
+	pk = rec->slot ^ (u64)rec->index << 48;
+	page = map_get(&page_map, pk);
+
+	/* still merged, it counts for the slots sharing it */
+	if (*page & PAGE_MERGED && (*page & ~PAGE_MERGED) == ci + 1) {
+		pair_dup(slot, &slots[c->owner]);
+		return;
+	}
+	page_leave(page);
+	*page = ci + 1;
+
+	/* the stable tree */
+	if (c->merged) {
+		content_merge(c, slot);
+		*page |= PAGE_MERGED;
+		slot->pages_merged++;
+		pair_dup(slot, &slots[c->owner]);
+		return;
+	}
+	n = map_find(&stable_keys, key);
+	if (n && *n)
+		rshash_neg += memcmp_cost + (HASH_STRENGTH_MAX - strength) +
+			      subtree_cost(*n);
+
+	/* the unstable tree */
+	n = map_get(&unstable, rec->hash[0]);
+	if (*n) {
+		up = &unstable_pages[*n - 1];
+		m = map_find(&page_map, up->page);
+		*n = 0;
+		/* the one in the tree was rewritten since */
+		if (!m || *m != ci + 1)
+			goto insert;
+
+		other = &slots[up->slot];
+		content_merge(c, other);
+		content_merge(c, slot);
+		*m |= PAGE_MERGED;
+		*page |= PAGE_MERGED;
+		other->pages_merged++;
+		slot->pages_merged++;
+		pair_dup(slot, other);
+		return;
+	}
+	n = map_find(&unstable_keys, key);
+	if (n && *n)
+		rshash_neg += memcmp_cost + strength + subtree_cost(*n);
+insert:
+	unstable_pages = grow(unstable_pages, nr_unstable, &unstable_size,
+			      sizeof(*unstable_pages));
+	up = &unstable_pages[nr_unstable++];
+	up->page = pk;
+	up->slot = slot - slots;
+	*n = nr_unstable;
+	(*map_get(&unstable_keys, key))++;
+}
+
+static void cow_page(struct ksm_trace_rec *rec)
+{
+	struct slot *slot = slot_of(rec);
+	u64 *page = map_find(&page_map, rec->slot ^ (u64)rec->index << 48);
+
+	slot->pages_cowed++;
+	if (page)
+		page_leave(page);
+}
+
+/* from here on as in mm/ksm.c */
+
+static void vma_rung_up(struct slot *slot)
+{
+	if (slot->rung < (int)ksm_scan_ladder_size - 1)
+		slot->rung++;
+}
+
+static void vma_rung_down(struct slot *slot)
+{
+	if (slot->rung > 0)
+		slot->rung--;
+}
+
+static unsigned long cal_dedup_ratio(struct slot *slot)
+{
+	unsigned long dedup_num = slot->dedup_num;
+	unsigned long ret;
+
+	if (!slot->pages_scanned || !dedup_num)
+		return 0;
+
+	ret = dedup_num * KSM_DEDUP_RATIO_SCALE / slot->pages;
+
+	if (ksm_thrash_threshold && slot->pages_merged) {
+		if (slot->pages_cowed * 100 / slot->pages_merged
+		    > ksm_thrash_threshold)
+			ret = 0;
+		else
+			ret = ret * (slot->pages_merged - slot->pages_cowed)
+			      / slot->pages_merged;
+	}
+
+	return ret;
+}
+
+static void cal_pair_dedup(u64 pair, unsigned long dup_num)
+{
+	struct slot *slot1 = &slots[pair >> 32];
+	struct slot *slot2 = &slots[(u32)pair];
+	unsigned long scanned1, scanned2, num;
+
+	scanned1 = slot_round_scanned(slot1);
+	scanned2 = slot_round_scanned(slot2);
+	if (!dup_num || !scanned1 || !scanned2)
+		return;
+
+	num = dup_num * slot1->pages / scanned1;
+	if (slot1 == slot2) {
+		slot1->dedup_num += num;
+		return;
+	}
+
+	num = num * slot2->pages / scanned2;
+	slot1->dedup_num += num;
+	slot2->dedup_num += num;
+}
+
+static void inc_hash_strength(unsigned long delta)
+{
+	hash_strength += 1 << delta;
+	if (hash_strength > HASH_STRENGTH_MAX)
+		hash_strength = HASH_STRENGTH_MAX;
+}
+
+static void dec_hash_strength(unsigned long delta)
+{
+	unsigned long change = 1 << delta;
+
+	if (hash_strength <= change + 1)
+		hash_strength = 1;
+	else
+		hash_strength -= change;
+}
+
+static void inc_hash_strength_delta(void)
+{
+	hash_strength_delta++;
+	if (hash_strength_delta > HASH_STRENGTH_DELTA_MAX)
+		hash_strength_delta = HASH_STRENGTH_DELTA_MAX;
+}
+
+static unsigned long get_current_neg_ratio(void)
+{
+	if (!rshash_pos || rshash_neg > rshash_pos)
+		return 100;
+
+	return 100 * rshash_neg / rshash_pos;
+}
+
+static u64 get_current_benefit(void)
+{
+	if (rshash_neg > rshash_pos)
+		return 0;
+
+	return (rshash_pos - rshash_neg) /
+	       (ksm_pages_scanned - ksm_pages_scanned_last);
+}
+
+static int judge_rshash_direction(void)
+{
+	u64 current_neg_ratio, stable_benefit;
+	u64 current_benefit, delta = 0;
+
+	current_neg_ratio = get_current_neg_ratio();
+
+	if (current_neg_ratio == 0) {
+		rshash_neg_cont_zero++;
+		if (rshash_neg_cont_zero > 2)
+			return GO_DOWN;
+		else
+			return STILL;
+	}
+	rshash_neg_cont_zero = 0;
+
+	if (current_neg_ratio > 90)
+		goto out;
+
+	if (ksm_scan_round % 1024 == 3)
+		goto out;
+
+	current_benefit = get_current_benefit();
+	stable_benefit = rshash_state.stable_benefit;
+
+	if (!stable_benefit)
+		goto out;
+
+	if (current_benefit > stable_benefit)
+		delta = current_benefit - stable_benefit;
+	else if (current_benefit < stable_benefit)
+		delta = stable_benefit - current_benefit;
+
+	delta = 100 * delta / stable_benefit;
+
+	if (delta > 50) {
+		rshash_cont_obscure++;
+		if (rshash_cont_obscure > 2)
+			return OBSCURE;
+		else
+			return STILL;
+	}
+
+out:
+	rshash_cont_obscure = 0;
+	return STILL;
+}
+
+static void rshash_adjust(void)
+{
+	if (ksm_pages_scanned == ksm_pages_scanned_last)
+		return;
+
+	switch (rshash_state.state) {
+	case RSHASH_STILL:
+		switch (judge_rshash_direction()) {
+		case GO_UP:
+			if (rshash_state.pre_direct == GO_DOWN)
+				hash_strength_delta = 0;
+
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.stable_benefit = get_current_benefit();
+			rshash_state.pre_direct = GO_UP;
+			break;
+
+		case GO_DOWN:
+			if (rshash_state.pre_direct == GO_UP)
+				hash_strength_delta = 0;
+
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.stable_benefit = get_current_benefit();
+			rshash_state.pre_direct = GO_DOWN;
+			break;
+
+		case OBSCURE:
+			rshash_state.stable_point = hash_strength;
+			rshash_state.turn_point_down = hash_strength;
+			rshash_state.turn_point_up = hash_strength;
+			rshash_state.turn_benefit_down = get_current_benefit();
+			rshash_state.turn_benefit_up = get_current_benefit();
+			rshash_state.lookup_window_index = 0;
+			rshash_state.state = RSHASH_TRYDOWN;
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	case RSHASH_TRYDOWN:
+		if (rshash_state.lookup_window_index++ % 5 == 0)
+			rshash_state.below_count = 0;
+
+		if (get_current_benefit() < rshash_state.stable_benefit)
+			rshash_state.below_count++;
+		else if (get_current_benefit() >
+			 rshash_state.turn_benefit_down) {
+			rshash_state.turn_point_down = hash_strength;
+			rshash_state.turn_benefit_down = get_current_benefit();
+		}
+
+		if (rshash_state.below_count >= 3 ||
+		    judge_rshash_direction() == GO_UP) {
+			hash_strength = rshash_state.stable_point;
+			hash_strength_delta = 0;
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+			rshash_state.lookup_window_index = 0;
+			rshash_state.state = RSHASH_TRYUP;
+			hash_strength_delta = 0;
+		} else {
+			dec_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+		}
+		break;
+
+	case RSHASH_TRYUP:
+		if (rshash_state.lookup_window_index++ % 5 == 0)
+			rshash_state.below_count = 0;
+
+		if (get_current_benefit() < rshash_state.stable_benefit)
+			rshash_state.below_count++;
+		else if (get_current_benefit() > rshash_state.turn_benefit_up) {
+			rshash_state.turn_point_up = hash_strength;
+			rshash_state.turn_benefit_up = get_current_benefit();
+		}
+
+		if (rshash_state.below_count >= 3 ||
+		    judge_rshash_direction() == GO_DOWN) {
+			hash_strength = rshash_state.turn_benefit_up >
+				rshash_state.turn_benefit_down ?
+				rshash_state.turn_point_up :
+				rshash_state.turn_point_down;
+
+			rshash_state.state = RSHASH_PRE_STILL;
+		} else {
+			inc_hash_strength(hash_strength_delta);
+			inc_hash_strength_delta();
+		}
+		break;
+
+	case RSHASH_NEW:
+	case RSHASH_PRE_STILL:
+		rshash_state.stable_benefit = get_current_benefit();
+		rshash_state.state = RSHASH_STILL;
+		hash_strength_delta = 0;
+		break;
+	}
+}
+
+/* the stable tree keyed again, as stable_tree_delta_hash() does */
+static void stable_rekey(void)
+{
+	unsigned long i;
+
+	map_clear(&stable_keys);
+	for (i = 0; i < nr_contents; i++) {
+		if (contents[i].merged)
+			(*map_get(&stable_keys, stable_key(&contents[i])))++;
+	}
+}
+
+static void print_round(void)
+{
+	unsigned long per_rung[KSM_SCAN_LADDER_MAX] = { 0 };
+	unsigned long i;
+
+	for (i = 0; i < nr_slots; i++)
+		per_rung[slots[i].rung]++;
+
+	printf("%8llu %10lu %10lu %10lu %8lu  ", ksm_scan_round,
+	       ksm_pages_scanned - ksm_pages_scanned_last,
+	       nr_merged * trace_rate,
+	       (nr_merged - nr_stable) * trace_rate, hash_strength);
+	for (i = 0; i < ksm_scan_ladder_size; i++)
+		printf(" %lu", per_rung[i]);
+	printf("\n");
+}
+
+static void round_update_ladder(void)
+{
+	unsigned long i, mean = 0, prev_hash_strength = hash_strength;
+	struct slot *slot;
+
+	for (i = 0; i < pairs.size; i++) {
+		if (pairs.e[i].used)
+			cal_pair_dedup(pairs.e[i].key, pairs.e[i].val);
+	}
+
+	for (i = 0; i < nr_slots; i++) {
+		slot = &slots[i];
+		slot->dedup_ratio = cal_dedup_ratio(slot);
+		mean += slot->dedup_ratio;
+	}
+	if (nr_slots)
+		mean /= nr_slots;
+
+	for (i = 0; !baseline && i < nr_slots; i++) {
+		slot = &slots[i];
+		if (slot->dedup_ratio && slot->dedup_ratio >= mean)
+			vma_rung_up(slot);
+		else if (slot->slot_scanned)
+			vma_rung_down(slot);
+	}
+
+	if (verbose)
+		print_round();
+
+	for (i = 0; i < nr_slots; i++) {
+		slot = &slots[i];
+		slot->last_scanned = slot->pages_scanned;
+		slot->slot_scanned = 0;
+		slot->pages_merged = 0;
+		slot->pages_cowed = 0;
+		slot->dedup_num = 0;
+		slot->dedup_ratio = 0;
+	}
+	map_clear(&pairs);
+	map_clear(&unstable);
+	map_clear(&unstable_keys);
+	nr_unstable = 0;
+
+	if (!baseline)
+		rshash_adjust();
+	rshash_neg = rshash_pos = 0;
+	ksm_pages_scanned_last = ksm_pages_scanned;
+
+	if (hash_level(prev_hash_strength) != hash_level(hash_strength))
+		stable_rekey();
+	if (prev_hash_strength != hash_strength)
+		hash_strength_changes++;
+}
+
+static void usage(void)
+{
+	printf("ksmsim [-hvb] [-r rate] [-m min_scan_ratio] "
+	       "[-d scan_ratio_delta]\n"
+	       "       [-t thrash_threshold] [-c memcmp_cost] "
+	       "[-s hash_strength] [-p page_size] [trace]\n\n"
+	       "-b|--baseline          Replay the captured rungs and hash "
+	       "strengths\n"
+	       "-c|--memcmp-cost=n     Cost of a page compare, in hashed words\n"
+	       "-d|--delta=n           ksm_scan_ratio_delta\n"
+	       "-h|--help              Show usage information\n"
+	       "-m|--min-scan-ratio=n  ksm_min_scan_ratio\n"
+	       "-p|--page-size=n       Page size of the traced kernel\n"
+	       "-r|--rate=n            hash_trace_rate of the trace\n"
+	       "-s|--strength=n        Initial hash strength\n"
+	       "-t|--thrash=n          ksm_thrash_threshold, in percent\n"
+	       "-v|--verbose           Show every round\n");
+}
+
+static struct option opts[] = {
+	{ "baseline", 0, NULL, 'b' },
+	{ "memcmp-cost", 1, NULL, 'c' },
+	{ "delta", 1, NULL, 'd' },
+	{ "help", 0, NULL, 'h' },
+	{ "min-scan-ratio", 1, NULL, 'm' },
+	{ "page-size", 1, NULL, 'p' },
+	{ "rate", 1, NULL, 'r' },
+	{ "strength", 1, NULL, 's' },
+	{ "thrash", 1, NULL, 't' },
+	{ "verbose", 0, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct ksm_trace_rec rec;
+	unsigned long long recs = 0;
+	FILE *fp = stdin;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "bc:d:hm:p:r:s:t:v",
+				opts, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			baseline = 1;
+			break;
+		case 'c':
+			memcmp_cost = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			ksm_scan_ratio_delta = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			ksm_min_scan_ratio = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			page_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			trace_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			hash_strength = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			ksm_thrash_threshold = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (ksm_scan_ratio_delta < 2 || !ksm_min_scan_ratio || !trace_rate ||
+	    page_size < sizeof(u32) << KSM_TRACE_LEVELS)
+		fatal("invalid parameters");
+	if (!hash_strength)
+		hash_strength = HASH_STRENGTH_FULL >> 4;
+
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	init_ladder();
+
+	if (verbose)
+		printf("%8s %10s %10s %10s %8s   slots per rung\n", "round",
+		       "scanned", "merged", "sharing", "strength");
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (!recs++)
+			ksm_scan_round = rec.round;
+		while (ksm_scan_round < rec.round) {
+			round_update_ladder();
+			ksm_scan_round++;
+		}
+
+		if (rec.type == KSM_TRACE_PAGE)
+			scan_page(&rec);
+		else if (rec.type == KSM_TRACE_COW)
+			cow_page(&rec);
+	}
+	if (recs)
+		round_update_ladder();
+
+	printf("records:               %llu\n", recs);
+	printf("slots:                 %lu\n", nr_slots);
+	printf("pages merged:          %lu\n", nr_merged * trace_rate);
+	printf("pages sharing:         %lu\n",
+	       (nr_merged - nr_stable) * trace_rate);
+	printf("hash strength:         %lu (%lu changes)\n", hash_strength,
+	       hash_strength_changes);
+
+	return 0;
+}
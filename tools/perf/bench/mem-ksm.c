@@ -0,0 +1,475 @@
+/*
+ * mem-ksm.c
+ *
+ * ksm: dedup workload generator and scorer for KSM/UKSM
+ *
+ * Maps an anonymous region with a controlled mix of duplicated, zero and
+ * unique pages, optionally keeps rewriting some of them, and samples the
+ * KSM counters until the sharing settles. Then it reports how long that
+ * took, the CPU time ksmd spent on it and what a COW fault on a merged
+ * page costs.
+ *
+ * With --record the results are saved as a baseline, with --baseline they
+ * are checked against one, and the bench fails if the merging got slower,
+ * merged less or cost ksmd more CPU per merged page than the tolerance
+ * allows. --fork checks that a child forked after merging reads back the
+ * content of every merged page, through the rmap of the shared kpages.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define KSM_SYSFS	"/sys/kernel/mm/ksm/"
+
+static const char	*size_str	= "256MB";
+static unsigned int	dup_ratio	= 50;
+static unsigned int	zero_ratio	= 10;
+static unsigned int	templates	= 16;
+static unsigned int	write_rate;
+static unsigned int	interval_ms	= 500;
+static unsigned int	timeout_sec	= 300;
+static unsigned int	settle_samples	= 6;
+static unsigned int	cow_samples	= 4096;
+static const char	*baseline_str;
+static const char	*record_str;
+static unsigned int	tolerance	= 20;
+static bool		fork_check;
+
+static const struct option options[] = {
+	OPT_STRING('s', "size", &size_str, "256MB",
+		    "Size of the anonymous region. "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_UINTEGER('d', "dup-ratio", &dup_ratio,
+		    "Percentage of pages copied from a few templates"),
+	OPT_UINTEGER('z', "zero-ratio", &zero_ratio,
+		    "Percentage of pages left zero-filled"),
+	OPT_UINTEGER('T', "templates", &templates,
+		    "Number of distinct contents of the duplicated pages"),
+	OPT_UINTEGER('w', "write-rate", &write_rate,
+		    "Duplicated pages rewritten per second, to break COW"),
+	OPT_UINTEGER('i', "interval", &interval_ms,
+		    "Sampling interval in milliseconds"),
+	OPT_UINTEGER('t', "timeout", &timeout_sec,
+		    "Give up waiting for a steady state after this many seconds"),
+	OPT_UINTEGER('S', "settle", &settle_samples,
+		    "Samples within 1% of each other that make a steady state"),
+	OPT_UINTEGER('c', "cow-samples", &cow_samples,
+		    "Number of merged pages written to time COW faults"),
+	OPT_STRING('b', "baseline", &baseline_str, "file",
+		    "Fail if the results regressed from those recorded here"),
+	OPT_STRING('R', "record", &record_str, "file",
+		    "Record the results as a baseline"),
+	OPT_UINTEGER('x', "tolerance", &tolerance,
+		    "Percentage a result may be worse than its baseline by"),
+	OPT_BOOLEAN('f', "fork", &fork_check,
+		    "Check the merged pages from a child forked after merging"),
+	OPT_END()
+};
+
+static const char * const bench_mem_ksm_usage[] = {
+	"perf bench mem ksm <options>",
+	NULL
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	BUG_ON(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long read_ksm(const char *name)
+{
+	char path[PATH_MAX];
+	unsigned long val = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%lu", &val) != 1)
+		val = 0;
+	fclose(fp);
+	return val;
+}
+
+/* the increase of a KSM counter since @base, 0 if it went down */
+static unsigned long read_ksm_delta(const char *name, unsigned long base)
+{
+	unsigned long val = read_ksm(name);
+
+	return val > base ? val - base : 0;
+}
+
+/* KsmSharing: of /proc/meminfo in kB, 0 if this kernel has none */
+static unsigned long read_meminfo_ksm(void)
+{
+	char line[128];
+	unsigned long val = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "KsmSharing: %lu kB", &val) == 1)
+			break;
+	}
+	fclose(fp);
+	return val;
+}
+
+/* utime + stime of all the ksmd threads, in seconds */
+static double ksmd_cpu(void)
+{
+	unsigned long utime, stime, ticks = 0;
+	char path[PATH_MAX], buf[512], *p;
+	struct dirent *d;
+	FILE *fp;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return 0.0;
+
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] < '0' || d->d_name[0] > '9')
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/stat", d->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (!fgets(buf, sizeof(buf), fp)) {
+			fclose(fp);
+			continue;
+		}
+		fclose(fp);
+
+		p = strchr(buf, '(');
+		if (!p || strncmp(p, "(ksmd", 5))
+			continue;
+
+		/* utime and stime are the 12th and 13th fields after comm */
+		p = strrchr(buf, ')');
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+				"%*u %*u %lu %lu", &utime, &stime) == 2)
+			ticks += utime + stime;
+	}
+	closedir(dir);
+
+	return (double)ticks / (double)sysconf(_SC_CLK_TCK);
+}
+
+static void fill_random(unsigned long *p, size_t words, unsigned int *seed)
+{
+	size_t i;
+
+	for (i = 0; i < words; i++)
+		p[i] = (unsigned long)rand_r(seed) * 0x9e3779b1UL + rand_r(seed);
+}
+
+/*
+ * Fork a child to read back the duplicated pages while they are merged: its
+ * ptes are copied from ours, all mapping the kpages. Returns the number of
+ * pages with wrong content it found, or -1 if it could not tell.
+ */
+static long fork_check_pages(char *region, char **tmpl, size_t nr_dup,
+			     long page_size)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		size_t i, bad = 0;
+
+		for (i = 0; i < nr_dup; i++)
+			if (memcmp(region + i * page_size, tmpl[i % templates],
+				   page_size))
+				bad++;
+		_exit(bad > 255 ? 255 : bad);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+struct ksm_results {
+	double settle_time;	/* s, -1 if not reached */
+	unsigned long sharing;
+	double cpu_per_page;	/* us of ksmd per page merged */
+};
+
+/* 1 if @val is worse than @base by more than the tolerance */
+static int regressed(const char *what, double val, double base, int higher)
+{
+	double limit = higher ? base * (100 + tolerance) / 100 :
+				base * (100 - tolerance) / 100;
+	int bad = higher ? val > limit : val < limit;
+
+	printf(" %14s %s: %lf, baseline %lf\n", bad ? "REGRESSED" : "ok",
+	       what, val, base);
+	return bad;
+}
+
+static int check_baseline(struct ksm_results *res)
+{
+	struct ksm_results base;
+	int bad = 0;
+	FILE *fp;
+
+	fp = fopen(baseline_str, "r");
+	if (!fp)
+		die("cannot read the baseline %s\n", baseline_str);
+	if (fscanf(fp, "%lf %lu %lf", &base.settle_time, &base.sharing,
+		   &base.cpu_per_page) != 3)
+		die("bad baseline %s\n", baseline_str);
+	fclose(fp);
+
+	if (base.settle_time >= 0) {
+		if (res->settle_time < 0) {
+			printf(" %14s steady state not reached\n", "REGRESSED");
+			bad = 1;
+		} else {
+			bad |= regressed("s to steady state",
+					 res->settle_time, base.settle_time, 1);
+		}
+	}
+	bad |= regressed("pages sharing", res->sharing, base.sharing, 0);
+	bad |= regressed("us of ksmd per merged page", res->cpu_per_page,
+			 base.cpu_per_page, 1);
+
+	return bad;
+}
+
+static void record_results(struct ksm_results *res)
+{
+	FILE *fp;
+
+	fp = fopen(record_str, "w");
+	if (!fp)
+		die("cannot write the baseline %s\n", record_str);
+	fprintf(fp, "%lf %lu %lf\n", res->settle_time, res->sharing,
+		res->cpu_per_page);
+	fclose(fp);
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+int bench_mem_ksm(int argc, const char **argv,
+		  const char *prefix __used)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t len, nr_pages, nr_dup, nr_zero, i, writes = 0;
+	unsigned long sharing0, sharing = 0, last = 0, peak = 0;
+	unsigned long meminfo0, meminfo = 0;
+	unsigned int seed = 0x5eed, settled = 0;
+	double start, t, cpu0, cpu, settle_time = -1.0;
+	double cow_total = 0.0, cow_max = 0.0, plain_total = 0.0;
+	size_t cow_done = 0, plain_done = 0;
+	struct ksm_results res;
+	long fork_bad = 0;
+	int failed = 0;
+	char **tmpl;
+	char *region;
+
+	argc = parse_options(argc, argv, options, bench_mem_ksm_usage, 0);
+
+	len = (size_t)perf_atoll((char *)size_str);
+	if ((s64)len <= 0 || dup_ratio + zero_ratio > 100 || !templates ||
+	    !interval_ms) {
+		fprintf(stderr, "Invalid parameters\n");
+		return 1;
+	}
+
+	if (access(KSM_SYSFS "run", R_OK))
+		die("No " KSM_SYSFS " in this kernel, CONFIG_KSM=y?\n");
+
+	nr_pages = len / page_size;
+	nr_dup = nr_pages * dup_ratio / 100;
+	nr_zero = nr_pages * zero_ratio / 100;
+
+	region = mmap(NULL, nr_pages * page_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+		die("mmap failed - maybe size is too large?\n");
+
+	tmpl = zalloc(templates * sizeof(*tmpl));
+	if (!tmpl)
+		die("memory allocation failed\n");
+	for (i = 0; i < templates; i++) {
+		tmpl[i] = malloc(page_size);
+		if (!tmpl[i])
+			die("memory allocation failed\n");
+		fill_random((unsigned long *)tmpl[i],
+			    page_size / sizeof(long), &seed);
+	}
+
+	/* dup pages first, then zero pages (touched), then unique ones */
+	for (i = 0; i < nr_pages; i++) {
+		char *page = region + i * page_size;
+
+		if (i < nr_dup)
+			memcpy(page, tmpl[i % templates], page_size);
+		else if (i < nr_dup + nr_zero)
+			memset(page, 0, page_size);
+		else
+			fill_random((unsigned long *)page,
+				    page_size / sizeof(long), &seed);
+	}
+
+#ifdef MADV_MERGEABLE
+	/* not needed by UKSM, which scans all anonymous areas */
+	madvise(region, nr_pages * page_size, MADV_MERGEABLE);
+#endif
+
+	sharing0 = read_ksm("pages_sharing");
+	meminfo0 = read_meminfo_ksm();
+	cpu0 = ksmd_cpu();
+	start = now();
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# %zu pages: %zu duplicated in %u contents, %zu zero\n",
+		       nr_pages, nr_dup, templates, nr_zero);
+		printf("# %10s %14s %14s %10s\n",
+		       "time(s)", "pages_sharing", "KsmSharing(kB)",
+		       "ksmd(s)");
+	}
+
+	do {
+		unsigned long target = (unsigned long)write_rate *
+				       interval_ms / 1000;
+
+		/* rewrite a few duplicated pages to break their COW */
+		for (i = 0; nr_dup && i < target; i++, writes++) {
+			char *page = region +
+				     (size_t)rand_r(&seed) % nr_dup * page_size;
+
+			page[rand_r(&seed) % page_size]++;
+		}
+
+		sleep_ms(interval_ms);
+
+		t = now() - start;
+		sharing = read_ksm_delta("pages_sharing", sharing0);
+		meminfo = read_meminfo_ksm();
+		meminfo = meminfo > meminfo0 ? meminfo - meminfo0 : 0;
+		cpu = ksmd_cpu() - cpu0;
+		if (sharing > peak)
+			peak = sharing;
+
+		if (bench_format == BENCH_FORMAT_DEFAULT)
+			printf("  %10.2lf %14lu %14lu %10.2lf\n",
+			       t, sharing, meminfo, cpu);
+
+		if (sharing && (sharing > last ? sharing - last :
+				last - sharing) * 100 <= sharing) {
+			if (++settled >= settle_samples && settle_time < 0)
+				settle_time = t;
+		} else {
+			settled = 0;
+		}
+		last = sharing;
+	} while (settle_time < 0 && t < timeout_sec);
+
+	cpu = ksmd_cpu() - cpu0;
+
+	/* rewritten pages would not match their template anymore */
+	if (fork_check && !write_rate) {
+		fork_bad = fork_check_pages(region, tmpl, nr_dup, page_size);
+		if (fork_bad)
+			failed = 1;
+	}
+
+	/* dup pages not rewritten above are the likely merged ones */
+	for (i = 0; i < nr_dup && cow_done < cow_samples; i++, cow_done++) {
+		char *page = region + (nr_dup - 1 - i) * page_size;
+		double t0 = now(), d;
+
+		page[0]++;
+		d = now() - t0;
+		cow_total += d;
+		if (d > cow_max)
+			cow_max = d;
+	}
+
+	/* the same write on pages that were never merged, for reference */
+	for (i = nr_dup + nr_zero; i < nr_pages && plain_done < cow_samples;
+	     i++, plain_done++) {
+		char *page = region + i * page_size;
+		double t0 = now();
+
+		page[0]++;
+		plain_total += now() - t0;
+	}
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		if (settle_time < 0)
+			printf(" %14s steady state not reached in %u s\n",
+			       "", timeout_sec);
+		else
+			printf(" %14lf s to steady state\n", settle_time);
+		printf(" %14lu pages sharing at the end (peak %lu)\n",
+		       sharing, peak);
+		printf(" %14lf s of ksmd CPU time\n", cpu);
+		printf(" %14zu pages rewritten meanwhile\n", writes);
+		printf(" %14lf us per COW fault on a merged page (max %lf)\n",
+		       cow_done ? cow_total / cow_done * 1e6 : 0.0,
+		       cow_max * 1e6);
+		printf(" %14lf us per write to an unmerged page\n",
+		       plain_done ? plain_total / plain_done * 1e6 : 0.0);
+		if (fork_check && !write_rate)
+			printf(" %14ld merged pages read back wrong by a child\n",
+			       fork_bad);
+		break;
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf %lu %lf %lf %lf\n", settle_time, sharing, cpu,
+		       cow_done ? cow_total / cow_done * 1e6 : 0.0,
+		       plain_done ? plain_total / plain_done * 1e6 : 0.0);
+		break;
+	default:
+		/* reaching this means there's some disaster: */
+		die("unknown format: %d\n", bench_format);
+		break;
+	}
+
+	res.settle_time = settle_time;
+	res.sharing = sharing;
+	res.cpu_per_page = sharing ? cpu / sharing * 1e6 : 0.0;
+	if (record_str)
+		record_results(&res);
+	if (baseline_str && check_baseline(&res))
+		failed = 1;
+
+	for (i = 0; i < templates; i++)
+		free(tmpl[i]);
+	free(tmpl);
+	munmap(region, nr_pages * page_size);
+
+	return failed;
+}
@@ -0,0 +1,395 @@
+/*
+ * mem-pagefault.c
+ *
+ * pagefault: page fault throughput and latency, by kind of fault
+ *
+ * For each scenario and thread count, every thread takes one fault per page
+ * of its own slice of a shared region, timing each of them. The faults are
+ * all taken in the same mm, so the threads also contend on its mmap_sem and
+ * page table locks. Reports the faults per second of all the threads and
+ * percentiles of the latency of a fault.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define KSM_SYSFS	"/sys/kernel/mm/ksm/"
+#define HPAGE_SIZE	(2UL << 20)
+
+static const char	*size_str	= "64MB";
+static const char	*threads_str	= "1,2,4";
+static const char	*modes_str	= "anon,file,cow,ksm,thp";
+static const char	*dir_str	= "/tmp";
+static unsigned int	ksm_timeout	= 60;
+
+static const struct option options[] = {
+	OPT_STRING('s', "size", &size_str, "64MB",
+		    "Size of the slice each thread faults in. "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_STRING('t', "threads", &threads_str, "1,2,4",
+		    "Comma separated thread counts to run each scenario with"),
+	OPT_STRING('m', "mode", &modes_str, "anon,file,cow,ksm,thp",
+		    "Comma separated scenarios: anon (first touch), file "
+		    "(read of a shared file mapping), cow (write after fork), "
+		    "ksm (write to merged pages), thp (first touch of "
+		    "huge pages)"),
+	OPT_STRING('d', "dir", &dir_str, "/tmp",
+		    "Directory for the file of the file scenario"),
+	OPT_UINTEGER('k', "ksm-timeout", &ksm_timeout,
+		    "Seconds to wait for ksmd to merge the region of ksm"),
+	OPT_END()
+};
+
+static const char * const bench_mem_pagefault_usage[] = {
+	"perf bench mem pagefault <options>",
+	NULL
+};
+
+enum fault_mode {
+	FAULT_ANON,
+	FAULT_FILE,
+	FAULT_COW,
+	FAULT_KSM,
+	FAULT_THP,
+	NR_FAULT_MODES
+};
+
+static const char *mode_names[NR_FAULT_MODES] = {
+	"anon", "file", "cow", "ksm", "thp",
+};
+
+struct fault_thread {
+	pthread_t thread;
+	char *base;		/* of its slice */
+	size_t nr;		/* faults to take */
+	size_t step;		/* bytes between them */
+	int write;
+	u64 *lat;		/* ns of each fault */
+	double elapsed;
+};
+
+static pthread_barrier_t start_barrier;
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+
+	BUG_ON(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *fault_worker(void *arg)
+{
+	struct fault_thread *ft = arg;
+	volatile char *p = ft->base;
+	u64 start, t0, t1;
+	size_t i;
+	char sum = 0;
+
+	pthread_barrier_wait(&start_barrier);
+
+	start = t0 = now_ns();
+	for (i = 0; i < ft->nr; i++, p += ft->step) {
+		if (ft->write)
+			*p = 1;
+		else
+			sum += *p;
+		t1 = now_ns();
+		ft->lat[i] = t1 - t0;
+		t0 = t1;
+	}
+	ft->elapsed = (double)(t0 - start) / 1e9;
+	(void)sum;
+
+	return NULL;
+}
+
+static unsigned long read_ksm(const char *name)
+{
+	char path[PATH_MAX];
+	unsigned long val = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%lu", &val) != 1)
+		val = 0;
+	fclose(fp);
+	return val;
+}
+
+/* fill the region with one content and wait for ksmd to merge most of it */
+static int ksm_prepare(char *region, size_t len, long page_size)
+{
+	unsigned long sharing0 = read_ksm("pages_sharing");
+	size_t nr_pages = len / page_size, i;
+	unsigned int waited;
+
+	for (i = 0; i < nr_pages; i++)
+		memset(region + i * page_size, 0x5a, page_size);
+
+#ifdef MADV_MERGEABLE
+	/* not needed by UKSM, which scans all anonymous areas */
+	madvise(region, len, MADV_MERGEABLE);
+#endif
+
+	for (waited = 0; waited < ksm_timeout * 10; waited++) {
+		if (read_ksm("pages_sharing") - sharing0 >= nr_pages * 9 / 10)
+			return 0;
+		usleep(100000);
+	}
+
+	fprintf(stderr, "# ksm: only %lu of %zu pages merged in %u s\n",
+		read_ksm("pages_sharing") - sharing0, nr_pages, ksm_timeout);
+	return -1;
+}
+
+/* a file of @len bytes in the page cache, mapped shared and read only */
+static char *file_prepare(size_t len)
+{
+	char path[PATH_MAX];
+	char buf[4096];
+	size_t done;
+	char *region;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/perf-bench-pagefault.XXXXXX",
+		 dir_str);
+	fd = mkstemp(path);
+	if (fd < 0)
+		die("cannot create a file in %s\n", dir_str);
+	unlink(path);
+
+	memset(buf, 0x5a, sizeof(buf));
+	for (done = 0; done < len; done += sizeof(buf))
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			die("cannot write the file in %s\n", dir_str);
+
+	region = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return region == MAP_FAILED ? NULL : region;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(enum fault_mode mode, int nr_threads, u64 *lat,
+		   size_t nr, double elapsed)
+{
+	double rate = elapsed > 0.0 ? (double)nr / elapsed : 0.0;
+
+#define PCT(p)	((double)lat[(size_t)((nr - 1) * (p))] / 1e3)
+	qsort(lat, nr, sizeof(*lat), cmp_u64);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("  %-5s %7d %12.0lf %9.2lf %9.2lf %9.2lf %9.2lf %10.2lf\n",
+		       mode_names[mode], nr_threads, rate, PCT(0.5), PCT(0.9),
+		       PCT(0.99), PCT(0.999), (double)lat[nr - 1] / 1e3);
+		break;
+	case BENCH_FORMAT_SIMPLE:
+		printf("%s %d %lf %lf %lf %lf\n", mode_names[mode], nr_threads,
+		       rate, PCT(0.5), PCT(0.99), (double)lat[nr - 1] / 1e3);
+		break;
+	default:
+		/* reaching this means there's some disaster: */
+		die("unknown format: %d\n", bench_format);
+		break;
+	}
+#undef PCT
+}
+
+static void run_one(enum fault_mode mode, int nr_threads, size_t slice)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t len = slice * nr_threads, step = page_size, nr, total;
+	struct fault_thread *threads;
+	char *region, *map = NULL;
+	int pipefd[2], i;
+	pid_t child = -1;
+	double elapsed = 0.0;
+	u64 *lat;
+
+	if (mode == FAULT_THP) {
+		/* a huge page aligned region, each fault maps a huge page */
+		step = HPAGE_SIZE;
+		slice = (slice + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+		len = slice * nr_threads;
+		map = mmap(NULL, len + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			die("mmap failed - maybe size is too large?\n");
+		region = (char *)(((unsigned long)map + HPAGE_SIZE - 1) &
+				  ~(HPAGE_SIZE - 1));
+#ifdef MADV_HUGEPAGE
+		madvise(region, len, MADV_HUGEPAGE);
+#endif
+	} else if (mode == FAULT_FILE) {
+		region = map = file_prepare(len);
+		if (!region)
+			die("mmap failed - maybe size is too large?\n");
+	} else {
+		region = map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED)
+			die("mmap failed - maybe size is too large?\n");
+	}
+
+	if (mode == FAULT_KSM && ksm_prepare(region, len, page_size)) {
+		munmap(map, len);
+		return;
+	}
+
+	if (mode == FAULT_COW) {
+		/* the child keeps the pages shared until we are done */
+		memset(region, 0x5a, len);
+		if (pipe(pipefd))
+			die("pipe failed\n");
+		child = fork();
+		if (child < 0)
+			die("fork failed\n");
+		if (!child) {
+			char c;
+
+			close(pipefd[1]);
+			while (read(pipefd[0], &c, 1) < 0 && errno == EINTR)
+				;
+			_exit(0);
+		}
+		close(pipefd[0]);
+	}
+
+	nr = slice / step;
+	total = nr * nr_threads;
+	if (!nr)
+		die("the slice of a thread is smaller than a fault\n");
+	threads = zalloc(nr_threads * sizeof(*threads));
+	lat = malloc(total * sizeof(*lat));
+	if (!threads || !lat)
+		die("memory allocation failed\n");
+
+	BUG_ON(pthread_barrier_init(&start_barrier, NULL, nr_threads + 1));
+	for (i = 0; i < nr_threads; i++) {
+		struct fault_thread *ft = &threads[i];
+
+		ft->base = region + i * slice;
+		ft->nr = nr;
+		ft->step = step;
+		ft->write = mode != FAULT_FILE;
+		ft->lat = lat + i * nr;
+		if (pthread_create(&ft->thread, NULL, fault_worker, ft))
+			die("pthread_create failed\n");
+	}
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].elapsed > elapsed)
+			elapsed = threads[i].elapsed;
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	if (child > 0) {
+		close(pipefd[1]);
+		waitpid(child, NULL, 0);
+	}
+
+	report(mode, nr_threads, lat, total, elapsed);
+
+	free(lat);
+	free(threads);
+	munmap(map, mode == FAULT_THP ? len + HPAGE_SIZE : len);
+}
+
+static int parse_modes(unsigned int *modes)
+{
+	char *str = strdup(modes_str), *tok, *save = NULL;
+	int m;
+
+	if (!str)
+		return -1;
+
+	*modes = 0;
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (m = 0; m < NR_FAULT_MODES; m++)
+			if (!strcmp(tok, mode_names[m]))
+				break;
+		if (m == NR_FAULT_MODES) {
+			free(str);
+			return -1;
+		}
+		*modes |= 1U << m;
+	}
+	free(str);
+
+	return *modes ? 0 : -1;
+}
+
+int bench_mem_pagefault(int argc, const char **argv,
+			const char *prefix __used)
+{
+	int threads[64], nr_counts = 0, i, m;
+	unsigned int modes;
+	const char *p;
+	char *end;
+	size_t slice;
+
+	argc = parse_options(argc, argv, options, bench_mem_pagefault_usage, 0);
+
+	slice = (size_t)perf_atoll((char *)size_str);
+	if ((s64)slice <= 0 || parse_modes(&modes)) {
+		fprintf(stderr, "Invalid parameters\n");
+		return 1;
+	}
+
+	for (p = threads_str; *p && nr_counts < 64; p = end) {
+		threads[nr_counts] = strtol(p, &end, 10);
+		if (end == p || threads[nr_counts] <= 0 ||
+		    (*end && *end != ',')) {
+			fprintf(stderr, "Invalid thread counts: %s\n",
+				threads_str);
+			return 1;
+		}
+		nr_counts++;
+		if (*end)
+			end++;
+	}
+
+	if ((modes & (1U << FAULT_KSM)) && access(KSM_SYSFS "run", R_OK)) {
+		fprintf(stderr, "# no " KSM_SYSFS ", skipping ksm\n");
+		modes &= ~(1U << FAULT_KSM);
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %-5s %7s %12s %9s %9s %9s %9s %10s\n", "mode",
+		       "threads", "faults/s", "p50(us)", "p90(us)", "p99(us)",
+		       "p99.9(us)", "max(us)");
+
+	for (m = 0; m < NR_FAULT_MODES; m++) {
+		if (!(modes & (1U << m)))
+			continue;
+		for (i = 0; i < nr_counts; i++)
+			run_one(m, threads[i], slice);
+	}
+
+	return 0;
+}
@@ -52,6 +52,12 @@ static struct bench_suite mem_suites[] = {
 	{ "memcpy",
 	  "Simple memory copy in various ways",
 	  bench_mem_memcpy },
+	{ "ksm",
+	  "Page merging of a synthetic dedup workload",
+	  bench_mem_ksm },
+	{ "pagefault",
+	  "Page fault throughput and latency, by kind of fault",
+	  bench_mem_pagefault },
 	suite_all,
 	{ NULL,
 	  NULL,
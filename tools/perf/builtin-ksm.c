@@ -0,0 +1,657 @@
+#include "builtin.h"
+#include "perf.h"
+
+#include "util/util.h"
+#include "util/cache.h"
+#include "util/symbol.h"
+#include "util/thread.h"
+#include "util/header.h"
+#include "util/session.h"
+
+#include "util/parse-options.h"
+#include "util/trace-event.h"
+
+#include "util/debug.h"
+
+#include <linux/list.h>
+#include <linux/hash.h>
+
+static char const		*input_name = "perf.data";
+
+static int			print_lines = 20;
+static const char		*sort_key = "merged";
+
+static bool			show_process;
+static bool			show_vma;
+static bool			show_rung;
+static bool			show_hash;
+
+#define KSMHASH_BITS		10
+#define KSMHASH_SIZE		(1UL << KSMHASH_BITS)
+
+#define KSM_MAX_RUNGS		16
+
+/*
+ * What the ksm events tell about one vma_slot, or about one mm: the
+ * slot and mm pointers recorded by the kernel are only used as IDs.
+ */
+struct ksm_stat {
+	struct list_head	hash_entry;
+	u64			key;
+	u64			mm;		/* of a slot */
+	int			rung;		/* of a slot, -1 if not seen */
+	pid_t			pid;		/* of an mm, -1 if not seen */
+	char			comm[16];
+
+	unsigned long		scanned;
+	unsigned long		merged;
+	unsigned long		cowed;
+	u64			merge_time;
+};
+
+static struct list_head		slot_table[KSMHASH_SIZE];
+static struct list_head		mm_table[KSMHASH_SIZE];
+static unsigned long		nr_slots, nr_mms;
+
+struct rung_stat {
+	unsigned long		entered;
+	unsigned long		left;
+	unsigned long		scanned;
+	unsigned long		merged;
+	unsigned long		cowed;
+};
+
+static struct rung_stat		rungs[KSM_MAX_RUNGS + 1];	/* last: unknown */
+
+/* the stages of ksm_cmp_and_merge_page, by their outcome */
+enum {
+	STAGE_TREE,		/* searching the stable and unstable trees */
+	STAGE_MERGE_STABLE,	/* merging with a stable tree page */
+	STAGE_MERGE_UNSTABLE,	/* merging two unstable tree pages */
+	STAGE_FAILED,		/* found a candidate, could not merge it */
+	STAGE_NO_MATCH,		/* inserting into the trees, nothing found */
+	STAGE_MERGE_TWO,	/* ksm_merge_two_pages() alone */
+	STAGE_DELTA_HASH,	/* rehashing the stable tree */
+	STAGE_ROUND_UPDATE,	/* updating the ladder at the end of a round */
+	NR_STAGES,
+};
+
+static const char *stage_names[NR_STAGES] = {
+	[STAGE_TREE]		= "tree search",
+	[STAGE_MERGE_STABLE]	= "merge with stable",
+	[STAGE_MERGE_UNSTABLE]	= "merge in unstable",
+	[STAGE_FAILED]		= "merge failed",
+	[STAGE_NO_MATCH]	= "no match",
+	[STAGE_MERGE_TWO]	= "merge_two_pages",
+	[STAGE_DELTA_HASH]	= "stable tree rehash",
+	[STAGE_ROUND_UPDATE]	= "round update",
+};
+
+struct stage_stat {
+	unsigned long		nr;
+	u64			total;
+	u64			max;
+};
+
+static struct stage_stat	stages[NR_STAGES];
+
+struct hash_change {
+	u64			time;
+	u32			from;
+	u32			to;
+	unsigned long		nodes;
+	u64			latency;
+};
+
+static struct hash_change	*hash_changes;
+static unsigned long		nr_hash_changes, hash_changes_size;
+
+static unsigned long		nr_rounds, nr_cowed, nr_merged, nr_scanned;
+static u64			round_last, round_total, round_max, round_min;
+static u64			first_time, last_time;
+
+static void init_tables(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < KSMHASH_SIZE; i++) {
+		INIT_LIST_HEAD(slot_table + i);
+		INIT_LIST_HEAD(mm_table + i);
+	}
+}
+
+static struct ksm_stat *ksm_stat_findnew(struct list_head *table,
+					 unsigned long *nr, u64 key)
+{
+	struct list_head *entry = table + hash_long((unsigned long)key,
+						    KSMHASH_BITS);
+	struct ksm_stat *st;
+
+	list_for_each_entry(st, entry, hash_entry) {
+		if (st->key == key)
+			return st;
+	}
+
+	st = zalloc(sizeof(*st));
+	if (!st)
+		die("zalloc");
+	st->key = key;
+	st->rung = -1;
+	st->pid = -1;
+	list_add(&st->hash_entry, entry);
+	(*nr)++;
+
+	return st;
+}
+
+#define slot_stat(key)	ksm_stat_findnew(slot_table, &nr_slots, key)
+#define mm_stat(key)	ksm_stat_findnew(mm_table, &nr_mms, key)
+
+static struct rung_stat *rung_of(struct ksm_stat *slot)
+{
+	if (slot->rung < 0 || slot->rung >= KSM_MAX_RUNGS)
+		return &rungs[KSM_MAX_RUNGS];
+	return &rungs[slot->rung];
+}
+
+static void stage_add(int stage, u64 latency)
+{
+	struct stage_stat *st = &stages[stage];
+
+	st->nr++;
+	st->total += latency;
+	if (latency > st->max)
+		st->max = latency;
+}
+
+static void process_cmp_and_merge_event(void *data, struct event *event)
+{
+	struct ksm_stat *slot, *mm;
+	int stable, unstable, merged;
+	u64 latency, tree_latency;
+
+	slot = slot_stat(raw_field_value(event, "slot", data));
+	slot->mm = raw_field_value(event, "mm", data);
+	mm = mm_stat(slot->mm);
+
+	stable = raw_field_value(event, "stable", data);
+	unstable = raw_field_value(event, "unstable", data);
+	latency = raw_field_value(event, "latency", data);
+	tree_latency = raw_field_value(event, "tree_latency", data);
+	if (tree_latency > latency)
+		tree_latency = latency;
+
+	merged = !stable || !unstable;
+
+	nr_scanned++;
+	slot->scanned++;
+	mm->scanned++;
+	rung_of(slot)->scanned++;
+
+	stage_add(STAGE_TREE, tree_latency);
+	latency -= tree_latency;
+	if (!stable)
+		stage_add(STAGE_MERGE_STABLE, latency);
+	else if (!unstable)
+		stage_add(STAGE_MERGE_UNSTABLE, latency);
+	else if (stable == -1 && unstable == -1)
+		stage_add(STAGE_NO_MATCH, latency);
+	else
+		stage_add(STAGE_FAILED, latency);
+
+	if (merged) {
+		nr_merged++;
+		slot->merged++;
+		slot->merge_time += latency;
+		mm->merged++;
+		mm->merge_time += latency;
+		rung_of(slot)->merged++;
+	}
+}
+
+static void process_cowed_event(void *data, struct event *event,
+				struct thread *thread)
+{
+	struct ksm_stat *slot, *mm;
+
+	slot = slot_stat(raw_field_value(event, "slot", data));
+	slot->mm = raw_field_value(event, "mm", data);
+	mm = mm_stat(slot->mm);
+
+	/* a COW fault runs in the context of the task, learn who owns mm */
+	if (thread) {
+		mm->pid = thread->pid;
+		strncpy(mm->comm, thread->comm ? : "", sizeof(mm->comm) - 1);
+	}
+
+	nr_cowed++;
+	slot->cowed++;
+	mm->cowed++;
+	rung_of(slot)->cowed++;
+}
+
+static void process_rung_enter_event(void *data, struct event *event)
+{
+	struct ksm_stat *slot;
+	int from, to;
+
+	slot = slot_stat(raw_field_value(event, "slot", data));
+	from = raw_field_value(event, "from", data);
+	to = raw_field_value(event, "to", data);
+
+	if (from >= 0 && from < KSM_MAX_RUNGS && from != to)
+		rungs[from].left++;
+	slot->rung = to;
+	rung_of(slot)->entered++;
+}
+
+static void process_delta_hash_event(void *data, struct event *event,
+				     u64 timestamp)
+{
+	struct hash_change *hc;
+	u64 latency = raw_field_value(event, "latency", data);
+
+	stage_add(STAGE_DELTA_HASH, latency);
+
+	if (nr_hash_changes == hash_changes_size) {
+		hash_changes_size = hash_changes_size * 2 ? : 64;
+		hash_changes = realloc(hash_changes, hash_changes_size *
+				       sizeof(*hash_changes));
+		if (!hash_changes)
+			die("realloc");
+	}
+
+	hc = &hash_changes[nr_hash_changes++];
+	hc->time = timestamp;
+	hc->from = raw_field_value(event, "from", data);
+	hc->to = raw_field_value(event, "to", data);
+	hc->nodes = raw_field_value(event, "nodes", data);
+	hc->latency = latency;
+}
+
+static void process_round_event(void *data, struct event *event,
+				u64 timestamp)
+{
+	u64 d;
+
+	stage_add(STAGE_ROUND_UPDATE, raw_field_value(event, "latency", data));
+
+	/* a round lasts from one ladder update to the next */
+	if (round_last) {
+		d = timestamp - round_last;
+		nr_rounds++;
+		round_total += d;
+		if (d > round_max)
+			round_max = d;
+		if (!round_min || d < round_min)
+			round_min = d;
+	}
+	round_last = timestamp;
+}
+
+static void
+process_raw_event(event_t *raw_event __used, void *data,
+		  int cpu __used, u64 timestamp, struct thread *thread)
+{
+	struct event *event;
+	int type;
+
+	type = trace_parse_common_type(data);
+	event = trace_find_event(type);
+	if (!event)
+		return;
+
+	if (!first_time)
+		first_time = timestamp;
+	last_time = timestamp;
+
+	if (!strcmp(event->name, "ksm_cmp_and_merge_page"))
+		process_cmp_and_merge_event(data, event);
+	else if (!strcmp(event->name, "ksm_page_cowed"))
+		process_cowed_event(data, event, thread);
+	else if (!strcmp(event->name, "ksm_merge_two_pages"))
+		stage_add(STAGE_MERGE_TWO,
+			  raw_field_value(event, "latency", data));
+	else if (!strcmp(event->name, "ksm_vma_rung_enter"))
+		process_rung_enter_event(data, event);
+	else if (!strcmp(event->name, "ksm_stable_tree_delta_hash"))
+		process_delta_hash_event(data, event, timestamp);
+	else if (!strcmp(event->name, "ksm_round_update_ladder"))
+		process_round_event(data, event, timestamp);
+}
+
+static int process_sample_event(event_t *event, struct sample_data *sample,
+				struct perf_session *session)
+{
+	struct thread *thread = perf_session__findnew(session, event->ip.pid);
+
+	if (thread == NULL) {
+		pr_debug("problem processing %d event, skipping it.\n",
+			 event->header.type);
+		return -1;
+	}
+
+	dump_printf(" ... thread: %s:%d\n", thread->comm, thread->pid);
+
+	process_raw_event(event, sample->raw_data, sample->cpu,
+			  sample->time, thread);
+
+	return 0;
+}
+
+static struct perf_event_ops event_ops = {
+	.sample			= process_sample_event,
+	.comm			= event__process_comm,
+	.ordered_samples	= true,
+};
+
+static int stat_cmp(const void *a, const void *b)
+{
+	const struct ksm_stat *l = *(const struct ksm_stat **)a;
+	const struct ksm_stat *r = *(const struct ksm_stat **)b;
+	unsigned long x, y;
+
+	if (!strcmp(sort_key, "cowed")) {
+		x = l->cowed;
+		y = r->cowed;
+	} else if (!strcmp(sort_key, "scanned")) {
+		x = l->scanned;
+		y = r->scanned;
+	} else {
+		x = l->merged;
+		y = r->merged;
+	}
+
+	if (x > y)
+		return -1;
+	else if (x < y)
+		return 1;
+	return 0;
+}
+
+static struct ksm_stat **sorted_stats(struct list_head *table,
+				      unsigned long nr)
+{
+	struct ksm_stat **array, *st;
+	unsigned long i, n = 0;
+
+	array = calloc(nr ? : 1, sizeof(*array));
+	if (!array)
+		die("calloc");
+
+	for (i = 0; i < KSMHASH_SIZE; i++)
+		list_for_each_entry(st, table + i, hash_entry)
+			array[n++] = st;
+
+	qsort(array, n, sizeof(*array), stat_cmp);
+	return array;
+}
+
+static double per_sec(unsigned long n)
+{
+	u64 span = last_time - first_time;
+
+	if (!span)
+		return 0.0;
+	return (double)n * 1e9 / (double)span;
+}
+
+static double percent(unsigned long n, unsigned long total)
+{
+	if (!total)
+		return 0.0;
+	return 100.0 * n / total;
+}
+
+static void print_processes(void)
+{
+	struct ksm_stat **array;
+	unsigned long i;
+	char buf[32];
+
+	array = sorted_stats(mm_table, nr_mms);
+
+	printf("\n%.92s\n", graph_dotted_line);
+	printf(" %-18s | %-22s | %10s | %10s | %10s | %8s\n", "mm",
+	       "comm:pid", "scanned", "merged", "cowed", "merged%");
+	printf("%.92s\n", graph_dotted_line);
+
+	for (i = 0; i < nr_mms && (print_lines < 0 || (int)i < print_lines);
+	     i++) {
+		struct ksm_stat *mm = array[i];
+
+		if (mm->pid >= 0)
+			snprintf(buf, sizeof(buf), "%s:%d", mm->comm, mm->pid);
+		else
+			snprintf(buf, sizeof(buf), "?");
+		printf(" %#-18" PRIx64 " | %-22s | %10lu | %10lu | %10lu | "
+		       "%7.2f%%\n", mm->key, buf, mm->scanned, mm->merged,
+		       mm->cowed, percent(mm->merged, mm->scanned));
+	}
+
+	printf("%.92s\n", graph_dotted_line);
+	free(array);
+}
+
+static void print_vmas(void)
+{
+	struct ksm_stat **array;
+	unsigned long i;
+
+	array = sorted_stats(slot_table, nr_slots);
+
+	printf("\n%.100s\n", graph_dotted_line);
+	printf(" %-18s | %-18s | %4s | %10s | %10s | %10s | %12s\n", "slot",
+	       "mm", "rung", "scanned", "merged", "cowed", "ns/merge");
+	printf("%.100s\n", graph_dotted_line);
+
+	for (i = 0; i < nr_slots && (print_lines < 0 || (int)i < print_lines);
+	     i++) {
+		struct ksm_stat *slot = array[i];
+
+		printf(" %#-18" PRIx64 " | %#-18" PRIx64 " | %4d | %10lu | "
+		       "%10lu | %10lu | %12" PRIu64 "\n", slot->key, slot->mm,
+		       slot->rung, slot->scanned, slot->merged, slot->cowed,
+		       slot->merged ? slot->merge_time / slot->merged : 0);
+	}
+
+	printf("%.100s\n", graph_dotted_line);
+	free(array);
+}
+
+static void print_rungs(void)
+{
+	int i;
+
+	printf("\n%.82s\n", graph_dotted_line);
+	printf(" %-7s | %10s | %10s | %10s | %10s | %10s | %8s\n", "rung",
+	       "entered", "left", "scanned", "merged", "cowed", "merged%");
+	printf("%.82s\n", graph_dotted_line);
+
+	for (i = 0; i <= KSM_MAX_RUNGS; i++) {
+		struct rung_stat *r = &rungs[i];
+
+		if (!r->entered && !r->scanned && !r->cowed)
+			continue;
+		if (i < KSM_MAX_RUNGS)
+			printf(" %-7d |", i);
+		else
+			printf(" %-7s |", "?");
+		printf(" %10lu | %10lu | %10lu | %10lu | %10lu | %7.2f%%\n",
+		       r->entered, r->left, r->scanned, r->merged, r->cowed,
+		       percent(r->merged, r->scanned));
+	}
+
+	printf("%.82s\n", graph_dotted_line);
+}
+
+static void print_hash_changes(void)
+{
+	unsigned long i;
+
+	printf("\n%.72s\n", graph_dotted_line);
+	printf(" %-14s | %-21s | %12s | %14s\n", "time(s)", "hash_strength",
+	       "stable nodes", "latency(ns)");
+	printf("%.72s\n", graph_dotted_line);
+
+	for (i = 0; i < nr_hash_changes &&
+	     (print_lines < 0 || (int)i < print_lines); i++) {
+		struct hash_change *hc = &hash_changes[i];
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), "%u -> %u", hc->from, hc->to);
+		printf(" %14.6f | %-21s | %12lu | %14" PRIu64 "\n",
+		       (double)(hc->time - first_time) / 1e9, buf,
+		       hc->nodes, hc->latency);
+	}
+
+	printf("%.72s\n", graph_dotted_line);
+}
+
+static void print_summary(void)
+{
+	int i;
+
+	printf("\nSUMMARY\n=======\n");
+	printf("Time span: %f s\n", (double)(last_time - first_time) / 1e9);
+	printf("Pages scanned: %lu (%.1f/s)\n", nr_scanned,
+	       per_sec(nr_scanned));
+	printf("Pages merged: %lu (%.1f/s)\n", nr_merged, per_sec(nr_merged));
+	printf("Merged pages COWed: %lu (%.1f/s)\n", nr_cowed,
+	       per_sec(nr_cowed));
+	if (nr_rounds)
+		printf("Rounds: %lu, %f s on average (min %f, max %f)\n",
+		       nr_rounds, (double)round_total / nr_rounds / 1e9,
+		       (double)round_min / 1e9, (double)round_max / 1e9);
+	else
+		printf("Rounds: no full round recorded\n");
+	printf("Hash strength changes: %lu\n", nr_hash_changes);
+
+	printf("\n%.72s\n", graph_dotted_line);
+	printf(" %-20s | %10s | %12s | %10s | %10s\n", "stage", "count",
+	       "total(ms)", "mean(ns)", "max(ns)");
+	printf("%.72s\n", graph_dotted_line);
+	for (i = 0; i < NR_STAGES; i++) {
+		struct stage_stat *st = &stages[i];
+
+		printf(" %-20s | %10lu | %12.3f | %10" PRIu64 " | %10" PRIu64
+		       "\n", stage_names[i], st->nr, (double)st->total / 1e6,
+		       st->nr ? st->total / st->nr : 0, st->max);
+	}
+	printf("%.72s\n", graph_dotted_line);
+}
+
+static void print_result(void)
+{
+	bool all = !show_process && !show_vma && !show_rung && !show_hash;
+
+	print_summary();
+	if (all || show_process)
+		print_processes();
+	if (all || show_vma)
+		print_vmas();
+	if (all || show_rung)
+		print_rungs();
+	if (all || show_hash)
+		print_hash_changes();
+}
+
+static int __cmd_report(void)
+{
+	int err = -EINVAL;
+	struct perf_session *session = perf_session__new(input_name, O_RDONLY,
+							 0, false, &event_ops);
+	if (session == NULL)
+		return -ENOMEM;
+
+	if (!perf_session__has_traces(session, "ksm record"))
+		goto out_delete;
+
+	init_tables();
+
+	setup_pager();
+	err = perf_session__process_events(session, &event_ops);
+	if (err != 0)
+		goto out_delete;
+	print_result();
+out_delete:
+	perf_session__delete(session);
+	return err;
+}
+
+static const char * const ksm_usage[] = {
+	"perf ksm [<options>] {record|report}",
+	NULL
+};
+
+static const struct option ksm_options[] = {
+	OPT_STRING('i', "input", &input_name, "file",
+		   "input file name"),
+	OPT_STRING('s', "sort", &sort_key, "key",
+		   "sort processes and vmas by: merged, cowed, scanned"),
+	OPT_INTEGER('l', "line", &print_lines,
+		    "show n lines of each table, -1 for all"),
+	OPT_BOOLEAN(0, "process", &show_process, "show per-process statistics"),
+	OPT_BOOLEAN(0, "vma", &show_vma, "show per-vma statistics"),
+	OPT_BOOLEAN(0, "rung", &show_rung, "show per-rung statistics"),
+	OPT_BOOLEAN(0, "hash", &show_hash, "show hash strength changes"),
+	OPT_END()
+};
+
+static const char *record_args[] = {
+	"record",
+	"-a",
+	"-R",
+	"-f",
+	"-c", "1",
+	"-e", "ksm:ksm_cmp_and_merge_page",
+	"-e", "ksm:ksm_merge_two_pages",
+	"-e", "ksm:ksm_page_cowed",
+	"-e", "ksm:ksm_vma_rung_enter",
+	"-e", "ksm:ksm_stable_tree_delta_hash",
+	"-e", "ksm:ksm_round_update_ladder",
+};
+
+static int __cmd_record(int argc, const char **argv)
+{
+	unsigned int rec_argc, i, j;
+	const char **rec_argv;
+
+	rec_argc = ARRAY_SIZE(record_args) + argc - 1;
+	rec_argv = calloc(rec_argc + 1, sizeof(char *));
+
+	if (rec_argv == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(record_args); i++)
+		rec_argv[i] = strdup(record_args[i]);
+
+	for (j = 1; j < (unsigned int)argc; j++, i++)
+		rec_argv[i] = argv[j];
+
+	return cmd_record(i, rec_argv, NULL);
+}
+
+int cmd_ksm(int argc, const char **argv, const char *prefix __used)
+{
+	argc = parse_options(argc, argv, ksm_options, ksm_usage, 0);
+
+	if (!argc)
+		usage_with_options(ksm_usage, ksm_options);
+
+	symbol__init();
+
+	if (!strncmp(argv[0], "rec", 3)) {
+		return __cmd_record(argc, argv);
+	} else if (!strncmp(argv[0], "rep", 3)) {
+		if (strcmp(sort_key, "merged") && strcmp(sort_key, "cowed") &&
+		    strcmp(sort_key, "scanned")) {
+			error("Unknown --sort key: '%s'", sort_key);
+			usage_with_options(ksm_usage, ksm_options);
+		}
+		return __cmd_report();
+	} else
+		usage_with_options(ksm_usage, ksm_options);
+
+	return 0;
+}